@@ -0,0 +1,202 @@
+; muSE benchmark suite.
+;
+; Times the core interpreter and the main libraries and writes the
+; results to stdout as JSON -
+;
+;   {"suite":"muse-bench","version":1,"benchmarks":[
+;      {"name":"cons","ops":1000000,"best_us":...,"ops_per_sec":...}, ...]}
+;
+; Each benchmark does "ops" operations of its kind and is run a few
+; times, of which the fastest run is reported so that a busy machine
+; doesn't make for a slow result. Run it with
+;
+;   muse bench.scm --run > results.json
+;
+; and compare two such runs with compare.scm. See build/posix/bench.
+
+(define bench-runs 3)
+(define bench-http-port 18731)
+(define bench-results (vector ()))
+
+(define (bench-record name ops us)
+  (let ((r (mk-hashtable)))
+    (r 'name name)
+    (r 'ops ops)
+    (r 'best_us us)
+    (r 'ops_per_sec (if (> us 0) (trunc (/ (* ops 1000000.0) us)) 0))
+    (bench-results 0 (cons r (bench-results 0)))))
+
+(define (bench-best thunk k best)
+  (if (> k 0)
+      (let ((us (time-taken-us (thunk))))
+        (bench-best thunk (- k 1) (if (and best (< best us)) best us)))
+      best))
+
+; (bench name ops thunk) runs the thunk bench-runs times and
+; records the fastest as taking ops operations.
+(define (bench name ops thunk)
+  (bench-record name ops (bench-best thunk bench-runs ())))
+
+(define (repeat n thunk)
+  (if (> n 0) (do (thunk) (repeat (- n 1) thunk)) ()))
+
+(define (count-up i n f)
+  (if (< i n) (do (f i) (count-up (+ i 1) n f)) ()))
+
+(define (build-list n acc)
+  (if (> n 0) (build-list (- n 1) (cons n acc)) acc))
+
+; Core - cons cells, gc, eval and function calls.
+
+(define (bench-cons)
+  (bench "cons" 1000000 (fn () (repeat 10 (fn () (build-list 100000 ()))))))
+
+(define (bench-gc)
+  ; Short lived garbage, several times the size of the heap.
+  (bench "gc-churn" 4000000 (fn () (repeat 400 (fn () (build-list 10000 ()))))))
+
+(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+
+(define (bench-calls)
+  ; fib 22 makes 57313 calls.
+  (bench "call-lambda" 57313 (fn () (fib 22))))
+
+(define (bench-eval)
+  (let ((expr '(+ (* 2 3) (- 10 4) (if (< 1 2) 1 0))))
+    (bench "eval" 100000 (fn () (repeat 100000 (fn () (eval expr)))))))
+
+(define (bench-map)
+  (let ((xs (build-list 10000 ())))
+    ; map is lazy, so length makes it do the work.
+    (bench "map-closure" 100000 (fn () (repeat 10 (fn () (length (map (fn (x) (+ x 1)) xs))))))))
+
+; Symbols, hashtables and vectors.
+
+(define (bench-symbols)
+  (let ((names (mk-vector 20000)))
+    (count-up 0 20000 (fn (i) (names i (format "bench-symbol-" i))))
+    ; The first run interns them and the others find them interned.
+    (bench "symbol-intern" 20000 (fn () (count-up 0 20000 (fn (i) (symbol (names i))))))))
+
+(define (bench-hashtable)
+  (bench "hashtable-put-get" 40000
+         (fn ()
+           (let ((h (mk-hashtable)))
+             (count-up 0 20000 (fn (i) (h i i)))
+             (count-up 0 20000 (fn (i) (h i)))))))
+
+(define (bench-vector)
+  (let ((v (mk-vector 100000)))
+    (bench "vector-set-get" 200000
+           (fn ()
+             (count-up 0 100000 (fn (i) (v i i)))
+             (count-up 0 100000 (fn (i) (v i)))))))
+
+(define (bench-sort)
+  (let ((xs (map (fn (i) (rand 1000000)) (build-list 50000 ()))))
+    (length xs)
+    (bench "sort" 50000 (fn () (sort xs)))))
+
+; JSON and XML.
+
+(define (json-doc n)
+  (let ((v (mk-vector n)))
+    (count-up 0 n (fn (i)
+                    (let ((h (mk-hashtable)))
+                      (h 'id i)
+                      (h 'name (format "item-" i))
+                      (h 'price (* i 1.5))
+                      (h 'tags (vector "a" "b" "c"))
+                      (v i h))))
+    v))
+
+(define (bench-json)
+  (let ((doc (json-doc 2000)))
+    (bench "json-write" 2000 (fn () (write-json (memport) doc)))
+    (bench "json-read" 2000
+           (fn ()
+             (let ((m (memport)))
+               (write-json m doc)
+               (read-json m))))))
+
+(define (xml-doc n)
+  (cons 'items (cons () (map (fn (i) (list 'item (list (cons 'id (format i))) (format "item-" i))) (build-list n ())))))
+
+(define (bench-xml)
+  (let ((doc (xml-doc 2000)))
+    (bench "xml-write" 2000 (fn () (write-xml (memport) doc)))
+    (bench "xml-read" 2000
+           (fn ()
+             (let ((m (memport)))
+               (write-xml m doc)
+               (read-xml m))))))
+
+; Ports.
+
+(define (read-lines p n)
+  (if (eof? p) n (do (read-line p) (read-lines p (+ n 1)))))
+
+(define (bench-read-line)
+  (bench "read-line" 20000
+         (fn ()
+           (let ((m (memport)))
+             (count-up 0 20000 (fn (i) (print m "line number " i)))
+             (read-lines m 0)))))
+
+; Processes.
+
+(define (ponger)
+  (let ((msg (receive)))
+    ((first msg) 'pong)
+    (ponger)))
+
+(define (bench-processes)
+  (let ((p (spawn ponger)))
+    (bench "process-post-receive" 10000
+           (fn () (repeat 5000 (fn () (p 'ping) (receive p))))))
+  (bench "process-spawn" 2000
+         (fn () (repeat 2000 (fn () (spawn (fn () ())))))))
+
+; Loopback HTTP.
+
+(define bench-http-body (string->bytes "hello"))
+
+(define (bench-serve request port keep-alive?)
+  (http-respond port 200 (list (cons 'Content-Type "text/plain")
+                               (cons 'Content-Length (bytes-size bench-http-body)))
+                T)
+  (write-bytes port bench-http-body)
+  T)
+
+(define (bench-http)
+  (spawn (fn ()
+           (with-incoming-connections-to-port bench-http-port
+             (fn (port client)
+               (spawn (fn () (http-serve port bench-serve)))
+               T))))
+  (let ((uri (format "http://127.0.0.1:" bench-http-port "/bench")))
+    (bench "http-requests" 500
+           (fn () (repeat 500 (fn () (let ((p (fetch-uri uri 'stream))) (read-line p) (close p))))))))
+
+(define (main)
+  (bench-cons)
+  (bench-gc)
+  (bench-calls)
+  (bench-eval)
+  (bench-map)
+  (bench-symbols)
+  (bench-hashtable)
+  (bench-vector)
+  (bench-sort)
+  (bench-json)
+  (bench-xml)
+  (bench-read-line)
+  (bench-processes)
+  (bench-http)
+  (let ((report (mk-hashtable)))
+    (report 'suite "muse-bench")
+    (report 'version 1)
+    (report 'benchmarks (list->vector (reverse (bench-results 0))))
+    (write-json report)
+    (print ""))
+  (exit))
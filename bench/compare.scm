@@ -0,0 +1,38 @@
+; Compares two runs of the muSE benchmark suite.
+;
+; Reads bench-baseline.json and bench-results.json, as written by
+; bench.scm, from the current folder and prints, for each benchmark,
+; the baseline and current operations per second and the change.
+; Benchmarks that got slower by more than bench-tolerance percent are
+; marked REGRESSION. Run it with
+;
+;   muse compare.scm --run
+
+(define bench-tolerance 10)
+
+(define (read-bench-file file)
+  (let ((runs (mk-hashtable))
+        (report (read-json (open-file file 'for-reading))))
+    (for-each (report 'benchmarks) (fn (b) (runs (symbol (b 'name)) b)))
+    runs))
+
+(define (change-percent base now)
+  (trunc (* 100 (- (/ now (* 1.0 base)) 1))))
+
+(define (compare-one baseline b)
+  (let ((base (baseline (symbol (b 'name))))
+        (now (b 'ops_per_sec)))
+    (if base
+        (let ((change (change-percent (base 'ops_per_sec) now)))
+          (print (b 'name) (base 'ops_per_sec) now (format change "%")
+                 (if (< change (- bench-tolerance)) "REGRESSION" ""))
+          (if (< change (- bench-tolerance)) 1 0))
+        (do (print (b 'name) "-" now "new") 0))))
+
+(define (main)
+  (let ((baseline (read-bench-file "bench-baseline.json"))
+        (results (read-json (open-file "bench-results.json" 'for-reading))))
+    (print "benchmark baseline-ops/s current-ops/s change")
+    (let ((regressions (reduce + 0 (vector->list (map (fn (b) (compare-one baseline b)) (results 'benchmarks))))))
+      (print "regressions:" regressions)))
+  (exit))
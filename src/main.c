@@ -21,6 +21,83 @@ static const char *k_args_attach_switch				= "--attach";
 static const char *k_args_run_switch                = "--run";
 static const muse_char *k_main_function_name		= L"main";
 static const muse_char *k_program_string_name		= L"*program*";
+static const char *k_parameters_variable			= "MUSE_PARAMETERS";
+
+/**
+ * The names by which parameters can be given in the MUSE_PARAMETERS
+ * environment variable.
+ */
+static const struct { const char *name; int parameter; } k_parameter_names[] =
+{
+	{ "heap-size",					MUSE_HEAP_SIZE					},
+	{ "grow-heap-threshold",		MUSE_GROW_HEAP_THRESHOLD		},
+	{ "stack-size",					MUSE_STACK_SIZE					},
+	{ "max-symbols",				MUSE_MAX_SYMBOLS				},
+	{ "discard-doc",				MUSE_DISCARD_DOC				},
+	{ "pretty-print",				MUSE_PRETTY_PRINT				},
+	{ "tab-size",					MUSE_TAB_SIZE					},
+	{ "default-attention",			MUSE_DEFAULT_ATTENTION			},
+	{ "enable-trace",				MUSE_ENABLE_TRACE				},
+	{ "generational-gc",			MUSE_GENERATIONAL_GC			},
+	{ "gc-slice-us",				MUSE_GC_SLICE_US				},
+	{ "gc-mark-threads",			MUSE_GC_MARK_THREADS			},
+	{ "heap-shrink-collections",	MUSE_HEAP_SHRINK_COLLECTIONS	},
+	{ "heap-shrink-threshold",		MUSE_HEAP_SHRINK_THRESHOLD		},
+	{ "compile-lambdas",			MUSE_COMPILE_LAMBDAS			},
+	{ "shared-locals",				MUSE_SHARED_LOCALS				},
+	{ "http-idle-timeout-us",		MUSE_HTTP_IDLE_TIMEOUT_US		},
+	{ "http-max-requests",			MUSE_HTTP_MAX_REQUESTS			},
+	{ "http-pool-max-idle",			MUSE_HTTP_POOL_MAX_IDLE			},
+	{ "http-pool-idle-timeout-us",	MUSE_HTTP_POOL_IDLE_TIMEOUT_US	},
+	{ NULL,							MUSE_END_OF_LIST				}
+};
+
+/**
+ * Fills in \p parameters for muse_init_env() from the MUSE_PARAMETERS
+ * environment variable, which lists name=value pairs separated by commas
+ * or spaces, such as "generational-gc=1,heap-size=65536". Returns NULL if
+ * the variable isn't set. Unknown names are reported and left out.
+ */
+static const int *read_parameters( int parameters[2*MUSE_NUM_PARAMETER_NAMES+1] )
+{
+	const char *spec = getenv( k_parameters_variable );
+	int n = 0;
+
+	if ( spec == NULL )
+		return NULL;
+
+	while ( *spec )
+	{
+		size_t len = strcspn( spec, ", " );
+		const char *eq = memchr( spec, '=', len );
+
+		if ( len > 0 )
+		{
+			int i;
+
+			for ( i = 0; k_parameter_names[i].name; ++i )
+			{
+				if ( eq && (size_t)(eq - spec) == strlen(k_parameter_names[i].name) && strncmp( spec, k_parameter_names[i].name, eq - spec ) == 0 )
+					break;
+			}
+
+			if ( k_parameter_names[i].name && n < 2*MUSE_NUM_PARAMETER_NAMES )
+			{
+				parameters[n++] = k_parameter_names[i].parameter;
+				parameters[n++] = atoi( eq + 1 );
+			}
+			else
+				fprintf( stderr, "muse: Unknown parameter '%.*s' in %s.\n", (int)len, spec, k_parameters_variable );
+		}
+
+		spec += len;
+		if ( *spec )
+			++spec;
+	}
+
+	parameters[n] = MUSE_END_OF_LIST;
+	return parameters;
+}
 
 /**
  * Creates an executable from the given set of source files.
@@ -294,7 +371,8 @@ static muse_cell fn_repl( muse_env *env, args_t *context, muse_cell args )
  *
  *		Creates an executable "execfile" of the given source files.
  *		When this executable is run, the source files attached to
- *		it will automatically be loaded.
+ *		it will automatically be loaded. Images written by compile-file
+ *		can be given in place of source files, and load without parsing.
  *		@see muSEexec_check() for details about identifying such source code.
  *
  * B)	fullpath-to-muse/muse
@@ -310,11 +388,15 @@ static muse_cell fn_repl( muse_env *env, args_t *context, muse_cell args )
  * If the appended source code has a function called "main", it is invoked with
  * a list of command line argument strings supplied to the executable. If no such
  * main function is defined, it simply starts the REPL.
+ *
+ * In all cases, the environment is created with the parameters given in the
+ * MUSE_PARAMETERS environment variable, if it is set. @see read_parameters()
  */
 int main( int argc, char **argv )
 {
 	char execpath[1024];
-	muse_env *env = muse_init_env(NULL);
+	int parameters[2*MUSE_NUM_PARAMETER_NAMES+1];
+	muse_env *env = muse_init_env( read_parameters(parameters) );
 	
 	get_execpath( env, argv[0], execpath, 1024 );
 
@@ -40,6 +40,19 @@ const char *g_muse_typenames[] =
 	"MUSE_LAZY_CELL"
 };
 
+/**
+ * Incremental collection does a slice of work every MUSE_GC_SLICE_CELLS
+ * allocations and sweeps MUSE_GC_SWEEP_PAGE_CELLS cells (a multiple of 8)
+ * each time the free list drains.
+ */
+enum { MUSE_GC_SLICE_CELLS = 1024, MUSE_GC_SWEEP_PAGE_CELLS = 4096 };
+
+/**
+ * Heaps smaller than this are marked by a single thread even if
+ * MUSE_GC_MARK_THREADS asks for more. Starting threads isn't free.
+ */
+enum { MUSE_PARALLEL_MARK_MIN_CELLS = 1 << 20 };
+
 static void init_stack( muse_stack *s, int size )
 {
 	s->size = size;
@@ -75,6 +88,45 @@ static muse_boolean realloc_stack( muse_stack *s, int new_size )
 		return MUSE_TRUE;
 }
 
+static void init_symbol_table( muse_symbol_table_t *t, int min_symbols )
+{
+	int capacity = 16;
+
+	while ( capacity < 2 * min_symbols )
+		capacity *= 2;
+
+	t->slots		= (muse_symbol_slot_t*)calloc( capacity, sizeof(muse_symbol_slot_t) );
+	t->capacity		= capacity;
+	t->count		= 0;
+	t->old_slots	= NULL;
+	t->old_capacity	= 0;
+	t->old_pos		= 0;
+}
+
+static void destroy_symbol_table( muse_symbol_table_t *t )
+{
+	free( t->slots );
+	free( t->old_slots );
+	memset( t, 0, sizeof(muse_symbol_table_t) );
+}
+
+static void init_finalizers( muse_finalizers_t *f )
+{
+	init_stack( &f->texts, 1024 );
+	init_stack( &f->objects, 256 );
+	init_stack( &f->destructors, 16 );
+}
+
+static void destroy_finalizers( muse_finalizers_t *f )
+{
+	destroy_stack( &f->texts );
+	destroy_stack( &f->objects );
+	destroy_stack( &f->destructors );
+	free( f->stats );
+	f->stats = NULL;
+	f->num_stats = f->stats_capacity = 0;
+}
+
 static void init_heap( muse_env *env, muse_heap *heap, int heap_size )
 {
 	heap_size				= (heap_size + 7) & ~7;
@@ -85,6 +137,20 @@ static void init_heap( muse_env *env, muse_heap *heap, int heap_size )
 	heap->marks				= (unsigned char *)calloc( heap_size >> 3, 1 );
 	heap->keep				= (unsigned char *)calloc( heap_size >> 3, 1 );
 
+	if ( env->parameters[MUSE_GC_SLICE_US] > 0 )
+	{
+		heap->gc_countdown	= MUSE_GC_SLICE_CELLS;
+		init_stack( &heap->grey, 1024 );
+	}
+	else if ( env->parameters[MUSE_GENERATIONAL_GC] )
+	{
+		heap->old			= (unsigned char *)calloc( heap_size >> 3, 1 );
+		init_stack( &heap->remembered, 1024 );
+	}
+
+	if ( env->parameters[MUSE_GC_MARK_THREADS] > 1 && !heap->grey.bottom )
+		init_stack( &heap->grey, 1024 );
+
 	/* Initialize free list */
 	{
 		int i, i_end;
@@ -106,6 +172,12 @@ static void destroy_heap( muse_heap *heap )
 		heap->size_cells = 0;
 		free(heap->marks);
 		free(heap->keep);
+		free(heap->old);
+		heap->old = NULL;
+		destroy_stack( &heap->remembered );
+		destroy_stack( &heap->grey );
+		heap->gc_phase = MUSE_GC_IDLE;
+		heap->gc_countdown = 0;
 		heap->free_cells = 0;
 		heap->free_cell_count = 0;
 	}
@@ -123,14 +195,30 @@ static unsigned char *crealloc( unsigned char *mem, size_t orig_size, size_t new
 	return mem2;
 }
 
-static muse_boolean grow_heap( muse_heap *heap, int new_size )
+static void report_gc_event( muse_env *env, muse_gc_stats_t *stats );
+static void forget_timeouts( muse_env *env, muse_process_frame_t *p );
+static void unlink_process( muse_process_frame_t *process );
+
+static muse_boolean grow_heap( muse_env *env, int new_size )
 {
+	muse_heap *heap = _heap();
+	muse_gc_stats_t stats;
+
 	new_size = (new_size + 7) & ~7;
 	
 	fprintf(stderr, "\n(growing heap to %d)\n", new_size);
 	if ( new_size <= heap->size_cells )
 		return MUSE_TRUE;
 
+	/* Cells beyond the shrink limit that are free will be 
+	collected into the free list by the next collection. */
+	heap->shrink_limit = 0;
+
+	memset( &stats, 0, sizeof(stats) );
+	stats.event				= MUSE_GC_HEAP_GROWN;
+	stats.heap_size_before	= heap->size_cells;
+	stats.pause_us			= muse_elapsed_us(env->timer);
+
 	{
 		muse_cell_data *p = (muse_cell_data*)realloc( heap->cells, new_size * sizeof(muse_cell_data) );
 		if ( p )
@@ -142,6 +230,8 @@ static muse_boolean grow_heap( muse_heap *heap, int new_size )
 				heap->cells = p;
 				heap->marks = m;
 				heap->keep = k;
+				if ( heap->old )
+					heap->old = crealloc( heap->old, heap->size_cells >> 3, new_size >> 3 );
 
 				/* Collect the newly allocated cells into the free list. */				
 				{
@@ -160,6 +250,8 @@ static muse_boolean grow_heap( muse_heap *heap, int new_size )
 					heap->size_cells = new_size;
 				}
 				
+				stats.pause_us = muse_elapsed_us(env->timer) - stats.pause_us;
+				report_gc_event( env, &stats );
 				return MUSE_TRUE;
 			}
 			else
@@ -237,7 +329,18 @@ static void init_parameters( muse_env *env, const int *parameters )
 		0,		/* MUSE_ENABLE_OBJC */
 		0,		/* MUSE_OWN_OBJC_AUTORELEASE_POOL */
 #endif
-		MUSE_TRUE	/* MUSE_ENABLE_TRACE */
+		MUSE_TRUE,	/* MUSE_ENABLE_TRACE */
+		MUSE_FALSE,	/* MUSE_GENERATIONAL_GC */
+		0,		/* MUSE_GC_SLICE_US */
+		0,		/* MUSE_GC_MARK_THREADS */
+		0,		/* MUSE_HEAP_SHRINK_COLLECTIONS */
+		25,		/* MUSE_HEAP_SHRINK_THRESHOLD */
+		MUSE_TRUE,	/* MUSE_COMPILE_LAMBDAS */
+		MUSE_FALSE,	/* MUSE_SHARED_LOCALS */
+		15000000,	/* MUSE_HTTP_IDLE_TIMEOUT_US */
+		100,	/* MUSE_HTTP_MAX_REQUESTS */
+		8,		/* MUSE_HTTP_POOL_MAX_IDLE */
+		30000000	/* MUSE_HTTP_POOL_IDLE_TIMEOUT_US */
 	};
 
 	/* Initialize default values. */
@@ -280,11 +383,8 @@ MUSEAPI muse_env *muse_init_env( const int *parameters )
 	
 	init_heap( env, &env->heap, env->parameters[MUSE_HEAP_SIZE] );
 	init_stack( &env->symbol_stack, env->parameters[MUSE_MAX_SYMBOLS] );
-	
-	/* The symbol stack is not really a stack. Its an array of buckets 
-	containing lists of symbols and is of fixed size. We use a hashing
-	algorithm to uniquify a symbol. */
-	env->symbol_stack.top = env->symbol_stack.bottom + env->symbol_stack.size;
+	init_symbol_table( &env->symbol_table, env->parameters[MUSE_MAX_SYMBOLS] );
+	init_finalizers( &env->finalizers );
 
 	/* Start a time reference point. */
 	env->timer = muse_tick();
@@ -294,7 +394,7 @@ MUSEAPI muse_env *muse_init_env( const int *parameters )
 		SAVE_STACK_POINTER( saved_sp );
 
 		{
-			muse_process_frame_t *p = create_process( env, env->parameters[MUSE_DEFAULT_ATTENTION], MUSE_NIL, saved_sp );
+			muse_process_frame_t *p = create_process( env, env->parameters[MUSE_DEFAULT_ATTENTION], MUSE_NIL, saved_sp, 0 );
 			env->current_process = p;
 			init_process_mailbox( p );
 			prime_process( p );
@@ -322,9 +422,39 @@ MUSEAPI muse_env *muse_init_env( const int *parameters )
 	env->parameters[MUSE_ENABLE_OBJC] = MUSE_FALSE;
 #endif
 	
+	muse_snapshot_base(env);
 	return env;
 }
 
+/**
+ * Records the value and property list that every symbol has right now.
+ * Snapshots written by \ref fn_save_snapshot "save-snapshot" leave out
+ * symbols that still have what was recorded, and refer to the recorded
+ * values by the names of their symbols instead of writing them out. That
+ * is how native functions, which can't be written to a file, get into a
+ * snapshot. muse_init_env() calls this once the builtins are defined.
+ * If you define native functions of your own, call it again afterwards
+ * so that values referring to them can be snapshotted too.
+ */
+MUSEAPI void muse_snapshot_base( muse_env *env )
+{
+	muse_stack *base = &env->snapshot_base;
+	muse_stack *ss = _symstack();
+	int n = (int)(ss->top - ss->bottom);
+	int i;
+
+	if ( base->size < 2 * n )
+		realloc_stack( base, 2 * n );
+
+	base->top = base->bottom;
+	for ( i = 0; i < n; ++i )
+	{
+		muse_cell sym = ss->bottom[i];
+		*(base->top++) = _symval(sym);
+		*(base->top++) = muse_symbol_plist( env, sym );
+	}
+}
+
 static void cleanup_slots( muse_env *env )
 {
 	// Do slot cleanup in reverse order of
@@ -352,6 +482,12 @@ MUSEAPI void muse_destroy_env( muse_env *env )
 	/* Deallocate objc pool if enabled. */
 	destroy_objc_bridge(env);
 #endif
+
+	/* Stops the profiler's timer, if it is running. */
+	muse_destroy_profiler(env);
+
+	/* Other environments can't send us anything from now on. */
+	muse_destroy_workers(env);
 	
 	/* Mark all processes as dead. */
 	{
@@ -360,6 +496,7 @@ MUSEAPI void muse_destroy_env( muse_env *env )
 		do
 		{
 			p->state_bits = MUSE_PROCESS_DEAD;
+			forget_timeouts( env, p );
 			p = p->next;
 		}
 		while ( p != cp );
@@ -371,7 +508,16 @@ MUSEAPI void muse_destroy_env( muse_env *env )
 	muse_tock(env->timer);
 	free(env->builtin_symbols);
 	env->builtin_symbols = NULL;
+	muse_destroy_timers( env );
+	muse_destroy_cstacks( env );
+	muse_destroy_prop_cache( env );
+	muse_destroy_regexp_cache( env );
+	muse_destroy_plist_cache( env );
 	destroy_stack( &env->symbol_stack );
+	destroy_stack( &env->snapshot_base );
+	destroy_symbol_table( &env->symbol_table );
+	destroy_finalizers( &env->finalizers );
+	muse_destroy_text_storage( env );
 	destroy_heap( &env->heap );
 	free( env->parameters );
 	free( env->slots );
@@ -468,6 +614,16 @@ MUSEAPI void muse_set_slot_cleanup_proc( muse_env *env, int slotid, muse_slot_cl
  */
 MUSEAPI muse_cell muse_cons( muse_env *env, muse_cell head, muse_cell tail )
 {
+	if ( env->heap.gc_countdown > 0 && --env->heap.gc_countdown == 0 )
+	{
+		/* Time for a slice of incremental collection. */
+		int sp = _spos();
+		_spush(head);
+		_spush(tail);
+		muse_gc_step(env);
+		_unwind(sp);
+	}
+
 	if ( env->heap.free_cells == MUSE_NIL )
 	{
 		/* Make sure that the given head and tail
@@ -483,13 +639,28 @@ MUSEAPI muse_cell muse_cons( muse_env *env, muse_cell head, muse_cell tail )
 		if ( env->heap.free_cells == MUSE_NIL )
 		{
 			fprintf( stderr, "\t\t\tNo free cells!\n" );
-			grow_heap( &env->heap, env->heap.size_cells * 2 );
+			grow_heap( env, env->heap.size_cells * 2 );
 		}
 	}
 
 	{
 		muse_cell c = _takefreecell();
 		_setht( c, head, tail );
+
+		env->current_process->cells_allocated++;
+		env->gc_telemetry.cells_allocated++;
+
+		if ( env->heap.gc_phase == MUSE_GC_MARKING )
+		{
+			/* Cells allocated during marking survive the cycle, 
+			but what they refer to still needs to be traced. The new
+			cell itself can't go on the grey stack because it is 
+			often retyped right away - as an int, symbol, etc. */
+			_mark(c);
+			muse_shade( env, _quq(head) );
+			muse_shade( env, _quq(tail) );
+		}
+
 		_spush(c);
 		return c;
 	}
@@ -723,9 +894,12 @@ MUSEAPI size_t muse_trace_report( muse_env *env, size_t numchars, muse_char *buf
 	return chars;
 }
 
-static void add_special( muse_env *env, muse_cell special )
+static void add_special( muse_stack *s, muse_cell special )
 {
-	_lpush( _cons( special, 0 ), &env->specials );
+	if ( s->top - s->bottom >= s->size )
+		realloc_stack( s, 2 * s->size );
+
+	*(s->top++) = special;
 }
 
 /**
@@ -736,8 +910,8 @@ static void add_special( muse_env *env, muse_cell special )
  * stores null characters in it. You can subsequently
  * change the contents of the text cell.
  * 
- * @internal The cell is also placed on the specials list
- * so that the memory required to hold the cell can be
+ * @internal The cell is also placed on the text finalizers
+ * list so that the memory required to hold the cell can be
  * destroyed when the text cell is no longer needed and is
  * garbage collected.
  */ 
@@ -746,7 +920,7 @@ MUSEAPI muse_cell muse_mk_text( muse_env *env, const muse_char *start, const mus
 	muse_cell c			= _setcellnct( _cons( 0, 0 ), MUSE_TEXT_CELL );
 	muse_cell_data *d	= _ptr(c);
 	
-	d->text.start		= (muse_char *)malloc( (end - start + 1) * sizeof(muse_char) );
+	d->text.start		= muse_text_alloc( env, (int)(end - start) );
 	d->text.end			= d->text.start + (end - start);
 	*(d->text.end)		= 0;
 
@@ -757,7 +931,7 @@ MUSEAPI muse_cell muse_mk_text( muse_env *env, const muse_char *start, const mus
 		memcpy( d->text.start, start, sizeof(muse_char) * (end - start) );
 	}
 
-	add_special(env,c);
+	add_special( &env->finalizers.texts, c );
 		
 	return c;
 }
@@ -772,10 +946,11 @@ MUSEAPI muse_cell muse_mk_text_utf8( muse_env *env, const char *start, const cha
 	muse_text_cell *t	= &_ptr(c)->text;
 	int len				= (int)(end - start);
 
-	t->start			= (muse_char*)calloc( muse_unicode_size(start, len), 1 );
+	t->start			= muse_text_alloc( env, len );
 	t->end				= t->start + muse_utf8_to_unicode( t->start, len, start, len );
+	*(t->end)			= 0;
 
-	add_special(env,c);
+	add_special( &env->finalizers.texts, c );
 	
 	return c;
 }
@@ -818,6 +993,20 @@ MUSEAPI muse_cell muse_mk_nativefn( muse_env *env, muse_nativefn_t fn, void *con
 	return c;
 }
 
+/**
+ * Creates a native function cell for a function that takes its
+ * arguments in an array, as described by \p info. The function can be
+ * used like any other native function. muse_apply() evaluates the
+ * arguments straight into the array and C code that calls the
+ * cell's muse_nativefn_t with an argument list still works.
+ *
+ * @see muse_argv_nativefn_t
+ */
+MUSEAPI muse_cell muse_mk_argv_nativefn( muse_env *env, const muse_argv_nativefn_info_t *info )
+{
+	return _mk_nativefn( muse_argv_nativefn_adapter, (void*)info );
+}
+
 /**
  * A destructor is a native function that also gets
  * called with no arguments when the function is 
@@ -826,48 +1015,109 @@ MUSEAPI muse_cell muse_mk_nativefn( muse_env *env, muse_nativefn_t fn, void *con
 MUSEAPI muse_cell muse_mk_destructor( muse_env *env, muse_nativefn_t fn, void *context )
 {
 	muse_cell f = _mk_nativefn( fn, context );
-	add_special(env, f);
+	add_special( &env->finalizers.destructors, f );
 	return f;
 }
 
+/**
+ * Moving a larger table's slots in one go would stall the
+ * interning of a symbol. This many old slots are moved per insertion
+ * instead, which finishes well before the new table is half full.
+ */
+enum { MUSE_SYMBOL_MOVE_STEP = 16 };
+
+static int symbol_slot( muse_int hash, int capacity )
+{
+	unsigned int h = (unsigned int)(hash ^ (hash >> 32)) * 2654435761u;
+	return (int)((h ^ (h >> 16)) & (unsigned int)(capacity - 1));
+}
+
+static muse_cell find_symbol_slot( const muse_symbol_slot_t *slots, int capacity, muse_int hash, const muse_char *start, int length )
+{
+	int i = symbol_slot( hash, capacity );
+
+	for ( ; slots[i].symbol; i = (i + 1) & (capacity - 1) )
+	{
+		const muse_symbol_slot_t *e = slots + i;
+
+		if ( e->hash == hash && e->length == length && memcmp( e->name, start, length * sizeof(muse_char) ) == 0 )
+			return e->symbol;
+	}
+
+	return MUSE_NIL;
+}
+
+static void put_symbol_slot( muse_symbol_slot_t *slots, int capacity, const muse_symbol_slot_t *e )
+{
+	int i = symbol_slot( e->hash, capacity );
+
+	while ( slots[i].symbol )
+		i = (i + 1) & (capacity - 1);
+
+	slots[i] = *e;
+}
+
+/**
+ * Moves up to \p n slots of the old table into the current one
+ * and releases the old table once they have all been moved.
+ */
+static void move_symbol_slots( muse_symbol_table_t *t, int n )
+{
+	while ( n-- > 0 && t->old_pos < t->old_capacity )
+	{
+		const muse_symbol_slot_t *e = t->old_slots + t->old_pos++;
+
+		if ( e->symbol )
+			put_symbol_slot( t->slots, t->capacity, e );
+	}
+
+	if ( t->old_pos >= t->old_capacity )
+	{
+		free( t->old_slots );
+		t->old_slots = NULL;
+		t->old_capacity = t->old_pos = 0;
+	}
+}
+
+static void add_symbol_slot( muse_symbol_table_t *t, const muse_symbol_slot_t *e )
+{
+	if ( t->old_slots )
+		move_symbol_slots( t, MUSE_SYMBOL_MOVE_STEP );
+
+	if ( 2 * (t->count + 1) > t->capacity )
+	{
+		/* The last move is always complete by now, but finish it
+		just in case so that there are never more than two tables. */
+		if ( t->old_slots )
+			move_symbol_slots( t, t->old_capacity );
+
+		t->old_slots	= t->slots;
+		t->old_capacity	= t->capacity;
+		t->old_pos		= 0;
+		t->capacity		*= 2;
+		t->slots		= (muse_symbol_slot_t*)calloc( t->capacity, sizeof(muse_symbol_slot_t) );
+	}
+
+	put_symbol_slot( t->slots, t->capacity, e );
+	t->count++;
+}
+
 static muse_cell lookup_symbol( muse_env *env, const muse_char *start, const muse_char *end, muse_int *out_hash )
 {
+	muse_symbol_table_t *t = &env->symbol_table;
 	muse_int hash = muse_hash_text( start, end, MUSE_SYMBOL_CELL );
-	
-	muse_stack *ss = _symstack();
+	int length = (int)(end - start);
+	muse_cell sym;
 	
 	if ( out_hash )
 		*out_hash = hash;
 
-	/* The symbols are allocated over a set of buckets according to 
-		their hashes. All symbols with the same hash are assigned to the
-		same bucket, which essentially contains a linear linked list of
-		symbols. After finding the bucket, we just do a linear search
-		through the symbols in the list to find the one that matches,
-		if there is one. */
-	{
-		int bucket = (int)(((hash % ss->size) + ss->size) % ss->size);
-		muse_cell slist = ss->bottom[bucket];
-		
-		while ( slist )
-		{
-			muse_cell considering = _next(&slist);
-			muse_cell symdef = _head(_tail(considering));
-			
-			if ( _ptr(_head(symdef))->i == hash )
-			{
-				/* Maybe found. */
-				muse_text_cell t = _ptr(_tail(symdef))->text;
-				if ( (t.end - t.start) == (end - start) && wcscmp( t.start, start ) == 0 )
-				{
-					/* Found. */
-					return considering;
-				}
-			}
-		}
-		
-		return MUSE_NIL;
-	}
+	sym = find_symbol_slot( t->slots, t->capacity, hash, start, length );
+
+	if ( !sym && t->old_slots )
+		sym = find_symbol_slot( t->old_slots, t->old_capacity, hash, start, length );
+	
+	return sym;
 }
 
 /**
@@ -889,26 +1139,44 @@ MUSEAPI muse_cell muse_intern_symbol( muse_env *env, muse_cell sym, int local_ix
 
 		do
 		{
-			/* Make sure we have enough storage for defined symbols 
-			in each process. */
-			if ( local_ix >= p->locals.size )
+			/* Processes sharing the main process' locals see
+			the value given to it there. */
+			if ( !p->shared_locals )
 			{
-				muse_assert( local_ix < 2 * p->locals.size );
-				if ( realloc_stack( &(p->locals), 2 * p->locals.size ) == MUSE_FALSE )
-					muse_raise_error( env, MUSE_NIL, MUSE_NIL );
+				/* Make sure we have enough storage for defined symbols 
+				in each process. */
+				if ( local_ix >= p->locals.size )
+				{
+					muse_assert( local_ix < 2 * p->locals.size );
+					if ( realloc_stack( &(p->locals), 2 * p->locals.size ) == MUSE_FALSE )
+						muse_raise_error( env, MUSE_NIL, MUSE_NIL );
+				}
+				
+				p->locals.bottom[local_ix] = sym;
+				p->locals.top = p->locals.bottom + env->num_symbols;
 			}
-			
-			p->locals.bottom[local_ix] = sym;
-			p->locals.top = p->locals.bottom + env->num_symbols;
 			p = p->next;
 		}
 		while ( p != cp );
 	}
 
-	/* Add the symbol to its hash bucket. */
+	/* Keep the symbol alive. */
+	add_special( ss, sym );
+
+	/* Named symbols can be looked up by their names. Anonymous
+	ones are reachable only through their references. */
 	{
-		int bucket = (int)(((hash % ss->size) + ss->size) % ss->size);
-		ss->bottom[bucket] = _cons( sym, ss->bottom[bucket] );
+		muse_cell name = _tail(_head(_tail(sym)));
+
+		if ( name )
+		{
+			muse_symbol_slot_t e;
+			e.hash		= hash;
+			e.name		= _ptr(name)->text.start;
+			e.length	= (int)(_ptr(name)->text.end - e.name);
+			e.symbol	= sym;
+			add_symbol_slot( &env->symbol_table, &e );
+		}
 	}
 
 	/* Set the head of the symbol to refer to the local index */
@@ -917,6 +1185,84 @@ MUSEAPI muse_cell muse_intern_symbol( muse_env *env, muse_cell sym, int local_ix
 	return sym;
 }
 
+static int override_slot( int ix, int capacity )
+{
+	return (int)(((unsigned int)ix * 2654435761u) & (unsigned int)(capacity - 1));
+}
+
+/**
+ * Returns the value of the local \p ix in a process that shares the
+ * main process' locals - its own value if it has set one and the main
+ * process' value otherwise.
+ */
+muse_cell muse_shared_local( muse_process_frame_t *p, int ix )
+{
+	const muse_local_overrides_t *o = &p->overrides;
+
+	if ( o->count > 0 )
+	{
+		int i = override_slot( ix, o->capacity );
+
+		for ( ; o->keys[i]; i = (i + 1) & (o->capacity - 1) )
+		{
+			if ( o->keys[i] == ix + 1 )
+				return o->values[i];
+		}
+	}
+
+	return p->shared_locals->bottom[ix];
+}
+
+static void put_override( muse_local_overrides_t *o, int key, muse_cell value )
+{
+	int i = override_slot( key - 1, o->capacity );
+
+	while ( o->keys[i] && o->keys[i] != key )
+		i = (i + 1) & (o->capacity - 1);
+
+	if ( !o->keys[i] )
+	{
+		o->keys[i] = key;
+		o->count++;
+	}
+
+	o->values[i] = value;
+}
+
+static void resize_overrides( muse_local_overrides_t *o, int capacity )
+{
+	muse_local_overrides_t old = *o;
+	int i;
+
+	o->capacity	= capacity;
+	o->count	= 0;
+	o->keys		= (int*)calloc( capacity, sizeof(int) );
+	o->values	= (muse_cell*)calloc( capacity, sizeof(muse_cell) );
+
+	for ( i = 0; i < old.capacity; ++i )
+	{
+		if ( old.keys[i] )
+			put_override( o, old.keys[i], old.values[i] );
+	}
+
+	free( old.keys );
+	free( old.values );
+}
+
+/**
+ * Sets the value of the local \p ix in a process that shares its
+ * locals. Only the process itself sees the new value.
+ */
+void muse_set_shared_local( muse_process_frame_t *p, int ix, muse_cell value )
+{
+	muse_local_overrides_t *o = &p->overrides;
+
+	if ( 2 * (o->count + 1) > o->capacity )
+		resize_overrides( o, o->capacity ? 2 * o->capacity : 16 );
+
+	put_override( o, ix + 1, value );
+}
+
 /**
  * Returns a reference to a named symbol with the given name.
  * All symbols with the same name have identical symbol references.
@@ -945,9 +1291,12 @@ MUSEAPI muse_cell muse_symbol( muse_env *env, const muse_char *start, const muse
 	{
 		int local_ix = _newlocal();
 		
-		/* sym -> ( . ) */
+		/* sym -> ( . ) 
+		The head is set to the local cell by muse_intern_symbol(). Passing
+		it to _cons() would have an incremental collection take it for 
+		a cell reference. */
 		p = _spos();
-		sym = _setcellt( _cons( _localcell(local_ix), MUSE_NIL ), MUSE_SYMBOL_CELL );
+		sym = _setcellt( _cons( MUSE_NIL, MUSE_NIL ), MUSE_SYMBOL_CELL );
 		
 		{
 			muse_cell name = muse_mk_text( env, start, end );
@@ -1053,6 +1402,13 @@ MUSEAPI muse_cell muse_mk_anon_symbol(muse_env *env)
  */
 MUSEAPI void muse_mark( muse_env *env, muse_cell c )
 {
+	if ( env->heap.deferred_marking )
+	{
+		/* The parallel marker will trace it. */
+		muse_shade( env, c );
+		return;
+	}
+
 CONTINUE_MUSE_MARK:
 	if ( c > 0 && !_ismarked(c) )
 	{
@@ -1113,77 +1469,181 @@ static void mark_stack( muse_env *env, muse_stack *stack )
 		muse_mark( env, *bottom++ );
 }
 
+static void mark_overrides( muse_env *env, const muse_local_overrides_t *o )
+{
+	int i;
+
+	for ( i = 0; i < o->capacity; ++i )
+	{
+		if ( o->keys[i] )
+			muse_mark( env, o->values[i] );
+	}
+}
+
 static void free_text( muse_env *env, muse_cell t )
 {
 	if ( t )
 	{
 		muse_text_cell *c = &_ptr(t)->text;
 		if ( c->start )
-			free( c->start );
+			muse_text_free( env, c->start );
 		c->start = c->end = NULL;
 	}
 }
 
-void free_unused_specials( muse_env *env, muse_cell *specials )
+/**
+ * Returns the stats entry for the given kind of special cell,
+ * creating it if necessary.
+ */
+static muse_finalizer_stats_t *finalizer_stats( muse_finalizers_t *f, int kind, const muse_functional_object_type_t *type_info )
 {
-	muse_cell *cp = specials;
-	muse_cell c = *cp;
-	
-	while ( c )
+	int i;
+	for ( i = 0; i < f->num_stats; ++i )
+	{
+		if ( f->stats[i].kind == kind && f->stats[i].type_info == type_info )
+			return f->stats + i;
+	}
+
+	if ( f->num_stats >= f->stats_capacity )
 	{
-		muse_cell s = _head(c);
+		f->stats_capacity = f->stats_capacity ? 2 * f->stats_capacity : 16;
+		f->stats = (muse_finalizer_stats_t*)realloc( f->stats, f->stats_capacity * sizeof(muse_finalizer_stats_t) );
+	}
+
+	{
+		muse_finalizer_stats_t *st = f->stats + (f->num_stats++);
+		st->type_info	= type_info;
+		st->kind		= kind;
+		st->count		= 0;
+		st->time_us		= 0;
+		return st;
+	}
+}
+
+/**
+ * Releases the character buffers of unmarked text cells and 
+ * compacts the text finalizers array. Returns the number of
+ * text cells finalized.
+ */
+static int finalize_texts( muse_env *env )
+{
+	muse_stack *s = &env->finalizers.texts;
+	muse_cell *r = s->bottom, *w = s->bottom, *end = s->top;
+	muse_int start_us = muse_elapsed_us(env->timer);
+	int count = 0;
 
-		if ( _ismarked( s ) )
+	for ( ; r < end; ++r )
+	{
+		if ( _ismarked(*r) )
+			*w++ = *r;
+		else
 		{
-			/* Leave special untouched. */
-			_mark(c);
-			cp = &_ptr(c)->cons.tail;
-			c = *cp;
+			free_text( env, *r );
+			++count;
 		}
+	}
+
+	s->top = w;
+
+	if ( count > 0 )
+	{
+		muse_finalizer_stats_t *st = finalizer_stats( &env->finalizers, MUSE_TEXT_CELL, NULL );
+		st->count += count;
+		st->time_us += muse_elapsed_us(env->timer) - start_us;
+	}
+
+	return count;
+}
+
+/**
+ * Destroys unmarked functional objects, or runs unmarked destructor
+ * functions, and compacts the given finalizers array. Finalizers can
+ * create new specials, so the array may grow while we scan it and
+ * we work with indices instead of pointers. Objects whose type has no
+ * destroy function are simply freed. Returns the number of cells finalized.
+ */
+static int finalize_natives( muse_env *env, muse_stack *s )
+{
+	int r, w, count, end = (int)(s->top - s->bottom);
+
+	for ( r = w = 0; r < end; ++r )
+	{
+		muse_cell c = s->bottom[r];
+
+		if ( _ismarked(c) )
+			s->bottom[w++] = c;
 		else
 		{
-			/* 
-				Release the special. 
-				For a text cell, we need to release the memory allocated for the string.
-				If a nativefn is in the specials list, it means that it needs to be
-				executed in this phase. This can help take care of running destructors
-				for objects that are really allocated in native-c code.
-			 */
-			switch ( _cellt(s) )
+			muse_functional_object_t *obj = _fnobjdata(c);
+			const muse_functional_object_type_t *type_info = obj ? obj->type_info : NULL;
+			muse_finalizer_stats_t *st;
+
+			if ( obj && !type_info->destroy )
 			{
-				case MUSE_TEXT_CELL			: free_text(env,s); break;
-				case MUSE_NATIVEFN_CELL		: 
-					{
-						muse_functional_object_t *data = _fnobjdata(s);
-						if ( data )
-						{
-							muse_destroy_object( env, data );
-						}
-						else
-							_apply( s, MUSE_NIL, MUSE_FALSE );
-					}
-					break;
-				
-				default:;
+				free(obj);
+				st = finalizer_stats( &env->finalizers, MUSE_NATIVEFN_CELL, type_info );
 			}
-			
-			_step(&c);
-			*cp = c;
+			else
+			{
+				muse_int start_us = muse_elapsed_us(env->timer);
+
+				if ( obj )
+					muse_destroy_object( env, obj );
+				else
+					_apply( c, MUSE_NIL, MUSE_FALSE );
+
+				st = finalizer_stats( &env->finalizers, MUSE_NATIVEFN_CELL, type_info );
+				st->time_us += muse_elapsed_us(env->timer) - start_us;
+			}
+
+			st->count++;
 		}
 	}
+
+	/* Keep whatever specials were created by the finalizers. */
+	count = end - w;
+	for ( ; r < (int)(s->top - s->bottom); ++r )
+		s->bottom[w++] = s->bottom[r];
+
+	s->top = s->bottom + w;
+	return count;
 }
 
-void collect_free_cells( muse_env *env, muse_heap *heap )
+/**
+ * Finalizes every special cell that isn't marked. Objects and destructors
+ * are finalized before texts, since their finalizers may still look at
+ * text cells they refer to.
+ */
+static void free_unused_specials( muse_env *env )
+{
+	muse_gc_stats_t *stats = &env->gc_telemetry.current;
+
+	stats->objects_finalized		+= finalize_natives( env, &env->finalizers.objects );
+	stats->destructors_finalized	+= finalize_natives( env, &env->finalizers.destructors );
+	stats->texts_finalized			+= finalize_texts( env );
+}
+
+/**
+ * Returns the number of cells at the start of the heap
+ * that free cells are collected from.
+ * @see muse_heap::shrink_limit
+ */
+static int usable_heap_size( muse_heap *heap )
+{
+	return heap->shrink_limit > 0 ? heap->shrink_limit : heap->size_cells;
+}
+
+/**
+ * Sweeps the unmarked cells in the range [from,to) into the
+ * given free list and returns the number of cells collected.
+ * \p from and \p to must be multiples of 8.
+ */
+static int sweep_cells( muse_env *env, const unsigned char *marks, int from, int to, muse_cell *free_list )
 {
-	muse_cell f = MUSE_NIL;
-	int marks_size = heap->size_cells;
-	unsigned char *marks = heap->marks;
+	muse_cell f = *free_list;
 	int i, j, fcount;
 	
-	/* The nil cell is never freed. */
-	_mark(MUSE_NIL);
-	
-	for ( i = 0, fcount = 0; i < marks_size; )
+	for ( i = from, fcount = 0; i < to; )
 	{
 		if ( !marks[i>>3] )
 		{
@@ -1217,10 +1677,9 @@ void collect_free_cells( muse_env *env, muse_heap *heap )
 			/* Check each cell and add to free list if it is not marked. */
 			for ( j = i + 8; i < j; ++i )
 			{
-				muse_cell c = _cellati(i);
-				
-				if ( !_ismarked(c) )
+				if ( !(marks[i>>3] & (1 << (i & 7))) )
 				{
+					muse_cell c = _cellati(i);
 					_ptr(c)->cons.head = MUSE_NIL;
 					_ptr(c)->cons.tail = f;
 					f = c;
@@ -1230,8 +1689,17 @@ void collect_free_cells( muse_env *env, muse_heap *heap )
 		}
 	}
 	
-	heap->free_cell_count = fcount;
-	heap->free_cells = f;
+	*free_list = f;
+	return fcount;
+}
+
+void collect_free_cells( muse_env *env, muse_heap *heap )
+{
+	/* The nil cell is never freed. */
+	_mark(MUSE_NIL);
+	
+	heap->free_cells = MUSE_NIL;
+	heap->free_cell_count = sweep_cells( env, heap->marks, 0, usable_heap_size(heap), &heap->free_cells );
 }
 
 
@@ -1292,13 +1760,69 @@ MUSEAPI muse_boolean muse_doing_gc( muse_env *env )
 }
 
 /**
- * Copies the marks to the keep vector so that
- * whatever needs to  survive garbage collection
- * is preserved.
+ * Registers a function to be called after every garbage collection
+ * and heap resizing event, replacing any earlier one. Pass NULL to
+ * unregister it.
+ *
+ * @see muse_gc_callback_t
  */
-static void keep_marks( muse_heap *heap )
+MUSEAPI void muse_set_gc_callback( muse_env *env, muse_gc_callback_t callback, void *context )
 {
-	memcpy( heap->keep, heap->marks, heap->size_cells >> 3 );
+	env->gc_telemetry.callback			= callback;
+	env->gc_telemetry.callback_context	= context;
+}
+
+/**
+ * Copies up to \p max_events of the most recent gc events into
+ * \p events, latest first, and returns the number copied. Only the
+ * last MUSE_GC_HISTORY_SIZE events are kept.
+ */
+MUSEAPI int muse_gc_history( muse_env *env, int max_events, muse_gc_stats_t *events )
+{
+	const muse_gc_telemetry_t *t = &env->gc_telemetry;
+	int i, n = t->num_events < MUSE_GC_HISTORY_SIZE ? t->num_events : MUSE_GC_HISTORY_SIZE;
+
+	if ( n > max_events )
+		n = max_events;
+
+	for ( i = 0; i < n; ++i )
+		events[i] = t->history[(t->num_events - 1 - i) % MUSE_GC_HISTORY_SIZE];
+
+	return n;
+}
+
+/**
+ * Returns the number of cells allocated so far by the process
+ * with the given pid, or by the current process if \p pid is
+ * MUSE_NIL. Returns -1 if there is no such process.
+ */
+MUSEAPI muse_int muse_process_cells_allocated( muse_env *env, muse_cell pid )
+{
+	muse_process_frame_t *cp = env->current_process;
+	muse_process_frame_t *p = cp;
+
+	if ( pid == MUSE_NIL )
+		return cp->cells_allocated;
+
+	do
+	{
+		if ( process_id(p) == pid )
+			return p->cells_allocated;
+		p = p->next;
+	}
+	while ( p != cp );
+
+	return -1;
+}
+
+/**
+ * Copies the marks to the keep vector so that
+ * whatever needs to  survive garbage collection
+ * is preserved.
+ */
+static void keep_marks( muse_heap *heap )
+{
+	memcpy( heap->keep, heap->marks, heap->size_cells >> 3 );
 }
 
 /**
@@ -1307,28 +1831,687 @@ static void keep_marks( muse_heap *heap )
  * are restored. Note that after this call,
  * the keep vector is considered to be garbage.
  */
-static void mark_keep( muse_heap *heap )
+static void mark_keep( muse_heap *heap )
+{
+	/* Simply swap the two pointers. */
+	unsigned char *temp = heap->keep;
+	heap->keep = heap->marks;
+	heap->marks = temp;
+}
+
+/**
+ * Marks all cells in the heap as unmarked.
+ * Used only in muse_destroy_env when everything
+ * needs to go.
+ */
+static void unmark_all_cells( muse_heap *heap )
+{
+	memset( heap->marks, 0, heap->size_cells >> 3 );
+	memset( heap->keep, 0, heap->size_cells >> 3 );
+}
+
+/**
+ * Called by the write barrier (see _remember()) when an old
+ * cell is about to be modified. The cell is moved out of the
+ * old generation and onto the remembered set so that whatever
+ * new cells it comes to refer to are traced by the next minor
+ * collection. Since the cell is no longer old, subsequent writes
+ * to it don't record it again.
+ */
+void muse_remember_cell( muse_env *env, muse_cell c )
+{
+	muse_heap *heap = _heap();
+	muse_stack *r = &heap->remembered;
+	int ci = _celli(c);
+
+	heap->old[ci >> 3] &= ~(1 << (ci & 7));
+
+	if ( r->top - r->bottom >= r->size )
+		realloc_stack( r, 2 * r->size );
+
+	*(r->top++) = c;
+}
+
+/**
+ * Marks all cells in the old generation so that a minor
+ * collection doesn't need to trace them.
+ */
+static void mark_old_cells( muse_heap *heap )
+{
+	unsigned char *m = heap->marks;
+	unsigned char *m_end = m + (heap->size_cells >> 3);
+	const unsigned char *o = heap->old;
+
+	while ( m < m_end )
+		*m++ |= *o++;
+}
+
+/**
+ * The cells on the remembered set are roots for a minor
+ * collection. They might already be marked as members of
+ * the keep vector, so their contents are traced explicitly.
+ */
+static void mark_remembered( muse_env *env )
+{
+	muse_stack *r = &_heap()->remembered;
+	muse_cell *c = r->bottom;
+
+	for ( ; c < r->top; ++c )
+	{
+		muse_mark( env, _quq(_head(*c)) );
+		muse_mark( env, _quq(_tail(*c)) );
+		_mark(*c);
+	}
+}
+
+/**
+ * Functional objects keep their references in native memory
+ * that the write barrier doesn't see. So every old functional
+ * object is asked to mark its references during a minor collection.
+ * References to old cells terminate the marking immediately, so
+ * this is usually cheap.
+ */
+static void mark_old_objects( muse_env *env )
+{
+	const unsigned char *old = _heap()->old;
+	muse_cell *c = env->finalizers.objects.bottom;
+	muse_cell *c_end = env->finalizers.objects.top;
+
+	for ( ; c < c_end; ++c )
+	{
+		int si = _celli(*c);
+
+		if ( old[si >> 3] & (1 << (si & 7)) )
+		{
+			muse_functional_object_t *obj = _fnobjdata(*c);
+			if ( obj && obj->type_info->mark )
+				obj->type_info->mark( env, obj );
+		}
+	}
+}
+
+/**
+ * Marks everything reachable from the symbol table and
+ * from the stacks and other state of every process.
+ */
+static void mark_roots( muse_env *env )
+{
+	mark_stack( env, _symstack() );
+	mark_stack( env, &env->snapshot_base );
+	muse_profile_mark( env );
+	muse_plist_mark( env );
+	muse_mark_workers( env );
+	
+	{
+		muse_process_frame_t *cp = env->current_process;
+		muse_process_frame_t *p = cp;
+
+		do 
+		{
+			mark_process(p);
+			p = p->next;
+		}
+		while ( p != cp );
+	}
+}
+
+/**
+ * Adds the given event to the gc history and passes it on to
+ * the gc callback, if there is one.
+ */
+static void report_gc_event( muse_env *env, muse_gc_stats_t *stats )
+{
+	muse_gc_telemetry_t *t = &env->gc_telemetry;
+
+	stats->time_us		= muse_elapsed_us(env->timer);
+	stats->heap_size	= _heap()->size_cells;
+	stats->free_cells	= _heap()->free_cell_count;
+
+	if ( stats->event != MUSE_GC_HEAP_GROWN && stats->event != MUSE_GC_HEAP_SHRUNK )
+	{
+		stats->cells_allocated = t->cells_allocated - t->cells_allocated_at_last_gc;
+		t->cells_allocated_at_last_gc = t->cells_allocated;
+	}
+
+	t->history[(t->num_events++) % MUSE_GC_HISTORY_SIZE] = *stats;
+
+	if ( t->callback )
+		t->callback( env, t->callback_context, stats );
+}
+
+/**
+ * Starts collecting the statistics of a new collection
+ * into gc_telemetry.current.
+ */
+static void begin_gc_stats( muse_env *env, muse_gc_event_t event )
+{
+	muse_gc_stats_t *stats = &env->gc_telemetry.current;
+
+	memset( stats, 0, sizeof(muse_gc_stats_t) );
+	stats->event			= event;
+	stats->heap_size_before	= _heap()->size_cells;
+}
+
+/**
+ * Returns the index just past the last marked cell at or beyond
+ * the given index (a multiple of 8), rounded up to a multiple of 8.
+ * Returns \p from if no cell there is marked.
+ */
+static int marks_end( muse_heap *heap, int from )
+{
+	int i;
+
+	for ( i = heap->size_cells >> 3; i > (from >> 3); --i )
+	{
+		if ( heap->marks[i-1] )
+			return i << 3;
+	}
+
+	return from;
+}
+
+/**
+ * Releases the end of the heap from \p new_size onwards. There must
+ * be no live cells there. The free list is rebuilt from the marks.
+ */
+static void truncate_heap( muse_env *env, int new_size )
+{
+	muse_heap *heap = _heap();
+	muse_gc_stats_t stats;
+
+	memset( &stats, 0, sizeof(stats) );
+	stats.event				= MUSE_GC_HEAP_SHRUNK;
+	stats.heap_size_before	= heap->size_cells;
+	stats.pause_us			= muse_elapsed_us(env->timer);
+
+	fprintf(stderr, "\n(shrinking heap to %d)\n", new_size);
+
+	{
+		muse_cell_data *p = (muse_cell_data*)realloc( heap->cells, new_size * sizeof(muse_cell_data) );
+		unsigned char *m = (unsigned char*)realloc( heap->marks, new_size >> 3 );
+		unsigned char *k = (unsigned char*)realloc( heap->keep, new_size >> 3 );
+
+		/* Shrinking a block can't really fail, 
+		but keep the old one if it does. */
+		if ( p ) heap->cells = p;
+		if ( m ) heap->marks = m;
+		if ( k ) heap->keep = k;
+
+		if ( heap->old )
+		{
+			unsigned char *o = (unsigned char*)realloc( heap->old, new_size >> 3 );
+			if ( o ) heap->old = o;
+		}
+	}
+
+	heap->size_cells	= new_size;
+	heap->shrink_limit	= 0;
+	collect_free_cells( env, heap );
+
+	stats.pause_us = muse_elapsed_us(env->timer) - stats.pause_us;
+	report_gc_event( env, &stats );
+}
+
+/**
+ * Shrinks the heap once MUSE_HEAP_SHRINK_COLLECTIONS consecutive
+ * full collections have left it less than MUSE_HEAP_SHRINK_THRESHOLD%
+ * occupied. Called at the end of a full collection, while the marks
+ * vector holds the live cells.
+ *
+ * Cells can't be moved, and the cells in use when a collection 
+ * happens tend to be spread all over the heap. So we first stop 
+ * allocating cells beyond the new size (see muse_heap::shrink_limit)
+ * and release the end of the heap once nothing there is in use. If
+ * something there is still in use after MUSE_HEAP_SHRINK_COLLECTIONS
+ * more collections, only what lies beyond it is released.
+ */
+static void shrink_heap_if_needed( muse_env *env )
+{
+	muse_heap *heap = _heap();
+	muse_gc_telemetry_t *t = &env->gc_telemetry;
+	int live = heap->size_cells - heap->free_cell_count;
+	int new_size;
+
+	if ( env->parameters[MUSE_HEAP_SHRINK_COLLECTIONS] <= 0 )
+		return;
+
+	if ( heap->shrink_limit > 0 )
+	{
+		int limit = heap->shrink_limit;
+
+		int end = marks_end( heap, limit );
+
+		if ( end == limit )
+			truncate_heap( env, limit );
+		else if ( heap->free_cell_count < (100 - env->parameters[MUSE_GROW_HEAP_THRESHOLD]) * limit / 100 )
+		{
+			/* The heap got busy again before the end emptied out. 
+			Let the cells at the end be used again. */
+			heap->shrink_limit = 0;
+			heap->free_cell_count += sweep_cells( env, heap->marks, limit, heap->size_cells, &heap->free_cells );
+			t->low_occupancy_count = 0;
+		}
+		else if ( ++(t->low_occupancy_count) >= env->parameters[MUSE_HEAP_SHRINK_COLLECTIONS] )
+		{
+			/* Cells at the end have lived through as many collections
+			as it took to decide to shrink, so they are likely to stay.
+			Settle for releasing what lies beyond them, rather than
+			collecting within the limit indefinitely. */
+			heap->shrink_limit = 0;
+			t->low_occupancy_count = 0;
+
+			if ( end <= heap->size_cells - heap->size_cells / 4 )
+				truncate_heap( env, end );
+			else
+				heap->free_cell_count += sweep_cells( env, heap->marks, limit, heap->size_cells, &heap->free_cells );
+		}
+
+		return;
+	}
+
+	if ( (muse_int)live * 100 >= (muse_int)env->parameters[MUSE_HEAP_SHRINK_THRESHOLD] * heap->size_cells )
+	{
+		t->low_occupancy_count = 0;
+		return;
+	}
+
+	if ( ++(t->low_occupancy_count) < env->parameters[MUSE_HEAP_SHRINK_COLLECTIONS] )
+		return;
+
+	t->low_occupancy_count = 0;
+
+	/* Keep the live cells well below the growth threshold, so that
+	the heap doesn't have to grow again right away. */
+	new_size = (int)((muse_int)live * 200 / env->parameters[MUSE_GROW_HEAP_THRESHOLD]);
+	if ( new_size < env->parameters[MUSE_HEAP_SIZE] )
+		new_size = env->parameters[MUSE_HEAP_SIZE];
+
+	new_size = (new_size + 7) & ~7;
+
+	/* Not worth the trouble unless at least a quarter of the heap goes. */
+	if ( new_size > heap->size_cells - heap->size_cells / 4 )
+		return;
+
+	if ( marks_end( heap, new_size ) == new_size )
+		truncate_heap( env, new_size );
+	else
+	{
+		heap->shrink_limit = new_size;
+		collect_free_cells( env, heap );
+	}
+}
+
+/**
+ * Performs one mark and sweep collection. In a minor collection,
+ * only cells created since the previous collection are traced
+ * and freed. All survivors of a collection become old.
+ */
+static void collect_garbage( muse_env *env, muse_boolean minor )
+{
+	muse_heap *heap = _heap();
+	int mark_threads = (heap->size_cells >= MUSE_PARALLEL_MARK_MIN_CELLS) ? env->parameters[MUSE_GC_MARK_THREADS] : 0;
+	muse_gc_stats_t *stats = &env->gc_telemetry.current;
+	muse_int start_us = muse_elapsed_us(env->timer);
+	int free_before = heap->free_cell_count;
+
+	begin_gc_stats( env, minor ? MUSE_GC_MINOR_COLLECTION : MUSE_GC_FULL_COLLECTION );
+
+	/* 1. Save the current mark vector. */
+	keep_marks( heap );
+	
+	_mark(0);
+
+	/* When marking in parallel, the roots are only shaded 
+	and the marker threads trace everything from there. */
+	heap->deferred_marking = (mark_threads > 1);
+
+	if ( minor )
+	{
+		/* Old cells are taken to be alive. The only way they can refer
+		to younger cells is through the remembered set or through
+		functional objects. */
+		mark_old_cells( heap );
+		mark_remembered( env );
+		mark_old_objects( env );
+	}
+
+	/* 2. Mark all symbols and their values and plists, and
+	the references held by every process. */
+	mark_roots( env );
+
+	if ( mark_threads > 1 )
+		muse_parallel_mark( env, mark_threads );
+
+	/* 3. Go through the specials list and release 
+		  everything that isn't referenced. */
+	free_unused_specials( env );
+	
+	/* 4. Collect whatever is unmarked into the free list. */
+	collect_free_cells( env, heap );
+
+	stats->cells_marked	= heap->size_cells - heap->free_cell_count;
+	stats->cells_freed	= heap->free_cell_count - free_before;
+	stats->pause_us		= muse_elapsed_us(env->timer) - start_us;
+	report_gc_event( env, stats );
+
+	if ( !minor )
+		shrink_heap_if_needed( env );
+
+	/* 5. Everything that survived is now old. */
+	if ( heap->old )
+	{
+		memcpy( heap->old, heap->marks, heap->size_cells >> 3 );
+		heap->remembered.top = heap->remembered.bottom;
+	}
+
+	/* 6. Restore the mark vector to the marks for the
+	cells that must survive gc. */
+	mark_keep( heap );
+}
+
+/**
+ * Pushes a marked cell onto the grey stack so that its
+ * references will be traced by a later slice of incremental
+ * marking. 
+ */
+void muse_grey_cell( muse_env *env, muse_cell c )
+{
+	muse_stack *g = &_heap()->grey;
+
+	if ( g->top - g->bottom >= g->size )
+		realloc_stack( g, 2 * g->size );
+
+	*(g->top++) = c;
+}
+
+/**
+ * Marks an unmarked cell and pushes it onto the grey stack.
+ */
+void muse_shade( muse_env *env, muse_cell c )
+{
+	if ( c > 0 && !_ismarked(c) )
+	{
+		_mark(c);
+		muse_grey_cell( env, c );
+	}
+}
+
+static void shade_stack( muse_env *env, muse_stack *stack )
+{
+	muse_cell *bottom = stack->bottom;
+	muse_cell *top = stack->top;
+	
+	while ( bottom < top )
+		muse_shade( env, *bottom++ );
+}
+
+static void shade_overrides( muse_env *env, const muse_local_overrides_t *o )
+{
+	int i;
+
+	for ( i = 0; i < o->capacity; ++i )
+	{
+		if ( o->keys[i] )
+			muse_shade( env, o->values[i] );
+	}
+}
+
+/**
+ * Traces the references held by grey cells until there are no
+ * grey cells left or, if \p deadline_us > 0, until the environment's
+ * timer goes past \p deadline_us. Returns MUSE_TRUE if all grey
+ * cells have been traced.
+ */
+static muse_boolean mark_grey_cells( muse_env *env, muse_int deadline_us )
+{
+	muse_stack *g = &_heap()->grey;
+	int n = 0;
+
+	while ( g->top > g->bottom )
+	{
+		muse_cell c = *(--g->top);
+
+		if ( _iscompound(c) )
+		{
+			muse_shade( env, _quq(_head(c)) );
+			muse_shade( env, _quq(_tail(c)) );
+		}
+		else
+		{
+			muse_functional_object_t *obj = _fnobjdata(c);
+			if ( obj && obj->type_info->mark )
+				obj->type_info->mark( env, obj );
+		}
+
+		/* Checking the time is not free, so do it only every few cells. */
+		if ( deadline_us > 0 && (++n & 255) == 0 && muse_elapsed_us(env->timer) >= deadline_us )
+			return MUSE_FALSE;
+	}
+
+	return MUSE_TRUE;
+}
+
+/**
+ * Starts an incremental collection cycle. Only the symbols and the
+ * process locals are shaded here. The rest of the roots change too often
+ * to be worth tracing until the cycle finishes.
+ */
+static void begin_incremental_gc( muse_env *env )
+{
+	muse_heap *heap = _heap();
+
+	keep_marks( heap );
+	_mark(0);
+	heap->gc_phase = MUSE_GC_MARKING;
+	begin_gc_stats( env, MUSE_GC_INCREMENTAL_COLLECTION );
+
+	shade_stack( env, _symstack() );
+
+	{
+		muse_process_frame_t *cp = env->current_process;
+		muse_process_frame_t *p = cp;
+
+		do 
+		{
+			shade_stack( env, &p->locals );
+			shade_overrides( env, &p->overrides );
+			p = p->next;
+		}
+		while ( p != cp );
+	}
+}
+
+/**
+ * Completes the marking phase of an incremental collection in one go.
+ * The roots are marked again, and so are the references held by the surviving
+ * functional objects, since these can change without passing through 
+ * the write barrier. Unused specials are released and the heap is left
+ * to be swept lazily by sweep_page().
+ */
+static void finish_incremental_marking( muse_env *env )
+{
+	muse_heap *heap = _heap();
+	muse_gc_stats_t *stats = &env->gc_telemetry.current;
+	muse_int start_us = muse_elapsed_us(env->timer);
+	int free_before = heap->free_cell_count;
+
+	mark_grey_cells( env, 0 );
+	mark_roots( env );
+
+	{
+		muse_cell *c = env->finalizers.objects.bottom;
+		muse_cell *c_end = env->finalizers.objects.top;
+
+		for ( ; c < c_end; ++c )
+		{
+			if ( _ismarked(*c) )
+			{
+				muse_functional_object_t *obj = _fnobjdata(*c);
+				if ( obj && obj->type_info->mark )
+					obj->type_info->mark( env, obj );
+			}
+		}
+	}
+
+	free_unused_specials( env );
+
+	/* The marks of this cycle end up in the keep vector, 
+	from where sweep_page() picks them up. Cells still on the 
+	free list are unmarked and will be swept back into it. */
+	mark_keep( heap );
+	heap->gc_phase		= MUSE_GC_SWEEPING;
+	heap->free_cells	= MUSE_NIL;
+	heap->free_cell_count = 0;
+	heap->sweep_pos		= 0;
+	heap->sweep_end		= usable_heap_size(heap);
+
+	/* sweep_page() moves cells from marked to freed as it finds them. 
+	Cells that were already free don't count as freed. */
+	stats->cells_marked	= heap->sweep_end;
+	stats->cells_freed	= -free_before;
+	stats->pause_us		= muse_elapsed_us(env->timer) - start_us;
+}
+
+/**
+ * Grows the heap if fewer than (100 - MUSE_GROW_HEAP_THRESHOLD)% of 
+ * its cells are free.
+ */
+static void grow_heap_if_needed( muse_env *env, int free_cells_needed )
+{
+	muse_heap *heap = _heap();
+
+	if ( heap->free_cell_count < (100 - env->parameters[MUSE_GROW_HEAP_THRESHOLD]) * usable_heap_size(heap) / 100 )
+	{
+		if ( heap->shrink_limit > 0 )
+		{
+			/* Rather than grow, give up on shrinking. The next
+			collection will find the free cells at the end. */
+			heap->shrink_limit = 0;
+		}
+		else
+		{
+			/* We're still too close to the edge here. Allocate 
+			   enough memory. */
+			int new_size = heap->size_cells;
+			int opt_size = 2 * (heap->size_cells - heap->free_cell_count + free_cells_needed);
+			while ( new_size < opt_size )
+				new_size *= 2;
+			
+			grow_heap( env, new_size );
+		}
+	}
+}
+
+/**
+ * Grows the heap right away if it has fewer than \p n free cells, so
+ * that making that many cells that are all going to be kept, as when
+ * loading a snapshot, doesn't set off collections that free nothing.
+ */
+void muse_reserve_cells( muse_env *env, int n )
+{
+	muse_heap *heap = _heap();
+
+	if ( heap->free_cell_count < n )
+	{
+		int new_size = heap->size_cells;
+
+		while ( new_size - heap->size_cells + heap->free_cell_count < n )
+			new_size *= 2;
+
+		grow_heap( env, new_size );
+	}
+}
+
+/**
+ * Sweeps the next page of cells into the free list during the
+ * MUSE_GC_SWEEPING phase. Returns MUSE_FALSE once the whole heap has
+ * been swept, which ends the collection cycle.
+ */
+static muse_boolean sweep_page( muse_env *env )
 {
-	/* Simply swap the two pointers. */
-	unsigned char *temp = heap->keep;
-	heap->keep = heap->marks;
-	heap->marks = temp;
+	muse_heap *heap = _heap();
+	muse_gc_stats_t *stats = &env->gc_telemetry.current;
+	int to = heap->sweep_pos + MUSE_GC_SWEEP_PAGE_CELLS;
+	int swept;
+
+	if ( to > heap->sweep_end )
+		to = heap->sweep_end;
+
+	swept = sweep_cells( env, heap->keep, heap->sweep_pos, to, &heap->free_cells );
+	heap->free_cell_count += swept;
+	heap->sweep_pos = to;
+	stats->cells_marked -= swept;
+	stats->cells_freed += swept;
+
+	if ( to < heap->sweep_end )
+		return MUSE_TRUE;
+
+	heap->gc_phase = MUSE_GC_IDLE;
+	report_gc_event( env, stats );
+	grow_heap_if_needed( env, 0 );
+	return MUSE_FALSE;
 }
 
 /**
- * Marks all cells in the heap as unmarked.
- * Used only in muse_destroy_env when everything
- * needs to go.
+ * Does a bounded slice of marking work if an incremental
+ * collection is in its marking phase.
  */
-static void unmark_all_cells( muse_heap *heap )
+static void mark_slice( muse_env *env )
 {
-	memset( heap->marks, 0, heap->size_cells >> 3 );
-	memset( heap->keep, 0, heap->size_cells >> 3 );
+	if ( env->heap.gc_phase == MUSE_GC_MARKING )
+		mark_grey_cells( env, muse_elapsed_us(env->timer) + env->parameters[MUSE_GC_SLICE_US] );
+}
+
+/**
+ * Called by muse_cons() every MUSE_GC_SLICE_CELLS allocations when 
+ * incremental collection is enabled. Starts a collection cycle when
+ * free cells start running low, advances marking by a slice and
+ * finishes marking once no grey cells remain.
+ */
+void muse_gc_step( muse_env *env )
+{
+	muse_heap *heap = _heap();
+
+	heap->gc_countdown = MUSE_GC_SLICE_CELLS;
+
+	/* Like muse_gc(), leave atomic blocks alone. */
+	if ( env->current_process->atomicity > 0 || env->collecting_garbage )
+		return;
+
+	switch ( heap->gc_phase )
+	{
+	case MUSE_GC_IDLE:
+		if ( heap->free_cell_count < 2 * (100 - env->parameters[MUSE_GROW_HEAP_THRESHOLD]) * usable_heap_size(heap) / 100 )
+			begin_incremental_gc( env );
+		break;
+
+	case MUSE_GC_MARKING:
+		if ( heap->grey.top > heap->grey.bottom )
+			mark_slice( env );
+		else
+		{
+			env->collecting_garbage = MUSE_TRUE;
+			enter_atomic(env);
+			finish_incremental_marking( env );
+			leave_atomic(env);
+			env->collecting_garbage = MUSE_FALSE;
+		}
+		break;
+
+	default:;
+	}
 }
 
 void muse_gc_impl( muse_env *env, int free_cells_needed )
 {
 	muse_heap *heap = _heap();
+
+	/* If an incremental collection is sweeping, sweep only 
+	as much as is needed right now. */
+	if ( heap->gc_phase == MUSE_GC_SWEEPING && free_cells_needed > 0 )
+	{
+		while ( (heap->free_cells == MUSE_NIL || heap->free_cell_count < free_cells_needed * 2) && sweep_page( env ) );
+	}
 	
 	if ( free_cells_needed <= 0 || heap->free_cells == MUSE_NIL || heap->free_cell_count < free_cells_needed * 2 )
 	{
@@ -1336,54 +2519,37 @@ void muse_gc_impl( muse_env *env, int free_cells_needed )
 		
 		if ( free_cells_needed > 0 )
 		{
+			int min_free_cells = (100 - env->parameters[MUSE_GROW_HEAP_THRESHOLD]) * usable_heap_size(heap) / 100;
+
 			// If the process is in an atomic block, don't do GC,
 			// but simply grow the heap by the necessary amount.
 			if ( env->current_process->atomicity == 1 )
 			{
-				/* 1. Save the current mark vector. */
-				keep_marks( heap );
-				
-				_mark(0);
-
-				/* 2. Mark all symbols and their values and plists. */
-				mark_stack( env, _symstack() );
-				
-				/* 3. Mark references held by every process. */
+				if ( heap->gc_phase != MUSE_GC_IDLE )
 				{
-					muse_process_frame_t *cp = env->current_process;
-					muse_process_frame_t *p = cp;
+					/* We ran out of cells before the incremental
+					collection could finish, so finish it now. */
+					if ( heap->gc_phase == MUSE_GC_MARKING )
+						finish_incremental_marking( env );
 
-					do 
-					{
-						mark_process(p);
-						p = p->next;
-					}
-					while ( p != cp );
+					while ( sweep_page( env ) );
 				}
-
-				/* 4. Go through the specials list and release 
-					  everything that isn't referenced. */
-				free_unused_specials( env, &env->specials );
-				
-				/* 5. Collect whatever is unmarked into the free list. */
-				collect_free_cells( env, _heap() );
-
-				/* 6. Restore the mark vector to the marks for the
-				cells that must survive gc. */
-				mark_keep( heap );
+				else if ( heap->old )
+				{
+					/* Try a minor collection first. If that doesn't
+					give us enough room, the old generation is carrying
+					garbage and we do a full collection before resorting
+					to growing the heap. */
+					collect_garbage( env, MUSE_TRUE );
+
+					if ( heap->free_cell_count < min_free_cells )
+						collect_garbage( env, MUSE_FALSE );
+				}
+				else
+					collect_garbage( env, MUSE_FALSE );
 			}
 			
-			if ( heap->free_cell_count < (100 - env->parameters[MUSE_GROW_HEAP_THRESHOLD]) * heap->size_cells / 100 )
-			{
-				/* We're still too close to the edge here. Allocate 
-				   enough memory. */
-				int new_size = heap->size_cells;
-				int opt_size = 2 * (heap->size_cells - heap->free_cell_count + free_cells_needed);
-				while ( new_size < opt_size )
-					new_size *= 2;
-				
-				grow_heap( heap, new_size );
-			}
+			grow_heap_if_needed( env, free_cells_needed );
 		}
 		else
 		{
@@ -1392,9 +2558,11 @@ void muse_gc_impl( muse_env *env, int free_cells_needed )
 			everythign when shutting down. free_cells_needed <= 0
 			indicates that we're shutting down. */
 
+			heap->gc_phase = MUSE_GC_IDLE;
+			heap->gc_countdown = 0;
 			unmark_all_cells( heap );
 			_mark( process_id(env->current_process) );
-			free_unused_specials( env, &env->specials );
+			free_unused_specials( env );
 		}
 	}
 }
@@ -1451,7 +2619,7 @@ MUSEAPI muse_cell muse_mk_functional_object( muse_env *env, muse_functional_obje
 	muse_functional_object_t *obj = muse_create_object( env, type_info );
 	muse_cell fn = _mk_nativefn( obj->type_info->fn, obj );
 	obj->self = fn;
-	add_special(env,fn);
+	add_special( &env->finalizers.objects, fn );
 	muse_init_object( env, obj, init_args );
 	return fn;
 }
@@ -1494,6 +2662,78 @@ MUSEAPI muse_functional_object_t *muse_functional_object_data( muse_env *env, mu
  */
 /*@{*/
 
+static void enqueue_ready( muse_scheduler_t *s, muse_process_frame_t *p )
+{
+	muse_debug_only(muse_env *env = p->env;)
+	muse_assert( !p->ready_queued );
+	p->ready_next = NULL;
+	p->ready_queued = MUSE_TRUE;
+
+	if ( s->ready_tail )
+		s->ready_tail->ready_next = p;
+	else
+		s->ready_head = p;
+
+	s->ready_tail = p;
+}
+
+static muse_process_frame_t *dequeue_ready( muse_scheduler_t *s )
+{
+	muse_process_frame_t *p = s->ready_head;
+
+	s->ready_head = p->ready_next;
+	if ( !s->ready_head )
+		s->ready_tail = NULL;
+
+	p->ready_next = NULL;
+	p->ready_queued = MUSE_FALSE;
+	return p;
+}
+
+static void unlink_ready( muse_scheduler_t *s, muse_process_frame_t *p )
+{
+	muse_process_frame_t *prev = NULL, *q = s->ready_head;
+
+	while ( q && q != p )
+	{
+		prev = q;
+		q = q->ready_next;
+	}
+
+	if ( q )
+	{
+		if ( prev )
+			prev->ready_next = p->ready_next;
+		else
+			s->ready_head = p->ready_next;
+
+		if ( s->ready_tail == p )
+			s->ready_tail = prev;
+
+		p->ready_next = NULL;
+		p->ready_queued = MUSE_FALSE;
+	}
+}
+
+/**
+ * Makes a waiting process runnable and puts it at the back
+ * of the ready queue.
+ */
+void wake_process( muse_env *env, muse_process_frame_t *p )
+{
+	muse_cancel_timer( env, &p->wait_timer );
+	p->state_bits = MUSE_PROCESS_RUNNING;
+	enqueue_ready( &env->scheduler, p );
+}
+
+static void expire_wait( muse_env *env, muse_timer_t *timer )
+{
+	muse_process_frame_t *p = (muse_process_frame_t*)timer->context;
+
+	if ( p->state_bits & MUSE_PROCESS_WAITING )
+		wake_process( env, p );
+}
+
 /**
  * Creates a new process and returns a pointer to the frame of the newly created process.
  * The new process is initially in the "paused" state. It will not run initially because
@@ -1509,18 +2749,44 @@ MUSEAPI muse_functional_object_t *muse_functional_object_data( muse_env *env, mu
  * @param sp You can optionally supply a C stack pointer that points to the base of
  *			 the stack of the newly created process. When creating the main process
  *			 structure, this pointer must be NULL.
+ * @param stack_size The size in cells of the C stack of a spawned process. 
+ *			 If 0, the MUSE_STACK_SIZE parameter is used.
+ *
+ * Returns NULL if no C stack could be had for the new process.
  */
-muse_process_frame_t *create_process( muse_env *env, int attention, muse_cell thunk, void *sp )
+muse_process_frame_t *create_process( muse_env *env, int attention, muse_cell thunk, void *sp, int stack_size )
 {
 	muse_process_frame_t *p = (muse_process_frame_t*)calloc( 1, sizeof(muse_process_frame_t) );
 
 	muse_assert( attention > 0 );
 
+	if ( sp == NULL )
+	{
+		/* This is not the main process. Create a stack frame. 
+		The cstack frame is different from the other stack frame
+		in that it grows down. So top is the place the SP has to
+		jump to when entering the process and it'll be decremented
+		as more items gets pushed onto it. */
+		if ( !muse_alloc_cstack( env, &p->cstack, stack_size > 0 ? stack_size : env->parameters[MUSE_STACK_SIZE] ) )
+		{
+			free(p);
+			return NULL;
+		}
+		p->cstack.top = p->cstack.bottom + p->cstack.size - 4;
+	}
+	else
+	{
+		/* Its the main process. We just use the main stack frame as is. */
+		p->cstack.top = (muse_cell*)sp;
+	}
+
 	p->env						= env;
 	p->attention				= attention;
 	p->remaining_attention		= attention;
 	p->state_bits				= MUSE_PROCESS_PAUSED;
 	p->thunk					= thunk;
+	p->wait_timer.expire		= expire_wait;
+	p->wait_timer.context		= p;
 	
 	/* Create all the stacks. */
 	init_stack( &p->stack,			env->parameters[MUSE_STACK_SIZE]		);
@@ -1530,29 +2796,42 @@ muse_process_frame_t *create_process( muse_env *env, int attention, muse_cell th
 		 * above because the bindings stack is an array of 
 		 * symbol-value pairs.
 		 */
-	init_stack( &p->locals,			env->parameters[MUSE_MAX_SYMBOLS]		);
-
-	/* Create the trace info. */
-	p->traceinfo.size = 32;
-	p->traceinfo.depth = 0;
-	p->traceinfo.data = (muse_trace_t*)calloc( p->traceinfo.size, sizeof(muse_trace_t) );
 
-	if ( sp == NULL )
+	/* Processes spawned by the main process can share its locals, and
+	so do the processes they spawn. */
+	if ( env->current_process && (env->current_process->shared_locals || (env->parameters[MUSE_SHARED_LOCALS] && is_main_process(env))) )
 	{
-		/* This is not the main process. Create a stack frame. 
-		The cstack frame is different from the other stack frame
-		in that it grows down. So top is the place the SP has to
-		jump to when entering the process and it'll be decremented
-		as more items gets pushed onto it. */
-		init_stack( &p->cstack, env->parameters[MUSE_STACK_SIZE] );
-		p->cstack.top = p->cstack.bottom + p->cstack.size - 4;
+		muse_process_frame_t *parent = env->current_process;
+		p->shared_locals = parent->shared_locals ? parent->shared_locals : &parent->locals;
+
+		/* The spawning process' own values are copied, so that the new
+		process starts out seeing what it sees. */
+		if ( parent->overrides.count > 0 )
+		{
+			int i;
+			resize_overrides( &p->overrides, parent->overrides.capacity );
+			for ( i = 0; i < parent->overrides.capacity; ++i )
+			{
+				if ( parent->overrides.keys[i] )
+					put_override( &p->overrides, parent->overrides.keys[i], parent->overrides.values[i] );
+			}
+		}
 	}
 	else
 	{
-		/* Its the main process. We just use the main stack frame as is. */
-		p->cstack.top = (muse_cell*)sp;
+		/* The spawning process' locals may have grown past
+		MUSE_MAX_SYMBOLS, and they're all copied over below. */
+		int size = env->parameters[MUSE_MAX_SYMBOLS];
+		if ( env->current_process && env->current_process->locals.size > size )
+			size = env->current_process->locals.size;
+		init_stack( &p->locals,			size									);
 	}
 
+	/* Create the trace info. */
+	p->traceinfo.size = 32;
+	p->traceinfo.depth = 0;
+	p->traceinfo.data = (muse_trace_t*)calloc( p->traceinfo.size, sizeof(muse_trace_t) );
+
 	/* Initialize the queue pointers. */
 	p->next = p->prev = p;
 
@@ -1562,7 +2841,8 @@ muse_process_frame_t *create_process( muse_env *env, int attention, muse_cell th
 	/* Copy all the currently defined symbols over to the new process. */
 	if ( env->current_process )
 	{
-		memcpy( p->locals.bottom, env->current_process->locals.bottom, sizeof(muse_cell) * env->num_symbols );
+		if ( !p->shared_locals )
+			memcpy( p->locals.bottom, env->current_process->locals.bottom, sizeof(muse_cell) * env->num_symbols );
 
 		/* Also set the current_port settings to stdin/out/err. */
 		p->current_port[MUSE_STDIN_PORT] = muse_stdport( env, MUSE_STDIN_PORT );
@@ -1632,20 +2912,30 @@ muse_boolean prime_process( muse_process_frame_t *process )
 	Just save the current state. */
 	process->state_bits = MUSE_PROCESS_VIRGIN;
 
+	if ( env->current_process && env->current_process != process )
+		enqueue_ready( &env->scheduler, process );
+
 	return MUSE_TRUE;
 }
 
-static muse_env *g_env = NULL;
+/* Each thread runs its own environments, so this must not be shared. */
+static MUSE_THREAD_LOCAL muse_env *g_env = NULL;
 
 /**
  * Evaluates a process's thunk in a loop until the thunk 
  * evaluates to a non-nil value. Once the thunk completes
  * evaluation, the process dies and evaluation switches to
  * the next process.
+ *
+ * This must not be inlined into switch_to_process(), which calls it
+ * right after changing the stack pointer - the inlined code could
+ * read locals from the old stack.
  */
-muse_boolean run_process()
+MUSE_NOINLINE muse_boolean run_process()
 {
 	muse_env *env = g_env;
+
+	muse_release_retired_cstack( env );
 	
 	if ( env->current_process->cstack.size > 0 && env->current_process->thunk )
 	{
@@ -1662,90 +2952,147 @@ muse_boolean run_process()
 }
 
 /**
- * Immediately switches attention to the given process. If the given
+ * Immediately switches attention to the given process, which must be
+ * able to run and must not be in the ready queue. If the given 
  * process is in the "virgin" state, run_process() is called on it.
- * If the process is in the "paused" state, it checks whether the
- * pause has timed out and if so switches to the process. If the process
- * is still waiting, then it tries all processes in the process ring
- * before giving the process another chance. 
+ * Use run_next_process() to let the scheduler decide which process
+ * to run.
  *
- * Note that switch_to_process() will always return \c MUSE_TRUE,
- * - i.e. it will either block indefinitely or successfuly switch to the
- * given process.
+ * Returns \c MUSE_TRUE when the current process gets to run again.
  */
 muse_boolean switch_to_process( muse_env *env, muse_process_frame_t *process )
 {
-SWITCH_TO_PROCESS:
 	if ( env->current_process == process )
-	{
-		/* We reach here only on deadlock conditions. However,
-		there may be a timeout in effect, in which case we shouldn't
-		use up CPU time just looping and should sleep like a good
-		citizen. */
-		if ( process->state_bits & MUSE_PROCESS_WAITING )
-			muse_sleep( 1000 );
-		else
-			return MUSE_TRUE;
-	}
+		return MUSE_TRUE;
+
+	muse_assert( (process->state_bits & (MUSE_PROCESS_RUNNING | MUSE_PROCESS_VIRGIN)) && !process->ready_queued );
 
-	if ( process->state_bits & (MUSE_PROCESS_RUNNING | MUSE_PROCESS_VIRGIN) )
+	/* Save current process state and switch to the given process. 
+	A dead process has no state worth saving and leaves the ring now. */
+	if ( env->current_process->state_bits == MUSE_PROCESS_DEAD || setjmp( env->current_process->jmp ) == 0 )
 	{
-		/* The process is running. Save current process state
-		and switch to the given process. */
+		if ( env->current_process->state_bits == MUSE_PROCESS_DEAD )
+		{
+			unlink_process( env->current_process );
+			if ( env->current_process->cstack.size > 0 )
+				muse_retire_cstack( env, &env->current_process->cstack );
+		}
 
-		if ( env->current_process->state_bits == MUSE_PROCESS_DEAD || setjmp( env->current_process->jmp ) == 0 )
+		env->current_process = process;
+
+		if ( env->current_process->state_bits & MUSE_PROCESS_VIRGIN )
 		{
-			env->current_process = process;
+			env->current_process->state_bits = MUSE_PROCESS_RUNNING;
 
-			if ( env->current_process->state_bits & MUSE_PROCESS_VIRGIN )
-			{
-				env->current_process->state_bits = MUSE_PROCESS_RUNNING;
+			/* Change the SP for the virgin process. */
+			g_env = env;
+			CHANGE_STACK_POINTER(env->current_process->cstack.top);
 
-				/* Change the SP for the virgin process. */
-				g_env = env;
-				CHANGE_STACK_POINTER(env->current_process->cstack.top);
+			return run_process();
+		}
+		else
+			longjmp( env->current_process->jmp, 1 );
+	} 
 
-				return run_process();
-			}
-			else
-				longjmp( env->current_process->jmp, 1 );
-		} 
+	muse_release_retired_cstack( env );
+	return MUSE_TRUE;
+}
 
-		return MUSE_TRUE;
-	}
+/**
+ * Switches to the process at the head of the ready queue. If the
+ * current process can still run, it goes to the back of the queue
+ * first, so it continues if no other process is ready. Expired timers
+ * and ready sockets are dealt with before choosing, which wakes up the 
+ * processes waiting for them. When no process can run, waits for the
+ * network and other environments until the earliest deadline.
+ *
+ * Like switch_to_process(), this returns when the current 
+ * process gets to run again.
+ */
+muse_boolean run_next_process( muse_env *env )
+{
+	muse_scheduler_t *s = &env->scheduler;
+	muse_process_frame_t *cp = env->current_process;
 
-	if ( process->state_bits & MUSE_PROCESS_WAITING )
+	if ( cp->state_bits & (MUSE_PROCESS_RUNNING | MUSE_PROCESS_VIRGIN) )
+		enqueue_ready( s, cp );
+
+	for ( ;; )
 	{
-		/* If process is waiting for a message and it got one, the
-		fn_pid would have activated the process already. If it is still
-		waiting, check the timeout value in order to resume the process. */
+		muse_int deadline_us;
+
+		muse_expire_timers( env );
+		muse_receive_worker_messages( env );
+		muse_poll_network( env );
 
-		if ( process->state_bits & MUSE_PROCESS_HAS_TIMEOUT )
+		if ( s->ready_head )
+			return switch_to_process( env, dequeue_ready(s) );
+
+		deadline_us = muse_next_deadline_us( env );
+
+		if ( deadline_us >= 0 )
+		{
+			muse_int wait_us = deadline_us - muse_elapsed_us(env->timer);
+			if ( wait_us > 0 && !muse_wait_for_network( env, wait_us ) && !muse_wait_for_worker_messages( env, wait_us ) )
+				muse_sleep( wait_us );
+		}
+		else if ( !muse_wait_for_network( env, -1 ) && !muse_wait_for_worker_messages( env, -1 ) )
 		{
-			/* Check timeout. */
-			muse_int elapsed_us = muse_elapsed_us(env->timer);
-			if ( elapsed_us >= process->timeout_us )
-				process->state_bits = MUSE_PROCESS_RUNNING;
+			/* Every process is waiting for a message that no other
+			process is around to send. */
+			muse_sleep( 1000 );
 		}
+	}
+}
+
+/**
+ * Makes the current process wait until something calls wake_process()
+ * on it, running other processes in the meantime. If \p deadline_us >= 0,
+ * the process also resumes once the environment's timer reaches it.
+ * Unlike suspend_process(), this leaves the expiry of an enclosing 
+ * with-timeout-us to the caller to check for, so that it can first
+ * undo whatever it arranged to be woken by.
+ */
+void park_process( muse_env *env, muse_int deadline_us )
+{
+	muse_process_frame_t *p = env->current_process;
 
-		if ( process->state_bits == MUSE_PROCESS_RUNNING && env->current_process != process )
-			goto SWITCH_TO_PROCESS;
+	p->state_bits = MUSE_PROCESS_WAITING;
+
+	if ( deadline_us >= 0 )
+	{
+		p->state_bits |= MUSE_PROCESS_HAS_TIMEOUT;
+		muse_schedule_timer( env, &p->wait_timer, deadline_us );
 	}
 
-	/* Can't run this one. Try the next process. */
-	process = process->next;
-	goto SWITCH_TO_PROCESS;
+	run_next_process( env );
+}
+
+/**
+ * Makes the current process wait for a message, running other
+ * processes in the meantime. If \p deadline_us >= 0, the process
+ * also resumes once the environment's timer reaches it.
+ *
+ * @see post_message()
+ */
+void suspend_process( muse_env *env, muse_int deadline_us )
+{
+	park_process( env, deadline_us );
+
+	/* The wait is cut short by the expiry of an enclosing with-timeout-us. */
+	if ( env->current_process->eval_timeout_due )
+		check_timeout( env );
 }
 
 /**
- * Goes around the processes list and returns to the same point
- * after one round-robin cycle. procrastinate() will not 
- * switch to the next process if an atomic operation is going on.
+ * Lets the processes that are ready to run have their turn before
+ * returning. procrastinate() will not switch to the next process 
+ * if an atomic operation is going on.
  */
 muse_boolean procrastinate( muse_env *env )
 {
 	if ( env->current_process->atomicity == 0 )
-		return switch_to_process( env, env->current_process->next );
+		return run_next_process( env );
 	else
 		return MUSE_TRUE;
 }
@@ -1759,8 +3106,9 @@ void yield_process( muse_env *env, int spent_attention )
 	muse_process_frame_t *p = env->current_process;
 	
 	if ( p == p->next ) {
-		if ( p->num_eval_timeouts == 0 ) return;
-		check_timeout(env);
+		if ( env->timers.count == 0 ) return;
+		muse_expire_timers(env);
+		if ( p->eval_timeout_due ) check_timeout(env);
 		return;
 	}
 
@@ -1769,10 +3117,14 @@ void yield_process( muse_env *env, int spent_attention )
 		/* Not in an atomic block. So check remaining attention. */
 		if ( p->remaining_attention <= 0 )
 		{
+			/* Let an incremental collection make some progress 
+			at every process switch. */
+			mark_slice(env);
+
 			/* Give time to the next process. */
-			if ( p->num_eval_timeouts > 0 ) check_timeout(env);
 			p->remaining_attention = p->attention;
-			switch_to_process( env, p->next );
+			run_next_process( env );
+			if ( p->eval_timeout_due ) check_timeout(env);
 		}
 		else
 			p->remaining_attention -= spent_attention;
@@ -1789,15 +3141,11 @@ muse_boolean is_main_process( muse_env *env )
 }
 
 /**
- * Removes the given process from the process ring and marks it
- * as "dead". It then switches to the next process in the ring so that
- * the ring can continue.
+ * Takes the given process out of the process ring.
  */
-muse_boolean remove_process( muse_process_frame_t *process )
+static void unlink_process( muse_process_frame_t *process )
 {
-	muse_env *env = process->env;
-
-	/* First take the process out of the ring. */
+	muse_debug_only(muse_env *env = process->env;)
 	muse_process_frame_t 
 		*prev = process->prev,
 		*next = process->next;
@@ -1814,21 +3162,46 @@ muse_boolean remove_process( muse_process_frame_t *process )
 		prev->next = next;
 	}
 
-	process->state_bits = MUSE_PROCESS_DEAD;
 	process->next = process->prev = NULL;
+}
+
+/**
+ * Removes the given process from the process ring and marks it
+ * as "dead". If it is the current process, it then switches to the
+ * next process that can run.
+ *
+ * The current process stays in the ring until the switch actually
+ * happens, because it is still running on its own C stack till then
+ * and a garbage collection in the scheduler must not free it.
+ */
+muse_boolean remove_process( muse_process_frame_t *process )
+{
+	muse_env *env = process->env;
+
+	process->state_bits = MUSE_PROCESS_DEAD;
+
+	if ( process->ready_queued )
+		unlink_ready( &env->scheduler, process );
+	muse_cancel_timer( env, &process->wait_timer );
+	forget_timeouts( env, process );
 
 	if ( env->current_process == process )
 	{
-		if ( process == next )
+		if ( process == process->next )
 		{
 			muse_assert( !"All processes exited!" );
 			exit(0); /* All processes exited! */
 		}
 		else
-			return switch_to_process( env, next );
+			return run_next_process( env );
 	}
 	else
+	{
+		unlink_process( process );
+		if ( process->cstack.size > 0 )
+			muse_release_cstack( env, &process->cstack );
 		return MUSE_TRUE;
+	}
 }
 
 /**
@@ -1902,8 +3275,10 @@ void mark_process( muse_process_frame_t *p )
 	mark_stack( env, &p->stack );
 	mark_stack( env, &p->bindings_stack );
 	mark_stack( env, &p->locals );
+	mark_overrides( env, &p->overrides );
 	muse_mark( env, p->thunk );
 	muse_mark( env, p->mailbox );
+	muse_mark_mailbox_index( env, p );
 	muse_mark_recent( env, &(p->recent) );
 }
 
@@ -1913,12 +3288,18 @@ void mark_process( muse_process_frame_t *p )
 void free_process( muse_process_frame_t *p )
 {
 	muse_clear_recent( &(p->recent) );
+	muse_destroy_mailbox_index( p );
 	destroy_stack( &p->locals );
+	free( p->overrides.keys );
+	free( p->overrides.values );
 	destroy_stack( &p->bindings_stack );
 	destroy_stack( &p->stack );
+	if ( p->cstack.size > 0 )
+		muse_release_cstack( p->env, &p->cstack );
 	free(p->traceinfo.data);
 	p->traceinfo.data = NULL;
 	p->traceinfo.size = p->traceinfo.depth = 0;
+	free(p->profile_frames.frames);
 	free(p);
 }
 
@@ -1952,6 +3333,15 @@ void leave_atomic(muse_env *env)
  * @see fn_post
  */
 void post_message( muse_process_frame_t *p, muse_cell msg )
+{
+	post_message_from( p, msg, process_id(p->env->current_process) );
+}
+
+/**
+ * Like post_message(), but for a message sent by \p from, which is
+ * the pid of a process or a handle to another environment.
+ */
+void post_message_from( muse_process_frame_t *p, muse_cell msg, muse_cell from )
 {
 	muse_env *env = p->env;
 
@@ -1961,10 +3351,12 @@ void post_message( muse_process_frame_t *p, muse_cell msg )
 
 	p->mailbox_end = msg_entry;
 
+	muse_mailbox_posted( p, msg_entry );
+
 	if ( p->state_bits & MUSE_PROCESS_WAITING )
 	{
-		if ( !(p->waiting_for_pid) || p->waiting_for_pid == process_id(env->current_process) )
-			p->state_bits = MUSE_PROCESS_RUNNING;
+		if ( p->waiting_for == from || muse_message_matches( env, msg, p->waiting_for ) )
+			wake_process( env, p );
 	}
 }
 
@@ -1973,27 +3365,75 @@ typedef struct _timeout_info_t
 	struct _timeout_info_t *prev;
 	muse_cell prevcell;
 	muse_cell id;
-	void *timer;
+	muse_int start_us;
 	muse_int timeout_us;
+	muse_boolean expired;
+	muse_timer_t timer;
+	muse_process_frame_t *process;					///< NULL once the process is gone.
+	struct _timeout_info_t *live_prev, *live_next;	///< The process' list of uncollected timeouts.
 } timeout_info_t;
 
+static void unlink_timeout( timeout_info_t *ti )
+{
+	if ( ti->live_prev )
+		ti->live_prev->live_next = ti->live_next;
+	else
+		ti->process->live_timeouts = ti->live_next;
+
+	if ( ti->live_next )
+		ti->live_next->live_prev = ti->live_prev;
+
+	ti->live_prev = ti->live_next = NULL;
+	ti->process = NULL;
+}
+
+/**
+ * Cancels the timers of all the timeouts of a process that is
+ * going away. The timeouts themselves are freed when collected.
+ */
+static void forget_timeouts( muse_env *env, muse_process_frame_t *p )
+{
+	while ( p->live_timeouts )
+	{
+		timeout_info_t *ti = p->live_timeouts;
+		muse_cancel_timer( env, &ti->timer );
+		unlink_timeout( ti );
+	}
+}
+
 static muse_cell fn_timeout_var( muse_env *env, timeout_info_t *ti, muse_cell args )
 {
 	if ( muse_doing_gc(env) )
 	{
-		muse_tock(ti->timer);
+		muse_cancel_timer( env, &ti->timer );
+		if ( ti->process )
+			unlink_timeout( ti );
 		free(ti);
 	}
 
 	return MUSE_NIL;
 }
 
+static void expire_timeout( muse_env *env, muse_timer_t *timer )
+{
+	timeout_info_t *ti = (timeout_info_t*)timer->context;
+	muse_process_frame_t *p = ti->process;
+
+	ti->expired = MUSE_TRUE;
+	p->eval_timeout_due = MUSE_TRUE;
+
+	/* Don't let it keep waiting for a message. */
+	if ( p->state_bits & MUSE_PROCESS_WAITING )
+		wake_process( env, p );
+}
+
 /**
  * Adds another level of timeout nesting.
  */
 void push_timeout( muse_env *env, muse_cell id, muse_int timeout_us )
 {
 	int sp = _spos();
+	muse_process_frame_t *p = env->current_process;
 	muse_cell sym = _builtin_symbol(MUSE_TIMEOUTVAR);
 	muse_cell curr_timeout = _symval(sym);
 	
@@ -2005,32 +3445,68 @@ void push_timeout( muse_env *env, muse_cell id, muse_int timeout_us )
 
 	next_timeout->prevcell		= curr_timeout;
 	next_timeout->id			= id;
-	next_timeout->timer			= muse_tick();
+	next_timeout->start_us		= muse_elapsed_us(env->timer);
 	next_timeout->timeout_us	= timeout_us;
+	next_timeout->timer.expire	= expire_timeout;
+	next_timeout->timer.context	= next_timeout;
+	next_timeout->process		= p;
+
+	next_timeout->live_next = p->live_timeouts;
+	if ( p->live_timeouts )
+		p->live_timeouts->live_prev = next_timeout;
+	p->live_timeouts = next_timeout;
+
+	muse_schedule_timer( env, &next_timeout->timer, next_timeout->start_us + timeout_us );
 
 	_pushdef( _builtin_symbol(MUSE_TIMEOUTVAR), muse_mk_destructor( env, (muse_nativefn_t)fn_timeout_var, next_timeout ) );
 	_unwind(sp);
 
-	env->current_process->num_eval_timeouts++;
+	p->num_eval_timeouts++;
+}
+
+/**
+ * Removes the innermost level of timeout nesting when its block
+ * completes normally. Call before unwinding the bindings made by
+ * push_timeout(). A block left through an exception keeps its timer
+ * until it expires or is collected, which is harmless because an
+ * expired timeout that is no longer in the chain is never raised.
+ */
+void pop_timeout( muse_env *env )
+{
+	muse_cell sym = _builtin_symbol(MUSE_TIMEOUTVAR);
+	muse_cell ticell = _symval(sym);
+
+	if ( ticell != sym )
+	{
+		timeout_info_t *ti = (timeout_info_t*)muse_nativefn_context( env, ticell, NULL );
+		muse_cancel_timer( env, &ti->timer );
+	}
+
+	env->current_process->num_eval_timeouts--;
 }
 
 /**
- * Checks whether any timeout has expired
- * and if so raises an exception to the effect.
+ * Raises an exception if any timeout in effect has expired.
  * The structure of the exception is -
  *		('timeout 'id given-us elapsed-us)
+ *
+ * The timer heap marks expired timeouts and sets the process'
+ * eval_timeout_due, so callers only need to check when that is set.
  */
 void check_timeout( muse_env *env )
 {
 	int sp = _spos();
 	muse_cell sym = _builtin_symbol(MUSE_TIMEOUTVAR);
 	muse_cell ticell = _symval(sym);
+
+	env->current_process->eval_timeout_due = MUSE_FALSE;
+
 	if ( ticell != sym ) {
 		timeout_info_t *ti = (timeout_info_t*)(timeout_info_t*)muse_nativefn_context( env, ticell, NULL );
 		while ( ti != NULL ) {
-			muse_int elapsed_us = muse_elapsed_us(ti->timer);
-			if ( elapsed_us >= ti->timeout_us ) {
+			if ( ti->expired ) {
 				// Timed out.
+				muse_int elapsed_us = muse_elapsed_us(env->timer) - ti->start_us;
 				int bsp = _bspos();
 				_pushdef( sym, ti->prevcell );
 				muse_raise_error( env, _builtin_symbol(MUSE_TIMEOUT), muse_list( env, "cII", ti->id, ti->timeout_us, elapsed_us ) );
@@ -2134,7 +3610,7 @@ muse_boolean muse_find_recent_item( muse_env *env, muse_int key, muse_cell *valu
 	recent_context_t *s = r->contexts.vec + r->contexts.top;
 	int i = 0, n = 0;
 	
-	while ( s >= r->contexts.vec && n < MUSE_MAX_RECENT_ITEMS ) {
+	while ( s >= r->contexts.vec && n < MUSE_MAX_RECENT_ITEMS && !s->quiet ) {
 	
 		for ( i = s->depth - 1; i >= 0 && n < MUSE_MAX_RECENT_ITEMS; --i, ++n ) {
 			recent_entry_t *e = r->entries.vec + (s->base + i % MUSE_MAX_RECENT_ITEMS);
@@ -2164,7 +3640,7 @@ recent_entry_t *muse_find_recent_lazy_item( muse_env *env )
 	recent_context_t *s = r->contexts.vec + r->contexts.top;
 	int i = 0, n = 0;
 	
-	while ( s >= r->contexts.vec && n < MUSE_MAX_RECENT_ITEMS ) {
+	while ( s >= r->contexts.vec && n < MUSE_MAX_RECENT_ITEMS && !s->quiet ) {
 	
 		for ( i = s->depth - 1; i >= 0 && n < MUSE_MAX_RECENT_ITEMS; --i, ++n ) {
 			recent_entry_t *e = r->entries.vec + (s->base + i % MUSE_MAX_RECENT_ITEMS);
@@ -2195,6 +3671,9 @@ muse_cell muse_add_recent_item( muse_env *env, muse_int key, muse_cell value )
 		recent_context_t *rc = r->contexts.vec + r->contexts.top;
 		int i = rc->base + rc->depth % MUSE_MAX_RECENT_ITEMS;
 		
+		if ( rc->quiet )
+			return value;
+
 		if ( i >= r->entries.capacity ) {
 			int newcaps = r->entries.capacity * 2;
 			r->entries.vec = (recent_entry_t*)realloc( r->entries.vec, sizeof(recent_entry_t) * newcaps );
@@ -2246,6 +3725,7 @@ static recent_context_t *muse_push_recent_scope_base( muse_env *env )
 		rc->prev = rc->base;
 		rc->top = rc->base;
 		rc->depth = 0;
+		rc->quiet = 0;
 		return rc;
 	}
 }
@@ -2280,6 +3760,29 @@ muse_cell muse_pop_recent_scope( muse_env *env, muse_int key, muse_cell value )
 	return muse_add_recent_item( env, key, value );
 }
 
+/**
+ * Used instead of muse_push_recent_scope() for closures whose
+ * bodies don't refer to recent values. Rather than a new scope, 
+ * the current one is marked so that the computation's innards
+ * don't touch it.
+ */
+void muse_push_quiet_recent_scope( muse_env *env )
+{
+	recent_t *r = &(env->current_process->recent);
+	r->contexts.vec[r->contexts.top].quiet++;
+}
+
+/**
+ * The counterpart of muse_push_quiet_recent_scope().
+ */
+muse_cell muse_pop_quiet_recent_scope( muse_env *env, muse_int key, muse_cell value )
+{
+	recent_t *r = &(env->current_process->recent);
+	muse_assert( r->contexts.vec[r->contexts.top].quiet > 0 );
+	r->contexts.vec[r->contexts.top].quiet--;
+	return muse_add_recent_item( env, key, value );
+}
+
 /**
  * Saves the current value of it and reset it to "it".
  * Returns the bindings stack pos before saving it.
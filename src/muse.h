@@ -112,19 +112,22 @@ BEGIN_MUSE_C_FUNCTIONS
  * @subsection ML_DataStructures Data structures
  *	- \ref fn_cons "cons", \ref fn_first "first", \ref fn_rest "rest", \ref fn_length "length"
  *	- \ref fn_lcons "lcons", \ref fn_lazy "lazy"
- *	- \ref Vectors "vectors"
+ *	- \ref Vectors "vectors", \ref VectorViews "vector views"
  *	- \ref Hashtables "hashtables"
+ *	- \ref PersistentMaps "persistent maps"
+ *	- \ref NumericVectors "numeric vectors"
  *	- \ref ByteArray "byte arrays"
  *	- \ref Boxes "boxes"
  *
  * @subsection ML_ListOps List operations
  *	- \ref fn_list "list", \ref fn_first "first", \ref fn_rest "rest"
  *	- \ref fn_take "take", \ref fn_drop "drop", \ref fn_nth "nth"
- *	- \ref fn_sort "sort", \ref fn_sort_inplace "sort!", \ref fn_reverse "reverse", \ref fn_reverse_inplace "reverse!"
+ *	- \ref fn_sort "sort", \ref fn_sort_inplace "sort!", \ref fn_partial_sort "partial-sort", \ref fn_reverse "reverse", \ref fn_reverse_inplace "reverse!"
  *
  * @subsection ML_HOFs Higher order and/or polymorphic functions
  *	- \ref fn_map "map", \ref fn_reduce "reduce", \ref fn_collect "collect", \ref fn_slice "slice", \ref fn_transpose "transpose", \ref fn_join "join", \ref fn_length "length"
  *	- \ref fn_andmap "andmap", \ref fn_ormap "ormap", \ref fn_for_each "for-each"
+ *	- \ref fn_memoize "memoize", \ref fn_memoize_stats "memoize-stats", \ref fn_memoize_clear "memoize-clear"
  *	- \ref fn_get "get", \ref fn_put "put" and \ref fn_put_many "put*" can work across a multitude of key-value objects
  *	  such as hashtables, vectors, modules and objects.
  *
@@ -141,7 +144,7 @@ BEGIN_MUSE_C_FUNCTIONS
  * 
  * @subsection ML_IO Input and output
  *	- \ref PortIO
- *	- \ref fn_open_file "open-file", \ref fn_memport "memport", \ref fn_close "close"
+ *	- \ref fn_open_file "open-file", \ref fn_memport "memport", \ref fn_memport_bytes "memport-bytes", \ref fn_string_builder "string-builder", \ref fn_close "close"
  * 	- \ref fn_print "print", \ref fn_write "write", \ref fn_read "read", \ref fn_read_line "read-line", \ref fn_close "close"
  *	- \ref fn_json "json", \ref fn_read_json "read-json" and \ref fn_write_json "write-json"
  *	- \ref fn_xml "xml", \ref fn_read_xml "read-xml" and \ref fn_write_xml "write-xml"
@@ -150,7 +153,8 @@ BEGIN_MUSE_C_FUNCTIONS
  *	- \ref fn_open_connection "open-connection", \ref fn_with_incoming_connections_to_port "with-incoming-connections-to-port",
  *	  \ref fn_multicast_group "multicast-group"
  *	- \ref fn_wait_for_input "wait-for-input", \ref fn_reply "reply", \ref fn_multicast_group_p "multicast-group?"
- *	- \ref fn_fetch_uri "fetch-uri", \ref fn_http_parse "http-parse", \ref fn_http_respond "http-respond"
+ *	- \ref fn_fetch_uri "fetch-uri", \ref fn_http_parse "http-parse", \ref fn_http_respond "http-respond", \ref fn_http_serve "http-serve"
+ *	- \ref fn_send_file "send-file"
  *
  * @subsection ML_Processes Processes
  *	- \ref fn_spawn "spawn", \ref fn_receive "receive", \ref syntax_atomic "atomic", \ref fn_post "post"
@@ -158,7 +162,9 @@ BEGIN_MUSE_C_FUNCTIONS
  *	- \ref fn_with_timeout_us "with-timeout-us"
  *
  * @subsection ML_Crypto Cryptographic utilities
- *	- \ref fn_sha1_hash "sha1-hash", \ref fn_md5_hash "md5-hash"
+ *	- \ref fn_sha1_hash "sha1-hash", \ref fn_sha256_hash "sha256-hash", \ref fn_md5_hash "md5-hash"
+ *	- \ref fn_hasher "hasher", \ref fn_hasher_update "hasher-update", \ref fn_hasher_finish "hasher-finish"
+ *	- \ref fn_hash_files "hash-files"
  *
  * @subsection ML_Utilities Utilities
  *	- \ref fn_launch "launch"
@@ -283,6 +289,37 @@ typedef enum { MUSE_FALSE, MUSE_TRUE } muse_boolean; /**< Ask George Boole. */
  */
 typedef muse_cell (*muse_nativefn_t)( muse_env *env, void *context, muse_cell args );
 
+/**
+ * Native functions that always evaluate all of their arguments, in order,
+ * can use this calling convention instead of muse_nativefn_t. Such a function
+ * is given its arguments already evaluated, in an array that the caller
+ * fills in place on the muse stack, so no argument list needs to be built
+ * or walked for the call. The array is only valid during the call.
+ * Missing arguments have to be detected using \p argc.
+ *
+ * Syntax, i.e. anything that evaluates its arguments selectively or
+ * not at all, must use muse_nativefn_t.
+ *
+ * @param env The muse environment that's calling the native function.
+ * @param context The context pointer in the function's muse_argv_nativefn_info_t.
+ * @param argc The number of arguments.
+ * @param argv The evaluated arguments.
+ *
+ * @see muse_mk_argv_nativefn()
+ */
+typedef muse_cell (*muse_argv_nativefn_t)( muse_env *env, void *context, int argc, muse_cell *argv );
+
+/**
+ * Describes a native function that uses the muse_argv_nativefn_t
+ * calling convention. It must live as long as the function cells
+ * made from it, which is easiest to ensure by making it static.
+ */
+typedef struct
+{
+	muse_argv_nativefn_t	fn;
+	void					*context;
+} muse_argv_nativefn_info_t;
+
 /**
  * Some builtin-symbols are provided for general use.
  * @see muse_builtin_symbol()
@@ -333,7 +370,7 @@ typedef enum
 	MUSE_HEAP_SIZE,				/**< Integer parameter giving required heap size.	*/
 	MUSE_GROW_HEAP_THRESHOLD,	/**< Percentage of heap size usage above which to grow the heap. Default = 80. */
 	MUSE_STACK_SIZE,			/**< Integer parameter giving required stack size.	*/
-	MUSE_MAX_SYMBOLS,			/**< Integer parameter giving max symbols used.		*/
+	MUSE_MAX_SYMBOLS,			/**< Integer parameter giving the number of symbols to make room for initially. More are accommodated as needed. */
 	MUSE_DISCARD_DOC,			/**< Boolean parameter indicating that documentation should not be kept. Default = MUSE_FALSE. */
 	MUSE_PRETTY_PRINT,			/**< Boolean parameter indicating whether write and print should indent their output. Default = MUSE_TRUE */
 	MUSE_TAB_SIZE,				/**< Defaults to 4. Controls pretty printed output. */
@@ -343,12 +380,42 @@ typedef enum
 	MUSE_OWN_OBJC_AUTORELEASE_POOL, /**< Creates a keeps a reference to an independent auto-release pool, which is 
 									 * released when the muSE environment is destroyed. Default is MUSE_TRUE. */
 	MUSE_ENABLE_TRACE,			/**< Default = MUSE_TRUE. Enables the collection of stack traces during execution for error detection. */
-	
+	MUSE_GENERATIONAL_GC,		/**< Boolean parameter. When MUSE_TRUE, cells that survive a collection are treated
+								 *   as an old generation and most collections only trace and sweep cells created
+								 *   since the previous collection. Default = MUSE_FALSE. */
+	MUSE_GC_SLICE_US,			/**< Integer parameter. When > 0, garbage is collected incrementally - marking is done
+								 *   in slices of at most about these many microseconds interleaved with evaluation,
+								 *   and unused cells are swept into the free list a page at a time as it drains.
+								 *   Takes precedence over MUSE_GENERATIONAL_GC. Default = 0 (stop-the-world collection). */
+	MUSE_GC_MARK_THREADS,		/**< Integer parameter. When > 1, stop-the-world collections of large heaps mark
+								 *   reachable cells using these many threads. Evaluation itself remains single
+								 *   threaded. Default = 0 (marking is done by the evaluating thread alone). */
+	MUSE_HEAP_SHRINK_COLLECTIONS, /**< Integer parameter. When > 0, the heap is shrunk after these many consecutive
+								 *   stop-the-world collections leave it less than MUSE_HEAP_SHRINK_THRESHOLD% occupied.
+								 *   Only free cells at the end of the heap can be released. Default = 0 (never shrink). */
+	MUSE_HEAP_SHRINK_THRESHOLD,	/**< Percentage of heap size usage below which a collection counts towards 
+								 *   shrinking the heap. Default = 25. */
+	MUSE_COMPILE_LAMBDAS,		/**< Boolean parameter. When MUSE_TRUE, the bodies of closures are compiled into trees
+								 *   of pre-resolved nodes when the closures are created. Default = MUSE_TRUE. */
+	MUSE_SHARED_LOCALS,			/**< Boolean parameter. When MUSE_TRUE, spawned processes don't get a copy of the values of
+								 *   all symbols. They read the main process' values instead and keep only the values
+								 *   they set themselves, so they see later changes the main process makes to symbols
+								 *   they haven't set. Default = MUSE_FALSE. */
+	MUSE_HTTP_IDLE_TIMEOUT_US,	/**< Integer parameter. How long http-serve keeps a connection open waiting for the 
+								 *   next request. Default = 15000000 (15 seconds). */
+	MUSE_HTTP_MAX_REQUESTS,		/**< Integer parameter. The number of requests http-serve answers on one connection
+								 *   before closing it. Default = 100. */
+	MUSE_HTTP_POOL_MAX_IDLE,	/**< Integer parameter. The number of idle connections that fetch-uri keeps open for reuse.
+								 *   Default = 8. */
+	MUSE_HTTP_POOL_IDLE_TIMEOUT_US, /**< Integer parameter. How long fetch-uri keeps an idle connection open for reuse.
+								 *   Default = 30000000 (30 seconds). */
+
 	MUSE_NUM_PARAMETER_NAMES	/**< Not a parameter. */
 } muse_env_parameter_name_t;
 
 MUSEAPI muse_env	*muse_init_env( const int *parameters );
 MUSEAPI void		muse_destroy_env( muse_env *env );
+MUSEAPI void		muse_snapshot_base( muse_env *env );
 /*@}*/
 
 /** @name Basic memory management */
@@ -361,6 +428,7 @@ MUSEAPI muse_cell	muse_mk_text_utf8( muse_env *env, const char *start, const cha
 MUSEAPI muse_cell	muse_mk_ctext( muse_env *env, const muse_char *start );
 MUSEAPI muse_cell	muse_mk_ctext_utf8( muse_env *env, const char *start );
 MUSEAPI muse_cell	muse_mk_nativefn( muse_env *env, muse_nativefn_t fn, void *context );
+MUSEAPI muse_cell	muse_mk_argv_nativefn( muse_env *env, const muse_argv_nativefn_info_t *info );
 MUSEAPI muse_cell	muse_mk_destructor( muse_env *env, muse_nativefn_t fn, void *context );
 MUSEAPI muse_cell	muse_mk_anon_symbol(muse_env *env);
 MUSEAPI muse_cell	muse_list( muse_env *env, const char *format, ... ); // c, i, I, f, T, t, S, s
@@ -385,6 +453,54 @@ MUSEAPI muse_int*	muse_slot( muse_env *env, int slotid );
 MUSEAPI void		muse_set_slot_cleanup_proc( muse_env *env, int slotid, muse_slot_cleanup_proc_t proc );
 /*@}*/
 
+/** @name Garbage collection telemetry */
+/*@{*/
+/**
+ * The kinds of events reported by the garbage collector.
+ * @see muse_gc_stats_t
+ */
+typedef enum
+{
+	MUSE_GC_FULL_COLLECTION,		/**< A stop-the-world collection of the whole heap. */
+	MUSE_GC_MINOR_COLLECTION,		/**< A collection of the cells created since the previous one. @see MUSE_GENERATIONAL_GC */
+	MUSE_GC_INCREMENTAL_COLLECTION,	/**< A completed incremental collection cycle. @see MUSE_GC_SLICE_US */
+	MUSE_GC_HEAP_GROWN,				/**< The heap was grown. */
+	MUSE_GC_HEAP_SHRUNK				/**< The heap was shrunk. @see MUSE_HEAP_SHRINK_COLLECTIONS */
+} muse_gc_event_t;
+
+/**
+ * Describes one garbage collection or heap resizing event. 
+ * The cell counts are left 0 for heap resizing events.
+ */
+typedef struct
+{
+	muse_gc_event_t	event;
+	muse_int		time_us;				/**< When the event ended, in microseconds since the environment was created. */
+	muse_int		pause_us;				/**< How long evaluation was stopped for. For an incremental collection, this 
+											 *   is the time taken to finish marking and doesn't include the slices. */
+	muse_int		cells_allocated;		/**< Cells allocated since the previous collection. */
+	int				cells_marked;			/**< Cells found to be in use. */
+	int				cells_freed;			/**< Cells returned to the free list. */
+	int				texts_finalized;		/**< Text cells whose contents were released. */
+	int				objects_finalized;		/**< Functional objects destroyed. */
+	int				destructors_finalized;	/**< Destructor functions run. */
+	int				heap_size_before;		/**< Heap size in cells before the event. */
+	int				heap_size;				/**< Heap size in cells after the event. */
+	int				free_cells;				/**< Free cells after the event. */
+} muse_gc_stats_t;
+
+/**
+ * Called after every garbage collection and heap resizing event. The
+ * callback is called while the collector is still active and must not
+ * allocate cells or evaluate anything.
+ */
+typedef void (*muse_gc_callback_t)( muse_env *env, void *context, const muse_gc_stats_t *stats );
+
+MUSEAPI void		muse_set_gc_callback( muse_env *env, muse_gc_callback_t callback, void *context );
+MUSEAPI int			muse_gc_history( muse_env *env, int max_events, muse_gc_stats_t *events );
+MUSEAPI muse_int	muse_process_cells_allocated( muse_env *env, muse_cell pid );
+/*@}*/
+
 /** @name Cell access */
 /*@{*/
 MUSEAPI muse_cell_t	muse_cell_type( muse_cell cell );
@@ -769,6 +885,7 @@ MUSEAPI muse_cell	muse_box_set( muse_env *env, muse_cell box, muse_cell contents
 MUSEAPI muse_cell	muse_mk_bytes( muse_env *env, size_t s );
 MUSEAPI void *		muse_bytes_data( muse_env *env, muse_cell b, size_t offset );
 MUSEAPI size_t		muse_bytes_size( muse_env *env, muse_cell b );
+MUSEAPI muse_cell	muse_mk_slice( muse_env *env, muse_cell b, size_t offset, size_t size );
 /*@}*/
 /*@}*/
 
@@ -13,6 +13,144 @@
 #include "muse_builtins.h"
 #include <stdlib.h>
 
+/**
+ * @name Pipelines
+ *
+ * map and collect on a list give a lazy list whose tail is a pipeline
+ * thunk - a lazy cell that, when forced, runs the rest of a source list
+ * through a (predicate . mapper) stage, either part of which may be (),
+ * until one of its items is accepted.
+ *
+ * Items a predicate rejects don't make any cells. When this file walks
+ * a list that ends in a pipeline thunk, it doesn't force the thunk but
+ * runs its stage in place - the next result is linked into the list
+ * ahead of the same thunk, whose cursor is moved on. So reduce, find,
+ * for-each, and map or collect over a mapped list, make just one cons
+ * cell per result and no lazy cells. The results stay in the list like
+ * those of a forced thunk, so each item is mapped only once however
+ * many times the list is walked.
+ */
+/*@{*/
+static muse_cell lazy_pipeline( muse_env *env, void *context, muse_cell args );
+
+static muse_boolean is_pipeline_thunk( muse_env *env, muse_cell c )
+{
+	return c > 0
+		&& _cellt(c) == MUSE_LAZY_CELL
+		&& _cellt(_head(c)) == MUSE_NATIVEFN_CELL
+		&& _ptr(_head(c))->fn.fn == lazy_pipeline;
+}
+
+/**
+ * Makes a pipeline thunk running the \p cursor list through \p stage.
+ * The thunk's arguments are (me stage cursor) and the cursor is
+ * advanced in place as items are read.
+ */
+static muse_cell mk_pipeline_thunk( muse_env *env, muse_cell me, muse_cell stage, muse_cell cursor )
+{
+	return _setcellt( _cons( me, _cons( me, _cons( stage, _cons( cursor, MUSE_NIL ) ) ) ), MUSE_LAZY_CELL );
+}
+
+static muse_cell pipeline_tail( muse_env *env, muse_cell list );
+
+/**
+ * Reads items from the cursor in the thunk arguments \p args until the
+ * stage accepts one, which is returned in \p out with the cursor moved
+ * past it. Returns MUSE_FALSE once the source list runs out.
+ */
+static muse_boolean pipeline_next( muse_env *env, muse_cell args, muse_cell *out )
+{
+	muse_cell stage		= _quq(_head(_tail(args)));
+	muse_cell cursor_at	= _tail(_tail(args));
+	muse_cell argcell	= _cons( MUSE_NIL, MUSE_NIL );
+	int sp = _spos();
+
+	while ( _head(cursor_at) )
+	{
+		muse_cell cursor = _quq(_head(cursor_at));
+		muse_cell value = muse_head( env, cursor );
+		_spush(value);
+
+		/* The cursor is moved on before the stage runs, as the
+		   lazy mapper always did. */
+		_seth( cursor_at, pipeline_tail( env, cursor ) );
+
+		_seth( argcell, value );
+		if ( !_head(stage) || _apply( _head(stage), argcell, MUSE_TRUE ) )
+		{
+			if ( _tail(stage) )
+			{
+				_seth( argcell, value );
+				value = _apply( _tail(stage), argcell, MUSE_TRUE );
+			}
+
+			(*out) = value;
+			return MUSE_TRUE;
+		}
+
+		_unwind(sp);
+	}
+
+	return MUSE_FALSE;
+}
+
+/**
+ * Same as muse_tail(), except that a pipeline thunk in the tail of
+ * \p list is run in place instead of being forced, linking its next
+ * result into the list ahead of the thunk.
+ */
+static muse_cell pipeline_tail( muse_env *env, muse_cell list )
+{
+	muse_cell t = _tail(list);
+
+	if ( is_pipeline_thunk( env, t ) )
+	{
+		int sp = _spos();
+		muse_cell value;
+
+		muse_push_recent_scope(env);
+
+		if ( pipeline_next( env, _tail(t), &value ) )
+			_sett( list, _cons( value, t ) );
+		else
+			_sett( list, MUSE_NIL );
+
+		muse_pop_recent_scope( env, 0, MUSE_NIL );
+		_unwind(sp);
+		return _tail(list);
+	}
+
+	return muse_tail( env, list );
+}
+
+static muse_cell lazy_pipeline( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell value;
+
+	/* Since only lazy_pipeline can generate a call to itself,
+	   we know exactly what args looks like and can reuse it. */
+	muse_push_recent_scope(env);
+
+	if ( pipeline_next( env, args, &value ) )
+		return muse_pop_recent_scope( env, 0, _cons( value, _setcellt( _cons( _quq(_head(args)), args ), MUSE_LAZY_CELL ) ) );
+	else
+		return muse_pop_recent_scope( env, 0, MUSE_NIL );
+}
+
+/**
+ * Implements map and collect over a list by running it through a
+ * (predicate . mapper) stage. The first result is computed right away,
+ * as map has always done.
+ */
+static muse_cell list_pipeline( muse_env *env, muse_cell list, muse_cell predicate, muse_cell mapper )
+{
+	if ( !list )
+		return MUSE_NIL;
+
+	return lazy_pipeline( env, NULL, _tail( mk_pipeline_thunk( env, _mk_nativefn( lazy_pipeline, NULL ), _cons( predicate, mapper ), list ) ) );
+}
+/*@}*/
+
 static muse_cell list_iterator( muse_env *env, void *self, muse_iterator_callback_t callback, void *context )
 {
 	muse_cell list = (muse_cell)(size_t)self;
@@ -26,7 +164,7 @@ static muse_cell list_iterator( muse_env *env, void *self, muse_iterator_callbac
 		if ( cont == MUSE_FALSE )
 			return list;
 		
-		list = muse_tail(env,list);
+		list = pipeline_tail(env,list);
 	}	
 	
 	return MUSE_NIL;
@@ -91,41 +229,6 @@ muse_cell fn_length( muse_env *env, void *context, muse_cell args )
 	return MUSE_NIL;
 }
 
-static muse_cell lazy_mapper( muse_env *env, void *context, muse_cell args )
-{
-	muse_cell orig, me, fn, list;
-
-	orig = args; /**< Since only lazy_mapper can generate a call to itself,
-								we know exactly what args looks like and can reuse
-								it for each subsequent call. */
-	me = _quq(_head(args)); args = _tail(args);
-	fn = _quq(_head(args)); args = _tail(args);
-	list = _quq(_head(args));
-	
-	if ( list ) {
-		muse_cell h = muse_head( env, list );
-		_spush(h);
-		_seth( args, muse_tail( env, list ) );
-		return _cons( _apply( fn, _cons( h, MUSE_NIL ), MUSE_TRUE ), 
-		             _setcellt( _cons( me, orig ), MUSE_LAZY_CELL ) );
-	} else {
-		return MUSE_NIL;
-	}
-}
-
-static muse_cell list_map( muse_env *env, muse_cell list, muse_cell fn, muse_cell h, muse_cell t )
-{
-	if ( list )
-	{
-		muse_cell lm = _mk_nativefn( lazy_mapper, NULL ); 
-		return lazy_mapper( env, NULL, _cons( lm, _cons( fn, _cons( list, MUSE_NIL ) ) ) );
-	}
-	else
-	{
-		return h;
-	}
-}
-
 /**
  * @code (map fn obj) @endcode
  * The object can be a list, vector or hashtable and the return value will
@@ -160,7 +263,7 @@ muse_cell fn_map( muse_env *env, void *context, muse_cell args )
 	if ( _cellt(obj) == MUSE_CONS_CELL )
 	{
 		/* Map being done on a list. */
-		return muse_pop_recent_scope( env, (muse_int)fn_map, list_map( env, obj, fn, MUSE_NIL, MUSE_NIL ) );
+		return muse_pop_recent_scope( env, (muse_int)fn_map, list_pipeline( env, obj, MUSE_NIL, fn ) );
 	}
 	else
 	{
@@ -268,48 +371,6 @@ muse_cell fn_join( muse_env *env, void *context, muse_cell args )
 	
 }
 
-static muse_cell lazy_collect( muse_env *env, void *context, muse_cell args )
-{
-	muse_cell orig, me, predicate, mapper, list;
-
-	orig = args; /**< Since only lazy_collect can generate a call to itself,
-	                            we know exactly what args looks like and we can reuse it. */
-	me = _quq(_head(args)); args = _tail(args);
-	predicate = _quq(_head(args)); args = _tail(args);
-	mapper = _quq(_head(args)); args = _tail(args);
-	list = _quq(_head(args));
-
-	if ( list ) {
-		muse_cell thing = _cons( muse_head(env,list), MUSE_NIL );
-		muse_cell lazy_tail = _setcellt( _cons( me, orig ), MUSE_LAZY_CELL );
-		muse_push_recent_scope(env);
-		if ( !predicate || _apply( predicate, thing, MUSE_TRUE ) ) {
-			if ( mapper )
-				_seth( thing, _apply( mapper, thing, MUSE_TRUE ) );
-			_seth( args, muse_tail(env,list) );
-			return muse_pop_recent_scope( env, 0, _cons( _head(thing), lazy_tail ) );
-		} else {
-			_seth( args, muse_tail(env,list) );
-			return muse_pop_recent_scope( env, 0, lazy_tail );
-		}
-	} else {
-		return MUSE_NIL;
-	}
-}
-
-static muse_cell list_collect( muse_env *env, muse_cell list, muse_cell predicate, muse_cell mapper, muse_cell h, muse_cell t )
-{
-	if ( list )
-	{
-		muse_cell lc = _mk_nativefn( lazy_collect, NULL );
-		return lazy_collect( env, NULL, _cons( lc, _cons( predicate, _cons( mapper, _cons( list, MUSE_NIL )))) );
-	}
-	else
-	{
-		return h;
-	}
-}
-
 /**
  * @code (collect obj predicate mapper [reduction-fn]) @endcode
  * EXPERIMENTAL
@@ -352,7 +413,7 @@ muse_cell fn_collect( muse_env *env, void *context, muse_cell args )
 
 	if ( _cellt(obj) == MUSE_CONS_CELL )
 	{
-		return muse_pop_recent_scope( env, (muse_int)fn_collect, list_collect( env, obj, predicate, mapper, MUSE_NIL, MUSE_NIL ) );
+		return muse_pop_recent_scope( env, (muse_int)fn_collect, list_pipeline( env, obj, predicate, mapper ) );
 	}
 	else
 	{
@@ -366,24 +427,23 @@ muse_cell fn_collect( muse_env *env, void *context, muse_cell args )
 	return muse_pop_recent_scope( env, (muse_int)fn_collect, MUSE_NIL );
 }
 
+typedef struct
+{
+	muse_cell reduction_fn;
+	muse_cell acc; /**< A cell holding the accumulator so that it stays on the stack. */
+} list_reduce_t;
+
+static muse_boolean list_reducer( muse_env *env, void *self, list_reduce_t *info, muse_cell thing )
+{
+	_seth( info->acc, _apply( info->reduction_fn, _cons( _head(info->acc), _cons( thing, MUSE_NIL ) ), MUSE_TRUE ) );
+	return MUSE_TRUE;
+}
+
 static muse_cell list_reduce( muse_env *env, muse_cell obj, muse_cell reduction_fn, muse_cell acc )
 {
-	if ( obj )
-	{
-		{
-			int sp = _spos();
-			
-			_spush(acc);
-			
-			acc = _apply( reduction_fn, _cons( acc, _cons( muse_head(env,obj), MUSE_NIL ) ), MUSE_TRUE );
-		
-			_unwind(sp);
-		}
-		
-		return list_reduce( env, muse_tail(env,obj), reduction_fn, acc );
-	}
-	else
-		return acc;
+	list_reduce_t info = { reduction_fn, _cons( acc, MUSE_NIL ) };
+	list_iterator( env, (void*)(size_t)obj, (muse_iterator_callback_t)list_reducer, &info );
+	return _head(info.acc);
 }
 
 /**
@@ -673,6 +733,8 @@ static muse_cell list_slice( muse_env *env, muse_cell list, muse_cell argv )
  * index range is possible.
  *
  * Currently slicing is supported for lists and vectors.
+ * To work on a range of a vector without copying it, use
+ * \ref fn_vector_view "vector-view" instead.
  *
  * Note that this is an "eager evaluation" optimization. 
  * You can also achieve slicing for vectors and hashtables 
@@ -699,12 +761,47 @@ muse_cell fn_slice( muse_env *env, void *context, muse_cell args )
 	}
 }
 
-static muse_cell column_generator( muse_env *env, muse_cell *rows, int i, muse_boolean *eol )
+/**
+ * Gives the number of elements a row of a matrix given to transpose has,
+ * if it is a collection such as a vector or a vector view, or -1 if the
+ * row is a list.
+ */
+static int row_length( muse_env *env, muse_cell row )
+{
+	if ( _cellt(row) != MUSE_CONS_CELL && row )
+	{
+		muse_functional_object_t *obj = NULL;
+		muse_monad_view_t *monad = get_monad_view( env, row, &obj );
+		if ( monad && monad->size )
+			return (int)_intvalue( monad->size( env, obj ) );
+	}
+
+	return -1;
+}
+
+typedef struct
+{
+	muse_cell rows;
+	int column;
+} column_info_t;
+
+static muse_cell column_generator( muse_env *env, column_info_t *info, int i, muse_boolean *eol )
 {
-	if ( *rows ) {
-		muse_cell c = muse_head(env,muse_head(env,*rows));
-		_seth( *rows, muse_tail(env,muse_head(env,*rows)) );
-		(*rows) = muse_tail(env,*rows);
+	if ( info->rows ) {
+		muse_cell row = muse_head(env,info->rows);
+		int length = row_length( env, row );
+		muse_cell c = MUSE_NIL;
+
+		if ( length < 0 ) {
+			c = muse_head(env,row);
+			_seth( info->rows, muse_tail(env,row) );
+		} else if ( info->column < length ) {
+			/* Only the element in this column is fetched, so a view
+			of a large vector doesn't get copied. */
+			c = _apply( row, _cons( _mk_int(info->column), MUSE_NIL ), MUSE_TRUE );
+		}
+
+		info->rows = muse_tail(env,info->rows);
 		(*eol) = MUSE_FALSE;
 		return c;
 	} else {
@@ -715,10 +812,15 @@ static muse_cell column_generator( muse_env *env, muse_cell *rows, int i, muse_b
 
 static muse_cell transpose_generator( muse_env *env, muse_cell *rows, int i, muse_boolean *eol )
 {
-	if ( _head(*rows) ) {
-		muse_cell row = *rows;
+	muse_cell first = _head(*rows);
+	int length = row_length( env, first );
+
+	if ( length < 0 ? (first != MUSE_NIL) : (i < length) ) {
+		column_info_t info;
+		info.rows = *rows;
+		info.column = i;
 		(*eol) = MUSE_FALSE;
-		return muse_generate_list( env, (muse_list_generator_t)column_generator, &row );
+		return muse_generate_list( env, (muse_list_generator_t)column_generator, &info );
 	} else {
 		(*eol) = MUSE_TRUE;
 		return MUSE_NIL;
@@ -730,7 +832,8 @@ static muse_cell transpose_generator( muse_env *env, muse_cell *rows, int i, mus
  * 
  * Treats the given lists like the rows of a matrix, transposes
  * the lists and returns a list of the rows of the transposed
- * matrix.
+ * matrix. The rows can also be vectors or \ref VectorViews "vector views",
+ * whose elements are fetched one at a time without copying the rows.
  * 
  * For example -
  * @code
@@ -11,18 +11,313 @@
 
 #include "muse_builtins.h"
 #include <stdlib.h>
+#include <memory.h>
 
-typedef struct _sort_property_t
+/**
+ * @name Sorting
+ *
+ * All the sorts are stable - objects whose properties compare equal
+ * stay in the order they were in. The properties are looked at once
+ * before sorting. If they are all integers or all floats, they are
+ * turned into 64-bit keys that order the same way and radix sorted.
+ * If they are all texts, they're merge sorted by comparing the texts
+ * directly. Otherwise they're merge sorted using the usual object
+ * ordering.
+ */
+/*@{*/
+
+typedef unsigned long long sort_key_t;
+
+enum { SORT_ANY, SORT_INTS, SORT_FLOATS, SORT_TEXTS };
+
+/** Sorts of fewer items than this are done by insertion. */
+#define SORT_INSERTION_MAX	16
+
+/** Number keys are radix sorted only when there are at least this many. */
+#define SORT_RADIX_MIN		64
+
+typedef struct _sort_item_t
+{
+	union
+	{
+		sort_key_t		bits;	/**< Key of an int or float property. */
+		const muse_char	*text;	/**< Text of a text property. */
+	} key;
+	muse_cell	cell;
+	muse_cell	pty;
+	int			index;			/**< Original position, to break ties. */
+} sort_item_t;
+
+typedef struct
+{
+	muse_env	*env;
+	int			kind;
+} sort_info_t;
+
+/**
+ * Works out the kind of the properties and computes the
+ * keys that go with it.
+ */
+static int sort_prepare_keys( muse_env *env, sort_item_t *items, int n )
+{
+	int kind = SORT_ANY, i;
+	int celltype;
+
+	if ( n == 0 || !items[0].pty )
+		return SORT_ANY;
+
+	celltype = _cellt(items[0].pty);
+	switch ( celltype )
+	{
+	case MUSE_INT_CELL		: kind = SORT_INTS; break;
+	case MUSE_FLOAT_CELL	: kind = SORT_FLOATS; break;
+	case MUSE_TEXT_CELL		: kind = SORT_TEXTS; break;
+	default					: return SORT_ANY;
+	}
+
+	for ( i = 0; i < n; ++i )
+	{
+		muse_cell p = items[i].pty;
+
+		if ( !p || _cellt(p) != celltype )
+			return SORT_ANY;
+
+		switch ( kind )
+		{
+		case SORT_INTS:
+			/* Flipping the sign bit orders them as unsigned numbers. */
+			items[i].key.bits = (sort_key_t)_ptr(p)->i ^ ((sort_key_t)1 << 63);
+			break;
+		case SORT_FLOATS:
+			{
+				muse_float f = _ptr(p)->f;
+				sort_key_t bits = 0;
+
+				/* -0.0 and 0.0 compare equal, so give them the same key. */
+				if ( f != 0.0 )
+					memcpy( &bits, &f, sizeof(bits) );
+
+				/* Negative floats order backwards by their bits. */
+				items[i].key.bits = (bits >> 63) ? ~bits : (bits ^ ((sort_key_t)1 << 63));
+			}
+			break;
+		case SORT_TEXTS:
+			items[i].key.text = _ptr(p)->text.start;
+			break;
+		}
+	}
+
+	return kind;
+}
+
+/**
+ * Orders two items by their properties, and by their original
+ * positions if their properties are equal.
+ */
+static int sort_order( const sort_info_t *info, const sort_item_t *a, const sort_item_t *b )
+{
+	int c;
+
+	switch ( info->kind )
+	{
+	case SORT_INTS:
+	case SORT_FLOATS:	c = (a->key.bits > b->key.bits) - (a->key.bits < b->key.bits); break;
+	case SORT_TEXTS:	c = wcscmp( a->key.text, b->key.text ); break;
+	default:			c = muse_compare( info->env, a->pty, b->pty ); break;
+	}
+
+	return c ? c : (a->index - b->index);
+}
+
+static void insertion_sort( const sort_info_t *info, sort_item_t *items, int n )
+{
+	int i, j;
+
+	for ( i = 1; i < n; ++i )
+	{
+		sort_item_t x = items[i];
+
+		for ( j = i; j > 0 && sort_order( info, items + j - 1, &x ) > 0; --j )
+			items[j] = items[j-1];
+
+		items[j] = x;
+	}
+}
+
+/**
+ * Sorts the items using \p tmp, which has room for
+ * as many items, as scratch space.
+ */
+static void merge_sort( const sort_info_t *info, sort_item_t *items, sort_item_t *tmp, int n )
+{
+	int mid = n / 2;
+	int i, j, k;
+
+	if ( n <= SORT_INSERTION_MAX )
+	{
+		insertion_sort( info, items, n );
+		return;
+	}
+
+	merge_sort( info, items, tmp, mid );
+	merge_sort( info, items + mid, tmp, n - mid );
+
+	/* Nothing to do if the halves are already in order. */
+	if ( sort_order( info, items + mid - 1, items + mid ) <= 0 )
+		return;
+
+	memcpy( tmp, items, sizeof(sort_item_t) * mid );
+
+	for ( i = 0, j = mid, k = 0; i < mid && j < n; ++k )
+	{
+		if ( sort_order( info, items + j, tmp + i ) < 0 )
+			items[k] = items[j++];
+		else
+			items[k] = tmp[i++];
+	}
+
+	memcpy( items + k, tmp + i, sizeof(sort_item_t) * (mid - i) );
+}
+
+/**
+ * Least significant byte first radix sort of the keys. Bytes
+ * that are the same in all the keys are skipped.
+ */
+static void radix_sort( sort_item_t *items, sort_item_t *tmp, int n )
+{
+	int counts[8][256];
+	sort_item_t *from = items, *to = tmp;
+	int i, b;
+
+	memset( counts, 0, sizeof(counts) );
+
+	for ( i = 0; i < n; ++i )
+	{
+		sort_key_t bits = items[i].key.bits;
+		for ( b = 0; b < 8; ++b )
+			++counts[b][(bits >> (8*b)) & 0xFF];
+	}
+
+	for ( b = 0; b < 8; ++b )
+	{
+		int *offsets = counts[b];
+		int sum = 0, v;
+
+		if ( offsets[(from[0].key.bits >> (8*b)) & 0xFF] == n )
+			continue;
+
+		for ( v = 0; v < 256; ++v )
+		{
+			int c = offsets[v];
+			offsets[v] = sum;
+			sum += c;
+		}
+
+		for ( i = 0; i < n; ++i )
+			to[offsets[(from[i].key.bits >> (8*b)) & 0xFF]++] = from[i];
+
+		{
+			sort_item_t *t = from;
+			from = to;
+			to = t;
+		}
+	}
+
+	if ( from != items )
+		memcpy( items, from, sizeof(sort_item_t) * n );
+}
+
+/**
+ * Sorts the items by their properties.
+ */
+static void sort_items( muse_env *env, sort_item_t *items, int n )
+{
+	sort_info_t info;
+	sort_item_t *tmp;
+
+	info.env = env;
+	info.kind = sort_prepare_keys( env, items, n );
+
+	if ( n <= SORT_INSERTION_MAX )
+	{
+		insertion_sort( &info, items, n );
+		return;
+	}
+
+	tmp = (sort_item_t*)malloc( sizeof(sort_item_t) * n );
+
+	if ( (info.kind == SORT_INTS || info.kind == SORT_FLOATS) && n >= SORT_RADIX_MIN )
+		radix_sort( items, tmp, n );
+	else
+		merge_sort( &info, items, tmp, n );
+
+	free(tmp);
+}
+
+static void heap_sift_down( const sort_info_t *info, sort_item_t *heap, int n, int i )
 {
-	muse_env *env;
-	muse_cell cell;
-	muse_cell pty;
-} sort_property_t;
+	sort_item_t x = heap[i];
+
+	for ( ;; )
+	{
+		int child = 2 * i + 1;
+
+		if ( child >= n )
+			break;
+
+		if ( child + 1 < n && sort_order( info, heap + child + 1, heap + child ) > 0 )
+			++child;
 
-static int pty_compare( const void *cell1, const void *cell2 )
+		if ( sort_order( info, heap + child, &x ) <= 0 )
+			break;
+
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = x;
+}
+
+/**
+ * Moves the first \p k items of the sorted order to the start of
+ * the array, in sorted order, without sorting the rest. Keeps the
+ * \p k least items seen so far in a heap whose root is the greatest
+ * of them, so it takes O(n log k) time. Gives the number of items
+ * selected.
+ */
+static int partial_sort_items( muse_env *env, sort_item_t *items, int n, int k )
 {
-	muse_env *env = ((sort_property_t *)cell1)->env;
-	return _compare( ((const sort_property_t *)cell1)->pty, ((const sort_property_t *)cell2)->pty );
+	sort_info_t info;
+	int i;
+
+	if ( k > n )
+		k = n;
+
+	if ( k <= 0 )
+		return 0;
+
+	info.env = env;
+	info.kind = sort_prepare_keys( env, items, n );
+
+	for ( i = k / 2 - 1; i >= 0; --i )
+		heap_sift_down( &info, items, k, i );
+
+	for ( i = k; i < n; ++i )
+	{
+		if ( sort_order( &info, items + i, items ) < 0 )
+		{
+			items[0] = items[i];
+			heap_sift_down( &info, items, k, 0 );
+		}
+	}
+
+	{
+		sort_item_t *tmp = (sort_item_t*)malloc( sizeof(sort_item_t) * k );
+		merge_sort( &info, items, tmp, k );
+		free(tmp);
+	}
+
+	return k;
 }
 
 static muse_cell listiter( muse_env *env, muse_cell *listptr, int i, muse_boolean *eol )
@@ -81,65 +376,105 @@ static muse_cell sortproplist( muse_env *env, muse_cell propfn, muse_cell list )
 	return muse_generate_list( env, (muse_list_generator_t)propiter, &pm );
 };
 
-static muse_cell sort_by_property_inplace( muse_env *env, muse_cell list, muse_cell propertyFn )
+static int is_vector( muse_env *env, muse_cell coll )
 {
-	int	sp				= _spos();
-	int	length			= _list_length(list);
-	
-	/* Allocate a vector to hold a copy of the cells
-		so that we can sort fast. */
-	sort_property_t *vec = (sort_property_t*)malloc( sizeof(sort_property_t) * length );
-	if ( !vec )
-		return MUSE_NIL;
-	
-	/* Fill the vector with the list entries. */
-	if ( propertyFn )
+	return _functional_object_data( coll, 'vect' ) || _functional_object_data( coll, 'vecv' );
+}
+
+/**
+ * Makes the items for sorting the given list or vector. The properties
+ * are kept from being collected until the stack is unwound. Gives NULL
+ * if the collection is empty.
+ */
+static sort_item_t *sort_items_of( muse_env *env, muse_cell coll, muse_cell propertyFn, int *length )
+{
+	sort_item_t *items;
+	int i;
+
+	if ( is_vector( env, coll ) )
 	{
-		int			i		= 0;
-		muse_cell	c		= list; 
-		muse_cell	p		= sortproplist( env, propertyFn, list );
+		int n = muse_vector_length( env, coll );
+		muse_cell keep = propertyFn ? muse_mk_vector( env, n ) : MUSE_NIL;
+		muse_cell argcell = _cons( MUSE_NIL, MUSE_NIL );
+		int sp = _spos();
+
+		(*length) = n;
+		if ( n == 0 )
+			return NULL;
+
+		items = (sort_item_t*)malloc( sizeof(sort_item_t) * n );
 
-		for ( ; i < length; ++i, c = _tail(c), p = _tail(p) )
+		for ( i = 0; i < n; ++i )
 		{
-			vec[i].env		= env;
-			vec[i].cell		= _head(c);
-			vec[i].pty		= _head(p);
+			items[i].cell	= muse_vector_get( env, coll, i );
+			items[i].index	= i;
+
+			if ( propertyFn )
+			{
+				_seth( argcell, items[i].cell );
+				items[i].pty = muse_vector_put( env, keep, i, _apply( propertyFn, argcell, MUSE_TRUE ) );
+			}
+			else
+			{
+				items[i].pty = items[i].cell;
+			}
+
+			_unwind(sp);
 		}
 	}
 	else
 	{
-		/*	We're not given a property function. So simply
-		compare the cell contents. */
-		int			i = 0;
-		muse_cell	c = list; 
-		for ( ; i < length; ++i, c = muse_tail(env,c) )
+		int n = _list_length(coll);
+		muse_cell c = coll;
+		muse_cell p = propertyFn ? sortproplist( env, propertyFn, coll ) : coll;
+
+		(*length) = n;
+		if ( n == 0 )
+			return NULL;
+
+		items = (sort_item_t*)malloc( sizeof(sort_item_t) * n );
+
+		/* We can use _tail() here because the list has already
+		   been eagerly evaluated (i.e. is not lazy). */
+		for ( i = 0; i < n; ++i, c = _tail(c), p = _tail(p) )
 		{
-			vec[i].env = env;
-			vec[i].cell	= vec[i].pty = muse_head(env,c);
+			items[i].cell	= _head(c);
+			items[i].pty	= _head(p);
+			items[i].index	= i;
 		}
 	}
+
+	return items;
+}
+
+static muse_cell sort_by_property_inplace( muse_env *env, muse_cell coll, muse_cell propertyFn )
+{
+	int	sp = _spos();
+	int length = 0, i;
+	sort_item_t *items = sort_items_of( env, coll, propertyFn, &length );
+
+	if ( !items )
+		return coll;
+
+	sort_items( env, items, length );
 	
-	/* Sort using the generic qsort algo. */
-	qsort( vec, length, sizeof(sort_property_t), pty_compare );
-	
-	/* Put the sorted items into the list cells. */
+	/* Put the sorted items back into the collection. */
+	if ( is_vector( env, coll ) )
 	{
-		int			i = 0;
-		muse_cell	c = list;
-		
-		/* We can use _tail(c) here because the list has already
-		   been eagerly evaluated (i.e. is not lazy). */
-		for ( ; i < length; ++i, c = _tail(c) )
-		{
-			_seth( c, vec[i].cell );
-		}
+		for ( i = 0; i < length; ++i )
+			muse_vector_put( env, coll, i, items[i].cell );
+	}
+	else
+	{
+		muse_cell c = coll;
+		for ( i = 0; i < length; ++i, c = _tail(c) )
+			_seth( c, items[i].cell );
 	}
 	
-	/* Free the temp vector. */
-	free(vec);
+	free(items);
 	
 	_unwind(sp);
-	return list;
+	return coll;
 }
 
 /**
@@ -149,7 +484,8 @@ static muse_cell sort_by_property_inplace( muse_env *env, muse_cell list, muse_c
  * The first argument is the list of objects to sort. The cells
  * in the list are replaced with the same objects in sorted order.
  * The usual object ordering is used, which will sort a numeric
- * list in ascending order. 
+ * list in ascending order. The sort is stable - objects that
+ * compare equal keep their order.
  * 
  * A propertyFn can be specified to control the sorting order.
  * The ordering of two objects in the list is determined by the
@@ -165,7 +501,9 @@ static muse_cell sort_by_property_inplace( muse_env *env, muse_cell list, muse_c
  * instead of @code (sort! ls) @endcode
  * If the list consists of lists, then you can use the propertyFn
  * to select an element of the list entries to sort by.
- * 
+ *
+ * A vector or a \ref VectorViews "vector view" can be given instead
+ * of a list, in which case its slots are sorted in place.
  */
 muse_cell fn_sort_inplace( muse_env *env, void *context, muse_cell args )
 {
@@ -174,18 +512,77 @@ muse_cell fn_sort_inplace( muse_env *env, void *context, muse_cell args )
 	return muse_add_recent_item( env, (muse_int)fn_sort_inplace, sort_by_property_inplace( env, list, propertyFn ) );
 }
 
+/**
+ * Gives a new vector with the same elements as the
+ * given vector or vector view.
+ */
+static muse_cell vectordup( muse_env *env, muse_cell vec )
+{
+	int n = muse_vector_length( env, vec );
+	muse_cell result = muse_mk_vector( env, n );
+	int i;
+
+	for ( i = 0; i < n; ++i )
+		muse_vector_put( env, result, i, muse_vector_get( env, vec, i ) );
+
+	return result;
+}
+
 /**
  * Just like fn_sort_inplace(), except that the original list
  * is not modified. A new list of the same objects in sorted
- * order is returned.
+ * order is returned. Given a vector, it returns a new vector.
  */
 muse_cell fn_sort( muse_env *env, void *context, muse_cell args )
 {
-	muse_cell	list			= listdup( env, _evalnext(&args) );
+	muse_cell	coll			= _evalnext(&args);
+	muse_cell	list			= is_vector( env, coll ) ? vectordup( env, coll ) : listdup( env, coll );
 	muse_cell	propertyFn		= args ? _evalnext(&args) : MUSE_NIL;
 	return muse_add_recent_item( env, (muse_int)fn_sort, sort_by_property_inplace( env, list, propertyFn ) );
 }
 
+/**
+ * @code (partial-sort list k [propertyFn]) @endcode
+ *
+ * Gives the first \p k objects of the list in the order \ref fn_sort "sort"
+ * would put them in, without sorting the rest of the list. That takes time
+ * proportional to n log k instead of n log n for a list of n objects. The
+ * list isn't modified. The property function works as it does for sort, so
+ * @code (partial-sort scores 10 -) @endcode gives the top 10 scores.
+ *
+ * Given a vector, it gives a vector of the first \p k objects.
+ */
+muse_cell fn_partial_sort( muse_env *env, void *context, muse_cell args )
+{
+	int			sp				= _spos();
+	muse_cell	coll			= _evalnext(&args);
+	int			k				= (int)_intvalue(_evalnext(&args));
+	muse_cell	propertyFn		= args ? _evalnext(&args) : MUSE_NIL;
+	int			length			= 0, i;
+	sort_item_t	*items			= sort_items_of( env, coll, propertyFn, &length );
+	muse_cell	result			= MUSE_NIL;
+
+	k = items ? partial_sort_items( env, items, length, k ) : 0;
+
+	if ( is_vector( env, coll ) )
+	{
+		result = muse_mk_vector( env, k );
+		for ( i = 0; i < k; ++i )
+			muse_vector_put( env, result, i, items[i].cell );
+	}
+	else
+	{
+		for ( i = k - 1; i >= 0; --i )
+			result = _cons( items[i].cell, result );
+	}
+
+	free(items);
+
+	_unwind(sp);
+	return muse_add_recent_item( env, (muse_int)fn_partial_sort, result );
+}
+
+/*@}*/
 
 /**
  * @code (reverse list) @endcode
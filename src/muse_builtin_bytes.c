@@ -17,6 +17,17 @@
 #include <memory.h>
 #include <limits.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define MUSE_BYTES_SSE2 1
+#	include <emmintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+		static __inline int lowest_bit( unsigned int m ) { unsigned long i; _BitScanForward( &i, m ); return (int)i; }
+#	else
+#		define lowest_bit(m) __builtin_ctz(m)
+#	endif
+#endif
+
 /** @addtogroup FunctionalObjects */
 /*@{*/
 /**
@@ -30,6 +41,12 @@
  * You can access portions of a byte array by using the array
  * object itself as a function (\ref fn_bytes_fn) and copy
  * sections using \ref fn_copy_bytes "copy-bytes".
+ *
+ * For bulk work there are \ref fn_bytes_find "bytes-find",
+ * \ref fn_bytes_compare "bytes-compare", \ref fn_bytes_fill "bytes-fill!",
+ * \ref fn_bytes_xor "bytes-xor!", hex and base64 conversions and
+ * \ref fn_bytes_unpack "bytes-unpack", all of which work in place on the
+ * data of the byte array or slice.
  */
 /*@{*/
 
@@ -39,6 +56,7 @@ typedef struct
 	muse_int size;
 	unsigned char *bytes;
 	muse_cell ref; /**< The bytes object to the data of which this one refers. */
+	void (*release)( unsigned char *bytes, muse_int size ); /**< Gives back data not allocated by us, such as a mapped file. */
 } bytes_t;
 
 /**
@@ -57,6 +75,7 @@ unsigned char *bytes_ptr( muse_env *env, muse_cell b );
 void bytes_set_size( muse_env *env, muse_cell b, muse_int size );
 #define _mk_slice(b,offset,size) mk_slice(env,b,offset,size)
 static muse_cell mk_slice( muse_env *env, muse_cell b, muse_int offset, muse_int size );
+muse_cell mk_foreign_bytes( muse_env *env, unsigned char *bytes, muse_int size, void (*release)( unsigned char *bytes, muse_int size ) );
 static void bytes_init( muse_env *env, void *ptr, muse_cell args );
 static void bytes_mark( muse_env *env, void *ptr );
 static void bytes_destroy( muse_env *env, void *ptr );
@@ -91,6 +110,7 @@ static muse_format_view_t g_bytes_format_view =
 static bytes_t *bytes_alloc( bytes_t *b, muse_int size )
 {
 	b->size = size;
+	b->release = NULL;
 	if ( size > 0 )
 		b->bytes = (unsigned char *)calloc( (size_t)size, 1 );
 	return b;
@@ -100,7 +120,10 @@ static void bytes_free( bytes_t *b )
 {
 	if ( b->bytes )
 	{
-		free(b->bytes);
+		if ( b->release )
+			b->release( b->bytes, b->size );
+		else
+			free(b->bytes);
 		b->bytes = NULL;
 		b->size = 0;
 	}
@@ -120,6 +143,22 @@ muse_cell mk_bytes( muse_env *env, muse_int size )
 	return bytes;
 }
 
+/**
+ * Makes a bytes object of memory that we didn't allocate, such as a
+ * mapped file, which \p release gives back once the object and all
+ * slices of it are no longer in use.
+ */
+muse_cell mk_foreign_bytes( muse_env *env, unsigned char *bytes, muse_int size, void (*release)( unsigned char *bytes, muse_int size ) )
+{
+	muse_cell cell = _mk_functional_object( &g_bytes_type, MUSE_NIL );
+	bytes_t *b = _bytes_data(cell);
+	b->ref		= cell;
+	b->size		= size;
+	b->bytes	= bytes;
+	b->release	= release;
+	return cell;
+}
+
 unsigned char *bytes_ptr( muse_env *env, muse_cell b )
 {
 	return _bytes_data(b)->bytes;
@@ -231,7 +270,7 @@ static int int_BE( const unsigned char *bytes )
 	return i;
 }
 
-static int int_LE( const unsigned char *bytes )
+int int_LE( const unsigned char *bytes )
 {
 	int i = bytes[3];
 	i = (i << 8) | bytes[2];
@@ -253,7 +292,7 @@ static muse_int long_BE( const unsigned char *bytes )
 	return i;
 }
 
-static muse_int long_LE( const unsigned char *bytes )
+muse_int long_LE( const unsigned char *bytes )
 {
 	muse_int i = bytes[7];
 	i = (i << 8) | bytes[6];
@@ -286,7 +325,7 @@ static void put_int_BE( unsigned char *bytes, int i )
 	bytes[3] = (unsigned char)(i & 0xFF);
 }
 
-static void put_int_LE( unsigned char *bytes, int i )
+void put_int_LE( unsigned char *bytes, int i )
 {
 	bytes[3] = (unsigned char)((i >> 24) & 0xFF);
 	bytes[2] = (unsigned char)((i >> 16) & 0xFF);
@@ -306,7 +345,7 @@ static void put_long_BE( unsigned char *bytes, muse_int i )
 	bytes[7] = (unsigned char)(i & 0xFF);
 }
 
-static void put_long_LE( unsigned char *bytes, muse_int i )
+void put_long_LE( unsigned char *bytes, muse_int i )
 {
 	bytes[7] = (unsigned char)((i >> 56) & 0xFF);
 	bytes[6] = (unsigned char)((i >> 48) & 0xFF);
@@ -318,6 +357,48 @@ static void put_long_LE( unsigned char *bytes, muse_int i )
 	bytes[0] = (unsigned char)(i & 0xFF);
 }
 
+/**
+ * Gives the size in bytes of the named field type,
+ * or 0 if it isn't one of the field types.
+ */
+static int field_size( const muse_char *name )
+{
+	static const struct { const muse_char *name; int size; } k_fields[] =
+	{
+		{ L"byte", 1 }, { L"short", 2 }, { L"int", 4 }, { L"long", 8 }, { L"float", 4 }, { L"double", 8 },
+		{ L"Short", 2 }, { L"Int", 4 }, { L"Long", 8 }, { NULL, 0 }
+	};
+	int i;
+
+	for ( i = 0; k_fields[i].name; ++i )
+	{
+		if ( wcscmp( name, k_fields[i].name ) == 0 )
+			return k_fields[i].size;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads the field of the type whose name starts with \p type at \p bytes.
+ */
+static muse_cell get_field( muse_env *env, muse_char type, const unsigned char *bytes )
+{
+	switch ( type )
+	{
+	case 'b': return _mk_int( (char)bytes[0] );
+	case 's': return _mk_int( short_LE( bytes ) );
+	case 'i': return _mk_int( int_LE( bytes ) );
+	case 'l': return _mk_int( long_LE( bytes ) );
+	case 'f': { float f; memcpy( &f, bytes, sizeof(f) ); return _mk_float( f ); }
+	case 'd': { double d; memcpy( &d, bytes, sizeof(d) ); return _mk_float( d ); }
+	case 'S': return _mk_int( short_BE( bytes ) );
+	case 'I': return _mk_int( int_BE( bytes ) );
+	case 'L': return _mk_int( long_BE( bytes ) );
+	default	: return MUSE_NIL;
+	}
+}
+
 /**
  * @code (bytes-object byte-offset field-type [value]) @endcode
  *
@@ -451,19 +532,7 @@ muse_cell fn_bytes_fn( muse_env *env, bytes_t *b, muse_cell args )
 			else
 			{
 				/* We're getting a value. */
-
-				switch ( name[0] )
-				{
-				case 'b': return _mk_int( (char)b->bytes[(size_t)offset] );
-				case 's': return _mk_int( short_LE( b->bytes + (size_t)offset ) );
-				case 'i': return _mk_int( int_LE( b->bytes + (size_t)offset ) );
-				case 'l': return _mk_int( long_LE( b->bytes + (size_t)offset ) );
-				case 'f': return _mk_float( ((float*)(b->bytes + (size_t)offset))[0] );
-				case 'd': return _mk_float( ((double*)(b->bytes + (size_t)offset))[0] );
-				case 'S': return _mk_int( short_BE( b->bytes + (size_t)offset ) );
-				case 'I': return _mk_int( int_BE( b->bytes + (size_t)offset ) );
-				case 'L': return _mk_int( long_BE( b->bytes + (size_t)offset ) );
-				}
+				return get_field( env, name[0], b->bytes + (size_t)offset );
 			}
 		}
 		break;
@@ -609,12 +678,15 @@ static size_t port_read_force( muse_env *env, unsigned char *buffer, size_t size
 }
 
 /**
- * @code (read-bytes [port] [bytes]) -> bytes @endcode
+ * @code (read-bytes [port] [bytes-or-size]) -> bytes @endcode
  *
  * Reads raw bytes from the given port or stdin. If a bytes
- * object is given, it attempts to fill it. If no bytes object
- * is given, it reads from the port until eof and returns a
- * new bytes object containing the data.
+ * object is given, it attempts to fill it. If a size is given, it
+ * reads at most that many bytes. Otherwise, it reads from the port
+ * until eof and returns a new bytes object containing the data.
+ *
+ * From a file opened with @code 'mapped @endcode, the bytes aren't
+ * copied - a new bytes object is a slice of the mapped file.
  *
  * Supports \ref fn_the "the"
  */
@@ -639,7 +711,13 @@ muse_cell fn_read_bytes( muse_env *env, void *context, muse_cell args )
 		}
 	}
 
-	if ( bytes_arg )
+	if ( _cellt(bytes_arg) == MUSE_INT_CELL )
+	{
+		max_bytes = _intvalue(bytes_arg);
+		if ( max_bytes < 0 )
+			max_bytes = 0;
+	}
+	else if ( bytes_arg )
 	{
 		result = _bytes_data(bytes_arg);
 	}
@@ -650,6 +728,31 @@ muse_cell fn_read_bytes( muse_env *env, void *context, muse_cell args )
 	if ( port_eof(p) || max_bytes == 0 )
 		return muse_add_recent_item( env, (muse_int)fn_read_bytes, MUSE_NIL );
 
+	if ( !result )
+	{
+		muse_int offset = 0;
+		muse_cell mapping = fileport_mapping( p, &offset );
+
+		if ( mapping )
+		{
+			muse_int size = _bytes_data(mapping)->size - offset;
+			muse_cell slice = MUSE_NIL;
+
+			if ( max_bytes >= 0 && max_bytes < size )
+				size = max_bytes;
+
+			if ( size > 0 )
+			{
+				slice = _mk_slice( mapping, offset, size );
+				port_skip( (size_t)size, p );
+			}
+			else
+				port_skip( 1, p ); /* Reaches the end. */
+
+			return muse_add_recent_item( env, (muse_int)fn_read_bytes, slice );
+		}
+	}
+
 	{
 		int chunkSize = 4096;
 		int maxChunks = 1;
@@ -811,6 +914,494 @@ muse_cell fn_with_bytes_as_port( muse_env *env, void *context, muse_cell args )
 	}
 }
 
+/**
+ * @name Bulk operations
+ *
+ * These work directly on the data of a bytes object or slice, without
+ * copying it out, so that parsing a protocol or a file format doesn't
+ * have to loop over the bytes one at a time in muSE code.
+ */
+/*@{*/
+
+static bytes_t *bytes_arg( muse_env *env, muse_cell b )
+{
+	bytes_t *data = _bytes_data(b);
+
+	if ( !data )
+		muse_raise_error( env, _csymbol(L"error:bytes-expected"), _cons( b, MUSE_NIL ) );
+
+	return data;
+}
+
+/**
+ * Gives the first occurrence of \p needle in \p hay, or NULL. Where SSE2
+ * is available, 16 positions at a time are checked for the needle's first
+ * and last bytes and only those that match both are compared in full.
+ */
+static const unsigned char *find_bytes( const unsigned char *hay, size_t n, const unsigned char *needle, size_t m )
+{
+	const unsigned char *last;
+
+	if ( m == 0 )
+		return hay;
+
+	if ( m > n )
+		return NULL;
+
+	if ( m == 1 )
+		return (const unsigned char *)memchr( hay, needle[0], n );
+
+#ifdef MUSE_BYTES_SSE2
+	{
+		const __m128i first_byte = _mm_set1_epi8( (char)needle[0] );
+		const __m128i last_byte = _mm_set1_epi8( (char)needle[m-1] );
+		size_t i = 0, npos = n - m + 1;
+
+		for ( ; i + 16 <= npos; i += 16 )
+		{
+			__m128i a = _mm_loadu_si128( (const __m128i*)(hay + i) );
+			__m128i z = _mm_loadu_si128( (const __m128i*)(hay + i + m - 1) );
+			unsigned int mask = (unsigned int)_mm_movemask_epi8( _mm_and_si128( _mm_cmpeq_epi8( a, first_byte ), _mm_cmpeq_epi8( z, last_byte ) ) );
+
+			while ( mask )
+			{
+				size_t at = i + lowest_bit(mask);
+				if ( memcmp( hay + at + 1, needle + 1, m - 2 ) == 0 )
+					return hay + at;
+				mask &= mask - 1;
+			}
+		}
+
+		hay += i;
+		n -= i;
+	}
+#endif
+
+	for ( last = hay + (n - m); hay <= last; ++hay )
+	{
+		hay = (const unsigned char *)memchr( hay, needle[0], (size_t)(last - hay) + 1 );
+
+		if ( !hay )
+			return NULL;
+
+		if ( memcmp( hay + 1, needle + 1, m - 1 ) == 0 )
+			return hay;
+	}
+
+	return NULL;
+}
+
+/**
+ * @code (bytes-find bytes needle [start-offset]) @endcode
+ *
+ * Gives the offset of the first occurrence of \p needle in \p bytes
+ * at or after \p start-offset, or () if there is none. The \p needle
+ * can be a byte value, a bytes object or a string, which is looked
+ * for in its UTF-8 form.
+ */
+muse_cell fn_bytes_find( muse_env *env, void *context, muse_cell args )
+{
+	bytes_t *hay		= bytes_arg( env, _evalnext(&args) );
+	muse_cell needle	= _evalnext(&args);
+	muse_int start		= args ? _intvalue(_evalnext(&args)) : 0;
+	unsigned char byte;
+	const unsigned char *n = NULL, *found = NULL;
+	unsigned char *utf8 = NULL;
+	size_t m = 0;
+
+	if ( start < 0 || start > hay->size )
+		return MUSE_NIL;
+
+	if ( _cellt(needle) == MUSE_INT_CELL ) {
+		byte = (unsigned char)_intvalue(needle);
+		n = &byte;
+		m = 1;
+	} else if ( _cellt(needle) == MUSE_TEXT_CELL ) {
+		int len = 0;
+		const muse_char *str = muse_text_contents( env, needle, &len );
+		m = muse_utf8_size( str, len );
+		utf8 = (unsigned char*)malloc( m + 1 );
+		m = muse_unicode_to_utf8( (char*)utf8, m + 1, str, len );
+		n = utf8;
+	} else {
+		bytes_t *nb = bytes_arg( env, needle );
+		n = nb->bytes;
+		m = (size_t)nb->size;
+	}
+
+	found = find_bytes( hay->bytes + (size_t)start, (size_t)(hay->size - start), n, m );
+	free( utf8 );
+
+	return found ? _mk_int( found - hay->bytes ) : MUSE_NIL;
+}
+
+/**
+ * @code (bytes-compare a b) @endcode
+ *
+ * Compares the two byte arrays byte by byte as unsigned numbers and
+ * gives -1, 0 or 1 according as \p a is less than, the same as or more
+ * than \p b. If one is a prefix of the other, the shorter one is less.
+ */
+muse_cell fn_bytes_compare( muse_env *env, void *context, muse_cell args )
+{
+	bytes_t *a = bytes_arg( env, _evalnext(&args) );
+	bytes_t *b = bytes_arg( env, _evalnext(&args) );
+	muse_int n = a->size < b->size ? a->size : b->size;
+	int c = n > 0 ? memcmp( a->bytes, b->bytes, (size_t)n ) : 0;
+
+	if ( c == 0 )
+		c = (a->size < b->size) ? -1 : (a->size > b->size ? 1 : 0);
+
+	return _mk_int( c < 0 ? -1 : (c > 0 ? 1 : 0) );
+}
+
+/**
+ * @code (bytes-fill! bytes value [start-offset] [num-bytes]) @endcode
+ *
+ * Sets the bytes from \p start-offset, all of them by default, to
+ * the byte \p value. Evaluates to \p bytes.
+ */
+muse_cell fn_bytes_fill( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell bcell	= _evalnext(&args);
+	bytes_t *b		= bytes_arg( env, bcell );
+	int value		= (int)_intvalue(_evalnext(&args));
+	muse_int start	= args ? _intvalue(_evalnext(&args)) : 0;
+	muse_int size	= args ? _intvalue(_evalnext(&args)) : b->size - start;
+
+	muse_assert( start >= 0 && start <= b->size );
+
+	if ( start + size > b->size )
+		size = b->size - start;
+
+	if ( size > 0 )
+		memset( b->bytes + (size_t)start, value, (size_t)size );
+
+	return bcell;
+}
+
+static void xor_bytes( unsigned char *dest, const unsigned char *src, size_t n )
+{
+	size_t i = 0;
+
+#ifdef MUSE_BYTES_SSE2
+	for ( ; i + 16 <= n; i += 16 )
+	{
+		__m128i d = _mm_loadu_si128( (const __m128i*)(dest + i) );
+		__m128i s = _mm_loadu_si128( (const __m128i*)(src + i) );
+		_mm_storeu_si128( (__m128i*)(dest + i), _mm_xor_si128( d, s ) );
+	}
+#endif
+
+	for ( ; i < n; ++i )
+		dest[i] ^= src[i];
+}
+
+/**
+ * @code (bytes-xor! dest src) @endcode
+ *
+ * XORs the bytes of \p src into \p dest. If \p src is shorter, it is
+ * repeated over the length of \p dest, as for a key or a mask.
+ * Evaluates to \p dest.
+ */
+muse_cell fn_bytes_xor( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell dcell		= _evalnext(&args);
+	bytes_t *dest		= bytes_arg( env, dcell );
+	bytes_t *src		= bytes_arg( env, _evalnext(&args) );
+	size_t n			= (size_t)dest->size;
+	size_t m			= (size_t)src->size;
+	const unsigned char *key = src->bytes;
+	unsigned char repeated[128];
+	size_t i;
+
+	if ( m == 0 || n == 0 )
+		return dcell;
+
+	/* Repeat a short key so that each step does at least 64 bytes. */
+	if ( m < 64 && n > m )
+	{
+		size_t k = 0;
+		for ( ; k < 64; k += m )
+			memcpy( repeated + k, key, m );
+		key = repeated;
+		m = k;
+	}
+
+	for ( i = 0; i < n; i += m )
+		xor_bytes( dest->bytes + i, key, (n - i < m) ? n - i : m );
+
+	return dcell;
+}
+
+/**
+ * @code (bytes->hex bytes) @endcode
+ *
+ * Gives a string of two lower case hex digits per byte.
+ */
+muse_cell fn_bytes_to_hex( muse_env *env, void *context, muse_cell args )
+{
+	bytes_t *b = bytes_arg( env, _evalnext(&args) );
+	muse_cell text = muse_mk_text( env, NULL, ((const muse_char *)NULL) + 2 * b->size );
+	muse_char *chars = (muse_char*)muse_text_contents( env, text, NULL );
+	static const char k_digits[] = "0123456789abcdef";
+	muse_int i;
+
+	for ( i = 0; i < b->size; ++i )
+	{
+		chars[2*i]		= k_digits[b->bytes[i] >> 4];
+		chars[2*i+1]	= k_digits[b->bytes[i] & 15];
+	}
+
+	return text;
+}
+
+static int hex_digit( muse_char c )
+{
+	if ( c >= '0' && c <= '9' ) return c - '0';
+	if ( c >= 'a' && c <= 'f' ) return 10 + (c - 'a');
+	if ( c >= 'A' && c <= 'F' ) return 10 + (c - 'A');
+	return -1;
+}
+
+/**
+ * @code (hex->bytes string) @endcode
+ *
+ * Gives the bytes whose hex digits are in the string, which must have
+ * an even number of them. Raises error:bad-hex otherwise.
+ */
+muse_cell fn_hex_to_bytes( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell text = _evalnext(&args);
+	int len = 0, i;
+	const muse_char *chars;
+	muse_cell result;
+	unsigned char *out;
+
+	if ( _cellt(text) != MUSE_TEXT_CELL )
+		return muse_raise_error( env, _csymbol(L"error:string-expected"), _cons( text, MUSE_NIL ) );
+
+	chars = muse_text_contents( env, text, &len );
+
+	if ( len % 2 != 0 )
+		return muse_raise_error( env, _csymbol(L"error:bad-hex"), _cons( text, MUSE_NIL ) );
+
+	result = _mk_bytes( len / 2 );
+	out = _bytes_ptr(result);
+
+	for ( i = 0; i < len; i += 2 )
+	{
+		int hi = hex_digit( chars[i] ), lo = hex_digit( chars[i+1] );
+
+		if ( hi < 0 || lo < 0 )
+			return muse_raise_error( env, _csymbol(L"error:bad-hex"), _cons( text, MUSE_NIL ) );
+
+		out[i/2] = (unsigned char)((hi << 4) | lo);
+	}
+
+	return result;
+}
+
+static const char k_base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * @code (bytes->base64 bytes) @endcode
+ *
+ * Gives the standard base64 encoding of the bytes, padded with '='
+ * and without line breaks.
+ */
+muse_cell fn_bytes_to_base64( muse_env *env, void *context, muse_cell args )
+{
+	bytes_t *b = bytes_arg( env, _evalnext(&args) );
+	muse_int len = 4 * ((b->size + 2) / 3);
+	muse_cell text = muse_mk_text( env, NULL, ((const muse_char *)NULL) + len );
+	muse_char *out = (muse_char*)muse_text_contents( env, text, NULL );
+	const unsigned char *in = b->bytes, *end = b->bytes + b->size;
+
+	for ( ; end - in >= 3; in += 3, out += 4 )
+	{
+		unsigned int v = (in[0] << 16) | (in[1] << 8) | in[2];
+		out[0] = k_base64[v >> 18];
+		out[1] = k_base64[(v >> 12) & 63];
+		out[2] = k_base64[(v >> 6) & 63];
+		out[3] = k_base64[v & 63];
+	}
+
+	if ( end > in )
+	{
+		unsigned int v = (in[0] << 16) | ((end - in > 1) ? (in[1] << 8) : 0);
+		out[0] = k_base64[v >> 18];
+		out[1] = k_base64[(v >> 12) & 63];
+		out[2] = (end - in > 1) ? k_base64[(v >> 6) & 63] : '=';
+		out[3] = '=';
+	}
+
+	return text;
+}
+
+/**
+ * @code (base64->bytes string) @endcode
+ *
+ * Decodes standard base64. White space, such as line breaks, is skipped
+ * and the '=' padding at the end may be left out. Raises error:bad-base64
+ * if there is anything else in the string.
+ */
+muse_cell fn_base64_to_bytes( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell text = _evalnext(&args);
+	signed char k_values[256];
+	int len = 0, i, nbits = 0, npad = 0;
+	unsigned int acc = 0;
+	const muse_char *chars;
+	muse_cell result;
+	unsigned char *out;
+	muse_int nout = 0;
+
+	if ( _cellt(text) != MUSE_TEXT_CELL )
+		return muse_raise_error( env, _csymbol(L"error:string-expected"), _cons( text, MUSE_NIL ) );
+
+	memset( k_values, -1, sizeof(k_values) );
+	for ( i = 0; i < 64; ++i )
+		k_values[(unsigned char)k_base64[i]] = (signed char)i;
+
+	chars = muse_text_contents( env, text, &len );
+	result = _mk_bytes( 3 * (len / 4) + 3 );
+	out = _bytes_ptr(result);
+
+	for ( i = 0; i < len; ++i )
+	{
+		muse_char c = chars[i];
+
+		if ( c == ' ' || c == '\t' || c == '\r' || c == '\n' )
+			continue;
+
+		if ( c == '=' && npad < 2 ) {
+			++npad;
+			continue;
+		}
+
+		if ( npad > 0 || c > 255 || k_values[c] < 0 )
+			return muse_raise_error( env, _csymbol(L"error:bad-base64"), _cons( text, MUSE_NIL ) );
+
+		acc = (acc << 6) | (unsigned int)k_values[c];
+		nbits += 6;
+
+		if ( nbits >= 8 )
+		{
+			nbits -= 8;
+			out[nout++] = (unsigned char)((acc >> nbits) & 0xFF);
+		}
+	}
+
+	bytes_set_size( env, result, nout );
+	return result;
+}
+
+/**
+ * @code (bytes-unpack bytes layout [count] [start-offset]) @endcode
+ *
+ * Reads \p count records laid out one after another from
+ * \p start-offset, as many as fit by default, and gives a vector of them.
+ * The \p layout is a list of field types - the same ones that
+ * \ref fn_bytes_fn "a bytes object" takes, such as \c 'Short or \c 'double -
+ * and integers, which skip that many bytes of padding and can't be
+ * negative. Each record comes out as a vector of its fields. If \p layout
+ * is a single field type rather than a list, each record comes out as
+ * just that field's value.
+ * @code
+ * (bytes-unpack b '(Short Short Int 2 byte) 10)
+ * (bytes-unpack b 'float)
+ * @endcode
+ */
+muse_cell fn_bytes_unpack( muse_env *env, void *context, muse_cell args )
+{
+	bytes_t *b			= bytes_arg( env, _evalnext(&args) );
+	muse_cell layout	= _evalnext(&args);
+	muse_cell count_arg	= _evalnext(&args);
+	muse_int start		= args ? _intvalue(_evalnext(&args)) : 0;
+	muse_boolean single	= (_cellt(layout) == MUSE_SYMBOL_CELL) ? MUSE_TRUE : MUSE_FALSE;
+	muse_char types[64];
+	int sizes[64], nitems = 0, nfields = 0, record_size = 0;
+	muse_int count, i;
+	muse_cell result;
+
+	/* Resolve the layout once for all the records. */
+	{
+		muse_cell items = single ? _cons( layout, MUSE_NIL ) : layout;
+
+		for ( ; items; items = _tail(items), ++nitems )
+		{
+			muse_cell item = _head(items);
+			int size = 0;
+
+			if ( nitems >= 64 )
+				return muse_raise_error( env, _csymbol(L"error:layout-too-long"), _cons( layout, MUSE_NIL ) );
+
+			if ( _cellt(item) == MUSE_INT_CELL ) {
+				if ( _intvalue(item) < 0 || _intvalue(item) > b->size )
+					return muse_raise_error( env, _csymbol(L"error:bad-padding"), _cons( item, MUSE_NIL ) );
+				types[nitems] = 0;
+				size = (int)_intvalue(item);
+			} else if ( _cellt(item) == MUSE_SYMBOL_CELL && (size = field_size( muse_symbol_name( env, item ) )) > 0 ) {
+				types[nitems] = muse_symbol_name( env, item )[0];
+				++nfields;
+			} else {
+				return muse_raise_error( env, _csymbol(L"error:bad-field-type"), _cons( item, MUSE_NIL ) );
+			}
+
+			sizes[nitems] = size;
+			record_size += size;
+		}
+	}
+
+	if ( start < 0 || start > b->size || record_size <= 0 )
+		return muse_raise_error( env, _csymbol(L"error:bad-layout"), _cons( layout, MUSE_NIL ) );
+
+	count = (b->size - start) / record_size;
+	if ( count_arg && _intvalue(count_arg) < count )
+		count = _intvalue(count_arg) > 0 ? _intvalue(count_arg) : 0;
+
+	result = muse_mk_vector( env, (int)count );
+
+	{
+		const unsigned char *p = b->bytes + (size_t)start;
+		const unsigned char *end = b->bytes + b->size;
+		int sp = _spos();
+
+		for ( i = 0; i < count; ++i )
+		{
+			int j, f = 0;
+
+			if ( single ) {
+				if ( p + sizes[0] > end )
+					return muse_raise_error( env, _csymbol(L"error:bad-layout"), _cons( layout, MUSE_NIL ) );
+
+				muse_vector_put( env, result, (int)i, get_field( env, types[0], p ) );
+				p += record_size;
+			} else {
+				muse_cell record = muse_mk_vector( env, nfields );
+
+				for ( j = 0; j < nitems; p += sizes[j++] )
+				{
+					if ( p + sizes[j] > end )
+						return muse_raise_error( env, _csymbol(L"error:bad-layout"), _cons( layout, MUSE_NIL ) );
+
+					if ( types[j] )
+						muse_vector_put( env, record, f++, get_field( env, types[j], p ) );
+				}
+
+				muse_vector_put( env, result, (int)i, record );
+			}
+
+			_unwind(sp);
+		}
+	}
+
+	return result;
+}
+
+/*@}*/
+
 MUSEAPI muse_cell muse_mk_bytes( muse_env *env, size_t s )
 {
 	return fn_bytes( env, NULL, _cons( _mk_int(s), MUSE_NIL ) );
@@ -826,6 +1417,13 @@ MUSEAPI size_t muse_bytes_size( muse_env *env, muse_cell b )
 	return (size_t)(_bytes_data(b)->size);
 }
 
+MUSEAPI muse_cell muse_mk_slice( muse_env *env, muse_cell b, size_t offset, size_t size )
+{
+	bytes_t *data = _bytes_data(b);
+	bytes_t *ref = _bytes_data(data->ref);
+	return _mk_slice( data->ref, (data->bytes - ref->bytes) + offset, size );
+}
+
 
 typedef struct 
 {
@@ -845,6 +1443,15 @@ void muse_define_builtin_type_bytes( muse_env *env )
 		{ fn_copy_bytes,	L"copy-bytes"	},
 		{ fn_string_to_bytes, L"string->bytes" },
 		{ fn_with_bytes_as_port, L"with-bytes-as-port" },
+		{ fn_bytes_find,	L"bytes-find"	},
+		{ fn_bytes_compare,	L"bytes-compare" },
+		{ fn_bytes_fill,	L"bytes-fill!"	},
+		{ fn_bytes_xor,		L"bytes-xor!"	},
+		{ fn_bytes_to_hex,	L"bytes->hex"	},
+		{ fn_hex_to_bytes,	L"hex->bytes"	},
+		{ fn_bytes_to_base64, L"bytes->base64" },
+		{ fn_base64_to_bytes, L"base64->bytes" },
+		{ fn_bytes_unpack,	L"bytes-unpack"	},
 		{ NULL,				NULL			}
 	};
 
@@ -567,10 +567,10 @@ muse_cell fn_set_M( muse_env *env, void *context, muse_cell args )
  *
  * Sets the head of the given cons cell to the given value.
  */
-muse_cell fn_setf_M( muse_env *env, void *context, muse_cell args )
+muse_cell fn_setf_M( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell c = _evalnext(&args);
-	muse_cell v = _evalnext(&args);
+	muse_cell c = _argv(0);
+	muse_cell v = _argv(1);
 	_seth( c, v );
 	return v;
 }
@@ -580,10 +580,10 @@ muse_cell fn_setf_M( muse_env *env, void *context, muse_cell args )
  *
  * Sets the tail of the given cons cell to the given value.
  */
-muse_cell fn_setr_M( muse_env *env, void *context, muse_cell args )
+muse_cell fn_setr_M( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell c = _evalnext(&args);
-	muse_cell v = _evalnext(&args);
+	muse_cell c = _argv(0);
+	muse_cell v = _argv(1);
 	_sett( c, v );
 	return v;
 }
@@ -592,9 +592,9 @@ muse_cell fn_setr_M( muse_env *env, void *context, muse_cell args )
  * @code (first list)  @endcode
  * Gets the \c head of the list, which is the first element.
  */
-muse_cell fn_first( muse_env *env, void *context, muse_cell args )
+muse_cell fn_first( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	return muse_head( env, _eval(_head(args)) );
+	return muse_head( env, _argv(0) );
 }
 
 /**
@@ -603,9 +603,9 @@ muse_cell fn_first( muse_env *env, void *context, muse_cell args )
  * Gets the tail of the list. This is intended to be read as 
  * "rest of the list".
  */
-muse_cell fn_rest( muse_env *env, void *context, muse_cell args )
+muse_cell fn_rest( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	return muse_tail( env, _eval(_head(args)) );
+	return muse_tail( env, _argv(0) );
 }
 
 /**
@@ -615,10 +615,10 @@ muse_cell fn_rest( muse_env *env, void *context, muse_cell args )
  * n is zero based. Returns item at index n in the list.
  * Could be thought of as "skip n, then return head".
  */
-muse_cell fn_nth( muse_env *env, void *context, muse_cell args )
+muse_cell fn_nth( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	int N = (int)_ptr(_evalnext(&args))->i;
-	muse_cell c = _evalnext(&args);
+	int N = (int)_ptr(_argv(0))->i;
+	muse_cell c = _argv(1);
 	
 	while ( N-- > 0 )
 		c = muse_tail(env,c);
@@ -632,11 +632,11 @@ muse_cell fn_nth( muse_env *env, void *context, muse_cell args )
  * Returns a new list consisting of a maximum of N items of
  * the given list "ls".
  */
-muse_cell fn_take( muse_env *env, void *context, muse_cell args )
+muse_cell fn_take( muse_env *env, void *context, int argc, muse_cell *argv )
 {
 	int sp = _spos();
-	muse_int N = _intvalue(_evalnext(&args));
-	muse_cell list = _evalnext(&args);
+	muse_int N = _intvalue(_argv(0));
+	muse_cell list = _argv(1);
 
 	if ( list && (--N) >= 0 )
 	{
@@ -674,10 +674,10 @@ muse_cell fn_take( muse_env *env, void *context, muse_cell args )
  * 
  * Does not create a new list like \c take does. 
  */
-muse_cell fn_drop( muse_env *env, void *context, muse_cell args )
+muse_cell fn_drop( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	int N = (int)_ptr(_evalnext(&args))->i;
-	muse_cell c = _evalnext(&args);
+	int N = (int)_ptr(_argv(0))->i;
+	muse_cell c = _argv(1);
 	
 	while ( N-- > 0 )
 		c = muse_tail(env,c);
@@ -690,9 +690,9 @@ muse_cell fn_drop( muse_env *env, void *context, muse_cell args )
  *
  * Creates a structural duplicate of the given argument.
  */
-muse_cell fn_dup( muse_env *env, void *context, muse_cell args )
+muse_cell fn_dup( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	return muse_dup( env, _evalnext(&args) );
+	return muse_dup( env, _argv(0) );
 }
 
 /**
@@ -702,9 +702,9 @@ muse_cell fn_dup( muse_env *env, void *context, muse_cell args )
  *
  * Supports \ref fn_the "the"
  */
-muse_cell fn_list( muse_env *env, void *context, muse_cell args )
+muse_cell fn_list( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	return muse_add_recent_item( env, (muse_int)fn_list, muse_eval_list( env, args ) );
+	return muse_add_recent_item( env, (muse_int)fn_list, muse_array_to_list( env, argc, argv, 1 ) );
 }
 
 /**
@@ -724,19 +724,15 @@ muse_cell fn_list( muse_env *env, void *context, muse_cell args )
  * (1 2 3 4 5 10 20 30 40 50)
  * @endcode
  */
-muse_cell fn_append_M( muse_env *env, void *context, muse_cell args )
+muse_cell fn_append_M( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell head = MUSE_NIL;
-	muse_cell last = MUSE_NIL;
+	muse_cell head = _argv(0);
+	muse_cell last = head;
+	int k;
 
-	if ( args )
+	for ( k = 1; k < argc; ++k )
 	{
-		head = last = _evalnext(&args);
-	}
-
-	while ( args )
-	{
-		muse_cell tail = _evalnext(&args);
+		muse_cell tail = argv[k];
 		if ( tail )
 		{
 			muse_list_append( env, last, tail );
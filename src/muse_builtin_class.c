@@ -13,23 +13,85 @@
 #include "muse_builtins.h"
 #include "muse_port.h"
 #include <memory.h>
+#include <stdlib.h>
 
 
-typedef struct { muse_boolean inherited; muse_cell key, kvpair; } assoc_t;
+/**
+ * Property lookups are cached per environment in a direct mapped
+ * table keyed by (shape, key). An object's shape is a number that
+ * is unique within the environment and changes whenever the object's
+ * own lookups may have changed in a way other than a new key being
+ * added to its plist - i.e. when its supers or its whole plist get
+ * replaced. New keys are simply written into the cache as they are 
+ * added.
+ *
+ * Inherited results also depend on the supers' plists. They are stamped
+ * with the epoch of the cache, which is bumped whenever an object that
+ * has been searched as somebody's super gains a key or changes shape.
+ * Objects that are only ever instances don't touch the epoch, so
+ * filling in their fields doesn't disturb anybody's cached methods.
+ */
 enum { 
-	ASSOC_CACHE_KEY_BITS = 4, 
-	ASSOC_CACHE_SIZE = 1 << ASSOC_CACHE_KEY_BITS, 
-	ASSOC_CACHE_MASK = ASSOC_CACHE_SIZE - 1 
+	PROP_CACHE_KEY_BITS = 10, 
+	PROP_CACHE_SIZE = 1 << PROP_CACHE_KEY_BITS, 
+	PROP_CACHE_MASK = PROP_CACHE_SIZE - 1 
 };
 
+typedef struct 
+{ 
+	muse_int shape, epoch; 
+	muse_cell key, kvpair; 
+	muse_boolean inherited; 
+} prop_cache_entry_t;
+
+typedef struct _muse_prop_cache_t
+{
+	muse_int next_shape;
+	muse_int epoch;
+	prop_cache_entry_t entries[PROP_CACHE_SIZE];
+} muse_prop_cache_t;
+
 typedef struct 
 {
 	muse_functional_object_t base;
 	muse_cell supers;
 	muse_cell plist;
-	assoc_t cache[ASSOC_CACHE_SIZE];
+	muse_int shape;
+	muse_boolean is_super;	/**< Set once the object has been searched as a super. */
 } object_t;
 
+static muse_prop_cache_t *prop_cache( muse_env *env )
+{
+	if ( !env->prop_cache ) {
+		env->prop_cache = (muse_prop_cache_t*)calloc( 1, sizeof(muse_prop_cache_t) );
+		env->prop_cache->next_shape = 1;
+		env->prop_cache->epoch = 1;
+	}
+
+	return env->prop_cache;
+}
+
+/**
+ * Frees the property lookup cache. Called as the environment is destroyed.
+ */
+void muse_destroy_prop_cache( muse_env *env )
+{
+	free( env->prop_cache );
+	env->prop_cache = NULL;
+}
+
+/**
+ * Called when the object's inherited lookups are no longer valid
+ * and so that of any object it is a super of.
+ */
+static void object_reshape( muse_env *env, object_t *obj )
+{
+	muse_prop_cache_t *c = prop_cache(env);
+	obj->shape = c->next_shape++;
+	if ( obj->is_super )
+		c->epoch++;
+}
+
 static muse_cell object_get_prop( muse_env *env, void *self, muse_cell key, muse_cell argv );
 static muse_cell object_put_prop( muse_env *env, void *self, muse_cell key, muse_cell argv );
 
@@ -63,7 +125,7 @@ static void object_init( muse_env *env, void *ptr, muse_cell args )
 		_unwind(sp);
 	}
 
-	memset( obj->cache, 0, sizeof(obj->cache) );
+	obj->shape = prop_cache(env)->next_shape++;
 }
 
 static void *object_view( muse_env *env, int id ) 
@@ -131,6 +193,23 @@ muse_cell object_plist( muse_env *env, muse_cell obj )
 	return ((object_t*)muse_functional_object_data( env, obj, 'mobj' ))->plist;
 }
 
+muse_cell object_supers( muse_env *env, muse_cell obj )
+{
+	return ((object_t*)muse_functional_object_data( env, obj, 'mobj' ))->supers;
+}
+
+/**
+ * Replaces the supers list and the plist of the object
+ * all at once, as when it is restored from a snapshot.
+ */
+void object_assign( muse_env *env, muse_cell obj, muse_cell supers, muse_cell plist )
+{
+	object_t *it = (object_t*)muse_functional_object_data( env, obj, 'mobj' );
+	it->supers = supers;
+	it->plist = plist;
+	object_reshape( env, it );
+}
+
 /**
  * This function is called whenever the object is used in the function
  * position and invokes a method on the object. The first argument is 
@@ -260,8 +339,8 @@ muse_cell fn_supers( muse_env *env, void *context, muse_cell args )
 			/* Change supers list. */
 			it->supers = _evalnext(&args);
 
-			/* Invalidate cache. */
-			memset( it->cache, 0, sizeof(it->cache) );
+			/* Invalidate cached lookups through the old supers. */
+			object_reshape( env, it );
 		}
 
 		return it->supers;
@@ -274,48 +353,58 @@ muse_cell fn_supers( muse_env *env, void *context, muse_cell args )
 }
 
 
-static inline int keyindex( muse_cell key )
+static inline prop_cache_entry_t *prop_cache_entry( muse_prop_cache_t *c, object_t *obj, muse_cell key )
 {
-	return (int)(_celli(key) & ASSOC_CACHE_MASK);
+	muse_int h = obj->shape * 40503 + key;
+	return c->entries + (int)((h ^ (h >> PROP_CACHE_KEY_BITS)) & PROP_CACHE_MASK);
 }
 
-static muse_cell object_cache( object_t *self, int keyi, muse_cell key, muse_cell kvpair, muse_boolean inherited )
+static muse_cell object_cache( muse_env *env, object_t *self, muse_cell key, muse_cell kvpair, muse_boolean inherited )
 {
-	assoc_t *a = self->cache + keyi;
-	a->inherited = inherited;
-	a->key = key;
-	a->kvpair = kvpair;
+	muse_prop_cache_t *c = prop_cache(env);
+	prop_cache_entry_t *e = prop_cache_entry( c, self, key );
+	e->shape = self->shape;
+	e->epoch = c->epoch;
+	e->key = key;
+	e->kvpair = kvpair;
+	e->inherited = inherited;
 	return kvpair;
 }
 
+/**
+ * Finds the (key . value) pair of the given property in the object's
+ * plist or, if \p search_hierarchy is true, in its supers searched
+ * depth first in order. Found pairs are cached against the object's shape.
+ */
 static muse_cell object_search_prop( muse_env *env, object_t *self, muse_cell key, muse_boolean *inherited, muse_boolean search_hierarchy )
 {
-	int keyi = keyindex(key);
+	muse_prop_cache_t *c = prop_cache(env);
+	prop_cache_entry_t *e = prop_cache_entry( c, self, key );
 
-	if ( self->cache[keyi].key == key ) {
+	if ( e->shape == self->shape && e->key == key && (!e->inherited || e->epoch == c->epoch) 
+		 && (search_hierarchy || !e->inherited) ) {
 		/* Cache hit. */
-		muse_cell kv = self->cache[keyi].kvpair;
-		if ( inherited ) (*inherited) = self->cache[keyi].inherited;
-		return kv;
+		if ( inherited ) (*inherited) = e->inherited;
+		return e->kvpair;
 	} else {
 		/* Cache miss. */
 		muse_cell kv = muse_assoc( env, self->plist, key );
 		if ( kv ) {
 			/* Found in current object. Store in cache. */
 			if ( inherited ) (*inherited) = MUSE_FALSE;
-			return object_cache( self, keyi, key, kv, MUSE_FALSE );
+			return object_cache( env, self, key, kv, MUSE_FALSE );
 		} else if ( search_hierarchy ) {
 			/* Not found. Search hierarchy. */
 			muse_cell supers = self->supers;
-			muse_cell kv = MUSE_NIL;
-			while ( supers && !kv ) {
+			while ( supers ) {
 				muse_cell super = _next(&supers);
 				object_t *superobj = (object_t*)muse_functional_object_data( env, super, 'mobj' );
 				if ( superobj ) {
+					superobj->is_super = MUSE_TRUE;
 					kv = object_search_prop( env, superobj, key, NULL, MUSE_TRUE );
 					if ( kv ) {
 						if ( inherited ) (*inherited) = MUSE_TRUE;
-						return object_cache( self, keyi, key, kv, MUSE_TRUE );
+						return object_cache( env, self, key, kv, MUSE_TRUE );
 					}
 				} else {
 					return MUSE_NIL;
@@ -362,19 +451,23 @@ static muse_cell object_put_prop( muse_env *env, void *self, muse_cell key, muse
 			return muse_add_recent_item( env, key, val );
 		}
 	} else {
-		/* Not found in object (even if found in parent). Add to object. */
-		int keyi = keyindex(key);
+		/* Not found in object (even if found in parent). Add to object. 
+		   Objects inheriting from this one may have cached a different
+		   pair for the key. */
+		if ( obj->is_super )
+			prop_cache(env)->epoch++;
+
 		if ( argv ) {
 			/* If deep property setting, create an object. */
 			muse_cell newobj = fn_new( env, NULL, MUSE_NIL );
 			kv = _cons( key, newobj );
 			obj->plist = _cons( kv, obj->plist );
-			object_cache( obj, keyi, key, kv, MUSE_FALSE );
+			object_cache( env, obj, key, kv, MUSE_FALSE );
 			return muse_put( env, muse_add_recent_item( env, key, newobj ), val, argv );
 		} else {
 			kv = _cons( key, val );
 			obj->plist = _cons( kv, obj->plist );
-			object_cache( obj, keyi, key, kv, MUSE_FALSE );
+			object_cache( env, obj, key, kv, MUSE_FALSE );
 			return muse_add_recent_item( env, key, val );
 		}
 	}
@@ -408,7 +501,19 @@ static muse_cell super_invoke( muse_env *env, object_t *self, muse_cell supers,
 {
 	while ( supers ) {
 		muse_cell super = _next(&supers);
-		muse_cell method = muse_get( env, super, methodkey, MUSE_NIL );
+		object_t *superobj = (object_t*)muse_functional_object_data( env, super, 'mobj' );
+		muse_cell method;
+
+		if ( superobj ) {
+			/* Go through the lookup cache directly. */
+			muse_cell kv;
+			superobj->is_super = MUSE_TRUE;
+			kv = object_search_prop( env, superobj, methodkey, NULL, MUSE_TRUE );
+			method = kv ? _tail(kv) : MUSE_NIL;
+		} else {
+			method = muse_get( env, super, methodkey, MUSE_NIL );
+		}
+
 		if ( method ) {
 			return muse_add_recent_item( 
 						env, 
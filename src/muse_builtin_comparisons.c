@@ -87,13 +87,9 @@ static int deep_compare( muse_env *env, muse_cell lhs, muse_cell rhs )
 	}	
 }
 
-int fn_deep_compare( muse_env *env, muse_cell args )
+int fn_deep_compare( muse_env *env, int argc, muse_cell *argv )
 {
-	muse_cell lhs = _evalnext(&args);
-	muse_cell rhs = _evalnext(&args);
-	int result = deep_compare( env, lhs, rhs );
-
-	return result;
+	return deep_compare( env, _argv(0), _argv(1) );
 }
 
 /**
@@ -102,11 +98,9 @@ int fn_deep_compare( muse_env *env, muse_cell args )
  * will be equal even if their references are different, but
  * they have the same integer values.
  */
-muse_cell fn_eq( muse_env *env, void *context, muse_cell args )
+muse_cell fn_eq( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell lhs = _evalnext(&args);
-	muse_cell rhs = _evalnext(&args);
-	return muse_eq( env, lhs, rhs ) ? _t() : MUSE_NIL;
+	return muse_eq( env, _argv(0), _argv(1) ) ? _t() : MUSE_NIL;
 }
 
 /**
@@ -114,9 +108,9 @@ muse_cell fn_eq( muse_env *env, void *context, muse_cell args )
  * Compares x and y for value equality. Compound structures
  * such as lists are deep compared.
  */
-muse_cell fn_equal( muse_env *env, void *context, muse_cell args )
+muse_cell fn_equal( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	return fn_deep_compare( env, args ) == 0 ? _t() : MUSE_NIL;
+	return fn_deep_compare( env, argc, argv ) == 0 ? _t() : MUSE_NIL;
 }
 
 /**
@@ -124,45 +118,45 @@ muse_cell fn_equal( muse_env *env, void *context, muse_cell args )
  * Evaluates to T if x and y are not the same (deep comparison)
  * and to () if they are.
  */
-muse_cell fn_ne( muse_env *env, void *context, muse_cell args )
+muse_cell fn_ne( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	return fn_deep_compare( env, args ) != 0 ? _t() : MUSE_NIL;
+	return fn_deep_compare( env, argc, argv ) != 0 ? _t() : MUSE_NIL;
 }
 
 /**
  * @code (< x y) @endcode
  * T if x compares less than y and () otherwise.
  */
-muse_cell fn_lt( muse_env *env, void *context, muse_cell args )
+muse_cell fn_lt( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	return fn_deep_compare( env, args ) < 0 ? _t() : MUSE_NIL;
+	return fn_deep_compare( env, argc, argv ) < 0 ? _t() : MUSE_NIL;
 }
 
 /**
  * @code (> x y) @endcode
  * T if x compares greater than y and () otherwise.
  */
-muse_cell fn_gt( muse_env *env, void *context, muse_cell args )
+muse_cell fn_gt( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	return fn_deep_compare( env, args ) > 0 ? _t() : MUSE_NIL;
+	return fn_deep_compare( env, argc, argv ) > 0 ? _t() : MUSE_NIL;
 }
 
 /**
  * @code (<= x y) @endcode
  * T if x compares less than or equal to y and () otherwise.
  */
-muse_cell fn_le( muse_env *env, void *context, muse_cell args )
+muse_cell fn_le( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	return fn_deep_compare( env, args ) <= 0 ? _t() : MUSE_NIL;
+	return fn_deep_compare( env, argc, argv ) <= 0 ? _t() : MUSE_NIL;
 }
 
 /**
  * @code (>= x y) @endcode
  * T if x compares greater than or equal to y and () otherwise.
  */
-muse_cell fn_ge( muse_env *env, void *context, muse_cell args )
+muse_cell fn_ge( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	return fn_deep_compare( env, args ) >= 0 ? _t() : MUSE_NIL;
+	return fn_deep_compare( env, argc, argv ) >= 0 ? _t() : MUSE_NIL;
 }
 
 /**
@@ -217,10 +211,9 @@ muse_cell fn_or( muse_env *env, void *context, muse_cell args )
  *
  * Evaluates to T if x is () and to () if x is anything else.
  */
-muse_cell fn_not( muse_env *env, void *context, muse_cell args )
+muse_cell fn_not( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell c = _evalnext(&args);
-	return c ? MUSE_NIL : _t();
+	return _argv(0) ? MUSE_NIL : _t();
 }
 
 /**
@@ -228,21 +221,17 @@ muse_cell fn_not( muse_env *env, void *context, muse_cell args )
  * Returns the minimum element x,
  * where x <= x0 <= ... <= xn
  */
-muse_cell fn_min( muse_env *env, void *context, muse_cell args )
+muse_cell fn_min( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	int sp = _spos();
-	muse_cell result = _evalnext(&args);
+	muse_cell result = _argv(0);
+	int k;
 
-	while ( args )
+	for ( k = 1; k < argc; ++k )
 	{
-		muse_cell candidate = _evalnext(&args);
+		muse_cell candidate = argv[k];
 
 		if ( deep_compare( env, result, candidate ) > 0 ) 
-		{
 			result = candidate;
-			_unwind(sp);
-			_spush(result);
-		}
 	}
 
 	return result;
@@ -253,21 +242,17 @@ muse_cell fn_min( muse_env *env, void *context, muse_cell args )
  * Returns the maximum element x,
  * where x0 <= ... <= xn <= x
  */
-muse_cell fn_max( muse_env *env, void *context, muse_cell args )
+muse_cell fn_max( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	int sp = _spos();
-	muse_cell result = _evalnext(&args);
+	muse_cell result = _argv(0);
+	int k;
 
-	while ( args )
+	for ( k = 1; k < argc; ++k )
 	{
-		muse_cell candidate = _evalnext(&args);
+		muse_cell candidate = argv[k];
 
 		if ( deep_compare( env, result, candidate ) < 0 )
-		{
 			result = candidate;
-			_unwind(sp);
-			_spush(result);
-		}
 	}
 
 	return result;
@@ -37,6 +37,8 @@ typedef struct _continuation_t
 	muse_cell	this_cont;
 	muse_cell	invoke_result;
 	int			num_eval_timeouts;
+	int			text_arena_depth;
+	struct _muse_image_source_t *image_source;
 } continuation_t;
 
 static void continuation_init( muse_env *env, void *p, muse_cell args )
@@ -88,7 +90,15 @@ static muse_cell *copy_current_bindings( muse_env *env, int *size )
 
 	(*size) = env->num_symbols;
 	copy = (muse_cell*)malloc( sizeof(muse_cell) * (*size) );
-	memcpy( copy, s->bottom, sizeof(muse_cell) * (*size) );
+
+	if ( env->current_process->shared_locals )
+	{
+		int i;
+		for ( i = 0; i < (*size); ++i )
+			copy[i] = _local(i);
+	}
+	else
+		memcpy( copy, s->bottom, sizeof(muse_cell) * (*size) );
 
 	return copy;
 }
@@ -98,7 +108,19 @@ static void restore_bindings( muse_env *env, muse_cell *bindings, int size )
 {
 	muse_assert( size >= 0 );
 
-	memcpy( env->current_process->locals.bottom, bindings, sizeof(muse_cell) * size );
+	if ( env->current_process->shared_locals )
+	{
+		/* Only the values that actually differ are set, so as not to
+		give the process its own copy of every symbol. */
+		int i;
+		for ( i = 0; i < size; ++i )
+		{
+			if ( _local(i) != bindings[i] )
+				_setlocal( i, bindings[i] );
+		}
+	}
+	else
+		memcpy( env->current_process->locals.bottom, bindings, sizeof(muse_cell) * size );
 }
 
 static void *min3( void *p1, void *p2, void *p3 )
@@ -181,6 +203,8 @@ static muse_cell capture_continuation( muse_env *env, muse_cell cont )
 		c->process = env->current_process;
 		c->process_atomicity = env->current_process->atomicity;
 		c->num_eval_timeouts = env->current_process->num_eval_timeouts;
+		c->text_arena_depth = env->text_storage.arena_depth;
+		c->image_source = env->current_process->image_source;
 
 		c->this_cont = cont;
 		
@@ -208,6 +232,8 @@ static muse_cell capture_continuation( muse_env *env, muse_cell cont )
 		muse_assert( env->current_process == c->process );
 		c->process->atomicity = c->process_atomicity;
 		c->process->num_eval_timeouts = c->num_eval_timeouts;
+		muse_end_text_arena( env, c->text_arena_depth );
+		c->process->image_source = c->image_source;
 
 		/* Restore the evaluation stack. */
 		memcpy( _stack()->bottom + c->muse_stack_from, c->muse_stack_copy, sizeof(muse_cell) * c->muse_stack_size );
@@ -406,7 +432,10 @@ typedef struct _resume_point_t
 	muse_cell resumingtrap; /**< The trap one of whose handlers resumed the exception. */
 	muse_cell result;	/**< Holds the result of the resume invocation. */
 	recent_t recent;		/**< The top index of the recent list at capture time. */
+	int recent_quiet;		/**< The quiet count of the top recent context at capture time. */
 	int num_eval_timeouts;	/**< The depth of the timeout stack when the capture is made. */
+	int text_arena_depth;	/**< The text arena depth to return to, in case a parser raised an error. */
+	struct _muse_image_source_t *image_source;	/**< The image sources to return to, in case loading raised an error. */
 } resume_point_t;
 
 /**
@@ -429,11 +458,16 @@ static int resume_capture( muse_env *env, resume_point_t *rp, int setjmp_result
 		rp->resumingtrap = MUSE_NIL;
 		rp->result = 0;
 		rp->recent = env->current_process->recent;
+		rp->recent_quiet = rp->recent.contexts.vec[rp->recent.contexts.top].quiet;
 		rp->num_eval_timeouts = env->current_process->num_eval_timeouts;
+		rp->text_arena_depth = env->text_storage.arena_depth;
+		rp->image_source = env->current_process->image_source;
 	}
 	else
 	{
 		env->current_process->num_eval_timeouts = rp->num_eval_timeouts;
+		muse_end_text_arena( env, rp->text_arena_depth );
+		env->current_process->image_source = rp->image_source;
 		env->current_process->atomicity = rp->atomicity;
 		_unwind( rp->spos );
 		_unwind_bindings( rp->bspos );
@@ -441,6 +475,7 @@ static int resume_capture( muse_env *env, resume_point_t *rp, int setjmp_result
 		rp->result = (setjmp_result >= 0) ? (setjmp_result-1) : setjmp_result;
 		env->current_process->recent.entries.top = rp->recent.entries.top;
 		env->current_process->recent.contexts.top = rp->recent.contexts.top;
+		env->current_process->recent.contexts.vec[rp->recent.contexts.top].quiet = rp->recent_quiet;
 	}
 
 	return setjmp_result;
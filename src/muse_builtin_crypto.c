@@ -2,14 +2,19 @@
  * @file muse_builtin_crypto.c
  * @author Srikumar K. S. (mailto:kumar@muvee.com)
  *
- * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd. 
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
  *
  * All rights reserved. See LICENSE.txt distributed with this source code
  * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
  * for terms and conditions under which this software is provided to you.
  *
- * A collection of basic cryptographic utilities - sha1 and md5 -
+ * A collection of basic cryptographic utilities - sha1, sha256 and md5 -
  * that are useful in the online space.
+ *
+ * The block functions of sha1 and sha256 use the SHA extensions of x86
+ * processors or the crypto extensions of ARMv8 processors when the
+ * processor running the code has them, and portable C code otherwise.
+ * The choice is made once, in muse_define_crypto().
  */
 
 #include "muse_builtins.h"
@@ -18,455 +23,1028 @@
 #include "muse_port.h"
 #include "muse_utils.h"
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#	define MUSE_HASH_X86
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#		include <immintrin.h>
+#		define HASH_X86_TARGET
+#	else
+#		include <cpuid.h>
+#		include <immintrin.h>
+#		define HASH_X86_TARGET __attribute__((target("sha,sse4.1")))
+#	endif
+#elif defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2) || defined(_M_ARM64)
+	/* Only when the compiler targets the crypto extensions already,
+	as the Apple and Windows ARM64 compilers do by default. */
+#	define MUSE_HASH_ARM
+#	ifdef _M_ARM64
+#		include <arm64_neon.h>
+#	else
+#		include <arm_neon.h>
+#	endif
+#	if defined(__linux__)
+#		include <sys/auxv.h>
+#		include <asm/hwcap.h>
+#	endif
+#endif
+
+#ifdef MUSE_PLATFORM_WINDOWS
+	typedef HANDLE hash_thread_t;
+#	define atomic_next(a)	(InterlockedIncrement( (a) ) - 1)
+#else
+#	include <pthread.h>
+#	include <unistd.h>
+	typedef pthread_t hash_thread_t;
+#	define atomic_next(a)	__sync_fetch_and_add( (a), 1 )
+#endif
+
 /**
  * @addtogroup Crypto Cryptographic hashes
  */
 /*@{*/
-typedef struct {
-	unsigned int h0, h1, h2, h3, h4;
-} sha1_t;
 
-static sha1_t sha1_init()
+typedef enum { HASH_SHA1, HASH_SHA256, HASH_MD5 } hash_algo_t;
+
+/**
+ * Processes \p nblocks consecutive 64-byte blocks into the state \p h.
+ */
+typedef void (*hash_blocks_fn)( unsigned int *h, const unsigned char *data, size_t nblocks );
+
+/**
+ * The state of an incremental hash. Bytes that don't make up
+ * a whole block yet wait in \p buffer.
+ */
+typedef struct
 {
-	sha1_t s;
-	s.h0 = 0x67452301;
-	s.h1 = 0xEFCDAB89;
-	s.h2 = 0x98BADCFE;
-	s.h3 = 0x10325476;
-	s.h4 = 0xC3D2E1F0;
-	return s;
-}
+	hash_algo_t		algo;
+	unsigned int	h[8];
+	unsigned char	buffer[64];
+	size_t			buffered;
+	muse_int		total_bytes;
+} hash_state_t;
 
 static inline unsigned int leftrotate( unsigned int val, int n )
 {
 	return (val << n) | (val >> (32-n));
 }
 
-static sha1_t sha1_update( const unsigned char *chunk, sha1_t s )
+static inline unsigned int rightrotate( unsigned int val, int n )
+{
+	return (val >> n) | (val << (32-n));
+}
+
+static inline unsigned int be_word( const unsigned char *b )
+{
+	return ((unsigned int)b[0] << 24) | ((unsigned int)b[1] << 16) | ((unsigned int)b[2] << 8) | b[3];
+}
+
+/************************************************/
+/* Portable block functions                     */
+/************************************************/
+
+/**
+ * See http://en.wikipedia.org/wiki/SHA_hash_functions#SHA-1_pseudocode
+ * for the algorithm. The code below is basically a C implementation
+ * of whats given there.
+ */
+static void sha1_blocks( unsigned int *h, const unsigned char *chunk, size_t nblocks )
 {
-	unsigned int a, b, c, d, e, f, k;
-	unsigned int w[80];
-	int j;
-	for ( j = 0; j < 16; ++j )
+	for ( ; nblocks > 0; --nblocks, chunk += 64 )
 	{
-		unsigned int ui = chunk[j*4];
-		ui = (ui << 8) | chunk[j*4+1];
-		ui = (ui << 8) | chunk[j*4+2];
-		ui = (ui << 8) | chunk[j*4+3];
-		w[j] = ui;
+		unsigned int a, b, c, d, e, f, k;
+		unsigned int w[80];
+		int j;
+		for ( j = 0; j < 16; ++j )
+		{
+			w[j] = be_word( chunk + j*4 );
+		}
+		for ( j = 16; j < 80; ++j )
+		{
+			w[j] = leftrotate(w[j-3] ^ w[j-8] ^ w[j-14] ^ w[j-16], 1);
+		}
+
+		a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+		for ( j = 0; j < 80; ++j )
+		{
+			if ( 0 <= j && j < 20 ) {
+				f = (b & c) | ((~b) & d);
+				k = 0x5A827999;
+			} else if ( 20 <= j && j < 40 ) {
+				f = (b ^ c ^ d);
+				k = 0x6ED9EBA1;
+			} else if ( 40 <= j && j < 60 ) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			} else {
+				f = (b ^ c ^ d);
+				k = 0xCA62C1D6;
+			}
+
+			{
+				unsigned int temp = leftrotate(a,5) + f + e + k + w[j];
+				e = d;
+				d = c;
+				c = leftrotate(b,30);
+				b = a;
+				a = temp;
+			}
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
 	}
-	for ( j = 16; j < 80; ++j )
+}
+
+static const unsigned int k_sha256[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * See http://en.wikipedia.org/wiki/SHA-2#Pseudocode.
+ */
+static void sha256_blocks( unsigned int *h, const unsigned char *chunk, size_t nblocks )
+{
+	for ( ; nblocks > 0; --nblocks, chunk += 64 )
 	{
-		w[j] = leftrotate(w[j-3] ^ w[j-8] ^ w[j-14] ^ w[j-16], 1);
+		unsigned int a, b, c, d, e, f, g, hh;
+		unsigned int w[64];
+		int j;
+
+		for ( j = 0; j < 16; ++j )
+		{
+			w[j] = be_word( chunk + j*4 );
+		}
+		for ( j = 16; j < 64; ++j )
+		{
+			unsigned int s0 = rightrotate(w[j-15],7) ^ rightrotate(w[j-15],18) ^ (w[j-15] >> 3);
+			unsigned int s1 = rightrotate(w[j-2],17) ^ rightrotate(w[j-2],19) ^ (w[j-2] >> 10);
+			w[j] = w[j-16] + s0 + w[j-7] + s1;
+		}
+
+		a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+
+		for ( j = 0; j < 64; ++j )
+		{
+			unsigned int s1 = rightrotate(e,6) ^ rightrotate(e,11) ^ rightrotate(e,25);
+			unsigned int ch = (e & f) ^ ((~e) & g);
+			unsigned int t1 = hh + s1 + ch + k_sha256[j] + w[j];
+			unsigned int s0 = rightrotate(a,2) ^ rightrotate(a,13) ^ rightrotate(a,22);
+			unsigned int maj = (a & b) ^ (a & c) ^ (b & c);
+			unsigned int t2 = s0 + maj;
+
+			hh = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
 	}
+}
 
-	a = s.h0; b = s.h1; c = s.h2; d = s.h3; e = s.h4;
+/**
+ * See http://en.wikipedia.org/wiki/MD5#Pseudocode
+ * for the algorithm. The code below is basically a C implementation
+ * of whats given there.
+ */
+static void md5_blocks( unsigned int *h, const unsigned char *chunk, size_t nblocks )
+{
+	static const unsigned int r[64] =
+	{
+		7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,
+		5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,
+		4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,
+		6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21
+	};
 
-	for ( j = 0; j < 80; ++j )
+	/* k[i] = floor( fabs(sin(i+1)) * pow(2,32) ) */
+	static const unsigned int k[64] =
 	{
-		if ( 0 <= j && j < 20 ) {
-			f = (b & c) | ((~b) & d);
-			k = 0x5A827999;
-		} else if ( 20 <= j && j < 40 ) {
-			f = (b ^ c ^ d);
-			k = 0x6ED9EBA1;
-		} else if ( 40 <= j && j < 60 ) {
-			f = (b & c) | (b & d) | (c & d);
-			k = 0x8F1BBCDC;
-		} else {
-			f = (b ^ c ^ d);
-			k = 0xCA62C1D6;
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x2441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x4881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+	};
+
+	for ( ; nblocks > 0; --nblocks, chunk += 64 )
+	{
+		unsigned int a, b, c, d, f, g, temp;
+		unsigned int w[16];
+		int i;
+
+		for ( i = 0; i < 16; ++i )
+		{
+			unsigned int ui = chunk[i*4+3];
+			ui = (ui << 8) | chunk[i*4+2];
+			ui = (ui << 8) | chunk[i*4+1];
+			ui = (ui << 8) | chunk[i*4];
+			w[i] = ui;
 		}
 
+		a = h[0]; b = h[1]; c = h[2]; d = h[3];
 
+		for ( i = 0; i < 64; ++i )
 		{
-			unsigned int temp = leftrotate(a,5) + f + e + k + w[j];
-			e = d;
+			if ( 0 <= i && i < 16 ) {
+				f = (b & c) | ((~b) & d);
+				g = i;
+			} else if ( 16 <= i && i < 32 ) {
+				f = (d & b) | ((~ d) & c);
+				g = (5 * i + 1) & 15;
+			} else if ( 32 <= i && i < 48 ) {
+				f = b ^ c ^ d;
+				g = (3 * i + 5) & 15;
+			} else {
+				f = c ^ (b | (~d));
+				g = (7 * i) & 15;
+			}
+
+			temp = d;
 			d = c;
-			c = leftrotate(b,30);
-			b = a;
+			c = b;
+			b = b + leftrotate( (a + f + k[i] + w[g]), r[i] );
 			a = temp;
 		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
 	}
+}
+
+/************************************************/
+/* x86 SHA extensions                           */
+/************************************************/
+
+#ifdef MUSE_HASH_X86
 
-	s.h0 += a; s.h1 += b; s.h2 += c; s.h3 += d; s.h4 += e;
-	return s;
+/**
+ * Each sha1rnds4 does 4 of the 80 rounds. The message words for
+ * rounds 16 onwards are made 4 at a time from the previous 16, held
+ * in msg[] as a ring. The words sit in the lanes in reverse order,
+ * with A and W[0] in the top lane.
+ */
+#define SHA1_X86_ROUNDS(g,func) \
+	{ \
+		__m128i *m = msg + ((g) & 3); \
+		if ( (g) < 4 ) \
+			*m = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)(data + 16*(g)) ), k_bswap ); \
+		else \
+			*m = _mm_sha1msg2_epu32( _mm_xor_si128( _mm_sha1msg1_epu32( *m, msg[((g)+1)&3] ), msg[((g)+2)&3] ), msg[((g)+3)&3] ); \
+		e1 = ((g) == 0) ? _mm_add_epi32( e0, *m ) : _mm_sha1nexte_epu32( e0, *m ); \
+		e0 = abcd; \
+		abcd = _mm_sha1rnds4_epu32( abcd, e1, func ); \
+	}
+
+HASH_X86_TARGET static void sha1_blocks_x86( unsigned int *h, const unsigned char *data, size_t nblocks )
+{
+	const __m128i k_bswap = _mm_set_epi64x( 0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL );
+	__m128i abcd = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i*)h ), 0x1B );
+	__m128i e0 = _mm_set_epi32( h[4], 0, 0, 0 );
+
+	for ( ; nblocks > 0; --nblocks, data += 64 )
+	{
+		__m128i abcd_save = abcd, e0_save = e0, e1;
+		__m128i msg[4];
+
+		SHA1_X86_ROUNDS(0,0)  SHA1_X86_ROUNDS(1,0)  SHA1_X86_ROUNDS(2,0)  SHA1_X86_ROUNDS(3,0)  SHA1_X86_ROUNDS(4,0)
+		SHA1_X86_ROUNDS(5,1)  SHA1_X86_ROUNDS(6,1)  SHA1_X86_ROUNDS(7,1)  SHA1_X86_ROUNDS(8,1)  SHA1_X86_ROUNDS(9,1)
+		SHA1_X86_ROUNDS(10,2) SHA1_X86_ROUNDS(11,2) SHA1_X86_ROUNDS(12,2) SHA1_X86_ROUNDS(13,2) SHA1_X86_ROUNDS(14,2)
+		SHA1_X86_ROUNDS(15,3) SHA1_X86_ROUNDS(16,3) SHA1_X86_ROUNDS(17,3) SHA1_X86_ROUNDS(18,3) SHA1_X86_ROUNDS(19,3)
+
+		e0 = _mm_sha1nexte_epu32( e0, e0_save );
+		abcd = _mm_add_epi32( abcd, abcd_save );
+	}
+
+	_mm_storeu_si128( (__m128i*)h, _mm_shuffle_epi32( abcd, 0x1B ) );
+	h[4] = (unsigned int)_mm_extract_epi32( e0, 3 );
 }
 
-static sha1_t sha1_end( const unsigned char *chunk, size_t chunk_size, size_t total_bytes, sha1_t s )
+/**
+ * Each pair of sha256rnds2 does 4 of the 64 rounds. The state is
+ * kept as ABEF and CDGH, which is the arrangement the instructions
+ * want.
+ */
+#define SHA256_X86_ROUNDS(g) \
+	{ \
+		__m128i *m = msg + ((g) & 3), wk; \
+		if ( (g) < 4 ) \
+			*m = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)(data + 16*(g)) ), k_bswap ); \
+		else \
+			*m = _mm_sha256msg2_epu32( _mm_add_epi32( _mm_sha256msg1_epu32( *m, msg[((g)+1)&3] ), \
+												   _mm_alignr_epi8( msg[((g)+3)&3], msg[((g)+2)&3], 4 ) ), \
+									  msg[((g)+3)&3] ); \
+		wk = _mm_add_epi32( *m, _mm_loadu_si128( (const __m128i*)(k_sha256 + 4*(g)) ) ); \
+		cdgh = _mm_sha256rnds2_epu32( cdgh, abef, wk ); \
+		abef = _mm_sha256rnds2_epu32( abef, cdgh, _mm_shuffle_epi32( wk, 0x0E ) ); \
+	}
+
+HASH_X86_TARGET static void sha256_blocks_x86( unsigned int *h, const unsigned char *data, size_t nblocks )
 {
-	unsigned char tail[128];
-	size_t tail_size = 0;
-	//muse_assert( chunk_size < 64 );
-	memcpy( tail, chunk, chunk_size );
-	tail_size = chunk_size;
-	if ( tail_size + 9 > 64 ) {
-		memset( tail + chunk_size, 0, 128 - chunk_size );
-		tail[chunk_size] = 0x80;
-		tail_size = 128;
-	} else {
-		memset( tail + chunk_size, 0, 64 - chunk_size );
-		tail[chunk_size] = 0x80;
-		tail_size = 64;
+	const __m128i k_bswap = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL );
+	__m128i cdab = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i*)h ), 0xB1 );
+	__m128i efgh = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i*)(h + 4) ), 0x1B );
+	__m128i abef = _mm_alignr_epi8( cdab, efgh, 8 );
+	__m128i cdgh = _mm_blend_epi16( efgh, cdab, 0xF0 );
+
+	for ( ; nblocks > 0; --nblocks, data += 64 )
+	{
+		__m128i abef_save = abef, cdgh_save = cdgh;
+		__m128i msg[4];
+
+		SHA256_X86_ROUNDS(0)  SHA256_X86_ROUNDS(1)  SHA256_X86_ROUNDS(2)  SHA256_X86_ROUNDS(3)
+		SHA256_X86_ROUNDS(4)  SHA256_X86_ROUNDS(5)  SHA256_X86_ROUNDS(6)  SHA256_X86_ROUNDS(7)
+		SHA256_X86_ROUNDS(8)  SHA256_X86_ROUNDS(9)  SHA256_X86_ROUNDS(10) SHA256_X86_ROUNDS(11)
+		SHA256_X86_ROUNDS(12) SHA256_X86_ROUNDS(13) SHA256_X86_ROUNDS(14) SHA256_X86_ROUNDS(15)
+
+		abef = _mm_add_epi32( abef, abef_save );
+		cdgh = _mm_add_epi32( cdgh, cdgh_save );
 	}
 
-	// Append the length of the original data as a 64-bit big endian number.
 	{
-		size_t b = (size_t)total_bytes * 8;
-		unsigned char *a = tail + tail_size - 8;
-		a[7] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[6] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[5] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[4] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[3] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[2] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[1] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[0] = (unsigned char)(b & 0xFF);
+		__m128i feba = _mm_shuffle_epi32( abef, 0x1B );
+		__m128i dchg = _mm_shuffle_epi32( cdgh, 0xB1 );
+		_mm_storeu_si128( (__m128i*)h, _mm_blend_epi16( feba, dchg, 0xF0 ) );
+		_mm_storeu_si128( (__m128i*)(h + 4), _mm_alignr_epi8( dchg, feba, 8 ) );
 	}
+}
+
+static muse_boolean cpu_has_sha( void )
+{
+	unsigned int ecx1, ebx7;
+#ifdef _MSC_VER
+	int r[4];
+	__cpuid( r, 0 );
+	if ( r[0] < 7 ) return MUSE_FALSE;
+	__cpuid( r, 1 );
+	ecx1 = (unsigned int)r[2];
+	__cpuidex( r, 7, 0 );
+	ebx7 = (unsigned int)r[1];
+#else
+	unsigned int a = 0, b = 0, c = 0, d = 0;
+	if ( __get_cpuid_max( 0, NULL ) < 7 ) return MUSE_FALSE;
+	__get_cpuid( 1, &a, &b, &c, &d );
+	ecx1 = c;
+	__cpuid_count( 7, 0, a, b, c, d );
+	ebx7 = b;
+#endif
+	/* SSSE3, SSE4.1 and SHA. */
+	return ((ecx1 & (1 << 9)) && (ecx1 & (1 << 19)) && (ebx7 & (1 << 29))) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+#endif /* MUSE_HASH_X86 */
+
+/************************************************/
+/* ARMv8 crypto extensions                      */
+/************************************************/
 
+#ifdef MUSE_HASH_ARM
+
+static void sha1_blocks_arm( unsigned int *h, const unsigned char *data, size_t nblocks )
+{
+	static const unsigned int k[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+	uint32x4_t abcd = vld1q_u32( h );
+	uint32_t e0 = h[4];
+
+	for ( ; nblocks > 0; --nblocks, data += 64 )
 	{
-		unsigned char *b = tail, *b_end = tail + tail_size;
-		for ( ; b < b_end; b += 64 )
-			s = sha1_update( b, s );
+		uint32x4_t abcd_save = abcd, msg[4];
+		uint32_t e0_save = e0;
+		int g;
+
+		for ( g = 0; g < 4; ++g )
+			msg[g] = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + 16*g ) ) );
+
+		for ( g = 0; g < 20; ++g )
+		{
+			uint32x4_t *m = msg + (g & 3), wk;
+			uint32_t e1;
+
+			if ( g >= 4 )
+				*m = vsha1su1q_u32( vsha1su0q_u32( *m, msg[(g+1)&3], msg[(g+2)&3] ), msg[(g+3)&3] );
+
+			wk = vaddq_u32( *m, vdupq_n_u32( k[g/5] ) );
+			e1 = vsha1h_u32( vgetq_lane_u32( abcd, 0 ) );
+
+			if ( g < 5 )
+				abcd = vsha1cq_u32( abcd, e0, wk );
+			else if ( g >= 10 && g < 15 )
+				abcd = vsha1mq_u32( abcd, e0, wk );
+			else
+				abcd = vsha1pq_u32( abcd, e0, wk );
+
+			e0 = e1;
+		}
+
+		e0 += e0_save;
+		abcd = vaddq_u32( abcd, abcd_save );
 	}
 
-	return s;
+	vst1q_u32( h, abcd );
+	h[4] = e0;
 }
 
-static void word_as_hex( unsigned int word, muse_char *hex )
+static void sha256_blocks_arm( unsigned int *h, const unsigned char *data, size_t nblocks )
 {
-	hex[0] = num2hex((word >> 28) & 15);
-	hex[1] = num2hex((word >> 24) & 15);
-	hex[2] = num2hex((word >> 20) & 15);
-	hex[3] = num2hex((word >> 16) & 15);
-	hex[4] = num2hex((word >> 12) & 15);
-	hex[5] = num2hex((word >> 8) & 15);
-	hex[6] = num2hex((word >> 4) & 15);
-	hex[7] = num2hex(word & 15);
+	uint32x4_t state0 = vld1q_u32( h ), state1 = vld1q_u32( h + 4 );
+
+	for ( ; nblocks > 0; --nblocks, data += 64 )
+	{
+		uint32x4_t state0_save = state0, state1_save = state1, msg[4];
+		int g;
+
+		for ( g = 0; g < 4; ++g )
+			msg[g] = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + 16*g ) ) );
+
+		for ( g = 0; g < 16; ++g )
+		{
+			uint32x4_t *m = msg + (g & 3), wk, prev;
+
+			if ( g >= 4 )
+				*m = vsha256su1q_u32( vsha256su0q_u32( *m, msg[(g+1)&3] ), msg[(g+2)&3], msg[(g+3)&3] );
+
+			wk = vaddq_u32( *m, vld1q_u32( k_sha256 + 4*g ) );
+			prev = state0;
+			state0 = vsha256hq_u32( state0, state1, wk );
+			state1 = vsha256h2q_u32( state1, prev, wk );
+		}
+
+		state0 = vaddq_u32( state0, state0_save );
+		state1 = vaddq_u32( state1, state1_save );
+	}
+
+	vst1q_u32( h, state0 );
+	vst1q_u32( h + 4, state1 );
 }
 
-static muse_cell sha1_to_str( muse_env *env, sha1_t s )
+static muse_boolean cpu_has_sha( void )
 {
-	muse_cell result_str = muse_mk_text( env, (const muse_char *)0, ((const muse_char *)0) + 40 );
-	muse_char *str = (muse_char*)muse_text_contents( env, result_str, NULL );
-	word_as_hex( s.h0, str );
-	word_as_hex( s.h1, str + 8 );
-	word_as_hex( s.h2, str + 16 );
-	word_as_hex( s.h3, str + 24 );
-	word_as_hex( s.h4, str + 32 );
+#if defined(_M_ARM64)
+	return IsProcessorFeaturePresent( PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE ) ? MUSE_TRUE : MUSE_FALSE;
+#elif defined(__linux__) && defined(HWCAP_SHA1) && defined(HWCAP_SHA2)
+	unsigned long hwcap = getauxval( AT_HWCAP );
+	return ((hwcap & HWCAP_SHA1) && (hwcap & HWCAP_SHA2)) ? MUSE_TRUE : MUSE_FALSE;
+#else
+	return MUSE_TRUE;
+#endif
+}
 
-	return result_str;
+#endif /* MUSE_HASH_ARM */
+
+/************************************************/
+/* Incremental hashing                          */
+/************************************************/
+
+static hash_blocks_fn g_sha1_blocks = sha1_blocks;
+static hash_blocks_fn g_sha256_blocks = sha256_blocks;
+
+/**
+ * Switches sha1 and sha256 over to the processor's
+ * instructions for them if it has any.
+ */
+static void select_hash_blocks( void )
+{
+#if defined(MUSE_HASH_X86)
+	if ( cpu_has_sha() )
+	{
+		g_sha1_blocks = sha1_blocks_x86;
+		g_sha256_blocks = sha256_blocks_x86;
+	}
+#elif defined(MUSE_HASH_ARM)
+	if ( cpu_has_sha() )
+	{
+		g_sha1_blocks = sha1_blocks_arm;
+		g_sha256_blocks = sha256_blocks_arm;
+	}
+#endif
 }
 
-static sha1_t sha1_hash_bytes( const unsigned char *bytes, size_t sz )
+static hash_blocks_fn hash_blocks( hash_algo_t algo )
 {
-	sha1_t s = sha1_init();
-	size_t i = 0;
-	for ( i = 0; i < sz; i += 64 )
+	switch ( algo )
 	{
-		if ( i + 64 < sz )
-			s = sha1_update( bytes + i, s );
-		else
-			return sha1_end( bytes + i, sz - i, sz, s );
+	case HASH_SHA1		: return g_sha1_blocks;
+	case HASH_SHA256	: return g_sha256_blocks;
+	default				: return md5_blocks;
 	}
+}
 
-	return s;
+static size_t hash_digest_size( hash_algo_t algo )
+{
+	switch ( algo )
+	{
+	case HASH_SHA1		: return 20;
+	case HASH_SHA256	: return 32;
+	default				: return 16;
+	}
 }
 
-static sha1_t sha1_hash_port( muse_port_t p )
+static void hash_init( hash_state_t *s, hash_algo_t algo )
 {
-	unsigned char chunk[64];
-	size_t chunk_size = 0;
-	sha1_t s = sha1_init();
-	size_t nbytes = 0;
+	static const unsigned int k_sha1_init[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	static const unsigned int k_sha256_init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+	memset( s, 0, sizeof(hash_state_t) );
+	s->algo = algo;
 
-	while ( !port_eof(p) )
+	switch ( algo )
 	{
-		chunk_size = port_read( chunk, 64, p );
-		nbytes += chunk_size;
+	case HASH_SHA1		: memcpy( s->h, k_sha1_init, sizeof(k_sha1_init) ); break;
+	case HASH_SHA256	: memcpy( s->h, k_sha256_init, sizeof(k_sha256_init) ); break;
+	default				: memcpy( s->h, k_sha1_init, 4 * sizeof(unsigned int) ); break; /* md5 starts with the same four words. */
+	}
+}
 
-		if ( chunk_size < 64 ) 
-			break;
+static void hash_update( hash_state_t *s, const unsigned char *bytes, size_t size )
+{
+	hash_blocks_fn blocks = hash_blocks( s->algo );
 
-		s = sha1_update( chunk, s );
+	s->total_bytes += size;
+
+	if ( s->buffered > 0 )
+	{
+		size_t n = 64 - s->buffered;
+		if ( n > size ) n = size;
+		memcpy( s->buffer + s->buffered, bytes, n );
+		s->buffered += n;
+		bytes += n;
+		size -= n;
+
+		if ( s->buffered < 64 )
+			return;
+
+		blocks( s->h, s->buffer, 1 );
+		s->buffered = 0;
+	}
+
+	if ( size >= 64 )
+	{
+		blocks( s->h, bytes, size / 64 );
+		bytes += size & ~(size_t)63;
+		size &= 63;
 	}
 
-	return sha1_end( chunk, chunk_size, nbytes, s );
+	memcpy( s->buffer, bytes, size );
+	s->buffered = size;
 }
 
 /**
- * @code (sha1-hash [bytes|port|string]) @endcode
- *
- * Gives a 40-character hex string representation of the sha1 hash of
- * the given bytes.
- *
- * See http://en.wikipedia.org/wiki/SHA_hash_functions#SHA-1_pseudocode
- * for the algorithm. The code below is basically a C implementation
- * of whats given there.
+ * Pads the buffered tail with the length of the data and gives the
+ * digest - big endian words for sha1 and sha256, and little endian
+ * words for md5. The state is left as it was, so more data can be
+ * added after getting the digest of what has been added so far.
  */
-muse_cell fn_sha1_hash( muse_env *env, void *context, muse_cell args )
+static size_t hash_final( const hash_state_t *s, unsigned char *digest )
 {
-	muse_cell thing = _evalnext(&args);
-	sha1_t s;
-	if ( muse_port(env,thing) ) {
-		s = sha1_hash_port(muse_port(env,thing));
+	unsigned char tail[128];
+	size_t tail_size = (s->buffered + 9 > 64) ? 128 : 64;
+	unsigned int h[8];
+	size_t i, nwords = hash_digest_size( s->algo ) / 4;
+	muse_int bits = s->total_bytes * 8;
+
+	memcpy( tail, s->buffer, s->buffered );
+	memset( tail + s->buffered, 0, tail_size - s->buffered );
+	tail[s->buffered] = 0x80;
+
+	// Append the length of the original data as a 64-bit number,
+	// big endian for sha and little endian for md5.
+	for ( i = 0; i < 8; ++i, bits >>= 8 )
+	{
+		if ( s->algo == HASH_MD5 )
+			tail[tail_size - 8 + i] = (unsigned char)(bits & 0xFF);
+		else
+			tail[tail_size - 1 - i] = (unsigned char)(bits & 0xFF);
+	}
+
+	memcpy( h, s->h, sizeof(h) );
+	hash_blocks( s->algo )( h, tail, tail_size / 64 );
+
+	for ( i = 0; i < nwords; ++i )
+	{
+		unsigned char *d = digest + 4*i;
+		if ( s->algo == HASH_MD5 ) {
+			d[0] = (unsigned char)h[i]; d[1] = (unsigned char)(h[i] >> 8); d[2] = (unsigned char)(h[i] >> 16); d[3] = (unsigned char)(h[i] >> 24);
+		} else {
+			d[0] = (unsigned char)(h[i] >> 24); d[1] = (unsigned char)(h[i] >> 16); d[2] = (unsigned char)(h[i] >> 8); d[3] = (unsigned char)h[i];
+		}
+	}
+
+	return nwords * 4;
+}
+
+static muse_cell hash_to_str( muse_env *env, const hash_state_t *s )
+{
+	unsigned char digest[32];
+	size_t i, n = hash_final( s, digest );
+	muse_cell result_str = muse_mk_text( env, (const muse_char *)0, ((const muse_char *)0) + 2*n );
+	muse_char *str = (muse_char*)muse_text_contents( env, result_str, NULL );
+
+	for ( i = 0; i < n; ++i )
+	{
+		str[2*i]	= num2hex( digest[i] >> 4 );
+		str[2*i+1]	= num2hex( digest[i] & 15 );
+	}
+
+	return result_str;
+}
+
+/**
+ * Adds the contents of a bytes object, the rest of a port or the utf8
+ * form of a text to the hash. Gives MUSE_FALSE for anything else.
+ */
+static muse_boolean hash_thing( muse_env *env, hash_state_t *s, muse_cell thing )
+{
+	muse_port_t p = muse_port(env,thing);
+
+	if ( p ) {
+		unsigned char chunk[4096];
+		while ( !port_eof(p) )
+		{
+			size_t chunk_size = port_read( chunk, sizeof(chunk), p );
+			if ( chunk_size == 0 )
+				break;
+			hash_update( s, chunk, chunk_size );
+		}
 	} else if ( muse_functional_object_data( env, thing, 'barr' ) ) {
-		unsigned char *data = muse_bytes_data( env, thing, 0 );
-		size_t nbytes = muse_bytes_size( env, thing );
-		s = sha1_hash_bytes( data, nbytes );
+		hash_update( s, (const unsigned char *)muse_bytes_data( env, thing, 0 ), muse_bytes_size( env, thing ) );
 	} else if ( _cellt(thing) == MUSE_TEXT_CELL ) {
 		int len = 0;
 		const muse_char *str = muse_text_contents( env, thing, &len );
 		size_t usz = muse_utf8_size( str, len );
 		char *buffer = (char *)calloc( usz, 1 );
 		usz = muse_unicode_to_utf8( buffer, usz, str, len );
-		s = sha1_hash_bytes( (const unsigned char *)buffer, usz );
+		hash_update( s, (const unsigned char *)buffer, usz );
 		free(buffer);
 	} else {
-		return muse_raise_error( env, _csymbol(L"error:bad-sha1-data-source"), _cons( thing, MUSE_NIL ) );
+		return MUSE_FALSE;
 	}
 
-	return muse_add_recent_item( env, (muse_int)fn_sha1_hash, sha1_to_str( env, s ) );
+	return MUSE_TRUE;
 }
 
-typedef struct {
-	unsigned int h0, h1, h2, h3;
-} md5_t;
-
-static md5_t md5_init()
+static muse_cell hash_fn( muse_env *env, hash_algo_t algo, muse_cell args, const muse_char *error, muse_int fn )
 {
-	md5_t m;
-	m.h0 = 0x67452301;
-	m.h1 = 0xEFCDAB89;
-	m.h2 = 0x98BADCFE;
-	m.h3 = 0x10325476;
-
-	/*
-	{
-		int i = 0;
-		for ( ; i < 64; ++i )
-		{
-			k[i] = (unsigned int)floor( fabs(sin(i+1)) * pow(2,32) );
-			if ( i % 16 == 0 ) printf("\n");
-			printf( "0x%x, ", k[i] );
+	muse_cell thing = _evalnext(&args);
+	hash_state_t s;
 
-		}
-	}
-	*/
+	hash_init( &s, algo );
+	if ( !hash_thing( env, &s, thing ) )
+		return muse_raise_error( env, _csymbol(error), _cons( thing, MUSE_NIL ) );
 
-	return m;
+	return muse_add_recent_item( env, fn, hash_to_str( env, &s ) );
 }
 
-static md5_t md5_update( const unsigned char *chunk, md5_t m )
+/**
+ * Puts the 20 byte SHA-1 digest of the given bytes in \p digest,
+ * as the big endian words h0 to h4.
+ */
+void muse_sha1_digest( const void *bytes, size_t size, unsigned char digest[20] )
 {
-	static const unsigned int r[64] =
-	{
-		7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,  7, 12, 17, 22,
-		5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,  5,  9, 14, 20,
-		4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,  4, 11, 16, 23,
-		6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21,  6, 10, 15, 21
-	};
+	hash_state_t s;
+	hash_init( &s, HASH_SHA1 );
+	hash_update( &s, (const unsigned char*)bytes, size );
+	hash_final( &s, digest );
+}
 
-	static const unsigned int k[64] =
-	{
-		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501, 
-		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 
-		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x2441453, 0xd8a1e681, 0xe7d3fbc8, 
-		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a, 
-		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 
-		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x4881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665, 
-		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1, 
-		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
-	};
+/**
+ * @code (sha1-hash [bytes|port|string]) @endcode
+ *
+ * Gives a 40-character hex string representation of the sha1 hash of
+ * the given bytes.
+ *
+ * @see \ref fn_hasher "hasher" for hashing data that arrives in pieces.
+ */
+muse_cell fn_sha1_hash( muse_env *env, void *context, muse_cell args )
+{
+	return hash_fn( env, HASH_SHA1, args, L"error:bad-sha1-data-source", (muse_int)fn_sha1_hash );
+}
 
-	unsigned int a, b, c, d, f, g, temp;
-	unsigned int w[16];
-	int i;
+/**
+ * @code (sha256-hash [bytes|port|string]) @endcode
+ *
+ * Gives a 64-character hex string representation of the sha256 hash of
+ * the given bytes.
+ */
+muse_cell fn_sha256_hash( muse_env *env, void *context, muse_cell args )
+{
+	return hash_fn( env, HASH_SHA256, args, L"error:bad-sha256-data-source", (muse_int)fn_sha256_hash );
+}
 
-	for ( i = 0; i < 16; ++i )
-	{
-		unsigned int ui = chunk[i*4+3];
-		ui = (ui << 8) | chunk[i*4+2];
-		ui = (ui << 8) | chunk[i*4+1];
-		ui = (ui << 8) | chunk[i*4];
-		w[i] = ui;
-	}
+/**
+ * @code (md5-hash [bytes|port|string]) @endcode
+ *
+ * Gives a 32-character hex string representation of the md5 hash of
+ * the given bytes.
+ */
+muse_cell fn_md5_hash( muse_env *env, void *context, muse_cell args )
+{
+	return hash_fn( env, HASH_MD5, args, L"error:bad-md5-data-source", (muse_int)fn_md5_hash );
+}
 
-	a = m.h0; b = m.h1; c = m.h2; d = m.h3;
+static hash_algo_t hash_algo( muse_env *env, muse_cell name )
+{
+	if ( name == _csymbol(L"sha1") )	return HASH_SHA1;
+	if ( name == _csymbol(L"sha256") )	return HASH_SHA256;
+	if ( name == _csymbol(L"md5") )		return HASH_MD5;
 
-	for ( i = 0; i < 64; ++i )
-	{
-		if ( 0 <= i && i < 16 ) {
-			f = (b & c) | ((~b) & d);
-			g = i;
-		} else if ( 16 <= i && i < 32 ) {
-			f = (d & b) | ((~ d) & c);
-			g = (5 * i + 1) & 15;
-		} else if ( 32 <= i && i < 48 ) {
-			f = b ^ c ^ d;
-			g = (3 * i + 5) & 15;
-		} else {
-			f = c ^ (b | (~d));
-			g = (7 * i) & 15;
-		}
+	muse_raise_error( env, _csymbol(L"error:unknown-hash-algorithm"), _cons( name, MUSE_NIL ) );
+	return HASH_SHA1;
+}
 
-		temp = d;
-		d = c;
-		c = b;
-		b = b + leftrotate( (a + f + k[i] + w[g]), r[i] );
-		a = temp;
-	}
+/************************************************/
+/* Hasher objects                               */
+/************************************************/
 
-	m.h0 += a;
-	m.h1 += b;
-	m.h2 += c;
-	m.h3 += d;
+typedef struct
+{
+	muse_functional_object_t base;
+	hash_state_t state;
+} hasher_t;
 
-	return m;
+static void hasher_init( muse_env *env, void *ptr, muse_cell args )
+{
+	hasher_t *hr = (hasher_t*)ptr;
+	hash_init( &hr->state, hash_algo( env, _evalnext(&args) ) );
 }
 
-static md5_t md5_end( const unsigned char *chunk, size_t chunk_size, size_t total_bytes, md5_t m )
+static muse_cell hasher_update( muse_env *env, hasher_t *hr, muse_cell args )
 {
-	unsigned char tail[128];
-	size_t tail_size = 0;
-	//muse_assert( chunk_size < 64 );
-	memcpy( tail, chunk, chunk_size );
-	tail_size = chunk_size;
-	if ( tail_size + 9 > 64 ) {
-		memset( tail + chunk_size, 0, 128 - chunk_size );
-		tail[chunk_size] = 0x80;
-		tail_size = 128;
-	} else {
-		memset( tail + chunk_size, 0, 64 - chunk_size );
-		tail[chunk_size] = 0x80;
-		tail_size = 64;
-	}
-
-	// Append the length of the original data as a 64-bit little endian number.
+	while ( args )
 	{
-		size_t b = (size_t)total_bytes * 8;
-		unsigned char *a = tail + tail_size - 8;
-		a[0] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[1] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[2] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[3] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[4] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[5] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[6] = (unsigned char)(b & 0xFF); b >>= 8;
-		a[7] = (unsigned char)(b & 0xFF);
+		muse_cell thing = _evalnext(&args);
+		if ( !hash_thing( env, &hr->state, thing ) )
+			return muse_raise_error( env, _csymbol(L"error:bad-hash-data-source"), _cons( thing, MUSE_NIL ) );
 	}
 
-	{
-		unsigned char *b = tail, *b_end = tail + tail_size;
-		for ( ; b < b_end; b += 64 )
-			m = md5_update( b, m );
-	}
+	return hr->base.self;
+}
 
-	return m;
+/**
+ * Calling a hasher with data adds the data to it, like
+ * \ref fn_hasher_update "hasher-update". Calling it without
+ * arguments gives the hash, like \ref fn_hasher_finish "hasher-finish".
+ */
+static muse_cell fn_hasher_fn( muse_env *env, hasher_t *hr, muse_cell args )
+{
+	return args ? hasher_update( env, hr, args ) : hash_to_str( env, &hr->state );
 }
 
-static void word_as_hex_le( unsigned int word, muse_char *hex )
+static muse_functional_object_type_t g_hasher_type =
 {
-	hex[6] = num2hex((word >> 28) & 15);
-	hex[7] = num2hex((word >> 24) & 15);
-	hex[4] = num2hex((word >> 20) & 15);
-	hex[5] = num2hex((word >> 16) & 15);
-	hex[2] = num2hex((word >> 12) & 15);
-	hex[3] = num2hex((word >> 8) & 15);
-	hex[0] = num2hex((word >> 4) & 15);
-	hex[1] = num2hex(word & 15);
+	'muSE',
+	'hshr',
+	sizeof(hasher_t),
+	(muse_nativefn_t)fn_hasher_fn,
+	NULL,
+	hasher_init,
+	NULL,
+	NULL,
+	NULL
+};
+
+/**
+ * @code (hasher 'sha1|'sha256|'md5) @endcode
+ *
+ * Makes an incremental hasher, to which data can be added a piece
+ * at a time using \ref fn_hasher_update "hasher-update" - say as
+ * chunks of a file or as they are read off a socket. The hash of
+ * all the data added so far is given by \ref fn_hasher_finish "hasher-finish".
+ * @code
+ * (define h (hasher 'sha256))
+ * (hasher-update h (read-bytes port 65536))
+ * (hasher-update h "more" (read-bytes port 65536))
+ * (hasher-finish h)
+ * @endcode
+ */
+muse_cell fn_hasher( muse_env *env, void *context, muse_cell args )
+{
+	return _mk_functional_object( &g_hasher_type, args );
 }
 
-static muse_cell md5_to_str( muse_env *env, md5_t m )
+/**
+ * @code (hasher-update hasher data ...) @endcode
+ *
+ * Adds each given bytes object, port (read to its end) or text
+ * (as utf8) to the hasher. Evaluates to the hasher.
+ */
+muse_cell fn_hasher_update( muse_env *env, void *context, muse_cell args )
 {
-	muse_cell result_str = muse_mk_text( env, (const muse_char *)0, ((const muse_char *)0) + 32 );
-	muse_char *str = (muse_char*)muse_text_contents( env, result_str, NULL );
-	word_as_hex_le( m.h0, str );
-	word_as_hex_le( m.h1, str + 8 );
-	word_as_hex_le( m.h2, str + 16 );
-	word_as_hex_le( m.h3, str + 24 );
+	muse_cell h = _evalnext(&args);
+	hasher_t *hr = (hasher_t*)_functional_object_data( h, 'hshr' );
 
-	return result_str;
+	if ( !hr )
+		return muse_raise_error( env, _csymbol(L"error:hasher-expected"), _cons( h, MUSE_NIL ) );
+
+	return hasher_update( env, hr, args );
 }
 
-static md5_t md5_hash_bytes( const unsigned char *bytes, size_t sz )
+/**
+ * @code (hasher-finish hasher) @endcode
+ *
+ * Gives the hex string hash of all the data added to the hasher
+ * so far. The hasher is left as it was, so you can carry on adding
+ * data to it and get the hash of the longer data later.
+ */
+muse_cell fn_hasher_finish( muse_env *env, void *context, muse_cell args )
 {
-	md5_t m = md5_init();
-	size_t i = 0;
+	muse_cell h = _evalnext(&args);
+	hasher_t *hr = (hasher_t*)_functional_object_data( h, 'hshr' );
 
-	for ( i = 0; i < sz; i += 64 )
-	{
-		if ( i + 64 < sz )
-			m = md5_update( bytes + i, m );
-		else
-			return md5_end( bytes + i, sz - i, sz, m );
-	}
+	if ( !hr )
+		return muse_raise_error( env, _csymbol(L"error:hasher-expected"), _cons( h, MUSE_NIL ) );
 
-	return m;
+	return muse_add_recent_item( env, (muse_int)fn_hasher_finish, hash_to_str( env, &hr->state ) );
 }
 
-static md5_t md5_hash_port( muse_port_t p )
+/************************************************/
+/* Hashing files in parallel                    */
+/************************************************/
+
+typedef struct
+{
+	hash_algo_t			algo;
+	int					num_files;
+	const muse_char		**filenames;
+	hash_state_t		*results;
+	muse_boolean		*ok;
+#ifdef MUSE_PLATFORM_WINDOWS
+	volatile LONG		next;
+#else
+	volatile int		next;
+#endif
+} hash_files_t;
+
+/**
+ * Takes the next file that no thread has taken yet until there are none
+ * left. Only C library calls are made here, never anything to do with
+ * the environment.
+ */
+static void hash_files_worker( hash_files_t *job )
 {
-	unsigned char chunk[64];
-	size_t chunk_size = 0;
-	md5_t m = md5_init();
-	size_t nbytes = 0;
+	unsigned char *chunk = (unsigned char*)malloc( 65536 );
+	int i;
 
-	while ( !port_eof(p) )
+	while ( (i = (int)atomic_next( &job->next )) < job->num_files )
 	{
-		chunk_size = port_read( chunk, 64, p );
-		nbytes += chunk_size;
+		FILE *f = muse_fopen( job->filenames[i], L"rb" );
+		if ( f )
+		{
+			size_t n;
+			hash_init( job->results + i, job->algo );
+			while ( (n = fread( chunk, 1, 65536, f )) > 0 )
+				hash_update( job->results + i, chunk, n );
+			job->ok[i] = ferror(f) ? MUSE_FALSE : MUSE_TRUE;
+			fclose(f);
+		}
+	}
 
-		if ( chunk_size < 64 ) 
-			break;
+	free( chunk );
+}
 
-		m = md5_update( chunk, m );
-	}
+#ifdef MUSE_PLATFORM_WINDOWS
+static DWORD WINAPI hash_files_thread_proc( LPVOID job )
+{
+	hash_files_worker( (hash_files_t*)job );
+	return 0;
+}
+#else
+static void *hash_files_thread_proc( void *job )
+{
+	hash_files_worker( (hash_files_t*)job );
+	return NULL;
+}
+#endif
 
-	return md5_end( chunk, chunk_size, nbytes, m );
+static int num_processors( void )
+{
+#ifdef MUSE_PLATFORM_WINDOWS
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	return (int)info.dwNumberOfProcessors;
+#else
+	long n = sysconf( _SC_NPROCESSORS_ONLN );
+	return n > 0 ? (int)n : 1;
+#endif
 }
 
 /**
- * @code (md5-hash [bytes|port|string]) @endcode
- *
- * Gives a 32-character hex string representation of the md5 hash of
- * the given bytes.
+ * @code (hash-files 'sha1|'sha256|'md5 filenames [num-threads]) @endcode
  *
- * See http://en.wikipedia.org/wiki/MD5#Pseudocode
- * for the algorithm. The code below is basically a C implementation
- * of whats given there.
+ * Hashes each of the files in the given list and evaluates to a list
+ * of the hex string hashes in the same order. A file that couldn't
+ * be read gets () in its place. The files are read and hashed
+ * on \p num-threads threads, by default as many as there are processors.
+ * The calling process waits till all the files are done.
  */
-muse_cell fn_md5_hash( muse_env *env, void *context, muse_cell args )
+muse_cell fn_hash_files( muse_env *env, void *context, muse_cell args )
 {
-	muse_cell thing = _evalnext(&args);
-	md5_t m;
-	if ( muse_port(env,thing) ) {
-		m = md5_hash_port(muse_port(env,thing));
-	} else if ( muse_functional_object_data( env, thing, 'barr' ) ) {
-		unsigned char *data = muse_bytes_data( env, thing, 0 );
-		size_t nbytes = muse_bytes_size( env, thing );
-		m = md5_hash_bytes( data, nbytes );
-	} else if ( _cellt(thing) == MUSE_TEXT_CELL ) {
-		int len = 0;
-		const muse_char *str = muse_text_contents( env, thing, &len );
-		size_t usz = muse_utf8_size( str, len );
-		char *buffer = (char *)calloc( usz, 1 );
-		usz = muse_unicode_to_utf8( buffer, usz, str, len );
-		m = md5_hash_bytes( (const unsigned char *)buffer, usz );
-		free(buffer);
-	} else {
-		return muse_raise_error( env, _csymbol(L"error:bad-md5-data-source"), _cons( thing, MUSE_NIL ) );
+	hash_algo_t algo = hash_algo( env, _evalnext(&args) );
+	muse_cell files = _evalnext(&args);
+	int num_threads = args ? (int)_intvalue(_evalnext(&args)) : num_processors();
+	hash_files_t job;
+	hash_thread_t *threads;
+	int i, started = 0;
+
+	memset( &job, 0, sizeof(job) );
+	job.algo = algo;
+	job.num_files = muse_list_length( env, files );
+	job.filenames = (const muse_char**)calloc( job.num_files + 1, sizeof(const muse_char*) );
+	job.results = (hash_state_t*)calloc( job.num_files + 1, sizeof(hash_state_t) );
+	job.ok = (muse_boolean*)calloc( job.num_files + 1, sizeof(muse_boolean) );
+
+	for ( i = 0; i < job.num_files; ++i, files = _tail(files) )
+	{
+		muse_cell name = _head(files);
+		if ( _cellt(name) != MUSE_TEXT_CELL )
+		{
+			free( job.filenames ); free( job.results ); free( job.ok );
+			return muse_raise_error( env, _csymbol(L"error:filename-expected"), _cons( name, MUSE_NIL ) );
+		}
+		job.filenames[i] = _text_contents( name, NULL );
 	}
 
-	return muse_add_recent_item( env, (muse_int)fn_md5_hash, md5_to_str( env, m ) );
+	if ( num_threads > job.num_files ) num_threads = job.num_files;
+	if ( num_threads < 1 ) num_threads = 1;
+	threads = (hash_thread_t*)calloc( num_threads, sizeof(hash_thread_t) );
+
+	/* The calling thread is one of the workers. */
+	for ( i = 1; i < num_threads; ++i, ++started )
+	{
+#ifdef MUSE_PLATFORM_WINDOWS
+		threads[i] = CreateThread( NULL, 0, hash_files_thread_proc, &job, 0, NULL );
+		if ( threads[i] == NULL )
+			break;
+#else
+		if ( pthread_create( threads + i, NULL, hash_files_thread_proc, &job ) != 0 )
+			break;
+#endif
+	}
+
+	hash_files_worker( &job );
+
+	for ( i = 1; i <= started; ++i )
+	{
+#ifdef MUSE_PLATFORM_WINDOWS
+		WaitForSingleObject( threads[i], INFINITE );
+		CloseHandle( threads[i] );
+#else
+		pthread_join( threads[i], NULL );
+#endif
+	}
+
+	{
+		muse_cell h = MUSE_NIL, t = MUSE_NIL;
+		int sp = _spos();
+
+		for ( i = 0; i < job.num_files; ++i )
+		{
+			muse_cell c = _cons( job.ok[i] ? hash_to_str( env, job.results + i ) : MUSE_NIL, MUSE_NIL );
+			if ( t ) _sett( t, c ); else h = c;
+			t = c;
+			_unwind(sp);
+			_spush(h);
+		}
+
+		free( threads );
+		free( job.filenames ); free( job.results ); free( job.ok );
+		return h;
+	}
 }
 
 void muse_define_crypto( muse_env *env )
 {
+	static const struct { const muse_char *name; muse_nativefn_t fn; } k_crypto_fns[] =
+	{
+		{	L"sha1-hash",		fn_sha1_hash		},
+		{	L"sha256-hash",		fn_sha256_hash		},
+		{	L"md5-hash",		fn_md5_hash			},
+		{	L"hasher",			fn_hasher			},
+		{	L"hasher-update",	fn_hasher_update	},
+		{	L"hasher-finish",	fn_hasher_finish	},
+		{	L"hash-files",		fn_hash_files		},
+		{	NULL,				NULL				}
+	};
+
 	int sp = _spos();
-	_define( _csymbol(L"sha1-hash"), _mk_nativefn(fn_sha1_hash,NULL) );
-	_define( _csymbol(L"md5-hash"), _mk_nativefn(fn_md5_hash,NULL) );
-	_unwind(sp);
+	int i;
+
+	select_hash_blocks();
+
+	for ( i = 0; k_crypto_fns[i].name; ++i )
+	{
+		_define( _csymbol(k_crypto_fns[i].name), _mk_nativefn( k_crypto_fns[i].fn, NULL ) );
+		_unwind(sp);
+	}
 }
 
 /*@}*/
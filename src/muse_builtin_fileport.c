@@ -8,13 +8,24 @@
  * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
  * for terms and conditions under which this software is provided to you.
  *
- * Implements file ports - a wrapper for I/O using FILE*.
+ * Implements file ports - a wrapper for I/O using FILE*. A file opened
+ * for reading with the 'mapped flag is mapped into memory instead, and
+ * the port's input buffer points straight into the mapping.
  */
 
 #include "muse_port.h"
 #include <stdlib.h>
 #include <memory.h>
 
+#ifdef MUSE_PLATFORM_WINDOWS
+#	include <windows.h>
+#	include <io.h>
+#	include <sys/stat.h>
+#else
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#endif
+
 /** @addtogroup Ports */
 /*@{*/
 
@@ -24,13 +35,26 @@ typedef struct
 	int desc;
 	FILE *file;
 	int reserved0;
+	muse_cell mapping;			/**< The bytes object of the mapped file. */
+	const unsigned char *map;	/**< The mapped file. */
+	size_t map_size;
 } fileport_t;
 
+enum
+{
+	MAPPED_WINDOW_SIZE = 1 << 30	/**< The most of a mapped file that the port's buffer takes in at a time. */
+};
+
+extern muse_cell mk_foreign_bytes( muse_env *env, unsigned char *bytes, muse_int size, void (*release)( unsigned char *bytes, muse_int size ) );
+static muse_boolean map_file( muse_env *env, fileport_t *p );
+
 typedef struct
 {
 	muse_port_type_t port;
 } fileport_type_t;
 
+static fileport_type_t g_mapped_fileport_type;
+
 static void write_utf8_header( muse_env *env, fileport_t *p );
 static void discard_utf8_header( muse_env *env, fileport_t *p );
 
@@ -44,6 +68,7 @@ static void fileport_init( muse_env *env, void *ptr, muse_cell args )
 	muse_boolean expand_braces	= MUSE_FALSE;
 	muse_boolean detect_macros	= MUSE_FALSE;
 	muse_boolean tab_syntax		= MUSE_FALSE;
+	muse_boolean mapped_flag	= MUSE_FALSE;
 
 	muse_cell sym_for_reading	= _csymbol(L"for-reading");
 	muse_cell sym_for_writing	= _csymbol(L"for-writing");
@@ -52,6 +77,7 @@ static void fileport_init( muse_env *env, void *ptr, muse_cell args )
 	muse_cell sym_expand_braces = _csymbol(L"expand-braces");
 	muse_cell sym_detect_macros = _csymbol(L"detect-macros");
 	muse_cell sym_tab_syntax	= _csymbol(L"tab-syntax");
+	muse_cell sym_mapped		= _csymbol(L"mapped");
 
 	muse_cell filename = _evalnext(&args);
 
@@ -74,6 +100,8 @@ static void fileport_init( muse_env *env, void *ptr, muse_cell args )
 			detect_macros = MUSE_TRUE;
 		} else if ( flag == sym_tab_syntax ) 
 			tab_syntax = MUSE_TRUE;
+		else if ( flag == sym_mapped )
+			mapped_flag = MUSE_TRUE;
 	}
 
 	if ( read_flag ) p->base.mode |= MUSE_PORT_READ;
@@ -108,6 +136,24 @@ static void fileport_init( muse_env *env, void *ptr, muse_cell args )
 		p->base.error	= 0;
 		p->base.eof		= 0;
 
+		if ( mapped_flag && read_flag && !write_flag && map_file( env, p ) )
+		{
+			if ( binary_flag || p->map_size < 2 || (p->map[1] != 0x00 && !(p->map[0] == 0xff && p->map[1] == 0xfe)) )
+			{
+				/* Skip any UTF8 header, which the port's position starts past. */
+				if ( !binary_flag && p->map_size >= 3 && p->map[0] == 0xef && p->map[1] == 0xbb && p->map[2] == 0xbf )
+					p->base.in.fpos = 3;
+
+				p->base.base.type_info = (muse_functional_object_type_t*)&g_mapped_fileport_type;
+				break;
+			}
+
+			/* A 16-bit unicode file has to be converted as it is read. */
+			p->mapping	= MUSE_NIL;
+			p->map		= NULL;
+			p->map_size	= 0;
+		}
+
 		if ( !binary_flag )
 		{
 			if ( write_flag )
@@ -120,6 +166,72 @@ static void fileport_init( muse_env *env, void *ptr, muse_cell args )
 	}
 }
 
+static void unmap_file( unsigned char *bytes, muse_int size )
+{
+#ifdef MUSE_PLATFORM_WINDOWS
+	UnmapViewOfFile( bytes );
+#else
+	munmap( bytes, (size_t)size );
+#endif
+}
+
+/**
+ * Maps all of the file, copy on write so that the slices of it handed
+ * out as bytes objects, which can be written to, can't change the file.
+ * Returns MUSE_FALSE if it isn't a file that can be mapped, such as an
+ * empty file or a pipe.
+ */
+static muse_boolean map_file( muse_env *env, fileport_t *p )
+{
+	unsigned char *bytes = NULL;
+	muse_int size;
+
+#ifdef MUSE_PLATFORM_WINDOWS
+	struct _stati64 st;
+	if ( _fstati64( p->desc, &st ) != 0 || !(st.st_mode & _S_IFREG) || st.st_size <= 0 )
+		return MUSE_FALSE;
+
+	size = (muse_int)st.st_size;
+	if ( (muse_int)(SIZE_T)size != size )
+		return MUSE_FALSE;
+
+	{
+		HANDLE m = CreateFileMapping( (HANDLE)_get_osfhandle(p->desc), NULL, PAGE_WRITECOPY, 0, 0, NULL );
+		if ( m == NULL )
+			return MUSE_FALSE;
+
+		/* The view keeps the mapping open. */
+		bytes = (unsigned char*)MapViewOfFile( m, FILE_MAP_COPY, 0, 0, 0 );
+		CloseHandle( m );
+	}
+#else
+	struct stat st;
+	if ( fstat( p->desc, &st ) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 )
+		return MUSE_FALSE;
+
+	size = (muse_int)st.st_size;
+	if ( (muse_int)(size_t)size != size )
+		return MUSE_FALSE;
+
+	bytes = (unsigned char*)mmap( NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE, p->desc, 0 );
+	if ( bytes == (unsigned char*)MAP_FAILED )
+		bytes = NULL;
+#endif
+
+	if ( bytes == NULL )
+		return MUSE_FALSE;
+
+	p->mapping	= mk_foreign_bytes( env, bytes, size, unmap_file );
+	p->map		= bytes;
+	p->map_size	= (size_t)size;
+	return MUSE_TRUE;
+}
+
+static void fileport_mark( muse_env *env, void *ptr )
+{
+	muse_mark( env, ((fileport_t*)ptr)->mapping );
+}
+
 static void fileport_destroy( muse_env *env, void *ptr )
 {
 	fileport_t *p = (fileport_t*)ptr;
@@ -143,6 +255,11 @@ static void fileport_close( void *ptr )
 		p->file = NULL;		
 		p->desc = 0;
 	}
+
+	/* The mapping goes once the slices of it have gone too. */
+	p->mapping	= MUSE_NIL;
+	p->map		= NULL;
+	p->map_size	= 0;
 }
 
 static size_t fileport_read( void *buffer, size_t nbytes, void *port )
@@ -156,6 +273,19 @@ static size_t fileport_read( void *buffer, size_t nbytes, void *port )
 		return read( p->desc, buffer, (unsigned int)nbytes );
 }
 
+static const unsigned char *mapped_fileport_map( void *port, size_t offset, int *nbytes )
+{
+	fileport_t *p = (fileport_t*)port;
+	size_t n;
+
+	if ( p->map == NULL || offset >= p->map_size )
+		return NULL;
+
+	n = p->map_size - offset;
+	*nbytes = (int)(n < MAPPED_WINDOW_SIZE ? n : MAPPED_WINDOW_SIZE);
+	return p->map + offset;
+}
+
 static size_t uc16_fileport_read( void *buffer, size_t nbytes, void *port )
 {
 	fileport_t *p = (fileport_t*)port;
@@ -237,7 +367,8 @@ static fileport_type_t g_fileport_type =
 		fileport_close,
 		fileport_read,
 		fileport_write,
-		fileport_flush
+		fileport_flush,
+		NULL
 	}
 };
 
@@ -259,10 +390,34 @@ static fileport_type_t g_uc16_fileport_type =
 		fileport_close,
 		uc16_fileport_read,
 		NULL,
+		NULL,
 		NULL
 	}
 };
 
+static fileport_type_t g_mapped_fileport_type =
+{
+	{
+		{
+			'muSE',
+			'port',
+			sizeof(fileport_t),
+			NULL,
+			NULL,
+			fileport_init,
+			fileport_mark,
+			fileport_destroy,
+			NULL
+		},
+
+		fileport_close,
+		fileport_read,
+		NULL,
+		NULL,
+		mapped_fileport_map
+	}
+};
+
 static fileport_type_t g_port_type_stdin =
 {
 	{
@@ -281,6 +436,7 @@ static fileport_type_t g_port_type_stdin =
 		NULL,
 		fileport_read,
 		NULL,
+		NULL,
 		NULL
 	}
 };
@@ -303,23 +459,35 @@ static fileport_type_t g_port_type_stdout =
 		NULL,
 		NULL,
 		fileport_write,
-		fileport_flush
+		fileport_flush,
+		NULL
 	}
 };
 
 static fileport_t g_muse_stdports[3] =
 {
 	{	{ 'muSE', (muse_functional_object_type_t*)&g_port_type_stdin, MUSE_NIL },
-		MUSE_STDIN_PORT, NULL, 0
+		MUSE_STDIN_PORT, NULL, 0, MUSE_NIL, NULL, 0
 	},
 	{	{ 'muSE', (muse_functional_object_type_t*)&g_port_type_stdout, MUSE_NIL },
-		MUSE_STDOUT_PORT, NULL, 0
+		MUSE_STDOUT_PORT, NULL, 0, MUSE_NIL, NULL, 0
 	},
 	{	{ 'muSE', (muse_functional_object_type_t*)&g_port_type_stdout, MUSE_NIL },
-		MUSE_STDERR_PORT, NULL, 0
+		MUSE_STDERR_PORT, NULL, 0, MUSE_NIL, NULL, 0
 	}
 };
 
+muse_cell fileport_mapping( muse_port_base_t *p, muse_int *offset )
+{
+	fileport_t *f = (fileport_t*)p;
+
+	if ( p->base.type_info != &g_mapped_fileport_type.port.obj || f->map == NULL )
+		return MUSE_NIL;
+
+	*offset = (muse_int)p->in.fpos;
+	return f->mapping;
+}
+
 MUSEAPI muse_port_t muse_stdport( muse_env *env, muse_stdport_t descriptor )
 {
 	muse_assert( descriptor >= MUSE_STDIN_PORT && descriptor <= MUSE_STDERR_PORT );
@@ -327,7 +495,7 @@ MUSEAPI muse_port_t muse_stdport( muse_env *env, muse_stdport_t descriptor )
 }
 
 /**
- * @code (open-file "filename.txt" ['for-reading 'for-writing 'binary 'expand-braces 'detect-macros 'trust 'tab-syntax]) @endcode
+ * @code (open-file "filename.txt" ['for-reading 'for-writing 'binary 'expand-braces 'detect-macros 'trust 'tab-syntax 'mapped]) @endcode
  *
  * Returns a new file port for reading or writing to it.
  * Use \c read and \c write with the returned port and
@@ -343,6 +511,12 @@ MUSEAPI muse_port_t muse_stdport( muse_env *env, muse_stdport_t descriptor )
  * set, the reader will not execute any code. These flags only affect
  * the port when opened in read mode.
  *
+ * A file opened only for reading with the @code 'mapped @endcode flag
+ * is mapped into memory instead of being read through a buffer, which
+ * suits large files that are read through once. \ref fn_read_bytes "read-bytes"
+ * then gives slices of the mapped file without copying it. Files that
+ * can't be mapped, such as pipes, are read as usual.
+ *
  * For example -
  * @code
  * (let ((f (open-file "output.txt" 'for-writing)))
@@ -482,14 +656,26 @@ MUSEAPI muse_cell muse_load( muse_env *env, FILE *f )
 }
 
 /**
- * Similar to \ref muse_load but works on the given port.
+ * Similar to \ref muse_load but works on the given port. If the port
+ * holds an image written by \ref fn_compile_file "compile-file", it is
+ * loaded with muse_load_image() instead of going through the parser,
+ * and a snapshot written by \ref fn_save_snapshot "save-snapshot" is
+ * loaded with muse_load_snapshot().
  */
 MUSEAPI muse_cell muse_pload( muse_port_t p )
 {
 	muse_env *env = p->env;
 	int sp = _spos();
 	muse_cell result = MUSE_NIL;
-	muse_port_t prevIn = muse_current_port( env, MUSE_INPUT_PORT, p );
+	muse_port_t prevIn;
+
+	if ( muse_is_image_port(p) )
+		return muse_load_image(p);
+
+	if ( muse_is_snapshot_port(p) )
+		return muse_load_snapshot(p);
+
+	prevIn = muse_current_port( env, MUSE_INPUT_PORT, p );
 
 	while ( port_eof(p) == 0 )
 	{
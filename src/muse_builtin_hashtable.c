@@ -16,6 +16,7 @@
 #include "muse_port.h"
 #include <stdlib.h>
 #include <memory.h>
+#include <stddef.h>
 
 /** @addtogroup FunctionalObjects */
 /*@{*/
@@ -56,24 +57,188 @@
  */
 /*@{*/
 
+/**
+ * A slot of a hashtable's open addressed table. The key's hash is kept
+ * in the slot so that probing can skip over most other keys without
+ * looking at them, and so that the entries can be moved to a bigger
+ * table without hashing the keys again.
+ */
+typedef struct
+{
+	muse_int	hash;
+	muse_cell	key;
+	muse_cell	value;			/**< MUSE_NIL for a free slot. */
+} hashtable_slot_t;
+
+/**
+ * A linear probing table of slots. The capacity is always a power
+ * of 2 and the table is never more than 3/4 full, so probing always
+ * ends at a free slot.
+ */
+typedef struct
+{
+	hashtable_slot_t *slots;
+	int			capacity;
+	int			count;
+} hashtable_slots_t;
+
 typedef struct 
 {
 	muse_functional_object_t base;
 	int			count;			/**< The number of kvpairs in the hash table. */
-	int			bucket_count;	/**< The number of buckets in the hash table. */
-	muse_cell	*buckets;		/**< The array holding the buckets. Each bucket is
-									simply an assoc list. */
+	hashtable_slots_t table;	/**< The table that new kvpairs go into. */
+	hashtable_slots_t old;		/**< When the hash table grows, its kvpairs are moved
+									from the old table into the new one a few at a time
+									with each addition, so that no single addition pays
+									for moving all of them. Until then, lookups search
+									both tables. */
+	int			migrated;		/**< All slots of \p old before this one are free. */
 	muse_cell	datafn;			/**< fn(key)->value for use when key is not found. */
 } hashtable_t;
 
-static void get_size_or_datafn( muse_env *env, hashtable_t *h, muse_cell *args )
+/**
+ * The number of old slots looked at with each addition while the
+ * table is growing. Growing doubles the capacity, and the new table
+ * takes 3/4 of the old capacity in additions to fill up again, in
+ * which time at most 7/4 of the old capacity in slots needs stepping
+ * through. So this many steps finish the move well before then.
+ */
+#define HASHTABLE_MIGRATE_STEPS 4
+
+static int slots_capacity_for( int size )
+{
+	int capacity = 8;
+	while ( capacity - capacity / 4 < size )
+		capacity *= 2;
+	return capacity;
+}
+
+static void slots_init( hashtable_slots_t *t, int capacity )
+{
+	t->slots = capacity > 0 ? (hashtable_slot_t*)calloc( capacity, sizeof(hashtable_slot_t) ) : NULL;
+	t->capacity = capacity;
+	t->count = 0;
+}
+
+static void slots_free( hashtable_slots_t *t )
+{
+	free( t->slots );
+	t->slots = NULL;
+	t->capacity = 0;
+	t->count = 0;
+}
+
+/**
+ * muse_hash() of symbols and small integers isn't well spread in its
+ * low bits, so the hash is mixed before taking slot indices from it.
+ */
+static unsigned int hash_mix( muse_int hash )
+{
+	unsigned int x = (unsigned int)(hash ^ (hash >> 32));
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+static int slot_home( muse_int hash, int capacity )
+{
+	return (int)(hash_mix( hash ) & (unsigned int)(capacity - 1));
+}
+
+static int slot_has_key( muse_env *env, const hashtable_slot_t *s, muse_cell key, muse_int hash )
+{
+	if ( s->hash != hash )
+		return MUSE_FALSE;
+
+	if ( s->key == key )
+		return MUSE_TRUE;
+
+	switch ( _cellt(key) )
+	{
+	case MUSE_SYMBOL_CELL	: return MUSE_FALSE; /* Symbols are equal only if they're the same cell. */
+	case MUSE_INT_CELL		: return _cellt(s->key) == MUSE_INT_CELL && _intvalue(s->key) == _intvalue(key);
+	default					: return muse_equal( env, s->key, key );
+	}
+}
+
+static hashtable_slot_t *slots_find( muse_env *env, hashtable_slots_t *t, muse_cell key, muse_int hash )
+{
+	if ( t->count > 0 )
+	{
+		int mask = t->capacity - 1;
+		int i = slot_home( hash, t->capacity );
+		hashtable_slot_t *s;
+
+		while ( (s = t->slots + i)->value )
+		{
+			if ( slot_has_key( env, s, key, hash ) )
+				return s;
+
+			i = (i + 1) & mask;
+		}
+	}
+
+	return NULL;
+}
+
+static void slots_put( hashtable_slots_t *t, muse_int hash, muse_cell key, muse_cell value )
+{
+	int mask = t->capacity - 1;
+	int i = slot_home( hash, t->capacity );
+
+	while ( t->slots[i].value )
+		i = (i + 1) & mask;
+
+	t->slots[i].hash	= hash;
+	t->slots[i].key		= key;
+	t->slots[i].value	= value;
+	++(t->count);
+}
+
+/**
+ * Frees slot i, moving entries later in the probe sequence back into
+ * the hole where that keeps them reachable, so that no tombstones are
+ * needed.
+ */
+static void slots_remove( hashtable_slots_t *t, int i )
+{
+	int mask = t->capacity - 1;
+	int j = i;
+
+	for (;;)
+	{
+		hashtable_slot_t *s;
+		j = (j + 1) & mask;
+		s = t->slots + j;
+
+		if ( !s->value )
+			break;
+
+		/* The entry at j can fill the hole at i if its home slot
+		doesn't lie cyclically in (i,j]. */
+		if ( ((j - slot_home( s->hash, t->capacity )) & mask) >= ((j - i) & mask) )
+		{
+			t->slots[i] = *s;
+			i = j;
+		}
+	}
+
+	t->slots[i].key = MUSE_NIL;
+	t->slots[i].value = MUSE_NIL;
+	--(t->count);
+}
+
+static void get_size_or_datafn( muse_env *env, hashtable_t *h, muse_cell *args, int *size )
 {
 	if ( *args ) {
 		muse_cell arg = _evalnext(args);
 		if ( _isfn(arg) ) {
 			h->datafn = arg;
 		} else if ( _cellt(arg) == MUSE_INT_CELL ) {
-			h->bucket_count = (int)_intvalue( arg );
+			(*size) = (int)_intvalue( arg );
 		}
 	}
 }
@@ -81,30 +246,38 @@ static void get_size_or_datafn( muse_env *env, hashtable_t *h, muse_cell *args )
 static void hashtable_init( muse_env *env, void *p, muse_cell args )
 {
 	hashtable_t *h = (hashtable_t*)p;
+	int size = 0;
 	
-	h->bucket_count = 7;
-
-	get_size_or_datafn( env, h, &args );
-	get_size_or_datafn( env, h, &args );
+	get_size_or_datafn( env, h, &args, &size );
+	get_size_or_datafn( env, h, &args, &size );
 	
-	muse_assert( h->bucket_count > 0 );
-	h->buckets = (muse_cell*)calloc( h->bucket_count, sizeof(muse_cell) );	
+	slots_init( &h->table, slots_capacity_for( size ) );
 }
 
-static void hashtable_mark( muse_env *env, void *p )
+static void hashtable_mark_slots( muse_env *env, hashtable_slots_t *t )
 {
-	hashtable_t *h = (hashtable_t*)p;
-	
-	if ( h->count > 0 )
+	if ( t->count > 0 )
 	{
-		muse_cell *buckets = h->buckets;
-		muse_cell *buckets_end = buckets + h->bucket_count;
-	
-		while ( buckets < buckets_end )
+		hashtable_slot_t *s = t->slots;
+		hashtable_slot_t *s_end = s + t->capacity;
+
+		for ( ; s < s_end; ++s )
 		{
-			muse_mark( env, *buckets++ );
+			if ( s->value )
+			{
+				muse_mark( env, s->key );
+				muse_mark( env, s->value );
+			}
 		}
 	}
+}
+
+static void hashtable_mark( muse_env *env, void *p )
+{
+	hashtable_t *h = (hashtable_t*)p;
+	
+	hashtable_mark_slots( env, &h->table );
+	hashtable_mark_slots( env, &h->old );
 
 	muse_mark( env, h->datafn );
 }
@@ -113,10 +286,26 @@ static void hashtable_destroy( muse_env *env, void *p )
 {
 	hashtable_t *h = (hashtable_t*)p;
 	
-	if ( h->bucket_count > 0 )
+	slots_free( &h->table );
+	slots_free( &h->old );
+}
+
+/**
+ * Steps \p pos through the used slots of the hashtable, the old
+ * table's first. Gives NULL after the last one.
+ */
+static hashtable_slot_t *hashtable_next( hashtable_t *h, int *pos )
+{
+	while ( *pos < h->old.capacity + h->table.capacity )
 	{
-		free(h->buckets);
+		int i = (*pos)++;
+		hashtable_slot_t *s = (i < h->old.capacity) ? h->old.slots + i : h->table.slots + (i - h->old.capacity);
+
+		if ( s->value )
+			return s;
 	}
+
+	return NULL;
 }
 
 /**
@@ -137,21 +326,15 @@ static void hashtable_write( muse_env *env, void *ptr, void *port )
 	port_write( "hashtable '(", 12, p );
 	
 	{
-		int b, i;
+		int pos = 0, i = 0, sp = _spos();
+		hashtable_slot_t *s;
 		
-		/* Step through the buckets. */
-		for ( b = 0, i = 0; b < h->bucket_count && i < h->count; ++b )
+		while ( (s = hashtable_next( h, &pos )) )
 		{
-			muse_cell alist = h->buckets[b];
-			
-			/* Step through the pairs in each bucket. */
-			while ( alist )
-			{
-				if ( i > 0 ) port_putc( ' ', p );
-				muse_pwrite( p, _head(alist) );
-				alist = _tail(alist);
-				++i;
-			}
+			if ( i > 0 ) port_putc( ' ', p );
+			muse_pwrite( p, _cons( s->key, s->value ) );
+			_unwind(sp);
+			++i;
 		}
 	}
 	
@@ -159,43 +342,44 @@ static void hashtable_write( muse_env *env, void *ptr, void *port )
 	port_putc( '}', p );
 }
 
-static int bucket_for_hash( muse_int hash, int modulus )
-{
-	return (int)(((hash % modulus) + modulus) % modulus);
-}
-
-static void hashtable_rehash( muse_env *env, hashtable_t *h, int new_bucket_count )
+/**
+ * Moves up to \p steps of the old table's slots into the new table.
+ */
+static void hashtable_migrate( hashtable_t *h, int steps )
 {
-	muse_cell *new_buckets;
-	
-	new_bucket_count = new_bucket_count | 1;
-	new_buckets = (muse_cell*)calloc( new_bucket_count, sizeof(muse_cell) );
-	
-	/* Note that in the following rehash loop,
-	no cons happens. */
+	while ( h->old.count > 0 && steps-- > 0 )
 	{
-		int i = 0, N = h->bucket_count;
-		for ( ; i < N; ++i )
+		hashtable_slot_t *s = h->old.slots + h->migrated;
+
+		if ( s->value )
 		{
-			muse_cell alist = h->buckets[i];
-						
-			while ( alist )
-			{
-				muse_int hash_i = muse_hash( env, _head( _head( alist ) ) );
-				int new_b		= bucket_for_hash( hash_i, new_bucket_count );
-				muse_cell next	= _tail(alist);
-							
-				_sett( alist, new_buckets[new_b] );
-				new_buckets[new_b] = alist;
-				alist = next;
-			}
+			/* Removing the entry can move a later one into
+			this slot, so look at the same slot again. */
+			slots_put( &h->table, s->hash, s->key, s->value );
+			slots_remove( &h->old, h->migrated );
+		}
+		else
+		{
+			++(h->migrated);
 		}
 	}
-				
-	/* Replace the original buckets with the new buckets. */
-	free( h->buckets );
-	h->bucket_count = new_bucket_count;
-	h->buckets = new_buckets;
+
+	if ( h->old.count == 0 && h->old.slots )
+	{
+		slots_free( &h->old );
+		h->migrated = 0;
+	}
+}
+
+static void hashtable_grow( hashtable_t *h )
+{
+	/* Finish any earlier move before starting another. */
+	while ( h->old.count > 0 )
+		hashtable_migrate( h, h->old.capacity );
+
+	h->old = h->table;
+	h->migrated = 0;
+	slots_init( &h->table, 2 * h->old.capacity );
 }
 
 muse_cell fn_hashtable_stats( muse_env *env, void *context, muse_cell args )
@@ -206,86 +390,97 @@ muse_cell fn_hashtable_stats( muse_env *env, void *context, muse_cell args )
 	if ( h )
 	{
 		int collision_count = 0;
-		int unused_buckets = 0;
-		int b = 0;
+		int pos = 0;
+		hashtable_slot_t *s;
 		
-		for ( ; b < h->bucket_count; ++b )
+		/* An entry that isn't in its home slot had a collision. */
+		while ( (s = hashtable_next( h, &pos )) )
 		{
-			int bucket_size = _list_length( h->buckets[b] );
-			if ( bucket_size == 0 )
-				++unused_buckets;
-			else 
-				collision_count += (bucket_size - 1);
+			hashtable_slots_t *t = (pos <= h->old.capacity) ? &h->old : &h->table;
+			if ( (int)(s - t->slots) != slot_home( s->hash, t->capacity ) )
+				++collision_count;
 		}
 		
 		return muse_list( env, "cccc",
 						  muse_list( env, "si", "element-count", h->count ),
-						  muse_list( env, "si", "bucket-count", h->bucket_count ),
-						  muse_list( env, "si", "unused-buckets", unused_buckets ),
+						  muse_list( env, "si", "bucket-count", h->table.capacity + h->old.capacity ),
+						  muse_list( env, "si", "unused-buckets", h->table.capacity + h->old.capacity - h->count ),
 						  muse_list( env, "si", "collisions", collision_count ) );
 	}
 	
 	return MUSE_NIL;
 }
 
-static muse_cell *hashtable_add( muse_env *env, hashtable_t *h, muse_cell key, muse_cell value, muse_int *hash_opt )
+/**
+ * Adds a key that isn't in the hashtable already.
+ */
+static void hashtable_add( muse_env *env, hashtable_t *h, muse_cell key, muse_cell value, muse_int hash )
 {
-	muse_int hash;
-	
-	if ( hash_opt )
-		hash = *hash_opt;
+	muse_assert( value != MUSE_NIL );
+
+	if ( h->count + 1 > h->table.capacity - h->table.capacity / 4 )
+		hashtable_grow( h );
+
+	slots_put( &h->table, hash, key, value );
+	++(h->count);
+
+	hashtable_migrate( h, HASHTABLE_MIGRATE_STEPS );
+}
+
+static void hashtable_remove( hashtable_t *h, hashtable_slot_t *s )
+{
+	if ( s >= h->table.slots && s < h->table.slots + h->table.capacity )
+	{
+		slots_remove( &h->table, (int)(s - h->table.slots) );
+	}
 	else
-		hash = muse_hash( env, key );
-	
 	{
-		int bucket = bucket_for_hash( hash, h->bucket_count );
-		
-		if ( h->count + 1 >= 2 * h->bucket_count )
-		{
-			/* Need to rehash and determine new bucket. */
-			hashtable_rehash( env, h, h->bucket_count * 2 );
-			
-			bucket = bucket_for_hash( hash, h->bucket_count );
-		}
-
-		/* Add the kvpair to the determined bucket. */
-		muse_assert( value != MUSE_NIL );
-		h->buckets[bucket] = _cons( _cons( key, value ), h->buckets[bucket] );
-		++(h->count);
-		
-		return h->buckets + bucket;
+		slots_remove( &h->old, (int)(s - h->old.slots) );
 	}
+
+	--(h->count);
+
+	hashtable_migrate( h, HASHTABLE_MIGRATE_STEPS );
 }
 
-static void hashtable_fast_add( muse_env *env, hashtable_t *h, muse_cell *kvpair, muse_cell key, muse_cell value )
+static hashtable_slot_t *hashtable_get( muse_env *env, hashtable_t *h, muse_cell key, muse_int hash )
 {
-	muse_assert( *kvpair == MUSE_NIL );
+	hashtable_slot_t *s = slots_find( env, &h->table, key, hash );
 
-	(*kvpair) = _cons( _cons( key, value ), MUSE_NIL );
-	++(h->count);
+	if ( !s && h->old.count > 0 )
+		s = slots_find( env, &h->old, key, hash );
 
-	if ( h->count >= 2 * h->bucket_count )
-		hashtable_rehash( env, h, 2 * h->bucket_count );
+	return s;
 }
 
-static muse_cell *hashtable_get( muse_env *env, hashtable_t *h, muse_cell key, muse_int *hash_out )
+/**
+ * Associates the value with the key, replacing what was there.
+ * A value of () removes the key.
+ */
+static void hashtable_set( muse_env *env, hashtable_t *h, muse_cell key, muse_cell value, muse_int hash )
 {
-	muse_int hash = muse_hash(env,key);
-	int bucket = bucket_for_hash( hash, h->bucket_count );
+	hashtable_slot_t *s = hashtable_get( env, h, key, hash );
 
-	if ( hash_out ) 
-		(*hash_out) = hash;
-	
-	return muse_assoc_iter( env, h->buckets + bucket, key );
+	if ( s )
+	{
+		if ( value )
+			s->value = value;
+		else
+			hashtable_remove( h, s );
+	}
+	else if ( value )
+	{
+		hashtable_add( env, h, key, value, hash );
+	}
 }
 
 static muse_cell hashtable_get_prop( muse_env *env, void *self, muse_cell key, muse_cell argv ) {
 	hashtable_t *h = (hashtable_t*)self;
-	muse_int hash = 0;
-	muse_cell *kvpair = hashtable_get( env, h, key, &hash );
+	muse_int hash = muse_hash( env, key );
+	hashtable_slot_t *s = hashtable_get( env, h, key, hash );
 
-	if ( *kvpair ) {
-		muse_cell val = _tail( _head( *kvpair ) );
+	if ( s ) {
+		muse_cell val = s->value;
 		return argv ? muse_get( env, muse_add_recent_item( env, key, val ), muse_head( env, argv ), muse_tail( env, argv ) ) : val;
 	} else {
 		/* key doesn't exist. Try to compute using the func spec. */
@@ -295,9 +490,10 @@ static muse_cell hashtable_get_prop( muse_env *env, void *self, muse_cell key, m
 		if ( h->datafn )
 			value = _force(muse_apply( env, h->datafn, _cons(key,MUSE_NIL), MUSE_TRUE, MUSE_TRUE ));
 
-		/* Cache the value in the hashtable. */
+		/* Cache the value in the hashtable. The datafn may
+		have added the key itself. */
 		if ( value )
-			hashtable_add( env, h, key, value, &hash );
+			hashtable_set( env, h, key, value, hash );
 
 		return argv ? muse_get( env, muse_add_recent_item( env, key, value ), muse_head( env, argv ), muse_tail( env, argv ) ) 
 					: muse_add_recent_item( env, key, value );
@@ -307,16 +503,17 @@ static muse_cell hashtable_get_prop( muse_env *env, void *self, muse_cell key, m
 static muse_cell hashtable_put_prop( muse_env *env, void *self, muse_cell key, muse_cell argv ) {
 	muse_cell value = _next(&argv);
 	hashtable_t *h = (hashtable_t*)self;
+	muse_int hash = muse_hash( env, key );
 
-	muse_cell *kvpair = hashtable_get( env, h, key, NULL );
-	if ( *kvpair ) {
+	hashtable_slot_t *s = hashtable_get( env, h, key, hash );
+	if ( s ) {
 		if ( value )
 		{
 			/* It already exists. Simply change the value to the new one. */
 			if ( argv ) {
-				return muse_put( env, muse_add_recent_item( env, key, _tail(_head(*kvpair)) ), value, argv );
+				return muse_put( env, muse_add_recent_item( env, key, s->value ), value, argv );
 			} else {
-				_sett( _head(*kvpair), value );
+				s->value = value;
 				return muse_add_recent_item( env, key, value );
 			}
 		} 
@@ -324,18 +521,14 @@ static muse_cell hashtable_put_prop( muse_env *env, void *self, muse_cell key, m
 		{
 			/* The value is MUSE_NIL. Which means we have to remove
 			the kvpair from the hashtable. */
-			(*kvpair) = _tail( *kvpair );
-			--(h->count);
+			hashtable_remove( h, s );
 			return MUSE_NIL;
 		}
 	} else {
 		if ( value )
 		{
-			/* It doesn't exist. Need to add a new entry.
-			Check to see if we need to rehash the table. 
-			We rehash if we have to do more than 2 linear
-			searches on the average for each access. */
-			hashtable_fast_add( env, h, kvpair, key, value );
+			/* It doesn't exist. Need to add a new entry. */
+			hashtable_add( env, h, key, value, hash );
 			return muse_add_recent_item( env, key, value );
 		}
 		else
@@ -376,33 +569,21 @@ static muse_cell hashtable_size( muse_env *env, void *self )
 static void hashtable_merge_one( muse_env *env, hashtable_t *h1, muse_cell key, muse_cell new_value, muse_cell reduction_fn )
 {
 	int sp = _spos();
-	muse_int hash = 0;
-	muse_cell *new_kv = hashtable_get( env, h1, key, &hash );
+	muse_int hash = muse_hash( env, key );
+	hashtable_slot_t *s = hashtable_get( env, h1, key, hash );
 	
-	if ( new_kv && *new_kv )
-	{
-		/* Key already exists. */
-		if ( reduction_fn )
-		{
-			/* Set the value to reduction_fn( current_value, new_value ). */
-			_sett( _head( *new_kv ), 
-						   _apply( reduction_fn,
-									   _cons( _tail( _head( *new_kv ) ),
-												  _cons( new_value,
-															 MUSE_NIL ) ),
-									   MUSE_TRUE ) );					
-		}
-		else
-		{
-			/* No reduction function. Simply replace the old value with the new one. */
-			_sett( _head( *new_kv ), new_value );
-		}
-	}
-	else
+	if ( s && reduction_fn )
 	{
-		/* Key doesn't exist. Need to add new. */
-		hashtable_add( env, h1, key, new_value, &hash );
+		/* Key already exists. Set the value to 
+		reduction_fn( current_value, new_value ). */
+		new_value = _apply( reduction_fn,
+							_cons( s->value, _cons( new_value, MUSE_NIL ) ),
+							MUSE_TRUE );
 	}
+
+	/* The reduction function may have changed the table,
+	so look the key up again. */
+	hashtable_set( env, h1, key, new_value, hash );
 	
 	_unwind(sp);
 }
@@ -417,23 +598,18 @@ static muse_cell hashtable_map( muse_env *env, void *self, muse_cell fn )
 	muse_cell args = _cons( MUSE_NIL, MUSE_NIL );
 	
 	int sp = _spos();
-	int b;
-	for ( b = 0; b < h->bucket_count; ++b )
+	int pos = 0;
+	hashtable_slot_t *s;
+	while ( (s = hashtable_next( h, &pos )) )
 	{
-		muse_cell alist = h->buckets[b];
+		muse_cell key = s->key;
+		muse_int hash = s->hash;
 		
-		while ( alist )
-		{
-			muse_cell kv = _head(alist);
-			
-			_seth( args, _tail( kv ) );
-			
-			hashtable_add( env, result_ptr, _head( kv ), _apply( fn, args, MUSE_TRUE ), NULL );
-						
-			alist = _tail(alist);
-			
-			_unwind(sp);
-		}
+		_seth( args, s->value );
+		
+		hashtable_set( env, result_ptr, key, _apply( fn, args, MUSE_TRUE ), hash );
+		
+		_unwind(sp);
 	}
 	
 	if ( h->datafn != MUSE_NIL ) {
@@ -452,24 +628,12 @@ static muse_cell hashtable_map( muse_env *env, void *self, muse_cell fn )
 
 static void hashtable_merge( muse_env *env, hashtable_t *h1, hashtable_t *h2, muse_cell reduction_fn )
 {
-	int b = 0;
-	int sp = _spos();
+	int pos = 0;
+	hashtable_slot_t *s;
 	
-	for ( b = 0; b < h2->bucket_count; ++b )
+	while ( (s = hashtable_next( h2, &pos )) )
 	{
-		muse_cell alist = h2->buckets[b];
-		
-		while ( alist )
-		{
-			muse_cell kv = _head(alist);
-			muse_cell key = _head(kv);
-			muse_cell value = _tail(kv);
-			
-			hashtable_merge_one( env, h1, key, value, reduction_fn );
-			
-			_unwind(sp);
-			alist = _tail(alist);
-		}
+		hashtable_merge_one( env, h1, s->key, s->value, reduction_fn );
 	}
 }
 
@@ -504,27 +668,22 @@ static muse_cell hashtable_collect( muse_env *env, void *self, muse_cell predica
 	/* Step through self's contents and add all the key-value pairs that satisfy the predicate. */
 	{
 		int sp = _spos();
-		int b = 0;
-		for ( b = 0; b < h->bucket_count; ++b )
+		int pos = 0;
+		hashtable_slot_t *s;
+		while ( (s = hashtable_next( h, &pos )) )
 		{
-			muse_cell alist = h->buckets[b];
+			muse_cell kv = _cons( s->key, s->value );
 			
-			while ( alist )
+			if ( !predicate || _apply( predicate, kv, MUSE_TRUE ) )
 			{
-				muse_cell kv = _head( alist );
-				
-				if ( !predicate || _apply( predicate, kv, MUSE_TRUE ) )
-				{
-					/* Key-value pair satisfied the predicate. */
-					if ( mapper )
-						kv = _apply( mapper, kv, MUSE_TRUE );
-					
-					hashtable_merge_one( env, result_ptr, _head(kv), _tail(kv), reduction_fn );
-				}
+				/* Key-value pair satisfied the predicate. */
+				if ( mapper )
+					kv = _apply( mapper, kv, MUSE_TRUE );
 				
-				_unwind(sp);
-				alist = _tail(alist);
+				hashtable_merge_one( env, result_ptr, _head(kv), _tail(kv), reduction_fn );
 			}
+			
+			_unwind(sp);
 		}
 	}
 	
@@ -537,27 +696,20 @@ static muse_cell hashtable_reduce( muse_env *env, void *self, muse_cell reductio
 	
 	muse_cell result = initial;
 	muse_cell args = _cons( result, _cons( MUSE_NIL, MUSE_NIL ) );
-	muse_cell *arg1 = &(_ptr(args)->cons.head);
-	muse_cell *arg2 = &(_ptr(_tail(args))->cons.head);
+	muse_cell arg2 = _tail(args);
 	
 	int sp = _spos();
-	int b = 0;
-	for ( b = 0; b < h->bucket_count; ++b )
+	int pos = 0;
+	hashtable_slot_t *s;
+	while ( (s = hashtable_next( h, &pos )) )
 	{
-		muse_cell alist = h->buckets[b];
+		_seth( args, result );
+		_seth( arg2, s->value );
 		
-		while ( alist )
-		{
-			(*arg1) = result;
-			(*arg2) = _tail( _head( alist ) );
-			
-			result = _apply( reduction_fn, args, MUSE_TRUE );
-			
-			_unwind(sp);
-			_spush(result);
-			
-			alist = _tail(alist);
-		}
+		result = _apply( reduction_fn, args, MUSE_TRUE );
+		
+		_unwind(sp);
+		_spush(result);
 	}
 	
 	return result;
@@ -566,23 +718,17 @@ static muse_cell hashtable_reduce( muse_env *env, void *self, muse_cell reductio
 static muse_cell hashtable_iterator( muse_env *env, hashtable_t *self, muse_iterator_callback_t callback, void *context )
 {
 	int sp = _spos();
-	int b;
-	muse_boolean cont = MUSE_TRUE;
+	int pos = 0;
+	hashtable_slot_t *s;
 	
-	for ( b = 0; b < self->bucket_count; ++b )
+	while ( (s = hashtable_next( self, &pos )) )
 	{
-		muse_cell alist = self->buckets[b];
-		
-		while ( alist )
-		{
-			cont = callback( env, self, context, _tail(_head(alist)) );
-			_unwind(sp);
-			if ( !cont )
-				return _head(_head(alist)); /**< Return the key. */
-			
-			alist = _tail(alist);
-		}
-	}	
+		muse_cell key = s->key;
+		muse_boolean cont = callback( env, self, context, s->value );
+		_unwind(sp);
+		if ( !cont )
+			return key; /**< Return the key. */
+	}
 	
 	return MUSE_NIL;
 }
@@ -671,71 +817,45 @@ muse_cell fn_hashtable_size( muse_env *env, void *context, muse_cell args )
 	return _mk_int( h->count );
 }
 
-typedef struct {
-	muse_cell list;
-	int count;
-} copy_list_data_t;
-
-static muse_cell list_items( muse_env *env, void *context, int i, muse_boolean *eol )
-{
-	copy_list_data_t *data = (copy_list_data_t*)context;
-	if ( data->list ) {
-		(*eol) = MUSE_FALSE;
-		data->count++;
-		return _next(&(data->list));
-	} else {
-		(*eol) = MUSE_TRUE;
-		return MUSE_NIL;
-	}
-}
-
-static muse_cell copy_list( muse_env *env, muse_cell list, int *count )
-{
-	copy_list_data_t data = { list, 0 };
-	muse_cell result = muse_generate_list( env, list_items, &data );
-	if ( count ) (*count) = data.count;
-	return result;
-}
-
 /**
  * (hashtable alist).
  * Returns a hash table with the same contents as the given alist.
+ * If a key occurs more than once in the alist, the first one's value
+ * is used, same as with \ref fn_assoc "assoc".
  *
  * Supports \ref fn_the "the".
  */
 muse_cell fn_alist_to_hashtable( muse_env *env, void *context, muse_cell args )
 {
-	muse_cell ht = fn_mk_hashtable( env, NULL, MUSE_NIL );
-	
 	muse_cell alist = _evalnext(&args);
-	int count = 0;
-	muse_cell alist_copy = copy_list( env, alist, &count );
+	muse_cell ht = muse_mk_hashtable( env, _list_length(alist) );
+	hashtable_t *h = (hashtable_t*)_functional_object_data(ht,'hash');
 
+	while ( alist )
 	{
-		hashtable_t *h = (hashtable_t*)_functional_object_data(ht,'hash');
-		h->count = count;
-		h->buckets[0] = alist_copy;
-		hashtable_rehash( env, h, count );
+		muse_cell kv = _next(&alist);
+		muse_cell key = _head(kv);
+		muse_int hash = muse_hash( env, key );
+
+		if ( _tail(kv) && !hashtable_get( env, h, key, hash ) )
+			hashtable_add( env, h, key, _tail(kv), hash );
 	}
 	
 	return muse_add_recent_item( env, (muse_int)fn_alist_to_hashtable, ht );
 }
 
 typedef struct {
-	muse_cell intrabucket_iter;
-	muse_cell *buckets_iter;
-	muse_cell *buckets_end;
+	hashtable_t *h;
+	int pos;
 } h2a_data_t;
 
 static muse_cell h2a_generator( muse_env *env, h2a_data_t *data, int i, muse_boolean *eol )
 {
-	if ( data->intrabucket_iter ) {
+	hashtable_slot_t *s = hashtable_next( data->h, &(data->pos) );
+
+	if ( s ) {
 		(*eol) = MUSE_FALSE;
-		return _next(&(data->intrabucket_iter));
-	} else if ( data->buckets_iter + 1 < data->buckets_end ) {
-		++(data->buckets_iter);
-		data->intrabucket_iter = *(data->buckets_iter);
-		return h2a_generator( env, data, i, eol );
+		return _cons( s->key, s->value );
 	} else {
 		(*eol) = MUSE_TRUE;
 		return MUSE_NIL;
@@ -756,7 +876,7 @@ muse_cell fn_hashtable_to_alist( muse_env *env, void *context, muse_cell args )
 	muse_assert( h && h->base.type_info->type_word == 'hash' );
 	
 	{
-		h2a_data_t data = { *(h->buckets), h->buckets, h->buckets + h->bucket_count };
+		h2a_data_t data = { h, 0 };
 		return muse_add_recent_item( env, 
 									 (muse_int)fn_hashtable_to_alist, 
 									 muse_generate_list( env, (muse_list_generator_t)h2a_generator, &data ) );
@@ -843,5 +963,943 @@ MUSEAPI muse_cell muse_hashtable_put( muse_env *env, muse_cell ht, muse_cell key
 	return result;
 }
 
+/*@}*/
+
+/**
+ * @defgroup PersistentMaps Persistent maps
+ *
+ * A persistent map is like a \ref Hashtables "hashtable" that never 
+ * changes. Adding or removing keys gives a new map and leaves the
+ * original as it was, so a map can be handed to another process with
+ * \ref fn_post "post", or kept as a snapshot, without copying it and
+ * without worrying about it being changed underneath.
+ *
+ * The map is a hash array mapped trie, a tree of nodes with up to 32
+ * branches, picked by successive 5 bits of the key's hash. A new 
+ * version of a map copies only the nodes on the path to the changed
+ * key - at most 7 - and shares all the others with the old version,
+ * so \ref fn_pmap_assoc "pmap-assoc" and \ref fn_pmap_dissoc "pmap-dissoc"
+ * take O(log32 n) time and space. Nodes are reference counted, so
+ * those no map uses any more are freed as soon as their maps are 
+ * collected.
+ *
+ * Like a hashtable, @code (m key) @endcode and @code (get m key) @endcode
+ * give the value for the key or () if the map doesn't have the key, 
+ * though \ref fn_put "put" raises error:readonly-object. \ref fn_map "map",
+ * \ref fn_collect "collect", \ref fn_reduce "reduce", \ref fn_join "join",
+ * \ref fn_for_each "for-each" and \ref fn_find "find" work with maps 
+ * as they do with hashtables. Their results are maps too.
+ *
+ * @code
+ * (define m1 (pmap '((ceo . pete) (coo . terence))))
+ * (define m2 (pmap-assoc m1 'company 'muvee))
+ * (print (m2 'company) (m1 'company))
+ *      > muvee ()
+ * (print (pmap-size (pmap-dissoc m2 'coo)) (pmap-size m2))
+ *      > 2 3
+ * @endcode
+ */
+/*@{*/
+
+/**
+ * A trie node. A branch node has an entry for each bit set in
+ * \p datamap and a child node for each bit set in \p nodemap, both in 
+ * order of the bits. Keys whose hashes agree in all 32 bits end up in
+ * a collision node below the last branch level, which just holds them
+ * in a list with both maps 0.
+ */
+typedef struct _pmap_node_t
+{
+	int					refs;
+	unsigned int		datamap;
+	unsigned int		nodemap;
+	int					nentries;
+	int					nnodes;
+	struct _pmap_node_t	**nodes;
+	hashtable_slot_t	entries[1];
+} pmap_node_t;
+
+typedef struct 
+{
+	muse_functional_object_t base;
+	int			count;			/**< The number of kvpairs in the map. */
+	pmap_node_t	*root;			/**< NULL for an empty map. */
+} pmap_t;
+
+#define PMAP_BITS 5
+#define PMAP_LEVELS_END 32	/**< Shifts from here on are collision nodes. */
+
+static int pmap_popcount( unsigned int x )
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	x = (x + (x >> 4)) & 0x0F0F0F0F;
+	return (int)((x * 0x01010101) >> 24);
+}
+
+static unsigned int pmap_bit( unsigned int bits, int shift )
+{
+	return 1u << ((bits >> shift) & 31);
+}
+
+static pmap_node_t *pmap_node_alloc( int nentries, int nnodes )
+{
+	size_t entries_size = sizeof(hashtable_slot_t) * (nentries > 0 ? nentries : 1);
+	pmap_node_t *n = (pmap_node_t*)malloc( offsetof(pmap_node_t,entries) + entries_size + sizeof(pmap_node_t*) * nnodes );
+	n->refs = 1;
+	n->datamap = 0;
+	n->nodemap = 0;
+	n->nentries = nentries;
+	n->nnodes = nnodes;
+	n->nodes = (pmap_node_t**)((char*)n->entries + entries_size);
+	return n;
+}
+
+static pmap_node_t *pmap_node_retain( pmap_node_t *n )
+{
+	if ( n )
+		++(n->refs);
+	return n;
+}
+
+static void pmap_node_release( pmap_node_t *n )
+{
+	if ( n && --(n->refs) == 0 )
+	{
+		int i;
+		for ( i = 0; i < n->nnodes; ++i )
+			pmap_node_release( n->nodes[i] );
+		free(n);
+	}
+}
+
+static void pmap_node_mark( muse_env *env, pmap_node_t *n )
+{
+	int i;
+
+	for ( i = 0; i < n->nentries; ++i )
+	{
+		muse_mark( env, n->entries[i].key );
+		muse_mark( env, n->entries[i].value );
+	}
+
+	for ( i = 0; i < n->nnodes; ++i )
+		pmap_node_mark( env, n->nodes[i] );
+}
+
+/**
+ * Gives a copy of branch node \p n with the position \p bit holding
+ * \p entry, or \p child, or nothing if both are NULL. The copy takes over
+ * the caller's reference to \p child and shares all the other children.
+ */
+static pmap_node_t *pmap_node_edit( pmap_node_t *n, unsigned int bit, const hashtable_slot_t *entry, pmap_node_t *child )
+{
+	unsigned int datamap = (n->datamap & ~bit) | (entry ? bit : 0);
+	unsigned int nodemap = (n->nodemap & ~bit) | (child ? bit : 0);
+	pmap_node_t *e = pmap_node_alloc( pmap_popcount(datamap), pmap_popcount(nodemap) );
+	int di = pmap_popcount( n->datamap & (bit - 1) );
+	int ni = pmap_popcount( n->nodemap & (bit - 1) );
+	int had_entry = (n->datamap & bit) ? 1 : 0;
+	int had_node = (n->nodemap & bit) ? 1 : 0;
+	int i;
+
+	e->datamap = datamap;
+	e->nodemap = nodemap;
+
+	memcpy( e->entries, n->entries, sizeof(hashtable_slot_t) * di );
+	if ( entry )
+		e->entries[di] = *entry;
+	memcpy( e->entries + di + (entry ? 1 : 0), n->entries + di + had_entry, sizeof(hashtable_slot_t) * (n->nentries - di - had_entry) );
+
+	for ( i = 0; i < ni; ++i )
+		e->nodes[i] = pmap_node_retain( n->nodes[i] );
+	if ( child )
+		e->nodes[ni] = child;
+	for ( i = ni + had_node; i < n->nnodes; ++i )
+		e->nodes[i - had_node + (child ? 1 : 0)] = pmap_node_retain( n->nodes[i] );
+
+	return e;
+}
+
+/**
+ * Makes the node at the given shift that holds the two entries, whose
+ * keys are different.
+ */
+static pmap_node_t *pmap_node_pair( const hashtable_slot_t *e1, unsigned int bits1, const hashtable_slot_t *e2, unsigned int bits2, int shift )
+{
+	pmap_node_t *n;
+
+	if ( shift >= PMAP_LEVELS_END )
+	{
+		n = pmap_node_alloc( 2, 0 );
+		n->entries[0] = *e1;
+		n->entries[1] = *e2;
+	}
+	else
+	{
+		unsigned int b1 = pmap_bit( bits1, shift );
+		unsigned int b2 = pmap_bit( bits2, shift );
+
+		if ( b1 == b2 )
+		{
+			n = pmap_node_alloc( 0, 1 );
+			n->nodemap = b1;
+			n->nodes[0] = pmap_node_pair( e1, bits1, e2, bits2, shift + PMAP_BITS );
+		}
+		else
+		{
+			n = pmap_node_alloc( 2, 0 );
+			n->datamap = b1 | b2;
+			n->entries[b1 < b2 ? 0 : 1] = *e1;
+			n->entries[b1 < b2 ? 1 : 0] = *e2;
+		}
+	}
+
+	return n;
+}
+
+static const hashtable_slot_t *pmap_node_find( muse_env *env, pmap_node_t *n, muse_cell key, muse_int hash )
+{
+	unsigned int bits = hash_mix( hash );
+	int shift = 0;
+
+	while ( n )
+	{
+		if ( shift >= PMAP_LEVELS_END )
+		{
+			int i;
+			for ( i = 0; i < n->nentries; ++i )
+			{
+				if ( slot_has_key( env, n->entries + i, key, hash ) )
+					return n->entries + i;
+			}
+			return NULL;
+		}
+		else
+		{
+			unsigned int bit = pmap_bit( bits, shift );
+
+			if ( n->datamap & bit )
+			{
+				const hashtable_slot_t *e = n->entries + pmap_popcount( n->datamap & (bit - 1) );
+				return slot_has_key( env, e, key, hash ) ? e : NULL;
+			}
+			else if ( n->nodemap & bit )
+			{
+				n = n->nodes[pmap_popcount( n->nodemap & (bit - 1) )];
+				shift += PMAP_BITS;
+			}
+			else
+			{
+				return NULL;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Gives the node that has what \p n has, with the entry's key 
+ * associated with the entry's value. Sets \p added if the key is new.
+ */
+static pmap_node_t *pmap_node_assoc( muse_env *env, pmap_node_t *n, const hashtable_slot_t *entry, unsigned int bits, int shift, int *added )
+{
+	if ( !n )
+	{
+		/* An empty map gets a root with just the entry. */
+		n = pmap_node_alloc( 1, 0 );
+		n->datamap = pmap_bit( bits, shift );
+		n->entries[0] = *entry;
+		*added = 1;
+		return n;
+	}
+
+	if ( shift >= PMAP_LEVELS_END )
+	{
+		pmap_node_t *e;
+		int i;
+
+		for ( i = 0; i < n->nentries; ++i )
+		{
+			if ( slot_has_key( env, n->entries + i, entry->key, entry->hash ) )
+				break;
+		}
+
+		if ( i < n->nentries && n->entries[i].value == entry->value )
+			return pmap_node_retain(n);
+
+		*added = (i == n->nentries);
+		e = pmap_node_alloc( n->nentries + *added, 0 );
+		memcpy( e->entries, n->entries, sizeof(hashtable_slot_t) * n->nentries );
+		e->entries[i] = *entry;
+		return e;
+	}
+	else
+	{
+		unsigned int bit = pmap_bit( bits, shift );
+
+		if ( n->datamap & bit )
+		{
+			const hashtable_slot_t *e = n->entries + pmap_popcount( n->datamap & (bit - 1) );
+
+			if ( slot_has_key( env, e, entry->key, entry->hash ) )
+			{
+				if ( e->value == entry->value )
+					return pmap_node_retain(n);
+
+				return pmap_node_edit( n, bit, entry, NULL );
+			}
+			else
+			{
+				/* Both entries move down to a new child. */
+				pmap_node_t *child = pmap_node_pair( e, hash_mix(e->hash), entry, bits, shift + PMAP_BITS );
+				*added = 1;
+				return pmap_node_edit( n, bit, NULL, child );
+			}
+		}
+		else if ( n->nodemap & bit )
+		{
+			pmap_node_t *child = n->nodes[pmap_popcount( n->nodemap & (bit - 1) )];
+			pmap_node_t *new_child = pmap_node_assoc( env, child, entry, bits, shift + PMAP_BITS, added );
+
+			if ( new_child == child )
+			{
+				pmap_node_release( new_child );
+				return pmap_node_retain(n);
+			}
+
+			return pmap_node_edit( n, bit, NULL, new_child );
+		}
+		else
+		{
+			*added = 1;
+			return pmap_node_edit( n, bit, entry, NULL );
+		}
+	}
+}
+
+/**
+ * Gives the node that has what \p n has without the key, or NULL if
+ * that leaves it empty. Sets \p removed if the key was there.
+ */
+static pmap_node_t *pmap_node_dissoc( muse_env *env, pmap_node_t *n, muse_cell key, muse_int hash, unsigned int bits, int shift, int *removed )
+{
+	if ( shift >= PMAP_LEVELS_END )
+	{
+		pmap_node_t *e;
+		int i;
+
+		for ( i = 0; i < n->nentries; ++i )
+		{
+			if ( slot_has_key( env, n->entries + i, key, hash ) )
+				break;
+		}
+
+		if ( i == n->nentries )
+			return pmap_node_retain(n);
+
+		*removed = 1;
+		if ( n->nentries == 1 )
+			return NULL;
+
+		e = pmap_node_alloc( n->nentries - 1, 0 );
+		memcpy( e->entries, n->entries, sizeof(hashtable_slot_t) * i );
+		memcpy( e->entries + i, n->entries + i + 1, sizeof(hashtable_slot_t) * (n->nentries - i - 1) );
+		return e;
+	}
+	else
+	{
+		unsigned int bit = pmap_bit( bits, shift );
+
+		if ( n->datamap & bit )
+		{
+			const hashtable_slot_t *e = n->entries + pmap_popcount( n->datamap & (bit - 1) );
+
+			if ( !slot_has_key( env, e, key, hash ) )
+				return pmap_node_retain(n);
+
+			*removed = 1;
+			if ( n->nentries == 1 && n->nnodes == 0 )
+				return NULL;
+
+			return pmap_node_edit( n, bit, NULL, NULL );
+		}
+		else if ( n->nodemap & bit )
+		{
+			pmap_node_t *child = n->nodes[pmap_popcount( n->nodemap & (bit - 1) )];
+			pmap_node_t *new_child = pmap_node_dissoc( env, child, key, hash, bits, shift + PMAP_BITS, removed );
+
+			if ( new_child == child )
+			{
+				pmap_node_release( new_child );
+				return pmap_node_retain(n);
+			}
+
+			if ( new_child == NULL )
+			{
+				if ( n->nentries == 0 && n->nnodes == 1 )
+					return NULL;
+
+				return pmap_node_edit( n, bit, NULL, NULL );
+			}
+
+			if ( new_child->nentries == 1 && new_child->nnodes == 0 )
+			{
+				/* A child left with one entry is folded into this node,
+				so that the trie doesn't keep long chains of them. */
+				pmap_node_t *e = pmap_node_edit( n, bit, new_child->entries, NULL );
+				pmap_node_release( new_child );
+				return e;
+			}
+
+			return pmap_node_edit( n, bit, NULL, new_child );
+		}
+		else
+		{
+			return pmap_node_retain(n);
+		}
+	}
+}
+
+typedef muse_boolean (*pmap_entry_fn_t)( muse_env *env, const hashtable_slot_t *entry, void *context );
+
+/**
+ * Calls \p fn on each entry under the node till it returns MUSE_FALSE,
+ * and gives that entry, or NULL if fn went through all of them.
+ */
+static const hashtable_slot_t *pmap_node_each( muse_env *env, pmap_node_t *n, pmap_entry_fn_t fn, void *context )
+{
+	int i;
+
+	if ( !n )
+		return NULL;
+
+	for ( i = 0; i < n->nentries; ++i )
+	{
+		if ( !fn( env, n->entries + i, context ) )
+			return n->entries + i;
+	}
+
+	for ( i = 0; i < n->nnodes; ++i )
+	{
+		const hashtable_slot_t *e = pmap_node_each( env, n->nodes[i], fn, context );
+		if ( e )
+			return e;
+	}
+
+	return NULL;
+}
+
+static void pmap_init( muse_env *env, void *p, muse_cell args )
+{
+	pmap_t *m = (pmap_t*)p;
+	m->count = 0;
+	m->root = NULL;
+}
+
+static void pmap_mark( muse_env *env, void *p )
+{
+	pmap_t *m = (pmap_t*)p;
+
+	if ( m->root )
+		pmap_node_mark( env, m->root );
+}
+
+static void pmap_destroy( muse_env *env, void *p )
+{
+	pmap_t *m = (pmap_t*)p;
+	pmap_node_release( m->root );
+	m->root = NULL;
+	m->count = 0;
+}
+
+typedef struct
+{
+	muse_port_t p;
+	int i;
+} pmap_write_t;
+
+static muse_boolean pmap_write_entry( muse_env *env, const hashtable_slot_t *entry, void *context )
+{
+	pmap_write_t *w = (pmap_write_t*)context;
+	int sp = _spos();
+
+	if ( w->i++ > 0 ) port_putc( ' ', w->p );
+	muse_pwrite( w->p, _cons( entry->key, entry->value ) );
+	_unwind(sp);
+	return MUSE_TRUE;
+}
+
+/**
+ * Writes the map out to the given port in the form
+ * @code
+ *    {pmap '((key1 . value1) (key2 . value2) ... (keyN . valueN))}
+ * @endcode
+ * so that a trusted read gives the map back.
+ */
+static void pmap_write( muse_env *env, void *ptr, void *port )
+{
+	pmap_t *m = (pmap_t*)ptr;
+	pmap_write_t w = { (muse_port_t)port, 0 };
+
+	port_putc( '{' , w.p );
+	port_write( "pmap '(", 7, w.p );
+	pmap_node_each( env, m->root, pmap_write_entry, &w );
+	port_putc( ')', w.p );
+	port_putc( '}', w.p );
+}
+
+/**
+ * Sets the key's value in a map that nothing else has seen yet,
+ * which is how new maps get built up. A value of () removes the key.
+ */
+static void pmap_set( muse_env *env, pmap_t *m, muse_cell key, muse_cell value, muse_int hash )
+{
+	pmap_node_t *root;
+
+	if ( value )
+	{
+		hashtable_slot_t entry;
+		int added = 0;
+
+		entry.hash	= hash;
+		entry.key	= key;
+		entry.value	= value;
+
+		root = pmap_node_assoc( env, m->root, &entry, hash_mix(hash), 0, &added );
+		m->count += added;
+	}
+	else if ( m->root )
+	{
+		int removed = 0;
+		root = pmap_node_dissoc( env, m->root, key, hash, hash_mix(hash), 0, &removed );
+		m->count -= removed;
+	}
+	else
+	{
+		return;
+	}
+
+	pmap_node_release( m->root );
+	m->root = root;
+}
+
+static void pmap_merge_one( muse_env *env, pmap_t *m, muse_cell key, muse_cell new_value, muse_cell reduction_fn )
+{
+	int sp = _spos();
+	muse_int hash = muse_hash( env, key );
+
+	if ( reduction_fn )
+	{
+		const hashtable_slot_t *e = pmap_node_find( env, m->root, key, hash );
+		if ( e )
+			new_value = _apply( reduction_fn, _cons( e->value, _cons( new_value, MUSE_NIL ) ), MUSE_TRUE );
+	}
+
+	pmap_set( env, m, key, new_value, hash );
+	_unwind(sp);
+}
+
+/**
+ * The function that implements map access. @code (m key) @endcode
+ * gives the value associated with the key, or () if there isn't one.
+ */
+muse_cell fn_pmap_fn( muse_env *env, pmap_t *m, muse_cell args )
+{
+	muse_cell key = _evalnext(&args);
+	const hashtable_slot_t *e = pmap_node_find( env, m->root, key, muse_hash( env, key ) );
+	return e ? e->value : MUSE_NIL;
+}
+
+/**
+ * The prop view, so that @code (get m key) @endcode works on maps.
+ * Maps can't be changed, so there's no put_prop and \ref fn_put "put"
+ * raises error:readonly-object.
+ */
+static muse_cell pmap_get_prop( muse_env *env, void *self, muse_cell key, muse_cell argv )
+{
+	pmap_t *m = (pmap_t*)self;
+	const hashtable_slot_t *e = pmap_node_find( env, m->root, key, muse_hash( env, key ) );
+	muse_cell val = e ? e->value : MUSE_NIL;
+	return argv ? muse_get( env, val, _head(argv), _tail(argv) ) : val;
+}
+
+static muse_prop_view_t g_pmap_prop_view =
+{
+	pmap_get_prop,
+	NULL
+};
+
+static muse_functional_object_type_t g_pmap_type;
+
+/**
+ * Makes an empty map. Unlike \ref fn_pmap "pmap", it doesn't add the
+ * map to the recent items, so it is what the map functions use to
+ * make their results.
+ */
+static muse_cell mk_pmap( muse_env *env )
+{
+	return _mk_functional_object( &g_pmap_type, MUSE_NIL );
+}
+
+static muse_cell pmap_size( muse_env *env, void *self )
+{
+	return _mk_int( ((pmap_t*)self)->count );
+}
+
+typedef struct
+{
+	pmap_t		*result;
+	muse_cell	fn;
+	muse_cell	args;
+	muse_cell	predicate;
+	muse_cell	reduction_fn;
+} pmap_monad_t;
+
+static muse_boolean pmap_map_entry( muse_env *env, const hashtable_slot_t *entry, void *context )
+{
+	pmap_monad_t *c = (pmap_monad_t*)context;
+	int sp = _spos();
+	muse_cell key = entry->key;
+	muse_int hash = entry->hash;
+
+	_seth( c->args, entry->value );
+	pmap_set( env, c->result, key, _apply( c->fn, c->args, MUSE_TRUE ), hash );
+	_unwind(sp);
+	return MUSE_TRUE;
+}
+
+static muse_cell pmap_map( muse_env *env, void *self, muse_cell fn )
+{
+	muse_cell result = mk_pmap( env );
+	pmap_monad_t c;
+
+	c.result = (pmap_t*)_functional_object_data( result, 'pmap' );
+	c.fn = fn;
+	c.args = _cons( MUSE_NIL, MUSE_NIL );
+
+	pmap_node_each( env, ((pmap_t*)self)->root, pmap_map_entry, &c );
+	return result;
+}
+
+static muse_boolean pmap_merge_entry( muse_env *env, const hashtable_slot_t *entry, void *context )
+{
+	pmap_monad_t *c = (pmap_monad_t*)context;
+	pmap_merge_one( env, c->result, entry->key, entry->value, c->reduction_fn );
+	return MUSE_TRUE;
+}
+
+/**
+ * The result starts out sharing all of the first map's nodes, so
+ * only the paths to keys that the other maps add or change get copied.
+ */
+static muse_cell pmap_join( muse_env *env, void *self, muse_cell objlist, muse_cell reduction_fn )
+{
+	pmap_t *m = (pmap_t*)self;
+	muse_cell result = mk_pmap( env );
+	pmap_monad_t c;
+
+	c.result = (pmap_t*)_functional_object_data( result, 'pmap' );
+	c.reduction_fn = reduction_fn;
+	c.result->root = pmap_node_retain( m->root );
+	c.result->count = m->count;
+
+	while ( objlist )
+	{
+		pmap_t *m2 = (pmap_t*)_functional_object_data( _next(&objlist), 'pmap' );
+		if ( m2 )
+			pmap_node_each( env, m2->root, pmap_merge_entry, &c );
+	}
+
+	return result;
+}
+
+static muse_boolean pmap_collect_entry( muse_env *env, const hashtable_slot_t *entry, void *context )
+{
+	pmap_monad_t *c = (pmap_monad_t*)context;
+	int sp = _spos();
+	muse_cell kv = _cons( entry->key, entry->value );
+
+	if ( !c->predicate || _apply( c->predicate, kv, MUSE_TRUE ) )
+	{
+		/* Key-value pair satisfied the predicate. */
+		if ( c->fn )
+			kv = _apply( c->fn, kv, MUSE_TRUE );
+
+		pmap_merge_one( env, c->result, _head(kv), _tail(kv), c->reduction_fn );
+	}
+
+	_unwind(sp);
+	return MUSE_TRUE;
+}
+
+static muse_cell pmap_collect( muse_env *env, void *self, muse_cell predicate, muse_cell mapper, muse_cell reduction_fn )
+{
+	muse_cell result = mk_pmap( env );
+	pmap_monad_t c;
+
+	c.result = (pmap_t*)_functional_object_data( result, 'pmap' );
+	c.predicate = predicate;
+	c.fn = mapper;
+	c.reduction_fn = reduction_fn;
+
+	pmap_node_each( env, ((pmap_t*)self)->root, pmap_collect_entry, &c );
+	return result;
+}
+
+static muse_boolean pmap_reduce_entry( muse_env *env, const hashtable_slot_t *entry, void *context )
+{
+	pmap_monad_t *c = (pmap_monad_t*)context;
+	int sp = _spos();
+
+	/* The running result is kept in the head of args. */
+	_seth( _tail(c->args), entry->value );
+	_seth( c->args, _apply( c->reduction_fn, c->args, MUSE_TRUE ) );
+	_unwind(sp);
+	return MUSE_TRUE;
+}
+
+static muse_cell pmap_reduce( muse_env *env, void *self, muse_cell reduction_fn, muse_cell initial )
+{
+	pmap_monad_t c;
+
+	c.reduction_fn = reduction_fn;
+	c.args = _cons( initial, _cons( MUSE_NIL, MUSE_NIL ) );
+
+	pmap_node_each( env, ((pmap_t*)self)->root, pmap_reduce_entry, &c );
+	return _head(c.args);
+}
+
+typedef struct
+{
+	pmap_t *self;
+	muse_iterator_callback_t callback;
+	void *context;
+} pmap_iterator_t;
+
+static muse_boolean pmap_iterate_entry( muse_env *env, const hashtable_slot_t *entry, void *context )
+{
+	pmap_iterator_t *it = (pmap_iterator_t*)context;
+	int sp = _spos();
+	muse_boolean cont = it->callback( env, it->self, it->context, entry->value );
+	_unwind(sp);
+	return cont;
+}
+
+static muse_cell pmap_iterator( muse_env *env, pmap_t *self, muse_iterator_callback_t callback, void *context )
+{
+	pmap_iterator_t it = { self, callback, context };
+	const hashtable_slot_t *e = pmap_node_each( env, self->root, pmap_iterate_entry, &it );
+	return e ? e->key : MUSE_NIL; /**< Return the key. */
+}
+
+static muse_monad_view_t g_pmap_monad_view =
+{
+	pmap_size,
+	pmap_map,
+	pmap_join,
+	pmap_collect,
+	pmap_reduce,
+	NULL
+};
+
+static void *pmap_view( muse_env *env, int id )
+{
+	switch ( id )
+	{
+		case 'mnad' : return &g_pmap_monad_view;
+		case 'iter' : return pmap_iterator;
+		case 'prop' : return &g_pmap_prop_view;
+		default : return NULL;
+	}
+}
+
+static muse_functional_object_type_t g_pmap_type =
+{
+	'muSE',
+	'pmap',
+	sizeof(pmap_t),
+	(muse_nativefn_t)fn_pmap_fn,
+	pmap_view,
+	pmap_init,
+	pmap_mark,
+	pmap_destroy,
+	pmap_write
+};
+
+/**
+ * @code (pmap [alist]) @endcode
+ *
+ * Gives a persistent map with the contents of the alist, or an empty
+ * map if there's no alist. If a key occurs more than once in the alist,
+ * the first one's value is used.
+ *
+ * Supports \ref fn_the "the".
+ */
+muse_cell fn_pmap( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell alist = _evalnext(&args);
+	muse_cell result = mk_pmap( env );
+	pmap_t *m = (pmap_t*)_functional_object_data( result, 'pmap' );
+
+	while ( alist )
+	{
+		muse_cell kv = _next(&alist);
+		muse_int hash = muse_hash( env, _head(kv) );
+
+		if ( !pmap_node_find( env, m->root, _head(kv), hash ) )
+			pmap_set( env, m, _head(kv), _tail(kv), hash );
+	}
+
+	return muse_add_recent_item( env, (muse_int)fn_pmap, result );
+}
+
+/**
+ * @code (pmap? m) @endcode
+ *
+ * Gives \c m if it is a persistent map, or () if it isn't.
+ */
+muse_cell fn_pmap_p( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell m = _evalnext(&args);
+	return _functional_object_data( m, 'pmap' ) ? m : MUSE_NIL;
+}
+
+/**
+ * @code (pmap-size m) @endcode
+ *
+ * Gives the number of key-value pairs in the map.
+ */
+muse_cell fn_pmap_size( muse_env *env, void *context, muse_cell args )
+{
+	pmap_t *m = (pmap_t*)_functional_object_data( _evalnext(&args), 'pmap' );
+
+	muse_assert( m != NULL && "Argument must be a persistent map!" );
+
+	return _mk_int( m ? m->count : 0 );
+}
+
+/**
+ * @code (pmap-assoc m key1 value1 key2 value2 ...) @endcode
+ *
+ * Gives a new map that has what \c m has, but with each key associated
+ * with the value after it. A value of () leaves out the key. \c m itself
+ * doesn't change, and shares all its nodes except those on the paths to
+ * the given keys with the new map.
+ */
+muse_cell fn_pmap_assoc( muse_env *env, void *context, muse_cell args )
+{
+	pmap_t *m = (pmap_t*)_functional_object_data( _evalnext(&args), 'pmap' );
+	muse_cell result = mk_pmap( env );
+	pmap_t *r = (pmap_t*)_functional_object_data( result, 'pmap' );
+
+	muse_assert( m != NULL && "First argument must be a persistent map!" );
+
+	if ( m )
+	{
+		r->root = pmap_node_retain( m->root );
+		r->count = m->count;
+	}
+
+	while ( args )
+	{
+		int sp = _spos();
+		muse_cell key = _evalnext(&args);
+		muse_cell value = _evalnext(&args);
+		pmap_set( env, r, key, value, muse_hash( env, key ) );
+		_unwind(sp);
+	}
+
+	return result;
+}
+
+/**
+ * @code (pmap-dissoc m key1 key2 ...) @endcode
+ *
+ * Gives a new map that has what \c m has except for the given keys.
+ * \c m itself doesn't change.
+ */
+muse_cell fn_pmap_dissoc( muse_env *env, void *context, muse_cell args )
+{
+	pmap_t *m = (pmap_t*)_functional_object_data( _evalnext(&args), 'pmap' );
+	muse_cell result = mk_pmap( env );
+	pmap_t *r = (pmap_t*)_functional_object_data( result, 'pmap' );
+
+	muse_assert( m != NULL && "First argument must be a persistent map!" );
+
+	if ( m )
+	{
+		r->root = pmap_node_retain( m->root );
+		r->count = m->count;
+	}
+
+	while ( args )
+	{
+		int sp = _spos();
+		muse_cell key = _evalnext(&args);
+		pmap_set( env, r, key, MUSE_NIL, muse_hash( env, key ) );
+		_unwind(sp);
+	}
+
+	return result;
+}
+
+static muse_boolean pmap_alist_entry( muse_env *env, const hashtable_slot_t *entry, void *context )
+{
+	muse_cell *tail = (muse_cell*)context;
+	int sp = _spos();
+	muse_cell c = _cons( _cons( entry->key, entry->value ), MUSE_NIL );
+
+	/* The list is reachable from its head, which is on the stack. */
+	_sett( *tail, c );
+	*tail = c;
+	_unwind(sp);
+	return MUSE_TRUE;
+}
+
+/**
+ * @code (pmap->alist m) @endcode
+ *
+ * Gives an alist of the contents of the map. The order of the
+ * elements is unpredictable.
+ */
+muse_cell fn_pmap_to_alist( muse_env *env, void *context, muse_cell args )
+{
+	pmap_t *m = (pmap_t*)_functional_object_data( _evalnext(&args), 'pmap' );
+	muse_cell head = _cons( MUSE_NIL, MUSE_NIL );
+	muse_cell tail = head;
+
+	muse_assert( m != NULL && "Argument must be a persistent map!" );
+
+	if ( m )
+		pmap_node_each( env, m->root, pmap_alist_entry, &tail );
+
+	return muse_add_recent_item( env, (muse_int)fn_pmap_to_alist, _tail(head) );
+}
+
+static const struct _defs k_pmap_funs[] =
+{
+	{	L"pmap",			fn_pmap				},
+	{	L"pmap?",			fn_pmap_p			},
+	{	L"pmap-size",		fn_pmap_size		},
+	{	L"pmap-assoc",		fn_pmap_assoc		},
+	{	L"pmap-dissoc",		fn_pmap_dissoc		},
+	{	L"pmap->alist",		fn_pmap_to_alist	},
+	{	NULL,				NULL				}
+};
+
+void muse_define_builtin_type_pmap(muse_env *env)
+{
+	int sp = _spos();
+	const struct _defs *defs = k_pmap_funs;
+	
+	for ( ; defs->name; ++defs )
+	{
+		_define( _csymbol(defs->name), _mk_nativefn( defs->fn, NULL ) );
+		_unwind(sp);
+	}
+}
+
 /*@}*/
 /*@}*/
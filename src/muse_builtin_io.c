@@ -14,6 +14,7 @@
 #include "muse_port.h"
 #include "muse_utils.h"
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * @code (port? p) @endcode
@@ -123,6 +124,112 @@ muse_cell fn_read( muse_env *env, void *context, muse_cell args )
 	}
 }
 
+/**
+ * Makes the text of a line from its UTF8 bytes, leaving out any carriage
+ * returns, with the text the only thing allocated.
+ */
+static muse_cell line_text( muse_env *env, const unsigned char *bytes, int nbytes, const muse_char *head, int head_len )
+{
+	int nused = 0, len;
+	muse_cell text;
+	muse_char *chars;
+
+	if ( nbytes > 0 && bytes[nbytes-1] == '\r' )
+		--nbytes;
+
+	len = head_len + utf8_to_uc16_block( NULL, bytes, nbytes, &nused, 1 );
+	text = muse_mk_text( env, NULL, ((const muse_char *)NULL) + len );
+	chars = (muse_char*)muse_text_contents( env, text, NULL );
+
+	if ( head_len > 0 )
+		memcpy( chars, head, head_len * sizeof(muse_char) );
+
+	utf8_to_uc16_block( chars + head_len, bytes, nbytes, &nused, 1 );
+
+	if ( head_len > 0 || (nbytes > 0 && memchr( bytes, '\r', nbytes )) )
+	{
+		/* Carriage returns within the line are dropped too. */
+		muse_char *from = chars, *to = chars, *end = chars + len;
+
+		for ( ; from < end; ++from )
+		{
+			if ( *from != '\r' )
+				*to++ = *from;
+		}
+
+		*to = 0;
+		_ptr(text)->text.end = to;
+	}
+
+	return text;
+}
+
+/**
+ * Reads a line from the port, finding its end in the port's buffer and
+ * decoding it in one go. Only a line that doesn't fit in the buffer has
+ * its start decoded into \p head first. Returns MUSE_NIL at the end of
+ * the stream.
+ */
+static muse_cell read_line( muse_env *env, muse_port_t port )
+{
+	muse_char *head = NULL;
+	int head_len = 0, head_size = 0, scanned = 0;
+	muse_cell result = MUSE_NIL;
+
+	while ( !port_eof(port) )
+	{
+		int avail = 0;
+		const unsigned char *bytes = port_buffered( port, &avail );
+		const unsigned char *nl = avail > scanned ? (const unsigned char*)memchr( bytes + scanned, '\n', avail - scanned ) : NULL;
+
+		if ( nl )
+		{
+			int nbytes = (int)(nl - bytes);
+			result = line_text( env, bytes, nbytes, head, head_len );
+			port_consume( nbytes + 1, port );
+			break;
+		}
+
+		scanned = avail;
+
+		if ( port_buffer_more(port) > 0 )
+			continue;
+
+		if ( avail == 0 )
+			continue; /* Reached the end of the stream. */
+
+		/* The buffer is full. Set aside what's in it. */
+		{
+			int nused = 0;
+
+			if ( head_len + avail > head_size )
+			{
+				head_size = 2 * (head_len + avail);
+				head = (muse_char*)realloc( head, head_size * sizeof(muse_char) );
+			}
+
+			head_len += utf8_to_uc16_block( head + head_len, bytes, avail, &nused, 0 );
+
+			if ( nused == 0 )
+				head_len += utf8_to_uc16_block( head + head_len, bytes, avail, &nused, 1 );
+
+			port_consume( nused, port );
+			scanned = 0;
+		}
+	}
+
+	if ( !result && head_len > 0 )
+	{
+		/* The stream ended without a line feed. */
+		result = line_text( env, NULL, 0, head, head_len );
+		if ( _ptr(result)->text.start == _ptr(result)->text.end )
+			result = MUSE_NIL;
+	}
+
+	free( head );
+	return result;
+}
+
 /**
  * @code (read-line [port]) @endcode
  *
@@ -144,41 +251,12 @@ muse_cell fn_read_line( muse_env *env, void *context, muse_cell args )
 		port = _stdport( MUSE_STDIN_PORT );
 
 	{
-		buffer_t *b = buffer_alloc();
-		while ( !port_eof(port) )
-		{
-			muse_char c = port_getchar(port);
-			if ( c == 0x0a || c == (muse_char)EOF )
-			{
-				muse_assert( 0x0a == '\n' );
+		muse_cell line = read_line( env, port );
 
-				/* Line feed character indicates end of line. */
-				break;
-			}
-			else if ( c == 0x0d )
-			{
-				muse_assert( 0x0d == '\r' );
-
-				/* Skip carriage return characters. */
-			}
-			else
-			{
-				/* Keep the character. */
-				buffer_putc( b, c );
-			}
-		}
-
-		if ( port_eof(port) && buffer_length(b) == 0 )
-		{
-			buffer_free(b);
-			return MUSE_NIL;
-		}
+		if ( line )
+			return muse_add_recent_item( env, (muse_int)fn_read_line, line );
 		else
-		{
-			muse_cell result = muse_add_recent_item( env, (muse_int)fn_read_line, buffer_to_string( b, env ) );
-			buffer_free(b);
-			return result;
-		}
+			return MUSE_NIL;
 	}
 }
 
@@ -246,6 +324,13 @@ muse_cell fn_with_bytes_as_port( muse_env *env, void *context, muse_cell args );
  * it will be loaded just as though it were the byte contents
  * of some file.
  *
+ * If the symbol \c *module-cache* is defined to be the path of a 
+ * directory, files loaded by name are kept there in the pre-parsed
+ * form that \ref fn_compile_file "compile-file" writes, and loaded
+ * from there without parsing for as long as the source file stays 
+ * the same. For example -
+ * @code (define *module-cache* "/var/cache/myapp") @endcode
+ *
  * @exception error:load
  * Handler format: @code (fn (resume 'error:load path) ...) @endcode
  * If the file is not found or could not be opened for
@@ -280,7 +365,7 @@ muse_cell fn_load( muse_env *env, void *context, muse_cell args )
 			int source_pos = 0;
 			if ( muSEexec_check( f, &source_pos, NULL, NULL ) )
 				fseek( f, source_pos, SEEK_SET );
-			result = muse_load( env, f );
+			result = muse_load_cached( env, filename, f );
 			fclose(f);
 			_unwind(sp);
 			return _spush(result);
@@ -15,28 +15,48 @@
 #include "muse_builtins.h"
 #include "muse_port.h"
 #include "muse_utils.h"
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define MUSE_JSON_SSE2 1
+#	include <emmintrin.h>
+#endif
+
 static muse_cell json_read( muse_port_t p );
 static muse_cell json_read_expr( muse_port_t p );
 static void json_skip_whitespace( muse_port_t p );
+static muse_char json_peek( muse_port_t p );
 static muse_cell json_read_number( muse_port_t p );
 static muse_cell json_read_key( muse_port_t p );
 static muse_cell json_read_string( muse_port_t p );
+static void json_read_string_into( muse_port_t p, buffer_t *b );
 static muse_cell json_read_keyword( muse_port_t p );
 static muse_cell json_read_array( muse_port_t p );
 static muse_cell json_read_array_expr( muse_port_t p );
 static muse_cell json_read_object( muse_port_t p );
 static muse_cell json_read_object_expr( muse_port_t p );
 
-static void json_write( muse_port_t p, muse_cell thing );
-static void json_write_number( muse_port_t p, muse_cell num );
-static void json_write_string( muse_port_t p, muse_cell str );
-static void json_write_vector( muse_port_t p, muse_cell arr );
-static void json_write_hash( muse_port_t p, muse_cell obj );
-static void json_write_object( muse_port_t p, muse_cell obj );
+/**
+ * A growable buffer that JSON is written into before it's sent to a port.
+ */
+typedef struct
+{
+	muse_env *env;
+	unsigned char *bytes;
+	size_t size, capacity;
+} json_out_t;
+
+static void json_out_init( json_out_t *out, muse_env *env );
+static void json_out_flush( json_out_t *out, muse_port_t p );
+static void json_write( json_out_t *out, muse_cell thing );
+static void json_write_number( json_out_t *out, muse_cell num );
+static void json_write_string( json_out_t *out, muse_cell str );
+static void json_write_vector( json_out_t *out, muse_cell arr );
+static void json_write_hash( json_out_t *out, muse_cell obj );
+static void json_write_object( json_out_t *out, muse_cell obj );
 
 /**
  * {json}
@@ -86,8 +106,12 @@ static void json_write_object( muse_port_t p, muse_cell obj );
  */
 muse_cell fn_json( muse_env *env, void *context, muse_cell args )
 {
+	int arena = muse_begin_text_arena(env);
+	muse_cell result;
 	muse_push_recent_scope(env);
-	return muse_pop_recent_scope( env, (muse_int)fn_json, json_read_expr( muse_current_port( env, MUSE_INPUT_PORT, NULL ) ) );
+	result = json_read_expr( muse_current_port( env, MUSE_INPUT_PORT, NULL ) );
+	muse_end_text_arena( env, arena );
+	return muse_pop_recent_scope( env, (muse_int)fn_json, result );
 }
 
 /**
@@ -95,8 +119,13 @@ muse_cell fn_json( muse_env *env, void *context, muse_cell args )
  *
  * thing is either a number, string, vector or a hashtable.
  * Writes the object in JSON format to the given port, or to
- * the current output port (usually stdout) if the port is 
- * omitted.
+ * the current output port (usually stdout) if the port is
+ * omitted. The whole of the JSON text is made in memory first
+ * and written to the port in one go.
+ *
+ * Floats are written with the fewest digits that read back as
+ * the same number. Strings are written as UTF-8, with control
+ * characters escaped.
  */
 muse_cell fn_write_json( muse_env *env, void *context, muse_cell args )
 {
@@ -109,9 +138,14 @@ muse_cell fn_write_json( muse_env *env, void *context, muse_cell args )
 		p = muse_current_port( env, MUSE_STDOUT_PORT, NULL );
 	}
 
-	muse_push_recent_scope(env);
-	json_write(p,arg);
-	muse_pop_recent_scope(env,0,MUSE_NIL);
+	{
+		json_out_t out;
+		json_out_init( &out, env );
+		muse_push_recent_scope(env);
+		json_write( &out, arg );
+		muse_pop_recent_scope(env,0,MUSE_NIL);
+		json_out_flush( &out, p );
+	}
 	return _builtin_symbol(MUSE_T);
 }
 
@@ -145,8 +179,14 @@ muse_cell fn_read_json( muse_env *env, void *context, muse_cell args )
 		p = muse_current_port( env, MUSE_STDIN_PORT, NULL );
 	}
 
-	muse_push_recent_scope( env );
-	return muse_pop_recent_scope( env, (muse_int)fn_read_json, json_read(p) );
+	{
+		int arena = muse_begin_text_arena(env);
+		muse_cell result;
+		muse_push_recent_scope( env );
+		result = json_read(p);
+		muse_end_text_arena( env, arena );
+		return muse_pop_recent_scope( env, (muse_int)fn_read_json, result );
+	}
 }
 
 static muse_cell json_read( muse_port_t p )
@@ -154,8 +194,7 @@ static muse_cell json_read( muse_port_t p )
 	json_skip_whitespace(p);
 
 	if ( !port_eof(p) ) {
-		muse_char c = port_getchar(p);
-		port_ungetchar(c,p);
+		muse_char c = json_peek(p);
 		switch ( c ) {
 			case '"': return json_read_string(p);
 			case '-': 
@@ -188,8 +227,7 @@ static muse_cell json_read_expr( muse_port_t p )
 	json_skip_whitespace(p);
 
 	if ( !port_eof(p) ) {
-		muse_char c = port_getchar(p);
-		port_ungetchar(c,p);
+		muse_char c = json_peek(p);
 		switch ( c ) {
 			case '"': return json_read_string(p);
 			case '-': 
@@ -227,29 +265,211 @@ static muse_cell json_read_expr( muse_port_t p )
 	}
 }
 
-static void json_skip_whitespace( muse_port_t p )
+/** @name Buffer scanning
+ * The reader looks at the port's input buffer directly wherever it can,
+ * with port_buffered(), and takes whole runs of bytes out of it at a time.
+ * Only escape codes and values that straddle the end of the buffer go
+ * through port_getchar().
+ */
+/*@{*/
+
+static int json_is_space( int c )
 {
-	if ( port_eof(p) )
-		return;
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f';
+}
+
+/**
+ * Characters that end a number or a keyword.
+ */
+static int json_is_delimiter( int c )
+{
+	return c == ',' || c == ':' || c == ']' || c == '}' || c == '"' || json_is_space(c);
+}
+
+static int json_lowest_bit( int mask )
+{
+#if defined(__GNUC__)
+	return __builtin_ctz( (unsigned int)mask );
+#else
+	int i = 0;
+	while ( !(mask & 1) ) {
+		mask >>= 1;
+		++i;
+	}
+	return i;
+#endif
+}
+
+/**
+ * Gives the position of the first quote or backslash in the bytes,
+ * or \p nbytes if there's none. Sixteen bytes are looked at a time 
+ * where SSE2 is available.
+ */
+static int json_scan_string( const unsigned char *bytes, int nbytes )
+{
+	int i = 0;
+
+#ifdef MUSE_JSON_SSE2
+	const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+
+	for ( ; i + 16 <= nbytes; i += 16 ) {
+		__m128i v = _mm_loadu_si128( (const __m128i*)(bytes + i) );
+		int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( v, quote ), _mm_cmpeq_epi8( v, backslash ) ) );
+		if ( mask )
+			return i + json_lowest_bit(mask);
+	}
+#endif
+
+	for ( ; i < nbytes; ++i ) {
+		if ( bytes[i] == '"' || bytes[i] == '\\' )
+			return i;
+	}
+
+	return nbytes;
+}
+
+/**
+ * Takes the given bytes at the head of the port's input buffer out of it.
+ * Lines are still counted so that the Scheme reader reports the right 
+ * positions after a {json} expression.
+ */
+static void json_consume( muse_port_t p, const unsigned char *bytes, int nbytes )
+{
+	const unsigned char *nl = (const unsigned char*)memchr( bytes, '\n', nbytes ), *last = NULL;
+
+	while ( nl ) {
+		++(p->in.line);
+		last = nl++;
+		nl = (const unsigned char*)memchr( nl, '\n', (bytes + nbytes) - nl );
+	}
+
+	p->in.column = last ? (muse_int)((bytes + nbytes) - (last + 1)) : p->in.column + nbytes;
+	port_consume_binary( nbytes, p );
+}
+
+/**
+ * Makes a text cell straight from a run of UTF8 bytes.
+ */
+static muse_cell json_text( muse_env *env, const unsigned char *bytes, int nbytes )
+{
+	int nused = 0, len;
+	muse_cell text = muse_mk_text( env, NULL, ((const muse_char *)NULL) + nbytes );
+	muse_char *chars = (muse_char*)muse_text_contents( env, text, NULL );
+
+	len = utf8_to_uc16_block( chars, bytes, nbytes, &nused, 1 );
+	chars[len] = 0;
+	_ptr(text)->text.end = chars + len;
+	return text;
+}
+
+/**
+ * Peeks at the next byte of input, which is the next character 
+ * if it is ASCII.
+ */
+static muse_char json_peek( muse_port_t p )
+{
+	int avail = 0;
+	const unsigned char *bytes = port_buffered( p, &avail );
+
+	if ( avail > 0 )
+		return bytes[0];
 	else {
 		muse_char c = port_getchar(p);
-		if ( c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' )
-			json_skip_whitespace(p);
-		else
-			port_ungetchar( c, p );
+		port_ungetchar( c, p );
+		return c;
+	}
+}
+
+/*@}*/
+
+static void json_skip_whitespace( muse_port_t p )
+{
+	while ( !port_eof(p) ) {
+		int avail = 0, i = 0;
+		const unsigned char *bytes = port_buffered( p, &avail );
+
+		while ( i < avail && json_is_space(bytes[i]) )
+			++i;
+
+		json_consume( p, bytes, i );
+
+		if ( i < avail || port_buffer_more(p) == 0 )
+			return;
 	}
 }
 
+/**
+ * Numbers that lie within the buffer are read from there. Integers
+ * with more than 18 digits, which may overflow, and anything unusual
+ * are left to the Scheme reader.
+ */
 static muse_cell json_read_number( muse_port_t p )
 {
+	muse_env *env = p->env;
+	int avail = 0, i = 0, int_digits = 0, fractional = 0;
+	const unsigned char *bytes = port_buffered( p, &avail );
+
+	if ( i < avail && bytes[i] == '-' )
+		++i;
+
+	for ( ; i < avail && bytes[i] >= '0' && bytes[i] <= '9'; ++i )
+		++int_digits;
+
+	if ( i < avail && bytes[i] == '.' ) {
+		fractional = 1;
+		for ( ++i; i < avail && bytes[i] >= '0' && bytes[i] <= '9'; ++i );
+	}
+
+	if ( i < avail && (bytes[i] == 'e' || bytes[i] == 'E') ) {
+		fractional = 1;
+		++i;
+		if ( i < avail && (bytes[i] == '-' || bytes[i] == '+') )
+			++i;
+		for ( ; i < avail && bytes[i] >= '0' && bytes[i] <= '9'; ++i );
+	}
+
+	if ( int_digits > 0 && i < avail && json_is_delimiter(bytes[i]) ) {
+		if ( !fractional && int_digits <= 18 ) {
+			muse_int n = 0;
+			int j = (bytes[0] == '-') ? 1 : 0;
+
+			for ( ; j < i; ++j )
+				n = n * 10 + (bytes[j] - '0');
+
+			json_consume( p, bytes, i );
+			return _mk_int( bytes[0] == '-' ? -n : n );
+		} else if ( fractional && i < 64 ) {
+			char text[64];
+			memcpy( text, bytes, i );
+			text[i] = '\0';
+			json_consume( p, bytes, i );
+			return _mk_float( atof(text) );
+		}
+	}
+
 	return muse_pread(p);
 }
 
 static muse_cell json_read_key( muse_port_t p )
 {
 	muse_env *env = p->env;
-	int sp = _spos();
-	muse_cell str = json_read_string(p);
+	int sp, avail = 0;
+	const unsigned char *bytes = port_buffered( p, &avail );
+	muse_cell str;
+
+	/* Short keys without escapes are looked up without making a string first. */
+	if ( avail > 1 && bytes[0] == '"' ) {
+		muse_char chars[128];
+		int end = 1 + json_scan_string( bytes + 1, (avail - 1 < 128) ? avail - 1 : 128 );
+		if ( end < avail && bytes[end] == '"' ) {
+			int nused = 0, len = utf8_to_uc16_block( chars, bytes + 1, end - 1, &nused, 1 );
+			json_consume( p, bytes, end + 1 );
+			return muse_symbol( env, chars, chars + len );
+		}
+	}
+
+	sp = _spos();
+	str = json_read_string(p);
 
 	int len = 0;
 	const muse_char *strptr = muse_text_contents( env, str, &len );
@@ -259,14 +479,74 @@ static muse_cell json_read_key( muse_port_t p )
 }
 
 static muse_cell json_read_string( muse_port_t p )
+{
+	int avail = 0;
+	const unsigned char *bytes = port_buffered( p, &avail );
+	buffer_t *b;
+	muse_cell str;
+
+	/* Most strings have no escapes and lie within the buffer.
+	Their text is made straight from its bytes. */
+	if ( avail > 1 && bytes[0] == '"' ) {
+		int end = 1 + json_scan_string( bytes + 1, avail - 1 );
+		if ( end < avail && bytes[end] == '"' ) {
+			str = json_text( p->env, bytes + 1, end - 1 );
+			json_consume( p, bytes, end + 1 );
+			return str;
+		}
+	}
+
+	b = buffer_alloc();
+	json_read_string_into( p, b );
+	str = buffer_to_string( b, p->env );
+	buffer_free(b);
+	return str;
+}
+
+/**
+ * Reads a quoted string into the given buffer, decoding escape codes.
+ * The pull reader uses this to compare keys against a selector path
+ * without creating a text cell for every key it sees.
+ */
+static void json_read_string_into( muse_port_t p, buffer_t *b )
 {
 	muse_char c = port_getchar(p);
 	assert( c == '"' );
 
 	{
-		buffer_t *b = buffer_alloc();
-	
+		muse_char chars[256];
+
 		while ( !port_eof(p) ) {
+			int avail = 0, stop, end, n, nused = 0;
+			const unsigned char *bytes = port_buffered( p, &avail );
+
+			if ( avail == 0 ) {
+				port_buffer_more(p);
+				continue;
+			}
+
+			/* Plain characters up to the next quote or escape are
+			decoded in bulk, a chars[] full at a time. */
+			stop = json_scan_string( bytes, avail );
+			end = (stop < 256) ? stop : 256;
+			n = utf8_to_uc16_block( chars, bytes, end, &nused, end == stop && stop < avail );
+
+			if ( nused == 0 && end > 0 ) {
+				/* A character is cut short by the end of the buffer. */
+				if ( port_buffer_more(p) == 0 ) {
+					n = utf8_to_uc16_block( chars, bytes, end, &nused, 1 );
+					buffer_puts( b, chars, n );
+					json_consume( p, bytes, nused );
+				}
+				continue;
+			}
+
+			buffer_puts( b, chars, n );
+			json_consume( p, bytes, nused );
+
+			if ( nused < stop || stop == avail )
+				continue;
+
 			c = port_getchar(p);
 			if ( c == '"' ) 
 				break;
@@ -296,16 +576,8 @@ static muse_cell json_read_string( muse_port_t p )
 						buffer_putc( b, c );
 						break;
 				}
-			} else {
-				buffer_putc( b, c );
 			}
 		}
-
-		{
-			muse_cell str = buffer_to_string( b, p->env );
-			buffer_free(b);
-			return str;
-		}
 	}
 }
 
@@ -503,6 +775,8 @@ static muse_cell json_read_object_items( muse_env *env, muse_port_t p, muse_cell
 					muse_hashtable_put( env, table, key, value );
 					_unwind(sp);
 
+					json_skip_whitespace(p);
+
 					{
 						muse_char c = port_getchar(p);
 						if ( c == ',' ) {
@@ -524,6 +798,8 @@ static muse_cell json_read_object_items( muse_env *env, muse_port_t p, muse_cell
 static muse_cell json_read_object_expr_items( muse_env *env, muse_port_t p, muse_cell h, muse_cell t, int sp );
 static muse_cell json_share_object_expr( muse_env *env, muse_cell objexpr );
 muse_cell fn_alist_to_hashtable( muse_env *env, void *context, muse_cell args );
+static const muse_argv_nativefn_info_t k_json_list_fn = { fn_list, NULL };
+static const muse_argv_nativefn_info_t k_json_cons_fn = { fn_cons, NULL };
 static muse_cell json_read_object_expr( muse_port_t p )
 {
 	muse_env *env = p->env;
@@ -534,7 +810,7 @@ static muse_cell json_read_object_expr( muse_port_t p )
 	{
 		muse_cell h = _cons( MUSE_NIL, MUSE_NIL );
 		int sp = _spos();
-		muse_cell t = _cons( _mk_nativefn(fn_list,NULL), MUSE_NIL );
+		muse_cell t = _cons( _mk_argv_nativefn(&k_json_list_fn), MUSE_NIL );
 		_setht( h, _mk_nativefn(fn_alist_to_hashtable,NULL), _cons( t, MUSE_NIL ) );
 		_unwind(sp);
 		return json_share_object_expr( env, json_read_object_expr_items( env, p, h, t, sp ) );
@@ -567,7 +843,7 @@ static muse_cell json_read_object_expr_items( muse_env *env, muse_port_t p, muse
 					if ( json_is_constant(env, value) ) {
 						assoc = _cons( muse_quote( env, _cons( key, value ) ), MUSE_NIL );
 					} else {
-						assoc = _cons( _cons( _mk_nativefn(fn_cons,NULL), _cons( muse_quote(env,key), _cons( value, MUSE_NIL ) ) ), MUSE_NIL );
+						assoc = _cons( _cons( _mk_argv_nativefn(&k_json_cons_fn), _cons( muse_quote(env,key), _cons( value, MUSE_NIL ) ) ), MUSE_NIL );
 					}
 					_sett( t, assoc );
 					t = assoc;
@@ -609,24 +885,692 @@ static muse_cell json_share_object_expr( muse_env *env, muse_cell objexpr )
 	return muse_eval( env, objexpr, MUSE_FALSE );
 }
 
-static void json_write( muse_port_t p, muse_cell thing ) 
+enum { JSON_SKIP_OUTSIDE, JSON_SKIP_IN_STRING, JSON_SKIP_IN_ESCAPE, JSON_SKIP_IN_TOKEN };
+
+/**
+ * Steps through the inside of containers that are \p depth deep, keeping
+ * track of whether it's in a string in \p state. Returns the number of
+ * bytes taken, which ends just past the closing bracket if the depth
+ * drops to 0. Where SSE2 is available, the quotes, backslashes and brackets
+ * of sixteen bytes are found at once and only those are looked at.
+ */
+static int json_skip_nested( const unsigned char *bytes, int nbytes, int *depth, int *state )
+{
+	int i = 0, d = *depth, st = *state;
+
+	if ( st == JSON_SKIP_IN_ESCAPE && nbytes > 0 ) {
+		st = JSON_SKIP_IN_STRING;
+		i = 1;
+	}
+
+#ifdef MUSE_JSON_SSE2
+	{
+		/* '[' and ']' differ from '{' and '}' only in the 0x20 bit. */
+		const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+		const __m128i open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}'), bit20 = _mm_set1_epi8(0x20);
+
+		for ( ; i + 16 <= nbytes; i += 16 ) {
+			__m128i v = _mm_loadu_si128( (const __m128i*)(bytes + i) );
+			__m128i folded = _mm_or_si128( v, bit20 );
+			int q = _mm_movemask_epi8( _mm_cmpeq_epi8( v, quote ) );
+			int bs = _mm_movemask_epi8( _mm_cmpeq_epi8( v, backslash ) );
+			int o = _mm_movemask_epi8( _mm_cmpeq_epi8( folded, open ) );
+			int c = _mm_movemask_epi8( _mm_cmpeq_epi8( folded, close ) );
+			int mask = (st == JSON_SKIP_IN_STRING) ? (q | bs) : (q | o | c);
+
+			while ( mask ) {
+				int bit = json_lowest_bit(mask), seen = (2 << bit) - 1;
+
+				if ( st == JSON_SKIP_IN_STRING ) {
+					if ( bs & (1 << bit) ) {
+						/* The escaped character is passed over too. */
+						if ( bit == 15 ) {
+							st = JSON_SKIP_IN_ESCAPE;
+							break;
+						}
+						seen = (4 << bit) - 1;
+					} else {
+						st = JSON_SKIP_OUTSIDE;
+					}
+				} else if ( q & (1 << bit) ) {
+					st = JSON_SKIP_IN_STRING;
+				} else if ( o & (1 << bit) ) {
+					++d;
+				} else if ( --d == 0 ) {
+					*depth = 0;
+					*state = JSON_SKIP_OUTSIDE;
+					return i + bit + 1;
+				}
+
+				mask = ((st == JSON_SKIP_IN_STRING) ? (q | bs) : (q | o | c)) & ~seen;
+			}
+
+			if ( st == JSON_SKIP_IN_ESCAPE ) {
+				if ( i + 16 >= nbytes ) {
+					i += 16;
+					break;
+				}
+				st = JSON_SKIP_IN_STRING;
+				++i;
+			}
+		}
+	}
+#endif
+
+	for ( ; i < nbytes; ++i ) {
+		int c = bytes[i];
+		if ( st == JSON_SKIP_IN_ESCAPE ) {
+			st = JSON_SKIP_IN_STRING;
+		} else if ( st == JSON_SKIP_IN_STRING ) {
+			if ( c == '\\' )
+				st = JSON_SKIP_IN_ESCAPE;
+			else if ( c == '"' )
+				st = JSON_SKIP_OUTSIDE;
+		} else if ( c == '"' ) {
+			st = JSON_SKIP_IN_STRING;
+		} else if ( c == '[' || c == '{' ) {
+			++d;
+		} else if ( (c == ']' || c == '}') && --d == 0 ) {
+			*depth = 0;
+			*state = JSON_SKIP_OUTSIDE;
+			return i + 1;
+		}
+	}
+
+	*depth = d;
+	*state = st;
+	return nbytes;
+}
+
+/**
+ * Skips over JSON values without creating any cells. If \p depth is 0,
+ * exactly one value is skipped. If \p depth is 1, the rest of the
+ * container whose opening bracket has already been consumed is skipped,
+ * including its closing bracket. Skipped parts are only checked for
+ * balanced brackets - they aren't validated in full.
+ *
+ * Returns MUSE_FALSE if an error was raised.
+ */
+static muse_boolean json_skip( muse_port_t p, int depth )
+{
+	muse_env *env = p->env;
+	int state = JSON_SKIP_OUTSIDE;
+
+	while ( MUSE_TRUE ) {
+		int avail = 0, i = 0;
+		const unsigned char *bytes = port_buffered( p, &avail );
+
+		if ( avail == 0 ) {
+			if ( port_buffer_more(p) > 0 )
+				continue;
+			if ( state == JSON_SKIP_IN_TOKEN )
+				return MUSE_TRUE; /* A number or keyword at the very end. */
+			muse_raise_error( env, _csymbol(L"json:unexpected-end-of-stream"), MUSE_NIL );
+			return MUSE_FALSE;
+		}
+
+		while ( i < avail ) {
+			if ( depth > 0 ) {
+				i += json_skip_nested( bytes + i, avail - i, &depth, &state );
+				if ( depth == 0 ) {
+					json_consume( p, bytes, i );
+					return MUSE_TRUE;
+				}
+				continue;
+			}
+
+			/* A single value at the top. */
+			switch ( state ) {
+				case JSON_SKIP_IN_STRING:
+					i += json_scan_string( bytes + i, avail - i );
+					if ( i < avail ) {
+						state = (bytes[i++] == '"') ? JSON_SKIP_OUTSIDE : JSON_SKIP_IN_ESCAPE;
+						if ( state == JSON_SKIP_OUTSIDE ) {
+							json_consume( p, bytes, i );
+							return MUSE_TRUE;
+						}
+					}
+					break;
+				case JSON_SKIP_IN_ESCAPE:
+					++i;
+					state = JSON_SKIP_IN_STRING;
+					break;
+				case JSON_SKIP_IN_TOKEN:
+					/* A number or a keyword. Step to the next delimiter. */
+					while ( i < avail && !json_is_delimiter(bytes[i]) )
+						++i;
+					if ( i < avail ) {
+						json_consume( p, bytes, i );
+						return MUSE_TRUE;
+					}
+					break;
+				default:
+					switch ( bytes[i++] ) {
+						case '"':
+							state = JSON_SKIP_IN_STRING;
+							break;
+						case '[':
+						case '{':
+							depth = 1;
+							break;
+						case ']':
+						case '}':
+						case ',':
+						case ':':
+							json_consume( p, bytes, i );
+							muse_raise_error( env, _csymbol(L"json:syntax-error"), MUSE_NIL );
+							return MUSE_FALSE;
+						case ' ': case '\t': case '\r': case '\n': case '\f':
+							break;
+						default:
+							state = JSON_SKIP_IN_TOKEN;
+							break;
+					}
+					break;
+			}
+		}
+
+		json_consume( p, bytes, avail );
+	}
+}
+
+/** @addtogroup FunctionalObjects */
+/*@{*/
+/**
+ * @defgroup JSONPull Pull reader
+ *
+ * A pull reader walks through a JSON stream one event at a time
+ * instead of building the whole document in memory. Create one using
+ * \ref fn_json_reader "json-reader". If r is a reader -
+ *	- (r) returns the next event - one of the symbols start-object,
+ *	  end-object, start-array or end-array, or a pair (key . name)
+ *	  or (value . v) where v is a string, number, true, false or ().
+ *	  It returns () when the stream ends. Several top level values,
+ *	  such as newline delimited JSON records, are read one after another.
+ *	- (r 'skip) skips input without creating any cells for it. Right after
+ *	  a start-object or start-array event, it skips the rest of that
+ *	  container including its end event. Right after a key event, it
+ *	  skips the key's value. After any other event, it skips the remaining
+ *	  items of the enclosing container.
+ *	- (r 'path) gives the list of keys and array indices leading from the
+ *	  top level value to the reader's current position.
+ */
+/*@{*/
+
+enum
+{
+	JSON_READER_VALUE,		/**< A value is expected next. */
+	JSON_READER_FIRST_ITEM,	/**< Just after '[' - a value or ']'. */
+	JSON_READER_FIRST_KEY,	/**< Just after '{' - a key or '}'. */
+	JSON_READER_KEY,		/**< After a ',' in an object. */
+	JSON_READER_NEXT		/**< After an item in a container - ',' or the closing bracket. */
+};
+
+typedef struct
+{
+	muse_functional_object_t base;
+	muse_cell port_cell;
+	muse_port_t port;
+
+	/**
+	 * The keys and indices of the enclosing containers, innermost first.
+	 * An integer at the head means we're in an array and () or a symbol
+	 * means we're in an object. The length of the list is the nesting depth.
+	 */
+	muse_cell path;
+	int state;
+} json_reader_t;
+
+static void json_reader_init( muse_env *env, void *ptr, muse_cell args )
+{
+	json_reader_t *r = (json_reader_t*)ptr;
+	r->port_cell = args ? _evalnext(&args) : MUSE_NIL;
+	r->port = r->port_cell ? muse_port( env, r->port_cell ) : muse_current_port( env, MUSE_STDIN_PORT, NULL );
+	r->path = MUSE_NIL;
+	r->state = JSON_READER_VALUE;
+}
+
+static void json_reader_mark( muse_env *env, void *ptr )
+{
+	json_reader_t *r = (json_reader_t*)ptr;
+	muse_mark( env, r->port_cell );
+	muse_mark( env, r->path );
+}
+
+static muse_cell json_reader_pop( muse_env *env, json_reader_t *r, const muse_char *event )
+{
+	r->path = _tail(r->path);
+	r->state = r->path ? JSON_READER_NEXT : JSON_READER_VALUE;
+	return _csymbol(event);
+}
+
+static muse_cell json_reader_next( muse_env *env, json_reader_t *r )
+{
+	muse_port_t p = r->port;
+
+	while ( MUSE_TRUE ) {
+		muse_char c;
+		json_skip_whitespace(p);
+
+		if ( port_eof(p) ) {
+			if ( r->path || r->state != JSON_READER_VALUE )
+				return muse_raise_error( env, _csymbol(L"json:unexpected-end-of-stream"), MUSE_NIL );
+			else
+				return MUSE_NIL;
+		}
+
+		c = port_getchar(p);
+
+		switch ( r->state ) {
+			case JSON_READER_FIRST_ITEM:
+				if ( c == ']' )
+					return json_reader_pop( env, r, L"end-array" );
+				r->state = JSON_READER_VALUE;
+				break;
+			case JSON_READER_FIRST_KEY:
+				if ( c == '}' )
+					return json_reader_pop( env, r, L"end-object" );
+				/* Fall through. */
+			case JSON_READER_KEY:
+				if ( c != '"' )
+					return muse_raise_error( env, _csymbol(L"json:object-syntax-error"), MUSE_NIL );
+				else {
+					muse_cell key;
+					port_ungetchar( c, p );
+					key = json_read_key(p);
+					json_skip_whitespace(p);
+					if ( port_eof(p) || port_getchar(p) != ':' )
+						return muse_raise_error( env, _csymbol(L"json:object-syntax-error"), key );
+					_seth( r->path, key );
+					r->state = JSON_READER_VALUE;
+					return _cons( _csymbol(L"key"), key );
+				}
+			case JSON_READER_NEXT:
+				if ( _cellt(_head(r->path)) == MUSE_INT_CELL ) {
+					if ( c == ',' ) {
+						_seth( r->path, _mk_int( _intvalue(_head(r->path)) + 1 ) );
+						r->state = JSON_READER_VALUE;
+						continue;
+					} else if ( c == ']' ) {
+						return json_reader_pop( env, r, L"end-array" );
+					} else {
+						return muse_raise_error( env, _csymbol(L"json:array-syntax-error"), MUSE_NIL );
+					}
+				} else {
+					if ( c == ',' ) {
+						r->state = JSON_READER_KEY;
+						continue;
+					} else if ( c == '}' ) {
+						return json_reader_pop( env, r, L"end-object" );
+					} else {
+						return muse_raise_error( env, _csymbol(L"json:object-syntax-error"), MUSE_NIL );
+					}
+				}
+		}
+
+		/* A value is expected. */
+		if ( c == '[' ) {
+			r->path = _cons( _mk_int(0), r->path );
+			r->state = JSON_READER_FIRST_ITEM;
+			return _csymbol(L"start-array");
+		} else if ( c == '{' ) {
+			r->path = _cons( MUSE_NIL, r->path );
+			r->state = JSON_READER_FIRST_KEY;
+			return _csymbol(L"start-object");
+		} else {
+			muse_cell value;
+			port_ungetchar( c, p );
+			value = json_read(p);
+			r->state = r->path ? JSON_READER_NEXT : JSON_READER_VALUE;
+			return _cons( _csymbol(L"value"), value );
+		}
+	}
+}
+
+static muse_cell json_reader_skip( muse_env *env, json_reader_t *r )
+{
+	switch ( r->state ) {
+		case JSON_READER_VALUE:
+			if ( !json_skip( r->port, 0 ) )
+				return MUSE_NIL;
+			r->state = r->path ? JSON_READER_NEXT : JSON_READER_VALUE;
+			break;
+		default:
+			if ( r->path ) {
+				if ( !json_skip( r->port, 1 ) )
+					return MUSE_NIL;
+				r->path = _tail(r->path);
+				r->state = r->path ? JSON_READER_NEXT : JSON_READER_VALUE;
+			}
+			break;
+	}
+
+	return _builtin_symbol(MUSE_T);
+}
+
+static muse_cell fn_json_reader_fn( muse_env *env, json_reader_t *r, muse_cell args )
+{
+	if ( args ) {
+		muse_cell cmd = _evalnext(&args);
+		if ( cmd == _csymbol(L"skip") )
+			return json_reader_skip( env, r );
+		else if ( cmd == _csymbol(L"path") ) {
+			muse_cell path = MUSE_NIL, p = r->path;
+			while ( p )
+				path = _cons( _next(&p), path );
+			return path;
+		} else
+			return muse_raise_error( env, _csymbol(L"json:invalid-reader-command"), _cons( cmd, MUSE_NIL ) );
+	} else {
+		return json_reader_next( env, r );
+	}
+}
+
+static muse_functional_object_type_t g_json_reader_type =
+{
+	'muSE',
+	'jsnr',
+	sizeof(json_reader_t),
+	(muse_nativefn_t)fn_json_reader_fn,
+	NULL,
+	json_reader_init,
+	json_reader_mark,
+	NULL,
+	NULL
+};
+
+/**
+ * @code (json-reader [port]) @endcode
+ *
+ * Creates a \ref JSONPull "pull reader" over the given port, or over
+ * the current input port (usually stdin) if the port is omitted.
+ * For example, this counts the records in a newline delimited JSON
+ * file while skipping their contents -
+ * @code
+ * > (define r (json-reader (open-file "records.json" 'for-reading)))
+ * > (define (count n) (case (r) (() n) ('start-object (r 'skip) (count (+ n 1))) (_ (count n))))
+ * > (count 0)
+ * @endcode
+ */
+muse_cell fn_json_reader( muse_env *env, void *context, muse_cell args )
+{
+	return _mk_functional_object( &g_json_reader_type, args );
+}
+
+typedef struct
+{
+	muse_env *env;
+	muse_port_t port;
+	muse_cell fn;
+	muse_cell results, last;
+	int count;
+	buffer_t *key;
+} json_select_t;
+
+/**
+ * Checks whether the key in the selector's buffer matches the
+ * given path element, which can be a symbol or a string.
+ */
+static muse_boolean json_key_matches( json_select_t *s, muse_cell sel )
+{
+	muse_env *env = s->env;
+	const muse_char *name = NULL;
+	int len = 0, i;
+
+	if ( _cellt(sel) == MUSE_SYMBOL_CELL ) {
+		name = muse_symbol_name( env, sel );
+		len = (int)wcslen(name);
+	} else if ( _cellt(sel) == MUSE_TEXT_CELL ) {
+		name = muse_text_contents( env, sel, &len );
+	} else {
+		return MUSE_FALSE;
+	}
+
+	if ( len != buffer_length(s->key) )
+		return MUSE_FALSE;
+
+	for ( i = 0; i < len; ++i ) {
+		if ( name[i] != buffer_char( s->key, i ) )
+			return MUSE_FALSE;
+	}
+
+	return MUSE_TRUE;
+}
+
+/**
+ * Raises the given syntax error, or json:unexpected-end-of-stream if
+ * the port has run out. Always gives MUSE_FALSE.
+ */
+static muse_boolean json_select_error( muse_port_t p, const muse_char *error )
 {
 	muse_env *env = p->env;
+	muse_raise_error( env, muse_csymbol( env, port_eof(p) ? L"json:unexpected-end-of-stream" : error ), MUSE_NIL );
+	return MUSE_FALSE;
+}
+
+/**
+ * Walks the value at the port's position along the selector path.
+ * Values at the end of the path are read in full and either passed to
+ * the selector's function or collected. Everything else is skipped
+ * without allocating cells. Returns MUSE_FALSE if an error was raised.
+ */
+static muse_boolean json_select_value( json_select_t *s, muse_cell path )
+{
+	muse_env *env = s->env;
+	muse_port_t p = s->port;
+	muse_cell sel, star = _csymbol(L"*");
+	muse_char c;
+
+	json_skip_whitespace(p);
+	if ( port_eof(p) )
+		return json_select_error( p, NULL );
+
+	if ( !path ) {
+		int sp = _spos();
+		muse_cell value = json_read(p);
+		if ( s->fn ) {
+			muse_apply( env, s->fn, _cons( value, MUSE_NIL ), MUSE_TRUE, MUSE_FALSE );
+			_unwind(sp);
+		} else if ( s->results ) {
+			muse_cell n = _cons( value, MUSE_NIL );
+			_sett( s->last, n );
+			s->last = n;
+			_unwind(sp);
+		} else {
+			s->results = s->last = _cons( value, MUSE_NIL );
+		}
+		++(s->count);
+		return MUSE_TRUE;
+	}
+
+	sel = _head(path);
+	c = port_getchar(p);
+
+	if ( c == '{' && _cellt(sel) != MUSE_INT_CELL ) {
+		while ( MUSE_TRUE ) {
+			json_skip_whitespace(p);
+			c = port_eof(p) ? 0 : port_getchar(p);
+			if ( c == '}' )
+				return MUSE_TRUE;
+			if ( c != '"' )
+				return json_select_error( p, L"json:object-syntax-error" );
+			port_ungetchar( c, p );
+			buffer_reset( s->key );
+			json_read_string_into( p, s->key );
+			json_skip_whitespace(p);
+			if ( port_eof(p) || port_getchar(p) != ':' )
+				return json_select_error( p, L"json:object-syntax-error" );
+			if ( sel == star || json_key_matches( s, sel ) ) {
+				if ( !json_select_value( s, _tail(path) ) )
+					return MUSE_FALSE;
+			} else if ( !json_skip( p, 0 ) ) {
+				return MUSE_FALSE;
+			}
+			json_skip_whitespace(p);
+			c = port_eof(p) ? 0 : port_getchar(p);
+			if ( c == '}' )
+				return MUSE_TRUE;
+			if ( c != ',' )
+				return json_select_error( p, L"json:object-syntax-error" );
+		}
+	} else if ( c == '[' && (sel == star || _cellt(sel) == MUSE_INT_CELL) ) {
+		muse_int i = 0;
+		json_skip_whitespace(p);
+		if ( !port_eof(p) ) {
+			c = port_getchar(p);
+			if ( c == ']' )
+				return MUSE_TRUE;
+			port_ungetchar( c, p );
+		}
+		for ( i = 0; MUSE_TRUE; ++i ) {
+			if ( sel == star || i == _intvalue(sel) ) {
+				if ( !json_select_value( s, _tail(path) ) )
+					return MUSE_FALSE;
+			} else if ( !json_skip( p, 0 ) ) {
+				return MUSE_FALSE;
+			}
+			json_skip_whitespace(p);
+			c = port_eof(p) ? 0 : port_getchar(p);
+			if ( c == ']' )
+				return MUSE_TRUE;
+			if ( c != ',' )
+				return json_select_error( p, L"json:array-syntax-error" );
+		}
+	} else {
+		port_ungetchar( c, p );
+		return json_skip( p, 0 );
+	}
+}
+
+/**
+ * @code (json-select port path [fn]) @endcode
+ *
+ * Picks out the values at the given path from every top level
+ * JSON value in the port, skipping everything else without building
+ * it in memory. The path is a list whose elements are keys - symbols
+ * or strings - for object fields, integers for array indices, or
+ * the symbol * to match any field or index. For example,
+ * @code
+ * > (json-select port '(items * name))
+ * @endcode
+ * gives the name fields of all the objects in the "items" array.
+ *
+ * If fn is given, it is called with each value as it is found and
+ * json-select returns the number of values found. Otherwise the values
+ * are returned as a list. With newline delimited JSON, the path
+ * is applied to each record in turn.
+ */
+muse_cell fn_json_select( muse_env *env, void *context, muse_cell args )
+{
+	json_select_t s;
+	int arena = 0;
+	s.env = env;
+	s.port = muse_port( env, _evalnext(&args) );
+	{
+		muse_cell path = _evalnext(&args);
+		s.fn = args ? _evalnext(&args) : MUSE_NIL;
+		s.results = s.last = MUSE_NIL;
+		s.count = 0;
+		s.key = buffer_alloc();
+
+		/* Values handed to fn may be kept around individually, so don't
+		   let them pin arena chunks. */
+		if ( !s.fn )
+			arena = muse_begin_text_arena(env);
+
+		muse_push_recent_scope( env );
+		json_skip_whitespace(s.port);
+		while ( !port_eof(s.port) ) {
+			if ( !json_select_value( &s, path ) )
+				break;
+			json_skip_whitespace(s.port);
+		}
+		buffer_free(s.key);
+		if ( !s.fn )
+			muse_end_text_arena( env, arena );
+
+		if ( s.fn ) {
+			muse_pop_recent_scope( env, 0, MUSE_NIL );
+			return _mk_int(s.count);
+		} else {
+			return muse_pop_recent_scope( env, (muse_int)fn_json_select, s.results );
+		}
+	}
+}
+
+/*@}*/
+/*@}*/
+
+/** @name Writing JSON
+ * JSON is written into a growable byte buffer which is handed to the
+ * port with a single port_write() once the whole value is in it.
+ */
+/*@{*/
+
+static void json_out_init( json_out_t *out, muse_env *env )
+{
+	out->env		= env;
+	out->bytes		= NULL;
+	out->size		= 0;
+	out->capacity	= 0;
+}
+
+/**
+ * Makes room for \p nbytes more bytes and returns where they go.
+ * The caller adds the bytes it actually wrote to \c size.
+ */
+static unsigned char *json_out_reserve( json_out_t *out, size_t nbytes )
+{
+	if ( out->size + nbytes > out->capacity ) {
+		size_t capacity = out->capacity ? 2 * out->capacity : 4096;
+		while ( capacity < out->size + nbytes )
+			capacity *= 2;
+		out->bytes = (unsigned char*)realloc( out->bytes, capacity );
+		out->capacity = capacity;
+	}
+
+	return out->bytes + out->size;
+}
+
+static void json_out_bytes( json_out_t *out, const char *bytes, size_t nbytes )
+{
+	memcpy( json_out_reserve( out, nbytes ), bytes, nbytes );
+	out->size += nbytes;
+}
+
+static void json_out_byte( json_out_t *out, int c )
+{
+	*json_out_reserve( out, 1 ) = (unsigned char)c;
+	++(out->size);
+}
+
+static void json_out_flush( json_out_t *out, muse_port_t p )
+{
+	if ( out->size > 0 )
+		port_write( out->bytes, out->size, p );
+
+	free( out->bytes );
+	json_out_init( out, out->env );
+}
+
+static void json_write( json_out_t *out, muse_cell thing ) 
+{
+	muse_env *env = out->env;
 	if ( thing == MUSE_NIL )
-		muse_pwrite( p, _csymbol(L"null") );
+		json_out_bytes( out, "null", 4 );
 	else {
 		switch ( _cellt(thing) ) {
 			case MUSE_INT_CELL:
-			case MUSE_FLOAT_CELL: json_write_number( p, thing ); break;
-			case MUSE_TEXT_CELL: json_write_string( p, thing ); break;
+			case MUSE_FLOAT_CELL: json_write_number( out, thing ); break;
+			case MUSE_TEXT_CELL: json_write_string( out, thing ); break;
 			case MUSE_NATIVEFN_CELL:
 				{
 					if ( muse_functional_object_data( env, thing, 'vect' ) ) {
-						json_write_vector( p, thing );
+						json_write_vector( out, thing );
 					} else if ( muse_functional_object_data( env, thing, 'hash' ) ) {
-						json_write_hash( p, thing ); 
+						json_write_hash( out, thing ); 
 					} else if ( muse_functional_object_data( env, thing, 'mobj' ) ) {
-						json_write_object( p, thing ); 
+						json_write_object( out, thing ); 
 					} else {
 						muse_raise_error( env, _csymbol(L"json:invalid-json-type"), thing );
 					}
@@ -634,9 +1578,11 @@ static void json_write( muse_port_t p, muse_cell thing )
 				}
 			case MUSE_SYMBOL_CELL:
 				{
-					const muse_char *symname = muse_symbol_name( p->env, thing );
-					if ( wcscmp( symname, L"true" ) || wcscmp( symname, L"false" ) ) {
-						muse_pwrite( p, thing );
+					const muse_char *symname = muse_symbol_name( env, thing );
+					if ( wcscmp( symname, L"true" ) == 0 ) {
+						json_out_bytes( out, "true", 4 );
+					} else if ( wcscmp( symname, L"false" ) == 0 ) {
+						json_out_bytes( out, "false", 5 );
 					} else {
 						muse_raise_error( env, _csymbol(L"json:invalid-keyword"), thing );
 					}
@@ -646,87 +1592,166 @@ static void json_write( muse_port_t p, muse_cell thing )
 	}
 }
 
-static void json_write_number( muse_port_t p, muse_cell num )
+/**
+ * Writes the shortest of the 15, 16 and 17 significant digit forms
+ * of the float that reads back as the same double. Integral values
+ * get a ".0" so that they're read back as floats, as with muse_pwrite().
+ * JSON has no infinities or NaNs, so those are written as null.
+ */
+static void json_write_float( json_out_t *out, muse_float f )
 {
-	muse_pwrite( p, num );
+	char text[32];
+	int count = 0, precision;
+
+	if ( f - f != 0.0 ) {
+		json_out_bytes( out, "null", 4 );
+		return;
+	}
+
+	for ( precision = 15; precision <= 17; ++precision ) {
+		count = sprintf( text, "%.*g", precision, f );
+		if ( strtod( text, NULL ) == f )
+			break;
+	}
+
+	if ( !(strchr( text, '.' ) || strchr( text, 'e' )) ) {
+		text[count++] = '.';
+		text[count++] = '0';
+	}
+
+	json_out_bytes( out, text, count );
 }
 
-static void json_write_string( muse_port_t p, muse_cell str )
+static void json_write_number( json_out_t *out, muse_cell num )
 {
-	int len = 0;
-	const muse_char *txt = muse_text_contents( p->env, str, &len );
+	muse_env *env = out->env;
 
-	port_putc( '"', p );
-	{
-		int i = 0;
-		for ( i = 0; i < len; ++i ) {
-			muse_char c = txt[i];
-			switch ( c ) {
-				case '"':	port_write( "\\\"", 2, p ); break;
-				case '\\':	port_write( "\\\\", 2, p ); break;
-				case '\b':	port_write( "\\b", 2, p ); break;
-				case '\f':	port_write( "\\f", 2, p ); break;
-				case '\n':	port_write( "\\n", 2, p ); break;
-				case '\r':	port_write( "\\r", 2, p ); break;
-				case '\t':	port_write( "\\t", 2, p ); break;
-				default:
-					port_putc( c, p );
-			}
+	if ( _cellt(num) == MUSE_FLOAT_CELL ) {
+		json_write_float( out, _ptr(num)->f );
+	} else {
+		/* Digits are made from the end backwards. */
+		char digits[24], *d = digits + sizeof(digits);
+		muse_int i = _ptr(num)->i;
+		unsigned long long n = i < 0 ? 0ULL - (unsigned long long)i : (unsigned long long)i;
+
+		do {
+			*(--d) = (char)('0' + (n % 10));
+			n /= 10;
+		} while ( n );
+
+		if ( i < 0 )
+			*(--d) = '-';
+
+		json_out_bytes( out, d, (digits + sizeof(digits)) - d );
+	}
+}
+
+/**
+ * Room is made for the worst case up front, which is a \\u escape 
+ * for every character, so that the characters can be stored without
+ * further checks. Runs of printable ASCII characters, which need no 
+ * escaping, are copied in a tight loop.
+ */
+static void json_write_chars( json_out_t *out, const muse_char *txt, int len )
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char *start = json_out_reserve( out, 6 * (size_t)len + 2 ), *o = start;
+	const muse_char *end = txt + len;
+
+	*o++ = '"';
+
+	while ( txt < end ) {
+		muse_char c;
+
+		while ( txt < end && *txt >= 0x20 && *txt < 0x80 && *txt != '"' && *txt != '\\' )
+			*o++ = (unsigned char)*txt++;
+
+		if ( txt == end )
+			break;
+
+		c = *txt++;
+		switch ( c ) {
+			case '"':	*o++ = '\\'; *o++ = '"'; break;
+			case '\\':	*o++ = '\\'; *o++ = '\\'; break;
+			case '\b':	*o++ = '\\'; *o++ = 'b'; break;
+			case '\f':	*o++ = '\\'; *o++ = 'f'; break;
+			case '\n':	*o++ = '\\'; *o++ = 'n'; break;
+			case '\r':	*o++ = '\\'; *o++ = 'r'; break;
+			case '\t':	*o++ = '\\'; *o++ = 't'; break;
+			default:
+				if ( c < 0x20 ) {
+					*o++ = '\\'; *o++ = 'u'; *o++ = '0'; *o++ = '0';
+					*o++ = hex[(c >> 4) & 0xF];
+					*o++ = hex[c & 0xF];
+				} else {
+					o += uc16_to_utf8( c, o, 4 );
+				}
 		}
 	}
-	port_putc( '"', p );
+
+	*o++ = '"';
+	out->size += o - start;
 }
 
-static void json_write_vector( muse_port_t p, muse_cell arr )
+static void json_write_string( json_out_t *out, muse_cell str )
 {
-	muse_env *env = p->env;
+	int len = 0;
+	const muse_char *txt = muse_text_contents( out->env, str, &len );
+	json_write_chars( out, txt, len );
+}
+
+static void json_write_vector( json_out_t *out, muse_cell arr )
+{
+	muse_env *env = out->env;
 	int len = muse_vector_length( env, arr );
-	port_putc( '[', p );
+	json_out_byte( out, '[' );
 	{
 		int i = 0;
 		for ( i = 0; i < len; ++i ) {
-			json_write(p, muse_vector_get( env, arr, i ));
+			json_write( out, muse_vector_get( env, arr, i ) );
 			if ( i + 1 < len )
-				port_putc( ',', p );
+				json_out_byte( out, ',' );
 		}
 	}
-	port_putc( ']', p );
+	json_out_byte( out, ']' );
 }
 
-muse_cell fn_hashtable_to_alist( muse_env *env, void *context, muse_cell args );
-
-static void json_write_hash( muse_port_t p, muse_cell obj )
+/**
+ * Writes the key-value pairs of an alist as the members of an object.
+ */
+static void json_write_members( json_out_t *out, muse_cell alist )
 {
-	muse_env *env = p->env;
-	int sp = _spos();
-	muse_cell alist = fn_hashtable_to_alist( env, NULL, _cons(obj,MUSE_NIL) );
-	_unwind(sp);
-	port_putc( '{', p );
+	muse_env *env = out->env;
+	json_out_byte( out, '{' );
 	while ( alist ) {
 		muse_cell ht = _next(&alist);
-		json_write_string(p, _symname(_head(ht)));
-		port_putc(':',p);
-		json_write(p,_tail(ht));
+		json_write_string( out, _symname(_head(ht)) );
+		json_out_byte( out, ':' );
+		json_write( out, _tail(ht) );
 		if ( alist )
-			port_putc( ',', p );
+			json_out_byte( out, ',' );
 	}
-	port_putc( '}', p );
+	json_out_byte( out, '}' );
+}
+
+muse_cell fn_hashtable_to_alist( muse_env *env, void *context, muse_cell args );
+
+static void json_write_hash( json_out_t *out, muse_cell obj )
+{
+	muse_env *env = out->env;
+	int sp = _spos();
+
+	/* The alist stays on the stack until it's written, since 
+	nested hashtables make alists of their own. */
+	json_write_members( out, fn_hashtable_to_alist( env, NULL, _cons(obj,MUSE_NIL) ) );
+	_unwind(sp);
 }
 
 muse_cell object_plist( muse_env *env, muse_cell obj );
 
-static void json_write_object( muse_port_t p, muse_cell obj )
+static void json_write_object( json_out_t *out, muse_cell obj )
 {
-	muse_env *env = p->env;
-	muse_cell plist = object_plist( env, obj );
-	port_putc( '{', p );
-	while ( plist ) {
-		muse_cell ht = _next(&plist);
-		json_write_string(p, _symname(_head(ht)));
-		port_putc(':',p);
-		json_write(p,_tail(ht));
-		if ( plist )
-			port_putc( ',', p );
-	}
-	port_putc( '}', p );
+	json_write_members( out, object_plist( out->env, obj ) );
 }
+
+/*@}*/
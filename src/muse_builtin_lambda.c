@@ -495,6 +495,8 @@ muse_cell syntax_lambda( muse_env *env, void *context, muse_cell args )
 				_unwind(sp);
 				_returncell(argcell);
 			}
+
+			muse_compile_lambda( env, closure );
 		}
 	}
 
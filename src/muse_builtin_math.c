@@ -20,15 +20,16 @@
  * The result will be an integer if all of its arguments
  * are integers. Otherwise it'll be float.
  */
-muse_cell fn_add( muse_env *env, void *context, muse_cell args )
+muse_cell fn_add( muse_env *env, void *context, int argc, muse_cell *argv )
 {
 	muse_int i = 0;
 	muse_float f = 0.0;
 	muse_boolean result_is_float = MUSE_FALSE;
+	int k;
 	
-	while ( args )
+	for ( k = 0; k < argc; ++k )
 	{
-		muse_cell arg = _evalnext(&args);
+		muse_cell arg = argv[k];
 		switch ( _cellt(arg) )
 		{
 			case MUSE_INT_CELL :
@@ -61,17 +62,18 @@ muse_cell fn_add( muse_env *env, void *context, muse_cell args )
  * 	- <tt>(- m n)</tt> gives <tt>(m-n)</tt>
  * 	- <tt>(- m n o p)</tt> gives <tt>(m - (n+o+p))</tt>
  */
-muse_cell fn_sub( muse_env *env, void *context, muse_cell args )
+muse_cell fn_sub( muse_env *env, void *context, int argc, muse_cell *argv )
 {
 	muse_int i = 0;
 	muse_float f = 0.0;
 	muse_boolean result_is_float = MUSE_FALSE;
 	muse_cell c = MUSE_NIL;
+	int k;
 	
-	if ( !args )
+	if ( argc == 0 )
 		return _mk_int(0);
 	
-	c = _evalnext(&args);
+	c = argv[0];
 	switch ( _cellt(c) )
 	{
 		case MUSE_INT_CELL		: i += _ptr(c)->i; break;
@@ -85,7 +87,7 @@ muse_cell fn_sub( muse_env *env, void *context, muse_cell args )
 				});
 	}
 	
-	if ( !args )
+	if ( argc == 1 )
 	{
 		if ( result_is_float )
 			return _mk_float( -f );
@@ -93,9 +95,9 @@ muse_cell fn_sub( muse_env *env, void *context, muse_cell args )
 			return _mk_int( -i );
 	}
 	
-	while ( args )
+	for ( k = 1; k < argc; ++k )
 	{
-		c = _evalnext(&args);
+		c = argv[k];
 		switch ( _cellt(c) )
 		{
 			case MUSE_INT_CELL		: i -= _ptr(c)->i; break;
@@ -122,15 +124,16 @@ muse_cell fn_sub( muse_env *env, void *context, muse_cell args )
  * at least one of the arguments is float. Otherwise
  * it is an integer.
  */
-muse_cell fn_mul( muse_env *env, void *context, muse_cell args )
+muse_cell fn_mul( muse_env *env, void *context, int argc, muse_cell *argv )
 {
 	muse_int i = 1;
 	muse_float f = 1.0;
 	muse_boolean result_is_float = MUSE_FALSE;
+	int k;
 	
-	while ( args )
+	for ( k = 0; k < argc; ++k )
 	{
-		muse_cell arg = _evalnext(&args);
+		muse_cell arg = argv[k];
 		switch ( _cellt(arg) )
 		{
 			case MUSE_INT_CELL :
@@ -164,15 +167,16 @@ muse_cell fn_mul( muse_env *env, void *context, muse_cell args )
  * 	- <tt>(/ m n)</tt> gives <tt>(m/n)</tt>
  * 	- <tt>(/ m n o p)</tt> gives <tt>(m / (n * o * p))</tt>
  */
-muse_cell fn_div( muse_env *env, void *context, muse_cell args )
+muse_cell fn_div( muse_env *env, void *context, int argc, muse_cell *argv )
 {
 	muse_float f = 1.0;
 	muse_cell c = MUSE_NIL;
+	int k;
 	
-	if ( !args )
+	if ( argc == 0 )
 		return _mk_int(0);
 	
-	c = _evalnext(&args);
+	c = argv[0];
 	switch ( _cellt(c) )
 	{
 		case MUSE_INT_CELL		: f = (muse_float)(_ptr(c)->i); break;
@@ -186,12 +190,12 @@ muse_cell fn_div( muse_env *env, void *context, muse_cell args )
 				});
 	}
 	
-	if ( !args )
+	if ( argc == 1 )
 		return _mk_float( 1.0 / f );
 	
-	while ( args )
+	for ( k = 1; k < argc; ++k )
 	{
-		c = _evalnext(&args);
+		c = argv[k];
 		switch ( _cellt(c) )
 		{
 			case MUSE_INT_CELL		: f /= _ptr(c)->i; break;
@@ -214,10 +218,10 @@ muse_cell fn_div( muse_env *env, void *context, muse_cell args )
  * Takes 2 arguments. Divides first by the second and returns
  * the quotient. Arguments must be integers.
  */
-muse_cell fn_idiv( muse_env *env, void *context, muse_cell args )
+muse_cell fn_idiv( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell a1 = _evalnext(&args);
-	muse_cell a2 = _evalnext(&args);
+	muse_cell a1 = _argv(0);
+	muse_cell a2 = _argv(1);
 	
 	muse_int q = _ptr(a1)->i / _ptr(a2)->i;
 	
@@ -233,10 +237,10 @@ muse_cell fn_idiv( muse_env *env, void *context, muse_cell args )
  * and the result is always in the range [0,denom)
  * irrespective of the sign of the numerator.
  */
-muse_cell fn_mod( muse_env *env, void *context, muse_cell args )
+muse_cell fn_mod( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_int n = _intvalue(_evalnext(&args));
-	muse_int m = _intvalue(_evalnext(&args));
+	muse_int n = _intvalue(_argv(0));
+	muse_int m = _intvalue(_argv(1));
 
 	muse_assert( m != 0 );
 	m = (m > 0) ? m : -m;
@@ -250,9 +254,9 @@ muse_cell fn_mod( muse_env *env, void *context, muse_cell args )
  *
  * Increments the integer contents of the given cell.
  */
-muse_cell fn_inc( muse_env *env, void *context, muse_cell args )
+muse_cell fn_inc( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell c = _evalnext(&args);
+	muse_cell c = _argv(0);
 	++(_ptr(c)->i);
 	return c;
 }
@@ -262,9 +266,9 @@ muse_cell fn_inc( muse_env *env, void *context, muse_cell args )
  *
  * Decrements the integer contents of the given cell.
  */
-muse_cell fn_dec( muse_env *env, void *context, muse_cell args )
+muse_cell fn_dec( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell c = _evalnext(&args);
+	muse_cell c = _argv(0);
 	--(_ptr(c)->i);
 	return c;
 }
@@ -274,9 +278,9 @@ muse_cell fn_dec( muse_env *env, void *context, muse_cell args )
  * Converts a float to int. If given an integer argument.
  * returns it as is.
  */
-muse_cell fn_trunc( muse_env *env, void *context, muse_cell args )
+muse_cell fn_trunc( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell arg = _evalnext(&args);
+	muse_cell arg = _argv(0);
 	switch ( _cellt(arg) )
 	{
 		case MUSE_FLOAT_CELL : return _mk_int((muse_int)_ptr(arg)->f);
@@ -292,15 +296,15 @@ muse_cell fn_trunc( muse_env *env, void *context, muse_cell args )
  * 	- <tt>(rand F)</tt> returns a float random number in the range [0,F).
  * 	- <tt>(rand G F)</tt> returns a float random number in the range [G,F).
  */
-muse_cell fn_rand( muse_env *env, void *context, muse_cell args )
+muse_cell fn_rand( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell N = _evalnext(&args);
+	muse_cell N = _argv(0);
 	muse_cell M = MUSE_NIL;
 	
-	if ( args )
+	if ( argc > 1 )
 	{
 		M = N;
-		N = _evalnext(&args);
+		N = argv[1];
 		muse_assert( _cellt(M) == _cellt(N) );
 	}
 	
@@ -338,10 +342,10 @@ muse_cell fn_rand( muse_env *env, void *context, muse_cell args )
  * Computes base ^ exponent.
  * The result is always a float.
  */
-muse_cell fn_pow( muse_env *env, void *context, muse_cell args )
+muse_cell fn_pow( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell base		= _evalnext(&args);
-	muse_cell exponent	= _evalnext(&args);
+	muse_cell base		= _argv(0);
+	muse_cell exponent	= _argv(1);
 
 	return _mk_float( pow( _floatvalue(base), _floatvalue(exponent) ) );
 }
@@ -375,11 +379,11 @@ typedef double (*unary_math_op_t)(double);
  * 	-	floor
  * 	-	ceil
  */
-muse_cell fn_unary_math( muse_env *env, void *fn, muse_cell args )
+muse_cell fn_unary_math( muse_env *env, void *fn, int argc, muse_cell *argv )
 {
 	unary_math_op_t op = (unary_math_op_t)fn;
 	
-	muse_float f = _floatvalue(_evalnext(&args));
+	muse_float f = _floatvalue(_argv(0));
 	
 	return _mk_float( op(f) );
 }
@@ -411,32 +415,32 @@ static double muse_ceil( double x )
  */
 void muse_math_load_common_unary_functions( muse_env *env )
 {
-	struct _unary_op { const muse_char *name; unary_math_op_t f; };
+	struct _unary_op { const muse_char *name; muse_argv_nativefn_info_t info; };
 	
 	static const struct _unary_op k_unary_ops[] =
 	{
-	{	L"sqrt",	sqrt	},
-	{	L"log",		log		},
-	{	L"log10",	log10	},
-	{	L"exp",		exp		},
-	{	L"sin",		sin		},
-	{	L"cos",		cos		},
-	{	L"tan",		tan		},
-	{	L"asin",	asin	},
-	{	L"acos",	acos	},
-	{	L"atan",	atan	},
-	{	L"sinh",	sinh	},
-	{	L"cosh",	cosh	},
-	{	L"tanh",	tanh	},
+	{	L"sqrt",	{ fn_unary_math, (void*)sqrt }	},
+	{	L"log",	{ fn_unary_math, (void*)log }	},
+	{	L"log10",	{ fn_unary_math, (void*)log10 }	},
+	{	L"exp",	{ fn_unary_math, (void*)exp }	},
+	{	L"sin",	{ fn_unary_math, (void*)sin }	},
+	{	L"cos",	{ fn_unary_math, (void*)cos }	},
+	{	L"tan",	{ fn_unary_math, (void*)tan }	},
+	{	L"asin",	{ fn_unary_math, (void*)asin }	},
+	{	L"acos",	{ fn_unary_math, (void*)acos }	},
+	{	L"atan",	{ fn_unary_math, (void*)atan }	},
+	{	L"sinh",	{ fn_unary_math, (void*)sinh }	},
+	{	L"cosh",	{ fn_unary_math, (void*)cosh }	},
+	{	L"tanh",	{ fn_unary_math, (void*)tanh }	},
 #ifndef MUSE_PLATFORM_WINDOWS
-	{	L"asinh",	asinh	},
-	{	L"acosh",	acosh	},
-	{	L"atanh",	atanh	},
+	{	L"asinh",	{ fn_unary_math, (void*)asinh }	},
+	{	L"acosh",	{ fn_unary_math, (void*)acosh }	},
+	{	L"atanh",	{ fn_unary_math, (void*)atanh }	},
 #endif
-	{	L"fabs",	fabs	},
-	{	L"floor",	muse_floor	},
-	{	L"ceil",	muse_ceil	},
-	{	NULL,		NULL	}
+	{	L"fabs",	{ fn_unary_math, (void*)fabs }	},
+	{	L"floor",	{ fn_unary_math, (void*)muse_floor }	},
+	{	L"ceil",	{ fn_unary_math, (void*)muse_ceil }	},
+	{	NULL,		{ NULL, NULL }	}
 	};
 	
 	{
@@ -444,7 +448,7 @@ void muse_math_load_common_unary_functions( muse_env *env )
 		while ( op->name )
 		{
 			int sp = _spos();
-			_define( _csymbol(op->name), _mk_nativefn( fn_unary_math, (void*)(op->f) ) );
+			_define( _csymbol(op->name), _mk_argv_nativefn( &op->info ) );
 			_unwind(sp);
 			++op;
 		}
@@ -19,18 +19,18 @@
 
 BEGIN_MUSE_C_FUNCTIONS
 
-muse_cell fn_add( muse_env *env, void *context, muse_cell args );
-muse_cell fn_sub( muse_env *env, void *context, muse_cell args );
-muse_cell fn_mul( muse_env *env, void *context, muse_cell args );
-muse_cell fn_div( muse_env *env, void *context, muse_cell args );
-muse_cell fn_idiv( muse_env *env, void *context, muse_cell args );
-muse_cell fn_mod( muse_env *env, void *context, muse_cell args );
-
-muse_cell fn_inc( muse_env *env, void *context, muse_cell args );
-muse_cell fn_dec( muse_env *env, void *context, muse_cell args );
-muse_cell fn_trunc( muse_env *env, void *context, muse_cell args );
-muse_cell fn_rand( muse_env *env, void *context, muse_cell args );
-muse_cell fn_pow( muse_env *env, void *context, muse_cell args );
+muse_cell fn_add( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_sub( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_mul( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_div( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_idiv( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_mod( muse_env *env, void *context, int argc, muse_cell *argv );
+
+muse_cell fn_inc( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_dec( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_trunc( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_rand( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_pow( muse_env *env, void *context, int argc, muse_cell *argv );
 
 void muse_math_load_common_unary_functions( muse_env *env );
 
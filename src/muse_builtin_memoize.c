@@ -0,0 +1,391 @@
+/**
+ * @file muse_builtin_memoize.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Implements memoized functions, which remember the results of their
+ * most recent calls in a bounded hashed cache.
+ */
+
+#include "muse_builtins.h"
+#include <stdlib.h>
+#include <memory.h>
+
+/** @addtogroup FunctionalObjects */
+/*@{*/
+/**
+ * @defgroup Memoize Memoized functions
+ *
+ * \ref fn_memoize "memoize" wraps a function in one that remembers the
+ * results of calls by their arguments, up to a given number of them.
+ * When the cache is full, the result that was least recently asked
+ * for makes way for the new one. Unlike the values that \ref fn_the "the"
+ * refers to, which last only as long as the scope that computed them,
+ * a memoized function keeps its results for as long as it is around
+ * itself, and looking one up takes the same time however many there are.
+ *
+ * @code
+ * (define fib
+ *   (memoize (fn (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+ *            1000))
+ * (fib 90)
+ * (memoize-stats fib)
+ * @endcode
+ *
+ * Arguments are matched the way \ref Hashtables "hashtable" keys are -
+ * numbers, texts and symbols by value and anything else by identity.
+ * The results are held on to by the memoized function, so they are
+ * not collected as garbage until they are evicted or the memoized
+ * function itself is.
+ */
+/*@{*/
+
+/**
+ * A cached call. Entries are chained into hash buckets through
+ * \p hnext and into the LRU list, most recently used first, through
+ * \p prev and \p next. Links are entry indices, with -1 for none.
+ */
+typedef struct
+{
+	muse_int	hash;
+	muse_cell	args;
+	muse_cell	value;
+	int			hnext, prev, next;
+} memo_entry_t;
+
+typedef struct
+{
+	muse_functional_object_t base;
+	muse_cell		fn;
+	int				capacity, count;
+	memo_entry_t	*entries;
+	int				*buckets;		/**< Power of 2 sized, at least capacity. */
+	int				bucket_mask;
+	int				head, tail;		/**< Most and least recently used entries. */
+	muse_int		hits, misses, evictions;
+} memo_t;
+
+enum
+{
+	MEMO_DEFAULT_CAPACITY	= 1024,
+	MEMO_MAX_CAPACITY		= 1 << 28
+};
+
+static void memo_alloc( memo_t *m, int capacity )
+{
+	int nbuckets = 8, i;
+	while ( nbuckets < capacity )
+		nbuckets *= 2;
+
+	m->capacity		= capacity;
+	m->count		= 0;
+	m->entries		= (memo_entry_t*)calloc( capacity, sizeof(memo_entry_t) );
+	m->buckets		= (int*)malloc( nbuckets * sizeof(int) );
+	m->bucket_mask	= nbuckets - 1;
+	m->head			= -1;
+	m->tail			= -1;
+
+	for ( i = 0; i < nbuckets; ++i )
+		m->buckets[i] = -1;
+}
+
+/**
+ * Takes the function and capacity already evaluated and checked
+ * by \ref fn_memoize "memoize".
+ */
+static void memo_init( muse_env *env, void *p, muse_cell args )
+{
+	memo_t *m = (memo_t*)p;
+
+	m->fn = _head(args);
+	memo_alloc( m, (int)_intvalue(_head(_tail(args))) );
+}
+
+static void memo_mark( muse_env *env, void *p )
+{
+	memo_t *m = (memo_t*)p;
+	int i;
+
+	muse_mark( env, m->fn );
+
+	for ( i = m->head; i >= 0; i = m->entries[i].next )
+	{
+		muse_mark( env, m->entries[i].args );
+		muse_mark( env, m->entries[i].value );
+	}
+}
+
+static void memo_destroy( muse_env *env, void *p )
+{
+	memo_t *m = (memo_t*)p;
+	free( m->entries );
+	free( m->buckets );
+	m->entries = NULL;
+	m->buckets = NULL;
+}
+
+/**
+ * Combines the hashtable hashes of the arguments, in order.
+ */
+static muse_int memo_hash( muse_env *env, muse_cell args )
+{
+	muse_int hash = 0;
+
+	while ( args )
+	{
+		hash = hash * 1000003 + muse_hash( env, _head(args) );
+		args = _tail(args);
+	}
+
+	return hash;
+}
+
+static muse_boolean memo_arg_equal( muse_env *env, muse_cell a, muse_cell b )
+{
+	if ( a == b )
+		return MUSE_TRUE;
+
+	switch ( _cellt(a) )
+	{
+	case MUSE_SYMBOL_CELL	: return MUSE_FALSE;
+	case MUSE_INT_CELL		: return _cellt(b) == MUSE_INT_CELL && _intvalue(a) == _intvalue(b);
+	case MUSE_FLOAT_CELL	:
+	case MUSE_TEXT_CELL		: return muse_equal( env, a, b ) ? MUSE_TRUE : MUSE_FALSE;
+	default					: return MUSE_FALSE;
+	}
+}
+
+static muse_boolean memo_args_equal( muse_env *env, muse_cell a, muse_cell b )
+{
+	while ( a && b )
+	{
+		if ( !memo_arg_equal( env, _head(a), _head(b) ) )
+			return MUSE_FALSE;
+
+		a = _tail(a);
+		b = _tail(b);
+	}
+
+	return (a == b) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+static int memo_find( muse_env *env, memo_t *m, muse_int hash, muse_cell args )
+{
+	int i = m->buckets[hash & m->bucket_mask];
+
+	while ( i >= 0 && !(m->entries[i].hash == hash && memo_args_equal( env, m->entries[i].args, args )) )
+		i = m->entries[i].hnext;
+
+	return i;
+}
+
+static void lru_unlink( memo_t *m, int i )
+{
+	memo_entry_t *e = m->entries + i;
+
+	if ( e->prev >= 0 ) m->entries[e->prev].next = e->next; else m->head = e->next;
+	if ( e->next >= 0 ) m->entries[e->next].prev = e->prev; else m->tail = e->prev;
+}
+
+static void lru_push_front( memo_t *m, int i )
+{
+	memo_entry_t *e = m->entries + i;
+
+	e->prev = -1;
+	e->next = m->head;
+
+	if ( m->head >= 0 )
+		m->entries[m->head].prev = i;
+	else
+		m->tail = i;
+
+	m->head = i;
+}
+
+/**
+ * Takes the least recently used entry out of the cache
+ * and returns its index for reuse.
+ */
+static int memo_evict( memo_t *m )
+{
+	int i = m->tail;
+	int *link = m->buckets + (m->entries[i].hash & m->bucket_mask);
+
+	while ( *link != i )
+		link = &(m->entries[*link].hnext);
+
+	*link = m->entries[i].hnext;
+	lru_unlink( m, i );
+	++m->evictions;
+	return i;
+}
+
+static void memo_add( memo_t *m, muse_int hash, muse_cell args, muse_cell value )
+{
+	int i = (m->count < m->capacity) ? m->count++ : memo_evict(m);
+	memo_entry_t *e = m->entries + i;
+	int *bucket = m->buckets + (hash & m->bucket_mask);
+
+	e->hash		= hash;
+	e->args		= args;
+	e->value	= value;
+	e->hnext	= *bucket;
+	*bucket		= i;
+	lru_push_front( m, i );
+}
+
+static muse_cell fn_memo_fn( muse_env *env, memo_t *m, muse_cell args )
+{
+	int sp = _spos();
+	muse_cell argv = muse_eval_list( env, args );
+	muse_int hash = memo_hash( env, argv );
+	int i = memo_find( env, m, hash, argv );
+	muse_cell value;
+
+	if ( i >= 0 )
+	{
+		++m->hits;
+		if ( i != m->head )
+		{
+			lru_unlink( m, i );
+			lru_push_front( m, i );
+		}
+		_unwind(sp);
+		return _spush( m->entries[i].value );
+	}
+
+	++m->misses;
+	value = _apply( m->fn, argv, MUSE_TRUE );
+
+	/* The function may have been called recursively with
+	the same arguments, leaving the result in place already. */
+	i = memo_find( env, m, hash, argv );
+	if ( i >= 0 )
+		m->entries[i].value = value;
+	else
+		memo_add( m, hash, argv, value );
+
+	_unwind(sp);
+	return _spush(value);
+}
+
+static muse_functional_object_type_t g_memo_type =
+{
+	'muSE',
+	'memo',
+	sizeof(memo_t),
+	(muse_nativefn_t)fn_memo_fn,
+	NULL,
+	memo_init,
+	memo_mark,
+	memo_destroy,
+	NULL
+};
+
+/**
+ * @code (memoize fn [capacity]) @endcode
+ *
+ * Gives a function that behaves like \p fn, except that it remembers
+ * the results of up to \p capacity calls by their arguments and doesn't
+ * call \p fn again for arguments it has a result for. \p capacity
+ * is 1024 if not given. When it is full, the result least recently
+ * asked for is forgotten to make room for a new one.
+ *
+ * Only memoize functions whose results depend only on their arguments
+ * and that have no side effects you rely on.
+ *
+ * @exception error:function-expected
+ * Handler format: @code (fn (resume 'error:function-expected value) ...) @endcode
+ * Raised when \p fn isn't a function.
+ *
+ * @exception error:positive-integer-expected
+ * Handler format: @code (fn (resume 'error:positive-integer-expected value) ...) @endcode
+ * Raised when \p capacity isn't an integer from 1 to 2^28.
+ *
+ * @see \ref fn_memoize_stats "memoize-stats", \ref fn_memoize_clear "memoize-clear"
+ */
+muse_cell fn_memoize( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell fn = _evalnext(&args);
+	muse_cell capacity = args ? _evalnext(&args) : _mk_int(MEMO_DEFAULT_CAPACITY);
+
+	if ( !_isfn(fn) )
+		return muse_raise_error( env, _csymbol(L"error:function-expected"), _cons(fn,MUSE_NIL) );
+
+	if ( _cellt(capacity) != MUSE_INT_CELL || _intvalue(capacity) <= 0 || _intvalue(capacity) > MEMO_MAX_CAPACITY )
+		return muse_raise_error( env, _csymbol(L"error:positive-integer-expected"), _cons(capacity,MUSE_NIL) );
+
+	return _mk_functional_object( &g_memo_type, _cons( fn, _cons( capacity, MUSE_NIL ) ) );
+}
+
+/**
+ * @code (memoize-stats memoized-fn) @endcode
+ *
+ * Evaluates to an object telling how well the memoized function's
+ * cache is doing. The properties are hits, misses, evictions,
+ * size and capacity. Evaluates to () if not given a memoized function.
+ */
+muse_cell fn_memoize_stats( muse_env *env, void *context, muse_cell args )
+{
+	memo_t *m = (memo_t*)_functional_object_data( _evalnext(&args), 'memo' );
+
+	if ( !m )
+		return MUSE_NIL;
+
+	return muse_put_many( env, fn_new( env, NULL, MUSE_NIL ),
+						  muse_list( env, "SISISISiSi",
+									 L"hits", m->hits,
+									 L"misses", m->misses,
+									 L"evictions", m->evictions,
+									 L"size", m->count,
+									 L"capacity", m->capacity ) );
+}
+
+/**
+ * @code (memoize-clear memoized-fn) @endcode
+ *
+ * Forgets all the results remembered by the memoized function
+ * and resets its counters. Evaluates to the memoized function.
+ */
+muse_cell fn_memoize_clear( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell mf = _evalnext(&args);
+	memo_t *m = (memo_t*)_functional_object_data( mf, 'memo' );
+
+	if ( m )
+	{
+		int capacity = m->capacity;
+		memo_destroy( env, m );
+		memo_alloc( m, capacity );
+		m->hits = m->misses = m->evictions = 0;
+	}
+
+	return mf;
+}
+
+static const struct memoize_fns_t { const muse_char *name; muse_nativefn_t fn; } g_memoize_fns[] =
+{
+	{	L"memoize",			fn_memoize			},
+	{	L"memoize-stats",	fn_memoize_stats	},
+	{	L"memoize-clear",	fn_memoize_clear	},
+	{	NULL,				NULL				}
+};
+
+void muse_define_builtin_type_memoize(muse_env *env)
+{
+	int sp = _spos();
+	const struct memoize_fns_t *fns = g_memoize_fns;
+	for ( ; fns->name; ++fns )
+	{
+		_define( _csymbol(fns->name), _mk_nativefn( fns->fn, NULL ) );
+		_unwind(sp);
+	}
+}
+
+/*@}*/
+/*@}*/
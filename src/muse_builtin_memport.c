@@ -12,8 +12,10 @@
  */
 
 #include "muse_port.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <stddef.h>
 
 /** @addtogroup FunctionalObjects */
 /*@{*/
@@ -30,11 +32,21 @@
  * all the regular I/O functions.
  */
 /*@{*/
+enum
+{
+	MEMPORT_CHUNK_SIZE = 16384	/**< The size of the chunks that hold a memport's data. */
+};
+
+/**
+ * The data of a memport is kept in a chain of chunks of the same size.
+ * Writes fill up the last chunk and add new ones as needed, so what has
+ * already been written is never moved.
+ */
 typedef struct _memchunk_t
 {
 	struct _memchunk_t *next;
 	size_t size;
-	unsigned char data[1];
+	unsigned char data[MEMPORT_CHUNK_SIZE];
 } memchunk_t;
 
 typedef struct
@@ -42,6 +54,7 @@ typedef struct
 	muse_port_base_t base;
 	memchunk_t *first, *last;
 	size_t read_offset;
+	memchunk_t *spare;	/**< A chunk that has been read, kept for the next write. */
 } memport_t;
 
 typedef struct
@@ -57,7 +70,7 @@ static void memport_init( muse_env *env, void *ptr, muse_cell args )
 
 	port_init( env, (muse_port_base_t*)p );
 	
-	p->first = p->last = NULL;
+	p->first = p->last = p->spare = NULL;
 	p->read_offset = 0;
 }
 
@@ -86,10 +99,43 @@ static void memport_close( void *ptr )
 		free(ch);		
 	}
 
-	p->first = p->last = NULL;
+	free( p->spare );
+	p->first = p->last = p->spare = NULL;
 	p->read_offset = 0;
 }
 
+static memchunk_t *new_chunk( memport_t *p )
+{
+	memchunk_t *ch = p->spare;
+
+	if ( ch )
+		p->spare = NULL;
+	else
+		ch = (memchunk_t*)malloc( sizeof(memchunk_t) );
+
+	ch->next = NULL;
+	ch->size = 0;
+	return ch;
+}
+
+/**
+ * Drops the first chunk once all of it has been read.
+ */
+static void drop_first_chunk( memport_t *p )
+{
+	memchunk_t *ch = p->first;
+
+	p->first = ch->next;
+	if ( p->first == NULL )
+		p->last = NULL;
+	p->read_offset = 0;
+
+	if ( p->spare )
+		free(ch);
+	else
+		p->spare = ch;
+}
+
 static size_t memport_read( void *buffer, size_t nbytes, void *port )
 {
 	memport_t *p = (memport_t*)port;
@@ -113,14 +159,7 @@ static size_t memport_read( void *buffer, size_t nbytes, void *port )
 		}
 
 		if ( p->read_offset >= p->first->size )
-		{
-			memchunk_t *ch = p->first;
-			p->first = ch->next;
-			free(ch);
-			if ( p->first == NULL )
-				p->last = NULL;
-			p->read_offset = 0;
-		}
+			drop_first_chunk(p);
 	}
 
 	return bytes_read;
@@ -128,28 +167,35 @@ static size_t memport_read( void *buffer, size_t nbytes, void *port )
 
 static size_t memport_write(void *buffer, size_t nbytes, void *port )
 {
-	if ( nbytes > 0 ) 
+	memport_t *p = (memport_t*)port;
+	const unsigned char *b = (const unsigned char *)buffer;
+	size_t written = 0;
+
+	while ( written < nbytes )
 	{
-		memport_t *p = (memport_t*)port;
-		
-		memchunk_t *ch = (memchunk_t*)malloc( sizeof(memchunk_t) + nbytes );
-		ch->next = NULL;
-		ch->size = nbytes;
-		memcpy( ch->data, buffer, nbytes );
+		size_t n;
 
-		if ( !(p->last) ) 
-			p->first = p->last = ch;
-		else
+		if ( !(p->last) )
+			p->first = p->last = new_chunk(p);
+		else if ( p->last->size == MEMPORT_CHUNK_SIZE )
 		{
-			p->last->next = ch;
-			p->last = ch;
+			p->last->next = new_chunk(p);
+			p->last = p->last->next;
 		}
 
-		p->base.eof = 0;
-		return nbytes;
+		n = MEMPORT_CHUNK_SIZE - p->last->size;
+		if ( n > nbytes - written )
+			n = nbytes - written;
+
+		memcpy( p->last->data + p->last->size, b + written, n );
+		p->last->size += n;
+		written += n;
 	}
 
-	return 0;
+	if ( nbytes > 0 )
+		p->base.eof = 0;
+
+	return nbytes;
 }
 
 static int memport_flush( void *port )
@@ -196,10 +242,218 @@ static memport_type_t g_memport_type =
 		memport_close,
 		memport_read,
 		memport_write,
-		memport_flush
+		memport_flush,
+		NULL
 	}
 };
 
+static memport_t *memport_data( muse_port_base_t *p )
+{
+	return (p && p->base.type_info == &g_memport_type.port.obj) ? (memport_t*)p : NULL;
+}
+
+muse_boolean is_memport( muse_port_base_t *p )
+{
+	return memport_data(p) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/**
+ * Fills in the runs of bytes waiting to be read from the memport, up to
+ * \p max of them, starting with any that the port has already buffered.
+ * Writes pending in the port's buffer are added first. Returns the number
+ * of runs, or -1 if the port isn't a memport.
+ */
+int memport_chunks( muse_port_base_t *port, muse_memport_chunk_t *chunks, int max )
+{
+	memport_t *p = memport_data(port);
+	memchunk_t *ch;
+	size_t offset;
+	int n = 0, avail = 0;
+
+	if ( !p )
+		return -1;
+
+	if ( port->out.avail > 0 )
+		port_flush(port);
+
+	if ( port->in.avail > 0 && n < max )
+	{
+		chunks[n].bytes = port_buffered( port, &avail );
+		chunks[n].size = (size_t)avail;
+		++n;
+	}
+
+	for ( ch = p->first, offset = p->read_offset; ch && n < max; ch = ch->next, offset = 0 )
+	{
+		chunks[n].bytes = ch->data + offset;
+		chunks[n].size = ch->size - offset;
+		++n;
+	}
+
+	return n;
+}
+
+/**
+ * Returns the number of bytes waiting to be read from the memport.
+ */
+size_t memport_size( muse_port_base_t *port )
+{
+	memport_t *p = memport_data(port);
+	memchunk_t *ch;
+	size_t size;
+
+	if ( !p )
+		return 0;
+
+	if ( port->out.avail > 0 )
+		port_flush(port);
+
+	size = (size_t)port->in.avail;
+	for ( ch = p->first; ch; ch = ch->next )
+		size += ch->size;
+
+	return size - p->read_offset;
+}
+
+/**
+ * Drops the first \p nbytes bytes waiting to be read from
+ * the memport, as though they'd been read.
+ */
+void memport_drop( muse_port_base_t *port, size_t nbytes )
+{
+	memport_t *p = memport_data(port);
+
+	if ( !p )
+		return;
+
+	if ( port->in.avail > 0 )
+	{
+		int n = nbytes < (size_t)port->in.avail ? (int)nbytes : port->in.avail;
+		port_consume( n, port );
+		nbytes -= n;
+	}
+
+	while ( p->first && nbytes > 0 )
+	{
+		size_t n = p->first->size - p->read_offset;
+
+		if ( n > nbytes )
+			n = nbytes;
+
+		p->read_offset += n;
+		nbytes -= n;
+
+		if ( p->read_offset >= p->first->size )
+			drop_first_chunk(p);
+	}
+}
+
+extern muse_cell mk_foreign_bytes( muse_env *env, unsigned char *bytes, muse_int size, void (*release)( unsigned char *bytes, muse_int size ) );
+
+static void release_chunk( unsigned char *bytes, muse_int size )
+{
+	free( bytes - offsetof(memchunk_t,data) );
+}
+
+/**
+ * Hands the first chunk over to a bytes object, 
+ * which frees it once it is no longer in use.
+ */
+static muse_cell take_first_chunk( muse_env *env, memport_t *p )
+{
+	memchunk_t *ch = p->first;
+
+	if ( p->read_offset > 0 )
+	{
+		ch->size -= p->read_offset;
+		memmove( ch->data, ch->data + p->read_offset, ch->size );
+		p->read_offset = 0;
+	}
+
+	p->first = ch->next;
+	if ( p->first == NULL )
+		p->last = NULL;
+
+	return mk_foreign_bytes( env, ch->data, (muse_int)ch->size, release_chunk );
+}
+
+/**
+ * @code (memport-bytes memport ['flat]) @endcode
+ *
+ * Takes all the data waiting to be read from the memport, leaving it
+ * empty, and evaluates to a list of bytes objects that hold it. The bytes
+ * objects use the memory that the memport kept the data in, so nothing
+ * is copied. If you pass @code 'flat @endcode, you get a single bytes
+ * object with all of the data instead, which is copied unless it was
+ * all in one piece. Evaluates to () if the memport has no data.
+ */
+muse_cell fn_memport_bytes( muse_env *env, void *context, muse_cell args )
+{
+	muse_port_t port = _port( _evalnext(&args) );
+	memport_t *p = memport_data(port);
+	muse_boolean flat = (args && _evalnext(&args) == _csymbol(L"flat")) ? MUSE_TRUE : MUSE_FALSE;
+	muse_cell head = MUSE_NIL, tail = MUSE_NIL;
+	int sp = _spos();
+
+	if ( !p )
+		return MUSE_NIL;
+
+	if ( port->out.avail > 0 )
+		port_flush(port);
+
+	if ( flat && (port->in.avail > 0 || (p->first && p->first->next)) )
+	{
+		/* The pieces have to be put together in a new bytes object. */
+		size_t size = memport_size(port);
+		muse_cell result = muse_mk_bytes( env, size );
+		unsigned char *b = (unsigned char*)muse_bytes_data( env, result, 0 );
+		muse_memport_chunk_t chunks[16];
+		int n, i;
+
+		while ( (n = memport_chunks( port, chunks, 16 )) > 0 )
+		{
+			size_t taken = 0;
+
+			for ( i = 0; i < n; ++i )
+			{
+				memcpy( b, chunks[i].bytes, chunks[i].size );
+				b += chunks[i].size;
+				taken += chunks[i].size;
+			}
+
+			memport_drop( port, taken );
+		}
+
+		return result;
+	}
+
+	if ( port->in.avail > 0 )
+	{
+		/* What the port has buffered is copied. */
+		int avail = 0;
+		const unsigned char *buffered = port_buffered( port, &avail );
+		head = tail = _cons( muse_mk_bytes( env, avail ), MUSE_NIL );
+		memcpy( muse_bytes_data( env, _head(head), 0 ), buffered, avail );
+		port_consume( avail, port );
+	}
+
+	while ( p->first )
+	{
+		muse_cell b = _cons( take_first_chunk( env, p ), MUSE_NIL );
+
+		if ( tail )
+			_sett( tail, b );
+		else
+			head = b;
+
+		tail = b;
+		_unwind(sp);
+		_spush(head);
+	}
+
+	return (flat && head) ? _head(head) : head;
+}
+
 MUSEAPI muse_port_t muse_create_memport( muse_env *env )
 {
 	return (muse_port_t)muse_create_and_init_object( env, (muse_functional_object_type_t*)&g_memport_type, MUSE_NIL );
@@ -228,11 +482,277 @@ muse_cell fn_memport( muse_env *env, void *context, muse_cell args )
 	return _mk_functional_object( (muse_functional_object_type_t*)&g_memport_type, args );
 }
 
+/** @name String builders */
+/*@{*/
+
+/**
+ * A string builder is a port that keeps what's written to it as UTF-8
+ * in one growable block of memory, which doubles in size as needed so 
+ * that appending is cheap however big the string gets.
+ */
+typedef struct
+{
+	muse_port_base_t base;
+	unsigned char *bytes;
+	size_t size, capacity;
+} strbuilder_t;
+
+typedef struct
+{
+	muse_port_type_t port;
+} strbuilder_type_t;
+
+static unsigned char *strbuilder_reserve( strbuilder_t *b, size_t nbytes )
+{
+	if ( b->size + nbytes > b->capacity )
+	{
+		size_t capacity = b->capacity ? 2 * b->capacity : 256;
+		while ( capacity < b->size + nbytes )
+			capacity *= 2;
+		b->bytes = (unsigned char*)realloc( b->bytes, capacity );
+		b->capacity = capacity;
+	}
+
+	return b->bytes + b->size;
+}
+
+static size_t strbuilder_write( void *buffer, size_t nbytes, void *port )
+{
+	strbuilder_t *b = (strbuilder_t*)port;
+	memcpy( strbuilder_reserve( b, nbytes ), buffer, nbytes );
+	b->size += nbytes;
+	return nbytes;
+}
+
+static int strbuilder_flush( void *port )
+{
+	return 0;
+}
+
+static void strbuilder_close( void *port )
+{
+	strbuilder_t *b = (strbuilder_t*)port;
+	free( b->bytes );
+	b->bytes = NULL;
+	b->size = b->capacity = 0;
+}
+
+static muse_cell fn_strbuilder_fn( muse_env *env, strbuilder_t *b, muse_cell args );
+
+static void strbuilder_init( muse_env *env, void *ptr, muse_cell args )
+{
+	strbuilder_t *b = (strbuilder_t*)ptr;
+
+	b->base.mode |= MUSE_PORT_WRITE;
+	port_init( env, (muse_port_base_t*)b );
+
+	b->bytes = NULL;
+	b->size = b->capacity = 0;
+
+	if ( args )
+		fn_strbuilder_fn( env, b, args );
+}
+
+static void strbuilder_destroy( muse_env *env, void *ptr )
+{
+	strbuilder_close( ptr );
+	port_destroy( (muse_port_base_t*)ptr );
+}
+
+/**
+ * Printing a string builder to a port writes out the string it holds
+ * without making a text object of it first.
+ */
+static void strbuilder_dump( muse_env *env, void *obj, void *port )
+{
+	strbuilder_t *b = (strbuilder_t*)obj;
+	muse_port_t p = (muse_port_t)port;
+
+	if ( b->base.out.avail > 0 )
+		port_flush( (muse_port_base_t*)b );
+
+	port_write( b->bytes, b->size, p );
+	pretty_printer_move( p, (int)b->size );
+}
+
+static muse_cell strbuilder_format( muse_env *env, void *obj )
+{
+	strbuilder_t *b = (strbuilder_t*)obj;
+
+	if ( b->base.out.avail > 0 )
+		port_flush( (muse_port_base_t*)b );
+
+	return muse_mk_text_utf8( env, (const char*)b->bytes, (const char*)(b->bytes + b->size) );
+}
+
+static muse_format_view_t g_strbuilder_format_view =
+{
+	strbuilder_format
+};
+
+static void *strbuilder_view( muse_env *env, int id )
+{
+	switch ( id ) {
+		case 'frmt' : return &g_strbuilder_format_view;
+		default		: return NULL;
+	}
+}
+
+static strbuilder_type_t g_strbuilder_type =
+{
+	{
+		{
+			'muSE',
+			'port',
+			sizeof(strbuilder_t),
+			(muse_nativefn_t)fn_strbuilder_fn,
+			strbuilder_view,
+			strbuilder_init,
+			NULL,
+			strbuilder_destroy,
+			strbuilder_dump
+		},
+
+		strbuilder_close,
+		NULL,
+		strbuilder_write,
+		strbuilder_flush,
+		NULL
+	}
+};
+
+/**
+ * Appends a value the way \ref fn_format "format" would convert it. 
+ * Values that format has no string for, such as lists, are written out
+ * as with \ref fn_write "write".
+ */
+static void strbuilder_append( muse_env *env, strbuilder_t *b, muse_cell value )
+{
+	muse_port_t p = (muse_port_t)b;
+
+	switch ( _cellt(value) )
+	{
+	case MUSE_TEXT_CELL :
+		{
+			int length = 0;
+			const muse_char *text = muse_text_contents( env, value, &length );
+			size_t size = muse_utf8_size( text, length );
+
+			/* Text goes straight into the block, after anything still
+			in the port's output buffer. */
+			if ( p->out.avail > 0 )
+				port_flush(p);
+
+			b->size += muse_unicode_to_utf8( (char*)strbuilder_reserve( b, size + 1 ), size + 1, text, length );
+			pretty_printer_move( p, length );
+		}
+		return;
+	case MUSE_INT_CELL :
+		{
+			char buffer[64];
+			port_write( buffer, sprintf( buffer, MUSE_FMT_INT, _intvalue(value) ), p );
+		}
+		return;
+	case MUSE_FLOAT_CELL :
+		{
+			char buffer[64];
+			port_write( buffer, sprintf( buffer, MUSE_FMT_FLOAT, _floatvalue(value) ), p );
+		}
+		return;
+	case MUSE_SYMBOL_CELL :
+		if ( value )
+		{
+			strbuilder_append( env, b, _symname(value) );
+			return;
+		}
+		break;
+	case MUSE_NATIVEFN_CELL :
+		{
+			muse_functional_object_t *f = NULL;
+			muse_format_view_t *fv = _fnobjview( value, 'frmt', f );
+			if ( fv && f != (muse_functional_object_t*)b )
+			{
+				int sp = _spos();
+				strbuilder_append( env, b, fv->format( env, f ) );
+				_unwind(sp);
+				return;
+			}
+		}
+		break;
+	default :
+		break;
+	}
+
+	if ( value )
+		muse_pwrite( p, value );
+}
+
+/**
+ * The function that implements string builder access.
+ */
+static muse_cell fn_strbuilder_fn( muse_env *env, strbuilder_t *b, muse_cell args )
+{
+	if ( args )
+	{
+		while ( args )
+		{
+			int sp = _spos();
+			strbuilder_append( env, b, _evalnext(&args) );
+			_unwind(sp);
+		}
+
+		return b->base.base.self;
+	}
+	else
+	{
+		return strbuilder_format( env, b );
+	}
+}
+
+/**
+ * @code (string-builder ...args...) @endcode
+ *
+ * Creates a string builder, for putting a big string together a piece
+ * at a time. The builder keeps what's added to it in a block of memory 
+ * that grows by doubling, so building a string of n characters takes
+ * time proportional to n, unlike repeated \ref fn_format "format"s, 
+ * which copy the whole string each time. The args are added as with
+ * the builder's function form described below.
+ *
+ * If sb is a string builder -
+ *	- @code (sb ...args...) @endcode adds the args to it and gives sb.
+ *	  Strings, numbers, symbols and objects that format can convert are
+ *	  added as format would convert them. Anything else, such as a list,
+ *	  is added as \ref fn_write "write" would write it.
+ *	- @code (sb) @endcode gives the string built so far. The builder can
+ *	  be added to after that.
+ *
+ * A string builder is also an output port, so you can \ref fn_print "print",
+ * \ref fn_write "write", \ref fn_write_json "write-json" and so on to it,
+ * pretty printed if pretty printing is on. Printing a builder to another port
+ * writes out its string directly, as does using it as an argument to format.
+ *
+ * @code
+ * > (define sb (string-builder "Squares: "))
+ * > (for-each '(1 2 3) (fn (i) (sb (* i i) " ")))
+ * > (sb)
+ * "Squares: 1 4 9 "
+ * @endcode
+ */
+muse_cell fn_string_builder( muse_env *env, void *context, muse_cell args )
+{
+	return _mk_functional_object( (muse_functional_object_type_t*)&g_strbuilder_type, args );
+}
+
+/*@}*/
+
 void muse_define_builtin_memport(muse_env *env)
 {	
 	/* Define the "open-file" function. This is the only file specific function needed.
 	After this the generic port functions take over. */
 	_define( _csymbol(L"memport"), _mk_nativefn( fn_memport, NULL ) );
+	_define( _csymbol(L"memport-bytes"), _mk_nativefn( fn_memport_bytes, NULL ) );
+	_define( _csymbol(L"string-builder"), _mk_nativefn( fn_string_builder, NULL ) );
 }
 /*@}*/
 /*@}*/
\ No newline at end of file
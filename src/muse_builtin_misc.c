@@ -158,7 +158,7 @@ static int directory_listing( const char *filespec, long filter, char **result[]
 	if ( glob(filespec, GLOB_MARK, NULL, &globbuf) == 0 )
 	{
 		size_t i = 0;
-		for ( i = 0; i < globbuf.gl_matchc; ++i )
+		for ( i = 0; i < globbuf.gl_pathc; ++i )
 		{
 			char *name = globbuf.gl_pathv[i];
 			
@@ -543,10 +543,16 @@ static muse_cell whatis_0( muse_env *env, muse_cell thing )
 					switch ( fobj->type_info->type_word ) {
 						case 'mobj' : return _csymbol(L"object");
 						case 'vect' : return _csymbol(L"vector");
+						case 'vecv' : return _csymbol(L"vector-view");
 						case 'hash' : return _csymbol(L"hashtable");
+						case 'pmap' : return _csymbol(L"pmap");
+						case 'f64v' : return _csymbol(L"f64vector");
+						case 'i64v' : return _csymbol(L"i64vector");
 						case 'boxx' : return _csymbol(L"box");
 						case 'barr' : return _csymbol(L"bytes");
 						case 'mmod' : return _csymbol(L"module");
+						case 'memo' : return _csymbol(L"fn");
+						case 'hshr' : return _csymbol(L"hasher");
 						default		: return MUSE_NIL;
 					}
 				} else {
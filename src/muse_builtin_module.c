@@ -141,8 +141,9 @@ static void module_init( muse_env *env, void *ptr, muse_cell args )
 		 macros as well. */
 		muse_port_t p = muse_current_port( env, MUSE_INPUT_PORT, NULL );
 		int sp = _spos();
-		while ( !port_eof(p) ) {
-			_eval(muse_pread(p));
+		muse_cell expr;
+		while ( (expr = muse_read_source(p)) >= 0 ) {
+			_eval(expr);
 			_unwind(sp);
 		}
 	}
@@ -250,8 +251,9 @@ static muse_cell module_augment( muse_env *env, module_t *m, muse_cell args )
 		 macros as well. */
 		muse_port_t p = muse_current_port( env, MUSE_INPUT_PORT, NULL );
 		int sp = _spos();
-		while ( !port_eof(p) ) {
-			_eval(muse_pread(p));
+		muse_cell expr;
+		while ( (expr = muse_read_source(p)) >= 0 ) {
+			_eval(expr);
 			_unwind(sp);
 		}
 	}
@@ -468,6 +470,65 @@ static muse_functional_object_type_t g_module_type =
 	module_write
 };
 
+/**
+ * Returns the main function of the module followed by an alist
+ * of its exported symbols and their values, as a new list. The
+ * main function is () if the module didn't define one.
+ */
+muse_cell module_contents( muse_env *env, muse_cell mod )
+{
+	module_t *m = (module_t*)muse_functional_object_data( env, mod, 'mmod' );
+	int sp = _spos();
+	muse_boolean has_main = (_cellt(m->main) != MUSE_NATIVEFN_CELL || _ptr(m->main)->fn.fn != syntax_do) ? MUSE_TRUE : MUSE_FALSE;
+	muse_cell h = _cons( has_main ? m->main : MUSE_NIL, MUSE_NIL ), t = h;
+	int i;
+
+	for ( i = 0; i < m->length; ++i )
+	{
+		muse_cell c = _cons( _cons( m->bindings[i].name, m->bindings[i].value ), MUSE_NIL );
+		_sett( t, c );
+		t = c;
+		_unwind(sp);
+		_spush(h);
+	}
+
+	return h;
+}
+
+/**
+ * Makes an empty module to be given its contents
+ * by module_assign(), as when restoring a snapshot.
+ */
+muse_cell mk_module( muse_env *env )
+{
+	/* An anonymous module with no exports and a body of (). */
+	return muse_mk_functional_object( env, &g_module_type, _cons( MUSE_NIL, _cons( MUSE_NIL, MUSE_NIL ) ) );
+}
+
+/**
+ * Replaces the contents of the module with what
+ * module_contents() gave for another module.
+ */
+void module_assign( muse_env *env, muse_cell mod, muse_cell contents )
+{
+	module_t *m = (module_t*)muse_functional_object_data( env, mod, 'mmod' );
+	muse_cell alist = _tail(contents);
+	int i;
+
+	free( m->bindings );
+	if ( _head(contents) )
+		m->main = _head(contents);
+	m->length = muse_list_length( env, alist );
+	m->bindings = (module_binding_t*)calloc( m->length + 1, sizeof(module_binding_t) );
+
+	for ( i = 0; i < m->length; ++i )
+	{
+		muse_cell kv = _next(&alist);
+		m->bindings[i].name = _head(kv);
+		m->bindings[i].value = _tail(kv);
+	}
+}
+
 /**
  * @code (module MyMod (exportA exportB ...) ...body... ) @endcode
  *
@@ -774,6 +835,9 @@ static muse_cell require_modules( muse_env *env, void *context, int i, muse_bool
  * doesn't exist, it will fetch and load 
  *  "http://muvee-symbolic-expressions.googlecode.com/svn/trunk/lib/ModuleSymbol.scm"
  * 
+ * Modules loaded from files are parsed only once if \c *module-cache*
+ * is set. See \ref fn_load "load".
+ *
  * Can raise fetch-uri and load related exceptions.
  *
  * @exception error:invalid-module-reference
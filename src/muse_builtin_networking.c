@@ -9,6 +9,9 @@
  * for terms and conditions under which this software is provided to you.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#	define _GNU_SOURCE /* For recvmmsg() and sendmmsg(). */
+#endif
 
 #include "muse_opcodes.h"
 #include "muse_port.h"
@@ -16,6 +19,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <wctype.h>
 
 /** @addtogroup Networking */
 /*@{*/
@@ -27,6 +31,9 @@ muse_cell fn_wait_for_input( muse_env *env, void *context, muse_cell args );
 muse_cell fn_multicast_group( muse_env *env, void *context, muse_cell args );
 muse_cell fn_reply( muse_env *env, void *context, muse_cell args );
 muse_cell fn_multicast_group_p( muse_env *env, void *context, muse_cell args );
+muse_cell fn_multicast_receive( muse_env *env, void *context, muse_cell args );
+muse_cell fn_multicast_send( muse_env *env, void *context, muse_cell args );
+muse_cell fn_send_file( muse_env *env, void *context, muse_cell args );
 /*@}*/
 
 #ifndef MUSE_PLATFORM_WINDOWS
@@ -39,6 +46,7 @@ muse_cell fn_multicast_group_p( muse_env *env, void *context, muse_cell args );
 #	else
 #		include <sys/ioctl.h>
 #	endif
+#	include <sys/stat.h>
 #	include <netdb.h>
 #	include <netinet/in.h>
 #	include <arpa/inet.h>
@@ -146,65 +154,614 @@ library! What a stupid thing to have to do! */
 	}
 #endif
 
-typedef struct _muse_net_t
+/**
+ * @name Readiness
+ *
+ * A process that finds a socket unready to read or write is parked -
+ * it stops running - until the socket becomes ready. The environment
+ * keeps a table of the sockets its processes are parked on and learns of
+ * their readiness from epoll on Linux and kqueue on BSD and MacOSX, or from
+ * select() elsewhere. The scheduler asks for any news in between running
+ * processes, and when no process can run it waits for the network together
+ * with the timers and other environments. So an idle server takes no CPU
+ * and a socket that is not ready costs nothing however many there are.
+ */
+/*@{*/
+
+#ifndef MUSE_PLATFORM_WINDOWS
+#	if defined(__linux__)
+#		define MUSE_NET_EPOLL 1
+#		include <sys/epoll.h>
+#	elif defined(MUSE_PLATFORM_BSD)
+#		define MUSE_NET_KQUEUE 1
+#		include <sys/event.h>
+#	endif
+#	include <errno.h>
+#	include <sys/select.h>
+#	define MUSE_SOCKET_WOULD_BLOCK()	(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)
+#else
+#	define MUSE_SOCKET_WOULD_BLOCK()	(WSAGetLastError() == WSAEWOULDBLOCK)
+#endif
+
+enum
 {
-	fd_set fdsets[3]; // 0 = read, 1 = write, 2 = except
-	int reductions;
-} muse_net_t;
+	MUSE_NET_READ,
+	MUSE_NET_WRITE,
+	MUSE_NET_POLL_INTERVAL_US	= 500,	/**< How often to look for ready sockets while processes are ready to run. */
+	MUSE_NET_MAX_EVENTS			= 64
+};
+
+/**
+ * A process parked on a socket. It lives on the C stack of the
+ * parked process.
+ */
+typedef struct _net_waiter_t
+{
+	struct _net_waiter_t	*next;
+	muse_process_frame_t	*process;
+	SOCKET					s;
+	int						cat;	/**< MUSE_NET_READ or MUSE_NET_WRITE. */
+	muse_boolean			ready;	/**< Set when the socket becomes ready, or is closed. */
+} net_waiter_t;
 
+/**
+ * The processes parked on one socket.
+ */
+typedef struct
+{
+	muse_boolean	used;
+	SOCKET			s;
+	net_waiter_t	*waiters[2];	/**< Indexed by MUSE_NET_READ and MUSE_NET_WRITE. */
+} net_watch_t;
 
-static void prepare_for_network_poll( muse_env *env, SOCKET s, int cat )
+typedef struct _muse_net_t
 {
-	FD_CLR( s, &(env->net->fdsets[cat]) );
-	FD_CLR( s, &(env->net->fdsets[2]) );
-}
+	int				capacity;	/**< Of the watches - an open addressing map from sockets. A power of two, or 0. */
+	int				count;
+	net_watch_t		*watches;
+	int				poller;		/**< The epoll or kqueue descriptor, or -1 if select() is used. */
+	int				wake_fd;	/**< The worker wakeup descriptor added to the poller, or -1. */
+	muse_int		last_poll_us;
+	struct _http_conn_t *idle_conns;	/**< The connections that fetch-uri keeps for reuse, most recently used first. */
+	int				num_idle_conns;
+} muse_net_t;
 
 typedef enum 
 {
 	POLL_SOCKET_FAILED,
 	POLL_SOCKET_ERROR,
-	POLL_SOCKET_SET
+	POLL_SOCKET_SET,
+	POLL_SOCKET_TIMEOUT
 } poll_socket_status_t;
 
-static poll_socket_status_t poll_network( muse_env *env, SOCKET s, int cat )
+static int watch_slot( SOCKET s, int capacity )
+{
+	return (int)(((unsigned int)s * 2654435761u) & (unsigned int)(capacity - 1));
+}
+
+static net_watch_t *find_watch( muse_net_t *net, SOCKET s )
+{
+	int i;
+
+	if ( net->count == 0 )
+		return NULL;
+
+	for ( i = watch_slot( s, net->capacity ); net->watches[i].used; i = (i + 1) & (net->capacity - 1) )
+	{
+		if ( net->watches[i].s == s )
+			return net->watches + i;
+	}
+
+	return NULL;
+}
+
+static net_watch_t *add_watch( muse_net_t *net, SOCKET s )
 {
-	while ( !FD_ISSET(s, &(env->net->fdsets[cat])) )
+	int i;
+
+	if ( (net->count + 1) * 2 > net->capacity )
 	{
-		FD_SET(s, &(env->net->fdsets[cat]) );
-		FD_SET(s, &(env->net->fdsets[2]) );
+		muse_net_t old = *net;
 
+		net->capacity	= old.capacity ? 2 * old.capacity : 16;
+		net->count		= 0;
+		net->watches	= (net_watch_t*)calloc( net->capacity, sizeof(net_watch_t) );
+
+		for ( i = 0; i < old.capacity; ++i )
 		{
-			int current_reductions = env->net->reductions;
-			procrastinate(env);
+			if ( old.watches[i].used )
+				*add_watch( net, old.watches[i].s ) = old.watches[i];
+		}
 
-			if ( env->net->reductions == current_reductions )
-			{
-				/* We have to do the reduction. */
-				static const struct timeval g_tv = {0,500};
-				int nfds = select( FD_SETSIZE, &(env->net->fdsets[0]), &(env->net->fdsets[1]), &(env->net->fdsets[2]), (struct timeval *)&g_tv );
-				env->net->reductions++;
+		free( old.watches );
+	}
+
+	for ( i = watch_slot( s, net->capacity ); net->watches[i].used; i = (i + 1) & (net->capacity - 1) )
+		;
+
+	net->watches[i].used = MUSE_TRUE;
+	net->watches[i].s = s;
+	net->count++;
+	return net->watches + i;
+}
+
+/**
+ * Removes the watch, moving back the ones after it that would
+ * otherwise no longer be found.
+ */
+static void remove_watch( muse_net_t *net, net_watch_t *watch )
+{
+	int mask = net->capacity - 1;
+	int i = (int)(watch - net->watches);
+	int j = i;
+
+	net->watches[i].used = MUSE_FALSE;
+	net->count--;
+
+	for ( ;; )
+	{
+		int k;
+
+		j = (j + 1) & mask;
+		if ( !net->watches[j].used )
+			break;
+
+		k = watch_slot( net->watches[j].s, net->capacity );
+		if ( (i <= j) ? (i < k && k <= j) : (i < k || k <= j) )
+			continue;
+
+		net->watches[i] = net->watches[j];
+		net->watches[j].used = MUSE_FALSE;
+		i = j;
+	}
+}
+
+/**
+ * Creates the epoll or kqueue descriptor when the first socket is
+ * watched. If there is none, select() is used instead.
+ */
+static void open_poller( muse_net_t *net )
+{
+#if MUSE_NET_EPOLL
+	if ( net->poller < 0 )
+		net->poller = epoll_create( MUSE_NET_MAX_EVENTS );
+#elif MUSE_NET_KQUEUE
+	if ( net->poller < 0 )
+		net->poller = kqueue();
+#endif
+}
+
+/**
+ * Tells the poller which of reading and writing the watch's processes
+ * are waiting for. Both epoll and kqueue report a socket once per arming.
+ */
+static void arm_watch( muse_net_t *net, net_watch_t *watch, int cat )
+{
+	open_poller( net );
+
+#if MUSE_NET_EPOLL
+	if ( net->poller >= 0 )
+	{
+		struct epoll_event ev;
+		ev.events	= (watch->waiters[MUSE_NET_READ] ? EPOLLIN : 0) | (watch->waiters[MUSE_NET_WRITE] ? EPOLLOUT : 0) | EPOLLONESHOT;
+		ev.data.fd	= watch->s;
+
+		if ( epoll_ctl( net->poller, EPOLL_CTL_MOD, watch->s, &ev ) != 0 && errno == ENOENT )
+			epoll_ctl( net->poller, EPOLL_CTL_ADD, watch->s, &ev );
+	}
+#elif MUSE_NET_KQUEUE
+	if ( net->poller >= 0 )
+	{
+		struct kevent kev;
+		EV_SET( &kev, watch->s, cat == MUSE_NET_READ ? EVFILT_READ : EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, NULL );
+		kevent( net->poller, &kev, 1, NULL, 0, NULL );
+	}
+#endif
+}
+
+static void wake_waiters( muse_env *env, net_waiter_t *w )
+{
+	for ( ; w; w = w->next )
+	{
+		w->ready = MUSE_TRUE;
+		if ( w->process->state_bits & MUSE_PROCESS_WAITING )
+			wake_process( env, w->process );
+	}
+}
+
+/**
+ * Wakes the processes parked on the socket for the ready directions,
+ * as a bit mask of (1 << MUSE_NET_READ) and (1 << MUSE_NET_WRITE).
+ */
+static void socket_ready( muse_env *env, SOCKET s, int ready )
+{
+	muse_net_t *net = env->net;
+	net_watch_t *watch = find_watch( net, s );
+	int cat;
+
+	if ( !watch )
+		return;
+
+	for ( cat = MUSE_NET_READ; cat <= MUSE_NET_WRITE; ++cat )
+	{
+		if ( (ready & (1 << cat)) && watch->waiters[cat] )
+		{
+			net_waiter_t *w = watch->waiters[cat];
+			watch->waiters[cat] = NULL;
+			wake_waiters( env, w );
+		}
+	}
+
+	if ( !watch->waiters[MUSE_NET_READ] && !watch->waiters[MUSE_NET_WRITE] )
+		remove_watch( net, watch );
+#if MUSE_NET_EPOLL
+	else
+		arm_watch( net, watch, -1 );
+#endif
+}
+
+static void watch_socket( muse_env *env, net_waiter_t *w )
+{
+	muse_net_t *net = env->net;
+	net_watch_t *watch = find_watch( net, w->s );
+
+	if ( !watch )
+		watch = add_watch( net, w->s );
+
+	w->next = watch->waiters[w->cat];
+	watch->waiters[w->cat] = w;
+	arm_watch( net, watch, w->cat );
+}
+
+static void unwatch_socket( muse_env *env, net_waiter_t *w )
+{
+	muse_net_t *net = env->net;
+	net_watch_t *watch = find_watch( net, w->s );
+	net_waiter_t **pw;
+
+	if ( !watch )
+		return;
+
+	for ( pw = &watch->waiters[w->cat]; *pw; pw = &(*pw)->next )
+	{
+		if ( *pw == w )
+		{
+			*pw = w->next;
+			break;
+		}
+	}
+
+	/* A poller that is still armed for the socket reports it once 
+	more, which is ignored or at worst wakes a process to try again. */
+	if ( !watch->waiters[MUSE_NET_READ] && !watch->waiters[MUSE_NET_WRITE] )
+		remove_watch( net, watch );
+}
+
+/**
+ * Wakes any processes parked on a socket that is being closed,
+ * so that they find out when they try to use it.
+ */
+static void forget_socket( muse_env *env, SOCKET s )
+{
+	if ( env->net )
+		socket_ready( env, s, (1 << MUSE_NET_READ) | (1 << MUSE_NET_WRITE) );
+}
+
+static void set_wait_time( struct timeval *tv, muse_int wait_us )
+{
+#ifdef MUSE_PLATFORM_WINDOWS
+	tv->tv_sec = (long)(wait_us / 1000000);
+	tv->tv_usec = (long)(wait_us % 1000000);
+#else
+	tv->tv_sec = (time_t)(wait_us / 1000000);
+	tv->tv_usec = (suseconds_t)(wait_us % 1000000);
+#endif
+}
+
+/**
+ * Waits with select() for up to \p wait_us for any socket in the 
+ * watch table, or for \p wake_fd if it is not -1.
+ */
+static void select_sockets( muse_env *env, muse_int wait_us, int wake_fd )
+{
+	muse_net_t *net = env->net;
+	fd_set fds[3];
+	struct timeval tv;
+	SOCKET max_s = 0;
+	int i, n;
+
+	FD_ZERO( &fds[0] );
+	FD_ZERO( &fds[1] );
+	FD_ZERO( &fds[2] );
+
+	for ( i = 0; i < net->capacity; ++i )
+	{
+		net_watch_t *watch = net->watches + i;
+		if ( watch->used )
+		{
+			if ( watch->waiters[MUSE_NET_READ] )
+				FD_SET( watch->s, &fds[0] );
+			if ( watch->waiters[MUSE_NET_WRITE] )
+				FD_SET( watch->s, &fds[1] );
+			FD_SET( watch->s, &fds[2] );
+			if ( watch->s > max_s )
+				max_s = watch->s;
+		}
+	}
+
+	if ( wake_fd >= 0 )
+	{
+		FD_SET( (SOCKET)wake_fd, &fds[0] );
+		if ( (SOCKET)wake_fd > max_s )
+			max_s = (SOCKET)wake_fd;
+	}
+
+	set_wait_time( &tv, wait_us );
+	n = select( (int)(max_s + 1), &fds[0], &fds[1], &fds[2], wait_us < 0 ? NULL : &tv );
 
-				if ( nfds == SOCKET_ERROR )
+	if ( n <= 0 )
+		return;
+
+	/* Waking processes changes the table, so the 
+	ready sockets are found first. */
+	{
+		struct { SOCKET s; int how; } *ready = malloc( net->count * sizeof(*ready) );
+		int num_ready = 0;
+
+		for ( i = 0; i < net->capacity; ++i )
+		{
+			net_watch_t *watch = net->watches + i;
+			if ( watch->used )
+			{
+				int r = (FD_ISSET( watch->s, &fds[0] ) ? (1 << MUSE_NET_READ) : 0)
+					  | (FD_ISSET( watch->s, &fds[1] ) ? (1 << MUSE_NET_WRITE) : 0)
+					  | (FD_ISSET( watch->s, &fds[2] ) ? (1 << MUSE_NET_READ) | (1 << MUSE_NET_WRITE) : 0);
+				if ( r )
 				{
-					FD_ZERO( &(env->net->fdsets[0]) );
-					FD_ZERO( &(env->net->fdsets[1]) );
-					FD_ZERO( &(env->net->fdsets[2]) );
-					return POLL_SOCKET_FAILED;
+					ready[num_ready].s = watch->s;
+					ready[num_ready++].how = r;
 				}
 			}
-			else
-			{
-				/* Reduction was done by another polling process. */
-			}
+		}
+
+		for ( i = 0; i < num_ready; ++i )
+			socket_ready( env, ready[i].s, ready[i].how );
+
+		free( ready );
+	}
+}
+
+/**
+ * Waits for up to \p wait_us, or indefinitely if it is negative, for
+ * the parked sockets and for \p wake_fd, and wakes the processes whose 
+ * sockets are ready.
+ */
+static void poll_sockets( muse_env *env, muse_int wait_us, int wake_fd )
+{
+	muse_net_t *net = env->net;
+
+#if MUSE_NET_EPOLL
+	if ( net->poller >= 0 )
+	{
+		struct epoll_event events[MUSE_NET_MAX_EVENTS];
+		int i, n;
+
+		if ( wake_fd >= 0 && wake_fd != net->wake_fd )
+		{
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.fd = wake_fd;
+			epoll_ctl( net->poller, EPOLL_CTL_ADD, wake_fd, &ev );
+			net->wake_fd = wake_fd;
+		}
+
+		n = epoll_wait( net->poller, events, MUSE_NET_MAX_EVENTS, wait_us < 0 ? -1 : (int)((wait_us + 999) / 1000) );
+
+		for ( i = 0; i < n; ++i )
+		{
+			int e = events[i].events;
+
+			if ( events[i].data.fd == net->wake_fd )
+				continue;
+
+			socket_ready( env, events[i].data.fd, 
+						  ((e & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? (1 << MUSE_NET_READ) : 0) |
+						  ((e & (EPOLLOUT | EPOLLERR | EPOLLHUP)) ? (1 << MUSE_NET_WRITE) : 0) );
+		}
+		return;
+	}
+#elif MUSE_NET_KQUEUE
+	if ( net->poller >= 0 )
+	{
+		struct kevent events[MUSE_NET_MAX_EVENTS];
+		struct timespec ts;
+		int i, n;
+
+		if ( wake_fd >= 0 && wake_fd != net->wake_fd )
+		{
+			struct kevent kev;
+			EV_SET( &kev, wake_fd, EVFILT_READ, EV_ADD, 0, 0, NULL );
+			kevent( net->poller, &kev, 1, NULL, 0, NULL );
+			net->wake_fd = wake_fd;
+		}
+
+		ts.tv_sec = (time_t)(wait_us / 1000000);
+		ts.tv_nsec = (long)((wait_us % 1000000) * 1000);
+		n = kevent( net->poller, NULL, 0, events, MUSE_NET_MAX_EVENTS, wait_us < 0 ? NULL : &ts );
+
+		for ( i = 0; i < n; ++i )
+		{
+			if ( (int)events[i].ident == net->wake_fd )
+				continue;
 
-			if ( FD_ISSET( s, &(env->net->fdsets[2]) ) )
-				return POLL_SOCKET_ERROR;
+			socket_ready( env, (SOCKET)events[i].ident, 
+						  (events[i].flags & EV_EOF) ? (1 << MUSE_NET_READ) | (1 << MUSE_NET_WRITE) :
+						  (events[i].filter == EVFILT_READ) ? (1 << MUSE_NET_READ) : (1 << MUSE_NET_WRITE) );
 		}
+		return;
+	}
+#endif
+
+	select_sockets( env, wait_us, wake_fd );
+}
+
+/**
+ * Waits for up to \p wait_us, or indefinitely if it is negative, until
+ * a socket that a process is parked on becomes ready, or a message arrives
+ * from another environment. Called by the scheduler when no process can
+ * run. Returns MUSE_FALSE without waiting if no process is parked on a 
+ * socket.
+ */
+muse_boolean muse_wait_for_network( muse_env *env, muse_int wait_us )
+{
+	int wake_fd = -1;
+
+	if ( !env->net || env->net->count == 0 )
+		return MUSE_FALSE;
+
+#ifdef MUSE_PLATFORM_WINDOWS
+	/* Messages from other environments can't interrupt select(),
+	so look for them every millisecond. */
+	if ( env->workers && (wait_us < 0 || wait_us > 1000) )
+		wait_us = 1000;
+	poll_sockets( env, wait_us, wake_fd );
+#else
+	if ( !muse_begin_worker_wait( env, &wake_fd ) )
+		wait_us = 0;
+	poll_sockets( env, wait_us, wake_fd );
+	muse_end_worker_wait( env );
+#endif
+
+	env->net->last_poll_us = muse_elapsed_us(env->timer);
+	return MUSE_TRUE;
+}
+
+/**
+ * Wakes the processes whose sockets have become ready, without waiting. 
+ * Called by the scheduler before it picks the next process to run, so 
+ * that parked processes get to run while others are busy. It looks only
+ * every MUSE_NET_POLL_INTERVAL_US, and not at all if no process can run, 
+ * since the scheduler is then about to wait for the network anyway.
+ */
+void muse_poll_network( muse_env *env )
+{
+	muse_net_t *net = env->net;
+	muse_int now_us;
+
+	if ( !net || net->count == 0 || !env->scheduler.ready_head )
+		return;
+
+	now_us = muse_elapsed_us(env->timer);
+	if ( now_us - net->last_poll_us < MUSE_NET_POLL_INTERVAL_US )
+		return;
+
+	net->last_poll_us = now_us;
+	poll_sockets( env, 0, -1 );
+}
+
+/**
+ * Returns MUSE_TRUE if the socket is ready to read (\p cat = MUSE_NET_READ)
+ * or write, without waiting.
+ */
+static muse_boolean socket_is_ready( SOCKET s, int cat )
+{
+	fd_set fds;
+	struct timeval tv = {0,0};
+
+	FD_ZERO( &fds );
+	FD_SET( s, &fds );
+
+	return select( (int)(s + 1), cat == MUSE_NET_READ ? &fds : NULL, cat == MUSE_NET_WRITE ? &fds : NULL, NULL, &tv ) > 0 ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/**
+ * Parks the current process until the socket is ready to read 
+ * (\p cat = MUSE_NET_READ) or write, or until the environment's timer
+ * reaches \p deadline_us if it is >= 0, letting other processes run
+ * meanwhile. An expired enclosing with-timeout-us is raised as usual.
+ *
+ * Inside an atomic block no other process may run, so the
+ * environment as a whole waits for the socket instead.
+ */
+static poll_socket_status_t wait_for_socket( muse_env *env, SOCKET s, int cat, muse_int deadline_us )
+{
+	muse_process_frame_t *p = env->current_process;
+	net_waiter_t w;
+
+	if ( p->atomicity > 0 )
+	{
+		fd_set fds[2];
+		struct timeval tv;
+		muse_int wait_us = deadline_us >= 0 ? deadline_us - muse_elapsed_us(env->timer) : -1;
+		int n;
+
+		FD_ZERO( &fds[0] );
+		FD_ZERO( &fds[1] );
+		FD_SET( s, &fds[0] );
+		FD_SET( s, &fds[1] );
+		set_wait_time( &tv, wait_us > 0 ? wait_us : 0 );
+		n = select( (int)(s + 1), cat == MUSE_NET_READ ? &fds[0] : NULL, cat == MUSE_NET_WRITE ? &fds[0] : NULL, &fds[1], wait_us < 0 ? NULL : &tv );
+
+		if ( n < 0 )
+			return POLL_SOCKET_FAILED;
+		if ( n == 0 )
+			return POLL_SOCKET_TIMEOUT;
+		return FD_ISSET( s, &fds[0] ) ? POLL_SOCKET_SET : POLL_SOCKET_ERROR;
+	}
+
+	w.process	= p;
+	w.s			= s;
+	w.cat		= cat;
+
+	for ( ;; )
+	{
+		w.ready = MUSE_FALSE;
+		watch_socket( env, &w );
+		park_process( env, deadline_us );
+
+		if ( !w.ready )
+			unwatch_socket( env, &w );
+
+		if ( p->eval_timeout_due )
+			check_timeout( env );
+
+		if ( w.ready )
+			return POLL_SOCKET_SET;
+
+		if ( deadline_us >= 0 && muse_elapsed_us(env->timer) >= deadline_us )
+			return POLL_SOCKET_TIMEOUT;
+
+		/* Woken up by a message. Keep waiting. */
 	}
+}
+
+/**
+ * Returns MUSE_TRUE if the socket, which is being connected without
+ * blocking and has become writeable, did connect.
+ */
+static muse_boolean socket_connected( SOCKET s )
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if ( getsockopt( s, SOL_SOCKET, SO_ERROR, (char*)&err, &len ) != 0 )
+		return MUSE_FALSE;
 
-	return POLL_SOCKET_SET;
+	return err == 0 ? MUSE_TRUE : MUSE_FALSE;
 }
 
+/**
+ * Waits until the socket is ready to read (\p cat = MUSE_NET_READ) or write.
+ */
+static poll_socket_status_t poll_network( muse_env *env, SOCKET s, int cat )
+{
+	if ( socket_is_ready( s, cat ) )
+		return POLL_SOCKET_SET;
+
+	return wait_for_socket( env, s, cat, -1 );
+}
+/*@}*/
+
 /**
  * @name Point to point communication
  *
@@ -243,6 +800,7 @@ static void socket_close( void *s )
 	
 	if ( p->socket )
 	{
+		forget_socket( p->base.env, p->socket );
 		closesocket( p->socket );
 		p->socket = 0;
 		port_destroy( (muse_port_t)s );
@@ -255,17 +813,16 @@ static size_t socket_read( void *buffer, size_t nbytes, void *s )
 	
 	muse_int result = SOCKET_ERROR;
 	
-	while ( result < 0 && poll_network( p->base.env, p->socket, 0 ) == POLL_SOCKET_SET )
+	/* Read what's there, and wait only if there's nothing. */
+	while ( p->socket )
 	{
 		result = recv( p->socket, buffer, (int)nbytes, 0 );
-		if ( result == 0 ) {
-			/* Socket closed from the other end. */
+
+		if ( result >= 0 || !MUSE_SOCKET_WOULD_BLOCK() )
+			break; /* Data, or the socket closed from the other end, or an error. */
+
+		if ( wait_for_socket( p->base.env, p->socket, MUSE_NET_READ, -1 ) != POLL_SOCKET_SET )
 			break;
-		} else if ( result < 0 ) {
-			/* The poll_network() hasn't updated to the new state 
-			that no more data is available. So clear the state flag. */
-			FD_CLR( p->socket, &(p->base.env->net->fdsets[0]) );
-		}
 	}
 	
 	if ( result <= 0 )
@@ -290,7 +847,11 @@ static size_t socket_write( void *buffer, size_t nbytes, void *s )
 	
 	while ( b < b_end )
 	{
-		bytes_sent = (poll_network( p->base.env, p->socket, 1 ) == POLL_SOCKET_SET) ? send( p->socket, b, (int)(b_end - b), 0 ) : SOCKET_ERROR;
+		bytes_sent = p->socket ? send( p->socket, b, (int)(b_end - b), 0 ) : SOCKET_ERROR;
+
+		if ( bytes_sent < 0 && p->socket && MUSE_SOCKET_WOULD_BLOCK() 
+			 && wait_for_socket( p->base.env, p->socket, MUSE_NET_WRITE, -1 ) == POLL_SOCKET_SET )
+			continue;
 		
 		if ( bytes_sent <= 0 )
 		{
@@ -328,87 +889,107 @@ static muse_port_type_t g_socket_type =
 	socket_close,
 	socket_read,
 	socket_write,
-	socket_flush
+	socket_flush,
+	NULL
 };
 
 /**
- * @code (open-connection "server.somewhere.com" port)
- * (open-connection "231.41.59.26" 31415) @endcode
- *
- * Opens a TCP connection to the given server on the given port
- * and returns a port object using which you can communicate with
- * the server. The port can be closed by calling (close p). If a
- * port number is omitted, 31415 (= \p MUSE_DEFAULT_MULTICAST_PORT)
- * is used as the default.
- *
- * Supports \ref fn_the "the"
+ * Connects to the given server, which is named or in the 123.234.12.23
+ * form, and fills in its \p address. Other processes get to run while
+ * the connection is made. Returns INVALID_SOCKET if it fails.
  */
-muse_cell fn_open_connection( muse_env *env, void *context, muse_cell args )
+static SOCKET connect_to_server( muse_env *env, const char *server, short portshort, struct sockaddr_in *address )
 {
-	int sp					= _spos();
-	muse_cell servername	= _evalnext(&args);
-	muse_cell portnum		= _evalnext(&args);
+	in_addr_t addr = inet_addr( server );
+	SOCKET s;
 
-	muse_cell portcell		= _mk_functional_object( &g_socket_type.obj, MUSE_NIL );
-	socketport_t *port		= (socketport_t*)_port(portcell);
-	
-	in_addr_t addr = INADDR_NONE;
-	char serverStringAddress[256];
-	short portshort = 0;
-	int length = 0;
-	const muse_char *serverWstringAddress;
-	
-	/* If we're given a symbol for the server name, we use the string form of
-	the symbol and look it up in the DNS. */
-	if ( _cellt(servername) == MUSE_SYMBOL_CELL )
-		servername = _symname(servername);
-		
-	serverWstringAddress = _text_contents( servername, &length );
-	muse_unicode_to_utf8( serverStringAddress, 256, serverWstringAddress, length );
-	
-	portshort = (short)(portnum ? _intvalue(portnum) : MUSE_DEFAULT_MULTICAST_PORT);
-	
-	addr = inet_addr( serverStringAddress );
 	if ( addr == INADDR_NONE ) {
 		/* Address not in 123.234.12.23 form. Treat it as a name and look it up in the name server. */
-		struct hostent *ent = gethostbyname( serverStringAddress );
+		struct hostent *ent = gethostbyname( server );
 		if ( ent == NULL ) {
 			/* Invalid server address. */
-			MUSE_DIAGNOSTICS3({ fprintf( stderr, "Connection to server '%s:%d' failed!\n", serverStringAddress, portshort ); herror("inet error:"); });
-			goto UNDO_CONN;
+			MUSE_DIAGNOSTICS3({ fprintf( stderr, "Connection to server '%s:%d' failed!\n", server, portshort ); herror("inet error:"); });
+			return INVALID_SOCKET;
 		}
 		if ( ent->h_length > 0 ) {
 			addr = *(in_addr_t*)ent->h_addr;
 		} else {
-			MUSE_DIAGNOSTICS3({ fprintf( stderr, "Invalid address '%s:%d'!\n", serverStringAddress, portshort ); });
-			goto UNDO_CONN;
+			MUSE_DIAGNOSTICS3({ fprintf( stderr, "Invalid address '%s:%d'!\n", server, portshort ); });
+			return INVALID_SOCKET;
 		}
 	}
 	
-	port->address.sin_family		= AF_INET;
-	port->address.sin_addr.s_addr	= addr;
-	port->address.sin_port			= htons( portshort );
+	address->sin_family			= AF_INET;
+	address->sin_addr.s_addr	= addr;
+	address->sin_port			= htons( portshort );
 	
-	port->socket = socket(AF_INET, SOCK_STREAM, 0);
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if ( s == INVALID_SOCKET )
+		return INVALID_SOCKET;
 
 	/* Set a zero timeout period using the SO_LINGER parameter. */
-    if ( port->socket > 0 ) 
 	{
-        struct linger lingerParams = { 1, 0 };
+		struct linger lingerParams = { 1, 0 };
 		u_long nbmode = 1;
-        setsockopt( port->socket, SOL_SOCKET, SO_LINGER, (const char *)&lingerParams, sizeof(struct linger) );
-		ioctlsocket( port->socket, FIONBIO, &nbmode );
-    }
+		setsockopt( s, SOL_SOCKET, SO_LINGER, (const char *)&lingerParams, sizeof(struct linger) );
+		ioctlsocket( s, FIONBIO, &nbmode );
+	}
 
 	/* Connect to the server. Connection will proceed asynchronously. 
-	We poll the network for writeability of this socket in order to determine
-	whether it is connected. */
-	prepare_for_network_poll( env, port->socket, 1 );
-	connect( port->socket, (struct sockaddr*)&(port->address), sizeof(port->address) );
+	We wait for this socket to become writeable in order to determine
+	whether it is connected, and then check that it really is. */
+	connect( s, (struct sockaddr*)address, sizeof(*address) );
+	
+	if ( poll_network( env, s, MUSE_NET_WRITE ) != POLL_SOCKET_SET || !socket_connected( s ) ) 
+	{
+		MUSE_DIAGNOSTICS3({ fprintf( stderr, "Connection to server '%s:%d' failed!\n", server, portshort ); });
+		closesocket( s );
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}
+
+/**
+ * @code (open-connection "server.somewhere.com" port)
+ * (open-connection "231.41.59.26" 31415) @endcode
+ *
+ * Opens a TCP connection to the given server on the given port
+ * and returns a port object using which you can communicate with
+ * the server. The port can be closed by calling (close p). If a
+ * port number is omitted, 31415 (= \p MUSE_DEFAULT_MULTICAST_PORT)
+ * is used as the default.
+ *
+ * Supports \ref fn_the "the"
+ */
+muse_cell fn_open_connection( muse_env *env, void *context, muse_cell args )
+{
+	int sp					= _spos();
+	muse_cell servername	= _evalnext(&args);
+	muse_cell portnum		= _evalnext(&args);
+
+	muse_cell portcell		= _mk_functional_object( &g_socket_type.obj, MUSE_NIL );
+	socketport_t *port		= (socketport_t*)_port(portcell);
+	
+	char serverStringAddress[256];
+	short portshort = 0;
+	int length = 0;
+	const muse_char *serverWstringAddress;
+	
+	/* If we're given a symbol for the server name, we use the string form of
+	the symbol and look it up in the DNS. */
+	if ( _cellt(servername) == MUSE_SYMBOL_CELL )
+		servername = _symname(servername);
+		
+	serverWstringAddress = _text_contents( servername, &length );
+	muse_unicode_to_utf8( serverStringAddress, 256, serverWstringAddress, length );
 	
-	if ( poll_network( env, port->socket, 1 ) != POLL_SOCKET_SET ) 
+	portshort = (short)(portnum ? _intvalue(portnum) : MUSE_DEFAULT_MULTICAST_PORT);
+	
+	port->socket = connect_to_server( env, serverStringAddress, portshort, &port->address );
+	if ( port->socket == INVALID_SOCKET )
 	{
-		MUSE_DIAGNOSTICS3({ fprintf( stderr, "Connection to server '%s:%d' failed!\n", serverStringAddress, portshort ); });
+		port->socket = 0;
 		goto UNDO_CONN;
 	}
 
@@ -586,12 +1167,14 @@ muse_cell fn_with_incoming_connections_to_port( muse_env *env, void *context, mu
 
 		POLL_AGAIN:
 		if ( client == INVALID_SOCKET ) {
-			prepare_for_network_poll( env, conn->listenSocket, 0 );
-			switch ( poll_network( env, conn->listenSocket, 0 ) ) {
+			switch ( poll_network( env, conn->listenSocket, MUSE_NET_READ ) ) {
 				case POLL_SOCKET_SET:
 					client = accept( conn->listenSocket, (struct sockaddr *)&client_address, &sockAddrSize );
+					if ( client == INVALID_SOCKET && MUSE_SOCKET_WOULD_BLOCK() )
+						goto POLL_AGAIN; /* Someone else got there first. */
 					break;
 				case POLL_SOCKET_FAILED:
+				case POLL_SOCKET_TIMEOUT:
 					goto POLL_AGAIN;
 				case POLL_SOCKET_ERROR:
 					if ( conn->listenSocket ) closesocket(conn->listenSocket);
@@ -616,6 +1199,13 @@ muse_cell fn_with_incoming_connections_to_port( muse_env *env, void *context, mu
 			client_port_cell = _mk_functional_object( &g_socket_type.obj, MUSE_NIL );
 			client_port = (socketport_t*)_port( client_port_cell );
 	
+			/* The client socket is read and written without blocking, 
+			so that only the process serving it waits for it. */
+			{
+				u_long nbmode = 1;
+				ioctlsocket( client, FIONBIO, &nbmode );
+			}
+
 			client_port->socket = client;
 			client_port->base.mode = MUSE_PORT_READ_WRITE;
 			client_port->base.eof = 0;
@@ -663,6 +1253,349 @@ BAIL:
 }
 /*@}*/
 
+/**
+ * @name Sending files
+ *
+ * A file, or a range of bytes in it, goes out through a socket port with
+ * sendfile() on Linux, BSD and MacOSX, so its contents are never copied
+ * into the process. To other ports, and on other systems, the file is
+ * copied in large blocks that go straight to the port's write function
+ * instead of through its buffer.
+ *
+ * The data in a memport goes out through a socket port a batch of
+ * chunks at a time with writev(), straight from the memport's chunks.
+ */
+/*@{*/
+
+#ifndef MUSE_PLATFORM_WINDOWS
+#	include <netinet/tcp.h>
+#	if defined(__linux__)
+#		define MUSE_NET_SENDFILE 1
+#		include <sys/sendfile.h>
+#	elif defined(MUSE_PLATFORM_BSD)
+#		define MUSE_NET_SENDFILE 1
+#		include <sys/uio.h>
+#	endif
+#	include <sys/uio.h>
+#endif
+
+enum
+{
+	SEND_FILE_BLOCK_SIZE	= 65536,
+	SEND_FILE_MAX_CHUNK		= 1 << 30,	/**< The most handed to sendfile() at a time. */
+	SEND_MEMPORT_CHUNKS		= 64		/**< The most memport chunks handed to writev() at a time. */
+};
+
+static muse_int file_size( FILE *f )
+{
+#ifdef MUSE_PLATFORM_WINDOWS
+	struct _stati64 st;
+	return _fstati64( _fileno(f), &st ) == 0 ? (muse_int)st.st_size : -1;
+#else
+	struct stat st;
+	return fstat( fileno(f), &st ) == 0 ? (muse_int)st.st_size : -1;
+#endif
+}
+
+/**
+ * Opens the named file for sending. If it can't be opened, error:open-file
+ * is raised and can be resumed with another file name. Returns NULL if it
+ * is resumed with anything else.
+ */
+static FILE *open_file_to_send( muse_env *env, muse_cell *filename )
+{
+	FILE *f;
+
+	while ( (f = muse_fopen( _text_contents(*filename,NULL), L"rb" )) == NULL )
+	{
+		*filename = muse_raise_error( env, _csymbol(L"error:open-file"), _cons(*filename,MUSE_NIL) );
+		if ( _cellt(*filename) != MUSE_TEXT_CELL )
+			return NULL;
+	}
+
+	return f;
+}
+
+/**
+ * Holds back partial segments while a response goes out, so that its
+ * headers and the start of the file share packets. Turning it off
+ * sends what is left right away.
+ */
+static void socket_cork( socketport_t *p, int on )
+{
+#ifdef TCP_CORK
+	if ( p->socket )
+		setsockopt( p->socket, IPPROTO_TCP, TCP_CORK, (const char*)&on, sizeof(on) );
+#endif
+}
+
+#ifdef MUSE_NET_SENDFILE
+/**
+ * Sends \p length bytes of the file starting at \p offset over the socket,
+ * parking the process whenever the socket is full. Returns the number of
+ * bytes sent, or -1 if nothing was sent because the system can't send this
+ * file this way, in which case it has to be copied.
+ */
+static muse_int socket_send_file( muse_env *env, socketport_t *p, int fd, muse_int offset, muse_int length )
+{
+	muse_int sent = 0;
+
+	while ( sent < length && p->socket )
+	{
+		muse_int count = length - sent < SEND_FILE_MAX_CHUNK ? length - sent : SEND_FILE_MAX_CHUNK;
+		muse_int n;
+
+#if defined(__linux__)
+		off_t pos = (off_t)(offset + sent);
+		n = sendfile( p->socket, fd, &pos, (size_t)count );
+#elif defined(__APPLE__)
+		off_t len = (off_t)count;
+		int r = sendfile( fd, p->socket, (off_t)(offset + sent), &len, NULL, 0 );
+		n = (r == 0 || len > 0) ? (muse_int)len : -1;
+#else
+		off_t len = 0;
+		int r = sendfile( fd, p->socket, (off_t)(offset + sent), (size_t)count, NULL, &len, 0 );
+		n = (r == 0 || len > 0) ? (muse_int)len : -1;
+#endif
+
+		if ( n > 0 )
+		{
+			sent += n;
+			continue;
+		}
+
+		if ( n == 0 )
+			break; /* The file is shorter than it was. */
+
+		if ( MUSE_SOCKET_WOULD_BLOCK() )
+		{
+			if ( wait_for_socket( env, p->socket, MUSE_NET_WRITE, -1 ) == POLL_SOCKET_SET )
+				continue;
+		}
+		else if ( sent == 0 && (errno == EINVAL || errno == ENOSYS || errno == ENOTSOCK || errno == EOPNOTSUPP) )
+			return -1;
+
+		p->base.error = SOCKET_ERROR;
+		break;
+	}
+
+	return sent;
+}
+#endif
+
+/**
+ * Copies \p length bytes of the file starting at \p offset to the port.
+ * Returns the number of bytes copied.
+ */
+static muse_int copy_file( muse_env *env, muse_port_t p, FILE *f, muse_int offset, muse_int length )
+{
+	unsigned char *block;
+	muse_int sent = 0;
+
+#ifdef MUSE_PLATFORM_WINDOWS
+	if ( _fseeki64( f, offset, SEEK_SET ) != 0 )
+#else
+	if ( fseeko( f, (off_t)offset, SEEK_SET ) != 0 )
+#endif
+		return 0;
+
+	block = (unsigned char*)malloc( SEND_FILE_BLOCK_SIZE );
+
+	while ( sent < length && !p->error )
+	{
+		size_t n = (size_t)(length - sent < SEND_FILE_BLOCK_SIZE ? length - sent : SEND_FILE_BLOCK_SIZE);
+
+		n = fread( block, 1, n, f );
+		if ( n == 0 || port_write( block, n, p ) < n )
+			break;
+
+		sent += n;
+	}
+
+	free(block);
+	return sent;
+}
+
+/**
+ * Sends \p length bytes of the file starting at \p offset to the port,
+ * after what the port already has buffered. Returns the number of bytes
+ * of the file sent.
+ */
+static muse_int send_file( muse_env *env, muse_port_t p, FILE *f, muse_int offset, muse_int length )
+{
+	muse_int sent = -1;
+	socketport_t *sp = (p->base.type_info == &g_socket_type.obj) ? (socketport_t*)p : NULL;
+
+	if ( sp )
+		socket_cork( sp, 1 );
+
+	port_flush(p);
+
+#ifdef MUSE_NET_SENDFILE
+	if ( sp && !p->error )
+		sent = socket_send_file( env, sp, fileno(f), offset, length );
+#endif
+
+	if ( sent < 0 )
+	{
+		sent = copy_file( env, p, f, offset, length );
+		port_flush(p);
+	}
+
+	if ( sp )
+		socket_cork( sp, 0 );
+
+	return sent;
+}
+
+/**
+ * Sends the data waiting in the memport over the socket, a batch of its
+ * chunks at a time, parking the process whenever the socket is full.
+ * What is sent is dropped from the memport. Returns the number of
+ * bytes sent.
+ */
+static muse_int socket_send_memport( muse_env *env, socketport_t *p, muse_port_t mp )
+{
+	muse_memport_chunk_t chunks[SEND_MEMPORT_CHUNKS];
+	muse_int sent = 0;
+	int n, i;
+
+	while ( p->socket && (n = memport_chunks( mp, chunks, SEND_MEMPORT_CHUNKS )) > 0 )
+	{
+		muse_int result;
+
+#ifdef MUSE_PLATFORM_WINDOWS
+		WSABUF bufs[SEND_MEMPORT_CHUNKS];
+		DWORD count = 0;
+
+		for ( i = 0; i < n; ++i )
+		{
+			bufs[i].buf = (char*)chunks[i].bytes;
+			bufs[i].len = (ULONG)chunks[i].size;
+		}
+
+		result = WSASend( p->socket, bufs, n, &count, 0, NULL, NULL ) == 0 ? (muse_int)count : SOCKET_ERROR;
+#else
+		struct iovec iov[SEND_MEMPORT_CHUNKS];
+
+		for ( i = 0; i < n; ++i )
+		{
+			iov[i].iov_base = (void*)chunks[i].bytes;
+			iov[i].iov_len = chunks[i].size;
+		}
+
+		result = writev( p->socket, iov, n );
+#endif
+
+		if ( result > 0 )
+		{
+			memport_drop( mp, (size_t)result );
+			sent += result;
+			continue;
+		}
+
+		if ( result < 0 && MUSE_SOCKET_WOULD_BLOCK() 
+			 && wait_for_socket( env, p->socket, MUSE_NET_WRITE, -1 ) == POLL_SOCKET_SET )
+			continue;
+
+		p->base.error = SOCKET_ERROR;
+		break;
+	}
+
+	return sent;
+}
+
+/**
+ * Sends the data waiting in the memport to the port, after what the port
+ * already has buffered, and drops it from the memport. Returns the number
+ * of bytes sent.
+ */
+static muse_int send_memport( muse_env *env, muse_port_t p, muse_port_t mp )
+{
+	muse_int sent = 0;
+	socketport_t *sp = (p->base.type_info == &g_socket_type.obj) ? (socketport_t*)p : NULL;
+
+	if ( sp )
+	{
+		socket_cork( sp, 1 );
+		port_flush(p);
+		if ( !p->error )
+			sent = socket_send_memport( env, sp, mp );
+		socket_cork( sp, 0 );
+		return sent;
+	}
+
+	{
+		muse_memport_chunk_t chunks[SEND_MEMPORT_CHUNKS];
+		int n, i;
+
+		while ( !p->error && (n = memport_chunks( mp, chunks, SEND_MEMPORT_CHUNKS )) > 0 )
+		{
+			size_t written = 0;
+
+			for ( i = 0; i < n && !p->error; ++i )
+				written += port_write( (void*)chunks[i].bytes, chunks[i].size, p );
+
+			memport_drop( mp, written );
+			sent += written;
+		}
+
+		port_flush(p);
+	}
+
+	return sent;
+}
+
+/**
+ * @code (send-file port file-name [offset] [num-bytes]) @endcode
+ *
+ * Sends the contents of the named file to the port, after anything
+ * already written to it, and returns the number of bytes sent. An optional
+ * start offset and size send a part of the file. The file isn't read into
+ * memory - over a socket, the system sends it directly where it can.
+ *
+ * Raises error:open-file if the file can't be opened. You can resume
+ * with another file name.
+ *
+ * @code (send-file port memport) @endcode
+ * Sends all the data waiting to be read from the memport, which is
+ * left empty, without copying it out of the memport first.
+ */
+muse_cell fn_send_file( muse_env *env, void *context, muse_cell args )
+{
+	muse_port_t p = (muse_port_t)muse_port( env, _evalnext(&args) );
+	muse_cell filename = _evalnext(&args);
+	muse_port_t mp = (muse_port_t)muse_port( env, filename );
+	muse_int offset, length, size, sent = 0;
+	FILE *f;
+
+	if ( is_memport(mp) )
+		return _mk_int( send_memport( env, p, mp ) );
+
+	offset = args ? _intvalue(_evalnext(&args)) : 0;
+	length = args ? _intvalue(_evalnext(&args)) : -1;
+	f = open_file_to_send( env, &filename );
+
+	if ( f == NULL )
+		return MUSE_NIL;
+
+	size = file_size(f);
+
+	if ( offset < 0 )
+		offset = 0;
+	if ( offset > size )
+		offset = size;
+	if ( length < 0 || offset + length > size )
+		length = size - offset;
+
+	if ( length > 0 )
+		sent = send_file( env, p, f, offset, length );
+
+	fclose(f);
+	return _mk_int(sent);
+}
+/*@}*/
+
 /**
  * @name Multicast messaging
  *
@@ -680,8 +1613,42 @@ BAIL:
  *
  * You can use the \ref fn_wait_for_input "wait-for-input" function to wait for a message
  * from a multicast group as well.
+ *
+ * For high rates of messages, \ref fn_multicast_receive "multicast-receive" and
+ * \ref fn_multicast_send "multicast-send" move whole batches of raw datagrams
+ * per system call - using recvmmsg() and sendmmsg() on Linux - instead of
+ * one datagram per read or write.
  */
 /*@{*/
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#	define MUSE_NET_MMSG 1
+#endif
+
+enum
+{
+	MULTICAST_BATCH_COUNT	= 64,	/**< Default number of datagrams moved per batch. */
+	MULTICAST_BATCH_SIZE	= 2048	/**< Default room for each received datagram. */
+};
+
+/**
+ * Scratch space for batches of datagrams, kept with the port and reused
+ * from one batch to the next. It only grows when a batch asks for more
+ * datagrams or bigger ones than it has room for.
+ */
+typedef struct
+{
+	int count;						/**< Room for this many datagrams. */
+	int size;						/**< Room for this many bytes per received datagram. */
+	unsigned char *data;			/**< count * size bytes for receiving into. */
+	struct sockaddr_in *addrs;
+	int *lengths;
+#ifdef MUSE_NET_MMSG
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+#endif
+} multicast_batch_t;
+
 typedef struct
 {
 	muse_port_base_t base;
@@ -691,6 +1658,7 @@ typedef struct
 	socklen_t src_addr_len;
 	struct ip_mreq mreq;
 	int reply;
+	multicast_batch_t batch;
 } multicast_socket_port_t;
 
 static void multicast_socket_init( muse_env *env, void *p, muse_cell args )
@@ -825,11 +1793,24 @@ static void multicast_socket_close( void *p )
 		}
 		
 		/* We're done with the socket. */
+		forget_socket( s->base.env, s->socket );
 		closesocket( s->socket );
 		s->socket = 0;
 	}
 }
 
+static void multicast_batch_free( multicast_batch_t *b )
+{
+	free( b->data );
+	free( b->addrs );
+	free( b->lengths );
+#ifdef MUSE_NET_MMSG
+	free( b->msgs );
+	free( b->iovs );
+#endif
+	memset( b, 0, sizeof(multicast_batch_t) );
+}
+
 static void multicast_socket_destroy( muse_env *env, void *p )
 {
 	multicast_socket_port_t *s = (multicast_socket_port_t*)p;
@@ -838,6 +1819,8 @@ static void multicast_socket_destroy( muse_env *env, void *p )
 	if ( s->socket )
 		multicast_socket_close(p);
 
+	multicast_batch_free( &s->batch );
+
 	port_destroy(p);
 }
 
@@ -851,7 +1834,7 @@ static size_t multicast_socket_read( void *buffer, size_t nbytes, void *p )
 
 	{
 		int result = 
-			poll_network( env, s->socket, 0 ) == POLL_SOCKET_SET
+			poll_network( env, s->socket, MUSE_NET_READ ) == POLL_SOCKET_SET
 				? recvfrom( s->socket, (char*)buffer, (int)nbytes, 0, (struct sockaddr*)&(s->src_addr), &s->src_addr_len )
 				: SOCKET_ERROR;
 
@@ -876,7 +1859,7 @@ static size_t multicast_socket_write( void *buffer, size_t nbytes, void *p )
 	const struct sockaddr *addr = (const struct sockaddr *)(s->reply ? &s->src_addr : &s->dst_addr);
 	int addr_len = s->reply ? s->src_addr_len : sizeof(s->dst_addr);
 	int result = 
-			poll_network( env, s->socket, 1 ) == POLL_SOCKET_SET
+			poll_network( env, s->socket, MUSE_NET_WRITE ) == POLL_SOCKET_SET
 				? sendto( s->socket, buffer, (int)nbytes, 0, addr, addr_len )
 				: SOCKET_ERROR;
 
@@ -912,7 +1895,8 @@ static muse_port_type_t g_multicast_socket_type =
 	multicast_socket_close,
 	multicast_socket_read,
 	multicast_socket_write,
-	multicast_socket_flush
+	multicast_socket_flush,
+	NULL
 };
 
 /**
@@ -985,46 +1969,350 @@ muse_cell fn_reply( muse_env *env, void *context, muse_cell args )
 	s->reply = 0;
 	return MUSE_NIL;
 }
-/*@}*/
+
+static multicast_socket_port_t *multicast_port_arg( muse_env *env, muse_cell port )
+{
+	multicast_socket_port_t *s = (multicast_socket_port_t*)_port(port);
+
+	if ( !port || !s || s->base.base.type_info != &g_multicast_socket_type.obj )
+		muse_raise_error( env, _csymbol(L"error:multicast-group-expected"), _cons( port, MUSE_NIL ) );
+
+	return s;
+}
 
 /**
- * @code (wait-for-input network-port [timeout-microseconds]) @endcode
- * Returns T if input is available and 'timeout if the wait timed out.
- * Returns () upon error. Works only for network ports. It won't
- * wait for file-based ports.
+ * Makes sure the batch has room for \p count datagrams of
+ * \p size bytes each, keeping what it has if that is enough.
  */
-muse_cell fn_wait_for_input( muse_env *env, void *context, muse_cell args )
+static multicast_batch_t *multicast_batch( multicast_socket_port_t *s, int count, int size )
 {
-	muse_cell port = _evalnext(&args);
-	muse_cell timeout = args ? _evalnext(&args) : MUSE_NIL;
-	
-	/* Wait for 10 minutes in the default case. */
-	muse_int timeout_us = timeout ? _intvalue(timeout) : (1000000 * 60 * 10);
-	
-	muse_port_t p = _port(port);
-	if ( p && (p->base.type_info == &g_socket_type.obj || p->base.type_info == &g_multicast_socket_type.obj) )
+	multicast_batch_t *b = &s->batch;
+
+	if ( count > b->count || size > b->size )
 	{
-		/* This is a socket. Don't wait for anything else. */
-		socketport_t *s = (socketport_t*)p;
-		
-		fd_set fds;
-#ifdef MUSE_PLATFORM_WINDOWS
-		struct timeval tv = { (long)(timeout_us / 1000000), (long)(timeout_us % 1000000) };
-#else
-		struct timeval tv = { (time_t)(timeout_us / 1000000), (suseconds_t)(timeout_us % 1000000) };
+		if ( count < b->count ) count = b->count;
+		if ( size < b->size ) size = b->size;
+
+		multicast_batch_free(b);
+		b->count	= count;
+		b->size		= size;
+		b->data		= (unsigned char*)malloc( (size_t)count * (size_t)size );
+		b->addrs	= (struct sockaddr_in*)calloc( count, sizeof(struct sockaddr_in) );
+		b->lengths	= (int*)calloc( count, sizeof(int) );
+#ifdef MUSE_NET_MMSG
+		b->msgs		= (struct mmsghdr*)calloc( count, sizeof(struct mmsghdr) );
+		b->iovs		= (struct iovec*)calloc( count, sizeof(struct iovec) );
 #endif
-		FD_ZERO(&fds);
-		FD_SET( s->socket, &fds );
-		
-		{
-			int result = select( (int)(s->socket + 1), &fds, NULL, NULL, &tv );
-			switch ( result )
-			{
-				case 1 : /* Success. */ return _t();
-				case 0 : /* Timed out. */ return _builtin_symbol(MUSE_TIMEOUT);
-				default: /* Error. */ return MUSE_NIL;
-			}
-		}
+	}
+
+	return b;
+}
+
+/**
+ * Reads up to \p count datagrams that are waiting on the socket without
+ * blocking, into the batch's buffers. Returns the number read, or
+ * SOCKET_ERROR if not even one could be.
+ */
+static int multicast_recv_batch( multicast_socket_port_t *s, multicast_batch_t *b, int count, int size )
+{
+	int n = 0;
+
+#ifdef MUSE_NET_MMSG
+	int i;
+	for ( i = 0; i < count; ++i )
+	{
+		b->iovs[i].iov_base				= b->data + (size_t)i * (size_t)size;
+		b->iovs[i].iov_len				= size;
+		b->msgs[i].msg_hdr.msg_name		= b->addrs + i;
+		b->msgs[i].msg_hdr.msg_namelen	= sizeof(struct sockaddr_in);
+		b->msgs[i].msg_hdr.msg_iov		= b->iovs + i;
+		b->msgs[i].msg_hdr.msg_iovlen	= 1;
+		b->msgs[i].msg_hdr.msg_control	= NULL;
+		b->msgs[i].msg_hdr.msg_controllen = 0;
+		b->msgs[i].msg_hdr.msg_flags	= 0;
+	}
+
+	n = recvmmsg( s->socket, b->msgs, count, MSG_DONTWAIT, NULL );
+
+	for ( i = 0; i < n; ++i )
+		b->lengths[i] = (int)b->msgs[i].msg_len;
+#else
+	for ( ; n < count && (n == 0 || socket_is_ready( s->socket, MUSE_NET_READ )); ++n )
+	{
+		socklen_t addr_len = sizeof(struct sockaddr_in);
+		int result = recvfrom( s->socket, (char*)(b->data + (size_t)n * (size_t)size), size, 0, (struct sockaddr*)(b->addrs + n), &addr_len );
+
+		if ( result < 0 )
+			break;
+
+		b->lengths[n] = result;
+	}
+
+	if ( n == 0 )
+		n = SOCKET_ERROR;
+#endif
+
+	return n;
+}
+
+/**
+ * Sends the batch's datagrams from \p first up to \p count, whose
+ * data is pointed to by \p datagrams. Returns the number sent, or
+ * SOCKET_ERROR if not even one could be.
+ */
+static int multicast_send_batch( multicast_socket_port_t *s, multicast_batch_t *b, unsigned char **datagrams, int first, int count )
+{
+	int n = first;
+
+#ifdef MUSE_NET_MMSG
+	int i;
+	for ( i = first; i < count; ++i )
+	{
+		b->iovs[i].iov_base				= datagrams[i];
+		b->iovs[i].iov_len				= b->lengths[i];
+		b->msgs[i].msg_hdr.msg_name		= b->addrs + i;
+		b->msgs[i].msg_hdr.msg_namelen	= sizeof(struct sockaddr_in);
+		b->msgs[i].msg_hdr.msg_iov		= b->iovs + i;
+		b->msgs[i].msg_hdr.msg_iovlen	= 1;
+		b->msgs[i].msg_hdr.msg_control	= NULL;
+		b->msgs[i].msg_hdr.msg_controllen = 0;
+		b->msgs[i].msg_hdr.msg_flags	= 0;
+	}
+
+	n = sendmmsg( s->socket, b->msgs + first, count - first, MSG_DONTWAIT );
+#else
+	for ( ; n < count && (n == first || socket_is_ready( s->socket, MUSE_NET_WRITE )); ++n )
+	{
+		if ( sendto( s->socket, (const char*)datagrams[n], b->lengths[n], 0, (const struct sockaddr*)(b->addrs + n), sizeof(struct sockaddr_in) ) < 0 )
+			break;
+	}
+
+	n = (n == first) ? SOCKET_ERROR : n - first;
+#endif
+
+	return n;
+}
+
+static muse_cell sender_text( muse_env *env, const struct sockaddr_in *addr )
+{
+	char sender[32];
+	_snprintf( sender, sizeof(sender), "%s:%d", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port) );
+	return muse_mk_ctext_utf8( env, sender );
+}
+
+/**
+ * Reads a "address:port" text, as \ref fn_multicast_receive "multicast-receive"
+ * gives for senders, into \p addr.
+ */
+static muse_boolean sender_addr( muse_env *env, muse_cell sender, struct sockaddr_in *addr )
+{
+	char text[32], *colon;
+	int length = 0;
+	const muse_char *chars = (_cellt(sender) == MUSE_TEXT_CELL) ? _text_contents( sender, &length ) : NULL;
+
+	if ( !chars || length >= (int)sizeof(text) )
+		return MUSE_FALSE;
+
+	text[muse_unicode_to_utf8( text, sizeof(text), chars, length )] = '\0';
+	colon = strchr( text, ':' );
+
+	if ( !colon )
+		return MUSE_FALSE;
+
+	*colon = '\0';
+	memset( addr, 0, sizeof(struct sockaddr_in) );
+	addr->sin_family		= AF_INET;
+	addr->sin_addr.s_addr	= inet_addr(text);
+	addr->sin_port			= htons( (u_short)atoi(colon + 1) );
+
+	return (addr->sin_addr.s_addr != INADDR_NONE) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/**
+ * @code (multicast-receive port [max-count] [max-size]) @endcode
+ *
+ * Waits for datagrams to arrive at the multicast group \p port and
+ * reads as many as are waiting, up to \p max-count of them (64 by
+ * default), in one go. Evaluates to a vector with a
+ * @code (sender . bytes) @endcode
+ * pair for each datagram, where \c sender is a text such as
+ * \c "10.0.0.12:31415" and \c bytes holds the datagram's raw data.
+ * Datagrams longer than \p max-size (2048 by default) are cut short.
+ * Evaluates to () if the wait or the read fails.
+ *
+ * The datagrams' data is read into buffers kept with the port and comes
+ * out as slices of a single byte array per batch. After a batch is read,
+ * \ref fn_reply "reply" goes to the sender of its last datagram.
+ */
+muse_cell fn_multicast_receive( muse_env *env, void *context, muse_cell args )
+{
+	multicast_socket_port_t *s	= multicast_port_arg( env, _evalnext(&args) );
+	muse_int count				= args ? _intvalue(_evalnext(&args)) : MULTICAST_BATCH_COUNT;
+	muse_int size				= args ? _intvalue(_evalnext(&args)) : MULTICAST_BATCH_SIZE;
+	multicast_batch_t *b;
+	int n, i, total = 0;
+	muse_cell data, result, sender = MUSE_NIL;
+	unsigned char *ptr;
+
+	if ( count < 1 ) count = 1;
+	if ( size < 1 ) size = 1;
+	if ( size > 65536 ) size = 65536;
+
+	b = multicast_batch( s, (int)count, (int)size );
+
+	if ( poll_network( env, s->socket, MUSE_NET_READ ) != POLL_SOCKET_SET
+		 || (n = multicast_recv_batch( s, b, (int)count, (int)size )) <= 0 )
+		return MUSE_NIL;
+
+	for ( i = 0; i < n; ++i )
+		total += b->lengths[i];
+
+	/* Pack the datagrams into one byte array and give
+	out slices of it, rather than one byte array each. */
+	data = muse_mk_bytes( env, total );
+	ptr = (unsigned char*)muse_bytes_data( env, data, 0 );
+	for ( i = 0; i < n; ++i )
+	{
+		memcpy( ptr, b->data + (size_t)i * (size_t)size, b->lengths[i] );
+		ptr += b->lengths[i];
+	}
+
+	result = muse_mk_vector( env, n );
+
+	{
+		int sp = _spos();
+		int offset = 0;
+
+		for ( i = 0; i < n; ++i )
+		{
+			/* Datagrams from the same sender in a row share the text. */
+			if ( i == 0 || b->addrs[i].sin_addr.s_addr != b->addrs[i-1].sin_addr.s_addr || b->addrs[i].sin_port != b->addrs[i-1].sin_port )
+				sender = sender_text( env, b->addrs + i );
+
+			muse_vector_put( env, result, i, _cons( sender, muse_mk_slice( env, data, offset, b->lengths[i] ) ) );
+			offset += b->lengths[i];
+			_unwind(sp);
+			_spush(sender);
+		}
+	}
+
+	s->src_addr		= b->addrs[n-1];
+	s->src_addr_len	= sizeof(s->src_addr);
+
+	return result;
+}
+
+/**
+ * @code (multicast-send port datagrams) @endcode
+ *
+ * Sends a vector or list of datagrams through the multicast group
+ * \p port, as many per system call as it can. Each datagram is
+ * either a byte array, which goes to the whole group, or a
+ * @code (sender . bytes) @endcode
+ * pair as given by \ref fn_multicast_receive "multicast-receive",
+ * which goes only to that sender. The data is sent straight from
+ * the byte arrays. Evaluates to the number of datagrams sent.
+ *
+ * @code
+ * (define group (multicast-group))
+ * (define (echo-all)
+ *   (multicast-send group (multicast-receive group))
+ *   (echo-all))
+ * @endcode
+ */
+muse_cell fn_multicast_send( muse_env *env, void *context, muse_cell args )
+{
+	multicast_socket_port_t *s	= multicast_port_arg( env, _evalnext(&args) );
+	muse_cell datagrams			= _evalnext(&args);
+	muse_boolean is_vector		= muse_functional_object_data( env, datagrams, 'vect' ) ? MUSE_TRUE : MUSE_FALSE;
+	int total					= is_vector ? muse_vector_length( env, datagrams ) : muse_list_length( env, datagrams );
+	multicast_batch_t *b		= multicast_batch( s, MULTICAST_BATCH_COUNT, 1 );
+	unsigned char *ptrs[MULTICAST_BATCH_COUNT];
+	int next = 0, sent = 0;
+
+	while ( next < total )
+	{
+		int count = 0, n = 0;
+
+		/* Gather up the next batch. */
+		for ( ; count < MULTICAST_BATCH_COUNT && next < total; ++count, ++next )
+		{
+			muse_cell d = is_vector ? muse_vector_get( env, datagrams, next ) : _next(&datagrams);
+			muse_cell bytes = d;
+
+			if ( _cellt(d) == MUSE_CONS_CELL ) {
+				bytes = _tail(d);
+				if ( !sender_addr( env, _head(d), b->addrs + count ) )
+					return muse_raise_error( env, _csymbol(L"error:bad-address"), _cons( _head(d), MUSE_NIL ) );
+			} else {
+				b->addrs[count] = s->dst_addr;
+			}
+
+			if ( !muse_functional_object_data( env, bytes, 'barr' ) )
+				return muse_raise_error( env, _csymbol(L"error:bytes-expected"), _cons( bytes, MUSE_NIL ) );
+
+			ptrs[count]			= (unsigned char*)muse_bytes_data( env, bytes, 0 );
+			b->lengths[count]	= (int)muse_bytes_size( env, bytes );
+		}
+
+		/* Send it, waiting for room as necessary. */
+		while ( n < count )
+		{
+			int result =
+				poll_network( env, s->socket, MUSE_NET_WRITE ) == POLL_SOCKET_SET
+					? multicast_send_batch( s, b, ptrs, n, count )
+					: SOCKET_ERROR;
+
+			if ( result < 0 )
+			{
+				if ( MUSE_SOCKET_WOULD_BLOCK() )
+					continue;
+
+				s->base.error = 1;
+				return _mk_int( sent + n );
+			}
+
+			n += result;
+		}
+
+		sent += n;
+	}
+
+	return _mk_int(sent);
+}
+/*@}*/
+
+/**
+ * @code (wait-for-input network-port [timeout-microseconds]) @endcode
+ * Returns T if input is available and 'timeout if the wait timed out.
+ * Returns () upon error. Works only for network ports. It won't
+ * wait for file-based ports.
+ */
+muse_cell fn_wait_for_input( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell port = _evalnext(&args);
+	muse_cell timeout = args ? _evalnext(&args) : MUSE_NIL;
+	
+	/* Wait for 10 minutes in the default case. */
+	muse_int timeout_us = timeout ? _intvalue(timeout) : (1000000 * 60 * 10);
+	
+	muse_port_t p = _port(port);
+	if ( p && (p->base.type_info == &g_socket_type.obj || p->base.type_info == &g_multicast_socket_type.obj) )
+	{
+		/* This is a socket. Other processes get to run while
+		we wait, and the wait ends early if an enclosing
+		with-timeout-us expires. */
+		socketport_t *s = (socketport_t*)p;
+
+		if ( socket_is_ready( s->socket, MUSE_NET_READ ) )
+			return _t();
+
+		switch ( wait_for_socket( env, s->socket, MUSE_NET_READ, muse_elapsed_us(env->timer) + timeout_us ) )
+		{
+			case POLL_SOCKET_SET :		/* Success. */ return _t();
+			case POLL_SOCKET_TIMEOUT :	/* Timed out. */ return _builtin_symbol(MUSE_TIMEOUT);
+			default:					/* Error. */ return MUSE_NIL;
+		}
 	}
 	else
 		return _t();
@@ -1347,311 +2635,1161 @@ static muse_cell fetch_uri( muse_env *env, fetch_uri_args_t *args, muse_cell arg
 #endif
 
 /**
- * Usage: (fetch-uri uri ['refresh] [headers])
- *
- * Evaluates to the cached local file path for the uri.
- * If 'refresh is passed, then it downloads the uri again if it
- * is out of date, even if it is already in the cache.
- * \p headers is a list of strings, each expected to contain
- * one line of the extra HTTP header to be passed to the request.
- * The header strings should not end with CRLF.
- *
- * muSE exceptions:
- *
- *	'fetch-uri:network-error uri
- *		Indicates a fundamental problem with connecting to the net.
- *		Allows you to replace the uri with a default file path.
- *
- *	'fetch-uri:bad-resource uri
- *		Indicates that the uri is either badly formatted or is
- *		referring to an invalid resource. In this case, you can
- *		continue by replacing the uri with either a file or a default
- *		uri that's known to work.
- *
- *	'fetch-uri:unsupported uri
- *		Indicates that the uri is not a http uri or of a type
- *		that can't be supported. In this case, you are allowed to 
- *		replace the uri with a file.
- *
- *	'fetch-uri:cache-failure uri
- *		Indicates a problem downloading the uri and storing it in
- *		the system cache. In this case, you're allowed to replace it with
- *		a file.
+ * @name HTTP client
  *
- * @note Supports \ref fn_the "the"
+ * Except for the cached downloads that WinInet does on Windows, fetch-uri
+ * talks HTTP/1.1 to the server itself. A connection whose response has been
+ * read to its end is kept open in a pool of the environment, keyed by host
+ * and port, for the next request to the same server. The pool holds up to
+ * MUSE_HTTP_POOL_MAX_IDLE connections, the least recently used going first,
+ * and closes those that have been idle for MUSE_HTTP_POOL_IDLE_TIMEOUT_US.
  */
-muse_cell fn_fetch_uri( muse_env *env, void *context, muse_cell args )
+/*@{*/
+
+static muse_cell http_parse( muse_port_t p );
+static muse_cell http_header_value( muse_env *env, muse_cell req, const muse_char *key );
+static muse_boolean http_header_has( muse_env *env, muse_cell req, const muse_char *key, const muse_char *token );
+
+enum
 {
-#ifdef MUSE_PLATFORM_WINDOWS
-	muse_trace_push( env, L"fetch-uri", MUSE_NIL, args );
-	{
-		muse_cell uri = muse_evalnext( env, &args );
-		muse_boolean cached = MUSE_TRUE;
-		muse_cell headers = MUSE_NIL;
-		muse_cell sym_refresh = muse_csymbol( env, L"refresh" );
-		while ( args ) {
-			muse_cell flag = muse_evalnext(env, &args);
-			if ( flag == sym_refresh ) {
-				cached = MUSE_FALSE;
-			} else if ( muse_cell_type(flag) == MUSE_CONS_CELL ) {
-				headers = flag;
-			}
-		}
-		
+	HTTP_HOST_MAX		= 256,
+	HTTP_RAW_SIZE		= 8192,
+	HTTP_MAX_REDIRECTS	= 5
+};
 
-		{
-			muse_cell result;
-			fetch_uri_args_t args;
-			args.uri = uri;
-			args.cached = cached;
-			args.mimePattern = NULL;
-			args.headers = headers;
+/**
+ * An idle connection in the pool.
+ */
+typedef struct _http_conn_t
+{
+	struct _http_conn_t	*next;
+	SOCKET				s;
+	char				host[HTTP_HOST_MAX];
+	short				port;
+	muse_int			idle_since_us;
+} http_conn_t;
+
+static void http_close_conn( muse_net_t *net, http_conn_t **pc )
+{
+	http_conn_t *c = *pc;
+	*pc = c->next;
+	closesocket( c->s );
+	free( c );
+	net->num_idle_conns--;
+}
 
-			result = muse_try( env, MUSE_NIL, (muse_nativefn_t)fetch_uri, &args, MUSE_NIL );
-			muse_trace_pop(env);
-			return muse_add_recent_item( env, (muse_int)fn_fetch_uri, result );
+/**
+ * Closes the pooled connections that have been idle for too long,
+ * and the least recently used ones beyond the first \p keep.
+ */
+static void http_pool_expire( muse_env *env, int keep )
+{
+	muse_net_t *net = env->net;
+	muse_int now_us = muse_elapsed_us(env->timer);
+	http_conn_t **pc = &net->idle_conns;
+	int n = 0;
+
+	while ( *pc )
+	{
+		if ( n >= keep || now_us - (*pc)->idle_since_us > env->parameters[MUSE_HTTP_POOL_IDLE_TIMEOUT_US] )
+			http_close_conn( net, pc );
+		else
+		{
+			++n;
+			pc = &(*pc)->next;
 		}
 	}
-#else
-	return muse_raise_error( env, _csymbol(L"error:not-implemented"), _cons( _csymbol(L"fetch-uri"), MUSE_NIL ) );
-#endif
 }
 
 /**
- * Shutsdown the socket API. No need to call this as its called
- * at GC time when the muse environment is destroyed.
+ * Takes an idle connection to the server out of the pool. Returns 
+ * INVALID_SOCKET if there is none. A connection that reads as ready
+ * while idle has been closed by the server, and is dropped.
  */
-static muse_cell fn_network_shutdown( muse_env *env, void *context, muse_cell args )
+static SOCKET http_pool_take( muse_env *env, const char *host, short port )
 {
-	free(env->net);
-	env->net = NULL;
-	muse_network_shutdown(env);
-	return MUSE_NIL;
-}
+	muse_net_t *net = env->net;
+	http_conn_t **pc = &net->idle_conns;
 
-static int http_readline( muse_port_t p, buffer_t *b, int limit )
-{
-	while ( !port_eof(p) && limit > 0 ) {
-		int c = port_getc(p);
-		if ( c == 0x0D ) {
-			c = port_getc(p);
-			if ( c == 0x0A )
-				return limit;
-			else {
-				buffer_putc( b, 0x0D );
-				--limit;
-			}
-		} else if ( c == 0x0A )
-			return limit;
-		else {
-			buffer_putc( b, (muse_char)c );
-			--limit;
-		}
-	}
-
-	return limit;
-}
-
-static int http_readheader( muse_port_t p, buffer_t *b, int limit )
-{
-	int count = 0;
-	while ( !port_eof(p) && limit > 3 ) {
-		int c = port_getc(p);
-		if ( c == 0x0D ) {
-			c = port_getc(p);
-			if ( c == 0x0A ) {
-				if ( count > 0 ) {
-					c = port_getc(p);
-					if ( c == ' ' || c == '\t' ) {
-						/* Continue. */
-						buffer_putc( b, 0x0D );
-						buffer_putc( b, 0x0A );
-						buffer_putc( b, c );
-						limit -= 3;
-						count += 3;
-					} else {
-						/* End of header. */
-						port_ungetc( c, p );
-						return limit;
-					}
-				} else {
-					/* New line reached right at start. */
-					return limit;
-				}
-			} else {
-				buffer_putc( b, 0x0D );
-				buffer_putc( b, c );
-				limit -= 2;
-				count += 2;
+	http_pool_expire( env, env->parameters[MUSE_HTTP_POOL_MAX_IDLE] );
+
+	while ( *pc )
+	{
+		http_conn_t *c = *pc;
+
+		if ( c->port == port && strcmp( c->host, host ) == 0 )
+		{
+			if ( socket_is_ready( c->s, MUSE_NET_READ ) )
+			{
+				http_close_conn( net, pc );
+				continue;
 			}
-		} else if ( c == 0x0A ) {
-			if ( count > 0 ) {
-				c = port_getc(p);
-				if ( c == ' ' || c == '\t' ) {
-					/* Continue. */
-					buffer_putc( b, 0x0A );
-					buffer_putc( b, c );
-					limit -= 2;
-					count += 2;
-				} else {
-					/* End of header. */
-					port_ungetc( c, p );
-					return limit;
-				}
-			} else {
-				/* New line reached right at start. */
-				return limit;
+			else
+			{
+				SOCKET s = c->s;
+				*pc = c->next;
+				free( c );
+				net->num_idle_conns--;
+				return s;
 			}
-		} else {
-			buffer_putc( b, c );
-			--limit;
-			++count;
 		}
+
+		pc = &c->next;
 	}
 
-	return (limit > 3) ? limit : 0;
+	return INVALID_SOCKET;
 }
 
-static int http_headerkey( buffer_t *b )
+static void http_pool_put( muse_env *env, SOCKET s, const char *host, short port )
 {
-	int len = buffer_length(b);
-	int i = 0;
-	while ( i < len ) {
-		muse_char c = buffer_char( b, i );
-		if ( c == ':' )
-			return i;
-		else
-			++i;
-	}
+	muse_net_t *net = env->net;
+	http_conn_t *c = (http_conn_t*)calloc( 1, sizeof(http_conn_t) );
+
+	c->s				= s;
+	c->port				= port;
+	c->idle_since_us	= muse_elapsed_us(env->timer);
+	strcpy( c->host, host );
 
-	return i;
+	c->next = net->idle_conns;
+	net->idle_conns = c;
+	net->num_idle_conns++;
+
+	http_pool_expire( env, env->parameters[MUSE_HTTP_POOL_MAX_IDLE] );
 }
 
-static int http_headerval( buffer_t *b, int colon_pos ) 
+typedef enum
 {
-	int len = buffer_length(b);
-	int i = colon_pos;
-	if ( buffer_char( b, i ) != ':' )
-		return len;
-	else {
-		++i;
-		while ( i < len ) {
-			muse_char c = buffer_char( b, i );
-			if ( c == ' ' || c == '\t' )
-				++i;
-			else 
-				return i;
-		}
-		return i;
-	}
-}
+	HTTP_BODY_HEADERS,	/**< The status line and headers are being read. */
+	HTTP_BODY_LENGTH,	/**< A body of known length. */
+	HTTP_BODY_CHUNKED,	/**< A body in chunked transfer encoding. */
+	HTTP_BODY_CLOSE,	/**< A body that ends when the server closes the connection. */
+	HTTP_BODY_DONE
+} http_framing_t;
 
-static int http_readword( buffer_t *in, int from, buffer_t *out )
+/**
+ * A port that reads an HTTP response off a connection. Once the headers
+ * have been read, it reads only the body, undoing its framing. The
+ * connection is read through a buffer under the port's own buffer, so 
+ * that nothing past the end of the body is taken into the port.
+ */
+typedef struct
 {
-	int inlen = buffer_length(in);
-	while ( from < inlen ) {
-		muse_char c = buffer_char( in, from );
-		if ( c == ' ' || c == '\t' || c == 0x0D || c == 0x0A ) {
-			while ( c == ' ' || c == '\t' || c == 0x0D || c == 0x0A ) {
-				++from;
-				if ( from+1 < inlen ) 
-					c = buffer_char( in, from );
-				else
-					return from;
-			}
-			return from;
-		} else {
-			buffer_putc( out, c );
-			++from;
-		}
+	socketport_t	sock;		/**< The connection. Must be first. */
+	char			host[HTTP_HOST_MAX];
+	short			port;
+	http_framing_t	framing;
+	muse_int		remaining;	/**< Bytes left of the body, or of the current chunk. */
+	muse_boolean	chunks_begun;
+	muse_boolean	keep_alive;	/**< Whether the connection can be reused after the body. */
+	muse_boolean	broken;		/**< Set if the connection ended before the body did. */
+	unsigned char	raw[HTTP_RAW_SIZE];
+	int				raw_pos, raw_avail;
+} http_body_port_t;
+
+static int http_raw_fill( http_body_port_t *b )
+{
+	if ( b->raw_avail == 0 && b->sock.socket )
+	{
+		b->raw_pos = 0;
+		b->raw_avail = (int)socket_read( b->raw, sizeof(b->raw), &b->sock );
 	}
 
-	return from;
+	return b->raw_avail;
 }
 
-static void lowercase_text( muse_env *env, muse_cell text )
+static int http_raw_getc( http_body_port_t *b )
 {
-	int len = 0;
-	muse_char *str = (muse_char*)muse_text_contents( env, text, &len );
-	int i = 0;
-	for ( i = 0; i < len; ++i ) {
-		muse_char c = str[i];
-		if ( c >= 'A' && c <= 'Z' )
-			str[i] = (c - 'A') + 'a';
-	}
-}
+	if ( http_raw_fill(b) == 0 )
+		return EOF;
 
-muse_cell fn_symbol( muse_env *env, void *context, muse_cell args );
+	--(b->raw_avail);
+	return b->raw[b->raw_pos++];
+}
 
-static muse_cell http_parse( muse_port_t p )
+static size_t http_raw_read( http_body_port_t *b, void *buffer, size_t nbytes )
 {
-	muse_env *env = p->env;
-
-	int sp = _spos();
-	buffer_t *reqline = buffer_alloc();
-	if ( http_readline( p, reqline, 4096 ) > 0 ) {
-		muse_cell req = MUSE_NIL;
+	size_t n;
 
-		/* Parse the request line into its components. */
-		{
-			muse_cell get_or_post, url, ver;
-			buffer_t *word = buffer_alloc();
-			int nextWord = http_readword( reqline, 0, word );
-			get_or_post = buffer_to_symbol( word, env );
-			buffer_free(word); word = buffer_alloc();
-			nextWord = http_readword( reqline, nextWord, word );
-			url = buffer_to_string( word, env );
-			buffer_free(word); word = buffer_alloc();
-			nextWord = http_readword( reqline, nextWord, word );
-			ver = buffer_to_string( word, env );
-			buffer_free(word);
-			req = muse_cons( env, muse_list( env, "ccc", get_or_post, url, ver ), MUSE_NIL );
-			_unwind(sp);
-			_spush(req);
-		}
+	/* Large reads needn't go through the buffer. */
+	if ( b->raw_avail == 0 && nbytes >= sizeof(b->raw) )
+		return b->sock.socket ? socket_read( buffer, nbytes, &b->sock ) : 0;
 
-		buffer_free(reqline);
+	if ( http_raw_fill(b) == 0 )
+		return 0;
 
+	n = nbytes < (size_t)b->raw_avail ? nbytes : (size_t)b->raw_avail;
+	memcpy( buffer, b->raw + b->raw_pos, n );
+	b->raw_pos += (int)n;
+	b->raw_avail -= (int)n;
+	return n;
+}
+
+static int http_hex_digit( int c )
+{
+	if ( c >= '0' && c <= '9' ) return c - '0';
+	if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+	if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * Reads the end of the previous chunk and the size line of the next one. 
+ * After the last chunk, which is empty, the trailer is skipped. Returns
+ * MUSE_FALSE at the end of the body.
+ */
+static muse_boolean http_next_chunk( http_body_port_t *b )
+{
+	muse_int size = 0;
+	int digits = 0, c, d;
+
+	if ( b->chunks_begun )
+	{
+		while ( (c = http_raw_getc(b)) != EOF && c != 0x0A )
+			;
+	}
+
+	b->chunks_begun = MUSE_TRUE;
+
+	while ( (d = http_hex_digit( c = http_raw_getc(b) )) >= 0 )
+	{
+		size = size * 16 + d;
+		++digits;
+	}
+
+	/* Skip any chunk extensions. */
+	while ( c != EOF && c != 0x0A )
+		c = http_raw_getc(b);
+
+	if ( c == EOF || digits == 0 )
+	{
+		b->broken = MUSE_TRUE;
+		return MUSE_FALSE;
+	}
+
+	if ( size == 0 )
+	{
+		/* Skip the trailer, up to the empty line that ends it. */
+		int len;
+		do
+		{
+			len = 0;
+			while ( (c = http_raw_getc(b)) != EOF && c != 0x0A )
+			{
+				if ( c != 0x0D )
+					++len;
+			}
+		}
+		while ( c != EOF && len > 0 );
+
+		if ( c == EOF )
+			b->broken = MUSE_TRUE;
+
+		return MUSE_FALSE;
+	}
+
+	b->remaining = size;
+	return MUSE_TRUE;
+}
+
+/**
+ * Called at the end of the body. The connection goes back to the
+ * pool if it can be reused, and is closed otherwise.
+ */
+static void http_body_done( http_body_port_t *b )
+{
+	muse_env *env = b->sock.base.env;
+
+	b->framing = HTTP_BODY_DONE;
+
+	if ( b->sock.socket )
+	{
+		if ( b->keep_alive && !b->broken && b->raw_avail == 0 && env->net )
+			http_pool_put( env, b->sock.socket, b->host, b->port );
+		else
+			closesocket( b->sock.socket );
+
+		b->sock.socket = 0;
+	}
+}
+
+static size_t http_body_read( void *buffer, size_t nbytes, void *p )
+{
+	http_body_port_t *b = (http_body_port_t*)p;
+	size_t n;
+
+	switch ( b->framing )
+	{
+		case HTTP_BODY_HEADERS:
+		case HTTP_BODY_CLOSE:
+			return http_raw_read( b, buffer, nbytes );
+
+		case HTTP_BODY_CHUNKED:
+			if ( b->remaining == 0 && !http_next_chunk(b) )
+			{
+				http_body_done(b);
+				return 0;
+			}
+			/* Fall through. */
+
+		case HTTP_BODY_LENGTH:
+			if ( b->remaining == 0 )
+			{
+				http_body_done(b);
+				return 0;
+			}
+
+			n = http_raw_read( b, buffer, (muse_int)nbytes < b->remaining ? nbytes : (size_t)b->remaining );
+			if ( n == 0 )
+			{
+				b->broken = MUSE_TRUE;
+				http_body_done(b);
+				return 0;
+			}
+
+			b->remaining -= n;
+
+			/* Let the connection go as soon as the body has been read. */
+			if ( b->remaining == 0 && b->framing == HTTP_BODY_LENGTH )
+				http_body_done(b);
+
+			return n;
+
+		default:
+			return 0;
+	}
+}
+
+static void http_body_close( void *p )
+{
+	http_body_port_t *b = (http_body_port_t*)p;
+
+	/* Closing before the end of the body leaves 
+	the connection unusable for another request. */
+	b->framing = HTTP_BODY_DONE;
+
+	if ( b->sock.socket )
+		socket_close( p );
+	else
+		port_destroy( (muse_port_t)p );
+}
+
+static void http_body_destroy( muse_env *env, void *p )
+{
+	http_body_close(p);
+	port_destroy( (muse_port_t)p );
+}
+
+static muse_port_type_t g_http_body_type =
+{
+	{
+		'muSE',
+		'port',
+		sizeof(http_body_port_t),
+		NULL,
+		NULL,
+		socket_init,
+		NULL,
+		http_body_destroy,
+		NULL
+	},
+	
+	http_body_close,
+	http_body_read,
+	NULL,
+	socket_flush,
+	NULL
+};
+
+/**
+ * Splits an http:// uri into its host, port and the rest, which
+ * is the path. Returns MUSE_FALSE if it isn't such a uri.
+ */
+static muse_boolean http_split_uri( const char *uri, char *host, short *port, const char **path )
+{
+	const char *h = uri + 7, *e;
+
+	if ( strncmp( uri, "http://", 7 ) != 0 )
+		return MUSE_FALSE;
+
+	for ( e = h; *e && *e != ':' && *e != '/' && *e != '?' && *e != '#'; ++e )
+		;
+
+	if ( e == h || e - h >= HTTP_HOST_MAX )
+		return MUSE_FALSE;
+
+	memcpy( host, h, e - h );
+	host[e - h] = '\0';
+	*port = 80;
+
+	if ( *e == ':' )
+	{
+		int n = 0;
+		for ( ++e; *e >= '0' && *e <= '9'; ++e )
+			n = n * 10 + (*e - '0');
+		*port = (short)n;
+	}
+
+	*path = e;
+	return MUSE_TRUE;
+}
+
+/**
+ * Sends a GET request for the path, with the given extra header lines,
+ * in a single write.
+ */
+static muse_boolean http_send_request( muse_env *env, http_body_port_t *b, const char *path, muse_cell headers )
+{
+	size_t path_len = strcspn( path, "#" );
+	size_t size = path_len + strlen(b->host) + 128, n;
+	muse_cell h;
+	char *req;
+	muse_boolean sent;
+
+	for ( h = headers; h; h = _tail(h) )
+	{
+		int sp = _spos();
+		while ( _cellt(_head(h)) != MUSE_TEXT_CELL )
+		{
+			_seth( h, muse_raise_error( env, _csymbol(L"fetch-uri:bad-header"), _cons( _head(h), MUSE_NIL ) ) );
+			_unwind(sp);
+		}
+
+		{
+			int len = 0;
+			const muse_char *line = muse_text_contents( env, _head(h), &len );
+			size += muse_utf8_size( line, len ) + 2;
+		}
+	}
+
+	req = (char*)malloc( size );
+
+	n = _snprintf( req, size, "GET %s%.*s HTTP/1.1\r\nHost: %s", path[0] == '/' ? "" : "/", (int)path_len, path, b->host );
+	if ( b->port != 80 )
+		n += _snprintf( req + n, size - n, ":%d", (int)(unsigned short)b->port );
+	n += _snprintf( req + n, size - n, "\r\nUser-Agent: muSE\r\n" );
+
+	for ( h = headers; h; h = _tail(h) )
+	{
+		int len = 0;
+		const muse_char *line = muse_text_contents( env, _head(h), &len );
+		n += muse_unicode_to_utf8( req + n, size - n, line, len );
+		req[n++] = '\x0d';
+		req[n++] = '\x0a';
+	}
+
+	req[n++] = '\x0d';
+	req[n++] = '\x0a';
+
+	sent = socket_write( req, n, &b->sock ) == n ? MUSE_TRUE : MUSE_FALSE;
+	free( req );
+	return sent;
+}
+
+/**
+ * Works out from the response headers how the body is framed and
+ * whether the connection can be reused. Returns the status code.
+ */
+static int http_begin_body( muse_env *env, http_body_port_t *b, muse_cell resp )
+{
+	muse_cell status_line = _head(resp);
+	const muse_char *ver = muse_symbol_name( env, _head(status_line) );
+	const muse_char *code = muse_text_contents( env, _head(_tail(status_line)), NULL );
+	muse_cell length = http_header_value( env, resp, L"content-length" );
+	int status = 0;
+
+	for ( ; *code >= '0' && *code <= '9'; ++code )
+		status = status * 10 + (*code - '0');
+
+	if ( wcscmp( ver, L"HTTP/1.1" ) == 0 )
+		b->keep_alive = http_header_has( env, resp, L"connection", L"close" ) ? MUSE_FALSE : MUSE_TRUE;
+	else
+		b->keep_alive = http_header_has( env, resp, L"connection", L"keep-alive" );
+
+	if ( status / 100 == 1 || status == 204 || status == 304 )
+	{
+		/* No body. An interim response is followed by another, so the
+		connection isn't reused in that case. */
+		b->framing = HTTP_BODY_LENGTH;
+		b->remaining = 0;
+		if ( status / 100 == 1 )
+			b->keep_alive = MUSE_FALSE;
+	}
+	else if ( http_header_has( env, resp, L"transfer-encoding", L"chunked" ) )
+	{
+		b->framing = HTTP_BODY_CHUNKED;
+		b->remaining = 0;
+	}
+	else if ( length )
+	{
+		const muse_char *s = muse_text_contents( env, length, NULL );
+		b->framing = HTTP_BODY_LENGTH;
+		b->remaining = 0;
+		for ( ; *s >= '0' && *s <= '9'; ++s )
+			b->remaining = b->remaining * 10 + (*s - '0');
+	}
+	else
+	{
+		b->framing = HTTP_BODY_CLOSE;
+		b->keep_alive = MUSE_FALSE;
+	}
+
+	/* What the port has buffered past the headers is part 
+	of the body, and has to be read through the framing. */
+	{
+		int avail = 0;
+		const unsigned char *bytes = port_buffered( (muse_port_t)b, &avail );
+
+		memmove( b->raw + avail, b->raw + b->raw_pos, b->raw_avail );
+		memcpy( b->raw, bytes, avail );
+		b->raw_pos = 0;
+		b->raw_avail += avail;
+		port_consume( avail, (muse_port_t)b );
+	}
+
+	if ( b->framing == HTTP_BODY_LENGTH && b->remaining == 0 )
+		http_body_done(b);
+
+	return status;
+}
+
+/**
+ * Sends a GET request to the server, over a pooled connection if there
+ * is one, and reads the response headers into \p resp. Returns the port
+ * to read the body of the response from, with the status code in
+ * \p status, or MUSE_NIL if the server couldn't be reached.
+ */
+static muse_cell http_get( muse_env *env, const char *host, short port, const char *path, muse_cell headers, muse_cell *resp, int *status )
+{
+	int sp = _spos();
+	int attempt;
+
+	for ( attempt = 0; attempt < 2; ++attempt )
+	{
+		muse_cell portcell = _mk_functional_object( &g_http_body_type.obj, MUSE_NIL );
+		http_body_port_t *b = (http_body_port_t*)_port(portcell);
+		SOCKET s = attempt == 0 ? http_pool_take( env, host, port ) : INVALID_SOCKET;
+		muse_boolean reused = (s != INVALID_SOCKET) ? MUSE_TRUE : MUSE_FALSE;
+
+		if ( !reused )
+			s = connect_to_server( env, host, port, &b->sock.address );
+
+		if ( s == INVALID_SOCKET )
+			break;
+
+		b->sock.socket		= s;
+		b->sock.base.mode	= MUSE_PORT_READ;
+		b->port				= port;
+		strcpy( b->host, host );
+
+		if ( http_send_request( env, b, path, headers ) && (*resp = http_parse( (muse_port_t)b )) )
+		{
+			*status = http_begin_body( env, b, *resp );
+			_unwind(sp);
+			_spush(*resp);
+			_spush(portcell);
+			return portcell;
+		}
+
+		port_close( (muse_port_t)b );
+		_unwind(sp);
+
+		/* A fresh connection that fails won't do better the second time. If a 
+		pooled one fails, the server probably closed it just as it was reused. */
+		if ( !reused )
+			break;
+	}
+
+	return MUSE_NIL;
+}
+
+#ifndef MUSE_PLATFORM_WINDOWS
+/**
+ * Puts the path of the cache file for the uri, with the given
+ * extension, in \p file.
+ */
+static void http_cache_file( const char *uri, const char *ext, char *file, size_t size )
+{
+	const char *dir = getenv("TMPDIR");
+	unsigned long long hash = 14695981039346656037ULL;
+	const unsigned char *u;
+
+	for ( u = (const unsigned char*)uri; *u; ++u )
+		hash = (hash ^ *u) * 1099511628211ULL;
+
+	snprintf( file, size, "%s/muse-fetch-cache/%016llx.%s", (dir && dir[0]) ? dir : "/tmp", hash, ext );
+}
+
+/**
+ * Puts in \p ext the extension of the cached file for a resource of the
+ * given MIME type, chosen as on Windows, where the system's cache is used.
+ * Returns the number of candidate extensions written to \p ext when
+ * \p mime is NULL, for looking up a cached file.
+ */
+static int http_cache_exts( const char *path, const muse_char *mime, char ext[][8] )
+{
+	static const struct { const muse_char *mime; const char *ext; } k_mime_exts[] =
+	{
+		{ L"text", "txt" }, { L"xml", "xml" }, { L"image/jpeg", "jpg" }, { L"image/png", "png" }, { L"image/gif", "gif" }
+	};
+	const char *end = path + strcspn( path, "?#" ), *dot = NULL, *c;
+	int i, n = 0;
+
+	for ( c = path; c < end; ++c )
+	{
+		if ( *c == '.' )
+			dot = c;
+		else if ( *c == '/' )
+			dot = NULL;
+	}
+
+	for ( i = 0; i < (int)(sizeof(k_mime_exts)/sizeof(k_mime_exts[0])); ++i )
+	{
+		if ( mime == NULL )
+			strcpy( ext[n++], k_mime_exts[i].ext );
+		else if ( wcsstr( mime, k_mime_exts[i].mime ) )
+		{
+			strcpy( ext[0], k_mime_exts[i].ext );
+			return 1;
+		}
+	}
+
+	if ( dot && end - dot > 1 && end - dot <= 6 )
+	{
+		memcpy( ext[n], dot + 1, end - dot - 1 );
+		ext[n++][end - dot - 1] = '\0';
+	}
+
+	if ( mime == NULL || n == 0 )
+		strcpy( ext[n++], "bin" );
+
+	return n;
+}
+
+/**
+ * Looks for a cached copy of the uri. Returns MUSE_TRUE
+ * with its path in \p file if there is one.
+ */
+static muse_boolean http_cache_lookup( const char *uri, const char *path, char *file, size_t size )
+{
+	char ext[8][8];
+	int i, n = http_cache_exts( path, NULL, ext );
+
+	for ( i = 0; i < n; ++i )
+	{
+		http_cache_file( uri, ext[i], file, size );
+		if ( access( file, R_OK ) == 0 )
+			return MUSE_TRUE;
+	}
+
+	return MUSE_FALSE;
+}
+
+/**
+ * Saves the body of the response to the cache file for the uri,
+ * returning the path of the file, or MUSE_NIL if it couldn't.
+ */
+static muse_cell http_cache_save( muse_env *env, const char *uri, const char *path, muse_cell resp, muse_cell portcell )
+{
+	http_body_port_t *b = (http_body_port_t*)_port(portcell);
+	muse_cell mime = http_header_value( env, resp, L"content-type" );
+	char ext[8][8], file[1024], part[1040];
+	unsigned char buffer[16384];
+	muse_boolean ok = MUSE_TRUE;
+	size_t n;
+	int fd;
+	FILE *f;
+
+	http_cache_exts( path, mime ? muse_text_contents( env, mime, NULL ) : L"", ext );
+	http_cache_file( uri, ext[0], file, sizeof(file) );
+
+	/* The file is written under another name and renamed into
+	place when complete, so that a partial file is never found. */
+	*strrchr( file, '/' ) = '\0';
+	mkdir( file, 0700 );
+	file[strlen(file)] = '/';
+	snprintf( part, sizeof(part), "%s.XXXXXX", file );
+
+	fd = mkstemp( part );
+	f = fd >= 0 ? fdopen( fd, "wb" ) : NULL;
+	if ( !f )
+	{
+		if ( fd >= 0 )
+			close( fd );
+		port_close( (muse_port_t)b );
+		return MUSE_NIL;
+	}
+
+	while ( ok && (n = port_read( buffer, sizeof(buffer), (muse_port_t)b )) > 0 )
+		ok = fwrite( buffer, 1, n, f ) == n ? MUSE_TRUE : MUSE_FALSE;
+
+	ok = (ok && !b->broken && fclose(f) == 0) ? MUSE_TRUE : MUSE_FALSE;
+	port_close( (muse_port_t)b );
+
+	if ( !ok || rename( part, file ) != 0 )
+	{
+		unlink( part );
+		return MUSE_NIL;
+	}
+
+	return muse_mk_ctext_utf8( env, file );
+}
+#endif
+
+typedef struct
+{
+	muse_cell		uri;
+	muse_boolean	cached;
+	muse_boolean	stream;
+	muse_cell		headers;
+	int				redirects;
+} http_fetch_args_t;
+
+/**
+ * fetch-uri over the HTTP client. Returns the port to read the body from
+ * if args->stream is set, and the path of the cached copy otherwise.
+ * Redirections are followed.
+ */
+static muse_cell http_fetch( muse_env *env, http_fetch_args_t *args, muse_cell unused )
+{
+	muse_cell uri = args->uri;
+	int len = 0;
+	const muse_char *uri_str = muse_text_contents( env, uri, &len );
+	size_t size = muse_utf8_size( uri_str, len ) + 1;
+	char *u = (char*)malloc( size );
+	char host[HTTP_HOST_MAX];
+	const char *path = NULL;
+	short port = 80;
+	muse_cell resp = MUSE_NIL, portcell;
+	int status = 0;
+
+	muse_unicode_to_utf8( u, size, uri_str, len );
+	u[size-1] = '\0';
+
+	if ( !http_split_uri( u, host, &port, &path ) )
+	{
+		free( u );
+
+		/* A local file stands for itself. */
+		if ( !args->stream && wcsstr( uri_str, L"://" ) == NULL )
+			return uri;
+
+		return muse_raise_error( env, _csymbol(L"fetch-uri:unsupported"), uri );
+	}
+
+#ifndef MUSE_PLATFORM_WINDOWS
+	if ( !args->stream && args->cached )
+	{
+		char file[1024];
+		if ( http_cache_lookup( u, path, file, sizeof(file) ) )
+		{
+			free( u );
+			return muse_mk_ctext_utf8( env, file );
+		}
+	}
+#endif
+
+	portcell = http_get( env, host, port, path, args->headers, &resp, &status );
+
+	if ( !portcell )
+	{
+		free( u );
+		return muse_raise_error( env, _csymbol(L"fetch-uri:network-error"), uri );
+	}
+
+	if ( status / 100 == 3 && args->redirects < HTTP_MAX_REDIRECTS )
+	{
+		muse_cell location = http_header_value( env, resp, L"location" );
+
+		if ( location )
+		{
+			const muse_char *loc = muse_text_contents( env, location, NULL );
+
+			port_close( _port(portcell) );
+
+			if ( loc[0] == '/' )
+			{
+				/* Relative to the server. */
+				size_t loc_size = muse_utf8_size( loc, (int)wcslen(loc) );
+				char *target = (char*)malloc( HTTP_HOST_MAX + 32 + loc_size );
+				int n = _snprintf( target, HTTP_HOST_MAX + 32, "http://%s:%d", host, (int)(unsigned short)port );
+				n += (int)muse_unicode_to_utf8( target + n, loc_size + 1, loc, wcslen(loc) );
+				target[n] = '\0';
+				args->uri = muse_mk_ctext_utf8( env, target );
+				free( target );
+			}
+			else
+				args->uri = location;
+
+			free( u );
+			args->redirects++;
+			return http_fetch( env, args, unused );
+		}
+	}
+
+	if ( status < 200 || status >= 300 )
+	{
+		free( u );
+		port_close( _port(portcell) );
+		return muse_raise_error( env, _csymbol(L"fetch-uri:bad-resource"), uri );
+	}
+
+	if ( args->stream )
+	{
+		free( u );
+		return portcell;
+	}
+
+#ifndef MUSE_PLATFORM_WINDOWS
+	{
+		muse_cell file = http_cache_save( env, u, path, resp, portcell );
+		free( u );
+		return file ? file : muse_raise_error( env, _csymbol(L"fetch-uri:cache-failure"), uri );
+	}
+#else
+	free( u );
+	port_close( _port(portcell) );
+	return muse_raise_error( env, _csymbol(L"error:not-implemented"), _cons( _csymbol(L"fetch-uri"), MUSE_NIL ) );
+#endif
+}
+/*@}*/
+
+/**
+ * Usage: (fetch-uri uri ['refresh] ['stream] [headers])
+ *
+ * Evaluates to the cached local file path for the uri.
+ * If 'refresh is passed, then it downloads the uri again if it
+ * is out of date, even if it is already in the cache.
+ * If 'stream is passed, then it evaluates to a port from which the
+ * body of the resource can be read as it arrives instead, so that a 
+ * large download needn't be held anywhere. The connection goes back to
+ * the pool for reuse once the body has been read to its end.
+ * \p headers is a list of strings, each expected to contain
+ * one line of the extra HTTP header to be passed to the request.
+ * The header strings should not end with CRLF.
+ *
+ * Connections to a server are kept open and reused for later requests
+ * to it - see MUSE_HTTP_POOL_MAX_IDLE and MUSE_HTTP_POOL_IDLE_TIMEOUT_US.
+ * On Windows, cached downloads are done by the system, which
+ * pools connections by itself.
+ *
+ * muSE exceptions:
+ *
+ *	'fetch-uri:network-error uri
+ *		Indicates a fundamental problem with connecting to the net.
+ *		Allows you to replace the uri with a default file path.
+ *
+ *	'fetch-uri:bad-resource uri
+ *		Indicates that the uri is either badly formatted or is
+ *		referring to an invalid resource. In this case, you can
+ *		continue by replacing the uri with either a file or a default
+ *		uri that's known to work. Except for cached downloads on 
+ *		Windows, the value you continue with is the result as it is 
+ *		and isn't fetched, so give a file, or a port for 'stream.
+ *
+ *	'fetch-uri:unsupported uri
+ *		Indicates that the uri is not a http uri or of a type
+ *		that can't be supported. In this case, you are allowed to 
+ *		replace the uri with a file, or with a port for 'stream.
+ *
+ *	'fetch-uri:cache-failure uri
+ *		Indicates a problem downloading the uri and storing it in
+ *		the system cache. In this case, you're allowed to replace it with
+ *		a file.
+ *
+ * @note Supports \ref fn_the "the"
+ */
+muse_cell fn_fetch_uri( muse_env *env, void *context, muse_cell args )
+{
+	muse_trace_push( env, L"fetch-uri", MUSE_NIL, args );
+	{
+		muse_cell uri = muse_evalnext( env, &args );
+		muse_boolean cached = MUSE_TRUE;
+		muse_boolean stream = MUSE_FALSE;
+		muse_cell headers = MUSE_NIL;
+		muse_cell sym_refresh = muse_csymbol( env, L"refresh" );
+		muse_cell sym_stream = muse_csymbol( env, L"stream" );
+		while ( args ) {
+			muse_cell flag = muse_evalnext(env, &args);
+			if ( flag == sym_refresh ) {
+				cached = MUSE_FALSE;
+			} else if ( flag == sym_stream ) {
+				stream = MUSE_TRUE;
+			} else if ( muse_cell_type(flag) == MUSE_CONS_CELL ) {
+				headers = flag;
+			}
+		}
+		
+		{
+			muse_cell result;
+
+#ifdef MUSE_PLATFORM_WINDOWS
+			if ( !stream )
+			{
+				fetch_uri_args_t args;
+				args.uri = uri;
+				args.cached = cached;
+				args.mimePattern = NULL;
+				args.headers = headers;
+
+				result = muse_try( env, MUSE_NIL, (muse_nativefn_t)fetch_uri, &args, MUSE_NIL );
+			}
+			else
+#endif
+			{
+				http_fetch_args_t args;
+				args.uri = uri;
+				args.cached = cached;
+				args.stream = stream;
+				args.headers = headers;
+				args.redirects = 0;
+
+				result = muse_try( env, MUSE_NIL, (muse_nativefn_t)http_fetch, &args, MUSE_NIL );
+			}
+
+			muse_trace_pop(env);
+			return muse_add_recent_item( env, (muse_int)fn_fetch_uri, result );
+		}
+	}
+}
+
+/**
+ * Shutsdown the socket API. No need to call this as its called
+ * at GC time when the muse environment is destroyed.
+ */
+static muse_cell fn_network_shutdown( muse_env *env, void *context, muse_cell args )
+{
+#ifndef MUSE_PLATFORM_WINDOWS
+	if ( env->net->poller >= 0 )
+		close( env->net->poller );
+#endif
+	while ( env->net->idle_conns )
+		http_close_conn( env->net, &env->net->idle_conns );
+	free(env->net->watches);
+	free(env->net);
+	env->net = NULL;
+	muse_network_shutdown(env);
+	return MUSE_NIL;
+}
+
+/**
+ * Finds the next line of input in the port's buffer, reading more
+ * as needed, so that it can be parsed in place. Returns the bytes that
+ * start with the line, which stay valid until the port is next read from,
+ * and sets \p len to the length of the line without its line ending and
+ * \p eol_len to the length of the line ending. A line that doesn't fit
+ * in the buffer is cut short. Returns NULL at the end of the input.
+ */
+static const unsigned char *http_line( muse_port_t p, int *len, int *eol_len )
+{
+	int scanned = 0;
+
+	for ( ;; )
+	{
+		int avail = 0;
+		const unsigned char *bytes = port_buffered( p, &avail );
+		const unsigned char *nl = (avail > scanned) ? (const unsigned char*)memchr( bytes + scanned, 0x0A, avail - scanned ) : NULL;
+
+		if ( nl )
 		{
-			muse_cell reqlast = req;
-			
-			/* Parse each header and append to the list. */
-			reqline = buffer_alloc();
-			while ( http_readheader( p, reqline, 4096 ) > 0 ) {
-				int len = buffer_length(reqline);
-				if ( len > 0 ) {
-					/* Valid header line read in. */
-					int pos = http_headerkey(reqline);
-					if ( pos < len ) {
-						muse_cell header = buffer_substring( reqline, env, 0, pos );
-						muse_cell value;
-						lowercase_text( env, header );
-						pos = http_headerval( reqline, pos );
-						value = buffer_substring( reqline, env, pos, len - pos );
-						header = _cons( _cons( fn_symbol( env, NULL, _cons(header,MUSE_NIL) ), value ), MUSE_NIL );
-						_sett( reqlast, header );
-						reqlast = header;
-						_unwind(sp);
-						_spush(req);
-						buffer_free(reqline);
-						reqline = buffer_alloc();
-					} else {
-						break;
-					}
-				} else {
-					/* Current read position is end of all headers 
-					   including the trailing extra newline. */
-					break;
-				}
+			*len = (int)(nl - bytes);
+			*eol_len = 1;
+			if ( *len > 0 && bytes[*len - 1] == 0x0D )
+			{
+				--(*len);
+				++(*eol_len);
 			}
+			return bytes;
+		}
+
+		scanned = avail;
 
-			buffer_free(reqline);
-			return req;
+		if ( port_buffer_more(p) == 0 )
+		{
+			/* End of input, or the line is too long - just take what there is. */
+			*len = avail;
+			*eol_len = 0;
+			return avail > 0 ? port_buffered( p, &avail ) : NULL;
 		}
-	} else {
-		buffer_free(reqline);
+	}
+}
+
+static muse_boolean http_space( int c )
+{
+	return (c == ' ' || c == '\t') ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/**
+ * Makes a text cell out of the given bytes, each of which is taken to be
+ * a character, as HTTP headers are ISO-8859-1.
+ */
+static muse_cell http_text( muse_env *env, const unsigned char *bytes, int len )
+{
+	muse_cell text = muse_mk_text( env, NULL, ((const muse_char *)NULL) + len );
+	muse_char *str = (muse_char*)muse_text_contents( env, text, NULL );
+	int i;
+
+	for ( i = 0; i < len; ++i )
+		str[i] = bytes[i];
+
+	return text;
+}
+
+/**
+ * Makes a symbol out of the given bytes, lowercased if \p lower is MUSE_TRUE.
+ */
+static muse_cell http_symbol( muse_env *env, const unsigned char *bytes, int len, muse_boolean lower )
+{
+	muse_char name[64] = {0};
+	muse_char *str = len <= 64 ? name : (muse_char*)malloc( len * sizeof(muse_char) );
+	muse_cell sym;
+	int i;
+
+	if ( !str )
+		return muse_raise_error( env, _csymbol(L"error:out-of-memory"), _cons( _mk_int(len), MUSE_NIL ) );
+
+	for ( i = 0; i < len; ++i )
+	{
+		muse_char c = bytes[i];
+		str[i] = (lower && c >= 'A' && c <= 'Z') ? (c - 'A') + 'a' : c;
+	}
+
+	sym = muse_symbol( env, str, str + len );
+
+	if ( str != name )
+		free( str );
+
+	return sym;
+}
+
+/**
+ * Finds the next word in the bytes starting at \p *pos, and moves \p *pos
+ * past it. Returns the length of the word.
+ */
+static int http_word( const unsigned char *bytes, int len, int *pos, int *start )
+{
+	int i = *pos;
+
+	while ( i < len && http_space(bytes[i]) )
+		++i;
+
+	*start = i;
+
+	while ( i < len && !http_space(bytes[i]) )
+		++i;
+
+	*pos = i;
+	return i - *start;
+}
+
+/**
+ * Parses the header line and appends it to the list after \p last,
+ * or adds it to the value of \p last if it continues that header.
+ * Returns the last cell of the list, or MUSE_NIL if the line isn't 
+ * a header.
+ */
+static muse_cell http_header( muse_env *env, const unsigned char *line, int len, muse_cell last )
+{
+	int colon = 0, from, to = len;
+
+	while ( to > 0 && http_space(line[to-1]) )
+		--to;
+
+	if ( http_space(line[0]) )
+	{
+		/* A folded header. Replace the fold with a space. */
+		muse_cell header = _head(last);
+		muse_cell prev = _tail(header);
+		int prev_len = 0, i;
+		const muse_char *prev_str = muse_text_contents( env, prev, &prev_len );
+		muse_cell value;
+		muse_char *str;
+
+		for ( from = 0; from < to && http_space(line[from]); ++from )
+			;
+
+		value = muse_mk_text( env, NULL, ((const muse_char *)NULL) + prev_len + 1 + (to - from) );
+		str = (muse_char*)muse_text_contents( env, value, NULL );
+		memcpy( str, prev_str, prev_len * sizeof(muse_char) );
+		str[prev_len] = ' ';
+		for ( i = from; i < to; ++i )
+			str[prev_len + 1 + i - from] = line[i];
+
+		_sett( header, value );
+		return last;
+	}
+
+	while ( colon < len && line[colon] != ':' )
+		++colon;
+
+	if ( colon == len )
+		return MUSE_NIL;
+
+	for ( from = colon + 1; from < to && http_space(line[from]); ++from )
+		;
+
+	{
+		muse_cell header = _cons( _cons( http_symbol( env, line, colon, MUSE_TRUE ), http_text( env, line + from, to - from ) ), MUSE_NIL );
+		_sett( last, header );
+		return header;
+	}
+}
+
+/**
+ * Parses a request off the port, reading the headers in place in the
+ * port's buffer. Empty lines before the request line are skipped, as
+ * clients may send them after the body of the previous request.
+ */
+static muse_cell http_parse( muse_port_t p )
+{
+	muse_env *env = p->env;
+	int sp = _spos();
+	const unsigned char *line;
+	int len = 0, eol_len = 0;
+	muse_cell req, last;
+
+	while ( (line = http_line( p, &len, &eol_len )) && len == 0 && eol_len > 0 )
+		port_consume( eol_len, p );
+
+	if ( !line )
 		return MUSE_NIL;
+
+	/* Parse the request line into its components. */
+	{
+		int pos = 0, start = 0, n;
+		muse_cell get_or_post, url, ver;
+
+		n = http_word( line, len, &pos, &start );
+		get_or_post = http_symbol( env, line + start, n, MUSE_FALSE );
+		n = http_word( line, len, &pos, &start );
+		url = http_text( env, line + start, n );
+		n = http_word( line, len, &pos, &start );
+		ver = http_text( env, line + start, n );
+		req = muse_cons( env, muse_list( env, "ccc", get_or_post, url, ver ), MUSE_NIL );
+		_unwind(sp);
+		_spush(req);
+		port_consume( len + eol_len, p );
+	}
+
+	/* Parse each header and append to the list. */
+	last = req;
+	while ( (line = http_line( p, &len, &eol_len )) && len > 0 )
+	{
+		muse_cell header = (last == req && http_space(line[0])) ? MUSE_NIL : http_header( env, line, len, last );
+
+		if ( !header )
+			break;
+
+		port_consume( len + eol_len, p );
+		last = header;
+		_unwind(sp);
+		_spush(req);
 	}
+
+	/* The blank line that ends the headers. */
+	if ( line && len == 0 )
+		port_consume( eol_len, p );
+
+	return req;
 }
 
 /**
@@ -1667,8 +3805,229 @@ muse_cell fn_http_parse( muse_env *env, void *context, muse_cell args )
 {
 	muse_cell pcell = _evalnext(&args);
 	muse_port_t p = _port(pcell);
+	int arena = muse_begin_text_arena(env);
+	muse_cell result = http_parse(p);
+	muse_end_text_arena( env, arena );
+
+	return muse_add_recent_item( env, (muse_int)fn_http_parse, result );
+}
+
+/**
+ * Returns the value of the header \p key of the request, or MUSE_NIL.
+ */
+static muse_cell http_header_value( muse_env *env, muse_cell req, const muse_char *key )
+{
+	muse_cell sym = _csymbol(key);
+	muse_cell headers = _tail(req);
+
+	for ( ; headers; headers = _tail(headers) )
+	{
+		muse_cell h = _head(headers);
+		if ( _head(h) == sym )
+			return _tail(h);
+	}
+
+	return MUSE_NIL;
+}
+
+/**
+ * Returns MUSE_TRUE if \p token is one of the comma separated
+ * tokens of the header \p key of the request, ignoring case.
+ */
+static muse_boolean http_header_has( muse_env *env, muse_cell req, const muse_char *key, const muse_char *token )
+{
+	muse_cell value = http_header_value( env, req, key );
+	int len = 0, i = 0, n = (int)wcslen(token);
+	const muse_char *str;
+
+	if ( !value )
+		return MUSE_FALSE;
+
+	str = muse_text_contents( env, value, &len );
+
+	while ( i < len )
+	{
+		int j = 0;
+
+		while ( i < len && (str[i] == ' ' || str[i] == '\t' || str[i] == ',') )
+			++i;
+
+		while ( i + j < len && j < n && towlower(str[i+j]) == token[j] )
+			++j;
+
+		if ( j == n && (i + j == len || str[i+j] == ',' || str[i+j] == ' ' || str[i+j] == '\t') )
+			return MUSE_TRUE;
+
+		while ( i < len && str[i] != ',' )
+			++i;
+	}
+
+	return MUSE_FALSE;
+}
+
+/**
+ * Returns MUSE_TRUE if the connection can be kept open after the request,
+ * as far as the client is concerned, and sets \p body_len to the length of
+ * the body of the request. A body of unknown length, which ends only with
+ * the connection, doesn't let it stay open.
+ */
+static muse_boolean http_keeps_alive( muse_env *env, muse_cell req, muse_int *body_len )
+{
+	muse_cell length = http_header_value( env, req, L"content-length" );
+	const muse_char *ver = muse_text_contents( env, _head(_tail(_tail(_head(req)))), NULL );
+
+	*body_len = 0;
+
+	if ( length )
+	{
+		const muse_char *s = muse_text_contents( env, length, NULL );
+		for ( ; *s >= '0' && *s <= '9'; ++s )
+			*body_len = *body_len * 10 + (*s - '0');
+	}
+
+	if ( http_header_value( env, req, L"transfer-encoding" ) )
+		return MUSE_FALSE;
+
+	if ( wcscmp( ver, L"HTTP/1.1" ) == 0 )
+		return http_header_has( env, req, L"connection", L"close" ) ? MUSE_FALSE : MUSE_TRUE;
+	else
+		return http_header_has( env, req, L"connection", L"keep-alive" );
+}
+
+/**
+ * Skips \p nbytes bytes of input. Returns MUSE_FALSE if the input
+ * ends before that.
+ */
+static muse_boolean http_skip( muse_port_t p, muse_int nbytes )
+{
+	while ( nbytes > 0 )
+	{
+		int avail = 0;
+		port_buffered( p, &avail );
+
+		if ( avail == 0 )
+		{
+			if ( port_buffer_more(p) == 0 )
+				return MUSE_FALSE;
+			continue;
+		}
+
+		if ( avail > nbytes )
+			avail = (int)nbytes;
+
+		port_consume( avail, p );
+		nbytes -= avail;
+	}
+
+	return MUSE_TRUE;
+}
+
+/**
+ * Waits for the next request on the port for up to \p idle_us. A request 
+ * that the client sent without waiting for the previous response is already
+ * in the buffer. Otherwise the responses written so far are sent before
+ * waiting. Returns MUSE_FALSE if no request came in time.
+ */
+static muse_boolean http_wait_for_request( muse_env *env, muse_port_t p, muse_int idle_us )
+{
+	int avail = 0;
+	port_buffered( p, &avail );
+
+	if ( avail > 0 )
+		return MUSE_TRUE;
+
+	port_flush(p);
+
+	if ( p->base.type_info == &g_socket_type.obj && idle_us >= 0 )
+	{
+		socketport_t *s = (socketport_t*)p;
+
+		if ( s->socket && !socket_is_ready( s->socket, MUSE_NET_READ ) )
+			return wait_for_socket( env, s->socket, MUSE_NET_READ, muse_elapsed_us(env->timer) + idle_us ) == POLL_SOCKET_SET ? MUSE_TRUE : MUSE_FALSE;
+	}
+
+	return MUSE_TRUE;
+}
+
+/**
+ * @code (http-serve port service-fn [idle-timeout-us] [max-requests]) @endcode
+ *
+ * Answers the HTTP requests that come in on a persistent connection,
+ * one after another. Each request is parsed as by \ref fn_http_parse "http-parse"
+ * and passed to
+ * @code (service-fn request port keep-alive?) @endcode
+ * which writes out the response, using \ref fn_http_respond "http-respond" for
+ * instance. Requests that the client sends without waiting for responses
+ * are answered in the order that they came in, and their responses go out
+ * together.
+ *
+ * \c keep-alive? is \c T if the connection will be kept open for another
+ * request, so that the response can say @code Connection: keep-alive @endcode
+ * and must then give its Content-Length. The connection is closed after the
+ * request if
+ *	- the client asked for that, or is HTTP/1.0 and didn't ask for keep-alive,
+ *	- the request has a body of unknown length,
+ *	- \p max-requests have been answered - MUSE_HTTP_MAX_REQUESTS by default, or
+ *	- \p service-fn returns ().
+ *
+ * It is also closed if no request comes in within \p idle-timeout-us microseconds,
+ * MUSE_HTTP_IDLE_TIMEOUT_US by default. Any part of the body of a request 
+ * that \p service-fn didn't read is skipped. The port is closed at the end,
+ * and the number of requests answered is returned.
+ *
+ * @code
+ * (with-incoming-connections-to-port 8080
+ *   (fn (port client)
+ *     (spawn (fn () (http-serve port serve-request)))
+ *     T))
+ * @endcode
+ */
+muse_cell fn_http_serve( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell pcell = _evalnext(&args);
+	muse_port_t p = _port(pcell);
+	muse_cell service_fn = _evalnext(&args);
+	muse_cell idle = args ? _evalnext(&args) : MUSE_NIL;
+	muse_cell cap = args ? _evalnext(&args) : MUSE_NIL;
+	muse_int idle_us = idle ? _intvalue(idle) : env->parameters[MUSE_HTTP_IDLE_TIMEOUT_US];
+	muse_int max_requests = cap ? _intvalue(cap) : env->parameters[MUSE_HTTP_MAX_REQUESTS];
+	muse_boolean keep_alive = MUSE_TRUE;
+	muse_int served = 0;
+	int sp = _spos();
+
+	while ( keep_alive && p->in.bytes && http_wait_for_request( env, p, idle_us ) )
+	{
+		muse_cell req;
+		muse_int body_len = 0;
+		size_t body_start;
+
+		{
+			int arena = muse_begin_text_arena(env);
+			req = http_parse(p);
+			muse_end_text_arena( env, arena );
+		}
+
+		if ( !req )
+			break;
+
+		keep_alive = (http_keeps_alive( env, req, &body_len ) && served + 1 < max_requests) ? MUSE_TRUE : MUSE_FALSE;
+		body_start = p->in.fpos;
+
+		if ( !_apply( service_fn, muse_list( env, "ccc", req, pcell, keep_alive ? _t() : MUSE_NIL ), MUSE_TRUE ) )
+			keep_alive = MUSE_FALSE;
+
+		++served;
+		_unwind(sp);
 
-	return muse_add_recent_item( env, (muse_int)fn_http_parse, http_parse(p));
+		/* The port may have been closed by the service function. */
+		if ( keep_alive && p->in.bytes && !http_skip( p, body_len - (muse_int)(p->in.fpos - body_start) ) )
+			keep_alive = MUSE_FALSE;
+	}
+
+	if ( p->in.bytes )
+		port_close(p);
+
+	return _mk_int(served);
 }
 
 static const char *http_codedesc( int code )
@@ -1720,12 +4079,103 @@ static const char *http_codedesc( int code )
 
 static void crlf( muse_port_t p )
 {
-	port_putc( 0x0d, p );
-	port_putc( 0x0a, p );
+	port_write( "\r\n", 2, p );
+}
+
+/**
+ * Writes out the text a byte per character. Unlike port_putc(), 
+ * port_write() doesn't flush the port at the end of every line, so
+ * a response goes out all at once when the port is flushed.
+ */
+static void http_write_text( muse_port_t p, const muse_char *s )
+{
+	char buffer[256];
+	int n = 0;
+
+	for ( ; *s; ++s )
+	{
+		buffer[n++] = (char)*s;
+		if ( n == sizeof(buffer) )
+		{
+			port_write( buffer, n, p );
+			n = 0;
+		}
+	}
+
+	if ( n > 0 )
+		port_write( buffer, n, p );
 }
 
 muse_cell fn_format( muse_env *env, void *context, muse_cell args );
 
+static const muse_char *http_number( const muse_char *s, const muse_char *end, muse_int *n )
+{
+	*n = -1;
+
+	for ( ; s < end && *s >= '0' && *s <= '9'; ++s )
+		*n = (*n < 0 ? 0 : *n * 10) + (*s - '0');
+
+	return s;
+}
+
+/**
+ * Finds the bytes asked for by a Range header such as "bytes=100-199",
+ * "bytes=100-" or "bytes=-100" in a file of \p size bytes. Returns 1 with
+ * the range in \p offset and \p length if there is such a range in the
+ * file and -1 if there isn't. Returns 0 if there's no range or it isn't one
+ * we serve, such as a list of ranges, in which case all of the file goes.
+ */
+static int http_byte_range( muse_env *env, muse_cell range, muse_int size, muse_int *offset, muse_int *length )
+{
+	int len = 0, i;
+	const muse_char *s, *end;
+	muse_int first, last;
+
+	if ( _cellt(range) != MUSE_TEXT_CELL )
+		return 0;
+
+	s = muse_text_contents( env, range, &len );
+	end = s + len;
+
+	while ( s < end && *s == ' ' )
+		++s;
+
+	for ( i = 0; i < 6; ++i )
+	{
+		if ( s + i == end || towlower(s[i]) != L"bytes="[i] )
+			return 0;
+	}
+
+	s = http_number( s + 6, end, &first );
+	if ( s == end || *s != '-' )
+		return 0;
+
+	s = http_number( s + 1, end, &last );
+	while ( s < end && *s == ' ' )
+		++s;
+
+	if ( s < end || (first < 0 && last < 0) || (last >= 0 && first > last) )
+		return 0;
+
+	if ( first < 0 )
+	{
+		/* The last so many bytes. */
+		if ( last == 0 || size == 0 )
+			return -1;
+
+		*offset	= last < size ? size - last : 0;
+		*length	= size - *offset;
+		return 1;
+	}
+
+	if ( first >= size )
+		return -1;
+
+	*offset	= first;
+	*length	= (last < 0 || last >= size ? size - 1 : last) - first + 1;
+	return 1;
+}
+
 /**
  * @code (http-respond port code headers-alist crlf?) @endcode
  * @param port The port to which to write out the headers.
@@ -1735,6 +4185,21 @@ muse_cell fn_format( muse_env *env, void *context, muse_cell args );
  *		list of headers. If you pass \c (), you can make another call
  *		to \c http-respond to write out some more headers.
  *
+ * @code (http-respond port code headers-alist file-name [range]) @endcode
+ * Responds with the contents of the named file, which are sent as by
+ * \ref fn_send_file "send-file" without being read into memory. The
+ * Content-Length header is added to the given headers, followed by
+ * the blank line and the file. If \p range is the request as given by
+ * \ref fn_http_parse "http-parse" or the text of its Range header, a 200
+ * response with a single byte range in the file becomes a 206 response
+ * with that part of the file, and a range beyond the end of the file gets
+ * a 416 response. Evaluates to the number of bytes of the file sent.
+ *
+ * @code (http-respond port code headers-alist memport) @endcode
+ * Responds with the data in the memport, which goes out as by
+ * \ref fn_send_file "send-file" after the headers and a Content-Length
+ * header. Evaluates to the number of bytes sent.
+ *
  * Supports \ref fn_the "the"
  */
 muse_cell fn_http_respond( muse_env *env, void *context, muse_cell args )
@@ -1742,6 +4207,36 @@ muse_cell fn_http_respond( muse_env *env, void *context, muse_cell args )
 	muse_port_t p = (muse_port_t)muse_port( env, _evalnext(&args) );
 	int code = (int)muse_int_value( env, _evalnext(&args) );
 	muse_cell headers = _evalnext(&args);
+	muse_cell end = _evalnext(&args);
+	FILE *f = NULL;
+	muse_port_t body = (muse_port_t)muse_port( env, end );
+	muse_int size = 0, offset = 0, length = 0;
+
+	if ( is_memport(body) )
+		length = (muse_int)memport_size(body);
+	else if ( _cellt(end) == MUSE_TEXT_CELL )
+	{
+		muse_cell range = _evalnext(&args);
+
+		f = open_file_to_send( env, &end );
+		if ( f == NULL )
+			return MUSE_NIL;
+
+		length = size = file_size(f);
+
+		if ( _cellt(range) == MUSE_CONS_CELL )
+			range = http_header_value( env, range, L"range" );
+
+		if ( code == 200 )
+		{
+			switch ( http_byte_range( env, range, size, &offset, &length ) )
+			{
+			case 1: code = 206; break;
+			case -1: code = 416; offset = length = 0; break;
+			default: offset = 0; length = size;
+			}
+		}
+	}
 
 	/* Write the response line first. */
 	{
@@ -1765,21 +4260,47 @@ muse_cell fn_http_respond( muse_env *env, void *context, muse_cell args )
 			if ( _cellt(key) != MUSE_SYMBOL_CELL ) continue; // Silently ignore the header.
 			if ( _cellt(value) != MUSE_TEXT_CELL ) continue; // Silenty ignore the header;
 
-			{
-				const muse_char *s = muse_symbol_name( env, key );
-				while (*s) { port_putc( *s++, p ); } 
-				port_putc( ':', p );
-				port_putc( ' ', p );
-				s = muse_text_contents( env, value, NULL );
-				while (*s) { port_putc( *s++, p ); }
-				crlf(p);
-			}
+			http_write_text( p, muse_symbol_name( env, key ) );
+			port_write( ": ", 2, p );
+			http_write_text( p, muse_text_contents( env, value, NULL ) );
+			crlf(p);
 
 			_unwind(sp);
 		}
 	}
 
-	if ( _evalnext(&args) )
+	if ( is_memport(body) )
+	{
+		char buffer[64];
+		int n = _snprintf( buffer, sizeof(buffer), "Content-Length: " MUSE_FMT_INT "\r\n\r\n", length );
+		port_write( buffer, n, p );
+		return _mk_int( send_memport( env, p, body ) );
+	}
+
+	if ( f )
+	{
+		char buffer[128];
+		int n = _snprintf( buffer, sizeof(buffer), "Accept-Ranges: bytes\r\nContent-Length: " MUSE_FMT_INT "\r\n", length );
+		muse_int sent = 0;
+		port_write( buffer, n, p );
+
+		if ( code == 206 )
+			n = _snprintf( buffer, sizeof(buffer), "Content-Range: bytes " MUSE_FMT_INT "-" MUSE_FMT_INT "/" MUSE_FMT_INT "\r\n", offset, offset + length - 1, size );
+		else if ( code == 416 )
+			n = _snprintf( buffer, sizeof(buffer), "Content-Range: bytes */" MUSE_FMT_INT "\r\n", size );
+		else
+			n = 0;
+
+		if ( n > 0 )
+			port_write( buffer, n, p );
+
+		crlf(p);
+		sent = send_file( env, p, f, offset, length );
+		fclose(f);
+		return _mk_int(sent);
+	}
+
+	if ( end )
 		crlf(p);
 
 	return MUSE_NIL;
@@ -1797,18 +4318,21 @@ void muse_define_builtin_networking(muse_env *env)
 		{		L"multicast-group",						fn_multicast_group						},
 		{		L"reply",								fn_reply								},
 		{		L"multicast-group?",					fn_multicast_group_p					},
+		{		L"multicast-receive",					fn_multicast_receive					},
+		{		L"multicast-send",						fn_multicast_send						},
 		{		L"fetch-uri",							fn_fetch_uri							},
 		{		L"http-parse",							fn_http_parse							},
 		{		L"http-respond",						fn_http_respond							},
+		{		L"http-serve",							fn_http_serve							},
+		{		L"send-file",							fn_send_file							},
 		{		NULL,									NULL									}
 	};
 
 	muse_network_startup(env);
 
 	env->net = (muse_net_t*)calloc( 1, sizeof(muse_net_t) );
-	FD_ZERO( &(env->net->fdsets[0]) );	// read
-	FD_ZERO( &(env->net->fdsets[1]) );	// write
-	FD_ZERO( &(env->net->fdsets[2]) );	// except
+	env->net->poller = -1;
+	env->net->wake_fd = -1;
 
 	/* Define a destructor function to shutdown the network when everything is done. 
 	Using braces in the symbol name ensures that this symbol cannot be written directly
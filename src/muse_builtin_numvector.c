@@ -0,0 +1,1416 @@
+/**
+ * @file muse_builtin_numvector.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Implements numeric vectors, which keep their numbers unboxed in one
+ * block of memory, along with whole vector arithmetic on them.
+ */
+
+#include "muse_builtins.h"
+#include "muse_port.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define MUSE_NUMVECTOR_SSE2 1
+#	include <emmintrin.h>
+#endif
+
+/** @addtogroup FunctionalObjects */
+/*@{*/
+/**
+ * @defgroup NumericVectors Numeric vectors
+ *
+ * A numeric vector is a fixed size array of numbers that are all
+ * floating point - an \c f64vector - or all integers - an \c i64vector.
+ * Unlike a \ref Vectors "vector", which holds a cell for each of its
+ * elements, a numeric vector keeps its numbers as plain 64-bit doubles
+ * or integers in one block of memory, so a million of them take 8MB and
+ * no cells at all.
+ *
+ * Like a vector, a numeric vector is a function - @code (v i) @endcode
+ * gives the element at index \c i and @code (v i x) @endcode sets it
+ * to \c x, converted to the vector's element type. \ref fn_map "map",
+ * \ref fn_reduce "reduce", \ref fn_collect "collect", \ref fn_join "join",
+ * \ref fn_slice "slice" and \ref fn_for_each "for-each" work on them
+ * too, but call a function for each element. The whole vector operations -
+ *	- \ref fn_numvector_add "numvector+", \ref fn_numvector_sub "numvector-",
+ *	  \ref fn_numvector_mul "numvector*" and \ref fn_numvector_div "numvector/"
+ *	- \ref fn_numvector_sum "numvector-sum", \ref fn_numvector_min "numvector-min",
+ *	  \ref fn_numvector_max "numvector-max" and \ref fn_numvector_dot "numvector-dot"
+ *	- \ref fn_numvector_lt "numvector<" and the other comparisons, which give
+ *	  masks of 1s and 0s
+ *
+ * work on all the numbers at a time in native loops, several numbers
+ * per instruction where the processor allows.
+ *
+ * Integer arithmetic wraps around at 64 bits. A float put into an
+ * i64vector loses its fraction and is limited to the range of 64-bit
+ * integers, with NaN stored as 0.
+ *
+ * @code
+ * (define v (f64vector 1 2 3 4))
+ * (numvector-sum (numvector* v v))
+ *      > 30.0
+ * (numvector->list (numvector> v 2.5))
+ *      > (0 0 1 1)
+ * @endcode
+ */
+/*@{*/
+
+typedef struct
+{
+	muse_functional_object_t base;
+	int length;
+	union
+	{
+		muse_float	*f;		/**< The elements of an f64vector. */
+		muse_int	*i;		/**< The elements of an i64vector. */
+	} data;
+} numvector_t;
+
+/* From muse_builtin_bytes.c */
+extern int int_LE( const unsigned char *bytes );
+extern muse_int long_LE( const unsigned char *bytes );
+extern void put_int_LE( unsigned char *bytes, int i );
+extern void put_long_LE( unsigned char *bytes, muse_int i );
+
+typedef unsigned long long i64_bits_t;
+
+#define MUSE_INT_MAX	((muse_int)(~(i64_bits_t)0 >> 1))
+#define MUSE_INT_MIN	(-MUSE_INT_MAX - 1)
+
+/**
+ * The integer a float stores as in an i64vector - the float with any
+ * fraction dropped, limited to the range of a muse_int, with NaN as 0.
+ * A plain cast is undefined for floats out of the range.
+ */
+static muse_int i64_from_float( muse_float f )
+{
+	if ( f != f )
+		return 0;
+	if ( f >= 9223372036854775807.0 )
+		return MUSE_INT_MAX;
+	if ( f <= -9223372036854775808.0 )
+		return MUSE_INT_MIN;
+	return (muse_int)f;
+}
+
+static muse_int i64_value( muse_env *env, muse_cell x )
+{
+	return _cellt(x) == MUSE_FLOAT_CELL ? i64_from_float( _ptr(x)->f ) : _intvalue(x);
+}
+
+/* From muse_builtin_vector.c */
+void get_slice_iterator_from_args( muse_env *env, int *from, int *count, int *step, int *to, int length, muse_cell *argv );
+
+/**
+ * Declarations of stuff placed at start of file for clarity and source
+ * code compatibility with other compilers such as gcc.
+ */
+/*@{*/
+static void numvector_init( muse_env *env, void *ptr, muse_cell args );
+static void numvector_destroy( muse_env *env, void *ptr );
+static void numvector_write( muse_env *env, void *ptr, void *port );
+static void *numvector_view( muse_env *env, int id );
+muse_cell fn_numvector_fn( muse_env *env, numvector_t *v, muse_cell args );
+
+static muse_functional_object_type_t g_f64vector_type =
+{
+	'muSE',
+	'f64v',
+	sizeof(numvector_t),
+	(muse_nativefn_t)fn_numvector_fn,
+	numvector_view,
+	numvector_init,
+	NULL,
+	numvector_destroy,
+	numvector_write
+};
+
+static muse_functional_object_type_t g_i64vector_type =
+{
+	'muSE',
+	'i64v',
+	sizeof(numvector_t),
+	(muse_nativefn_t)fn_numvector_fn,
+	numvector_view,
+	numvector_init,
+	NULL,
+	numvector_destroy,
+	numvector_write
+};
+/*@}*/
+
+#define _numvector_is_float(v) ((v)->base.type_info == &g_f64vector_type)
+
+static numvector_t *numvector_data( muse_env *env, muse_cell v )
+{
+	muse_functional_object_t *obj = _fnobjdata(v);
+
+	if ( obj && (obj->type_info == &g_f64vector_type || obj->type_info == &g_i64vector_type) )
+		return (numvector_t*)obj;
+	else
+		return NULL;
+}
+
+static muse_cell mk_numvector( muse_env *env, int is_float, int length )
+{
+	int sp = _spos();
+	muse_cell v = _mk_functional_object( is_float ? &g_f64vector_type : &g_i64vector_type, _cons( _mk_int(length), MUSE_NIL ) );
+	_unwind(sp);
+	_spush(v);
+	return v;
+}
+
+static void numvector_init( muse_env *env, void *ptr, muse_cell args )
+{
+	numvector_t *v = (numvector_t*)ptr;
+	muse_cell fill = MUSE_NIL;
+	int i;
+
+	v->length = args ? (int)_intvalue(_evalnext(&args)) : 0;
+	if ( v->length < 0 )
+		v->length = 0;
+
+	if ( args )
+		fill = _evalnext(&args);
+
+	/* Both element types are 8 bytes. */
+	v->data.i = (muse_int*)calloc( v->length > 0 ? v->length : 1, sizeof(muse_int) );
+
+	if ( fill )
+	{
+		if ( _numvector_is_float(v) )
+		{
+			muse_float x = _floatvalue(fill);
+			for ( i = 0; i < v->length; ++i )
+				v->data.f[i] = x;
+		}
+		else
+		{
+			muse_int x = i64_value( env, fill );
+			for ( i = 0; i < v->length; ++i )
+				v->data.i[i] = x;
+		}
+	}
+}
+
+static void numvector_destroy( muse_env *env, void *ptr )
+{
+	numvector_t *v = (numvector_t*)ptr;
+	free( v->data.i );
+	v->data.i = NULL;
+	v->length = 0;
+}
+
+/**
+ * Writes out the vector as @code {f64vector x1 x2 ...} @endcode
+ * or @code {i64vector n1 n2 ...} @endcode, so that a trusted read
+ * gives it back. Floats are written with as few digits as will
+ * read back exactly.
+ */
+static void numvector_write( muse_env *env, void *ptr, void *port )
+{
+	numvector_t *v = (numvector_t*)ptr;
+	muse_port_t p = (muse_port_t)port;
+	char buffer[64];
+	int i;
+
+	port_putc( '{', p );
+
+	if ( _numvector_is_float(v) )
+	{
+		port_write( "f64vector", 9, p );
+
+		for ( i = 0; i < v->length; ++i )
+		{
+			int len = sprintf( buffer, " %.15g", v->data.f[i] );
+
+			if ( strtod( buffer, NULL ) != v->data.f[i] )
+				len = sprintf( buffer, " %.17g", v->data.f[i] );
+
+			/* Keep it a float when read back. */
+			if ( !strpbrk( buffer, ".eEn" ) )
+			{
+				buffer[len++] = '.';
+				buffer[len++] = '0';
+			}
+
+			port_write( buffer, len, p );
+		}
+	}
+	else
+	{
+		port_write( "i64vector", 9, p );
+
+		for ( i = 0; i < v->length; ++i )
+		{
+			buffer[0] = ' ';
+			port_write( buffer, 1 + sprintf( buffer + 1, MUSE_FMT_INT, v->data.i[i] ), p );
+		}
+	}
+
+	port_putc( '}', p );
+}
+
+static muse_cell numvector_get( muse_env *env, numvector_t *v, int i )
+{
+	return _numvector_is_float(v) ? _mk_float( v->data.f[i] ) : _mk_int( v->data.i[i] );
+}
+
+static void numvector_set( muse_env *env, numvector_t *v, int i, muse_cell x )
+{
+	if ( _numvector_is_float(v) )
+		v->data.f[i] = _floatvalue(x);
+	else
+		v->data.i[i] = i64_value( env, x );
+}
+
+/**
+ * The function that implements numeric vector element access.
+ */
+muse_cell fn_numvector_fn( muse_env *env, numvector_t *v, muse_cell args )
+{
+	muse_cell indexcell = _evalnext(&args);
+	muse_int index = i64_value( env, indexcell );
+
+	if ( index < 0 || index >= v->length )
+		return muse_raise_error( env, _csymbol(L"error:index-out-of-range"), _cons( v->base.self, _cons( indexcell, MUSE_NIL ) ) );
+
+	if ( args )
+	{
+		muse_cell x = _evalnext(&args);
+		numvector_set( env, v, (int)index, x );
+		return x;
+	}
+	else
+	{
+		return numvector_get( env, v, (int)index );
+	}
+}
+
+static muse_cell numvector_size( muse_env *env, void *self )
+{
+	return _mk_int( ((numvector_t*)self)->length );
+}
+
+static muse_cell numvector_map( muse_env *env, void *self, muse_cell fn )
+{
+	numvector_t *v = (numvector_t*)self;
+	muse_cell result = mk_numvector( env, _numvector_is_float(v), v->length );
+	numvector_t *r = numvector_data( env, result );
+	muse_cell args = _cons( MUSE_NIL, MUSE_NIL );
+	int sp = _spos();
+	int i;
+
+	for ( i = 0; i < v->length; ++i )
+	{
+		_seth( args, numvector_get( env, v, i ) );
+		numvector_set( env, r, i, _apply( fn, args, MUSE_TRUE ) );
+		_unwind(sp);
+	}
+
+	return result;
+}
+
+/**
+ * Numeric vectors are joined by concatenation. The result is an
+ * f64vector if any of them is one.
+ */
+static muse_cell numvector_join( muse_env *env, void *self, muse_cell objlist, muse_cell reduction_fn )
+{
+	numvector_t *v = (numvector_t*)self;
+	int is_float = _numvector_is_float(v);
+	int length = v->length;
+	muse_cell list;
+
+	for ( list = objlist; list; list = _tail(list) )
+	{
+		numvector_t *v2 = numvector_data( env, _head(list) );
+		if ( v2 )
+		{
+			length += v2->length;
+			is_float = is_float || _numvector_is_float(v2);
+		}
+	}
+
+	{
+		muse_cell result = mk_numvector( env, is_float, length );
+		numvector_t *r = numvector_data( env, result );
+		numvector_t *from = v;
+		int offset = 0, i;
+
+		for ( list = objlist; from; )
+		{
+			if ( !is_float )
+				memcpy( r->data.i + offset, from->data.i, sizeof(muse_int) * from->length );
+			else if ( _numvector_is_float(from) )
+				memcpy( r->data.f + offset, from->data.f, sizeof(muse_float) * from->length );
+			else
+			{
+				for ( i = 0; i < from->length; ++i )
+					r->data.f[offset + i] = (muse_float)from->data.i[i];
+			}
+
+			offset += from->length;
+
+			for ( from = NULL; list && !from; list = _tail(list) )
+				from = numvector_data( env, _head(list) );
+		}
+
+		return result;
+	}
+}
+
+static muse_cell numvector_collect( muse_env *env, void *self, muse_cell predicate, muse_cell mapper, muse_cell reduction_fn )
+{
+	numvector_t *v = (numvector_t*)self;
+	muse_cell result = mk_numvector( env, _numvector_is_float(v), v->length );
+	numvector_t *r = numvector_data( env, result );
+	muse_cell args = _cons( MUSE_NIL, MUSE_NIL );
+	int sp = _spos();
+	int i, n = 0;
+
+	for ( i = 0; i < v->length; ++i )
+	{
+		_seth( args, numvector_get( env, v, i ) );
+
+		if ( !predicate || _apply( predicate, args, MUSE_TRUE ) )
+		{
+			if ( mapper )
+				numvector_set( env, r, n++, _apply( mapper, args, MUSE_TRUE ) );
+			else if ( _numvector_is_float(v) )
+				r->data.f[n++] = v->data.f[i];
+			else
+				r->data.i[n++] = v->data.i[i];
+		}
+
+		_unwind(sp);
+	}
+
+	r->length = n;
+	return result;
+}
+
+static muse_cell numvector_reduce( muse_env *env, void *self, muse_cell reduction_fn, muse_cell initial )
+{
+	numvector_t *v = (numvector_t*)self;
+	muse_cell args = _cons( initial, _cons( MUSE_NIL, MUSE_NIL ) );
+	muse_cell arg2 = _tail(args);
+	int sp = _spos();
+	int i;
+
+	for ( i = 0; i < v->length; ++i )
+	{
+		_seth( arg2, numvector_get( env, v, i ) );
+		_seth( args, _apply( reduction_fn, args, MUSE_TRUE ) );
+		_unwind(sp);
+	}
+
+	return _head(args);
+}
+
+static muse_cell numvector_slice( muse_env *env, void *self, muse_cell argv )
+{
+	numvector_t *v = (numvector_t*)self;
+	int from, count, step, to, i;
+	muse_cell result;
+	numvector_t *r;
+
+	get_slice_iterator_from_args( env, &from, &count, &step, &to, v->length, &argv );
+
+	if ( count < 0 )
+		count = 0;
+
+	result = mk_numvector( env, _numvector_is_float(v), count );
+	r = numvector_data( env, result );
+
+	/* Both element types are 8 bytes. */
+	for ( i = 0; i < count; ++i )
+		r->data.i[i] = v->data.i[from + i * step];
+
+	return result;
+}
+
+static muse_cell numvector_iterator( muse_env *env, numvector_t *self, muse_iterator_callback_t callback, void *context )
+{
+	int sp = _spos();
+	int i;
+
+	for ( i = 0; i < self->length; ++i )
+	{
+		muse_boolean cont = callback( env, self, context, numvector_get( env, self, i ) );
+		_unwind(sp);
+		if ( !cont )
+			return _mk_int(i); /**< Return the current index. */
+	}
+
+	return MUSE_NIL;
+}
+
+static muse_monad_view_t g_numvector_monad_view =
+{
+	numvector_size,
+	numvector_map,
+	numvector_join,
+	numvector_collect,
+	numvector_reduce,
+	numvector_slice
+};
+
+static void *numvector_view( muse_env *env, int id )
+{
+	switch ( id )
+	{
+		case 'mnad' : return &g_numvector_monad_view;
+		case 'iter' : return numvector_iterator;
+		default : return NULL;
+	}
+}
+
+/**
+ * @name Kernels
+ *
+ * The loops that do the whole vector operations. An operand is either
+ * a vector or, if its pointer is NULL, a number that goes with every
+ * element of the other operand. The elementwise loops are simple enough
+ * for compilers to vectorize on their own. The sums, dot products, minima
+ * and maxima of floats aren't, since that changes the order of the
+ * additions, so those are done two doubles at a time with SSE2 where
+ * it's available.
+ */
+/*@{*/
+
+#define NUMVECTOR_BINOP( r, n, a, as, b, bs, OP ) \
+	{ \
+		int i; \
+		if ( a && b ) \
+			for ( i = 0; i < n; ++i ) r[i] = a[i] OP b[i]; \
+		else if ( a ) \
+			for ( i = 0; i < n; ++i ) r[i] = a[i] OP bs; \
+		else \
+			for ( i = 0; i < n; ++i ) r[i] = as OP b[i]; \
+	}
+
+static void f64_binop( int op, muse_float *r, const muse_float *a, muse_float as, const muse_float *b, muse_float bs, int n )
+{
+	switch ( op )
+	{
+	case '+' : NUMVECTOR_BINOP( r, n, a, as, b, bs, + ); break;
+	case '-' : NUMVECTOR_BINOP( r, n, a, as, b, bs, - ); break;
+	case '*' : NUMVECTOR_BINOP( r, n, a, as, b, bs, * ); break;
+	case '/' : NUMVECTOR_BINOP( r, n, a, as, b, bs, / ); break;
+	}
+}
+
+/**
+ * Integer results wrap around. Signed overflow is undefined, so the
+ * arithmetic is done on the unsigned values, which wrap, and the
+ * results converted back.
+ */
+#define I64_WRAP( x, OP, y ) ((muse_int)((i64_bits_t)(x) OP (i64_bits_t)(y)))
+
+#define I64_BINOP( r, n, a, as, b, bs, OP ) \
+	{ \
+		int i; \
+		if ( a && b ) \
+			for ( i = 0; i < n; ++i ) r[i] = I64_WRAP( a[i], OP, b[i] ); \
+		else if ( a ) \
+			for ( i = 0; i < n; ++i ) r[i] = I64_WRAP( a[i], OP, bs ); \
+		else \
+			for ( i = 0; i < n; ++i ) r[i] = I64_WRAP( as, OP, b[i] ); \
+	}
+
+static void i64_binop( int op, muse_int *r, const muse_int *a, muse_int as, const muse_int *b, muse_int bs, int n )
+{
+	switch ( op )
+	{
+	case '+' : I64_BINOP( r, n, a, as, b, bs, + ); break;
+	case '-' : I64_BINOP( r, n, a, as, b, bs, - ); break;
+	case '*' : I64_BINOP( r, n, a, as, b, bs, * ); break;
+	}
+}
+
+static void f64_compare( int op, muse_int *r, const muse_float *a, muse_float as, const muse_float *b, muse_float bs, int n )
+{
+	switch ( op )
+	{
+	case '<' : NUMVECTOR_BINOP( r, n, a, as, b, bs, < ); break;
+	case 'l' : NUMVECTOR_BINOP( r, n, a, as, b, bs, <= ); break;
+	case '>' : NUMVECTOR_BINOP( r, n, a, as, b, bs, > ); break;
+	case 'g' : NUMVECTOR_BINOP( r, n, a, as, b, bs, >= ); break;
+	case '=' : NUMVECTOR_BINOP( r, n, a, as, b, bs, == ); break;
+	}
+}
+
+static void i64_compare( int op, muse_int *r, const muse_int *a, muse_int as, const muse_int *b, muse_int bs, int n )
+{
+	switch ( op )
+	{
+	case '<' : NUMVECTOR_BINOP( r, n, a, as, b, bs, < ); break;
+	case 'l' : NUMVECTOR_BINOP( r, n, a, as, b, bs, <= ); break;
+	case '>' : NUMVECTOR_BINOP( r, n, a, as, b, bs, > ); break;
+	case 'g' : NUMVECTOR_BINOP( r, n, a, as, b, bs, >= ); break;
+	case '=' : NUMVECTOR_BINOP( r, n, a, as, b, bs, == ); break;
+	}
+}
+
+static muse_float f64_sum( const muse_float *a, int n )
+{
+	muse_float sum = 0.0;
+	int i = 0;
+
+#ifdef MUSE_NUMVECTOR_SSE2
+	{
+		__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+		double lanes[2];
+
+		for ( ; i + 4 <= n; i += 4 )
+		{
+			s0 = _mm_add_pd( s0, _mm_loadu_pd( a + i ) );
+			s1 = _mm_add_pd( s1, _mm_loadu_pd( a + i + 2 ) );
+		}
+
+		_mm_storeu_pd( lanes, _mm_add_pd( s0, s1 ) );
+		sum = lanes[0] + lanes[1];
+	}
+#endif
+
+	for ( ; i < n; ++i )
+		sum += a[i];
+
+	return sum;
+}
+
+static muse_float f64_dot( const muse_float *a, const muse_float *b, int n )
+{
+	muse_float sum = 0.0;
+	int i = 0;
+
+#ifdef MUSE_NUMVECTOR_SSE2
+	{
+		__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+		double lanes[2];
+
+		for ( ; i + 4 <= n; i += 4 )
+		{
+			s0 = _mm_add_pd( s0, _mm_mul_pd( _mm_loadu_pd( a + i ), _mm_loadu_pd( b + i ) ) );
+			s1 = _mm_add_pd( s1, _mm_mul_pd( _mm_loadu_pd( a + i + 2 ), _mm_loadu_pd( b + i + 2 ) ) );
+		}
+
+		_mm_storeu_pd( lanes, _mm_add_pd( s0, s1 ) );
+		sum = lanes[0] + lanes[1];
+	}
+#endif
+
+	for ( ; i < n; ++i )
+		sum += a[i] * b[i];
+
+	return sum;
+}
+
+/**
+ * Gives the least element if \p want_max is 0, otherwise the
+ * greatest. \p n must be at least 1.
+ */
+static muse_float f64_extreme( const muse_float *a, int n, int want_max )
+{
+	muse_float m = a[0];
+	int i = 0;
+
+#ifdef MUSE_NUMVECTOR_SSE2
+	if ( n >= 4 )
+	{
+		__m128d m0 = _mm_loadu_pd( a ), m1 = _mm_loadu_pd( a + 2 );
+		double lanes[2];
+
+		for ( i = 4; i + 4 <= n; i += 4 )
+		{
+			if ( want_max )
+			{
+				m0 = _mm_max_pd( m0, _mm_loadu_pd( a + i ) );
+				m1 = _mm_max_pd( m1, _mm_loadu_pd( a + i + 2 ) );
+			}
+			else
+			{
+				m0 = _mm_min_pd( m0, _mm_loadu_pd( a + i ) );
+				m1 = _mm_min_pd( m1, _mm_loadu_pd( a + i + 2 ) );
+			}
+		}
+
+		_mm_storeu_pd( lanes, want_max ? _mm_max_pd( m0, m1 ) : _mm_min_pd( m0, m1 ) );
+		m = want_max ? (lanes[0] > lanes[1] ? lanes[0] : lanes[1]) : (lanes[0] < lanes[1] ? lanes[0] : lanes[1]);
+	}
+#endif
+
+	for ( ; i < n; ++i )
+	{
+		if ( want_max ? (a[i] > m) : (a[i] < m) )
+			m = a[i];
+	}
+
+	return m;
+}
+
+static muse_int i64_extreme( const muse_int *a, int n, int want_max )
+{
+	muse_int m = a[0];
+	int i;
+
+	for ( i = 1; i < n; ++i )
+	{
+		if ( want_max ? (a[i] > m) : (a[i] < m) )
+			m = a[i];
+	}
+
+	return m;
+}
+
+/*@}*/
+
+/**
+ * An operand of a whole vector operation, as doubles. Integer vectors
+ * are converted into \p tmp.
+ */
+typedef struct
+{
+	const muse_float *f;	/**< NULL for a number operand. */
+	muse_float s;			/**< The number operand. */
+	muse_float *tmp;
+} f64_operand_t;
+
+static void f64_operand( muse_env *env, f64_operand_t *o, muse_cell x, numvector_t *v )
+{
+	o->tmp = NULL;
+
+	if ( !v )
+	{
+		o->f = NULL;
+		o->s = _floatvalue(x);
+	}
+	else if ( _numvector_is_float(v) )
+	{
+		o->f = v->data.f;
+	}
+	else
+	{
+		int i;
+		o->tmp = (muse_float*)malloc( sizeof(muse_float) * (v->length > 0 ? v->length : 1) );
+		for ( i = 0; i < v->length; ++i )
+			o->tmp[i] = (muse_float)v->data.i[i];
+		o->f = o->tmp;
+	}
+}
+
+/**
+ * Checks the operands of a whole vector operation. At least one of
+ * them must be a numeric vector and the other must be a vector of
+ * the same length or a number. Gives the length of the result, or
+ * -1 after raising an error.
+ */
+static int numvector_operands( muse_env *env, muse_cell a, numvector_t *va, muse_cell b, numvector_t *vb )
+{
+	if ( (!va && !vb) || (!va && !_isnumber(a)) || (!vb && !_isnumber(b)) )
+	{
+		muse_raise_error( env, _csymbol(L"error:numvector-expected"), _cons( a, _cons( b, MUSE_NIL ) ) );
+		return -1;
+	}
+
+	if ( va && vb && va->length != vb->length )
+	{
+		muse_raise_error( env, _csymbol(L"error:length-mismatch"), _cons( a, _cons( b, MUSE_NIL ) ) );
+		return -1;
+	}
+
+	return va ? va->length : vb->length;
+}
+
+static int numvector_operand_is_float( muse_env *env, muse_cell x, numvector_t *v )
+{
+	return v ? _numvector_is_float(v) : (_cellt(x) == MUSE_FLOAT_CELL);
+}
+
+static muse_cell numvector_binop( muse_env *env, int op, muse_cell a, muse_cell b )
+{
+	numvector_t *va = numvector_data( env, a );
+	numvector_t *vb = numvector_data( env, b );
+	int n = numvector_operands( env, a, va, b, vb );
+	int is_float = (op == '/') || numvector_operand_is_float( env, a, va ) || numvector_operand_is_float( env, b, vb );
+	muse_cell result;
+	numvector_t *r;
+
+	if ( n < 0 )
+		return MUSE_NIL;
+
+	result = mk_numvector( env, is_float, n );
+	r = numvector_data( env, result );
+
+	if ( is_float )
+	{
+		f64_operand_t oa, ob;
+		f64_operand( env, &oa, a, va );
+		f64_operand( env, &ob, b, vb );
+		f64_binop( op, r->data.f, oa.f, oa.s, ob.f, ob.s, n );
+		free( oa.tmp );
+		free( ob.tmp );
+	}
+	else
+	{
+		i64_binop( op, r->data.i, va ? va->data.i : NULL, va ? 0 : i64_value( env, a ), vb ? vb->data.i : NULL, vb ? 0 : i64_value( env, b ), n );
+	}
+
+	return result;
+}
+
+static muse_cell numvector_compare( muse_env *env, int op, muse_cell a, muse_cell b )
+{
+	numvector_t *va = numvector_data( env, a );
+	numvector_t *vb = numvector_data( env, b );
+	int n = numvector_operands( env, a, va, b, vb );
+	muse_cell result;
+	numvector_t *r;
+
+	if ( n < 0 )
+		return MUSE_NIL;
+
+	result = mk_numvector( env, MUSE_FALSE, n );
+	r = numvector_data( env, result );
+
+	if ( numvector_operand_is_float( env, a, va ) || numvector_operand_is_float( env, b, vb ) )
+	{
+		f64_operand_t oa, ob;
+		f64_operand( env, &oa, a, va );
+		f64_operand( env, &ob, b, vb );
+		f64_compare( op, r->data.i, oa.f, oa.s, ob.f, ob.s, n );
+		free( oa.tmp );
+		free( ob.tmp );
+	}
+	else
+	{
+		i64_compare( op, r->data.i, va ? va->data.i : NULL, va ? 0 : _intvalue(a), vb ? vb->data.i : NULL, vb ? 0 : _intvalue(b), n );
+	}
+
+	return result;
+}
+
+/**
+ * Folds the binary operation over the arguments from the left. With
+ * one argument, \c - and \c / give the negation and the reciprocals.
+ */
+static muse_cell numvector_arith( muse_env *env, int op, muse_cell args )
+{
+	muse_cell result = _evalnext(&args);
+
+	if ( !args )
+	{
+		switch ( op )
+		{
+		case '-' : return numvector_binop( env, op, _mk_int(0), result );
+		case '/' : return numvector_binop( env, op, _mk_float(1.0), result );
+		default  : return numvector_binop( env, '+', _mk_int(0), result );
+		}
+	}
+
+	while ( args )
+	{
+		muse_cell b = _evalnext(&args);
+		result = numvector_binop( env, op, result, b );
+	}
+
+	return result;
+}
+
+/**
+ * @code (numvector+ a b ...) @endcode
+ *
+ * Adds numeric vectors of the same length element by element. Any of the
+ * arguments except the first can also be a number, which is added to every
+ * element. The result is an f64vector if any argument is an f64vector or
+ * a float, otherwise it is an i64vector.
+ */
+muse_cell fn_numvector_add( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_arith( env, '+', args );
+}
+
+/**
+ * @code (numvector- a b ...) @endcode
+ *
+ * Subtracts the rest of the arguments from the first, element by element,
+ * with the same argument rules as \ref fn_numvector_add "numvector+".
+ * @code (numvector- a) @endcode negates every element.
+ */
+muse_cell fn_numvector_sub( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_arith( env, '-', args );
+}
+
+/**
+ * @code (numvector* a b ...) @endcode
+ *
+ * Multiplies element by element, with the same argument rules as
+ * \ref fn_numvector_add "numvector+". A number argument scales the vector.
+ */
+muse_cell fn_numvector_mul( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_arith( env, '*', args );
+}
+
+/**
+ * @code (numvector/ a b ...) @endcode
+ *
+ * Divides the first argument by the rest, element by element, with the
+ * same argument rules as \ref fn_numvector_add "numvector+". The result
+ * is always an f64vector. @code (numvector/ a) @endcode gives the
+ * reciprocals of the elements.
+ */
+muse_cell fn_numvector_div( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_arith( env, '/', args );
+}
+
+static muse_cell numvector_compare_args( muse_env *env, int op, muse_cell args )
+{
+	muse_cell a = _evalnext(&args);
+	muse_cell b = _evalnext(&args);
+	return numvector_compare( env, op, a, b );
+}
+
+/**
+ * @code (numvector< a b) @endcode
+ *
+ * Compares two numeric vectors of the same length, or a vector and
+ * a number, element by element. Gives an i64vector that has 1 where
+ * the comparison holds and 0 where it doesn't. Such masks can be
+ * multiplied with other vectors and summed up to count.
+ * \c numvector<=, \c numvector>, \c numvector>= and \c numvector=
+ * work the same way.
+ */
+muse_cell fn_numvector_lt( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_compare_args( env, '<', args );
+}
+
+/**
+ * @code (numvector<= a b) @endcode
+ * @see fn_numvector_lt
+ */
+muse_cell fn_numvector_le( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_compare_args( env, 'l', args );
+}
+
+/**
+ * @code (numvector> a b) @endcode
+ * @see fn_numvector_lt
+ */
+muse_cell fn_numvector_gt( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_compare_args( env, '>', args );
+}
+
+/**
+ * @code (numvector>= a b) @endcode
+ * @see fn_numvector_lt
+ */
+muse_cell fn_numvector_ge( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_compare_args( env, 'g', args );
+}
+
+/**
+ * @code (numvector= a b) @endcode
+ * @see fn_numvector_lt
+ */
+muse_cell fn_numvector_eq( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_compare_args( env, '=', args );
+}
+
+static numvector_t *numvector_arg( muse_env *env, muse_cell *args )
+{
+	muse_cell x = _evalnext(args);
+	numvector_t *v = numvector_data( env, x );
+
+	if ( !v )
+		muse_raise_error( env, _csymbol(L"error:numvector-expected"), _cons( x, MUSE_NIL ) );
+
+	return v;
+}
+
+/**
+ * @code (numvector-sum v) @endcode
+ *
+ * Gives the sum of the elements of the vector - a float for an f64vector
+ * and an integer for an i64vector.
+ */
+muse_cell fn_numvector_sum( muse_env *env, void *context, muse_cell args )
+{
+	numvector_t *v = numvector_arg( env, &args );
+
+	if ( !v )
+		return MUSE_NIL;
+
+	if ( _numvector_is_float(v) )
+	{
+		return _mk_float( f64_sum( v->data.f, v->length ) );
+	}
+	else
+	{
+		muse_int sum = 0;
+		int i;
+		for ( i = 0; i < v->length; ++i )
+			sum = I64_WRAP( sum, +, v->data.i[i] );
+		return _mk_int( sum );
+	}
+}
+
+static muse_cell numvector_extreme( muse_env *env, muse_cell args, int want_max )
+{
+	numvector_t *v = numvector_arg( env, &args );
+
+	if ( !v || v->length == 0 )
+		return MUSE_NIL;
+
+	if ( _numvector_is_float(v) )
+		return _mk_float( f64_extreme( v->data.f, v->length, want_max ) );
+	else
+		return _mk_int( i64_extreme( v->data.i, v->length, want_max ) );
+}
+
+/**
+ * @code (numvector-min v) @endcode
+ *
+ * Gives the least element of the vector, or () if it is empty.
+ */
+muse_cell fn_numvector_min( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_extreme( env, args, 0 );
+}
+
+/**
+ * @code (numvector-max v) @endcode
+ *
+ * Gives the greatest element of the vector, or () if it is empty.
+ */
+muse_cell fn_numvector_max( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_extreme( env, args, 1 );
+}
+
+/**
+ * @code (numvector-dot a b) @endcode
+ *
+ * Gives the sum of the products of the corresponding elements of
+ * two numeric vectors of the same length. The result is an integer
+ * if both are i64vectors and a float otherwise.
+ */
+muse_cell fn_numvector_dot( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell a = _evalnext(&args);
+	muse_cell b = _evalnext(&args);
+	numvector_t *va = numvector_data( env, a );
+	numvector_t *vb = numvector_data( env, b );
+
+	if ( !va || !vb )
+		return muse_raise_error( env, _csymbol(L"error:numvector-expected"), _cons( a, _cons( b, MUSE_NIL ) ) );
+
+	if ( numvector_operands( env, a, va, b, vb ) < 0 )
+		return MUSE_NIL;
+
+	if ( _numvector_is_float(va) || _numvector_is_float(vb) )
+	{
+		f64_operand_t oa, ob;
+		muse_float dot;
+
+		f64_operand( env, &oa, a, va );
+		f64_operand( env, &ob, b, vb );
+		dot = f64_dot( oa.f, ob.f, va->length );
+		free( oa.tmp );
+		free( ob.tmp );
+		return _mk_float( dot );
+	}
+	else
+	{
+		muse_int dot = 0;
+		int i;
+		for ( i = 0; i < va->length; ++i )
+			dot = I64_WRAP( dot, +, I64_WRAP( va->data.i[i], *, vb->data.i[i] ) );
+		return _mk_int( dot );
+	}
+}
+
+static muse_cell numvector_from_args( muse_env *env, int is_float, muse_cell args )
+{
+	muse_cell result = mk_numvector( env, is_float, _list_length(args) );
+	numvector_t *v = numvector_data( env, result );
+	int sp = _spos();
+	int i;
+
+	for ( i = 0; i < v->length; ++i )
+	{
+		numvector_set( env, v, i, _evalnext(&args) );
+		_unwind(sp);
+	}
+
+	return result;
+}
+
+/**
+ * @code (mk-f64vector n [x]) @endcode
+ *
+ * Makes an f64vector of n elements, all of them \c x, or 0.0 if
+ * \c x isn't given.
+ */
+muse_cell fn_mk_f64vector( muse_env *env, void *context, muse_cell args )
+{
+	return _mk_functional_object( &g_f64vector_type, args );
+}
+
+/**
+ * @code (mk-i64vector n [x]) @endcode
+ *
+ * Makes an i64vector of n elements, all of them \c x, or 0 if
+ * \c x isn't given.
+ */
+muse_cell fn_mk_i64vector( muse_env *env, void *context, muse_cell args )
+{
+	return _mk_functional_object( &g_i64vector_type, args );
+}
+
+/**
+ * @code (f64vector x1 x2 ... xN) @endcode
+ *
+ * Makes an f64vector of the given numbers.
+ */
+muse_cell fn_f64vector( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_from_args( env, MUSE_TRUE, args );
+}
+
+/**
+ * @code (i64vector n1 n2 ... nN) @endcode
+ *
+ * Makes an i64vector of the given numbers, with any fractions dropped.
+ */
+muse_cell fn_i64vector( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_from_args( env, MUSE_FALSE, args );
+}
+
+static muse_cell numvector_from_list( muse_env *env, int is_float, muse_cell args )
+{
+	muse_cell list = _evalnext(&args);
+	muse_cell result = mk_numvector( env, is_float, _list_length(list) );
+	numvector_t *v = numvector_data( env, result );
+	int i;
+
+	for ( i = 0; list; ++i )
+		numvector_set( env, v, i, _next(&list) );
+
+	return result;
+}
+
+/**
+ * @code (list->f64vector list) @endcode
+ *
+ * Makes an f64vector of the numbers in the list.
+ */
+muse_cell fn_list_to_f64vector( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_from_list( env, MUSE_TRUE, args );
+}
+
+/**
+ * @code (list->i64vector list) @endcode
+ *
+ * Makes an i64vector of the numbers in the list.
+ */
+muse_cell fn_list_to_i64vector( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_from_list( env, MUSE_FALSE, args );
+}
+
+/**
+ * @code (f64vector? v) @endcode
+ *
+ * Gives \c v if it is an f64vector, or () if it isn't.
+ */
+muse_cell fn_f64vector_p( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell v = _evalnext(&args);
+	numvector_t *nv = numvector_data( env, v );
+	return (nv && _numvector_is_float(nv)) ? v : MUSE_NIL;
+}
+
+/**
+ * @code (i64vector? v) @endcode
+ *
+ * Gives \c v if it is an i64vector, or () if it isn't.
+ */
+muse_cell fn_i64vector_p( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell v = _evalnext(&args);
+	numvector_t *nv = numvector_data( env, v );
+	return (nv && !_numvector_is_float(nv)) ? v : MUSE_NIL;
+}
+
+/**
+ * @code (numvector-length v) @endcode
+ *
+ * Gives the number of elements in the numeric vector.
+ */
+muse_cell fn_numvector_length( muse_env *env, void *context, muse_cell args )
+{
+	numvector_t *v = numvector_arg( env, &args );
+	return v ? _mk_int( v->length ) : MUSE_NIL;
+}
+
+/**
+ * @code (numvector->list v) @endcode
+ *
+ * Gives a list of the elements of the numeric vector.
+ */
+muse_cell fn_numvector_to_list( muse_env *env, void *context, muse_cell args )
+{
+	numvector_t *v = numvector_arg( env, &args );
+	muse_cell head = _cons( MUSE_NIL, MUSE_NIL );
+	muse_cell tail = head;
+	int sp = _spos();
+	int i;
+
+	for ( i = 0; v && i < v->length; ++i )
+	{
+		muse_cell c = _cons( numvector_get( env, v, i ), MUSE_NIL );
+		_sett( tail, c );
+		tail = c;
+		_unwind(sp);
+	}
+
+	return _tail(head);
+}
+
+/**
+ * Gives the size in bytes of the given field type - one of
+ * \c 'double, \c 'float, \c 'long or \c 'int - and its first
+ * letter in \p code, or 0 if it isn't one of them.
+ */
+static int numvector_field( muse_env *env, muse_cell type, int *code )
+{
+	const muse_char *name = _cellt(type) == MUSE_SYMBOL_CELL ? muse_symbol_name( env, type ) : L"";
+
+	*code = name[0];
+
+	if ( wcscmp( name, L"double" ) == 0 || wcscmp( name, L"long" ) == 0 )
+		return 8;
+	else if ( wcscmp( name, L"float" ) == 0 || wcscmp( name, L"int" ) == 0 )
+		return 4;
+	else
+		return 0;
+}
+
+/**
+ * @code (numvector->bytes v [field-type]) @endcode
+ *
+ * Gives a byte array of the elements of the vector, one after another
+ * in little endian order, each stored as the given field type -
+ * \c 'double, \c 'float, \c 'long or \c 'int, as with the
+ * \ref ByteArray "byte array" function. The default is \c 'double for
+ * an f64vector and \c 'long for an i64vector.
+ */
+muse_cell fn_numvector_to_bytes( muse_env *env, void *context, muse_cell args )
+{
+	numvector_t *v = numvector_arg( env, &args );
+	muse_cell type = MUSE_NIL;
+	int code = 0, size;
+
+	if ( !v )
+		return MUSE_NIL;
+
+	type = args ? _evalnext(&args) : _csymbol( _numvector_is_float(v) ? L"double" : L"long" );
+	size = numvector_field( env, type, &code );
+
+	if ( size == 0 )
+		return muse_raise_error( env, _csymbol(L"error:bad-field-type"), _cons( type, MUSE_NIL ) );
+
+	{
+		muse_cell result = muse_mk_bytes( env, (size_t)v->length * size );
+		unsigned char *bytes = (unsigned char*)muse_bytes_data( env, result, 0 );
+		int i;
+
+		switch ( code )
+		{
+		case 'd':
+			for ( i = 0; i < v->length; ++i, bytes += 8 )
+			{
+				muse_float f = _numvector_is_float(v) ? v->data.f[i] : (muse_float)v->data.i[i];
+				muse_int bits;
+				memcpy( &bits, &f, 8 );
+				put_long_LE( bytes, bits );
+			}
+			break;
+		case 'f':
+			for ( i = 0; i < v->length; ++i, bytes += 4 )
+			{
+				float f = (float)(_numvector_is_float(v) ? v->data.f[i] : (muse_float)v->data.i[i]);
+				int bits;
+				memcpy( &bits, &f, 4 );
+				put_int_LE( bytes, bits );
+			}
+			break;
+		case 'l':
+			for ( i = 0; i < v->length; ++i, bytes += 8 )
+				put_long_LE( bytes, _numvector_is_float(v) ? i64_from_float( v->data.f[i] ) : v->data.i[i] );
+			break;
+		case 'i':
+			for ( i = 0; i < v->length; ++i, bytes += 4 )
+				put_int_LE( bytes, (int)(_numvector_is_float(v) ? i64_from_float( v->data.f[i] ) : v->data.i[i]) );
+			break;
+		}
+
+		return result;
+	}
+}
+
+static muse_cell numvector_from_bytes( muse_env *env, int is_float, muse_cell args )
+{
+	muse_cell b = _evalnext(&args);
+	muse_cell type = args ? _evalnext(&args) : _csymbol( is_float ? L"double" : L"long" );
+	int code = 0;
+	int size = numvector_field( env, type, &code );
+
+	if ( !muse_functional_object_data( env, b, 'barr' ) )
+		return muse_raise_error( env, _csymbol(L"error:bytes-expected"), _cons( b, MUSE_NIL ) );
+
+	if ( size == 0 )
+		return muse_raise_error( env, _csymbol(L"error:bad-field-type"), _cons( type, MUSE_NIL ) );
+
+	{
+		int n = (int)(muse_bytes_size( env, b ) / size);
+		const unsigned char *bytes = (const unsigned char*)muse_bytes_data( env, b, 0 );
+		muse_cell result = mk_numvector( env, is_float, n );
+		numvector_t *v = numvector_data( env, result );
+		int i;
+
+		for ( i = 0; i < n; ++i )
+		{
+			muse_float f = 0.0;
+			muse_int x = 0;
+
+			switch ( code )
+			{
+			case 'd':
+				{
+					muse_int bits = long_LE( bytes + 8 * i );
+					memcpy( &f, &bits, 8 );
+					x = i64_from_float( f );
+				}
+				break;
+			case 'f':
+				{
+					int bits = int_LE( bytes + 4 * i );
+					float f32;
+					memcpy( &f32, &bits, 4 );
+					f = f32;
+					x = i64_from_float( f32 );
+				}
+				break;
+			case 'l':
+				x = long_LE( bytes + 8 * i );
+				f = (muse_float)x;
+				break;
+			case 'i':
+				x = int_LE( bytes + 4 * i );
+				f = (muse_float)x;
+				break;
+			}
+
+			if ( is_float )
+				v->data.f[i] = f;
+			else
+				v->data.i[i] = x;
+		}
+
+		return result;
+	}
+}
+
+/**
+ * @code (bytes->f64vector bytes [field-type]) @endcode
+ *
+ * Makes an f64vector of the numbers stored one after another in the
+ * byte array in little endian order, each as the given field type -
+ * \c 'double (the default), \c 'float, \c 'long or \c 'int.
+ * Bytes left over at the end are ignored.
+ */
+muse_cell fn_bytes_to_f64vector( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_from_bytes( env, MUSE_TRUE, args );
+}
+
+/**
+ * @code (bytes->i64vector bytes [field-type]) @endcode
+ *
+ * Makes an i64vector of the numbers stored one after another in the
+ * byte array in little endian order, each as the given field type -
+ * \c 'long (the default), \c 'int, \c 'double or \c 'float.
+ * Bytes left over at the end are ignored.
+ */
+muse_cell fn_bytes_to_i64vector( muse_env *env, void *context, muse_cell args )
+{
+	return numvector_from_bytes( env, MUSE_FALSE, args );
+}
+
+static const struct numvector_fns_t { const muse_char *name; muse_nativefn_t fn; } g_numvector_fns[] =
+{
+	{	L"mk-f64vector",		fn_mk_f64vector			},
+	{	L"mk-i64vector",		fn_mk_i64vector			},
+	{	L"f64vector",			fn_f64vector			},
+	{	L"i64vector",			fn_i64vector			},
+	{	L"list->f64vector",		fn_list_to_f64vector	},
+	{	L"list->i64vector",		fn_list_to_i64vector	},
+	{	L"f64vector?",			fn_f64vector_p			},
+	{	L"i64vector?",			fn_i64vector_p			},
+	{	L"numvector-length",	fn_numvector_length		},
+	{	L"numvector->list",		fn_numvector_to_list	},
+	{	L"numvector->bytes",	fn_numvector_to_bytes	},
+	{	L"bytes->f64vector",	fn_bytes_to_f64vector	},
+	{	L"bytes->i64vector",	fn_bytes_to_i64vector	},
+	{	L"numvector+",			fn_numvector_add		},
+	{	L"numvector-",			fn_numvector_sub		},
+	{	L"numvector*",			fn_numvector_mul		},
+	{	L"numvector/",			fn_numvector_div		},
+	{	L"numvector<",			fn_numvector_lt			},
+	{	L"numvector<=",			fn_numvector_le			},
+	{	L"numvector>",			fn_numvector_gt			},
+	{	L"numvector>=",			fn_numvector_ge			},
+	{	L"numvector=",			fn_numvector_eq			},
+	{	L"numvector-sum",		fn_numvector_sum		},
+	{	L"numvector-min",		fn_numvector_min		},
+	{	L"numvector-max",		fn_numvector_max		},
+	{	L"numvector-dot",		fn_numvector_dot		},
+	{	NULL,					NULL					},
+};
+
+void muse_define_builtin_type_numvector(muse_env *env)
+{
+	int sp = _spos();
+	const struct numvector_fns_t *fns = g_numvector_fns;
+	for ( ; fns->name; ++fns )
+	{
+		_define( _csymbol(fns->name), _mk_nativefn( fns->fn, NULL ) );
+		_unwind(sp);
+	}
+}
+
+/*@}*/
+/*@}*/
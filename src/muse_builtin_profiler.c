@@ -0,0 +1,647 @@
+/**
+ * @file muse_builtin_profiler.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * A profiler with two modes, selected using \ref fn_profile "profile".
+ *
+ * In the sampling mode, a timer thread periodically asks for a sample.
+ * The next muse_apply() then records the current process's trace stack
+ * together with the function being applied. The call paths are kept
+ * in a tree of functions with a count of the samples that ended at
+ * each node, and are reported as "collapsed stacks" - one line per path
+ * with the function names separated by ';' followed by the count - which
+ * is what flame graph tools take as input.
+ *
+ * In the exact mode, every closure call is counted and timed. Only the
+ * outermost of recursive calls to a closure adds to its inclusive time.
+ */
+
+#include "muse_builtins.h"
+#include "muse_port.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef MUSE_PLATFORM_WINDOWS
+	typedef HANDLE sampler_thread_t;
+#else
+#	include <pthread.h>
+	typedef pthread_t sampler_thread_t;
+#endif
+
+enum
+{
+	MUSE_PROFILE_OFF,
+	MUSE_PROFILE_SAMPLE,
+	MUSE_PROFILE_EXACT
+};
+
+enum
+{
+	MUSE_PROFILE_DEFAULT_INTERVAL_US	= 1000,
+	MUSE_PROFILE_MAX_NAME				= 256
+};
+
+/**
+ * A node of the tree of sampled call paths.
+ */
+typedef struct
+{
+	muse_cell	fn;
+	int			parent, child, sibling;
+	muse_int	count;	/**< The number of samples that ended at this node. */
+} sample_node_t;
+
+/**
+ * The call count and time of a closure in the exact mode.
+ */
+typedef struct
+{
+	muse_cell	fn;
+	muse_int	calls;
+	muse_int	inclusive_us;
+	int			active;	/**< The number of calls in progress. */
+} call_entry_t;
+
+typedef struct _muse_profile_t
+{
+	int					mode;
+	muse_boolean		saved_trace;	/**< The MUSE_ENABLE_TRACE setting before sampling started. */
+
+	/* Sampling mode. */
+	sample_node_t		*nodes;			/**< nodes[0] is the root. */
+	int					num_nodes, nodes_capacity;
+	muse_int			num_samples;
+	muse_int			interval_us;
+	volatile int		stop_sampler;
+	muse_boolean		sampler_running;
+	sampler_thread_t	sampler;
+
+	/* Exact mode. Open calls refer to entries by position, so the
+	entries don't move and are found using a separate hash index. */
+	call_entry_t		*entries;
+	int					num_entries, entries_capacity;
+	int					*index;		/**< 1 + the entry hashed to each slot, or 0. */
+	int					index_capacity;
+} muse_profile_t;
+
+/************************************************************************/
+/* Sampling                                                             */
+/************************************************************************/
+
+static void sampler_loop( muse_env *env )
+{
+	muse_profile_t *prof = env->profile;
+
+	while ( !prof->stop_sampler )
+	{
+		muse_sleep( prof->interval_us );
+		env->profile_sample_due = 1;
+	}
+}
+
+#ifdef MUSE_PLATFORM_WINDOWS
+static DWORD WINAPI sampler_thread_proc( LPVOID env )
+{
+	sampler_loop( (muse_env*)env );
+	return 0;
+}
+#else
+static void *sampler_thread_proc( void *env )
+{
+	sampler_loop( (muse_env*)env );
+	return NULL;
+}
+#endif
+
+static void start_sampler( muse_env *env )
+{
+	muse_profile_t *prof = env->profile;
+
+	prof->stop_sampler = 0;
+#ifdef MUSE_PLATFORM_WINDOWS
+	prof->sampler = CreateThread( NULL, 0, sampler_thread_proc, env, 0, NULL );
+	prof->sampler_running = (prof->sampler != NULL);
+#else
+	prof->sampler_running = (pthread_create( &prof->sampler, NULL, sampler_thread_proc, env ) == 0);
+#endif
+}
+
+static void stop_sampler( muse_env *env )
+{
+	muse_profile_t *prof = env->profile;
+
+	if ( !prof->sampler_running )
+		return;
+
+	prof->stop_sampler = 1;
+#ifdef MUSE_PLATFORM_WINDOWS
+	WaitForSingleObject( prof->sampler, INFINITE );
+	CloseHandle( prof->sampler );
+#else
+	pthread_join( prof->sampler, NULL );
+#endif
+	prof->sampler_running = MUSE_FALSE;
+	env->profile_sample_due = 0;
+}
+
+/**
+ * Returns the child of the given node for the function,
+ * adding one if there isn't one yet.
+ */
+static int sample_child( muse_profile_t *prof, int parent, muse_cell fn )
+{
+	int c;
+
+	for ( c = prof->nodes[parent].child; c > 0; c = prof->nodes[c].sibling )
+	{
+		if ( prof->nodes[c].fn == fn )
+			return c;
+	}
+
+	if ( prof->num_nodes >= prof->nodes_capacity )
+	{
+		prof->nodes_capacity *= 2;
+		prof->nodes = (sample_node_t*)realloc( prof->nodes, sizeof(sample_node_t) * prof->nodes_capacity );
+	}
+
+	c = prof->num_nodes++;
+	prof->nodes[c].fn		= fn;
+	prof->nodes[c].parent	= parent;
+	prof->nodes[c].child	= 0;
+	prof->nodes[c].sibling	= prof->nodes[parent].child;
+	prof->nodes[c].count	= 0;
+	prof->nodes[parent].child = c;
+	return c;
+}
+
+/**
+ * Called by muse_apply() when the sampling timer has gone off.
+ * Records the path given by the trace stack, followed by the
+ * function about to be applied. The trace stack only holds the
+ * latest frames, so very deep paths lose their outermost calls.
+ */
+void muse_profile_sample( muse_env *env, muse_cell fn )
+{
+	muse_profile_t *prof = env->profile;
+	muse_traceinfo_t *ti = &(env->current_process->traceinfo);
+	int bottom = ti->depth - ti->size;
+	int n = 0;
+
+	env->profile_sample_due = 0;
+
+	if ( prof == NULL || prof->mode != MUSE_PROFILE_SAMPLE )
+		return;
+
+	if ( bottom < 0 )
+		bottom = 0;
+
+	for ( ; bottom < ti->depth; ++bottom )
+	{
+		muse_cell f = ti->data[bottom % ti->size].fn;
+		if ( f )
+			n = sample_child( prof, n, f );
+	}
+
+	if ( fn )
+		n = sample_child( prof, n, fn );
+
+	prof->nodes[n].count++;
+	prof->num_samples++;
+}
+
+/************************************************************************/
+/* Exact mode                                                           */
+/************************************************************************/
+
+static int hash_fn( muse_cell fn, int capacity )
+{
+	return (int)((((unsigned long)fn >> 3) * 2654435761UL) & (capacity - 1));
+}
+
+static void rebuild_index( muse_profile_t *prof, int capacity )
+{
+	int e;
+
+	free( prof->index );
+	prof->index_capacity = capacity;
+	prof->index = (int*)calloc( capacity, sizeof(int) );
+
+	for ( e = 0; e < prof->num_entries; ++e )
+	{
+		int i = hash_fn( prof->entries[e].fn, capacity );
+		while ( prof->index[i] )
+			i = (i + 1) & (capacity - 1);
+		prof->index[i] = e + 1;
+	}
+}
+
+/**
+ * Returns the entry of the given function, adding one if needed.
+ */
+static int call_entry( muse_profile_t *prof, muse_cell fn )
+{
+	int i, e;
+
+	if ( 2 * (prof->num_entries + 1) > prof->index_capacity )
+		rebuild_index( prof, prof->index_capacity ? prof->index_capacity * 2 : 64 );
+
+	for ( i = hash_fn( fn, prof->index_capacity ); prof->index[i]; i = (i + 1) & (prof->index_capacity - 1) )
+	{
+		if ( prof->entries[prof->index[i] - 1].fn == fn )
+			return prof->index[i] - 1;
+	}
+
+	if ( prof->num_entries >= prof->entries_capacity )
+	{
+		prof->entries_capacity = prof->entries_capacity ? prof->entries_capacity * 2 : 32;
+		prof->entries = (call_entry_t*)realloc( prof->entries, sizeof(call_entry_t) * prof->entries_capacity );
+	}
+
+	e = prof->num_entries++;
+	prof->entries[e].fn				= fn;
+	prof->entries[e].calls			= 0;
+	prof->entries[e].inclusive_us	= 0;
+	prof->entries[e].active			= 0;
+	prof->index[i] = e + 1;
+	return e;
+}
+
+/**
+ * Called by muse_apply_lambda() when starting a call in the exact mode.
+ * Returns the depth to give to muse_profile_leave() once it is done.
+ */
+int muse_profile_enter( muse_env *env, muse_cell fn )
+{
+	muse_profile_t *prof = env->profile;
+	muse_profile_frames_t *pf = &(env->current_process->profile_frames);
+	muse_profile_frame_t *f;
+	call_entry_t *e;
+	int i = call_entry( prof, fn );
+
+	if ( pf->depth >= pf->capacity )
+	{
+		pf->capacity = pf->capacity ? pf->capacity * 2 : 64;
+		pf->frames = (muse_profile_frame_t*)realloc( pf->frames, sizeof(muse_profile_frame_t) * pf->capacity );
+	}
+
+	e = prof->entries + i;
+	e->calls++;
+
+	f = pf->frames + pf->depth;
+	f->entry		= i;
+	f->outermost	= (e->active == 0);
+	f->start_us		= muse_elapsed_us(env->timer);
+	e->active++;
+
+	return pf->depth++;
+}
+
+/**
+ * Ends the call started by the muse_profile_enter() that returned
+ * the given depth. Calls above it that never ended because of
+ * an exception or a continuation are ended as well.
+ */
+void muse_profile_leave( muse_env *env, int depth )
+{
+	muse_profile_t *prof = env->profile;
+	muse_profile_frames_t *pf = &(env->current_process->profile_frames);
+	muse_int now_us = muse_elapsed_us(env->timer);
+
+	while ( pf->depth > depth )
+	{
+		muse_profile_frame_t *f = pf->frames + (--pf->depth);
+		call_entry_t *e = prof->entries + f->entry;
+
+		if ( f->outermost )
+			e->inclusive_us += now_us - f->start_us;
+
+		e->active--;
+	}
+}
+
+/************************************************************************/
+/* Profile management                                                   */
+/************************************************************************/
+
+/**
+ * Marks the functions referred to by the profile, so that they
+ * remain to be reported.
+ */
+void muse_profile_mark( muse_env *env )
+{
+	muse_profile_t *prof = env->profile;
+	int i;
+
+	if ( prof == NULL )
+		return;
+
+	for ( i = 1; i < prof->num_nodes; ++i )
+		muse_mark( env, prof->nodes[i].fn );
+
+	for ( i = 0; i < prof->num_entries; ++i )
+		muse_mark( env, prof->entries[i].fn );
+}
+
+/**
+ * Stops profiling, leaving the collected data for reporting.
+ */
+static void stop_profile( muse_env *env )
+{
+	muse_profile_t *prof = env->profile;
+
+	if ( prof == NULL || prof->mode == MUSE_PROFILE_OFF )
+		return;
+
+	if ( prof->mode == MUSE_PROFILE_SAMPLE )
+	{
+		stop_sampler(env);
+		env->parameters[MUSE_ENABLE_TRACE] = prof->saved_trace;
+	}
+
+	env->profile_calls = MUSE_FALSE;
+	prof->mode = MUSE_PROFILE_OFF;
+}
+
+/**
+ * Discards the collected data and starts afresh in the given mode.
+ */
+static void start_profile( muse_env *env, int mode, muse_int interval_us )
+{
+	muse_profile_t *prof = env->profile;
+
+	if ( prof == NULL )
+	{
+		prof = env->profile = (muse_profile_t*)calloc( 1, sizeof(muse_profile_t) );
+		prof->nodes_capacity = 256;
+		prof->nodes = (sample_node_t*)malloc( sizeof(sample_node_t) * prof->nodes_capacity );
+	}
+	else
+		stop_profile(env);
+
+	prof->nodes[0].fn = MUSE_NIL;
+	prof->nodes[0].parent = prof->nodes[0].child = prof->nodes[0].sibling = 0;
+	prof->nodes[0].count = 0;
+	prof->num_nodes = 1;
+	prof->num_samples = 0;
+
+	prof->num_entries = 0;
+	if ( prof->index )
+		memset( prof->index, 0, sizeof(int) * prof->index_capacity );
+
+	/* Calls in progress refer to the discarded entries. */
+	{
+		muse_process_frame_t *p = env->current_process;
+		do
+		{
+			p->profile_frames.depth = 0;
+			p = p->next;
+		}
+		while ( p != env->current_process );
+	}
+
+	prof->mode = mode;
+
+	if ( mode == MUSE_PROFILE_SAMPLE )
+	{
+		prof->interval_us = interval_us > 0 ? interval_us : MUSE_PROFILE_DEFAULT_INTERVAL_US;
+		prof->saved_trace = env->parameters[MUSE_ENABLE_TRACE];
+		env->parameters[MUSE_ENABLE_TRACE] = MUSE_TRUE;
+		start_sampler(env);
+	}
+	else if ( mode == MUSE_PROFILE_EXACT )
+		env->profile_calls = MUSE_TRUE;
+}
+
+/**
+ * Stops profiling and releases the profile. Called when the
+ * environment is destroyed.
+ */
+void muse_destroy_profiler( muse_env *env )
+{
+	muse_profile_t *prof = env->profile;
+
+	if ( prof == NULL )
+		return;
+
+	stop_profile(env);
+	free( prof->nodes );
+	free( prof->entries );
+	free( prof->index );
+	free( prof );
+	env->profile = NULL;
+}
+
+/************************************************************************/
+/* Reporting                                                            */
+/************************************************************************/
+
+/**
+ * Gives the name of the function - the name given in its definition
+ * for closures, else the symbol it is defined as. Gives () for
+ * anonymous functions.
+ */
+static muse_cell profile_fn_name( muse_env *env, muse_cell fn )
+{
+	muse_cell name = (_cellt(fn) == MUSE_LAMBDA_CELL) ? meta_getname( env, fn ) : MUSE_NIL;
+	return name ? name : muse_symbol_with_value( env, fn );
+}
+
+/**
+ * Writes a readable name for the function into the buffer - its
+ * \ref profile_fn_name "name" if it has one and else its printed form.
+ */
+static size_t profile_name( muse_env *env, muse_cell fn, muse_char *buffer, size_t maxlen )
+{
+	muse_cell name = profile_fn_name( env, fn );
+	size_t len;
+
+	if ( name && _cellt(name) == MUSE_SYMBOL_CELL )
+		len = muse_sprintf( env, buffer, maxlen, L"%s", muse_symbol_name( env, name ) );
+	else if ( name && _cellt(name) == MUSE_TEXT_CELL )
+		len = muse_sprintf( env, buffer, maxlen, L"%s", muse_text_contents( env, name, NULL ) );
+	else
+		len = muse_sprintf( env, buffer, maxlen, L"%m", fn );
+
+	/* ';' and ' ' separate the parts of a collapsed stack. */
+	{
+		size_t i;
+		for ( i = 0; i < len; ++i )
+			if ( buffer[i] == ';' || buffer[i] == ' ' )
+				buffer[i] = '_';
+	}
+
+	return len;
+}
+
+static void port_write_chars( const muse_char *s, size_t len, muse_port_t p )
+{
+	size_t i;
+	for ( i = 0; i < len; ++i )
+		port_putchar( s[i], p );
+}
+
+static void write_path( muse_env *env, muse_profile_t *prof, int n, muse_port_t p )
+{
+	muse_char name[MUSE_PROFILE_MAX_NAME];
+	size_t len;
+
+	if ( prof->nodes[n].parent > 0 )
+	{
+		write_path( env, prof, prof->nodes[n].parent, p );
+		port_putchar( ';', p );
+	}
+
+	len = profile_name( env, prof->nodes[n].fn, name, MUSE_PROFILE_MAX_NAME );
+	port_write_chars( name, len, p );
+}
+
+/**
+ * @code (profile 'sample [interval-us]) @endcode
+ * @code (profile 'exact) @endcode
+ * @code (profile 'off) @endcode
+ * @code (profile) @endcode
+ *
+ * Starts or stops profiling. \c sample takes a sample of the
+ * current call path every interval-us microseconds (1000 by default),
+ * and turns on tracing while it runs. \c exact counts and times every
+ * closure call. Starting either discards the previously collected data.
+ * \c off stops profiling, keeping the data for \ref fn_profile_stacks "profile-stacks"
+ * and \ref fn_profile_calls "profile-calls". Without arguments,
+ * evaluates to the current mode.
+ */
+muse_cell fn_profile( muse_env *env, void *context, muse_cell args )
+{
+	static const muse_char *k_modes[] = { L"off", L"sample", L"exact" };
+
+	if ( args )
+	{
+		muse_cell mode = _evalnext(&args);
+
+		if ( mode == _csymbol(L"sample") )
+		{
+			muse_int interval_us = args ? _intvalue(_evalnext(&args)) : 0;
+			start_profile( env, MUSE_PROFILE_SAMPLE, interval_us );
+		}
+		else if ( mode == _csymbol(L"exact") )
+			start_profile( env, MUSE_PROFILE_EXACT, 0 );
+		else if ( mode == _csymbol(L"off") )
+			stop_profile( env );
+		else
+		{
+			MUSE_DIAGNOSTICS({
+				muse_message( env, L"(profile >>mode<<)", L"The mode has to be one of sample, exact or off.\nYou gave %m.", mode );
+			});
+			return MUSE_NIL;
+		}
+	}
+
+	return _csymbol( k_modes[env->profile ? env->profile->mode : MUSE_PROFILE_OFF] );
+}
+
+/**
+ * @code (profile-stacks [port]) @endcode
+ *
+ * Writes the call paths sampled by @code (profile 'sample) @endcode
+ * to the given port or the standard output as collapsed stacks -
+ * one line per path of the form @code outer;inner;innermost count @endcode
+ * that flame graph tools can render. Evaluates to the number of samples.
+ */
+muse_cell fn_profile_stacks( muse_env *env, void *context, muse_cell args )
+{
+	muse_profile_t *prof = env->profile;
+	muse_port_t p = args ? _port(_evalnext(&args)) : _stdport(MUSE_STDOUT_PORT);
+	int n;
+
+	if ( prof == NULL )
+		return _mk_int(0);
+
+	for ( n = 1; n < prof->num_nodes; ++n )
+	{
+		if ( prof->nodes[n].count > 0 )
+		{
+			muse_char count[32];
+			size_t len = muse_sprintf( env, count, 32, L" %d\n", prof->nodes[n].count );
+			write_path( env, prof, n, p );
+			port_write_chars( count, len, p );
+		}
+	}
+
+	port_flush(p);
+	return _mk_int(prof->num_samples);
+}
+
+static int compare_inclusive_time( const void *a, const void *b )
+{
+	muse_int ta = ((const call_entry_t*)a)->inclusive_us;
+	muse_int tb = ((const call_entry_t*)b)->inclusive_us;
+	return (ta < tb) ? 1 : ((ta > tb) ? -1 : 0);
+}
+
+/**
+ * @code (profile-calls) @endcode
+ *
+ * Evaluates to a list of entries of the form @code (fn calls inclusive-us) @endcode
+ * for the closures called since @code (profile 'exact) @endcode,
+ * in decreasing order of the time spent in them. \c fn is the name of
+ * the closure - the symbol it is defined as - or the closure itself
+ * if it has no name.
+ */
+muse_cell fn_profile_calls( muse_env *env, void *context, muse_cell args )
+{
+	muse_profile_t *prof = env->profile;
+	muse_cell h = MUSE_NIL, t = MUSE_NIL;
+	call_entry_t *sorted;
+	int i, n, sp;
+
+	if ( prof == NULL || prof->num_entries == 0 )
+		return MUSE_NIL;
+
+	n = prof->num_entries;
+	sorted = (call_entry_t*)malloc( sizeof(call_entry_t) * n );
+	memcpy( sorted, prof->entries, sizeof(call_entry_t) * n );
+
+	qsort( sorted, n, sizeof(call_entry_t), compare_inclusive_time );
+
+	sp = _spos();
+	for ( i = 0; i < n; ++i )
+	{
+		muse_cell name = profile_fn_name( env, sorted[i].fn );
+		muse_cell entry = _cons( _cons( name ? name : sorted[i].fn, _cons( _mk_int(sorted[i].calls), _cons( _mk_int(sorted[i].inclusive_us), MUSE_NIL ) ) ), MUSE_NIL );
+		if ( t )
+			_sett( t, entry );
+		else
+			h = entry;
+		t = entry;
+	}
+
+	free( sorted );
+	_unwind(sp);
+	_spush(h);
+	return h;
+}
+
+void muse_define_builtin_profiler( muse_env *env )
+{
+	static const struct _builtins { const muse_char *name; muse_nativefn_t fn; } k_profiler_funs[] =
+	{
+		{	L"profile",			fn_profile			},
+		{	L"profile-stacks",	fn_profile_stacks	},
+		{	L"profile-calls",	fn_profile_calls	},
+		{	NULL,				NULL				}
+	};
+
+	const struct _builtins *b = k_profiler_funs;
+	int sp = _spos();
+
+	for ( ; b->name; ++b )
+	{
+		_define( _csymbol(b->name), _mk_nativefn( b->fn, NULL ) );
+		_unwind(sp);
+	}
+}
@@ -58,6 +58,7 @@ typedef struct
 
 static muse_cell vector_force( muse_env *env, vector_t *v, int index, muse_cell val );
 static void vector_forceall( muse_env *env, vector_t *v );
+static vector_t *vector_range( muse_env *env, muse_cell obj, int *from, int *count, int *step );
 
 static vector_t *vector_init_with_length( void *ptr, int length )
 {
@@ -289,41 +290,55 @@ static muse_cell vector_map( muse_env *env, void *self, muse_cell fn )
 	return result;
 }
 
+/**
+ * Copies the elements of the vector or vector view \p obj into
+ * the slots of \p dest starting at \p offset. Gives the number
+ * of elements copied.
+ */
+static int vector_copy_into( muse_env *env, vector_t *dest, int offset, muse_cell obj )
+{
+	int from, count, step, i;
+	vector_t *v = vector_range( env, obj, &from, &count, &step );
+
+	for ( i = 0; v && i < count; ++i )
+	{
+		int j = from + i * step;
+		dest->slots[offset + i] = vector_force( env, v, j, v->slots[j] );
+	}
+
+	return v ? count : 0;
+}
+
 static muse_cell vector_join( muse_env *env, void *self, muse_cell objlist, muse_cell reduction_fn )
 {
-	vector_t *v1 = (vector_t*)self;
+	muse_cell self_cell = ((muse_functional_object_t*)self)->self;
 	muse_cell result;
 	vector_t *result_ptr;
+	int from, count, step;
 	
 	/* Compute the required total length. */
-	int total_length = v1->length;
+	int total_length = 0;
 	{
 		muse_cell temp_objlist = objlist;
+		vector_range( env, self_cell, &from, &total_length, &step );
 		while ( temp_objlist )
 		{
-			muse_cell obj = _next(&temp_objlist);
-			vector_t *v2 = (vector_t*)_functional_object_data( obj, 'vect' );
-			total_length += v2->length;
+			if ( vector_range( env, _next(&temp_objlist), &from, &count, &step ) )
+				total_length += count;
 		}
 	}
 	
 	{
+		int offset;
+
 		result = muse_mk_vector( env, total_length );
 		result_ptr = (vector_t*)_functional_object_data( result, 'vect' );
-		vector_forceall( env, v1 );
-		
-		memcpy( result_ptr->slots, v1->slots, sizeof(muse_cell) * v1->length );
+
+		offset = vector_copy_into( env, result_ptr, 0, self_cell );
 		
+		while ( objlist )
 		{
-			int offset = v1->length;
-			while ( objlist )
-			{
-				muse_cell obj = _next(&objlist);
-				vector_t *v2 = (vector_t*)_functional_object_data( obj, 'vect' );
-				vector_forceall( env, v2 );
-				memcpy( result_ptr->slots + offset, v2->slots, sizeof(muse_cell) * v2->length );
-				offset += v2->length;
-			}
+			offset += vector_copy_into( env, result_ptr, offset, _next(&objlist) );
 		}
 	}
 	
@@ -748,31 +763,389 @@ muse_cell fn_list_to_vector( muse_env *env, void *context, muse_cell args )
 muse_cell fn_vector_to_list( muse_env *env, void *context, muse_cell args )
 {
 	muse_cell fv = _evalnext(&args);
-	vector_t *v = (vector_t*)_functional_object_data(fv,'vect');
+	int vfrom, vcount, vstep;
+	vector_t *v = vector_range( env, fv, &vfrom, &vcount, &vstep );
 	muse_assert( v != NULL && "First argument must be a functional vector!" );
 
-	vector_forceall( env, v );
-
 	{
 		int from	= 0;
-		int count	= v->length;
+		int count	= vcount;
 		int step	= 1;
+		int i;
 
 		if ( args ) from	= (int)_intvalue(_evalnext(&args));
 		
 		/* Make sure count stays within valid limits even if
 		it isn't specified explcitly. */
-		count = v->length - from;
+		count = vcount - from;
 		
 		if ( args ) count	= (int)_intvalue(_evalnext(&args));
 		if ( args ) step	= (int)_intvalue(_evalnext(&args));
 
-		muse_assert( count >= 0 && from >= 0 && from + step * count <= v->length );
+		muse_assert( count >= 0 && from >= 0 && from + step * count <= vcount );
+
+		/* Only force the slots that go into the list, so that
+		converting a view doesn't force the whole vector. */
+		if ( v->datafn )
+		{
+			for ( i = 0; i < count; ++i )
+			{
+				int j = vfrom + (from + i * step) * vstep;
+				vector_force( env, v, j, v->slots[j] );
+			}
+		}
+
+		return muse_array_to_list( env, count, v->slots + vfrom + from * vstep, step * vstep );
+	}
+}
+
+/**
+ * @defgroup VectorViews Vector views
+ *
+ * A vector view is a window on to a range of the slots of a vector,
+ * made by \ref fn_vector_view "vector-view". It doesn't copy any slots -
+ * getting an element of the view gets the element of the vector and
+ * setting one sets the vector's slot. A view can be used wherever a
+ * vector can be read from - as a function, with \ref fn_vector_length "vector-length",
+ * \ref fn_vector_to_list "vector->list", \ref fn_map "map", \ref fn_reduce "reduce",
+ * \ref fn_for_each "for-each", \ref fn_join "join" and \ref fn_transpose "transpose".
+ * None of them touch the slots of the vector outside the view.
+ *
+ * \ref fn_slice "slice" on a view copies the elements it selects into
+ * a new vector, so @code (slice view) @endcode is the way to get a copy.
+ *
+ * @code
+ * (define v (vector 0 1 2 3 4 5 6 7 8 9))
+ * (define w (vector-view v 2 5))
+ * (print (vector->list w))
+ *      > (2 3 4 5 6)
+ * (w 0 'two)
+ * (print (v 2))
+ *      > two
+ * (print (vector->list (vector-view w 4 3 -1)))
+ *      > (6 5 4)
+ * @endcode
+ */
+/*@{*/
+
+typedef struct
+{
+	muse_functional_object_t base;
+	muse_cell parent;	/**< Always a vector, never another view. */
+	int from, count, step;
+} vector_view_t;
+
+static void vector_view_mark( muse_env *env, void *ptr )
+{
+	muse_mark( env, ((vector_view_t*)ptr)->parent );
+}
+
+static vector_t *vector_view_parent( muse_env *env, vector_view_t *w )
+{
+	return (vector_t*)_functional_object_data( w->parent, 'vect' );
+}
+
+/**
+ * Gives the element of the view at the given index,
+ * which must be in range.
+ */
+static muse_cell vector_view_at( muse_env *env, vector_view_t *w, int index )
+{
+	vector_t *v = vector_view_parent( env, w );
+	int j = w->from + index * w->step;
+	return vector_force( env, v, j, v->slots[j] );
+}
+
+/**
+ * Writes out the elements of the view as a vector, so a
+ * trusted read gives back a copy of the view.
+ */
+static void vector_view_write( muse_env *env, void *ptr, void *port )
+{
+	vector_view_t *w = (vector_view_t*)ptr;
+	muse_port_t p = (muse_port_t)port;
+	int i;
+	
+	port_putc( '{', p );
+	port_write( "vector", 6, p );	
+	
+	for ( i = 0; i < w->count; ++i )
+	{
+		port_putc( ' ', p );
+		muse_pwrite( p, vector_view_at( env, w, i ) );
+	}
+	
+	port_putc( '}', p );
+}
+
+/**
+ * The function that implements access to the slots of a vector view.
+ */
+muse_cell fn_vector_view_fn( muse_env *env, vector_view_t *w, muse_cell args )
+{
+	muse_cell indexcell = _evalnext(&args);
+	muse_int index = _intvalue(indexcell);
+
+	if ( index < 0 || index >= w->count )
+		return muse_raise_error( env, _csymbol(L"error:index-out-of-range"), _cons( w->base.self, _cons( indexcell, MUSE_NIL ) ) );
+
+	if ( args )
+	{
+		/* Set value. */
+		muse_cell newval = _evalnext(&args);
+		vector_view_parent( env, w )->slots[w->from + (int)index * w->step] = newval;
+		return newval;
+	}
+	else
+	{
+		/* Get value. */
+		return vector_view_at( env, w, (int)index );
+	}
+}
+
+static muse_cell vector_view_size( muse_env *env, void *self )
+{
+	return _mk_int( ((vector_view_t*)self)->count );
+}
+
+static muse_cell vector_view_map( muse_env *env, void *self, muse_cell fn )
+{
+	vector_view_t *w = (vector_view_t*)self;
+	muse_cell result = muse_mk_vector( env, w->count );
+	vector_t *result_ptr = (vector_t*)_functional_object_data( result, 'vect' );
+	muse_cell args = _cons( MUSE_NIL, MUSE_NIL );
+	int sp = _spos();
+	int i;
+
+	for ( i = 0; i < w->count; ++i )
+	{
+		_seth( args, vector_view_at( env, w, i ) );
+		result_ptr->slots[i] = _apply( fn, args, MUSE_TRUE );
+		_unwind(sp);
+	}
+
+	return result;
+}
+
+/**
+ * Copies the elements of the view into a new vector.
+ */
+static muse_cell vector_view_copy( muse_env *env, vector_view_t *w )
+{
+	muse_cell result = muse_mk_vector( env, w->count );
+	vector_copy_into( env, (vector_t*)_functional_object_data( result, 'vect' ), 0, w->base.self );
+	return result;
+}
+
+static muse_cell vector_view_collect( muse_env *env, void *self, muse_cell predicate, muse_cell mapper, muse_cell reduction_fn )
+{
+	muse_cell copy = vector_view_copy( env, (vector_view_t*)self );
+	return vector_collect( env, _functional_object_data( copy, 'vect' ), predicate, mapper, reduction_fn );
+}
+
+static muse_cell vector_view_reduce( muse_env *env, void *self, muse_cell reduction_fn, muse_cell initial )
+{
+	vector_view_t *w = (vector_view_t*)self;
+	muse_cell result = initial;
+	int sp = _spos();
+	int i;
+	
+	_spush(result);
+	
+	for ( i = 0; i < w->count; ++i )
+	{
+		result = _apply( reduction_fn,
+							 _cons( result, _cons( vector_view_at( env, w, i ), MUSE_NIL ) ),
+							 MUSE_TRUE );
+		_unwind(sp);
+		_spush(result);
+	}
+	
+	return result;	
+}
+
+static muse_cell vector_view_slice( muse_env *env, void *self, muse_cell argv )
+{
+	vector_view_t *w = (vector_view_t*)self;
+	int from, count, step, to, i;
+	muse_cell result;
+	vector_t *result_ptr;
+
+	get_slice_iterator_from_args( env, &from, &count, &step, &to, w->count, &argv );
+
+	result = muse_mk_vector( env, count > 0 ? count : 0 );
+	result_ptr = (vector_t*)_functional_object_data( result, 'vect' );
+
+	for ( i = 0; i < count; ++i )
+	{
+		result_ptr->slots[i] = vector_view_at( env, w, from + i * step );
+	}
+
+	return result;
+}
 
-		return muse_array_to_list( env, count, v->slots + from, step );
+static muse_cell vector_view_iterator( muse_env *env, vector_view_t *self, muse_iterator_callback_t callback, void *context )
+{
+	int sp = _spos();
+	int i;
+
+	for ( i = 0; i < self->count; ++i )
+	{
+		muse_boolean cont = callback( env, self, context, vector_view_at( env, self, i ) );
+		_unwind(sp);
+		if ( !cont )
+			return _mk_int(i); /**< Return the current index. */
 	}
+
+	return MUSE_NIL;
 }
 
+static muse_cell vector_view_get( muse_env *env, void *self, muse_cell key, muse_cell argv )
+{
+	vector_view_t *w = (vector_view_t*)self;
+	if ( _cellt(key) == MUSE_INT_CELL ) {
+		int index = (int)muse_int_value(env, key);
+		muse_cell val = (index >= 0 && index < w->count) ? vector_view_at( env, w, index ) : MUSE_NIL;
+		return argv ? muse_get( env, val, _head(argv), _tail(argv) ) : val;
+	} else {
+		return MUSE_NIL;
+	}
+}
+
+static muse_cell vector_view_put( muse_env *env, void *self, muse_cell key, muse_cell argv )
+{
+	vector_view_t *w = (vector_view_t*)self;
+	if ( _cellt(key) == MUSE_INT_CELL && _intvalue(key) >= 0 && _intvalue(key) < w->count ) {
+		muse_cell val = _next(&argv);
+		int index = (int)muse_int_value(env,key);
+		muse_cell *slot = vector_view_parent( env, w )->slots + w->from + index * w->step;
+		return argv ? muse_put( env, *slot, val, argv ) : (*slot = val); 
+	} else {
+		return MUSE_NIL;
+	}
+}
+
+static muse_prop_view_t g_vector_view_prop_view =
+{
+	vector_view_get,
+	vector_view_put
+};
+
+static muse_monad_view_t g_vector_view_monad_view =
+{
+	vector_view_size,
+	vector_view_map,
+	vector_join,
+	vector_view_collect,
+	vector_view_reduce,
+	vector_view_slice
+};
+
+static void *vector_view_view( muse_env *env, int id )
+{
+	switch ( id )
+	{
+		case 'mnad' : return &g_vector_view_monad_view;
+		case 'iter' : return vector_view_iterator;
+		case 'prop' : return &g_vector_view_prop_view;
+		case 'frmt' : return &g_vector_format_view;
+		default : return NULL;
+	}
+}
+
+static muse_functional_object_type_t g_vector_view_type =
+{
+	'muSE',
+	'vecv',
+	sizeof(vector_view_t),
+	(muse_nativefn_t)fn_vector_view_fn,
+	vector_view_view,
+	NULL,
+	vector_view_mark,
+	NULL,
+	vector_view_write
+};
+
+/**
+ * Gives the vector underlying the given vector or vector view,
+ * along with the range of its slots that \p obj covers. Gives
+ * NULL if \p obj is neither.
+ */
+static vector_t *vector_range( muse_env *env, muse_cell obj, int *from, int *count, int *step )
+{
+	muse_functional_object_t *fobj = _fnobjdata(obj);
+
+	if ( fobj && fobj->type_info == &g_vector_type )
+	{
+		vector_t *v = (vector_t*)fobj;
+		(*from) = 0;
+		(*count) = v->length;
+		(*step) = 1;
+		return v;
+	}
+	else if ( fobj && fobj->type_info == &g_vector_view_type )
+	{
+		vector_view_t *w = (vector_view_t*)fobj;
+		(*from) = w->from;
+		(*count) = w->count;
+		(*step) = w->step;
+		return vector_view_parent( env, w );
+	}
+	else
+	{
+		return NULL;
+	}
+}
+
+/**
+ * @code (vector-view v [from count step]) @endcode
+ *
+ * Makes a view of the slots of the vector \p v, without copying
+ * them. \p from, \p count and \p step select the slots the same way
+ * as they do for \ref fn_slice "slice". The view is a function like
+ * a vector - @code (view i) @endcode gets the slot \c i of the view
+ * and @code (view i x) @endcode sets the corresponding slot of \p v.
+ * 
+ * \p v can itself be a view, in which case the new view is of the
+ * same vector.
+ */
+muse_cell fn_vector_view( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell vec = _evalnext(&args);
+	muse_cell argv = muse_eval_list( env, args );
+	int vfrom, vcount, vstep, from, count, step, to;
+	vector_t *v = vector_range( env, vec, &vfrom, &vcount, &vstep );
+
+	if ( !v )
+		return muse_raise_error( env, _csymbol(L"error:vector-expected"), _cons( vec, MUSE_NIL ) );
+
+	get_slice_iterator_from_args( env, &from, &count, &step, &to, vcount, &argv );
+
+	{
+		muse_cell result = _mk_functional_object( &g_vector_view_type, MUSE_NIL );
+		vector_view_t *w = (vector_view_t*)_functional_object_data( result, 'vecv' );
+
+		w->parent	= v->base.self;
+		w->count	= count > 0 ? count : 0;
+		w->from		= w->count > 0 ? vfrom + from * vstep : 0;
+		w->step		= step * vstep;
+
+		return result;
+	}
+}
+
+/**
+ * @code (vector-view? x) @endcode
+ *
+ * Gives \p x if it is a vector view, or () if it isn't.
+ */
+muse_cell fn_vector_view_p( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell x = _evalnext(&args);
+	return _functional_object_data( x, 'vecv' ) ? x : MUSE_NIL;
+}
+
+/*@}*/
 
 static const struct vector_fns_t { const muse_char *name; muse_nativefn_t fn; } g_vector_fns[] =
 {
@@ -782,6 +1155,8 @@ static const struct vector_fns_t { const muse_char *name; muse_nativefn_t fn; }
 	{	L"vector-length",		fn_vector_length	},
 	{	L"vector->list",		fn_vector_to_list	},
 	{	L"list->vector",		fn_list_to_vector	},
+	{	L"vector-view",			fn_vector_view		},
+	{	L"vector-view?",		fn_vector_view_p	},
 	{	NULL,					NULL				},
 };
 
@@ -813,13 +1188,14 @@ MUSEAPI muse_cell muse_mk_vector( muse_env *env, int length )
 }
 
 /**
- * Returns the number of slots the vector has.
+ * Returns the number of slots the vector or vector view has.
  */
 MUSEAPI int muse_vector_length( muse_env *env, muse_cell vec )
 {
-	vector_t *v = (vector_t*)_functional_object_data( vec, 'vect' );
+	int from, count, step;
+	vector_t *v = vector_range( env, vec, &from, &count, &step );
 	muse_assert( v != NULL && "v must be a vector!" );
-	return v ? v->length : 0;
+	return v ? count : 0;
 }
 
 /**
@@ -827,11 +1203,13 @@ MUSEAPI int muse_vector_length( muse_env *env, muse_cell vec )
  */
 MUSEAPI muse_cell muse_vector_get( muse_env *env, muse_cell vec, int index )
 {
-	vector_t *v = (vector_t*)_functional_object_data( vec, 'vect' );
+	int from, count, step;
+	vector_t *v = vector_range( env, vec, &from, &count, &step );
 	muse_assert( v != NULL && "v must be a vector!" );
 	if ( v )
 	{
-		muse_assert( index >= 0 && index < v->length );
+		muse_assert( index >= 0 && index < count );
+		index = from + index * step;
 		return vector_force( env, v, index, v->slots[index] );
 	}
 	else
@@ -843,12 +1221,13 @@ MUSEAPI muse_cell muse_vector_get( muse_env *env, muse_cell vec, int index )
  */
 MUSEAPI muse_cell muse_vector_put( muse_env *env, muse_cell vec, int index, muse_cell value )
 {
-	vector_t *v = (vector_t*)_functional_object_data( vec, 'vect' );
+	int from, count, step;
+	vector_t *v = vector_range( env, vec, &from, &count, &step );
 	muse_assert( v != NULL && "v must be a vector!");
 	if ( v )
 	{
-		muse_assert( index >= 0 && index < v->length );
-		v->slots[index] = value;
+		muse_assert( index >= 0 && index < count );
+		v->slots[from + index * step] = value;
 		return value;
 	}
 	else
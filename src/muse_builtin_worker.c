@@ -0,0 +1,1033 @@
+/**
+ * @file muse_builtin_worker.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Workers - muSE environments running on threads of their own, so that
+ * a program can use more than one core. Environments share no cells, so
+ * a message to another environment is flattened into a byte image by the
+ * sender and rebuilt in the receiver's heap by the receiver.
+ *
+ * Every environment that takes part has an inbox. Senders push messages
+ * onto it without taking a lock. The receiving environment moves them into
+ * the mailbox of its main process from run_next_process(), and sleeps on
+ * the inbox when none of its processes can run.
+ */
+
+#include "muse_builtins.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef MUSE_PLATFORM_WINDOWS
+	typedef volatile LONG worker_atomic_t;
+#	define atomic_increment(a)			InterlockedIncrement(a)
+#	define atomic_decrement(a)			InterlockedDecrement(a)
+#	define atomic_cas_ptr(p,old,new)	(InterlockedCompareExchangePointer( (PVOID volatile*)(p), (new), (old) ) == (old))
+#	define atomic_take_ptr(p)			InterlockedExchangePointer( (PVOID volatile*)(p), NULL )
+#	define memory_barrier()				MemoryBarrier()
+#else
+#	include <pthread.h>
+#	include <sys/time.h>
+#	include <time.h>
+#	include <unistd.h>
+#	include <fcntl.h>
+	typedef volatile int worker_atomic_t;
+#	define atomic_increment(a)			__sync_add_and_fetch( (a), 1 )
+#	define atomic_decrement(a)			__sync_sub_and_fetch( (a), 1 )
+#	define atomic_cas_ptr(p,old,new)	__sync_bool_compare_and_swap( (p), (old), (new) )
+#	define atomic_take_ptr(p)			__sync_lock_test_and_set( (p), NULL )
+#	define memory_barrier()				__sync_synchronize()
+#endif
+
+/** @addtogroup Processes */
+/*@{*/
+
+struct _muse_inbox_t;
+
+/**
+ * A message on its way to another environment.
+ */
+typedef struct _muse_message_t
+{
+	struct _muse_message_t	*next;
+	struct _muse_inbox_t	*from;		/**< The sender's inbox, referenced. */
+	muse_boolean			as_is;		/**< Sent using \ref fn_post "post", so the sender is not prepended. */
+	size_t					size;
+	unsigned char			data[1];
+} muse_message_t;
+
+/**
+ * The receiving end of an environment. It is reference counted because
+ * handles to it live in other environments, which can outlast it.
+ */
+typedef struct _muse_inbox_t
+{
+	worker_atomic_t			refs;
+	muse_message_t * volatile head;		/**< Pushed by senders, newest first. */
+	volatile int			sleeping;	/**< Set while the owner waits for messages. */
+	volatile int			closed;		/**< Set once the owner has gone away. */
+#ifdef MUSE_PLATFORM_WINDOWS
+	HANDLE					wakeup;
+#else
+	pthread_mutex_t			lock;
+	pthread_cond_t			wakeup;
+	int						signalled;
+	int						wake_pipe[2];	/**< Made readable for an owner waiting on the network as well, or -1. */
+#endif
+} muse_inbox_t;
+
+/**
+ * What a handle to another environment refers to. The inbox is
+ * NULL once the handle's environment has let go of it.
+ */
+typedef struct
+{
+	muse_inbox_t *inbox;
+} worker_link_t;
+
+typedef struct _muse_workers_t
+{
+	muse_inbox_t			*inbox;
+	muse_inbox_t			*parent;		/**< The environment that spawned this one, if it is a worker. */
+	muse_process_frame_t	*main_process;	/**< Messages from other environments go here. */
+	muse_cell				*peers;			/**< Handles to other environments. There is one per inbox. */
+	int						num_peers, peers_capacity;
+} muse_workers_t;
+
+typedef struct
+{
+	muse_inbox_t	*inbox;
+	muse_inbox_t	*parent;
+	muse_message_t	*thunk;
+	int				*parameters;
+} worker_start_t;
+
+static muse_cell fn_worker( muse_env *env, worker_link_t *link, muse_cell args );
+
+/************************************************************************/
+/* Inboxes                                                              */
+/************************************************************************/
+
+static muse_inbox_t *new_inbox()
+{
+	muse_inbox_t *inbox = (muse_inbox_t*)calloc( 1, sizeof(muse_inbox_t) );
+	inbox->refs = 1;
+#ifdef MUSE_PLATFORM_WINDOWS
+	inbox->wakeup = CreateEvent( NULL, FALSE, FALSE, NULL );
+#else
+	pthread_mutex_init( &inbox->lock, NULL );
+	pthread_cond_init( &inbox->wakeup, NULL );
+	inbox->wake_pipe[0] = inbox->wake_pipe[1] = -1;
+#endif
+	return inbox;
+}
+
+static muse_inbox_t *retain_inbox( muse_inbox_t *inbox )
+{
+	atomic_increment( &inbox->refs );
+	return inbox;
+}
+
+static void free_messages( muse_message_t *m );
+
+static void release_inbox( muse_inbox_t *inbox )
+{
+	if ( inbox && atomic_decrement( &inbox->refs ) == 0 )
+	{
+		free_messages( (muse_message_t*)atomic_take_ptr( &inbox->head ) );
+#ifdef MUSE_PLATFORM_WINDOWS
+		CloseHandle( inbox->wakeup );
+#else
+		pthread_cond_destroy( &inbox->wakeup );
+		pthread_mutex_destroy( &inbox->lock );
+		if ( inbox->wake_pipe[0] >= 0 )
+		{
+			close( inbox->wake_pipe[0] );
+			close( inbox->wake_pipe[1] );
+		}
+#endif
+		free( inbox );
+	}
+}
+
+static void push_message( muse_inbox_t *inbox, muse_message_t *m )
+{
+	muse_message_t *head;
+
+	do
+	{
+		head = inbox->head;
+		m->next = head;
+	}
+	while ( !atomic_cas_ptr( &inbox->head, head, m ) );
+
+	/* The push is a full barrier, so either we see the receiver
+	going to sleep or it sees the message before it does. */
+	if ( inbox->sleeping )
+	{
+#ifdef MUSE_PLATFORM_WINDOWS
+		SetEvent( inbox->wakeup );
+#else
+		pthread_mutex_lock( &inbox->lock );
+		inbox->signalled = 1;
+		pthread_cond_signal( &inbox->wakeup );
+		if ( inbox->wake_pipe[1] >= 0 )
+			write( inbox->wake_pipe[1], "", 1 );
+		pthread_mutex_unlock( &inbox->lock );
+#endif
+	}
+}
+
+/**
+ * Takes all the messages in the inbox, oldest first.
+ */
+static muse_message_t *take_messages( muse_inbox_t *inbox )
+{
+	muse_message_t *m = (muse_message_t*)atomic_take_ptr( &inbox->head );
+	muse_message_t *result = NULL;
+
+	while ( m )
+	{
+		muse_message_t *next = m->next;
+		m->next = result;
+		result = m;
+		m = next;
+	}
+
+	return result;
+}
+
+/**
+ * Waits for a message to arrive for up to \p wait_us microseconds,
+ * or indefinitely if \p wait_us is negative.
+ */
+static void wait_for_messages( muse_inbox_t *inbox, muse_int wait_us )
+{
+	inbox->sleeping = 1;
+	memory_barrier();
+
+#ifdef MUSE_PLATFORM_WINDOWS
+	if ( inbox->head == NULL )
+		WaitForSingleObject( inbox->wakeup, wait_us < 0 ? INFINITE : (DWORD)((wait_us + 999) / 1000) );
+#else
+	pthread_mutex_lock( &inbox->lock );
+	if ( inbox->head == NULL && !inbox->signalled )
+	{
+		if ( wait_us < 0 )
+			pthread_cond_wait( &inbox->wakeup, &inbox->lock );
+		else
+		{
+			struct timeval now;
+			struct timespec until;
+			muse_int ns;
+
+			gettimeofday( &now, NULL );
+			ns = ((muse_int)now.tv_usec + wait_us) * 1000;
+			until.tv_sec = now.tv_sec + (time_t)(ns / 1000000000);
+			until.tv_nsec = (long)(ns % 1000000000);
+			pthread_cond_timedwait( &inbox->wakeup, &inbox->lock, &until );
+		}
+	}
+	inbox->signalled = 0;
+	pthread_mutex_unlock( &inbox->lock );
+#endif
+
+	inbox->sleeping = 0;
+}
+
+/************************************************************************/
+/* Message images                                                       */
+/************************************************************************/
+
+/*
+ * A value is written as a tag byte followed by its contents -
+ *	'n'							()
+ *	'q' value					a quick-quoted value
+ *	'i' muse_int				an integer
+ *	'f' muse_float				a float
+ *	't' int muse_char...		a text
+ *	's' int muse_char...		a symbol, by name
+ *	'l' int value... value		a list - its elements, then its last tail
+ *	'v' int value...			a vector
+ *	'w' muse_inbox_t*			a handle to an environment, referenced
+ *
+ * Scalars are copied in and out with memcpy, so they need no alignment.
+ * The characters of a text are preceded by padding to align them, so that
+ * the text can be taken directly from the image.
+ */
+
+typedef struct
+{
+	unsigned char	*data;
+	size_t			size, capacity;
+} image_t;
+
+static void put_bytes( image_t *im, const void *bytes, size_t n )
+{
+	if ( im->size + n > im->capacity )
+	{
+		do
+			im->capacity = im->capacity ? 2 * im->capacity : 256;
+		while ( im->size + n > im->capacity );
+
+		im->data = (unsigned char*)realloc( im->data, im->capacity );
+	}
+
+	memcpy( im->data + im->size, bytes, n );
+	im->size += n;
+}
+
+static void put_tag( image_t *im, char tag )
+{
+	put_bytes( im, &tag, 1 );
+}
+
+static void put_int( image_t *im, int i )
+{
+	put_bytes( im, &i, sizeof(i) );
+}
+
+static void put_chars( image_t *im, char tag, const muse_char *s, int length )
+{
+	static const unsigned char k_padding[sizeof(muse_char)] = {0};
+
+	put_tag( im, tag );
+	put_int( im, length );
+	put_bytes( im, k_padding, (sizeof(muse_char) - (im->size % sizeof(muse_char))) % sizeof(muse_char) );
+	put_bytes( im, s, length * sizeof(muse_char) );
+}
+
+static muse_boolean is_worker( muse_env *env, muse_cell c )
+{
+	return (c && _cellt(c) == MUSE_NATIVEFN_CELL && _ptr(c)->fn.fn == (muse_nativefn_t)fn_worker) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+static void put_value( muse_env *env, image_t *im, muse_cell c )
+{
+	if ( c < 0 )
+	{
+		put_tag( im, 'q' );
+		put_value( env, im, _quq(c) );
+		return;
+	}
+
+	if ( c == MUSE_NIL )
+	{
+		put_tag( im, 'n' );
+		return;
+	}
+
+	switch ( _cellt(c) )
+	{
+	case MUSE_CONS_CELL :
+		{
+			muse_cell l = c;
+			int n = 0;
+
+			while ( l > 0 && _cellt(l) == MUSE_CONS_CELL )
+			{
+				++n;
+				l = _tail(l);
+			}
+
+			put_tag( im, 'l' );
+			put_int( im, n );
+
+			for ( l = c; n > 0; --n )
+			{
+				put_value( env, im, _head(l) );
+				l = _tail(l);
+			}
+
+			put_value( env, im, l );
+		}
+		return;
+
+	case MUSE_INT_CELL :
+		{
+			muse_int i = _intvalue(c);
+			put_tag( im, 'i' );
+			put_bytes( im, &i, sizeof(i) );
+		}
+		return;
+
+	case MUSE_FLOAT_CELL :
+		{
+			muse_float f = _floatvalue(c);
+			put_tag( im, 'f' );
+			put_bytes( im, &f, sizeof(f) );
+		}
+		return;
+
+	case MUSE_TEXT_CELL :
+		{
+			int length = 0;
+			const muse_char *s = _text_contents( c, &length );
+			put_chars( im, 't', s, length );
+		}
+		return;
+
+	case MUSE_SYMBOL_CELL :
+		{
+			const muse_char *name = muse_symbol_name( env, c );
+			put_chars( im, 's', name, (int)wcslen(name) );
+		}
+		return;
+
+	case MUSE_NATIVEFN_CELL :
+		if ( is_worker( env, c ) )
+		{
+			worker_link_t *link = (worker_link_t*)_ptr(c)->fn.context;
+			if ( link->inbox )
+			{
+				muse_inbox_t *inbox = retain_inbox( link->inbox );
+				put_tag( im, 'w' );
+				put_bytes( im, &inbox, sizeof(inbox) );
+				return;
+			}
+		}
+		else if ( _functional_object_data( c, 'vect' ) )
+		{
+			int i, n = muse_vector_length( env, c );
+			put_tag( im, 'v' );
+			put_int( im, n );
+			for ( i = 0; i < n; ++i )
+				put_value( env, im, muse_vector_get( env, c, i ) );
+			return;
+		}
+		break;
+
+	case MUSE_LAMBDA_CELL :
+	case MUSE_LAZY_CELL :
+		break;
+	}
+
+	/* Closures, processes, ports and the like only
+	make sense in the environment they belong to. */
+	muse_raise_error( env, _csymbol(L"error:not-sendable"), _cons( c, MUSE_NIL ) );
+	put_tag( im, 'n' );
+}
+
+static muse_message_t *new_message( muse_env *env, muse_cell msg )
+{
+	image_t im = { NULL, 0, 0 };
+	muse_message_t *m;
+
+	put_value( env, &im, msg );
+
+	m = (muse_message_t*)calloc( 1, sizeof(muse_message_t) + im.size );
+	m->size = im.size;
+	memcpy( m->data, im.data, im.size );
+	free( im.data );
+	return m;
+}
+
+static int get_int( const unsigned char **pos )
+{
+	int i;
+	memcpy( &i, *pos, sizeof(i) );
+	(*pos) += sizeof(i);
+	return i;
+}
+
+static const muse_char *get_chars( const unsigned char *data, const unsigned char **pos, int *length )
+{
+	const muse_char *s;
+
+	(*length) = get_int( pos );
+	(*pos) += (sizeof(muse_char) - (((*pos) - data) % sizeof(muse_char))) % sizeof(muse_char);
+	s = (const muse_char*)(*pos);
+	(*pos) += (*length) * sizeof(muse_char);
+	return s;
+}
+
+static muse_cell peer_handle( muse_env *env, muse_inbox_t *inbox );
+
+/**
+ * Rebuilds a value from its image. Everything created is left
+ * on the stack, so the caller unwinds it.
+ */
+static muse_cell get_value( muse_env *env, const unsigned char *data, const unsigned char **pos )
+{
+	char tag = (char)*(*pos)++;
+
+	switch ( tag )
+	{
+	case 'q' :
+		return _qq( get_value( env, data, pos ) );
+
+	case 'i' :
+		{
+			muse_int i;
+			memcpy( &i, *pos, sizeof(i) );
+			(*pos) += sizeof(i);
+			return _mk_int(i);
+		}
+
+	case 'f' :
+		{
+			muse_float f;
+			memcpy( &f, *pos, sizeof(f) );
+			(*pos) += sizeof(f);
+			return _mk_float(f);
+		}
+
+	case 't' :
+	case 's' :
+		{
+			int length;
+			const muse_char *s = get_chars( data, pos, &length );
+			return (tag == 't') ? muse_mk_text( env, s, s + length ) : muse_symbol( env, s, s + length );
+		}
+
+	case 'l' :
+		{
+			int n = get_int( pos );
+			muse_cell head = MUSE_NIL, last = MUSE_NIL;
+			int sp = _spos();
+
+			for ( ; n > 0; --n )
+			{
+				muse_cell c = _cons( get_value( env, data, pos ), MUSE_NIL );
+
+				if ( last )
+					_sett( last, c );
+				else
+					head = c;
+
+				last = c;
+				_unwind(sp);
+				_spush(head);
+			}
+
+			_sett( last, get_value( env, data, pos ) );
+			_unwind(sp);
+			_spush(head);
+			return head;
+		}
+
+	case 'v' :
+		{
+			int i, n = get_int( pos );
+			muse_cell v = muse_mk_vector( env, n );
+			int sp = _spos();
+
+			for ( i = 0; i < n; ++i )
+			{
+				muse_vector_put( env, v, i, get_value( env, data, pos ) );
+				_unwind(sp);
+			}
+
+			return v;
+		}
+
+	case 'w' :
+		{
+			muse_inbox_t *inbox;
+			memcpy( &inbox, *pos, sizeof(inbox) );
+			(*pos) += sizeof(inbox);
+			return peer_handle( env, inbox );
+		}
+
+	default :
+		return MUSE_NIL;
+	}
+}
+
+/**
+ * Lets go of the inboxes an image refers to, for an image that
+ * wasn't rebuilt by get_value().
+ */
+static void skip_value( const unsigned char *data, const unsigned char **pos )
+{
+	switch ( (char)*(*pos)++ )
+	{
+	case 'q' : skip_value( data, pos ); break;
+	case 'i' : (*pos) += sizeof(muse_int); break;
+	case 'f' : (*pos) += sizeof(muse_float); break;
+	case 't' :
+	case 's' :
+		{
+			int length;
+			get_chars( data, pos, &length );
+		}
+		break;
+	case 'l' :
+		{
+			int n = get_int( pos ) + 1;
+			while ( n-- > 0 )
+				skip_value( data, pos );
+		}
+		break;
+	case 'v' :
+		{
+			int n = get_int( pos );
+			while ( n-- > 0 )
+				skip_value( data, pos );
+		}
+		break;
+	case 'w' :
+		{
+			muse_inbox_t *inbox;
+			memcpy( &inbox, *pos, sizeof(inbox) );
+			(*pos) += sizeof(inbox);
+			release_inbox( inbox );
+		}
+		break;
+	}
+}
+
+static void free_messages( muse_message_t *m )
+{
+	while ( m )
+	{
+		muse_message_t *next = m->next;
+		const unsigned char *pos = m->data;
+
+		skip_value( m->data, &pos );
+		release_inbox( m->from );
+		free( m );
+		m = next;
+	}
+}
+
+/************************************************************************/
+/* Handles                                                              */
+/************************************************************************/
+
+static muse_workers_t *workers_of( muse_env *env )
+{
+	if ( !env->workers )
+	{
+		muse_workers_t *w = (muse_workers_t*)calloc( 1, sizeof(muse_workers_t) );
+		muse_process_frame_t *p = env->current_process;
+
+		/* The main process is the one running on the thread's own stack. */
+		while ( p->cstack.size > 0 )
+			p = p->next;
+
+		w->inbox = new_inbox();
+		w->main_process = p;
+		env->workers = w;
+	}
+
+	return env->workers;
+}
+
+/**
+ * Returns this environment's handle to the given inbox, creating one if
+ * there isn't one yet. The reference to the inbox passes to the handle,
+ * or is released if there already is a handle.
+ */
+static muse_cell peer_handle( muse_env *env, muse_inbox_t *inbox )
+{
+	muse_workers_t *w = workers_of(env);
+	worker_link_t *link;
+	int i;
+
+	for ( i = 0; i < w->num_peers; ++i )
+	{
+		link = (worker_link_t*)_ptr(w->peers[i])->fn.context;
+		if ( link->inbox == inbox )
+		{
+			release_inbox( inbox );
+			return w->peers[i];
+		}
+	}
+
+	if ( w->num_peers >= w->peers_capacity )
+	{
+		w->peers_capacity = w->peers_capacity ? 2 * w->peers_capacity : 4;
+		w->peers = (muse_cell*)realloc( w->peers, w->peers_capacity * sizeof(muse_cell) );
+	}
+
+	link = (worker_link_t*)calloc( 1, sizeof(worker_link_t) );
+	link->inbox = inbox;
+	return w->peers[w->num_peers++] = _mk_destructor( (muse_nativefn_t)fn_worker, link );
+}
+
+static muse_cell send_message( muse_env *env, muse_inbox_t *to, muse_cell msg, muse_boolean as_is )
+{
+	muse_workers_t *w = workers_of(env);
+	muse_message_t *m;
+
+	if ( to->closed )
+		return MUSE_NIL;
+
+	m = new_message( env, msg );
+	m->from = retain_inbox( w->inbox );
+	m->as_is = as_is;
+	push_message( to, m );
+	return _t();
+}
+
+/**
+ * A handle to another environment, as returned by \ref fn_spawn_worker "spawn-worker"
+ * and \ref fn_worker_parent "worker-parent", is used like a process id.
+ *	- (w arg1 arg2 ...) sends the list of arguments to the main process of the
+ *	  environment. It receives it with the handle to the sending environment in
+ *	  front, just as a message sent to a pid gets the sender's pid in front.
+ *	- (post msg w) sends \p msg as is.
+ *	- (receive w) waits for a message from the environment.
+ *	- (w) evaluates to T while the environment is around and to () after.
+ *
+ * Sending evaluates to T, or to () if the environment has gone away.
+ */
+static muse_cell fn_worker( muse_env *env, worker_link_t *link, muse_cell args )
+{
+	if ( muse_doing_gc(env) )
+	{
+		release_inbox( link->inbox );
+		free( link );
+		return MUSE_NIL;
+	}
+
+	if ( !link->inbox || link->inbox->closed )
+		return MUSE_NIL;
+
+	if ( !args )
+		return _t();
+
+	{
+		int sp = _spos();
+		muse_cell result = send_message( env, link->inbox, muse_eval_list( env, args ), MUSE_FALSE );
+		_unwind(sp);
+		return result;
+	}
+}
+
+/**
+ * Returns \c MUSE_TRUE if \p worker is a handle to another environment.
+ */
+muse_boolean muse_is_worker( muse_env *env, muse_cell worker )
+{
+	return is_worker( env, worker );
+}
+
+/**
+ * Sends \p msg as is to the environment that \p worker is a handle to.
+ * @see fn_post()
+ */
+muse_cell muse_post_to_worker( muse_env *env, muse_cell worker, muse_cell msg )
+{
+	worker_link_t *link = (worker_link_t*)_ptr(worker)->fn.context;
+	return link->inbox ? send_message( env, link->inbox, msg, MUSE_TRUE ) : MUSE_NIL;
+}
+
+/************************************************************************/
+/* Scheduler hooks                                                      */
+/************************************************************************/
+
+/**
+ * Moves the messages that have arrived from other environments into the
+ * main process' mailbox. Called from run_next_process().
+ */
+void muse_receive_worker_messages( muse_env *env )
+{
+	muse_workers_t *w = env->workers;
+	muse_message_t *m;
+
+	if ( !w || !w->inbox->head )
+		return;
+
+	m = take_messages( w->inbox );
+
+	while ( m )
+	{
+		muse_message_t *next = m->next;
+		int sp = _spos();
+		const unsigned char *pos = m->data;
+		muse_cell from = peer_handle( env, retain_inbox( m->from ) );
+		muse_cell msg = get_value( env, m->data, &pos );
+
+		if ( !m->as_is )
+			msg = _cons( from, msg );
+
+		post_message_from( w->main_process, msg, from );
+		_unwind(sp);
+
+		release_inbox( m->from );
+		free( m );
+		m = next;
+	}
+}
+
+/**
+ * Waits until a message arrives from another environment or
+ * \p wait_us microseconds pass. A negative \p wait_us waits
+ * as long as it takes. Returns \c MUSE_FALSE without waiting if
+ * the environment has never dealt with workers, since nothing
+ * can arrive then.
+ */
+muse_boolean muse_wait_for_worker_messages( muse_env *env, muse_int wait_us )
+{
+	if ( !env->workers )
+		return MUSE_FALSE;
+
+	wait_for_messages( env->workers->inbox, wait_us );
+	return MUSE_TRUE;
+}
+
+#ifndef MUSE_PLATFORM_WINDOWS
+/**
+ * Lets the environment wait for messages from other environments
+ * together with other things, such as the network, that it can wait
+ * for on a file descriptor. \p fd is set to a descriptor that becomes
+ * readable when a message arrives, or to -1 if the environment has never
+ * dealt with workers. Returns \c MUSE_FALSE if messages have already 
+ * arrived, in which case there should be no wait. muse_end_worker_wait()
+ * must follow either way.
+ */
+muse_boolean muse_begin_worker_wait( muse_env *env, int *fd )
+{
+	muse_inbox_t *inbox;
+
+	*fd = -1;
+	if ( !env->workers )
+		return MUSE_TRUE;
+
+	inbox = env->workers->inbox;
+
+	if ( inbox->wake_pipe[0] < 0 )
+	{
+		int fds[2];
+		if ( pipe( fds ) != 0 )
+			return MUSE_FALSE;
+		fcntl( fds[0], F_SETFL, O_NONBLOCK );
+		fcntl( fds[1], F_SETFL, O_NONBLOCK );
+		pthread_mutex_lock( &inbox->lock );
+		inbox->wake_pipe[0] = fds[0];
+		inbox->wake_pipe[1] = fds[1];
+		pthread_mutex_unlock( &inbox->lock );
+	}
+
+	*fd = inbox->wake_pipe[0];
+	inbox->sleeping = 1;
+	memory_barrier();
+	return inbox->head == NULL ? MUSE_TRUE : MUSE_FALSE;
+}
+
+void muse_end_worker_wait( muse_env *env )
+{
+	muse_inbox_t *inbox;
+	char drain[64];
+
+	if ( !env->workers )
+		return;
+
+	inbox = env->workers->inbox;
+	inbox->sleeping = 0;
+
+	while ( read( inbox->wake_pipe[0], drain, sizeof(drain) ) > 0 )
+		;
+
+	pthread_mutex_lock( &inbox->lock );
+	inbox->signalled = 0;
+	pthread_mutex_unlock( &inbox->lock );
+}
+#endif
+
+void muse_mark_workers( muse_env *env )
+{
+	muse_workers_t *w = env->workers;
+	int i;
+
+	if ( !w )
+		return;
+
+	for ( i = 0; i < w->num_peers; ++i )
+		muse_mark( env, w->peers[i] );
+}
+
+/**
+ * Closes the environment's inbox and lets go of all the other
+ * environments' inboxes. Called as the environment is destroyed.
+ */
+void muse_destroy_workers( muse_env *env )
+{
+	muse_workers_t *w = env->workers;
+	int i;
+
+	if ( !w )
+		return;
+
+	w->inbox->closed = 1;
+	memory_barrier();
+	free_messages( take_messages( w->inbox ) );
+
+	for ( i = 0; i < w->num_peers; ++i )
+	{
+		worker_link_t *link = (worker_link_t*)_ptr(w->peers[i])->fn.context;
+		release_inbox( link->inbox );
+		link->inbox = NULL;
+	}
+
+	release_inbox( w->parent );
+	release_inbox( w->inbox );
+	free( w->peers );
+	free( w );
+	env->workers = NULL;
+}
+
+/************************************************************************/
+/* Worker threads                                                       */
+/************************************************************************/
+
+static void run_worker( worker_start_t *start )
+{
+	muse_env *env = muse_init_env( start->parameters );
+	muse_workers_t *w = (muse_workers_t*)calloc( 1, sizeof(muse_workers_t) );
+
+	w->inbox = start->inbox;
+	w->parent = start->parent;
+	w->main_process = env->current_process;
+	env->workers = w;
+
+	{
+		int sp = _spos();
+		const unsigned char *pos = start->thunk->data;
+		muse_cell expr = get_value( env, start->thunk->data, &pos );
+		_eval( expr );
+		_unwind(sp);
+	}
+
+	free( start->thunk );
+	free( start->parameters );
+	free( start );
+
+	muse_destroy_env( env );
+}
+
+#ifdef MUSE_PLATFORM_WINDOWS
+static DWORD WINAPI worker_thread_proc( LPVOID start )
+{
+	run_worker( (worker_start_t*)start );
+	return 0;
+}
+#else
+static void *worker_thread_proc( void *start )
+{
+	run_worker( (worker_start_t*)start );
+	return NULL;
+}
+#endif
+
+static muse_boolean start_worker_thread( worker_start_t *start )
+{
+#ifdef MUSE_PLATFORM_WINDOWS
+	HANDLE thread = CreateThread( NULL, 0, worker_thread_proc, start, 0, NULL );
+	if ( thread == NULL )
+		return MUSE_FALSE;
+	CloseHandle( thread );
+	return MUSE_TRUE;
+#else
+	pthread_t thread;
+	pthread_attr_t attr;
+	int result;
+
+	pthread_attr_init( &attr );
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+	result = pthread_create( &thread, &attr, worker_thread_proc, start );
+	pthread_attr_destroy( &attr );
+	return (result == 0) ? MUSE_TRUE : MUSE_FALSE;
+#endif
+}
+
+/**
+ * @code (spawn-worker expr) @endcode
+ *
+ * Starts a new environment on a thread of its own and evaluates a copy of
+ * \p expr in it. The environment goes away once the evaluation completes.
+ * The new environment is created with the same parameters as this one and
+ * starts out with only the builtin definitions, so \p expr has to bring in
+ * whatever else it needs - usually by loading a file.
+ *
+ * Evaluates to a handle to the new environment, which is used like a process
+ * id to send it messages. Within the worker, \ref fn_worker_parent "worker-parent"
+ * gives the handle to the spawning environment.
+ *
+ * A value sent to another environment is copied into it. Messages can consist of
+ * lists, vectors, symbols, numbers, text and environment handles. Sending anything
+ * else raises <tt>error:not-sendable</tt>. Shared structure is copied as many
+ * times as it occurs, and cyclic structures cannot be sent.
+ *
+ * @code
+ * (define w (spawn-worker '(case (receive) ((from n) (from (* n n))))))
+ * (w 12)
+ * (receive w)
+ * > (<worker> 144)
+ * @endcode
+ */
+muse_cell fn_spawn_worker( muse_env *env, void *context, muse_cell args )
+{
+	muse_workers_t *w = workers_of(env);
+	worker_start_t *start = (worker_start_t*)calloc( 1, sizeof(worker_start_t) );
+	muse_cell handle;
+	int i;
+
+	start->thunk = new_message( env, _evalnext(&args) );
+	start->inbox = new_inbox();
+	start->parent = retain_inbox( w->inbox );
+
+	/* Pass on our parameters. */
+	start->parameters = (int*)calloc( 2 * MUSE_NUM_PARAMETER_NAMES, sizeof(int) );
+	for ( i = 1; i < MUSE_NUM_PARAMETER_NAMES; ++i )
+	{
+		start->parameters[2*(i-1)] = i;
+		start->parameters[2*(i-1)+1] = env->parameters[i];
+	}
+
+	handle = peer_handle( env, retain_inbox( start->inbox ) );
+
+	if ( !start_worker_thread( start ) )
+	{
+		release_inbox( start->inbox );
+		release_inbox( start->parent );
+		free_messages( start->thunk );
+		free( start->parameters );
+		free( start );
+		return muse_raise_error( env, _csymbol(L"error:thread-failed"), MUSE_NIL );
+	}
+
+	return handle;
+}
+
+/**
+ * @code (worker-parent) @endcode
+ *
+ * Within an environment started using \ref fn_spawn_worker "spawn-worker",
+ * evaluates to the handle to the environment that started it. Evaluates
+ * to () in other environments.
+ */
+muse_cell fn_worker_parent( muse_env *env, void *context, muse_cell args )
+{
+	if ( env->workers && env->workers->parent )
+		return peer_handle( env, retain_inbox( env->workers->parent ) );
+	else
+		return MUSE_NIL;
+}
+
+void muse_define_builtin_worker( muse_env *env )
+{
+	static const struct _builtins { const muse_char *name; muse_nativefn_t fn; } k_worker_funs[] =
+	{
+		{	L"spawn-worker",	fn_spawn_worker		},
+		{	L"worker-parent",	fn_worker_parent	},
+		{	NULL,				NULL				}
+	};
+
+	const struct _builtins *b = k_worker_funs;
+	int sp = _spos();
+
+	for ( ; b->name; ++b )
+	{
+		_define( _csymbol(b->name), _mk_nativefn( b->fn, NULL ) );
+		_unwind(sp);
+	}
+}
+/*@}*/
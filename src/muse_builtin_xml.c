@@ -357,7 +357,10 @@ static muse_cell xml_read_tag_body( muse_env *env, muse_port_t p, muse_cell tag,
  */
 muse_cell fn_xml( muse_env *env, void *context, muse_cell args )
 {
-	return muse_read_xml_node( muse_current_port( env, MUSE_INPUT_PORT, NULL ) );
+	int arena = muse_begin_text_arena(env);
+	muse_cell result = muse_read_xml_node( muse_current_port( env, MUSE_INPUT_PORT, NULL ) );
+	muse_end_text_arena( env, arena );
+	return result;
 }
 
 
@@ -415,6 +418,8 @@ muse_cell fn_xml( muse_env *env, void *context, muse_cell args )
 muse_cell fn_read_xml( muse_env *env, void *context, muse_cell args )
 {
 	muse_port_t port;
+	muse_cell node;
+	int arena;
 
 	if ( args )
 	{
@@ -427,7 +432,11 @@ muse_cell fn_read_xml( muse_env *env, void *context, muse_cell args )
 		port = muse_stdport( env, MUSE_STDIN_PORT );
 	}
 
-	return muse_add_recent_item( env, (muse_int)fn_read_xml, _eval(muse_read_xml_node(port)) );
+	arena = muse_begin_text_arena(env);
+	node = muse_read_xml_node(port);
+	muse_end_text_arena( env, arena );
+
+	return muse_add_recent_item( env, (muse_int)fn_read_xml, _eval(node) );
 }
 
 static void xml_skip_ignorables( muse_port_t p )
@@ -1295,3 +1304,512 @@ static muse_cell xml_read_tag_body( muse_env *env, muse_port_t p, muse_cell tag,
 	}
 }
 
+
+/** @name Streaming XML
+ * The streaming reader turns the XML in a port into a sequence of start
+ * tag, text and end tag events, so that documents can be processed
+ * without building the whole tree in memory.
+ */
+/*@{*/
+
+enum
+{
+	XML_EVENT_NONE,		/**< The end of the stream. */
+	XML_EVENT_START,	/**< A start tag. The tag and attributes are in the reader. */
+	XML_EVENT_TEXT,		/**< Text or CDATA. The string is the reader's value. */
+	XML_EVENT_END		/**< An end tag. The tag is in the reader. */
+};
+
+typedef struct
+{
+	muse_env *env;
+	muse_port_t p;
+	muse_cell tag, attrs, value;
+	buffer_t *text;		/**< Reused for every run of text. */
+	int skipping;		/**< When non-zero, attributes and text don't become cells. */
+	int self_closed;	/**< The last start tag was of the form <tag/>. */
+	int pending_end;	/**< The end event of a self closed tag is due. */
+} xml_events_t;
+
+static void xml_read_tag_name( muse_port_t p, char sym[128] )
+{
+	int symlen = 0;
+
+	while ( symlen < 127 && !port_eof(p) && p->error == 0 )
+	{
+		int c = port_getc(p);
+		if ( isspace(c) || c == '>' || c == '/' || c == '=' )
+		{
+			port_ungetc(c,p);
+			break;
+		}
+
+		sym[symlen++] = (char)c;
+	}
+
+	sym[symlen] = '\0';
+}
+
+/**
+ * Reads the attributes of a start tag up to and including
+ * its closing '>' or '/>'.
+ */
+static void xml_read_event_attribs( xml_events_t *x )
+{
+	muse_env *env = x->env;
+	muse_port_t p = x->p;
+	muse_cell last = MUSE_NIL;
+
+	x->attrs = MUSE_NIL;
+	x->self_closed = 0;
+
+	while ( !port_eof(p) && p->error == 0 )
+	{
+		char sym[128];
+		muse_cell value = MUSE_NIL;
+		int c;
+
+		xml_skip_whitespace(p);
+		c = port_getc(p);
+		if ( c == '>' )
+			return;
+		else if ( c == '/' )
+		{
+			if ( port_getc(p) == '>' )
+			{
+				x->self_closed = 1;
+				return;
+			}
+			continue;
+		}
+
+		port_ungetc(c,p);
+		xml_read_tag_name( p, sym );
+		if ( sym[0] == '\0' )
+		{
+			/* Not something we understand. Step over it. */
+			port_getc(p);
+			continue;
+		}
+
+		xml_skip_whitespace(p);
+		c = port_getc(p);
+		if ( c == '=' )
+		{
+			int q;
+			xml_skip_whitespace(p);
+			q = port_getc(p);
+			if ( q == '"' || q == '\'' )
+			{
+				int length = 0;
+				char *val = xml_read_utf8_until( (char)q, &length, p );
+				if ( !x->skipping )
+					value = muse_mk_text_utf8( env, val, val + length );
+				free(val);
+			}
+			else
+			{
+				char val[257];
+				int n;
+				port_ungetc(q,p);
+				n = read_unquoted_attrib_value( p, val );
+				if ( !x->skipping )
+					value = muse_mk_text_utf8( env, val, val + n );
+			}
+		}
+		else
+		{
+			/* Flag. */
+			port_ungetc(c,p);
+			value = muse_builtin_symbol(env,MUSE_T);
+		}
+
+		if ( !x->skipping )
+		{
+			muse_cell item = _cons( _cons( muse_csymbol_utf8(env,sym), value ), MUSE_NIL );
+			if ( last )
+				_sett( last, item );
+			else
+				x->attrs = item;
+			last = item;
+		}
+	}
+}
+
+/**
+ * Reads text up to the next '<', decoding character codes.
+ * Returns MUSE_FALSE if the text is all white space, which is
+ * dropped since it's usually just indentation.
+ */
+static muse_boolean xml_read_event_text( xml_events_t *x )
+{
+	muse_env *env = x->env;
+	muse_port_t p = x->p;
+	muse_boolean blank = MUSE_TRUE;
+
+	buffer_reset( x->text );
+
+	while ( !port_eof(p) && p->error == 0 )
+	{
+		muse_char c = port_getchar(p);
+
+		if ( c == '<' )
+		{
+			port_ungetchar(c,p);
+			break;
+		}
+		else if ( c == '&' && !x->skipping )
+		{
+			muse_cell code;
+			port_ungetchar(c,p);
+			code = xml_parse_amp_code( env, p );
+			if ( code && _cellt(code) == MUSE_TEXT_CELL )
+			{
+				int len = 0;
+				const muse_char *s = muse_text_contents( env, code, &len );
+				buffer_puts( x->text, s, len );
+			}
+			else
+			{
+				port_getchar(p);
+				buffer_putc( x->text, c );
+			}
+			blank = MUSE_FALSE;
+		}
+		else if ( c != (muse_char)EOF )
+		{
+			if ( c >= 0x80 || !isspace(c) )
+				blank = MUSE_FALSE;
+			if ( !x->skipping )
+				buffer_putc( x->text, c );
+		}
+	}
+
+	if ( blank )
+		return MUSE_FALSE;
+
+	x->value = x->skipping ? MUSE_NIL : buffer_to_string( x->text, env );
+	return MUSE_TRUE;
+}
+
+/**
+ * Reads up to the next event. Comments, processing instructions and
+ * DOCTYPE declarations are passed over wherever they occur.
+ */
+static int xml_next_event( xml_events_t *x )
+{
+	muse_env *env = x->env;
+	muse_port_t p = x->p;
+
+	if ( x->pending_end )
+	{
+		x->pending_end = 0;
+		return XML_EVENT_END;
+	}
+
+	while ( !port_eof(p) && p->error == 0 )
+	{
+		muse_char c = port_getchar(p);
+
+		if ( c != '<' )
+		{
+			port_ungetchar(c,p);
+			if ( xml_read_event_text(x) )
+				return XML_EVENT_TEXT;
+			continue;
+		}
+
+		c = port_getchar(p);
+		if ( c == '/' )
+		{
+			char sym[128];
+			xml_skip_whitespace(p);
+			xml_read_tag_name( p, sym );
+			while ( !port_eof(p) && p->error == 0 && port_getc(p) != '>' );
+			x->tag = muse_csymbol_utf8( env, sym );
+			return XML_EVENT_END;
+		}
+		else if ( c == '!' || c == '?' )
+		{
+			port_ungetchar(c,p);
+			port_ungetchar('<',p);
+			x->value = xml_read_CDATA(p);
+			if ( x->value )
+			{
+				if ( x->skipping )
+					x->value = MUSE_NIL;
+				return XML_EVENT_TEXT;
+			}
+
+			if ( !(xml_skip_comment(p) || xml_skip_DOCTYPE(p) || xml_skip_proc(p)) )
+			{
+				/* Some other declaration. Step over it. */
+				while ( !port_eof(p) && p->error == 0 && port_getc(p) != '>' );
+			}
+		}
+		else
+		{
+			char sym[128];
+			port_ungetchar(c,p);
+			xml_read_tag_name( p, sym );
+			x->tag = muse_csymbol_utf8( env, sym );
+			xml_read_event_attribs(x);
+			x->pending_end = x->self_closed;
+			return XML_EVENT_START;
+		}
+	}
+
+	return XML_EVENT_NONE;
+}
+
+static void xml_events_init( xml_events_t *x, muse_env *env, muse_port_t p )
+{
+	x->env			= env;
+	x->p			= p;
+	x->tag			= MUSE_NIL;
+	x->attrs		= MUSE_NIL;
+	x->value		= MUSE_NIL;
+	x->text			= buffer_alloc();
+	x->skipping		= 0;
+	x->self_closed	= 0;
+	x->pending_end	= 0;
+}
+
+/**
+ * @code (xml-events port fn) @endcode
+ *
+ * Reads the XML in the port as a stream of events, without building 
+ * the document in memory. fn is called for each event as -
+ *	- @code (fn 'start tag attrs) @endcode for a start tag, where attrs
+ *	  is an a-list of the tag's attributes as read-xml gives them,
+ *	- @code (fn 'text "...") @endcode for text and CDATA sections,
+ *	- @code (fn 'end tag) @endcode for an end tag. A tag of the form
+ *	  @code <tag/> @endcode gives a start event followed by an end event.
+ *
+ * Text that is all white space, such as indentation, is dropped. Character
+ * codes such as @code &amp; @endcode are decoded as with read-xml. Comments, processing
+ * instructions and DOCTYPE declarations are skipped. Reading goes on to the
+ * end of the stream, so a file with several top level nodes gives events for
+ * all of them. The result is the number of start tags seen.
+ *
+ * @see fn_xml_select
+ */
+muse_cell fn_xml_events( muse_env *env, void *context, muse_cell args )
+{
+	muse_port_t p = muse_port( env, _evalnext(&args) );
+	muse_cell fn = _evalnext(&args);
+	muse_cell start = _csymbol(L"start"), text = _csymbol(L"text"), end = _csymbol(L"end");
+	muse_int count = 0;
+	xml_events_t x;
+	int event;
+
+	xml_events_init( &x, env, p );
+
+	do
+	{
+		int sp = _spos();
+
+		switch ( event = xml_next_event(&x) )
+		{
+			case XML_EVENT_START:
+				++count;
+				muse_apply( env, fn, _cons( start, _cons( x.tag, _cons( x.attrs, MUSE_NIL ) ) ), MUSE_TRUE, MUSE_FALSE );
+				break;
+			case XML_EVENT_TEXT:
+				muse_apply( env, fn, _cons( text, _cons( x.value, MUSE_NIL ) ), MUSE_TRUE, MUSE_FALSE );
+				break;
+			case XML_EVENT_END:
+				muse_apply( env, fn, _cons( end, _cons( x.tag, MUSE_NIL ) ), MUSE_TRUE, MUSE_FALSE );
+				break;
+		}
+
+		_unwind(sp);
+	}
+	while ( event != XML_EVENT_NONE );
+
+	buffer_free( x.text );
+	return _mk_int(count);
+}
+
+typedef struct
+{
+	xml_events_t x;
+	muse_cell fn;
+	muse_cell results;	/**< The elements found follow this cell. */
+	muse_cell last;
+	int count;
+} xml_select_t;
+
+/**
+ * Builds the node whose start tag was just read, in the same
+ * form as read-xml gives for constant XML.
+ */
+static muse_cell xml_build_node( xml_select_t *s )
+{
+	muse_env *env = s->x.env;
+	muse_cell node = _cons( s->x.tag, _cons( s->x.attrs, MUSE_NIL ) );
+	muse_cell last = _tail(node);
+	int self_closed = s->x.self_closed;
+
+	while ( MUSE_TRUE )
+	{
+		muse_cell item;
+
+		switch ( xml_next_event( &s->x ) )
+		{
+			case XML_EVENT_START:
+				item = _cons( xml_build_node(s), MUSE_NIL );
+				break;
+			case XML_EVENT_TEXT:
+				item = _cons( s->x.value, MUSE_NIL );
+				break;
+			default:
+				if ( !self_closed && last == _tail(node) )
+					_sett( last, _cons( muse_mk_ctext( env, L"" ), MUSE_NIL ) );
+				return node;
+		}
+
+		_sett( last, item );
+		last = item;
+	}
+}
+
+/**
+ * Steps over the rest of the element whose start tag was just read,
+ * without making cells for its attributes or text.
+ */
+static void xml_skip_element( xml_select_t *s )
+{
+	muse_env *env = s->x.env;
+	int depth = 1, event, sp = _spos();
+
+	++(s->x.skipping);
+	while ( depth > 0 && (event = xml_next_event( &s->x )) != XML_EVENT_NONE )
+	{
+		if ( event == XML_EVENT_START )
+			++depth;
+		else if ( event == XML_EVENT_END )
+			--depth;
+		_unwind(sp);
+	}
+	--(s->x.skipping);
+}
+
+static void xml_select_element( xml_select_t *s, muse_cell path );
+
+/**
+ * Matches an element whose start tag was just read against the head 
+ * of the path, skipping it if it doesn't match. An empty path matches
+ * any element.
+ */
+static void xml_select_start( xml_select_t *s, muse_cell path )
+{
+	muse_env *env = s->x.env;
+
+	if ( !path )
+		xml_select_element( s, MUSE_NIL );
+	else if ( _head(path) == _csymbol(L"*") || _head(path) == s->x.tag )
+		xml_select_element( s, _tail(path) );
+	else
+		xml_skip_element(s);
+}
+
+/**
+ * Deals with an element that has matched the path so far. If the
+ * path ends with it, it is built and handed over. Otherwise its 
+ * children are matched against the rest of the path.
+ */
+static void xml_select_element( xml_select_t *s, muse_cell path )
+{
+	muse_env *env = s->x.env;
+
+	if ( !path )
+	{
+		int sp = _spos();
+		muse_cell node = xml_build_node(s);
+		if ( s->fn ) {
+			muse_apply( env, s->fn, _cons( node, MUSE_NIL ), MUSE_TRUE, MUSE_FALSE );
+		} else {
+			muse_cell n = _cons( node, MUSE_NIL );
+			_sett( s->last, n );
+			s->last = n;
+		}
+		_unwind(sp);
+		++(s->count);
+	}
+	else
+	{
+		int event, sp = _spos();
+		while ( (event = xml_next_event( &s->x )) != XML_EVENT_NONE && event != XML_EVENT_END )
+		{
+			if ( event == XML_EVENT_START )
+				xml_select_start( s, path );
+			_unwind(sp);
+		}
+	}
+}
+
+/**
+ * @code (xml-select port path [fn]) @endcode
+ *
+ * Picks out the elements at the given path from the XML in the port,
+ * building only those in memory. The path is a list of tag symbols
+ * starting from the top level node, where the symbol * matches any tag.
+ * For example, 
+ * @code
+ * > (xml-select port '(rss channel item))
+ * @endcode
+ * gives all the item elements of an RSS feed. The elements are in the
+ * same form as read-xml gives -
+ * @code
+ * (item () (title () "Hello") (link () "http://..."))
+ * @endcode
+ *
+ * An empty path gives the top level nodes themselves.
+ *
+ * If fn is given, it is called with each element as it is found and
+ * xml-select returns the number of elements found. Otherwise the elements
+ * are returned as a list.
+ *
+ * @see fn_xml_events
+ */
+muse_cell fn_xml_select( muse_env *env, void *context, muse_cell args )
+{
+	xml_select_t s;
+	int arena = 0, event;
+	muse_port_t p = muse_port( env, _evalnext(&args) );
+	muse_cell path = _evalnext(&args);
+
+	xml_events_init( &s.x, env, p );
+	s.fn = args ? _evalnext(&args) : MUSE_NIL;
+	s.count = 0;
+
+	/* Elements handed to fn may be kept around individually, so don't
+	   let them pin arena chunks. */
+	if ( !s.fn )
+		arena = muse_begin_text_arena(env);
+
+	muse_push_recent_scope( env );
+	s.results = s.last = _cons( MUSE_NIL, MUSE_NIL );
+	{
+		int sp = _spos();
+		while ( (event = xml_next_event( &s.x )) != XML_EVENT_NONE )
+		{
+			if ( event == XML_EVENT_START )
+				xml_select_start( &s, path );
+			_unwind(sp);
+		}
+	}
+	buffer_free( s.x.text );
+	if ( !s.fn )
+		muse_end_text_arena( env, arena );
+
+	if ( s.fn ) {
+		muse_pop_recent_scope( env, 0, MUSE_NIL );
+		return _mk_int(s.count);
+	} else {
+		return muse_pop_recent_scope( env, (muse_int)fn_xml_select, _tail(s.results) );
+	}
+}
+
+/*@}*/
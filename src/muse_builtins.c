@@ -27,7 +27,6 @@ static const struct _builtins
 {
 {		L"quote",		fn_quote			},
 {		L"lazy",		fn_lazy				},
-{		L"cons",		fn_cons				},
 {		L"lcons",		fn_lcons			},
 {		L"eval",		fn_eval				},
 {		L"fn",			syntax_lambda		},
@@ -68,17 +67,7 @@ static const struct _builtins
 {		L"define-extension",	fn_define_extension		},
 {		L"define-override",		fn_define_override		},
 {		L"set!",		fn_set_M			},
-{		L"setf!",		fn_setf_M			},
-{		L"setr!",		fn_setr_M			},
-{		L"first",		fn_first			},
-{		L"rest",		fn_rest				},
-{		L"nth",			fn_nth				},
-{		L"take",		fn_take				},
-{		L"drop",		fn_drop				},
-{		L"dup",			fn_dup				},
-{		L"list",		fn_list				},
 {		L"length",		fn_length			},
-{		L"append!",		fn_append_M			},
 
 /************** Higher Order Functions ***************/
 {		L"size",			fn_length			},
@@ -94,32 +83,9 @@ static const struct _builtins
 {		L"transpose",	fn_transpose		},
 {		L"datafn",		fn_datafn			},
 
-/************** Math ***************/
-{		L"+",			fn_add				},
-{		L"-",			fn_sub				},
-{		L"*",			fn_mul				},
-{		L"/",			fn_div				},
-{		L"%",			fn_mod				},
-{		L"i/",			fn_idiv				},
-{		L"++",			fn_inc				},
-{		L"--",			fn_dec				},
-{		L"trunc",		fn_trunc			},
-{		L"rand",		fn_rand				},
-{		L"pow",			fn_pow				},
-	
 /************** Comparisons ***************/
-{		L"eq?",			fn_eq				},
-{		L"=",			fn_equal			},
-{		L"!=",			fn_ne				},
-{		L"<",			fn_lt				},
-{		L">",			fn_gt				},
-{		L"<=",			fn_le				},
-{		L">=",			fn_ge				},
 {		L"and",			fn_and				},
 {		L"or",			fn_or				},
-{		L"not",			fn_not				},
-{		L"min",			fn_min				},
-{		L"max",			fn_max				},
 	
 /************** Constructs ***************/
 {		L"if",			syntax_if			},
@@ -131,6 +97,10 @@ static const struct _builtins
 {		L"for",			syntax_for			},
 {		L"case",		syntax_case			},
 {		L"stats",		fn_stats			},
+{		L"finalizer-stats",	fn_finalizer_stats	},
+{		L"stack-stats",	fn_stack_stats		},
+{		L"gc-stats",	fn_gc_stats			},
+{		L"recent-stats",	fn_recent_stats		},
 	
 /************** Type checks ***************/
 {		L"int?",		fn_int_p			},
@@ -154,6 +124,7 @@ static const struct _builtins
 /************** Algorithms ***************/
 {		L"sort!",		fn_sort_inplace		},
 {		L"sort",		fn_sort				},
+{		L"partial-sort",	fn_partial_sort		},
 {		L"reverse",		fn_reverse			},
 {		L"reverse!",	fn_reverse_inplace	},
 	
@@ -178,13 +149,19 @@ static const struct _builtins
 {		L"mickey",		fn_mickey			},
 {		L"scribble",	fn_scribble			},
 {		L"load",		fn_load				},
+{		L"compile-file",	fn_compile_file	},
+{		L"save-snapshot",	fn_save_snapshot	},
 {		L"file-has-attached-code?",		fn_file_has_attached_code_p	},
 {		L"write-xml",	fn_write_xml		},
 {		L"read-xml",	fn_read_xml			},
 {		L"xml",			fn_xml				},
+{		L"xml-events",	fn_xml_events		},
+{		L"xml-select",	fn_xml_select		},
 {		L"write-json",	fn_write_json		},
 {		L"read-json",	fn_read_json		},
 {		L"json",		fn_json				},
+{		L"json-reader",	fn_json_reader		},
+{		L"json-select",	fn_json_select		},
 {		L"exit",		fn_exit				},
 {		L"tab-syntax",		fn_tab_syntax		},
 {		L"scheme-syntax",	fn_scheme_syntax	},
@@ -223,13 +200,69 @@ static const struct _builtins
 {		NULL,			NULL				}
 };
 
+/**
+ * Builtins that evaluate all their arguments and
+ * take them in an array.
+ * @see muse_argv_nativefn_t
+ */
+static const struct _argv_builtins 
+	{
+		const muse_char *name;
+		muse_argv_nativefn_info_t info;
+	} k_argv_builtins[] =
+{
+{		L"cons",		{ fn_cons, NULL }			},
+
+/************** Cell manipulation ***************/
+{		L"setf!",		{ fn_setf_M, NULL }			},
+{		L"setr!",		{ fn_setr_M, NULL }			},
+{		L"first",		{ fn_first, NULL }			},
+{		L"rest",		{ fn_rest, NULL }			},
+{		L"nth",			{ fn_nth, NULL }			},
+{		L"take",		{ fn_take, NULL }			},
+{		L"drop",		{ fn_drop, NULL }			},
+{		L"dup",			{ fn_dup, NULL }			},
+{		L"list",		{ fn_list, NULL }			},
+{		L"append!",		{ fn_append_M, NULL }		},
+
+/************** Math ***************/
+{		L"+",			{ fn_add, NULL }			},
+{		L"-",			{ fn_sub, NULL }			},
+{		L"*",			{ fn_mul, NULL }			},
+{		L"/",			{ fn_div, NULL }			},
+{		L"%",			{ fn_mod, NULL }			},
+{		L"i/",			{ fn_idiv, NULL }			},
+{		L"++",			{ fn_inc, NULL }			},
+{		L"--",			{ fn_dec, NULL }			},
+{		L"trunc",		{ fn_trunc, NULL }			},
+{		L"rand",		{ fn_rand, NULL }			},
+{		L"pow",			{ fn_pow, NULL }			},
+
+/************** Comparisons ***************/
+{		L"eq?",			{ fn_eq, NULL }				},
+{		L"=",			{ fn_equal, NULL }			},
+{		L"!=",			{ fn_ne, NULL }				},
+{		L"<",			{ fn_lt, NULL }				},
+{		L">",			{ fn_gt, NULL }				},
+{		L"<=",			{ fn_le, NULL }				},
+{		L">=",			{ fn_ge, NULL }				},
+{		L"not",			{ fn_not, NULL }			},
+{		L"min",			{ fn_min, NULL }			},
+{		L"max",			{ fn_max, NULL }			},
+
+{		NULL,			{ NULL, NULL }				}
+};
+
 void muse_define_builtin_memport(muse_env *env);
+void muse_define_builtin_profiler(muse_env *env);
+void muse_define_builtin_worker(muse_env *env);
 void muse_define_image_properties( muse_env *env );
 void muse_define_crypto( muse_env *env );
 
 void muse_load_builtin_fns(muse_env *env)
 {
 	const struct _builtins *b = k_builtins;
+	const struct _argv_builtins *ab = k_argv_builtins;
 	int sp = _spos();
 	
 	while ( b->name )
@@ -239,18 +272,31 @@ void muse_load_builtin_fns(muse_env *env)
 		
 		++b;
 	}
+
+	while ( ab->name )
+	{
+		_define( _csymbol(ab->name), _mk_argv_nativefn( &ab->info ) );
+		_unwind(sp);
+		
+		++ab;
+	}
 		
 	muse_define_put_macro(env);
 	muse_define_builtin_local(env);
 	muse_math_load_common_unary_functions(env);
 	muse_define_builtin_type_vector(env);
 	muse_define_builtin_type_hashtable(env);
+	muse_define_builtin_type_pmap(env);
+	muse_define_builtin_type_numvector(env);
 	muse_define_builtin_type_bytes(env);
 	muse_define_builtin_type_module(env);
 	muse_define_builtin_type_box(env);
+	muse_define_builtin_type_memoize(env);
 	muse_define_builtin_fileport(env);
 	muse_define_builtin_memport(env);
 	muse_define_builtin_networking(env);
+	muse_define_builtin_profiler(env);
+	muse_define_builtin_worker(env);
 	muse_register_com_support(env);
 	muse_define_image_properties(env);
 	muse_define_xml_codes(env);
@@ -275,13 +321,9 @@ muse_cell fn_quote( muse_env *env, void *context, muse_cell args )
  * and grows the heap if necessary.
  * @see _cons()
  */
-muse_cell fn_cons( muse_env *env, void *context, muse_cell args )
+muse_cell fn_cons( muse_env *env, void *context, int argc, muse_cell *argv )
 {
-	muse_cell h, t;
-	
-	h = _evalnext(&args);
-	t = _evalnext(&args);
-	return _cons( h, t );
+	return _cons( _argv(0), _argv(1) );
 }
 
 /**
@@ -546,11 +588,217 @@ muse_cell fn_stats( muse_env *env, void *context, muse_cell args )
 	
 	muse_cell obj = fn_new(env,NULL,MUSE_NIL);
 	return muse_put_many( env, obj, 
-						 muse_list( env, "SiSiSiSi",
+						 muse_list( env, "SiSiSiSiSI",
 								   L"free-cells", free_cell_count,
 								   L"stack-size", sp,
 								   L"symbol-count", env->num_symbols,
-								   L"bindings-depth", _bspos()/2 ) );
+								   L"bindings-depth", _bspos()/2,
+								   L"cells-allocated", env->current_process->cells_allocated ) );
+}
+
+/**
+ * @code (finalizer-stats) @endcode
+ *
+ * Evaluates to a list of entries of the form @code (kind count microseconds) @endcode
+ * giving the number of garbage collected cells of each kind that have
+ * been finalized so far, and the total time spent finalizing them. 
+ * The kind is @code text @endcode for text cells, @code destructor @endcode 
+ * for native destructor functions, and the four character type word
+ * of the object type for functional objects.
+ */
+muse_cell fn_finalizer_stats( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell h = MUSE_NIL, t = MUSE_NIL;
+	const muse_finalizers_t *f = &env->finalizers;
+	int i, sp = _spos();
+
+	for ( i = 0; i < f->num_stats; ++i )
+	{
+		const muse_finalizer_stats_t *st = f->stats + i;
+		muse_char word[5];
+		const muse_char *kind = word;
+
+		if ( st->type_info )
+		{
+			int w = st->type_info->type_word;
+			word[0] = (w >> 24) & 0xFF;
+			word[1] = (w >> 16) & 0xFF;
+			word[2] = (w >> 8) & 0xFF;
+			word[3] = w & 0xFF;
+			word[4] = 0;
+		}
+		else
+			kind = (st->kind == MUSE_TEXT_CELL) ? L"text" : L"destructor";
+
+		{
+			muse_cell entry = _cons( muse_list( env, "SiI", kind, st->count, st->time_us ), MUSE_NIL );
+			if ( t )
+				_sett( t, entry );
+			else
+				h = entry;
+			t = entry;
+		}
+	}
+
+	_unwind(sp);
+	_spush(h);
+	return h;
+}
+
+/**
+ * @code (stack-stats) @endcode
+ *
+ * Evaluates to a list of entries of the form
+ * @code (size in-use pooled spawned high-water) @endcode
+ * describing the C stacks of spawned processes, one entry per
+ * size of stack that has been used. \c size is in cells, \c in-use 
+ * and \c pooled are the numbers of stacks of that size held by live
+ * processes and kept for reuse, \c spawned is the number of processes
+ * that have been given one, and \c high-water is the most cells any of
+ * them has used so far. Stacks too big to be pooled are grouped under
+ * the size @code oversized @endcode.
+ *
+ * The high water mark is a good guide for the stack size to give
+ * \ref fn_spawn "spawn" for processes of the same kind.
+ */
+muse_cell fn_stack_stats( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell h = MUSE_NIL, t = MUSE_NIL;
+	int high_water[MUSE_CSTACK_CLASSES+1];
+	int k, sp = _spos();
+
+	for ( k = 0; k < MUSE_CSTACK_CLASSES; ++k )
+		high_water[k] = env->cstacks.classes[k].high_water;
+	high_water[MUSE_CSTACK_CLASSES] = env->cstacks.oversized.high_water;
+
+	/* Include what the live processes have used so far. */
+	{
+		muse_process_frame_t *cp = env->current_process;
+		muse_process_frame_t *p = cp;
+
+		do
+		{
+			if ( p->cstack.size > 0 )
+			{
+				int used = muse_cstack_used( env, &p->cstack );
+
+				for ( k = 0; k < MUSE_CSTACK_CLASSES && muse_cstack_class_cells(k) != p->cstack.size; ++k )
+					;
+
+				if ( used > high_water[k] )
+					high_water[k] = used;
+			}
+			p = p->next;
+		}
+		while ( p != cp );
+	}
+
+	for ( k = 0; k <= MUSE_CSTACK_CLASSES; ++k )
+	{
+		const muse_cstack_class_t *c = (k < MUSE_CSTACK_CLASSES) ? env->cstacks.classes + k : &env->cstacks.oversized;
+		muse_cell entry;
+
+		if ( c->count == 0 && c->spawned == 0 )
+			continue;
+
+		entry = _cons( _cons( (k < MUSE_CSTACK_CLASSES) ? _mk_int( muse_cstack_class_cells(k) ) : _csymbol(L"oversized"),
+							  muse_list( env, "iiIi", c->count - c->num_free, c->num_free, c->spawned, high_water[k] ) ),
+					   MUSE_NIL );
+		if ( t )
+			_sett( t, entry );
+		else
+			h = entry;
+		t = entry;
+	}
+
+	_unwind(sp);
+	_spush(h);
+	return h;
+}
+
+/**
+ * @code (gc-stats [n]) @endcode
+ *
+ * Evaluates to a list of objects describing the most recent
+ * garbage collection and heap resizing events, latest first.
+ * Only the last 64 events are kept. If n is given, at most
+ * n events are returned. Each object has the properties -
+ *	- kind = full, minor, incremental, heap-grown or heap-shrunk
+ *	- time-us = when the event ended
+ *	- pause-us = how long evaluation was stopped for
+ *	- allocated = cells allocated since the previous collection
+ *	- marked, freed = cells found to be in use and cells freed
+ *	- texts-finalized, objects-finalized, destructors-finalized
+ *	- heap-size-before, heap-size, free-cells
+ *
+ * @see muse_set_gc_callback()
+ */
+muse_cell fn_gc_stats( muse_env *env, void *context, muse_cell args )
+{
+	static const muse_char *k_event_names[] = { L"full", L"minor", L"incremental", L"heap-grown", L"heap-shrunk" };
+	muse_gc_stats_t events[MUSE_GC_HISTORY_SIZE];
+	int i, n = MUSE_GC_HISTORY_SIZE, sp;
+	muse_cell h = MUSE_NIL, t = MUSE_NIL;
+
+	if ( args )
+		n = (int)_intvalue(_evalnext(&args));
+
+	n = muse_gc_history( env, n, events );
+	sp = _spos();
+
+	for ( i = 0; i < n; ++i )
+	{
+		const muse_gc_stats_t *e = events + i;
+		muse_cell obj = fn_new(env,NULL,MUSE_NIL);
+		muse_cell entry;
+
+		muse_put_many( env, obj,
+					   muse_list( env, "SSSISISISiSiSiSiSiSiSiSi",
+								  L"kind", k_event_names[e->event],
+								  L"time-us", e->time_us,
+								  L"pause-us", e->pause_us,
+								  L"allocated", e->cells_allocated,
+								  L"marked", e->cells_marked,
+								  L"freed", e->cells_freed,
+								  L"texts-finalized", e->texts_finalized,
+								  L"objects-finalized", e->objects_finalized,
+								  L"destructors-finalized", e->destructors_finalized,
+								  L"heap-size-before", e->heap_size_before,
+								  L"heap-size", e->heap_size,
+								  L"free-cells", e->free_cells ) );
+
+		entry = _cons( obj, MUSE_NIL );
+		if ( t )
+			_sett( t, entry );
+		else
+			h = entry;
+		t = entry;
+	}
+
+	_unwind(sp);
+	_spush(h);
+	return h;
+}
+
+/**
+ * @code (recent-stats) @endcode
+ *
+ * Evaluates to an object telling how many closure calls and
+ * lazy value evaluations set up a new scope for the values
+ * that \ref fn_the "the" refers to, and how many could do without
+ * one because their code never refers to recent values. The properties
+ * are scoped-calls, unscoped-calls, scoped-forces and unscoped-forces.
+ */
+muse_cell fn_recent_stats( muse_env *env, void *context, muse_cell args )
+{
+	const muse_recent_stats_t *st = &env->recent_stats;
+	muse_cell obj = fn_new(env,NULL,MUSE_NIL);
+	return muse_put_many( env, obj,
+						 muse_list( env, "SISISISI",
+								   L"scoped-calls", st->scoped_calls,
+								   L"unscoped-calls", st->unscoped_calls,
+								   L"scoped-forces", st->scoped_forces,
+								   L"unscoped-forces", st->unscoped_forces ) );
 }
 
 /************************ Type checks ***********************/
@@ -974,22 +1222,14 @@ muse_cell fn_generate_documentation( muse_env *env, void *context, muse_cell arg
 		return MUSE_NIL;
 	p = muse_assign_port(env, f, MUSE_PORT_WRITE);
 
-	/* The symbol table is a hash table where each bucket has a list
-	of symbols. */
 	size = sprintf( (char*)buffer, "/** @defgroup %S */\n/*@{*/\n", _text_contents( filename, NULL ) );
 	port_write( buffer, size, p );
 	{
 		muse_cell *syms = env->symbol_stack.bottom;
-		muse_cell *syms_end = syms + env->symbol_stack.size;
+		muse_cell *syms_end = env->symbol_stack.top;
 
 		while ( syms < syms_end )
-		{
-			muse_cell s = *syms++;
-			while ( s )
-			{
-				gendoc_for_symbol( env,_next(&s), p);
-			}
-		}
+			gendoc_for_symbol( env, *syms++, p );
 	}
 	size = sprintf( (char*)buffer, "\n/*@}*/\n" );
 	port_write( buffer, size, p );
@@ -1228,13 +1468,20 @@ muse_cell fn_this_process( muse_env *env, void *context, muse_cell args )
 }
 
 /**
- * @code (spawn (fn () [body]) [attention]) -> pid @endcode
+ * @code (spawn (fn () [body]) [attention] [stack-size]) -> pid @endcode
  *
  * Spawns a new process which will evaluate the given thunk.
  * The (optional) attention value is a positive integer
  * giving the number of reductions to perform in the created process
  * before yielding to other processes. The default value is 10.
  *
+ * The (optional) stack size is the size in cells of the C stack
+ * of the process, which defaults to the MUSE_STACK_SIZE parameter.
+ * It is rounded up to a power of two pages. Processes that do little
+ * work can do with far less - see \ref fn_stack_stats "stack-stats".
+ * Running out of C stack is a fatal fault and not an error that can
+ * be caught.
+ *
  * The result of the spawn expression is a pid using which you can
  * identify the created process and send messages to it by using the
  * pid as a normal function.
@@ -1248,8 +1495,13 @@ muse_cell fn_spawn( muse_env *env, void *context, muse_cell args )
 {
 	muse_cell thunk = _evalnext(&args);
 	int attention = args ? (int)_intvalue( _evalnext(&args) ) : env->parameters[MUSE_DEFAULT_ATTENTION];
+	int stack_size = args ? (int)_intvalue( _evalnext(&args) ) : 0;
 
-	muse_process_frame_t *p = init_process_mailbox( create_process( env, attention, thunk, NULL ) );
+	muse_process_frame_t *p = create_process( env, attention, thunk, NULL, stack_size );
+	if ( p == NULL )
+		return muse_raise_error( env, _csymbol(L"error:out-of-stack-memory"), _cons( _mk_int(stack_size), MUSE_NIL ) );
+
+	p = init_process_mailbox( p );
 	prime_process( p );
 	return process_id( p );
 }
@@ -1271,101 +1523,77 @@ muse_cell syntax_atomic( muse_env *env, void *context, muse_cell args )
 }
 
 /**
- * @code (receive [pid] [timeout-us]) @endcode
+ * @code (receive [pid-or-tag] [timeout-us]) @endcode
  *
  * Waits for and returns the next message in the process' mailbox.
- * It has four forms -
+ * It has six forms -
  *	- (receive)
  *	- (receive pid)
+ *	- (receive 'tag)
  *	- (receive timeout-us)
  *	- (receive pid timeout-us)
+ *	- (receive 'tag timeout-us)
  * 
  * If a process-id is given as the argument, it waits until a message is 
- * received from that specific process. If a timeout value (in microseconds) 
- * is given, it waits until either a message is received or the timeout expires. 
+ * received from that specific process. If a symbol is given, it waits 
+ * for a message whose first element after the sender's pid is that symbol,
+ * i.e. one that matches the pattern @code (pid 'tag . args) @endcode. 
+ * Messages from the same sender or with the same tag are received in the
+ * order they were sent. If a timeout value (in microseconds) is given, 
+ * it waits until either a message is received or the timeout expires. 
  * If the timeout expired, the receive expression evaluates to MUSE_NIL - i.e. to ().
+ *
+ * Waiting for a sender or tag doesn't involve looking through the other
+ * messages in the mailbox, so a process can leave many messages queued up 
+ * while it picks out the ones it wants.
  */
 muse_cell fn_receive( muse_env *env, void *context, muse_cell args )
 {
 	muse_process_frame_t *p = env->current_process;
-	muse_cell pid = MUSE_NIL;
+	muse_cell key = MUSE_NIL;
 	muse_int timeout_us = -1;
-	muse_cell msgs = MUSE_NIL;
+	muse_cell msg = MUSE_NIL;
 
 	if ( args )
 	{
-		/* Check whether the first arg is a pid that we have to wait for. */
-		pid = _evalnext(&args);
+		/* Check whether the first arg is a pid or tag that we have to wait for. */
+		key = _evalnext(&args);
 
-		switch ( _cellt(pid) )
+		switch ( _cellt(key) )
 		{
 		case MUSE_NATIVEFN_CELL :
+		case MUSE_SYMBOL_CELL :
 			/* Yes it is. Check whether the next argument is a timeout value. */
 			timeout_us = args ? _intvalue( _evalnext(&args) ) : -1;
 			break;
 		case MUSE_INT_CELL :
 		case MUSE_FLOAT_CELL :
 			/* Its not. It is a timeout value. */
-			timeout_us = _intvalue( pid );
-			pid = MUSE_NIL;
+			timeout_us = _intvalue( key );
+			key = MUSE_NIL;
 			break;
 		default:
 			muse_assert( !"Invalid argument to (receive...)" );
 		}
 	}
 
-	/* Set the pid wwe're waiting for. */
-	p->waiting_for_pid = pid;
-	msgs = p->mailbox;
-
-	if ( pid )
-	{
-		/* Search for the message. */
-		while ( _tail(msgs) && _head(_head(_tail(msgs))) != pid )
-			msgs = _tail(msgs);
-	}
+	/* Set the pid or tag we're waiting for. */
+	p->waiting_for = key;
+	msg = muse_take_message( env, p, key );
 
-	if ( !_tail(msgs) )
+	if ( !msg )
 	{
 		/* Wait for timeout value if specified. */
-		p->state_bits = MUSE_PROCESS_WAITING;
-
-		if ( timeout_us > 0 )
-		{
-			p->state_bits |= MUSE_PROCESS_HAS_TIMEOUT;
-			p->timeout_us = muse_elapsed_us(env->timer) + timeout_us;
-		}
+		suspend_process( env, timeout_us > 0 ? muse_elapsed_us(env->timer) + timeout_us : -1 );
 
-		switch_to_process( env, p->next );
+		/* Check for message again. If there's still no message, we've timed out. 
+		An actual message will never be MUSE_NIL because it will contain the PID of the
+		sending process at the head. */
+		msg = muse_take_message( env, p, key );
 	}
 
-	/* Check for message again. If there's still no message, return with MUSE_NIL. 
-	An actual message will never be MUSE_NIL because it will contain the PID of the
-	sending process at the head. */
-	msgs = p->mailbox;
-
-	if ( pid )
-	{
-		/* Search for the message. */
-		while ( _tail(msgs) && _head(_head(_tail(msgs))) != pid )
-			msgs = _tail(msgs);
-	}
-
-	if ( _tail(msgs) )
-	{
-		/* Yes! We've received a message. Remove it from the queue and return it. */
-		muse_cell msg = _tail(msgs);
-		p->waiting_for_pid = MUSE_NIL; /**< No longer waiting for a pid. */
-		_sett( msgs, _tail( msg ) );
-
-		/* After removing, check if we've reached the end of the message queue. */
-		if ( msg == p->mailbox_end )
-			p->mailbox_end = msgs;
-
-		return _head( msg );
-	}
-	else
-		return MUSE_NIL; /**< We've timed out. */
+	p->waiting_for = MUSE_NIL; /**< No longer waiting for a pid or tag. */
+	return msg;
 }
 
 
@@ -1379,21 +1607,12 @@ muse_cell fn_receive( muse_env *env, void *context, muse_cell args )
  */
 muse_cell fn_run( muse_env *env, void *context, muse_cell args )
 {
-	muse_process_frame_t *p = env->current_process;
 	muse_int timeout_us = args ? _intvalue( _evalnext(&args) ) : -1;
 	muse_int endtime_us = timeout_us + muse_elapsed_us(env->timer);
 
 	do
 	{
-		p->state_bits = MUSE_PROCESS_WAITING;
-
-		if ( timeout_us >= 0 )
-		{
-			p->state_bits |= MUSE_PROCESS_HAS_TIMEOUT;
-			p->timeout_us = endtime_us;
-		}
-
-		switch_to_process( env, env->current_process->next );
+		suspend_process( env, timeout_us >= 0 ? endtime_us : -1 );
 	}
 	while ( timeout_us < 0 );
 
@@ -1447,6 +1666,10 @@ muse_cell fn_post( muse_env *env, void *context, muse_cell args )
 		/* We've been given a pid to post to. */
 		muse_cell pid = _evalnext(&args);
 
+		/* The pid may be a handle to another environment. */
+		if ( muse_is_worker( env, pid ) )
+			return muse_post_to_worker( env, pid, msg );
+
 		MUSE_DIAGNOSTICS({
 			if ( !_is_pid(pid) )
 				muse_message( env,L"(post msg >>[pid]<<)", L"Expected a process id as the second argument.\nGot\n\t%m\ninstead.", pid );
@@ -1493,8 +1716,8 @@ muse_cell fn_with_timeout_us( muse_env *env, void *context, muse_cell args )
 		int bsp = _bspos();
 		push_timeout( env, id, timeout_us );
 		result = muse_force( env, muse_do( env, args ) );
+		pop_timeout( env );
 		_unwind_bindings(bsp);
-		env->current_process->num_eval_timeouts--;
 	}
 
 	return result;
@@ -1583,7 +1806,8 @@ muse_cell fn_the( muse_env *env, void *context, muse_cell args )
 	muse_int ikey = key;
 
 	if ( _cellt(key) == MUSE_NATIVEFN_CELL ) {
-		ikey = (muse_int)(size_t)(_ptr(key)->fn.fn);
+		const muse_argv_nativefn_info_t *info = _argvfninfo(key);
+		ikey = info ? (muse_int)(size_t)(info->fn) : (muse_int)(size_t)(_ptr(key)->fn.fn);
 	}
 
 	{
@@ -1727,26 +1951,21 @@ muse_cell fn_symbol_whose_value_is( muse_env *env, void *context, muse_cell args
 	has the given cell as its value. */
 
 	muse_stack symbols = env->symbol_stack;
-	int i;
-	for ( i = 0; i < symbols.size; ++i )
+	muse_cell *s;
+	for ( s = symbols.bottom; s < symbols.top; ++s )
 	{
-		muse_cell symlist = symbols.bottom[i];
-		
-		while ( symlist )
-		{
-			muse_cell sym = _next(&symlist);
+		muse_cell sym = *s;
 
-			if ( _symval(sym) == value ) {
-				if ( !symbol_on_stack(env,sym) ) /* Value found. */
-					return sym;
-			} else {
-				/* Recursively search any modules for such a value. */
-				void *data = muse_functional_object_data( env, _symval(sym), 'mmod' );
-				if ( data ) {
-					muse_cell found = module_find_symbol_with_value( env, data, value );
-					if ( found )
-						return _cons( sym, found );
-				}
+		if ( _symval(sym) == value ) {
+			if ( !symbol_on_stack(env,sym) ) /* Value found. */
+				return sym;
+		} else {
+			/* Recursively search any modules for such a value. */
+			void *data = muse_functional_object_data( env, _symval(sym), 'mmod' );
+			if ( data ) {
+				muse_cell found = module_find_symbol_with_value( env, data, value );
+				if ( found )
+					return _cons( sym, found );
 			}
 		}
 	}
@@ -25,7 +25,7 @@ BEGIN_MUSE_C_FUNCTIONS
 /*@{*/
 muse_cell fn_quote( muse_env *env, void *context, muse_cell args );
 muse_cell fn_lazy( muse_env *env, void *context, muse_cell args );
-muse_cell fn_cons( muse_env *env, void *context, muse_cell args );
+muse_cell fn_cons( muse_env *env, void *context, int argc, muse_cell *argv );
 muse_cell fn_lcons( muse_env *env, void *context, muse_cell args );
 muse_cell syntax_lambda( muse_env *env, void *context, muse_cell args );
 muse_cell syntax_block( muse_env *env, void *context, muse_cell args );
@@ -71,16 +71,16 @@ muse_cell fn_define( muse_env *env, void *context, muse_cell args );
 muse_cell fn_define_extension( muse_env *env, void *context, muse_cell args );
 muse_cell fn_define_override( muse_env *env, void *context, muse_cell args );
 muse_cell fn_set_M( muse_env *env, void *context, muse_cell args );
-muse_cell fn_setf_M( muse_env *env, void *context, muse_cell args );
-muse_cell fn_setr_M( muse_env *env, void *context, muse_cell args );
-muse_cell fn_first( muse_env *env, void *context, muse_cell args );
-muse_cell fn_rest( muse_env *env, void *context, muse_cell args );
-muse_cell fn_nth( muse_env *env, void *context, muse_cell args );
-muse_cell fn_take( muse_env *env, void *context, muse_cell args );
-muse_cell fn_drop( muse_env *env, void *context, muse_cell args );
-muse_cell fn_dup( muse_env *env, void *context, muse_cell args );
-muse_cell fn_list( muse_env *env, void *context, muse_cell args );
-muse_cell fn_append_M( muse_env *env, void *context, muse_cell args );
+muse_cell fn_setf_M( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_setr_M( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_first( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_rest( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_nth( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_take( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_drop( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_dup( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_list( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_append_M( muse_env *env, void *context, int argc, muse_cell *argv );
 /*@}*/
 
 /** @addtogroup HOFs Higher order functions */
@@ -101,18 +101,18 @@ muse_cell fn_datafn( muse_env *env, void *context, muse_cell args );
 
 /** @addtogroup Comparisons Comparisons */
 /*@{*/
-muse_cell fn_eq( muse_env *env, void *context, muse_cell args );
-muse_cell fn_equal( muse_env *env, void *context, muse_cell args );
-muse_cell fn_lt( muse_env *env, void *context, muse_cell args );
-muse_cell fn_gt( muse_env *env, void *context, muse_cell args );
-muse_cell fn_le( muse_env *env, void *context, muse_cell args );
-muse_cell fn_ge( muse_env *env, void *context, muse_cell args );
-muse_cell fn_ne( muse_env *env, void *context, muse_cell args );
+muse_cell fn_eq( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_equal( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_lt( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_gt( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_le( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_ge( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_ne( muse_env *env, void *context, int argc, muse_cell *argv );
 muse_cell fn_and( muse_env *env, void *context, muse_cell args );
 muse_cell fn_or( muse_env *env, void *context, muse_cell args );
-muse_cell fn_not( muse_env *env, void *context, muse_cell args );
-muse_cell fn_min( muse_env *env, void *context, muse_cell args );
-muse_cell fn_max( muse_env *env, void *context, muse_cell args );
+muse_cell fn_not( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_min( muse_env *env, void *context, int argc, muse_cell *argv );
+muse_cell fn_max( muse_env *env, void *context, int argc, muse_cell *argv );
 /*@}*/
 
 /** @addtogroup LanguageConstructs Language constructs */
@@ -165,6 +165,7 @@ muse_cell fn_object_p( muse_env *env, void *context, muse_cell args );
 /*@{*/
 muse_cell fn_sort_inplace( muse_env *env, void *context, muse_cell args );
 muse_cell fn_sort( muse_env *env, void *context, muse_cell args );
+muse_cell fn_partial_sort( muse_env *env, void *context, muse_cell args );
 muse_cell fn_reverse( muse_env *env, void *context, muse_cell args );
 muse_cell fn_reverse_inplace( muse_env *env, void *context, muse_cell args );
 /*@}*/
@@ -182,13 +183,19 @@ muse_cell fn_flush( muse_env *env, void *context, muse_cell args );
 muse_cell fn_mickey( muse_env *env, void *context, muse_cell args );
 muse_cell fn_scribble( muse_env *env, void *context, muse_cell args );
 muse_cell fn_load( muse_env *env, void *context, muse_cell args );
+muse_cell fn_compile_file( muse_env *env, void *context, muse_cell args );
+muse_cell fn_save_snapshot( muse_env *env, void *context, muse_cell args );
 muse_cell fn_file_has_attached_code_p( muse_env *env, void *context, muse_cell args );
 muse_cell fn_write_xml( muse_env *env, void *context, muse_cell args );
 muse_cell fn_read_xml( muse_env *env, void *context, muse_cell args );
 muse_cell fn_xml( muse_env *env, void *context, muse_cell args );
+muse_cell fn_xml_events( muse_env *env, void *context, muse_cell args );
+muse_cell fn_xml_select( muse_env *env, void *context, muse_cell args );
 muse_cell fn_write_json( muse_env *env, void *context, muse_cell args );
 muse_cell fn_read_json( muse_env *env, void *context, muse_cell args );
 muse_cell fn_json( muse_env *env, void *context, muse_cell args );
+muse_cell fn_json_reader( muse_env *env, void *context, muse_cell args );
+muse_cell fn_json_select( muse_env *env, void *context, muse_cell args );
 muse_cell fn_exit( muse_env *env, void *context, muse_cell args );
 muse_cell fn_tab_syntax( muse_env *env, void *context, muse_cell args );
 muse_cell fn_scheme_syntax( muse_env *env, void *context, muse_cell args );
@@ -228,6 +235,11 @@ muse_cell fn_scheme_syntax( muse_env *env, void *context, muse_cell args );
  * list, both processes can modify the contents of the object. The only 
  * constructs available to coordinate such modifications are
  * message passing and atomic blocks.
+ *
+ * All the processes of an environment share one thread. To use more
+ * cores, start environments on threads of their own using
+ * \ref fn_spawn_worker "spawn-worker". They share nothing and talk
+ * only by sending each other copies of messages.
  */
 /*@{*/
 muse_cell fn_spawn( muse_env *env, void *context, muse_cell args );
@@ -238,6 +250,8 @@ muse_cell fn_run( muse_env *env, void *context, muse_cell args );
 muse_cell fn_post( muse_env *env, void *context, muse_cell args );
 muse_cell fn_process_p( muse_env *env, void *context, muse_cell args );
 muse_cell fn_with_timeout_us( muse_env *env, void *context, muse_cell args );
+muse_cell fn_spawn_worker( muse_env *env, void *context, muse_cell args );
+muse_cell fn_worker_parent( muse_env *env, void *context, muse_cell args );
 /*@}*/
 
 /** @name Misc */
@@ -262,6 +276,13 @@ muse_cell fn_temp_file( muse_env *env, void *context, muse_cell args );
 muse_cell fn_to_lower( muse_env *env, void *context, muse_cell args );
 muse_cell fn_to_upper( muse_env *env, void *context, muse_cell args );
 muse_cell fn_stats( muse_env *env, void *context, muse_cell args );
+muse_cell fn_finalizer_stats( muse_env *env, void *context, muse_cell args );
+muse_cell fn_stack_stats( muse_env *env, void *context, muse_cell args );
+muse_cell fn_gc_stats( muse_env *env, void *context, muse_cell args );
+muse_cell fn_recent_stats( muse_env *env, void *context, muse_cell args );
+muse_cell fn_profile( muse_env *env, void *context, muse_cell args );
+muse_cell fn_profile_stacks( muse_env *env, void *context, muse_cell args );
+muse_cell fn_profile_calls( muse_env *env, void *context, muse_cell args );
 /*@}*/
 
 void muse_load_builtin_fns( muse_env *env );
@@ -284,9 +305,14 @@ void muse_define_put_macro( muse_env *env );
 /*@{*/
 void muse_define_builtin_type_vector(muse_env *env);
 void muse_define_builtin_type_hashtable(muse_env *env);
+muse_cell fn_hashtable_to_alist( muse_env *env, void *context, muse_cell args );
+void muse_define_builtin_type_pmap(muse_env *env);
+muse_cell fn_pmap( muse_env *env, void *context, muse_cell args );
+void muse_define_builtin_type_numvector(muse_env *env);
 void muse_define_builtin_type_bytes( muse_env *env );
 void muse_define_builtin_type_module( muse_env *env );
 void muse_define_builtin_type_box(muse_env *env);
+void muse_define_builtin_type_memoize(muse_env *env);
 /*@}*/
 
 void muse_define_builtin_networking(muse_env *env);
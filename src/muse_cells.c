@@ -133,13 +133,16 @@ MUSEAPI const muse_char *muse_text_contents( muse_env *env, muse_cell cell, int
 }
 
 /**
- * Returns the context pointer of a nativefn cell.
+ * Returns the context pointer of a nativefn cell. For a function
+ * made by muse_mk_argv_nativefn(), this is the context given in its
+ * muse_argv_nativefn_info_t.
  */
 MUSEAPI void *muse_nativefn_context( muse_env *env, muse_cell cell, muse_nativefn_t *fn )
 {
 	muse_nativefn_cell c = _ptr(cell)->fn;
+	const muse_argv_nativefn_info_t *info = _argvfninfo(cell);
 	if ( fn ) (*fn) = c.fn;
-	return c.context;
+	return info ? info->context : c.context;
 }
 
 /**
@@ -187,6 +190,7 @@ MUSEAPI muse_cell muse_set_cell( muse_env *env, muse_cell cell, muse_cell head,
  */
 MUSEAPI muse_cell muse_set_head( muse_env *env, muse_cell cell, muse_cell head )
 {
+	_remember(cell);
 	_ptr(cell)->cons.head = head;
 	return cell;
 }
@@ -199,6 +203,7 @@ MUSEAPI muse_cell muse_set_head( muse_env *env, muse_cell cell, muse_cell head )
  */
 MUSEAPI muse_cell muse_set_tail( muse_env *env, muse_cell cell, muse_cell tail )
 {
+	_remember(cell);
 	_ptr(cell)->cons.tail = tail;
 	return cell;
 }
@@ -236,8 +241,8 @@ MUSEAPI muse_cell muse_set_text( muse_env *env, muse_cell text, const muse_char
 	}
 	else
 	{
-		free(t->start);
-		t->start = (muse_char*)malloc( sizeof(muse_char) * (end-start+1) );
+		muse_text_free( env, t->start );
+		t->start = muse_text_alloc( env, (int)(end-start) );
 		t->end = t->start + (end-start);
 		memcpy( t->start, start, sizeof(muse_char) * (end-start+1) );
 	}
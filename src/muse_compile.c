@@ -0,0 +1,829 @@
+/**
+ * @file muse_compile.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Compiles the body of a closure into a tree of pre-resolved nodes when
+ * the closure is created, so that applying the closure doesn't have to
+ * rediscover the structure of its body through muse_eval() and muse_apply()
+ * every time -
+ *	- Constants evaluate to themselves without a type switch.
+ *	- Symbols are read straight out of the process' locals.
+ *	- \ref syntax_if "if" and \ref syntax_do "do" are run by the tree itself.
+ *	- Calls to arithmetic, comparison and list primitives with a fixed
+ *	  number of arguments are done in place on the evaluated arguments.
+ *	  Anything other than numbers is handed to the primitive itself.
+ *	- Closure calls have their arguments evaluated by the tree and calls
+ *	  in tail position produce lazy cells just like muse_do() does.
+ *
+ * Everything else, including syntax such as let and case, is given to
+ * muse_apply() or muse_eval() exactly as the interpreter would.
+ *
+ * The compiled tree is held by a functional object which is placed,
+ * quick-quoted, right after the meta object in the closure's body. The
+ * body's S-expression stays as it is for write and meta.
+ */
+
+#include "muse_builtins.h"
+#include <stdlib.h>
+
+enum
+{
+	NODE_CONST,		/**< Evaluates to \c cell. */
+	NODE_SYMBOL,	/**< Evaluates to the value of the symbol \c cell. */
+	NODE_EVAL,		/**< The expression \c cell is given to muse_eval(). */
+	NODE_NATIVE,	/**< The primitive \c cell is applied to the unevaluated \c args. */
+	NODE_ARGV,		/**< The array primitive \c cell is called with the values of the children. */
+	NODE_CALL,		/**< The value of the first child is applied to the rest. Falls
+					 *   back to the unevaluated \c args if it isn't a closure. */
+	NODE_IF,		/**< Condition, then and else children. */
+	NODE_DO,		/**< A guarded block, as in \ref syntax_do "do". */
+	NODE_BLOCK,		/**< A plain block, as in muse_do(). */
+	NODE_ADD,
+	NODE_SUB,
+	NODE_MUL,
+	NODE_COMPARE,	/**< \c op gives the comparison. */
+	NODE_EQ,
+	NODE_NOT,
+	NODE_FIRST,
+	NODE_REST,
+	NODE_CONS
+};
+
+enum { COMPARE_LT, COMPARE_GT, COMPARE_LE, COMPARE_GE, COMPARE_EQUAL, COMPARE_NE };
+
+enum
+{
+	MUSE_MAX_INLINE_ARGS = 8	/**< Arithmetic with more arguments than this isn't done in place. */
+};
+
+typedef struct
+{
+	short		kind;
+	short		op;
+	int			nargs;	/**< The number of children. */
+	int			kids;	/**< Index of the first child in compiled_code_t::kids. */
+	muse_cell	cell;	/**< A constant, a symbol, a primitive or the expression itself. */
+	muse_cell	args;	/**< The unevaluated arguments of a call. */
+} code_node_t;
+
+typedef struct
+{
+	muse_functional_object_t base;
+	muse_cell	source;		/**< The body expressions the code was compiled from. */
+	muse_cell	formals;	/**< The formals of the closure. */
+	muse_boolean simple_formals; /**< MUSE_TRUE if the formals are just symbols, as in (a b . c). */
+	muse_boolean uses_recent;	/**< MUSE_FALSE if the body can't refer to recent values. */
+	code_node_t	*nodes;
+	int			num_nodes, nodes_capacity;
+	int			*kids;		/**< Node indices of the children of all the nodes. */
+	int			num_kids, kids_capacity;
+	int			root;
+} compiled_code_t;
+
+static void code_init( muse_env *env, void *ptr, muse_cell args )
+{
+	compiled_code_t *code = (compiled_code_t*)ptr;
+	code->source	= MUSE_NIL;
+	code->formals	= MUSE_NIL;
+	code->simple_formals = MUSE_FALSE;
+	code->uses_recent = MUSE_TRUE;
+	code->nodes		= NULL;
+	code->kids		= NULL;
+	code->root		= -1;
+}
+
+static void code_mark( muse_env *env, void *ptr )
+{
+	muse_mark( env, ((compiled_code_t*)ptr)->source );
+	muse_mark( env, ((compiled_code_t*)ptr)->formals );
+}
+
+static void code_destroy( muse_env *env, void *ptr )
+{
+	compiled_code_t *code = (compiled_code_t*)ptr;
+	free( code->nodes );
+	free( code->kids );
+	code->nodes = NULL;
+	code->kids = NULL;
+}
+
+static void code_write( muse_env *env, void *ptr, void *port )
+{
+	muse_pwrite( (muse_port_t)port, ((compiled_code_t*)ptr)->source );
+}
+
+static muse_cell fn_code( muse_env *env, compiled_code_t *code, muse_cell args )
+{
+	return MUSE_NIL;
+}
+
+static muse_functional_object_type_t g_compiled_code_type =
+{
+	'muSE',
+	'code',
+	sizeof(compiled_code_t),
+	(muse_nativefn_t)fn_code,
+	NULL,
+	code_init,
+	code_mark,
+	code_destroy,
+	code_write
+};
+
+/************************************************************************/
+/* Compilation                                                          */
+/************************************************************************/
+
+static int new_node( compiled_code_t *code, int kind, muse_cell cell )
+{
+	code_node_t *node;
+
+	if ( code->num_nodes >= code->nodes_capacity )
+	{
+		code->nodes_capacity = code->nodes_capacity ? code->nodes_capacity * 2 : 16;
+		code->nodes = (code_node_t*)realloc( code->nodes, sizeof(code_node_t) * code->nodes_capacity );
+	}
+
+	node = code->nodes + code->num_nodes;
+	node->kind	= (short)kind;
+	node->op	= 0;
+	node->nargs	= 0;
+	node->kids	= 0;
+	node->cell	= cell;
+	node->args	= MUSE_NIL;
+	return code->num_nodes++;
+}
+
+/**
+ * Returns the length of the given list, or -1 if it
+ * isn't a proper list.
+ */
+static int proper_length( muse_env *env, muse_cell list )
+{
+	int n = 0;
+
+	while ( list > 0 && _cellt(list) == MUSE_CONS_CELL )
+	{
+		list = _tail(list);
+		++n;
+	}
+
+	return list == MUSE_NIL ? n : -1;
+}
+
+static int compile_expr( muse_env *env, compiled_code_t *code, muse_cell expr );
+
+/**
+ * Compiles the given expressions as the children of the node.
+ * The children's indices are reserved first because compiling them
+ * adds the children of the children.
+ */
+static void compile_kids( muse_env *env, compiled_code_t *code, int n, muse_cell exprs, int count )
+{
+	int base = code->num_kids, k;
+
+	if ( code->num_kids + count > code->kids_capacity )
+	{
+		while ( code->num_kids + count > code->kids_capacity )
+			code->kids_capacity = code->kids_capacity ? code->kids_capacity * 2 : 16;
+		code->kids = (int*)realloc( code->kids, sizeof(int) * code->kids_capacity );
+	}
+
+	code->num_kids += count;
+	code->nodes[n].kids = base;
+	code->nodes[n].nargs = count;
+
+	for ( k = 0; k < count; ++k )
+	{
+		int kid = compile_expr( env, code, _next(&exprs) );
+		code->kids[base + k] = kid;
+	}
+}
+
+static int compile_block( muse_env *env, compiled_code_t *code, int kind, muse_cell body )
+{
+	int n = new_node( code, kind, MUSE_NIL );
+	compile_kids( env, code, n, body, proper_length( env, body ) );
+	return n;
+}
+
+/**
+ * Chooses the node for an application of the given primitive, if
+ * the primitive is one that can be run in place with the given number
+ * of arguments. Returns -1 if not.
+ */
+static int inline_primitive_kind( muse_nativefn_t sf, muse_argv_nativefn_t f, int nargs, short *op )
+{
+	*op = 0;
+
+	if ( sf == syntax_if )			return nargs == 3 ? NODE_IF : -1;
+	if ( sf == syntax_do )			return NODE_DO;
+	if ( nargs > MUSE_MAX_INLINE_ARGS ) return -1;
+	if ( f == fn_add )				return NODE_ADD;
+	if ( f == fn_mul )				return NODE_MUL;
+	if ( f == fn_sub )				return nargs >= 1 ? NODE_SUB : -1;
+	if ( f == fn_eq )				return nargs == 2 ? NODE_EQ : -1;
+	if ( f == fn_cons )				return nargs == 2 ? NODE_CONS : -1;
+	if ( f == fn_not )				return nargs == 1 ? NODE_NOT : -1;
+	if ( f == fn_first )			return nargs == 1 ? NODE_FIRST : -1;
+	if ( f == fn_rest )				return nargs == 1 ? NODE_REST : -1;
+
+	if ( nargs != 2 )				return -1;
+	if ( f == fn_lt )				{ *op = COMPARE_LT; return NODE_COMPARE; }
+	if ( f == fn_gt )				{ *op = COMPARE_GT; return NODE_COMPARE; }
+	if ( f == fn_le )				{ *op = COMPARE_LE; return NODE_COMPARE; }
+	if ( f == fn_ge )				{ *op = COMPARE_GE; return NODE_COMPARE; }
+	if ( f == fn_equal )			{ *op = COMPARE_EQUAL; return NODE_COMPARE; }
+	if ( f == fn_ne )				{ *op = COMPARE_NE; return NODE_COMPARE; }
+
+	return -1;
+}
+
+static int compile_application( muse_env *env, compiled_code_t *code, muse_cell expr )
+{
+	muse_cell head = _head(expr);
+	muse_cell args = _tail(expr);
+	int nargs = proper_length( env, args );
+	int n;
+
+	if ( nargs < 0 )
+		return new_node( code, NODE_EVAL, expr );
+
+	if ( head > 0 && _cellt(head) == MUSE_NATIVEFN_CELL )
+	{
+		const muse_argv_nativefn_info_t *info = _argvfninfo(head);
+		short op;
+		int kind = (_fnobjdata(head) == NULL) 
+					? inline_primitive_kind( _ptr(head)->fn.fn, info ? info->fn : NULL, nargs, &op ) 
+					: -1;
+
+		if ( kind < 0 && info )
+			kind = NODE_ARGV;
+
+		if ( kind < 0 )
+		{
+			n = new_node( code, NODE_NATIVE, head );
+			code->nodes[n].args = args;
+			return n;
+		}
+
+		n = new_node( code, kind, head );
+		code->nodes[n].op = op;
+		code->nodes[n].args = args;
+		compile_kids( env, code, n, args, nargs );
+
+		return n;
+	}
+
+	/* The function is only known at run time. */
+	n = new_node( code, NODE_CALL, expr );
+	code->nodes[n].args = args;
+	compile_kids( env, code, n, expr, nargs + 1 );
+	return n;
+}
+
+static int compile_expr( muse_env *env, compiled_code_t *code, muse_cell expr )
+{
+	if ( expr <= 0 )
+		return new_node( code, NODE_CONST, _quq(expr) );
+
+	switch ( _cellt(expr) )
+	{
+		case MUSE_SYMBOL_CELL	: return new_node( code, NODE_SYMBOL, expr );
+		case MUSE_CONS_CELL		: return compile_application( env, code, expr );
+		default					: return new_node( code, NODE_CONST, expr );
+	}
+}
+
+enum { MUSE_RECENT_SCAN_BUDGET = 4096 };
+
+/**
+ * Returns MUSE_TRUE if evaluating the expression might refer to the 
+ * recent values of the scope it is evaluated in - i.e. if it mentions
+ * \ref fn_the "the" or "it", or a primitive that evaluates code it is
+ * given, or a macro that might expand to such code. Quoted data is
+ * looked into as well. Closures that are called get scopes of their
+ * own and so don't count. When in doubt - for instance if
+ * the expression is too big to look through - the answer is yes.
+ */
+static muse_boolean may_use_recent( muse_env *env, muse_cell expr, int *budget )
+{
+	expr = _quq(expr);
+
+	while ( expr )
+	{
+		if ( --(*budget) < 0 )
+			return MUSE_TRUE;
+
+		switch ( _cellt(expr) )
+		{
+			case MUSE_SYMBOL_CELL :
+				if ( expr == _builtin_symbol(MUSE_THE) || expr == _builtin_symbol(MUSE_IT) )
+					return MUSE_TRUE;
+				expr = _symval(expr);
+				if ( expr <= 0 || _cellt(expr) == MUSE_SYMBOL_CELL || _cellt(expr) == MUSE_CONS_CELL )
+					return MUSE_FALSE;
+				break;
+			case MUSE_NATIVEFN_CELL :
+				{
+					muse_nativefn_t f = _ptr(expr)->fn.fn;
+					return (f == fn_the || f == fn_with_recent || f == fn_eval || f == fn_apply || f == fn_load) ? MUSE_TRUE : MUSE_FALSE;
+				}
+			case MUSE_LAMBDA_CELL :
+				/* Only macros expand into the code around them. */
+				if ( _head(expr) >= 0 )
+					return MUSE_FALSE;
+				else
+				{
+					muse_cell code = muse_compiled_code( env, expr );
+					return code ? muse_compiled_code_uses_recent( env, code ) : MUSE_TRUE;
+				}
+			case MUSE_CONS_CELL :
+				if ( may_use_recent( env, _head(expr), budget ) )
+					return MUSE_TRUE;
+				expr = _quq(_tail(expr));
+				break;
+			default :
+				return MUSE_FALSE;
+		}
+	}
+
+	return MUSE_FALSE;
+}
+
+/**
+ * Returns MUSE_TRUE if the formals are a list of symbols,
+ * optionally ending in a symbol for the rest of the arguments.
+ */
+static muse_boolean are_simple_formals( muse_env *env, muse_cell formals )
+{
+	while ( formals > 0 && _cellt(formals) == MUSE_CONS_CELL )
+	{
+		muse_cell f = _head(formals);
+
+		if ( f <= 0 || _cellt(f) != MUSE_SYMBOL_CELL || _isquote(f) )
+			return MUSE_FALSE;
+
+		formals = _tail(formals);
+	}
+
+	return (formals == MUSE_NIL || (formals > 0 && _cellt(formals) == MUSE_SYMBOL_CELL)) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/**
+ * Compiles the body of the given closure made by \ref syntax_lambda "fn"
+ * and inserts the compiled code into the body right after the
+ * closure's meta object. Does nothing if the closure has no meta
+ * object or an empty body.
+ */
+void muse_compile_lambda( muse_env *env, muse_cell fn )
+{
+	muse_cell body = _tail(fn);
+
+	if ( !env->parameters[MUSE_COMPILE_LAMBDAS] || !body || _head(body) >= 0 || !_tail(body) )
+		return;
+
+	if ( proper_length( env, _tail(body) ) < 0 )
+		return;
+
+	{
+		int sp = _spos();
+		muse_cell c = _mk_functional_object( &g_compiled_code_type, MUSE_NIL );
+		compiled_code_t *code = (compiled_code_t*)_fnobjdata(c);
+
+		code->source = _tail(body);
+		code->formals = _quq(_head(fn));
+		code->simple_formals = are_simple_formals( env, code->formals );
+		{
+			int budget = MUSE_RECENT_SCAN_BUDGET;
+			code->uses_recent = may_use_recent( env, code->source, &budget );
+		}
+		code->root = compile_block( env, code, NODE_BLOCK, code->source );
+
+		_sett( body, _cons( _qq(c), _tail(body) ) );
+		_unwind(sp);
+	}
+}
+
+/**
+ * Returns the compiled code of the given closure, or MUSE_NIL if
+ * it hasn't been compiled or its body has been altered since.
+ */
+muse_cell muse_compiled_code( muse_env *env, muse_cell fn )
+{
+	muse_cell body = _tail(fn);
+
+	if ( body && _head(body) < 0 )
+	{
+		muse_cell rest = _tail(body);
+
+		if ( rest && _head(rest) < 0 )
+		{
+			muse_cell c = _quq(_head(rest));
+			compiled_code_t *code = (compiled_code_t*)_fnobjdata(c);
+
+			if ( code && code->base.type_info == &g_compiled_code_type && code->source == _tail(rest) )
+				return c;
+		}
+	}
+
+	return MUSE_NIL;
+}
+
+/**
+ * Returns MUSE_FALSE if the compiled code can't refer to recent
+ * values, in which case running it needs no recent scope.
+ * @see muse_push_quiet_recent_scope()
+ */
+muse_boolean muse_compiled_code_uses_recent( muse_env *env, muse_cell code )
+{
+	return code ? ((compiled_code_t*)_fnobjdata(code))->uses_recent : MUSE_TRUE;
+}
+
+/**
+ * Returns MUSE_TRUE if the given cell is a compiled code object.
+ */
+muse_boolean muse_is_compiled_code( muse_env *env, muse_cell c )
+{
+	muse_functional_object_t *obj = _fnobjdata(c);
+	return (obj && obj->type_info == &g_compiled_code_type) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/************************************************************************/
+/* Execution                                                            */
+/************************************************************************/
+
+/**
+ * Same as muse_bind_formals(), but binds a list of symbols directly
+ * instead of matching it as a pattern.
+ */
+muse_boolean muse_bind_compiled_formals( muse_env *env, muse_cell c, muse_cell formals, muse_cell args )
+{
+	const compiled_code_t *code = (const compiled_code_t*)_fnobjdata(c);
+
+	if ( code->simple_formals && code->formals == formals )
+	{
+		int bsp = _bspos();
+		muse_cell f = formals, a = args;
+
+		while ( f > 0 && _cellt(f) == MUSE_CONS_CELL )
+		{
+			if ( a <= 0 || _cellt(a) != MUSE_CONS_CELL )
+				break;
+
+			_pushdef( _head(f), _head(a) );
+			f = _tail(f);
+			a = _tail(a);
+		}
+
+		if ( f > 0 && _cellt(f) == MUSE_SYMBOL_CELL )
+		{
+			_pushdef( f, a );
+			return MUSE_TRUE;
+		}
+
+		if ( f == MUSE_NIL && a == MUSE_NIL )
+			return MUSE_TRUE;
+
+		/* Too few or too many arguments, or a lazy argument
+		list. Leave it to the pattern matcher. */
+		_unwind_bindings(bsp);
+	}
+
+	return muse_bind_formals( env, formals, args );
+}
+
+static muse_cell run_node( muse_env *env, const compiled_code_t *code, int n, muse_boolean lazy );
+
+#define _kid(node,k) (code->kids[(node)->kids + (k)])
+
+/**
+ * Same as muse_do(), over the node's children.
+ */
+static muse_cell run_block( muse_env *env, const compiled_code_t *code, const code_node_t *node )
+{
+	muse_cell result = MUSE_NIL;
+	int sp = _spos();
+	int k;
+
+	for ( k = 0; k < node->nargs; ++k )
+	{
+		_unwind(sp);
+		result = run_node( env, code, _kid(node,k), k + 1 == node->nargs );
+	}
+
+	return result;
+}
+
+/**
+ * Leaves the result of a primitive on the stack and
+ * forces it if needed, as muse_apply() and muse_eval() do.
+ */
+static muse_cell primitive_result( muse_env *env, int sp, muse_cell result, muse_boolean lazy )
+{
+	_unwind(sp);
+	_spush(result);
+	return lazy ? result : _force(result);
+}
+
+/**
+ * Same as \ref syntax_if "if".
+ */
+static muse_cell run_if( muse_env *env, const compiled_code_t *code, const code_node_t *node, muse_boolean lazy )
+{
+	int sp = _spos();
+	muse_cell result;
+	muse_cell cond;
+
+	yield_process(env,1);
+
+	cond = run_node( env, code, _kid(node,0), MUSE_FALSE );
+	muse_push_copy_recent_scope(env);
+	{
+		int bp = _bspos();
+		_push_binding(_builtin_symbol(MUSE_IT));
+		result = run_node( env, code, _kid(node, cond ? 1 : 2), MUSE_TRUE );
+		_unwind_bindings(bp);
+		muse_pop_recent_scope( env, (muse_int)syntax_if, result );
+	}
+
+	return primitive_result( env, sp, result, lazy );
+}
+
+/**
+ * Same as \ref syntax_do "do".
+ */
+static muse_cell run_do( muse_env *env, const compiled_code_t *code, const code_node_t *node, muse_boolean lazy )
+{
+	int sp = _spos();
+	muse_cell result;
+
+	yield_process(env,1);
+
+	muse_push_copy_recent_scope(env);
+	{
+		int bp = _bspos();
+		_push_binding(_builtin_symbol(MUSE_IT));
+		result = run_block( env, code, node );
+		_unwind_bindings(bp);
+		muse_pop_recent_scope( env, 0, MUSE_NIL );
+	}
+
+	return primitive_result( env, sp, result, lazy );
+}
+
+/**
+ * Applies the node's primitive to already evaluated arguments.
+ * Used when the arguments are not what the node can handle itself,
+ * so that the primitive gets to report the problem.
+ */
+static muse_cell apply_primitive( muse_env *env, const code_node_t *node, int argc, muse_cell *argv )
+{
+	const muse_argv_nativefn_info_t *info = _argvfninfo(node->cell);
+	muse_assert( info != NULL );
+	return info->fn( env, info->context, argc, argv );
+}
+
+static muse_cell run_arith( muse_env *env, const compiled_code_t *code, const code_node_t *node, muse_boolean lazy )
+{
+	int sp = _spos();
+	muse_cell argv[MUSE_MAX_INLINE_ARGS];
+	muse_int i = (node->kind == NODE_MUL) ? 1 : 0;
+	muse_float f = (node->kind == NODE_MUL) ? 1.0 : 0.0;
+	muse_boolean result_is_float = MUSE_FALSE;
+	int k;
+
+	yield_process(env,1);
+
+	for ( k = 0; k < node->nargs; ++k )
+		argv[k] = run_node( env, code, _kid(node,k), MUSE_FALSE );
+
+	/* The accumulation follows the primitives exactly - integers and
+	floats are summed separately and combined at the end. */
+	for ( k = 0; k < node->nargs; ++k )
+	{
+		muse_cell arg = argv[k];
+
+		switch ( _cellt(arg) )
+		{
+			case MUSE_INT_CELL :
+				switch ( node->kind )
+				{
+					case NODE_ADD : i += _ptr(arg)->i; break;
+					case NODE_SUB : if ( k == 0 ) i += _ptr(arg)->i; else i -= _ptr(arg)->i; break;
+					default		  : i *= _ptr(arg)->i; break;
+				}
+				break;
+			case MUSE_FLOAT_CELL :
+				result_is_float = MUSE_TRUE;
+				switch ( node->kind )
+				{
+					case NODE_ADD : f += _ptr(arg)->f; break;
+					case NODE_SUB : if ( k == 0 ) f += _ptr(arg)->f; else f -= _ptr(arg)->f; break;
+					default		  : f *= _ptr(arg)->f; break;
+				}
+				break;
+			default :
+				return primitive_result( env, sp, apply_primitive( env, node, node->nargs, argv ), lazy );
+		}
+	}
+
+	if ( node->kind == NODE_SUB && node->nargs == 1 )
+		return primitive_result( env, sp, result_is_float ? _mk_float(-f) : _mk_int(-i), lazy );
+
+	switch ( node->kind )
+	{
+		case NODE_ADD : return primitive_result( env, sp, result_is_float ? _mk_float(f + i) : _mk_int(i), lazy );
+		case NODE_SUB : return primitive_result( env, sp, result_is_float ? _mk_float(i + f) : _mk_int(i), lazy );
+		default		  : return primitive_result( env, sp, result_is_float ? _mk_float(f * i) : _mk_int(i), lazy );
+	}
+}
+
+static muse_cell run_compare( muse_env *env, const compiled_code_t *code, const code_node_t *node, muse_boolean lazy )
+{
+	int sp = _spos();
+	muse_cell argv[2];
+	int lt, rt, c;
+
+	yield_process(env,1);
+
+	argv[0] = run_node( env, code, _kid(node,0), MUSE_FALSE );
+	argv[1] = run_node( env, code, _kid(node,1), MUSE_FALSE );
+
+	lt = _cellt(argv[0]);
+	rt = _cellt(argv[1]);
+
+	/* Only numbers are compared in place, the same way that the
+	comparison primitives do. */
+	if ( argv[0] == MUSE_NIL || argv[1] == MUSE_NIL || !_isnumbert(lt) || !_isnumbert(rt) )
+		return primitive_result( env, sp, apply_primitive( env, node, 2, argv ), lazy );
+
+	if ( argv[0] == argv[1] )
+		c = 0;
+	else if ( lt == MUSE_INT_CELL && rt == MUSE_INT_CELL )
+	{
+		muse_int i1 = _ptr(argv[0])->i, i2 = _ptr(argv[1])->i;
+		c = (i1 < i2) ? -1 : (i1 > i2 ? 1 : 0);
+	}
+	else
+	{
+		muse_float f1 = _floatvalue(argv[0]), f2 = _floatvalue(argv[1]);
+		c = (f1 < f2) ? -1 : (f1 > f2 ? 1 : 0);
+	}
+
+	switch ( node->op )
+	{
+		case COMPARE_LT		: c = (c < 0); break;
+		case COMPARE_GT		: c = (c > 0); break;
+		case COMPARE_LE		: c = (c <= 0); break;
+		case COMPARE_GE		: c = (c >= 0); break;
+		case COMPARE_EQUAL	: c = (c == 0); break;
+		default				: c = (c != 0); break;
+	}
+
+	return primitive_result( env, sp, c ? _t() : MUSE_NIL, lazy );
+}
+
+/**
+ * Evaluates the node's arguments into a list, the way
+ * muse_eval_list() does.
+ */
+static muse_cell run_args( muse_env *env, const compiled_code_t *code, const code_node_t *node )
+{
+	muse_cell h, t;
+	int sp, k;
+
+	if ( node->nargs <= 1 )
+		return MUSE_NIL;
+
+	h = t = _cons( MUSE_NIL, MUSE_NIL );
+	sp = _spos();
+	_seth( h, run_node( env, code, _kid(node,1), MUSE_FALSE ) );
+	_unwind(sp);
+
+	for ( k = 2; k < node->nargs; ++k )
+	{
+		muse_cell c = _cons( run_node( env, code, _kid(node,k), MUSE_FALSE ), MUSE_NIL );
+		_sett( t, c );
+		t = c;
+		_unwind(sp);
+	}
+
+	return h;
+}
+
+/**
+ * Calls an array primitive with the values of the node's children,
+ * which are kept in stack slots while the primitive runs.
+ */
+static muse_cell run_argv( muse_env *env, const compiled_code_t *code, const code_node_t *node, muse_boolean lazy )
+{
+	const muse_argv_nativefn_info_t *info = _argvfninfo(node->cell);
+	int sp = _spos();
+	muse_cell *argv = _stack()->top;
+	int k;
+
+	yield_process(env,1);
+
+	muse_assert( _stack()->top + node->nargs <= _stack()->bottom + _stack()->size );
+	for ( k = 0; k < node->nargs; ++k )
+		argv[k] = MUSE_NIL;
+	_stack()->top += node->nargs;
+
+	{
+		int argsp = _spos();
+
+		for ( k = 0; k < node->nargs; ++k )
+		{
+			argv[k] = run_node( env, code, _kid(node,k), MUSE_FALSE );
+			_unwind(argsp);
+		}
+	}
+
+	return primitive_result( env, sp, info->fn( env, info->context, node->nargs, argv ), lazy );
+}
+
+static muse_cell run_call( muse_env *env, const compiled_code_t *code, const code_node_t *node, muse_boolean lazy )
+{
+	muse_cell fn = run_node( env, code, _kid(node,0), MUSE_FALSE );
+	muse_cell result;
+
+	if ( _cellt(fn) == MUSE_LAMBDA_CELL && _head(fn) >= 0 )
+	{
+		int sp = _spos();
+		result = muse_apply( env, fn, run_args( env, code, node ), MUSE_TRUE, lazy );
+		_unwind(sp);
+		_spush(result);
+	}
+	else
+		result = muse_apply( env, fn, node->args, MUSE_FALSE, lazy );
+
+	return lazy ? result : _force(result);
+}
+
+static muse_cell run_node( muse_env *env, const compiled_code_t *code, int n, muse_boolean lazy )
+{
+	const code_node_t *node = code->nodes + n;
+
+	switch ( node->kind )
+	{
+		case NODE_CONST		: return node->cell;
+		case NODE_SYMBOL	: return _symval(node->cell);
+		case NODE_EVAL		: return muse_eval( env, node->cell, lazy );
+		case NODE_CALL		: return run_call( env, code, node, lazy );
+		case NODE_IF		: return run_if( env, code, node, lazy );
+		case NODE_DO		: return run_do( env, code, node, lazy );
+		case NODE_BLOCK		: return run_block( env, code, node );
+		case NODE_ADD		:
+		case NODE_SUB		:
+		case NODE_MUL		: return run_arith( env, code, node, lazy );
+		case NODE_COMPARE	: return run_compare( env, code, node, lazy );
+		case NODE_NATIVE	:
+			{
+				muse_cell result = muse_apply( env, node->cell, node->args, MUSE_FALSE, lazy );
+				return lazy ? result : _force(result);
+			}
+		case NODE_ARGV		: return run_argv( env, code, node, lazy );
+		default				:
+			{
+				int sp = _spos();
+				muse_cell argv[2], result;
+				int k;
+
+				yield_process(env,1);
+
+				for ( k = 0; k < node->nargs; ++k )
+					argv[k] = run_node( env, code, _kid(node,k), MUSE_FALSE );
+
+				switch ( node->kind )
+				{
+					case NODE_EQ	: result = muse_eq( env, argv[0], argv[1] ) ? _t() : MUSE_NIL; break;
+					case NODE_NOT	: result = argv[0] ? MUSE_NIL : _t(); break;
+					case NODE_FIRST	: result = muse_head( env, argv[0] ); break;
+					case NODE_REST	: result = muse_tail( env, argv[0] ); break;
+					default			: result = _cons( argv[0], argv[1] ); break;
+				}
+
+				return primitive_result( env, sp, result, lazy );
+			}
+	}
+}
+
+/**
+ * Runs the compiled body of a closure in the same way that
+ * muse_do() evaluates it - i.e. with the last expression evaluated
+ * lazily. The formals must already be bound. The code object is
+ * left on the stack so that it stays alive while it runs.
+ */
+muse_cell muse_run_compiled_code( muse_env *env, muse_cell c )
+{
+	const compiled_code_t *code = (const compiled_code_t*)_fnobjdata(c);
+	_spush(c);
+	return run_block( env, code, code->nodes + code->root );
+}
@@ -0,0 +1,284 @@
+/**
+ * @file muse_cstacks.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * The C stacks of spawned processes. They are mapped directly from the
+ * system with an inaccessible guard page below them, so that a process that
+ * runs out of stack faults instead of overwriting other memory.
+ *
+ * Stacks are a power of two pages in size, and those no longer in use are
+ * pooled by size for the next spawn. A pooled stack is wiped clean - the
+ * part near its top, which nearly every process uses, is zeroed and the
+ * rest of what was used is given back to the system. Since untouched stack
+ * memory is then always zero, how much of a stack a process has used is
+ * found by looking for the lowest word that isn't.
+ */
+
+#include "muse_opcodes.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef MUSE_PLATFORM_WINDOWS
+#	include <windows.h>
+#else
+#	include <sys/mman.h>
+#	include <unistd.h>
+#	ifndef MAP_ANONYMOUS
+#		define MAP_ANONYMOUS MAP_ANON
+#	endif
+#endif
+
+enum
+{
+	MUSE_CSTACK_KEEP_PAGES = 4	/**< The pages at the top of a pooled stack that are kept instead of given back. */
+};
+
+static size_t page_size()
+{
+#ifdef MUSE_PLATFORM_WINDOWS
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	return info.dwPageSize;
+#else
+	return (size_t)sysconf( _SC_PAGESIZE );
+#endif
+}
+
+static size_t stack_bytes( const muse_stack *s )
+{
+	return s->size * sizeof(muse_cell);
+}
+
+/**
+ * The class of stacks of the given number of pages,
+ * which is a power of two.
+ */
+static int stack_class( size_t pages )
+{
+	int k = 0;
+	while ( ((size_t)1 << k) < pages )
+		++k;
+	return k;
+}
+
+static muse_cstack_class_t *class_of( muse_env *env, int k )
+{
+	return k < MUSE_CSTACK_CLASSES ? env->cstacks.classes + k : &env->cstacks.oversized;
+}
+
+static unsigned char *map_stack( size_t bytes, size_t guard )
+{
+#ifdef MUSE_PLATFORM_WINDOWS
+	DWORD old;
+	unsigned char *base = (unsigned char*)VirtualAlloc( NULL, guard + bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+	if ( base == NULL )
+		return NULL;
+	VirtualProtect( base, guard, PAGE_NOACCESS, &old );
+#else
+	unsigned char *base = (unsigned char*)mmap( NULL, guard + bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if ( base == (unsigned char*)MAP_FAILED )
+		return NULL;
+	mprotect( base, guard, PROT_NONE );
+#endif
+	return base + guard;
+}
+
+static void unmap_stack( unsigned char *bottom, size_t bytes, size_t guard )
+{
+#ifdef MUSE_PLATFORM_WINDOWS
+	VirtualFree( bottom - guard, 0, MEM_RELEASE );
+#else
+	munmap( bottom - guard, guard + bytes );
+#endif
+}
+
+/**
+ * Zeroes the given used part of a stack, giving back to
+ * the system what lies below the pages that are kept.
+ */
+static void wipe_stack( unsigned char *bottom, size_t bytes, size_t used, size_t page )
+{
+	size_t keep = MUSE_CSTACK_KEEP_PAGES * page;
+	unsigned char *end = bottom + bytes;
+
+	if ( keep > bytes )
+		keep = bytes;
+
+	if ( used <= keep )
+	{
+		memset( end - used, 0, used );
+		return;
+	}
+
+	memset( end - keep, 0, keep );
+
+	{
+		/* The pages below those kept are replaced by fresh zero pages. */
+		size_t release = (used - keep + page - 1) / page * page;
+		unsigned char *from = end - keep - release;
+
+#ifdef MUSE_PLATFORM_WINDOWS
+		memset( from, 0, release );
+#else
+		if ( mmap( from, release, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 ) == MAP_FAILED )
+			memset( from, 0, release );
+#endif
+	}
+}
+
+/**
+ * Returns the size in cells of the stacks of class \p k.
+ */
+int muse_cstack_class_cells( int k )
+{
+	return (int)((((size_t)1 << k) * page_size()) / sizeof(muse_cell));
+}
+
+/**
+ * Gives the stack a C stack of at least \p size cells, with
+ * \p size being rounded up to the next power of two pages.
+ * s->top is left for the caller to set. Returns MUSE_FALSE
+ * if the system has no memory left to map.
+ */
+muse_boolean muse_alloc_cstack( muse_env *env, muse_stack *s, int size )
+{
+	size_t page = page_size();
+	size_t pages = ((size_t)size * sizeof(muse_cell) + page - 1) / page;
+	int k = stack_class( pages > 0 ? pages : 1 );
+	size_t bytes = ((size_t)1 << k) * page;
+	muse_cstack_class_t *c = class_of( env, k );
+
+	if ( c->num_free > 0 )
+		s->bottom = (muse_cell*)c->free[--c->num_free];
+	else
+	{
+		s->bottom = (muse_cell*)map_stack( bytes, page );
+		if ( s->bottom == NULL )
+			return MUSE_FALSE;
+		++c->count;
+	}
+
+	s->size = (int)(bytes / sizeof(muse_cell));
+	s->top = s->bottom;
+	++c->spawned;
+	return MUSE_TRUE;
+}
+
+/**
+ * Returns the number of cells of the C stack that have been used,
+ * as found by the lowest word that isn't zero.
+ */
+int muse_cstack_used( muse_env *env, const muse_stack *s )
+{
+	const muse_cell *c = s->bottom, *end = s->bottom + s->size;
+
+#ifndef MUSE_PLATFORM_WINDOWS
+	{
+		/* Skip the pages that have never been touched. */
+		size_t page = page_size();
+		size_t pages = stack_bytes(s) / page;
+		unsigned char vec[256];
+		size_t i = 0;
+
+		while ( i < pages )
+		{
+			size_t n = pages - i < sizeof(vec) ? pages - i : sizeof(vec);
+			size_t j;
+
+			if ( mincore( (void*)((unsigned char*)s->bottom + i * page), n * page, (void*)vec ) != 0 )
+				break;
+
+			for ( j = 0; j < n && !(vec[j] & 1); ++j )
+				;
+
+			i += j;
+			if ( j < n )
+				break;
+		}
+
+		c = (const muse_cell*)((const unsigned char*)s->bottom + i * page);
+	}
+#endif
+
+	while ( c < end && *c == 0 )
+		++c;
+
+	return (int)(end - c);
+}
+
+/**
+ * Returns the C stack to the pool, or to the system if the pool
+ * of its size is full.
+ */
+void muse_release_cstack( muse_env *env, muse_stack *s )
+{
+	size_t page = page_size();
+	size_t bytes = stack_bytes(s);
+	int k = stack_class( bytes / page );
+	muse_cstack_class_t *c = class_of( env, k );
+	int used = muse_cstack_used( env, s );
+
+	if ( used > c->high_water )
+		c->high_water = used;
+
+	if ( k < MUSE_CSTACK_CLASSES && c->num_free < MUSE_CSTACK_POOL_LIMIT )
+	{
+		wipe_stack( (unsigned char*)s->bottom, bytes, used * sizeof(muse_cell), page );
+		c->free[c->num_free++] = s->bottom;
+	}
+	else
+	{
+		unmap_stack( (unsigned char*)s->bottom, bytes, page );
+		--c->count;
+	}
+
+	s->bottom = s->top = NULL;
+	s->size = 0;
+}
+
+/**
+ * Takes the C stack away from a process that has exited but is still
+ * running on it. It is released by muse_release_retired_cstack() once
+ * the switch to another process is done.
+ */
+void muse_retire_cstack( muse_env *env, muse_stack *s )
+{
+	muse_release_retired_cstack( env );
+	env->cstacks.retired = *s;
+	s->bottom = s->top = NULL;
+	s->size = 0;
+}
+
+void muse_release_retired_cstack( muse_env *env )
+{
+	if ( env->cstacks.retired.size > 0 )
+		muse_release_cstack( env, &env->cstacks.retired );
+}
+
+/**
+ * Gives all pooled stacks back to the system.
+ */
+void muse_destroy_cstacks( muse_env *env )
+{
+	size_t page = page_size();
+	int k;
+
+	muse_release_retired_cstack( env );
+
+	for ( k = 0; k < MUSE_CSTACK_CLASSES; ++k )
+	{
+		muse_cstack_class_t *c = env->cstacks.classes + k;
+
+		while ( c->num_free > 0 )
+		{
+			unmap_stack( (unsigned char*)c->free[--c->num_free], ((size_t)1 << k) * page, page );
+			--c->count;
+		}
+	}
+}
@@ -127,6 +127,85 @@ muse_cell muse_apply_nativefn( muse_env *env, muse_cell fn, muse_cell args )
 	return f->fn( env, f->context, args );
 }
 
+/**
+ * Calls a native function made by muse_mk_argv_nativefn() with the given
+ * arguments, which are evaluated (or just copied, if \p args_already_evaluated)
+ * into consecutive slots reserved on the stack. The slots keep the
+ * arguments alive while the rest are evaluated and the function runs.
+ *
+ * An argument list of the form (a b . c) is evaluated as muse_eval_list()
+ * would, and the function gets the elements of the resulting list.
+ */
+static muse_cell apply_argv_nativefn( muse_env *env, const muse_argv_nativefn_info_t *info, muse_cell args, muse_boolean args_already_evaluated )
+{
+	int sp = _spos();
+	int argc = 0, i;
+	muse_cell *argv, a, result;
+
+	for ( a = args; a && _cellt(a) == MUSE_CONS_CELL; a = muse_tail(env,a) )
+		++argc;
+
+	if ( a && !args_already_evaluated )
+	{
+		args = muse_eval_list( env, args );
+		args_already_evaluated = MUSE_TRUE;
+
+		for ( argc = 0, a = args; a && _cellt(a) == MUSE_CONS_CELL; a = muse_tail(env,a) )
+			++argc;
+	}
+
+	if ( argc > (_stack()->size - _spos()) / 4 )
+	{
+		/* Too many to fit on the stack with room to spare for the
+		function itself. The list keeps the arguments alive instead. */
+		if ( !args_already_evaluated )
+			args = muse_eval_list( env, args );
+		else
+			_spush(args);
+
+		/* The array is a bytes object so that it goes away with the
+		garbage even if the function raises an error. */
+		argv = (muse_cell*)muse_bytes_data( env, muse_mk_bytes( env, sizeof(muse_cell) * (argc > 0 ? argc : 1) ), 0 );
+		for ( i = 0, a = args; i < argc; ++i )
+			argv[i] = _quq(_next(&a));
+
+		result = info->fn( env, info->context, argc, argv );
+		_unwind(sp);
+		_spush(result);
+		return result;
+	}
+
+	argv = _stack()->top;
+	for ( i = 0; i < argc; ++i )
+		argv[i] = MUSE_NIL;
+	_stack()->top += argc;
+
+	{
+		int argsp = _spos();
+
+		for ( i = 0; i < argc; ++i )
+		{
+			argv[i] = args_already_evaluated ? _quq(_next(&args)) : _evalnext(&args);
+			_unwind(argsp);
+		}
+	}
+
+	result = info->fn( env, info->context, argc, argv );
+	_unwind(sp);
+	_spush(result);
+	return result;
+}
+
+/**
+ * The muse_nativefn_t of all native functions made by muse_mk_argv_nativefn().
+ * It is only called directly by C code that has an argument list -
+ * muse_apply() passes the arguments in an array itself.
+ */
+muse_cell muse_argv_nativefn_adapter( muse_env *env, void *context, muse_cell args )
+{
+	return apply_argv_nativefn( env, (const muse_argv_nativefn_info_t*)context, args, MUSE_FALSE );
+}
+
 /**
  * Binds the symbols in the given formals list to
  * the corresponding values in the args list.
@@ -293,6 +372,9 @@ muse_cell muse_apply_lambda( muse_env *env, muse_cell fn, muse_cell args )
 	the arguments must not be evaluated - i.e. the function is
 	a syntax transformer. */
 	muse_cell formals = _quq(_head(fn));
+
+	/* The body may have been compiled by syntax_lambda. */
+	muse_cell code = muse_compiled_code( env, fn );
 	
 	/* Keep a tab on the current state of the binding stack so 
 	that we can revert to this point after we're done with the
@@ -303,12 +385,37 @@ muse_cell muse_apply_lambda( muse_env *env, muse_cell fn, muse_cell args )
 	if ( trace ) muse_trace_push( env, NULL, fn, args );
 
 	/* Bind all formal parameters. If binding failed, return MUSE_NIL. */
-	if ( muse_bind_formals( env, formals, args ) )
+	if ( code ? muse_bind_compiled_formals( env, code, formals, args ) : muse_bind_formals( env, formals, args ) )
 	{
+		int profile_depth = env->profile_calls ? muse_profile_enter( env, fn ) : -1;
+
+		if ( !muse_compiled_code_uses_recent( env, code ) )
+		{
+			/* The body never refers to recent values or "it", so
+			it only has to be kept from disturbing the caller's. */
+			muse_push_quiet_recent_scope(env);
+			env->recent_stats.unscoped_calls++;
+
+			/* The "it" binding is still pushed because it also marks
+			the bindings stack as non-empty, which is how define tells
+			a local definition from a global one in functions that
+			take no arguments. */
+			_pushdef( _builtin_symbol(MUSE_IT), _builtin_symbol(MUSE_IT) );
+
+			{
+				muse_cell result = muse_run_compiled_code( env, code );
+				_unwind_bindings(bsp);
+				if ( trace ) muse_trace_pop(env);
+				if ( profile_depth >= 0 ) muse_profile_leave( env, profile_depth );
+				return muse_pop_quiet_recent_scope( env, fn, result );
+			}
+		}
+
 		/* Create a new scope for the "recent items" list so that
 		the \ref fn_the "the" references created within th function
 		don't affect the caller's context. */
 		muse_push_recent_scope(env);
+		env->recent_stats.scoped_calls++;
 
 		/* Undefine the "it" symbol so that \ref fn_the "the"
 		expressions within the function can affect "it" locally. */
@@ -317,12 +424,13 @@ muse_cell muse_apply_lambda( muse_env *env, muse_cell fn, muse_cell args )
 		{
 			/*	Evaluate the body. 
 				Only "result" will remain on the stack. */
-			muse_cell result = _do( _tail(_tail(fn)) );
+			muse_cell result = code ? muse_run_compiled_code( env, code ) : _do( _tail(_tail(fn)) );
 		
 			/* Restore the save bindings. */
 			_unwind_bindings(bsp);
 			
 			if ( trace ) muse_trace_pop(env);
+			if ( profile_depth >= 0 ) muse_profile_leave( env, profile_depth );
 			return muse_pop_recent_scope( env, fn, result );
 		}
 	}
@@ -403,6 +511,9 @@ MUSEAPI muse_cell muse_apply( muse_env *env, muse_cell fn, muse_cell args, muse_
 	/* Check whether we've devoted enough attention to this process. */
 	yield_process(env,1);
 
+	if ( env->profile_sample_due )
+		muse_profile_sample( env, fn );
+
 	{
 		int sp = _spos();
 		muse_cell result = fn;
@@ -413,7 +524,13 @@ MUSEAPI muse_cell muse_apply( muse_env *env, muse_cell fn, muse_cell args, muse_
 		{
 			case MUSE_NATIVEFN_CELL		:
 				{
-					if ( args_already_evaluated )
+					const muse_argv_nativefn_info_t *info = _argvfninfo(fn);
+
+					if ( info )
+					{
+						result = apply_argv_nativefn( env, info, args, args_already_evaluated );
+					}
+					else if ( args_already_evaluated )
 					{
 						result = muse_apply_nativefn( env, fn, quick_quote_list(env, args) );
 						quick_unquote_list(env, args);
@@ -507,6 +624,19 @@ MUSEAPI muse_cell muse_do( muse_env *env, muse_cell block )
 }
 
 
+/**
+ * Returns MUSE_FALSE if the function applied to force a lazy cell
+ * is a closure that can't refer to recent values, so that forcing
+ * it needs no scope of its own.
+ */
+static muse_boolean force_needs_recent_scope( muse_env *env, muse_cell h )
+{
+	if ( h > 0 && _cellt(h) == MUSE_LAMBDA_CELL )
+		return muse_compiled_code_uses_recent( env, muse_compiled_code( env, h ) );
+	else
+		return MUSE_TRUE;
+}
+
 /**
  * Forces evaluation of a lazy cell.
  */
@@ -520,14 +650,30 @@ MUSEAPI muse_cell muse_force( muse_env *env, muse_cell cell )
 	if ( cell > 0 && _cellt(cell) == MUSE_LAZY_CELL ) {
 
 		muse_cell value = cell;
+		muse_boolean quiet = !force_needs_recent_scope( env, _head(cell) );
 
-		muse_push_recent_scope(env);
+		if ( quiet )
+			muse_push_quiet_recent_scope(env);
+		else
+			muse_push_recent_scope(env);
 
 		do {
+			/* The cell is kept on the stack since muse_apply() can 
+			switch processes, and so collect garbage, before it 
+			protects the function and arguments. */
 			_unwind(sp);
+			_spush(cell);
 
 			{
 				muse_cell h = _head(cell);
+
+				/* A lazy tail can produce another lazy value that needs
+				a proper scope to be forced in. */
+				if ( quiet && N > 0 && force_needs_recent_scope( env, h ) ) {
+					muse_pop_quiet_recent_scope( env, 0, MUSE_NIL );
+					muse_push_recent_scope(env);
+					quiet = MUSE_FALSE;
+				}
 				
 				if ( h )
 					/* When the head of a lazy cell is not MUSE_NIL, it should
@@ -544,7 +690,13 @@ MUSEAPI muse_cell muse_force( muse_env *env, muse_cell cell )
 
 		} while ( cell > 0 && _cellt(cell) == MUSE_LAZY_CELL );
 
-		muse_pop_recent_scope( env, MUSE_NIL, MUSE_NIL );
+		if ( quiet ) {
+			muse_pop_quiet_recent_scope( env, MUSE_NIL, MUSE_NIL );
+			env->recent_stats.unscoped_forces++;
+		} else {
+			muse_pop_recent_scope( env, MUSE_NIL, MUSE_NIL );
+			env->recent_stats.scoped_forces++;
+		}
 
 		{
 			recent_entry_t *e = muse_find_recent_lazy_item(env);
@@ -0,0 +1,2333 @@
+/**
+ * @file muse_image.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Pre-parsed code images. \ref fn_compile_file "compile-file" reads source
+ * code as \ref fn_load "load" would and writes out what it reads in a compact
+ * binary form, which load turns back into expressions in a single pass
+ * without going through the parser. An image is -
+ *	- the bytes of k_image_magic,
+ *	- the top level expressions one after another,
+ *	- and an IMAGE_END tag.
+ *
+ * Each expression starts with a tag byte. Counts, lengths and indices are
+ * unsigned LEB128 numbers and integers are zigzag encoded ones. Floats are
+ * the 8 bytes of the double, least significant first. Texts and symbol
+ * names are length-prefixed UTF-8. A symbol's name is given only the first
+ * time the symbol appears. After that, it is referred to by the order in
+ * which it first appeared. A list is the number of its elements followed
+ * by the elements and by what its last pair ends with, which is () for
+ * a proper list. Vectors and hashtables, which brace expressions read
+ * into, are given by what is in them. The native functions that macros
+ * expand into are given by the symbols whose values they are.
+ */
+
+#include "muse_builtins.h"
+#include "muse_port.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef MUSE_PLATFORM_WINDOWS
+#	include <direct.h>
+#	include <process.h>
+#	include <sys/stat.h>
+#else
+#	include <unistd.h>
+#	include <sys/stat.h>
+#endif
+
+enum
+{
+	IMAGE_END,
+	IMAGE_NIL,
+	IMAGE_INT,
+	IMAGE_FLOAT,
+	IMAGE_TEXT,
+	IMAGE_SYMBOL,		/**< A symbol appearing for the first time, with its name. */
+	IMAGE_SYMBOL_REF,	/**< The index of a symbol that has appeared before. */
+	IMAGE_LIST,
+	IMAGE_BYTES,
+
+	/* Only in snapshots. */
+	SNAPSHOT_PAIR,			/**< A cons or lambda cell, given by its type, head and tail. */
+	SNAPSHOT_CLOSURE,		/**< A compiled closure, given by its formals, meta object and source code. */
+	SNAPSHOT_ANON_SYMBOL,	/**< An anonymous symbol, given by its plist. */
+	SNAPSHOT_OBJECT,		/**< An object, given by its supers and its plist. */
+	SNAPSHOT_VECTOR,		/**< The length of a vector followed by its elements. */
+	SNAPSHOT_HASHTABLE,		/**< A hashtable, given by the alist of its contents. */
+	SNAPSHOT_MODULE,		/**< A module, given by its main function followed by the alist of its exports. */
+	SNAPSHOT_BASE,			/**< The recorded value of a symbol, see muse_snapshot_base(). */
+
+	/* Only in images. */
+	IMAGE_VECTOR,			/**< The length of a vector followed by its elements. */
+	IMAGE_HASHTABLE,		/**< The number of entries in a hashtable followed by each key and its value. */
+	IMAGE_PRIM				/**< A native function, given by the symbol whose value it is. */
+};
+
+typedef unsigned long long image_uint_t;
+
+/** The first 7 bytes identify an image and the last gives its version. */
+static const unsigned char k_image_magic[8] = { 0, 'm', 'u', 'S', 'E', 'i', 'm', 1 };
+static const unsigned char k_snapshot_magic[8] = { 0, 'm', 'u', 'S', 'E', 's', 'n', 1 };
+
+/** An open addressed map from cells to non-negative ints. */
+typedef struct
+{
+	muse_cell *keys;
+	int *values;
+	int capacity, count;
+} cell_map_t;
+
+typedef struct
+{
+	muse_env *env;
+	muse_port_t port;
+	cell_map_t symbols;	/**< The symbols seen so far and their indices. */
+	cell_map_t prims;	/**< The symbols found for native functions, see prim_symbol(). */
+	char *scratch;
+	size_t scratch_size;
+} image_writer_t;
+
+typedef struct
+{
+	muse_env *env;
+	muse_port_t port;
+
+	/**
+	 * The bytes in the port's buffer being read, which are taken
+	 * out of the port only by reader_sync(). This saves going
+	 * through port_getc() for each byte.
+	 */
+	/*@{*/
+	const unsigned char *start, *next, *end;
+	/*@}*/
+
+	muse_cell *symbols;	/**< By the order in which they appeared. */
+	int capacity, count;
+	char *scratch;
+	size_t scratch_size;
+	muse_boolean bad;
+} image_reader_t;
+
+typedef struct _muse_image_source_t image_source_t;
+
+static char *scratch_space( char **scratch, size_t *scratch_size, size_t size )
+{
+	if ( size > *scratch_size )
+	{
+		*scratch_size = size > 2 * (*scratch_size) ? size : 2 * (*scratch_size);
+		*scratch = (char*)realloc( *scratch, *scratch_size );
+	}
+
+	return *scratch;
+}
+
+/** @name Writing images */
+/*@{*/
+static void write_uint( image_writer_t *w, image_uint_t n )
+{
+	unsigned char b[10];
+	int i = 0;
+
+	do
+	{
+		b[i] = (unsigned char)(n & 0x7F);
+		n >>= 7;
+		if ( n )
+			b[i] |= 0x80;
+		++i;
+	}
+	while ( n );
+
+	port_write( b, i, w->port );
+}
+
+static void write_tag( image_writer_t *w, int tag )
+{
+	unsigned char b = (unsigned char)tag;
+	port_write( &b, 1, w->port );
+}
+
+static void write_utf8( image_writer_t *w, const muse_char *s, int len )
+{
+	size_t size = muse_utf8_size( s, len );
+	char *utf8 = scratch_space( &w->scratch, &w->scratch_size, size + 1 );
+
+	size = muse_unicode_to_utf8( utf8, size + 1, s, len );
+	write_uint( w, size );
+	port_write( utf8, size, w->port );
+}
+
+static int cell_slot( muse_cell c, int capacity )
+{
+	return (int)(((unsigned int)c * 2654435761u) & (unsigned int)(capacity - 1));
+}
+
+/** Returns the value of the cell in the map, or -1 if it isn't there. */
+static int cell_map_find( const cell_map_t *m, muse_cell c )
+{
+	int i;
+
+	if ( m->capacity == 0 )
+		return -1;
+
+	for ( i = cell_slot( c, m->capacity ); m->keys[i]; i = (i + 1) & (m->capacity - 1) )
+	{
+		if ( m->keys[i] == c )
+			return m->values[i];
+	}
+
+	return -1;
+}
+
+/**
+ * Returns where the value of the cell is kept in the map, adding the
+ * cell with the value -1 if it isn't there. The pointer is good only
+ * until the next cell is added.
+ */
+static int *cell_map_slot( cell_map_t *m, muse_cell c )
+{
+	int i;
+
+	if ( (m->count + 1) * 2 > m->capacity )
+	{
+		muse_cell *keys = m->keys;
+		int *values = m->values;
+		int capacity = m->capacity, j;
+
+		m->capacity	= capacity ? 2 * capacity : 256;
+		m->keys		= (muse_cell*)calloc( m->capacity, sizeof(muse_cell) );
+		m->values	= (int*)malloc( m->capacity * sizeof(int) );
+
+		for ( j = 0; j < capacity; ++j )
+		{
+			if ( keys[j] )
+			{
+				for ( i = cell_slot( keys[j], m->capacity ); m->keys[i]; i = (i + 1) & (m->capacity - 1) )
+					;
+				m->keys[i] = keys[j];
+				m->values[i] = values[j];
+			}
+		}
+
+		free(keys);
+		free(values);
+	}
+
+	for ( i = cell_slot( c, m->capacity ); m->keys[i]; i = (i + 1) & (m->capacity - 1) )
+	{
+		if ( m->keys[i] == c )
+			return m->values + i;
+	}
+
+	m->keys[i] = c;
+	m->values[i] = -1;
+	++m->count;
+	return m->values + i;
+}
+
+static void cell_map_free( cell_map_t *m )
+{
+	free( m->keys );
+	free( m->values );
+}
+
+/**
+ * Returns the index of the symbol if it has been written before.
+ * Otherwise gives it the next index and returns -1.
+ */
+static int symbol_index( image_writer_t *w, muse_cell sym )
+{
+	int *ix = cell_map_slot( &w->symbols, sym );
+
+	if ( *ix >= 0 )
+		return *ix;
+
+	*ix = w->symbols.count - 1;
+	return -1;
+}
+
+/**
+ * Returns the symbol whose value is the native function, or () if
+ * there isn't one. Macros expand into the same few functions over
+ * and over, so what muse_symbol_with_value() finds is kept.
+ */
+static muse_cell prim_symbol( image_writer_t *w, muse_cell prim )
+{
+	int *sym = cell_map_slot( &w->prims, prim );
+
+	if ( *sym < 0 )
+		*sym = muse_symbol_with_value( w->env, prim );
+
+	return *sym;
+}
+
+static void write_expr( image_writer_t *w, muse_cell expr )
+{
+	muse_env *env = w->env;
+
+	if ( expr == MUSE_NIL )
+	{
+		write_tag( w, IMAGE_NIL );
+		return;
+	}
+
+	switch ( _cellt(expr) )
+	{
+	case MUSE_INT_CELL:
+		{
+			muse_int i = _ptr(expr)->i;
+			write_tag( w, IMAGE_INT );
+			write_uint( w, ((image_uint_t)i << 1) ^ (image_uint_t)(i >> 63) );
+		}
+		break;
+
+	case MUSE_FLOAT_CELL:
+		{
+			muse_float f = _ptr(expr)->f;
+			image_uint_t bits;
+			unsigned char b[8];
+			int i;
+
+			memcpy( &bits, &f, sizeof(bits) );
+			for ( i = 0; i < 8; ++i, bits >>= 8 )
+				b[i] = (unsigned char)(bits & 0xFF);
+
+			write_tag( w, IMAGE_FLOAT );
+			port_write( b, 8, w->port );
+		}
+		break;
+
+	case MUSE_TEXT_CELL:
+		{
+			int len = 0;
+			const muse_char *s = muse_text_contents( env, expr, &len );
+			write_tag( w, IMAGE_TEXT );
+			write_utf8( w, s, len );
+		}
+		break;
+
+	case MUSE_SYMBOL_CELL:
+		{
+			int ix = symbol_index( w, expr );
+
+			if ( ix >= 0 )
+			{
+				write_tag( w, IMAGE_SYMBOL_REF );
+				write_uint( w, ix );
+			}
+			else
+			{
+				const muse_char *name = muse_symbol_name( env, expr );
+				write_tag( w, IMAGE_SYMBOL );
+				write_utf8( w, name, (int)wcslen(name) );
+			}
+		}
+		break;
+
+	case MUSE_CONS_CELL:
+		{
+			muse_cell c = expr;
+			int n = 0;
+
+			while ( c && _cellt(c) == MUSE_CONS_CELL )
+			{
+				++n;
+				c = _tail(c);
+			}
+
+			write_tag( w, IMAGE_LIST );
+			write_uint( w, n );
+
+			for ( c = expr; n > 0; --n, c = _tail(c) )
+				write_expr( w, _head(c) );
+
+			write_expr( w, c );
+		}
+		break;
+
+	case MUSE_NATIVEFN_CELL:
+		if ( !muse_functional_object_data( env, expr, 0 ) && prim_symbol( w, expr ) )
+		{
+			write_tag( w, IMAGE_PRIM );
+			write_expr( w, prim_symbol( w, expr ) );
+			break;
+		}
+		/* Fall through. */
+
+	default:
+		if ( muse_functional_object_data( env, expr, 'barr' ) )
+		{
+			size_t size = muse_bytes_size( env, expr );
+			write_tag( w, IMAGE_BYTES );
+			write_uint( w, size );
+			port_write( muse_bytes_data( env, expr, 0 ), size, w->port );
+		}
+		else if ( muse_functional_object_data( env, expr, 'vect' ) )
+		{
+			int i, length = muse_vector_length( env, expr );
+
+			write_tag( w, IMAGE_VECTOR );
+			write_uint( w, length );
+
+			for ( i = 0; i < length; ++i )
+				write_expr( w, muse_vector_get( env, expr, i ) );
+		}
+		else if ( muse_functional_object_data( env, expr, 'hash' ) )
+		{
+			int sp = _spos();
+			muse_cell alist = _spush( fn_hashtable_to_alist( env, NULL, _cons( expr, MUSE_NIL ) ) );
+			muse_cell c;
+			int n = 0;
+
+			for ( c = alist; c; c = _tail(c) )
+				++n;
+
+			write_tag( w, IMAGE_HASHTABLE );
+			write_uint( w, n );
+
+			for ( ; alist; alist = _tail(alist) )
+			{
+				write_expr( w, _head(_head(alist)) );
+				write_expr( w, _tail(_head(alist)) );
+			}
+
+			_unwind(sp);
+		}
+		else
+		{
+			/* Functions, objects and the like that were made by
+			expressions evaluated while reading. */
+			muse_cell value = muse_raise_error( env, _csymbol(L"error:not-compilable"), _cons(expr,MUSE_NIL) );
+			write_expr( w, value == expr ? MUSE_NIL : value );
+		}
+	}
+}
+
+/**
+ * Returns MUSE_TRUE if write_expr() can write out the expression
+ * without having to raise error:not-compilable.
+ */
+static muse_boolean is_imageable( image_writer_t *w, muse_cell expr )
+{
+	muse_env *env = w->env;
+
+	while ( expr )
+	{
+		switch ( _cellt(expr) )
+		{
+		case MUSE_INT_CELL:
+		case MUSE_FLOAT_CELL:
+		case MUSE_TEXT_CELL:
+		case MUSE_SYMBOL_CELL:
+			return MUSE_TRUE;
+
+		case MUSE_CONS_CELL:
+			if ( !is_imageable( w, _head(expr) ) )
+				return MUSE_FALSE;
+			expr = _tail(expr);
+			break;
+
+		case MUSE_NATIVEFN_CELL:
+			if ( !muse_functional_object_data( env, expr, 0 ) && prim_symbol( w, expr ) )
+				return MUSE_TRUE;
+			/* Fall through. */
+
+		default:
+			if ( muse_functional_object_data( env, expr, 'barr' ) )
+				return MUSE_TRUE;
+			else if ( muse_functional_object_data( env, expr, 'vect' ) )
+			{
+				int i, length = muse_vector_length( env, expr );
+
+				for ( i = 0; i < length; ++i )
+				{
+					if ( !is_imageable( w, muse_vector_get( env, expr, i ) ) )
+						return MUSE_FALSE;
+				}
+
+				return MUSE_TRUE;
+			}
+			else if ( muse_functional_object_data( env, expr, 'hash' ) )
+			{
+				int sp = _spos();
+				muse_boolean ok = is_imageable( w, _spush( fn_hashtable_to_alist( env, NULL, _cons( expr, MUSE_NIL ) ) ) );
+				_unwind(sp);
+				return ok;
+			}
+			else
+				return MUSE_FALSE;
+		}
+	}
+
+	return MUSE_TRUE;
+}
+/*@}*/
+
+/** @name Reading images */
+/*@{*/
+
+/**
+ * Takes the bytes read so far out of the port, so that
+ * the port can be read from directly.
+ */
+static void reader_sync( image_reader_t *r )
+{
+	if ( r->next > r->start )
+		port_consume_binary( (int)(r->next - r->start), r->port );
+
+	r->start = r->next = r->end = NULL;
+}
+
+static int read_byte( image_reader_t *r )
+{
+	if ( r->next == r->end )
+	{
+		int avail = 0;
+
+		reader_sync(r);
+		r->start = port_buffered( r->port, &avail );
+
+		if ( avail == 0 && port_buffer_more( r->port ) > 0 )
+			r->start = port_buffered( r->port, &avail );
+
+		r->next = r->start;
+		r->end = r->start + avail;
+
+		if ( avail == 0 )
+			return EOF;
+	}
+
+	return *(r->next++);
+}
+
+static size_t read_bytes( image_reader_t *r, void *buffer, size_t size )
+{
+	reader_sync(r);
+	return port_read( buffer, size, r->port );
+}
+
+static image_uint_t read_uint( image_reader_t *r )
+{
+	image_uint_t n = 0;
+	int shift = 0, c;
+
+	do
+	{
+		c = read_byte(r);
+		if ( c == EOF || shift > 63 )
+		{
+			r->bad = MUSE_TRUE;
+			return 0;
+		}
+
+		n |= (image_uint_t)(c & 0x7F) << shift;
+		shift += 7;
+	}
+	while ( c & 0x80 );
+
+	return n;
+}
+
+/**
+ * Returns the next \p size bytes, which are read into the scratch space
+ * unless they're all in the port's buffer already. They stay valid until
+ * the next read.
+ */
+static const char *read_span( image_reader_t *r, size_t size )
+{
+	if ( r->bad )
+		return NULL;
+
+	if ( (size_t)(r->end - r->next) >= size )
+	{
+		const char *span = (const char*)r->next;
+		r->next += size;
+		return span;
+	}
+
+	scratch_space( &r->scratch, &r->scratch_size, size + 1 );
+
+	if ( read_bytes( r, r->scratch, size ) < size )
+	{
+		r->bad = MUSE_TRUE;
+		return NULL;
+	}
+
+	return r->scratch;
+}
+
+/**
+ * Reads the UTF-8 bytes of a text or symbol name, giving
+ * their number in \p size.
+ */
+static const char *read_utf8( image_reader_t *r, size_t *size )
+{
+	*size = (size_t)read_uint(r);
+	return read_span( r, *size );
+}
+
+static muse_cell read_expr( image_reader_t *r, int tag );
+
+static muse_cell read_list( image_reader_t *r )
+{
+	muse_env *env = r->env;
+	image_uint_t n = read_uint(r);
+	muse_cell h = MUSE_NIL, t = MUSE_NIL;
+	int sp = _spos();
+
+	for ( ; n > 0 && !r->bad; --n )
+	{
+		muse_cell c = _cons( read_expr( r, read_byte(r) ), MUSE_NIL );
+
+		if ( t )
+			_sett( t, c );
+		else
+			h = c;
+
+		t = c;
+		_unwind(sp);
+		_spush(h);
+	}
+
+	{
+		muse_cell end = read_expr( r, read_byte(r) );
+
+		if ( t )
+			_sett( t, end );
+		else
+			h = end;
+	}
+
+	_unwind(sp);
+	return _spush(h);
+}
+
+static muse_cell read_expr( image_reader_t *r, int tag )
+{
+	muse_env *env = r->env;
+
+	if ( r->bad )
+		return MUSE_NIL;
+
+	switch ( tag )
+	{
+	case IMAGE_NIL:
+		return MUSE_NIL;
+
+	case IMAGE_INT:
+		{
+			image_uint_t n = read_uint(r);
+			return _mk_int( (muse_int)(n >> 1) ^ -(muse_int)(n & 1) );
+		}
+
+	case IMAGE_FLOAT:
+		{
+			const unsigned char *b = (const unsigned char*)read_span( r, 8 );
+			image_uint_t bits = 0;
+			muse_float f;
+			int i;
+
+			if ( r->bad )
+				break;
+
+			for ( i = 7; i >= 0; --i )
+				bits = (bits << 8) | b[i];
+
+			memcpy( &f, &bits, sizeof(f) );
+			return _mk_float(f);
+		}
+
+	case IMAGE_TEXT:
+		{
+			size_t size = 0;
+			const char *utf8 = read_utf8( r, &size );
+			return r->bad ? MUSE_NIL : muse_mk_text_utf8( env, utf8, utf8 + size );
+		}
+
+	case IMAGE_SYMBOL:
+		{
+			size_t size = 0;
+			const char *utf8 = read_utf8( r, &size );
+			muse_cell sym;
+
+			if ( r->bad )
+				return MUSE_NIL;
+
+			sym = muse_symbol_utf8( env, utf8, utf8 + size );
+
+			if ( r->count == r->capacity )
+			{
+				r->capacity = r->capacity ? 2 * r->capacity : 256;
+				r->symbols = (muse_cell*)realloc( r->symbols, r->capacity * sizeof(muse_cell) );
+			}
+
+			r->symbols[r->count++] = sym;
+			return sym;
+		}
+
+	case IMAGE_SYMBOL_REF:
+		{
+			image_uint_t ix = read_uint(r);
+
+			if ( r->bad || ix >= (image_uint_t)r->count )
+				break;
+
+			return r->symbols[ix];
+		}
+
+	case IMAGE_LIST:
+		return read_list(r);
+
+	case IMAGE_BYTES:
+		{
+			size_t size = (size_t)read_uint(r);
+			muse_cell b;
+
+			if ( r->bad )
+				return MUSE_NIL;
+
+			b = muse_mk_bytes( env, size );
+			if ( read_bytes( r, muse_bytes_data( env, b, 0 ), size ) < size )
+				break;
+
+			return b;
+		}
+
+	case IMAGE_VECTOR:
+		{
+			image_uint_t length = read_uint(r);
+			int sp = _spos(), i;
+			muse_cell vec;
+
+			if ( r->bad || length > (1 << 28) )
+				break;
+
+			vec = muse_mk_vector( env, (int)length );
+			for ( i = 0; i < (int)length && !r->bad; ++i )
+			{
+				muse_vector_put( env, vec, i, read_expr( r, read_byte(r) ) );
+				_unwind(sp);
+				_spush(vec);
+			}
+
+			_unwind(sp);
+			return _spush(vec);
+		}
+
+	case IMAGE_HASHTABLE:
+		{
+			image_uint_t n = read_uint(r);
+			int sp = _spos();
+			muse_cell ht;
+
+			if ( r->bad || n > (1 << 28) )
+				break;
+
+			ht = muse_mk_hashtable( env, (int)n );
+			for ( ; n > 0 && !r->bad; --n )
+			{
+				muse_cell key = _spush( read_expr( r, read_byte(r) ) );
+				muse_hashtable_put( env, ht, key, read_expr( r, read_byte(r) ) );
+				_unwind(sp);
+				_spush(ht);
+			}
+
+			_unwind(sp);
+			return _spush(ht);
+		}
+
+	case IMAGE_PRIM:
+		{
+			muse_cell sym = read_expr( r, read_byte(r) );
+			muse_cell prim;
+
+			if ( r->bad || _cellt(sym) != MUSE_SYMBOL_CELL )
+				break;
+
+			prim = _symval(sym);
+			if ( _cellt(prim) != MUSE_NATIVEFN_CELL || muse_functional_object_data( env, prim, 0 ) )
+				break;
+
+			return prim;
+		}
+	}
+
+	r->bad = MUSE_TRUE;
+	return MUSE_NIL;
+}
+/*@}*/
+
+/** @name Image sources */
+/*@{*/
+/**
+ * A port that an image is being loaded from, or that what is read from
+ * is being recorded as an image. A \ref fn_module "module" whose body is
+ * the rest of the file reads that body from the port itself, and goes
+ * through muse_read_source() so that it gets the expressions from the
+ * image, or gets them recorded. The sources of a process are stacked up
+ * from muse_process_frame_t::image_source and live on the C stack of the
+ * code doing the loading, except for compile-file's.
+ */
+struct _muse_image_source_t
+{
+	muse_port_t port;
+	image_reader_t *reader;		/**< Set when loading an image from the port. */
+	image_writer_t *writer;		/**< Set when recording what is read from the port. */
+	muse_boolean *ok;			/**< When set, cleared instead of raising error:not-compilable for what can't be recorded. */
+	size_t recorded_pos;		/**< Where the port was after the last expression recorded. */
+	int count;					/**< The number of expressions recorded. */
+	struct _muse_image_source_t *prev;
+};
+
+static void push_source( muse_env *env, image_source_t *s, muse_port_t port )
+{
+	s->port			= port;
+	s->recorded_pos	= port->in.fpos;
+	s->prev			= env->current_process->image_source;
+	env->current_process->image_source = s;
+}
+
+static void pop_source( muse_env *env, image_source_t *s )
+{
+	env->current_process->image_source = s->prev;
+}
+
+static void record_expr( image_source_t *s, muse_cell expr )
+{
+	if ( s->ok == NULL )
+		write_expr( s->writer, expr );
+	else if ( *(s->ok) && is_imageable( s->writer, expr ) )
+		write_expr( s->writer, expr );
+	else
+		*(s->ok) = MUSE_FALSE;
+
+	++s->count;
+	s->recorded_pos = s->port->in.fpos;
+}
+
+/**
+ * Reads the next expression from the port for code that reads the rest
+ * of the port by itself, returning a negative value when there is no more.
+ * If an image is being loaded from the port, the expression comes from
+ * the image, whose end is left for its loader to see. If what is read from
+ * the port is being recorded, the expression is recorded. Otherwise it's
+ * the same as muse_pread().
+ */
+muse_cell muse_read_source( muse_port_t p )
+{
+	muse_env *env = p->env;
+	image_source_t *s = env->current_process->image_source;
+	muse_cell expr;
+
+	while ( s && s->port != p )
+		s = s->prev;
+
+	if ( s && s->reader )
+	{
+		image_reader_t *r = s->reader;
+		int tag = read_byte(r);
+
+		if ( tag == IMAGE_END )
+		{
+			--r->next;
+			return -1;
+		}
+
+		expr = read_expr( r, tag );
+		reader_sync(r);
+		return r->bad ? -1 : expr;
+	}
+
+	if ( port_eof(p) )
+		return -1;
+
+	expr = muse_pread(p);
+
+	if ( s && expr >= 0 )
+		record_expr( s, expr );
+	else if ( s )
+		s->recorded_pos = p->in.fpos;	/* Past trailing space and comments. */
+
+	return expr;
+}
+/*@}*/
+
+static muse_boolean port_starts_with( muse_port_t p, const unsigned char magic[8] )
+{
+	int avail = 0;
+	const unsigned char *b = port_buffered( p, &avail );
+
+	while ( avail < 8 && memcmp( b, magic, avail ) == 0 && port_buffer_more(p) > 0 )
+		b = port_buffered( p, &avail );
+
+	return (avail >= 8 && memcmp( b, magic, 8 ) == 0) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/**
+ * Returns MUSE_TRUE if what is next in the port is an image. Only as
+ * much is read in as it takes to tell, and nothing is consumed.
+ */
+muse_boolean muse_is_image_port( muse_port_t p )
+{
+	return port_starts_with( p, k_image_magic );
+}
+
+/**
+ * Evaluates the expressions in the image that the port starts with, one
+ * by one as they're read, just as muse_pload() does for source code.
+ * Returns the result of the last one. If the image is cut short or
+ * damaged, it stops there and raises error:bad-image with the position
+ * in the port.
+ */
+muse_cell muse_load_image( muse_port_t p )
+{
+	muse_env *env = p->env;
+	int sp = _spos();
+	muse_cell result = MUSE_NIL;
+	muse_port_t prevIn = muse_current_port( env, MUSE_INPUT_PORT, p );
+	image_reader_t r;
+	image_source_t source;
+	int tag;
+
+	memset( &r, 0, sizeof(r) );
+	r.env	= env;
+	r.port	= p;
+
+	port_consume( sizeof(k_image_magic), p );
+
+	memset( &source, 0, sizeof(source) );
+	source.reader = &r;
+	push_source( env, &source, p );
+
+	while ( (tag = read_byte(&r)) != IMAGE_END )
+	{
+		muse_cell expr = read_expr( &r, tag );
+
+		if ( r.bad )
+			break;
+
+		/* The expression may read from the port itself. */
+		reader_sync( &r );
+		_unwind(sp);
+		_spush(expr);
+		result = _eval(expr);
+		_unwind(sp);
+		_spush(result);
+	}
+
+	reader_sync( &r );
+	pop_source( env, &source );
+	free( r.symbols );
+	free( r.scratch );
+	muse_current_port( env, MUSE_INPUT_PORT, prevIn );
+
+	if ( r.bad )
+	{
+		_unwind(sp);
+		return muse_raise_error( env, _csymbol(L"error:bad-image"), _cons( _mk_int( (muse_int)p->in.fpos ), MUSE_NIL ) );
+	}
+
+	return result;
+}
+
+/** 
+ * Operations on files given muse_char paths, for writing images 
+ * and the module cache. 
+ */
+/*@{*/
+#ifdef MUSE_PLATFORM_WINDOWS
+static int path_mkdir( const muse_char *path )					{ return _wmkdir( path ); }
+static int path_remove( const muse_char *path )					{ return _wremove( path ); }
+static int path_rename( const muse_char *from, const muse_char *to )	{ _wremove( to ); return _wrename( from, to ); }
+#else
+static char *path_narrow( const muse_char *path )
+{
+	size_t len = wcslen(path), size = muse_utf8_size( path, len ) + 1;
+	char *narrow = (char*)malloc( size );
+	narrow[muse_unicode_to_utf8( narrow, size, path, len )] = '\0';
+	return narrow;
+}
+
+static int path_mkdir( const muse_char *path )
+{
+	char *p = path_narrow(path);
+	int result = mkdir( p, 0755 );
+	free(p);
+	return result;
+}
+
+static int path_remove( const muse_char *path )
+{
+	char *p = path_narrow(path);
+	int result = unlink(p);
+	free(p);
+	return result;
+}
+
+static int path_rename( const muse_char *from, const muse_char *to )
+{
+	char *f = path_narrow(from), *t = path_narrow(to);
+	int result = rename( f, t );
+	free(f);
+	free(t);
+	return result;
+}
+#endif
+
+/**
+ * Returns the malloc()ed path of the file to write in place of the
+ * given one, which is renamed to it once complete, so that nothing
+ * ever sees a file that is only partly written.
+ */
+static muse_char *part_path( const muse_char *path )
+{
+	size_t len = wcslen(path) + 16;
+	muse_char *part = (muse_char*)malloc( len * sizeof(muse_char) );
+#ifdef MUSE_PLATFORM_WINDOWS
+	swprintf( part, len, L"%ls.%d", path, _getpid() );
+#else
+	swprintf( part, len, L"%ls.%d", path, (int)getpid() );
+#endif
+	return part;
+}
+/*@}*/
+
+/**
+ * Creates the named file to write an image or a snapshot to, raising
+ * error:open-file until it can be created. If \p path isn't NULL, the
+ * file created is the part_path() of the name instead, and the name's
+ * path is returned in \p path, malloc()ed, for renaming it to.
+ */
+static muse_port_t open_image_file( muse_env *env, muse_cell name, FILE **file, muse_char **path )
+{
+	muse_port_t out;
+
+	while ( *file == NULL )
+	{
+		if ( _cellt(name) == MUSE_TEXT_CELL )
+		{
+			if ( path )
+			{
+				muse_char *part = part_path( _text_contents(name,NULL) );
+				*file = muse_fopen( part, L"wb" );
+				free(part);
+
+				if ( *file )
+				{
+					*path = (muse_char*)malloc( (wcslen( _text_contents(name,NULL) ) + 1) * sizeof(muse_char) );
+					wcscpy( *path, _text_contents(name,NULL) );
+				}
+			}
+			else
+				*file = muse_fopen( _text_contents(name,NULL), L"wb" );
+		}
+
+		if ( *file == NULL )
+			name = muse_raise_error( env, _csymbol(L"error:open-file"), _cons( name, MUSE_NIL ) );
+	}
+
+	/* The port is made a writer only after it is assigned,
+	so that it doesn't start the file with a UTF-8 header. */
+	out = muse_assign_port( env, *file, 0 );
+	out->mode |= MUSE_PORT_WRITE;
+	return out;
+}
+
+/**
+ * Returns MUSE_TRUE if the expression makes a macro somewhere in it,
+ * that is, a function whose formals are quoted.
+ */
+static muse_boolean makes_macro( muse_env *env, muse_cell expr )
+{
+	muse_cell sym_fn = _csymbol(L"fn");
+
+	for ( ; expr && _cellt(expr) == MUSE_CONS_CELL; expr = _tail(expr) )
+	{
+		muse_cell h = _head(expr);
+
+		if ( _isquote(h) )
+			return MUSE_FALSE;
+
+		if ( h == sym_fn && _tail(expr) )
+		{
+			muse_cell formals = _head(_tail(expr));
+			if ( formals && _cellt(formals) == MUSE_CONS_CELL && _isquote(_head(formals)) )
+				return MUSE_TRUE;
+		}
+
+		if ( makes_macro( env, h ) )
+			return MUSE_TRUE;
+	}
+
+	return MUSE_FALSE;
+}
+
+typedef struct
+{
+	muse_cell source, image;
+	muse_boolean eval;
+	FILE *in_file, *out_file;
+	muse_port_t in, out, prevIn;
+	muse_char *path;			/**< Where the image file goes once it's complete. */
+	image_writer_t w;
+	image_source_t recorder;
+	muse_boolean done;
+} compile_file_t;
+
+/**
+ * Called when compile_file() is done or has been escaped from. Puts 
+ * the image file in place if it was completed and removes it if not.
+ */
+static muse_cell compile_file_finalizer( muse_env *env, compile_file_t *c, muse_cell args )
+{
+	if ( c->in )
+	{
+		pop_source( env, &c->recorder );
+		muse_current_port( env, MUSE_INPUT_PORT, c->prevIn );
+		muse_unassign_port( c->in );
+	}
+
+	if ( c->in_file )
+		fclose( c->in_file );
+
+	if ( c->out_file )
+	{
+		muse_char *part = part_path( c->path );
+
+		muse_unassign_port( c->out );
+		if ( fclose( c->out_file ) != 0 || !c->done || path_rename( part, c->path ) != 0 )
+			path_remove( part );
+
+		free( part );
+	}
+
+	cell_map_free( &c->w.symbols );
+	cell_map_free( &c->w.prims );
+	free( c->w.scratch );
+	free( c->path );
+	free( c );
+	return MUSE_NIL;
+}
+
+static muse_cell compile_file( muse_env *env, compile_file_t *c, muse_cell args )
+{
+	muse_add_finalizer_call( env, (muse_nativefn_t)compile_file_finalizer, c );
+
+	while ( c->in_file == NULL )
+	{
+		if ( _cellt(c->source) == MUSE_TEXT_CELL )
+			c->in_file = muse_fopen( _text_contents(c->source,NULL), L"rb" );
+
+		if ( c->in_file == NULL )
+			c->source = _spush( muse_raise_error( env, _csymbol(L"error:load"), _cons( c->source, MUSE_NIL ) ) );
+	}
+
+	{
+		int source_pos = 0;
+		if ( muSEexec_check( c->in_file, &source_pos, NULL, NULL ) )
+			fseek( c->in_file, source_pos, SEEK_SET );
+	}
+
+	c->out = _port(c->image);
+	if ( !c->out )
+		c->out = open_image_file( env, c->image, &c->out_file, &c->path );
+
+	c->w.env	= env;
+	c->w.port	= c->out;
+	port_write( (void*)k_image_magic, sizeof(k_image_magic), c->out );
+
+	c->in = muse_assign_port( env, c->in_file, MUSE_PORT_TRUSTED_INPUT );
+	c->prevIn = muse_current_port( env, MUSE_INPUT_PORT, c->in );
+	c->recorder.writer = &c->w;
+	push_source( env, &c->recorder, c->in );
+
+	for ( ;; )
+	{
+		int sp = _spos();
+		muse_cell expr;
+
+		if ( c->eval )
+			expr = muse_read_source( c->in );
+		else
+		{
+			/* A macro made without being evaluated wouldn't get to expand
+			the code after it, which would then be saved unexpanded. */
+			expr = port_eof(c->in) ? -1 : muse_pread( c->in );
+			if ( expr >= 0 && makes_macro( env, expr ) )
+				expr = muse_raise_error( env, _csymbol(L"error:not-compilable"), _cons( expr, MUSE_NIL ) );
+			if ( expr >= 0 )
+				record_expr( &c->recorder, expr );
+		}
+
+		if ( expr < 0 )
+			break;
+
+		if ( c->eval )
+			_eval(expr);
+
+		_unwind(sp);
+	}
+
+	write_tag( &c->w, IMAGE_END );
+	port_flush( c->out );
+	c->done = MUSE_TRUE;
+	return _mk_int( c->recorder.count );
+}
+
+/**
+ * @code (compile-file source-file image-file [eval?]) @endcode
+ *
+ * Reads all the expressions in the source file and writes them to the
+ * image file, which \ref fn_load "load" then loads much faster than the
+ * source because it needs no parsing. The image file can also be a port,
+ * and it can be attached to an executable in place of the source file.
+ * Evaluates to the number of top level expressions written. The image
+ * file is written under another name and renamed once it is complete,
+ * so it is left as it was if compiling fails.
+ *
+ * The source is read the same way \c load reads it. Braces and macros
+ * are expanded while reading, so what they produce is what is saved,
+ * including vectors, hashtables and the builtin functions that macros
+ * expand into. By default, nothing is evaluated otherwise, so braces and
+ * macros can only use what has already been loaded. Pass \c T for \p eval?
+ * to evaluate each expression after reading it, as \c load does, so that
+ * a file that defines its own macros compiles properly. The body of a
+ * \ref fn_module "module" whose body is the rest of the file is saved
+ * along with it either way.
+ *
+ * Raises error:load if the source file can't be opened, which you can
+ * resume with another file name, and error:open-file if the image file
+ * can't be created. Expressions evaluated while reading can produce
+ * values such as closures that can't be written to the image. For each
+ * of these, error:not-compilable is raised with the value. You can resume
+ * with something to write in its place. Without \p eval?, error:not-compilable
+ * is also raised for an expression that makes a macro, which you can resume
+ * with an expression to write instead.
+ */
+muse_cell fn_compile_file( muse_env *env, void *context, muse_cell args )
+{
+	int sp = _spos();
+	compile_file_t *c = (compile_file_t*)calloc( 1, sizeof(compile_file_t) );
+	muse_cell result;
+
+	c->source	= _spush( _evalnext(&args) );
+	c->image	= _spush( _evalnext(&args) );
+	c->eval		= (args && _evalnext(&args)) ? MUSE_TRUE : MUSE_FALSE;
+
+	result = muse_try( env, MUSE_NIL, (muse_nativefn_t)compile_file, c, MUSE_NIL );
+	_unwind(sp);
+	return _spush(result);
+}
+
+/** @name Module cache */
+/*@{*/
+/**
+ * When the symbol \c *module-cache* is set to the path of a directory,
+ * \ref fn_load "load", and so \ref fn_require "require", keeps an image
+ * of each source file it loads in that directory and loads the image
+ * instead of parsing the source the next time. A cache file is named by
+ * a hash of the source path and holds -
+ *	- the bytes of k_cache_magic,
+ *	- the source file's modification time and size as 8 byte little
+ *	  endian numbers, and the SHA-1 digest of its contents,
+ *	- and the image, as \ref fn_compile_file "compile-file" writes it.
+ *
+ * The image is used without reading the source when the time and size
+ * match, and when only the time differs but the digest matches. Otherwise
+ * the source is loaded as usual and the image is recorded as it is read
+ * and replaces the cache file once the whole file has loaded. What the
+ * reader expands braces and macros into is what gets saved, with the same
+ * caveats as for compile-file. A source file that reads into something
+ * that can't be saved, like a function made by a brace expression, is
+ * just not cached. The body of a \ref fn_module "module" that is the rest
+ * of the file is recorded along with it, but a file that is otherwise read
+ * from by the code in it isn't cached either.
+ */
+static const unsigned char k_cache_magic[8] = { 0, 'm', 'u', 'S', 'E', 'm', 'c', 1 };
+
+enum { CACHE_HEADER_SIZE = 8 + 8 + 8 + 20 };
+
+static void put_uint64_le( unsigned char *b, image_uint_t n )
+{
+	int i;
+	for ( i = 0; i < 8; ++i, n >>= 8 )
+		b[i] = (unsigned char)(n & 0xFF);
+}
+
+/**
+ * Fills in the header of the cache file for the source file's 
+ * contents, which are the \p size bytes at \p source.
+ *
+ * File times only go down to a second on some systems, so a source
+ * that was modified too recently may yet change again without its
+ * time changing. Its time is recorded as 0 so that its digest gets
+ * checked the next time around.
+ */
+static void cache_header( unsigned char header[CACHE_HEADER_SIZE], const struct stat *st, const unsigned char *source, size_t size )
+{
+	memcpy( header, k_cache_magic, 8 );
+	put_uint64_le( header + 8, (st->st_mtime + 2 <= time(NULL)) ? (image_uint_t)st->st_mtime : 0 );
+	put_uint64_le( header + 16, (image_uint_t)size );
+	muse_sha1_digest( source, size, header + 24 );
+}
+
+/**
+ * Writes out the image recorded in the memport \p image to the cache file,
+ * going through a file of its own in the same directory that is renamed
+ * into place when complete, so that a partial file is never loaded.
+ */
+static void cache_save( muse_env *env, const muse_char *dir, const muse_char *cache_path, const unsigned char header[CACHE_HEADER_SIZE], muse_port_t image )
+{
+	muse_char *part = part_path( cache_path );
+	unsigned char buffer[16384];
+	muse_boolean ok;
+	FILE *f;
+	size_t n;
+
+	f = muse_fopen( part, L"wb" );
+	if ( f == NULL && path_mkdir( dir ) == 0 )
+		f = muse_fopen( part, L"wb" );
+
+	if ( f == NULL )
+	{
+		free(part);
+		return;
+	}
+
+	ok = fwrite( header, 1, CACHE_HEADER_SIZE, f ) == CACHE_HEADER_SIZE ? MUSE_TRUE : MUSE_FALSE;
+
+	port_flush( image );
+	while ( ok && (n = port_read( buffer, sizeof(buffer), image )) > 0 )
+		ok = fwrite( buffer, 1, n, f ) == n ? MUSE_TRUE : MUSE_FALSE;
+
+	if ( fclose(f) != 0 || !ok || path_rename( part, cache_path ) != 0 )
+		path_remove( part );
+
+	free(part);
+}
+
+muse_cell fn_memport( muse_env *env, void *context, muse_cell args );
+
+/**
+ * Loads the source code in the port as muse_pload() does, recording what
+ * it reads as an image in \p image. Returns the result of the last
+ * expression, and sets \p ok to MUSE_FALSE if any of the expressions
+ * couldn't be recorded, or if something read from the port other than
+ * through muse_read_source(), which the image wouldn't have.
+ */
+static muse_cell load_and_record( muse_env *env, muse_port_t in, muse_port_t image, muse_boolean *ok )
+{
+	int sp = _spos();
+	muse_cell result = MUSE_NIL;
+	muse_port_t prevIn = muse_current_port( env, MUSE_INPUT_PORT, in );
+	image_writer_t w;
+	image_source_t recorder;
+
+	memset( &w, 0, sizeof(w) );
+	w.env	= env;
+	w.port	= image;
+	port_write( (void*)k_image_magic, sizeof(k_image_magic), image );
+
+	memset( &recorder, 0, sizeof(recorder) );
+	recorder.writer	= &w;
+	recorder.ok		= ok;
+	push_source( env, &recorder, in );
+
+	for ( ;; )
+	{
+		muse_cell expr = muse_read_source(in);
+
+		if ( expr < 0 )
+			break;
+
+		_unwind(sp);
+		_spush(expr);
+		result = _eval(expr);
+		_unwind(sp);
+		_spush(result);
+
+		if ( in->in.fpos != recorder.recorded_pos )
+			(*ok) = MUSE_FALSE;
+	}
+
+	write_tag( &w, IMAGE_END );
+	pop_source( env, &recorder );
+	muse_current_port( env, MUSE_INPUT_PORT, prevIn );
+	cell_map_free( &w.symbols );
+	cell_map_free( &w.prims );
+	free( w.scratch );
+	return result;
+}
+
+/**
+ * Reads the rest of the file into a new buffer, returning NULL if that
+ * can't be done. The buffer has room for at least one byte.
+ */
+static unsigned char *read_rest( FILE *f, long size )
+{
+	unsigned char *bytes = (unsigned char*)malloc( size > 0 ? size : 1 );
+
+	if ( size < 0 || fread( bytes, 1, size, f ) != (size_t)size )
+	{
+		free(bytes);
+		return NULL;
+	}
+
+	return bytes;
+}
+
+/**
+ * Loads the code in the file \p f, opened from \p filename and positioned
+ * at the start of its code, going through the module cache if
+ * \c *module-cache* is set. Otherwise it's the same as muse_load().
+ */
+muse_cell muse_load_cached( muse_env *env, muse_cell filename, FILE *f )
+{
+	int sp = _spos();
+	muse_cell dircell = _symval( _csymbol(L"*module-cache*") );
+	const muse_char *dir, *path;
+	muse_char *cache_path;
+	unsigned char header[CACHE_HEADER_SIZE], cached[CACHE_HEADER_SIZE];
+	muse_boolean have_cached = MUSE_FALSE, use_cached = MUSE_FALSE;
+	long start, size;
+	struct stat st;
+	muse_cell result;
+
+	if ( _cellt(dircell) != MUSE_TEXT_CELL || _cellt(filename) != MUSE_TEXT_CELL || fstat( fileno(f), &st ) != 0 )
+		return muse_load( env, f );
+
+	dir		= _text_contents( dircell, NULL );
+	path	= _text_contents( filename, NULL );
+	start	= ftell(f);
+	size	= (long)st.st_size - start;
+
+	/* The cache file is named by the FNV-1a hash of the source path. */
+	{
+		unsigned long long hash = 14695981039346656037ULL;
+		const muse_char *c;
+		size_t len = wcslen(dir) + 32;
+
+		for ( c = path; *c; ++c )
+			hash = (hash ^ (unsigned long long)*c) * 1099511628211ULL;
+
+		cache_path = (muse_char*)malloc( len * sizeof(muse_char) );
+		swprintf( cache_path, len, L"%ls/%016llx.mimg", dir, hash );
+	}
+
+	{
+		FILE *cf = muse_fopen( cache_path, L"rb" );
+		if ( cf )
+		{
+			have_cached = fread( cached, 1, CACHE_HEADER_SIZE, cf ) == CACHE_HEADER_SIZE ? MUSE_TRUE : MUSE_FALSE;
+			fclose(cf);
+		}
+	}
+
+	/* The cached image is used right away if the source's time and size
+	are what they were. Otherwise the source's digest decides. */
+	memcpy( header, k_cache_magic, 8 );
+	put_uint64_le( header + 8, (image_uint_t)st.st_mtime );
+	put_uint64_le( header + 16, (image_uint_t)size );
+
+	if ( have_cached && memcmp( cached, header, 24 ) == 0 )
+	{
+		use_cached = MUSE_TRUE;
+	}
+	else
+	{
+		unsigned char *source = read_rest( f, size );
+
+		if ( source == NULL )
+		{
+			free(cache_path);
+			fseek( f, start, SEEK_SET );
+			return muse_load( env, f );
+		}
+
+		cache_header( header, &st, source, size );
+		free(source);
+
+		if ( have_cached && memcmp( cached + 16, header + 16, CACHE_HEADER_SIZE - 16 ) == 0 && memcmp( cached, header, 8 ) == 0 )
+		{
+			/* Only the time has changed. Note the new one. */
+			FILE *cf = memcmp( cached + 8, header + 8, 8 ) != 0 ? muse_fopen( cache_path, L"r+b" ) : NULL;
+			if ( cf )
+			{
+				fwrite( header, 1, CACHE_HEADER_SIZE, cf );
+				fclose(cf);
+			}
+			use_cached = MUSE_TRUE;
+		}
+	}
+
+	if ( use_cached )
+	{
+		FILE *cf = muse_fopen( cache_path, L"rb" );
+
+		if ( cf )
+		{
+			muse_port_t in;
+			fseek( cf, CACHE_HEADER_SIZE, SEEK_SET );
+			in = muse_assign_port( env, cf, MUSE_PORT_TRUSTED_INPUT );
+
+			if ( muse_is_image_port(in) )
+			{
+				free(cache_path);
+				result = muse_load_image(in);
+				muse_unassign_port(in);
+				fclose(cf);
+				return result;
+			}
+
+			muse_unassign_port(in);
+			fclose(cf);
+		}
+
+		/* The cache file has gone bad. Its header is that of the source 
+		when it was read on the fast path, so work it out properly. */
+		fseek( f, start, SEEK_SET );
+		{
+			unsigned char *source = read_rest( f, size );
+			if ( source )
+			{
+				cache_header( header, &st, source, size );
+				free(source);
+			}
+		}
+	}
+
+	/* Load the source and record its image. */
+	fseek( f, start, SEEK_SET );
+
+	{
+		muse_port_t in = muse_assign_port( env, f, MUSE_PORT_TRUSTED_INPUT );
+
+		if ( muse_is_image_port(in) || muse_is_snapshot_port(in) )
+		{
+			/* Already compiled. */
+			result = muse_pload(in);
+		}
+		else
+		{
+			/* The memport is a cell so that it goes away 
+			with the garbage if loading is cut short. */
+			muse_cell imagecell = _spush( fn_memport( env, NULL, MUSE_NIL ) );
+			muse_boolean ok = MUSE_TRUE;
+
+			result = load_and_record( env, in, _port(imagecell), &ok );
+
+			if ( ok )
+				cache_save( env, dir, cache_path, header, _port(imagecell) );
+
+			_unwind(sp);
+			_spush(result);
+		}
+
+		muse_unassign_port(in);
+	}
+
+	free(cache_path);
+	return result;
+}
+/*@}*/
+
+/** @name Snapshots */
+/*@{*/
+typedef struct
+{
+	muse_cell cell;
+	int kind;
+	int first_ref, num_refs;
+} snapshot_node_t;
+
+typedef struct
+{
+	image_uint_t sym, value, plist;
+	int flags;
+} snapshot_binding_t;
+
+enum { SNAPSHOT_HAS_VALUE = 1, SNAPSHOT_HAS_PLIST = 2 };
+enum { SNAPSHOT_KEEP_CHUNK = 4096 };
+
+typedef struct
+{
+	image_writer_t out;
+	cell_map_t refs_of;		/**< The reference to the node of each cell written. */
+	cell_map_t base;		/**< Recorded values, to the positions of their symbols. */
+	snapshot_node_t *nodes;
+	int num_nodes, nodes_capacity;
+	image_uint_t *refs;		/**< The references that nodes make, see snapshot_node_t::first_ref. */
+	int num_refs, refs_capacity;
+	muse_cell keep;			/**< Cells made while writing, kept alive on the stack at keep_sp. */
+	int keep_sp;
+} snapshot_writer_t;
+
+static void snapshot_keep( snapshot_writer_t *s, muse_cell c )
+{
+	muse_env *env = s->out.env;
+	_unwind( s->keep_sp );
+	_spush( s->keep = _cons( c, s->keep ) );
+}
+
+static void snapshot_add_ref( snapshot_writer_t *s, image_uint_t ref )
+{
+	if ( s->num_refs == s->refs_capacity )
+	{
+		s->refs_capacity = s->refs_capacity ? 2 * s->refs_capacity : 1024;
+		s->refs = (image_uint_t*)realloc( s->refs, s->refs_capacity * sizeof(image_uint_t) );
+	}
+
+	s->refs[s->num_refs++] = ref;
+}
+
+/**
+ * Returns the node kind that the cell is written as,
+ * or -1 if it can't be written.
+ */
+static int snapshot_kind( snapshot_writer_t *s, muse_cell c )
+{
+	muse_env *env = s->out.env;
+
+	switch ( _cellt(c) )
+	{
+	case MUSE_INT_CELL		: return IMAGE_INT;
+	case MUSE_FLOAT_CELL	: return IMAGE_FLOAT;
+	case MUSE_TEXT_CELL		: return IMAGE_TEXT;
+	case MUSE_SYMBOL_CELL	: return _symname(c) ? IMAGE_SYMBOL : SNAPSHOT_ANON_SYMBOL;
+	case MUSE_LAZY_CELL		: return -1;
+	default:;
+	}
+
+	if ( cell_map_find( &s->base, c ) >= 0 )
+		return SNAPSHOT_BASE;
+
+	switch ( _cellt(c) )
+	{
+	case MUSE_CONS_CELL		: return SNAPSHOT_PAIR;
+	case MUSE_LAMBDA_CELL	: return muse_compiled_code( env, c ) ? SNAPSHOT_CLOSURE : SNAPSHOT_PAIR;
+	default:
+		if ( _functional_object_data( c, 'barr' ) )
+			return IMAGE_BYTES;
+		else if ( _functional_object_data( c, 'mobj' ) )
+			return SNAPSHOT_OBJECT;
+		else if ( _functional_object_data( c, 'vect' ) )
+			return SNAPSHOT_VECTOR;
+		else if ( _functional_object_data( c, 'hash' ) )
+			return SNAPSHOT_HASHTABLE;
+		else if ( _functional_object_data( c, 'mmod' ) )
+			return SNAPSHOT_MODULE;
+		else
+			return -1;
+	}
+}
+
+/**
+ * Returns the reference to the node for the given cell, adding a node
+ * if the cell has none yet. A reference is the node's index plus one,
+ * shifted up by a bit that tells whether the cell is quick quoted. The
+ * reference 0 is for ().
+ */
+static image_uint_t snapshot_ref( snapshot_writer_t *s, muse_cell c )
+{
+	muse_env *env = s->out.env;
+	image_uint_t qq = (c < 0) ? 1 : 0;
+	int *slot, kind;
+
+	c = _quq(c);
+	if ( c == MUSE_NIL )
+		return 0;
+
+	slot = cell_map_slot( &s->refs_of, c );
+	if ( *slot >= 0 )
+		return (image_uint_t)*slot | qq;
+
+	kind = snapshot_kind( s, c );
+
+	if ( kind < 0 )
+	{
+		/* Ports, native functions defined after the recorded ones and
+		the like. Until the replacement is written, the cell stands for
+		(), so that a replacement that contains it doesn't raise again. */
+		muse_cell value;
+		image_uint_t ref;
+
+		*slot = 0;
+		value = muse_raise_error( env, _csymbol(L"error:not-snapshottable"), _cons( c, MUSE_NIL ) );
+		snapshot_keep( s, value );
+		ref = (value == c) ? 0 : snapshot_ref( s, value );
+		*cell_map_slot( &s->refs_of, c ) = (int)ref;
+		return ref | qq;
+	}
+
+	if ( s->num_nodes == s->nodes_capacity )
+	{
+		s->nodes_capacity = s->nodes_capacity ? 2 * s->nodes_capacity : 1024;
+		s->nodes = (snapshot_node_t*)realloc( s->nodes, s->nodes_capacity * sizeof(snapshot_node_t) );
+	}
+
+	s->nodes[s->num_nodes].cell = c;
+	s->nodes[s->num_nodes].kind = kind;
+	s->nodes[s->num_nodes].first_ref = 0;
+	s->nodes[s->num_nodes].num_refs = 0;
+	*slot = (++s->num_nodes) << 1;
+	return (image_uint_t)*slot | qq;
+}
+
+/**
+ * Adds the references that the node makes to other nodes,
+ * adding nodes for the cells those are to.
+ */
+static void snapshot_expand( snapshot_writer_t *s, int n )
+{
+	muse_env *env = s->out.env;
+	muse_cell c = s->nodes[n].cell;
+	int first = s->num_refs;
+
+	switch ( s->nodes[n].kind )
+	{
+	case SNAPSHOT_PAIR:
+		snapshot_add_ref( s, snapshot_ref( s, _ptr(c)->cons.head ) );
+		snapshot_add_ref( s, snapshot_ref( s, _ptr(c)->cons.tail ) );
+		break;
+
+	case SNAPSHOT_CLOSURE:
+		{
+			/* The compiled code is left out. It is compiled
+			again when the snapshot is loaded. */
+			muse_cell body = _tail(c);
+			snapshot_add_ref( s, snapshot_ref( s, _head(c) ) );
+			snapshot_add_ref( s, snapshot_ref( s, _head(body) ) );
+			snapshot_add_ref( s, snapshot_ref( s, _tail(_tail(body)) ) );
+		}
+		break;
+
+	case SNAPSHOT_ANON_SYMBOL:
+		snapshot_add_ref( s, snapshot_ref( s, muse_symbol_plist( env, c ) ) );
+		break;
+
+	case SNAPSHOT_OBJECT:
+		snapshot_add_ref( s, snapshot_ref( s, object_supers( env, c ) ) );
+		snapshot_add_ref( s, snapshot_ref( s, object_plist( env, c ) ) );
+		break;
+
+	case SNAPSHOT_VECTOR:
+		{
+			int i, length = muse_vector_length( env, c );
+			for ( i = 0; i < length; ++i )
+				snapshot_add_ref( s, snapshot_ref( s, muse_vector_get( env, c, i ) ) );
+		}
+		break;
+
+	case SNAPSHOT_HASHTABLE:
+		{
+			muse_cell alist = fn_hashtable_to_alist( env, NULL, _cons( c, MUSE_NIL ) );
+			snapshot_keep( s, alist );
+			snapshot_add_ref( s, snapshot_ref( s, alist ) );
+		}
+		break;
+
+	case SNAPSHOT_MODULE:
+		{
+			muse_cell contents = module_contents( env, c );
+			snapshot_keep( s, contents );
+			snapshot_add_ref( s, snapshot_ref( s, contents ) );
+		}
+		break;
+
+	case SNAPSHOT_BASE:
+		{
+			muse_cell sym = _symstack()->bottom[ cell_map_find( &s->base, c ) ];
+			snapshot_add_ref( s, snapshot_ref( s, sym ) );
+		}
+		break;
+	}
+
+	/* The node array may have moved. */
+	s->nodes[n].first_ref = first;
+	s->nodes[n].num_refs = s->num_refs - first;
+}
+
+static void snapshot_write_node( snapshot_writer_t *s, const snapshot_node_t *node )
+{
+	int i;
+
+	switch ( node->kind )
+	{
+	case IMAGE_INT:
+	case IMAGE_FLOAT:
+	case IMAGE_TEXT:
+	case IMAGE_SYMBOL:
+	case IMAGE_BYTES:
+		/* Each symbol has only the one node, so it is always written
+		with its name, the way it first appears in an image. */
+		write_expr( &s->out, node->cell );
+		return;
+
+	case SNAPSHOT_PAIR:
+		write_tag( &s->out, SNAPSHOT_PAIR );
+		write_uint( &s->out, _cellt(node->cell) );
+		break;
+
+	case SNAPSHOT_VECTOR:
+		write_tag( &s->out, SNAPSHOT_VECTOR );
+		write_uint( &s->out, node->num_refs );
+		break;
+
+	default:
+		write_tag( &s->out, node->kind );
+	}
+
+	for ( i = 0; i < node->num_refs; ++i )
+		write_uint( &s->out, s->refs[node->first_ref + i] );
+}
+
+/**
+ * Writes a snapshot of the definitions of the given symbols to the port.
+ * The symbols are given as a list, or as T for every symbol whose
+ * value or plist isn't what muse_snapshot_base() recorded. Returns the
+ * number of symbols written.
+ */
+static int save_snapshot( muse_env *env, muse_port_t port, muse_cell symbols )
+{
+	muse_stack *ss = _symstack();
+	muse_stack *base = &env->snapshot_base;
+	int num_base = (int)(base->top - base->bottom) / 2;
+	snapshot_writer_t s;
+	snapshot_binding_t *bindings = NULL;
+	int num_bindings = 0, capacity = 0, i;
+
+	memset( &s, 0, sizeof(s) );
+	s.out.env	= env;
+	s.out.port	= port;
+	s.keep_sp	= _spos();
+	_spush( MUSE_NIL );
+
+	for ( i = 0; i < num_base; ++i )
+	{
+		muse_cell value = base->bottom[2*i];
+
+		if ( value && _cellt(value) != MUSE_SYMBOL_CELL )
+		{
+			int *slot = cell_map_slot( &s.base, value );
+			if ( *slot < 0 )
+				*slot = i;
+		}
+	}
+
+	for ( i = 0; ; ++i )
+	{
+		muse_cell sym, value, plist;
+		int flags = 0;
+
+		if ( symbols == _t() )
+		{
+			if ( i >= (int)(ss->top - ss->bottom) )
+				break;
+
+			sym = ss->bottom[i];
+			value = _symval(sym);
+			plist = muse_symbol_plist( env, sym );
+
+			/* Symbols like {{trap}} hold the interpreter's own state. */
+			if ( wcsncmp( muse_symbol_name( env, sym ), L"{{", 2 ) == 0 )
+				continue;
+
+			if ( i < num_base )
+			{
+				if ( value != base->bottom[2*i] )
+					flags |= SNAPSHOT_HAS_VALUE;
+				if ( plist != base->bottom[2*i+1] )
+					flags |= SNAPSHOT_HAS_PLIST;
+			}
+		}
+		else
+		{
+			if ( !symbols )
+				break;
+
+			sym = _next(&symbols);
+			if ( _cellt(sym) != MUSE_SYMBOL_CELL )
+				continue;
+
+			value = _symval(sym);
+			plist = muse_symbol_plist( env, sym );
+		}
+
+		if ( symbols != _t() || i >= num_base )
+		{
+			if ( value != sym )
+				flags |= SNAPSHOT_HAS_VALUE;
+			if ( plist )
+				flags |= SNAPSHOT_HAS_PLIST;
+		}
+
+		if ( flags == 0 )
+			continue;
+
+		if ( num_bindings == capacity )
+		{
+			capacity = capacity ? 2 * capacity : 256;
+			bindings = (snapshot_binding_t*)realloc( bindings, capacity * sizeof(snapshot_binding_t) );
+		}
+
+		bindings[num_bindings].sym		= snapshot_ref( &s, sym );
+		bindings[num_bindings].value	= (flags & SNAPSHOT_HAS_VALUE) ? snapshot_ref( &s, value ) : 0;
+		bindings[num_bindings].plist	= (flags & SNAPSHOT_HAS_PLIST) ? snapshot_ref( &s, plist ) : 0;
+		bindings[num_bindings].flags	= flags;
+		++num_bindings;
+	}
+
+	/* The node array doubles as the queue of nodes whose references
+	are yet to be found, so that long lists need no deep recursion. */
+	for ( i = 0; i < s.num_nodes; ++i )
+		snapshot_expand( &s, i );
+
+	port_write( (void*)k_snapshot_magic, sizeof(k_snapshot_magic), port );
+	write_uint( &s.out, s.num_nodes );
+
+	for ( i = 0; i < s.num_nodes; ++i )
+		snapshot_write_node( &s, s.nodes + i );
+
+	write_uint( &s.out, num_bindings );
+
+	for ( i = 0; i < num_bindings; ++i )
+	{
+		write_uint( &s.out, bindings[i].sym );
+		write_uint( &s.out, bindings[i].flags );
+		if ( bindings[i].flags & SNAPSHOT_HAS_VALUE )
+			write_uint( &s.out, bindings[i].value );
+		if ( bindings[i].flags & SNAPSHOT_HAS_PLIST )
+			write_uint( &s.out, bindings[i].plist );
+	}
+
+	port_flush(port);
+
+	free( bindings );
+	free( s.nodes );
+	free( s.refs );
+	cell_map_free( &s.refs_of );
+	cell_map_free( &s.base );
+	cell_map_free( &s.out.symbols );
+	cell_map_free( &s.out.prims );
+	free( s.out.scratch );
+
+	_unwind( s.keep_sp );
+	return num_bindings;
+}
+
+typedef struct
+{
+	image_reader_t in;
+	snapshot_node_t *nodes;
+	int num_nodes;
+	image_uint_t *refs;
+	int num_refs, refs_capacity;
+} snapshot_reader_t;
+
+static void snapshot_read_refs( snapshot_reader_t *s, snapshot_node_t *node, image_uint_t n )
+{
+	node->first_ref = s->num_refs;
+	node->num_refs = 0;
+
+	for ( ; n > 0 && !s->in.bad; --n )
+	{
+		if ( s->num_refs == s->refs_capacity )
+		{
+			s->refs_capacity = s->refs_capacity ? 2 * s->refs_capacity : 1024;
+			s->refs = (image_uint_t*)realloc( s->refs, s->refs_capacity * sizeof(image_uint_t) );
+		}
+
+		s->refs[s->num_refs++] = read_uint( &s->in );
+		++node->num_refs;
+	}
+}
+
+/** Returns the cell that the reference is to. */
+static muse_cell snapshot_cell( snapshot_reader_t *s, image_uint_t ref )
+{
+	image_uint_t ix = ref >> 1;
+	muse_cell c;
+
+	if ( ix == 0 )
+		return MUSE_NIL;
+
+	if ( ix > (image_uint_t)s->num_nodes )
+	{
+		s->in.bad = MUSE_TRUE;
+		return MUSE_NIL;
+	}
+
+	c = s->nodes[ix-1].cell;
+	return (ref & 1) ? _qq(c) : c;
+}
+
+static muse_cell snapshot_node_ref( snapshot_reader_t *s, const snapshot_node_t *node, int i )
+{
+	return snapshot_cell( s, s->refs[node->first_ref + i] );
+}
+
+/**
+ * Makes the cell for the node read next. Cells that refer to other
+ * cells are made empty and filled in once all nodes have been read.
+ */
+static void snapshot_read_node( snapshot_reader_t *s, snapshot_node_t *node )
+{
+	muse_env *env = s->in.env;
+	image_reader_t *r = &s->in;
+	int tag = read_byte(r);
+
+	node->kind = tag;
+	node->cell = MUSE_NIL;
+	node->first_ref = node->num_refs = 0;
+
+	switch ( tag )
+	{
+	case IMAGE_INT:
+	case IMAGE_FLOAT:
+	case IMAGE_TEXT:
+	case IMAGE_SYMBOL:
+	case IMAGE_BYTES:
+		node->cell = read_expr( r, tag );
+		break;
+
+	case SNAPSHOT_PAIR:
+		{
+			image_uint_t type = read_uint(r);
+			if ( type != MUSE_CONS_CELL && type != MUSE_LAMBDA_CELL )
+				r->bad = MUSE_TRUE;
+			else
+				node->cell = _setcellt( _cons( MUSE_NIL, MUSE_NIL ), (int)type );
+			snapshot_read_refs( s, node, 2 );
+		}
+		break;
+
+	case SNAPSHOT_CLOSURE:
+		node->cell = _setcellt( _cons( MUSE_NIL, MUSE_NIL ), MUSE_LAMBDA_CELL );
+		snapshot_read_refs( s, node, 3 );
+		break;
+
+	case SNAPSHOT_ANON_SYMBOL:
+		node->cell = _mk_anon_symbol();
+		snapshot_read_refs( s, node, 1 );
+		break;
+
+	case SNAPSHOT_OBJECT:
+		node->cell = fn_new( env, NULL, MUSE_NIL );
+		snapshot_read_refs( s, node, 2 );
+		break;
+
+	case SNAPSHOT_VECTOR:
+		{
+			image_uint_t length = read_uint(r);
+			if ( length > (1 << 28) )
+				r->bad = MUSE_TRUE;
+			else
+			{
+				node->cell = muse_mk_vector( env, (int)length );
+				snapshot_read_refs( s, node, length );
+			}
+		}
+		break;
+
+	case SNAPSHOT_HASHTABLE:
+		node->cell = muse_mk_hashtable( env, 0 );
+		snapshot_read_refs( s, node, 1 );
+		break;
+
+	case SNAPSHOT_MODULE:
+		node->cell = mk_module(env);
+		snapshot_read_refs( s, node, 1 );
+		break;
+
+	case SNAPSHOT_BASE:
+		snapshot_read_refs( s, node, 1 );
+		break;
+
+	default:
+		r->bad = MUSE_TRUE;
+	}
+}
+
+/**
+ * Returns the position in the symbol stack of each symbol that
+ * muse_snapshot_base() has recorded.
+ */
+static void snapshot_base_positions( muse_env *env, cell_map_t *m )
+{
+	muse_stack *ss = _symstack();
+	int i, n = (int)(env->snapshot_base.top - env->snapshot_base.bottom) / 2;
+
+	for ( i = 0; i < n; ++i )
+		*cell_map_slot( m, ss->bottom[i] ) = i;
+}
+
+/**
+ * Loads the snapshot that the port starts with, giving the symbols in it
+ * the values and plists they had when it was saved. Evaluates to the
+ * number of symbols. If the snapshot is cut short or damaged, nothing is
+ * defined and error:bad-snapshot is raised with the position in the port.
+ */
+muse_cell muse_load_snapshot( muse_port_t p )
+{
+	muse_env *env = p->env;
+	int sp = _spos();
+	muse_cell keep = MUSE_NIL;
+	snapshot_reader_t s;
+	snapshot_binding_t *bindings = NULL;
+	cell_map_t base;
+	image_uint_t num_nodes, num_bindings = 0, i;
+
+	memset( &s, 0, sizeof(s) );
+	memset( &base, 0, sizeof(base) );
+	s.in.env	= env;
+	s.in.port	= p;
+
+	port_consume( sizeof(k_snapshot_magic), p );
+	_spush( keep );
+
+	num_nodes = read_uint( &s.in );
+	if ( num_nodes > (1 << 28) )
+		s.in.bad = MUSE_TRUE;
+	else
+		muse_reserve_cells( env, (int)(num_nodes < (1 << 22) ? num_nodes : (1 << 22)) + 4 * SNAPSHOT_KEEP_CHUNK );
+
+	/* Read and make the cells. They're kept alive by a list of vectors
+	that each hold SNAPSHOT_KEEP_CHUNK of them. As they're all going to
+	be kept anyway, the cells are reserved beforehand so that making them
+	doesn't have the collector look for garbage that isn't there. */
+	for ( i = 0; i < num_nodes && !s.in.bad; ++i )
+	{
+		int k = (int)(i % SNAPSHOT_KEEP_CHUNK);
+
+		if ( (i & (i - 1)) == 0 )
+			s.nodes = (snapshot_node_t*)realloc( s.nodes, (i ? 2 * i : 1) * sizeof(snapshot_node_t) );
+
+		if ( k == 0 )
+		{
+			muse_reserve_cells( env, 4 * SNAPSHOT_KEEP_CHUNK );
+			keep = _cons( muse_mk_vector( env, SNAPSHOT_KEEP_CHUNK ), keep );
+			_unwind(sp);
+			_spush(keep);
+		}
+
+		snapshot_read_node( &s, s.nodes + i );
+		s.num_nodes = (int)(i + 1);
+		muse_vector_put( env, _head(keep), k, s.nodes[i].cell );
+		_unwind(sp);
+		_spush(keep);
+	}
+
+	/* Look up recorded values. */
+	for ( i = 0; i < (image_uint_t)s.num_nodes && !s.in.bad; ++i )
+	{
+		snapshot_node_t *node = s.nodes + i;
+
+		if ( node->kind == SNAPSHOT_BASE )
+		{
+			muse_cell sym = snapshot_node_ref( &s, node, 0 );
+			int pos;
+
+			if ( base.capacity == 0 )
+				snapshot_base_positions( env, &base );
+
+			pos = (sym > 0 && _cellt(sym) == MUSE_SYMBOL_CELL) ? cell_map_find( &base, sym ) : -1;
+
+			if ( pos < 0 )
+				s.in.bad = MUSE_TRUE;
+			else
+				node->cell = env->snapshot_base.bottom[2*pos];
+		}
+	}
+
+	/* Fill in the cells that refer to others. */
+	for ( i = 0; i < (image_uint_t)s.num_nodes && !s.in.bad; ++i )
+	{
+		snapshot_node_t *node = s.nodes + i;
+		muse_cell c = node->cell;
+
+		switch ( node->kind )
+		{
+		case SNAPSHOT_PAIR:
+			_setht( c, snapshot_node_ref( &s, node, 0 ), snapshot_node_ref( &s, node, 1 ) );
+			break;
+
+		case SNAPSHOT_CLOSURE:
+			{
+				int sp2 = _spos();
+				muse_cell body = _cons( snapshot_node_ref( &s, node, 1 ), snapshot_node_ref( &s, node, 2 ) );
+				_setht( c, snapshot_node_ref( &s, node, 0 ), body );
+				_unwind(sp2);
+			}
+			break;
+
+		case SNAPSHOT_ANON_SYMBOL:
+			_sett( _tail(c), snapshot_node_ref( &s, node, 0 ) );
+			break;
+
+		case SNAPSHOT_OBJECT:
+			object_assign( env, c, snapshot_node_ref( &s, node, 0 ), snapshot_node_ref( &s, node, 1 ) );
+			break;
+
+		case SNAPSHOT_VECTOR:
+			{
+				int j;
+				for ( j = 0; j < node->num_refs; ++j )
+					muse_vector_put( env, c, j, snapshot_node_ref( &s, node, j ) );
+			}
+			break;
+		}
+	}
+
+	/* Hashtables hash their keys, modules take their exports and
+	closures are compiled only once all the cells are complete. */
+	for ( i = 0; i < (image_uint_t)s.num_nodes && !s.in.bad; ++i )
+	{
+		snapshot_node_t *node = s.nodes + i;
+
+		if ( node->kind == SNAPSHOT_HASHTABLE )
+		{
+			muse_cell alist = snapshot_node_ref( &s, node, 0 );
+
+			while ( alist && _cellt(alist) == MUSE_CONS_CELL )
+			{
+				int sp2 = _spos();
+				muse_cell kv = _next(&alist);
+
+				if ( kv && _cellt(kv) == MUSE_CONS_CELL )
+					muse_hashtable_put( env, node->cell, _head(kv), _tail(kv) );
+				_unwind(sp2);
+			}
+		}
+		else if ( node->kind == SNAPSHOT_MODULE )
+		{
+			muse_cell contents = snapshot_node_ref( &s, node, 0 );
+
+			if ( contents && _cellt(contents) == MUSE_CONS_CELL )
+				module_assign( env, node->cell, contents );
+		}
+		else if ( node->kind == SNAPSHOT_CLOSURE )
+		{
+			int sp2 = _spos();
+			muse_compile_lambda( env, node->cell );
+			_unwind(sp2);
+		}
+	}
+
+	if ( !s.in.bad )
+	{
+		num_bindings = read_uint( &s.in );
+		if ( num_bindings > (image_uint_t)s.num_nodes )
+			s.in.bad = MUSE_TRUE;
+		else
+			bindings = (snapshot_binding_t*)malloc( (size_t)(num_bindings + 1) * sizeof(snapshot_binding_t) );
+	}
+
+	for ( i = 0; i < num_bindings && !s.in.bad; ++i )
+	{
+		bindings[i].sym		= read_uint( &s.in );
+		bindings[i].flags	= (int)read_uint( &s.in );
+		bindings[i].value	= (bindings[i].flags & SNAPSHOT_HAS_VALUE) ? read_uint( &s.in ) : 0;
+		bindings[i].plist	= (bindings[i].flags & SNAPSHOT_HAS_PLIST) ? read_uint( &s.in ) : 0;
+
+		{
+			muse_cell sym = snapshot_cell( &s, bindings[i].sym );
+			if ( !sym || _cellt(sym) != MUSE_SYMBOL_CELL )
+				s.in.bad = MUSE_TRUE;
+		}
+	}
+
+	reader_sync( &s.in );
+
+	/* Nothing is defined unless all of it could be read. */
+	for ( i = 0; i < num_bindings && !s.in.bad; ++i )
+	{
+		muse_cell sym = snapshot_cell( &s, bindings[i].sym );
+
+		if ( bindings[i].flags & SNAPSHOT_HAS_VALUE )
+			_define( sym, snapshot_cell( &s, bindings[i].value ) );
+
+		if ( bindings[i].flags & SNAPSHOT_HAS_PLIST )
+			_sett( _tail(sym), snapshot_cell( &s, bindings[i].plist ) );
+	}
+
+	free( bindings );
+	free( s.nodes );
+	free( s.refs );
+	free( s.in.symbols );
+	free( s.in.scratch );
+	cell_map_free( &base );
+	_unwind(sp);
+
+	if ( s.in.bad )
+		return muse_raise_error( env, _csymbol(L"error:bad-snapshot"), _cons( _mk_int( (muse_int)p->in.fpos ), MUSE_NIL ) );
+
+	return _mk_int( (muse_int)num_bindings );
+}
+
+/**
+ * Returns MUSE_TRUE if what is next in the port is a snapshot
+ * written by \ref fn_save_snapshot "save-snapshot".
+ */
+muse_boolean muse_is_snapshot_port( muse_port_t p )
+{
+	return port_starts_with( p, k_snapshot_magic );
+}
+
+/**
+ * @code (save-snapshot file [symbols]) @endcode
+ *
+ * Saves the definitions made since the environment was set up to the
+ * file, which can also be a port. \ref fn_load "Loading" the file into
+ * a fresh environment restores them, as a quicker start than loading and
+ * running the code that made them. The file can also be attached to an
+ * executable in place of source code. Evaluates to the number of symbols
+ * saved.
+ *
+ * A symbol is saved if its value or its plist is no longer what it was
+ * when the environment was set up, except for symbols named like
+ * \c {{trap}}, which the interpreter keeps its own state in. Give a list of \p symbols to save just
+ * those instead. Everything their values and plists refer to is saved
+ * along with them, keeping shared structure shared - lists, texts,
+ * numbers, closures, objects, modules, vectors, hashtables and byte
+ * arrays.
+ * Builtin functions and other values that the environment started with
+ * are saved by the names of the symbols they belonged to, and are found
+ * under those names when the snapshot is loaded. Changes made inside
+ * such values aren't saved. Compiled closures are compiled again when
+ * loaded.
+ *
+ * Raises error:open-file if the file can't be created. For every other
+ * value, such as a port, a native function or a lazy expression,
+ * error:not-snapshottable is raised with the value. You can resume with
+ * something to save in its place.
+ */
+muse_cell fn_save_snapshot( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell file = _evalnext(&args);
+	muse_cell symbols = args ? _evalnext(&args) : _t();
+	muse_port_t out = _port(file);
+	FILE *out_file = NULL;
+	int count;
+
+	if ( !out )
+		out = open_image_file( env, file, &out_file, NULL );
+
+	count = save_snapshot( env, out, symbols );
+
+	if ( out_file )
+	{
+		muse_unassign_port(out);
+		fclose(out_file);
+	}
+
+	return _mk_int(count);
+}
+/*@}*/
@@ -0,0 +1,325 @@
+/**
+ * @file muse_mailbox.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Taking messages out of process mailboxes. A mailbox is a list of
+ * entries - cons cells whose heads are the messages - in the order the
+ * messages arrived. Once a process waits for a message from a particular
+ * sender or with a particular tag (the symbol that the message starts with),
+ * it also gets an index from senders and tags to the entries. A message
+ * taken through the index is left in the list with its entry emptied, and
+ * the empty entries are dropped when they reach the front.
+ */
+
+#include "muse_opcodes.h"
+#include <stdlib.h>
+
+static int queue_slot( muse_cell key, int capacity )
+{
+	return (int)(((unsigned int)key * 2654435761u) & (unsigned int)(capacity - 1));
+}
+
+/**
+ * Returns the tag of the message - the symbol that its body starts
+ * with - or MUSE_NIL if it has none.
+ */
+static muse_cell message_tag( muse_env *env, muse_cell msg )
+{
+	muse_cell body = _tail(msg);
+
+	if ( body && _cellt(body) == MUSE_CONS_CELL )
+	{
+		muse_cell tag = _head(body);
+		if ( tag && _cellt(tag) == MUSE_SYMBOL_CELL )
+			return tag;
+	}
+
+	return MUSE_NIL;
+}
+
+/**
+ * Drops the entries at the front of the queue whose messages have
+ * already been received.
+ */
+static void drop_taken( muse_env *env, muse_mailbox_queue_t *q )
+{
+	while ( q->count > 0 && _head( q->entries[q->head] ) == MUSE_NIL )
+	{
+		q->head = (q->head + 1) & (q->capacity - 1);
+		--q->count;
+	}
+}
+
+static muse_mailbox_queue_t *find_queue( muse_mailbox_index_t *ix, muse_cell key )
+{
+	int i = queue_slot( key, ix->capacity );
+
+	for ( ; ix->queues[i].key; i = (i + 1) & (ix->capacity - 1) )
+	{
+		if ( ix->queues[i].key == key )
+			return ix->queues + i;
+	}
+
+	return NULL;
+}
+
+static muse_mailbox_queue_t *add_queue( muse_mailbox_index_t *ix, muse_cell key )
+{
+	int i = queue_slot( key, ix->capacity );
+
+	while ( ix->queues[i].key )
+		i = (i + 1) & (ix->capacity - 1);
+
+	ix->queues[i].key = key;
+	ix->count++;
+	return ix->queues + i;
+}
+
+/**
+ * Rebuilds the index with room for \p capacity queues, leaving out the
+ * queues that have no messages waiting.
+ */
+static void resize_index( muse_env *env, muse_mailbox_index_t *ix, int capacity )
+{
+	muse_mailbox_index_t old = *ix;
+	int i;
+
+	ix->capacity	= capacity;
+	ix->count		= 0;
+	ix->queues		= (muse_mailbox_queue_t*)calloc( capacity, sizeof(muse_mailbox_queue_t) );
+
+	for ( i = 0; i < old.capacity; ++i )
+	{
+		muse_mailbox_queue_t *q = old.queues + i;
+
+		if ( !q->key )
+			continue;
+
+		drop_taken( env, q );
+
+		if ( q->count > 0 )
+			*add_queue( ix, q->key ) = *q;
+		else
+			free( q->entries );
+	}
+
+	free( old.queues );
+}
+
+static void push_entry( muse_env *env, muse_mailbox_index_t *ix, muse_cell key, muse_cell entry )
+{
+	muse_mailbox_queue_t *q = find_queue( ix, key );
+
+	if ( q == NULL )
+	{
+		if ( (ix->count + 1) * 4 > ix->capacity * 3 )
+		{
+			/* Senders and tags come and go, so the queues that have
+			emptied are dropped instead of making room for them. */
+			int live = 0, capacity = 16, i;
+
+			for ( i = 0; i < ix->capacity; ++i )
+			{
+				if ( ix->queues[i].key )
+				{
+					drop_taken( env, ix->queues + i );
+					if ( ix->queues[i].count > 0 )
+						++live;
+				}
+			}
+
+			while ( capacity < (live + 1) * 4 )
+				capacity *= 2;
+
+			resize_index( env, ix, capacity );
+		}
+
+		q = add_queue( ix, key );
+	}
+	else
+		drop_taken( env, q );
+
+	if ( q->count >= q->capacity )
+	{
+		/* Grow the ring, unwrapping it as we go. */
+		int capacity = q->capacity ? 2 * q->capacity : 4;
+		muse_cell *entries = (muse_cell*)malloc( capacity * sizeof(muse_cell) );
+		int i;
+
+		for ( i = 0; i < q->count; ++i )
+			entries[i] = q->entries[(q->head + i) & (q->capacity - 1)];
+
+		free( q->entries );
+		q->entries	= entries;
+		q->capacity	= capacity;
+		q->head		= 0;
+	}
+
+	q->entries[(q->head + q->count) & (q->capacity - 1)] = entry;
+	q->count++;
+}
+
+static void index_entry( muse_env *env, muse_mailbox_index_t *ix, muse_cell entry )
+{
+	muse_cell msg = _head(entry);
+	muse_cell tag = message_tag( env, msg );
+
+	push_entry( env, ix, _head(msg), entry );
+
+	if ( tag )
+		push_entry( env, ix, tag, entry );
+}
+
+/**
+ * Indexes all the messages already in the mailbox.
+ */
+static muse_mailbox_index_t *create_index( muse_env *env, muse_process_frame_t *p )
+{
+	muse_mailbox_index_t *ix = (muse_mailbox_index_t*)calloc( 1, sizeof(muse_mailbox_index_t) );
+	muse_cell entry;
+
+	ix->capacity	= 16;
+	ix->queues		= (muse_mailbox_queue_t*)calloc( ix->capacity, sizeof(muse_mailbox_queue_t) );
+
+	for ( entry = _tail(p->mailbox); entry; entry = _tail(entry) )
+	{
+		if ( _head(entry) )
+			index_entry( env, ix, entry );
+	}
+
+	return ix;
+}
+
+/**
+ * Drops the emptied entries at the front of the mailbox.
+ */
+static void drop_taken_entries( muse_env *env, muse_process_frame_t *p )
+{
+	muse_cell entry;
+
+	while ( (entry = _tail(p->mailbox)) && _head(entry) == MUSE_NIL )
+	{
+		_sett( p->mailbox, _tail(entry) );
+		if ( entry == p->mailbox_end )
+			p->mailbox_end = p->mailbox;
+	}
+}
+
+/**
+ * Called by post_message() once it has appended the given entry
+ * to the mailbox of the process.
+ */
+void muse_mailbox_posted( muse_process_frame_t *p, muse_cell entry )
+{
+	if ( p->mailbox_index )
+		index_entry( p->env, p->mailbox_index, entry );
+}
+
+/**
+ * Returns MUSE_TRUE if the message is from \p key or has \p key as its
+ * tag. Every message matches MUSE_NIL.
+ */
+muse_boolean muse_message_matches( muse_env *env, muse_cell msg, muse_cell key )
+{
+	return (key == MUSE_NIL || _head(msg) == key || message_tag( env, msg ) == key) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/**
+ * Takes the oldest message in the mailbox of the process that matches
+ * \p key, which is MUSE_NIL for any message or the pid of a sender or
+ * a tag symbol. Returns MUSE_NIL if there is no such message.
+ */
+muse_cell muse_take_message( muse_env *env, muse_process_frame_t *p, muse_cell key )
+{
+	muse_cell msg = MUSE_NIL;
+
+	drop_taken_entries( env, p );
+
+	if ( key == MUSE_NIL )
+	{
+		muse_cell entry = _tail(p->mailbox);
+
+		if ( entry )
+		{
+			msg = _head(entry);
+			_sett( p->mailbox, _tail(entry) );
+			if ( entry == p->mailbox_end )
+				p->mailbox_end = p->mailbox;
+
+			/* The index may still refer to the entry. */
+			if ( p->mailbox_index )
+				_seth( entry, MUSE_NIL );
+		}
+	}
+	else
+	{
+		muse_mailbox_queue_t *q;
+
+		if ( !p->mailbox_index )
+			p->mailbox_index = create_index( env, p );
+
+		q = find_queue( p->mailbox_index, key );
+
+		if ( q )
+		{
+			drop_taken( env, q );
+
+			if ( q->count > 0 )
+			{
+				muse_cell entry = q->entries[q->head];
+				q->head = (q->head + 1) & (q->capacity - 1);
+				q->count--;
+
+				msg = _head(entry);
+				_seth( entry, MUSE_NIL );
+				drop_taken_entries( env, p );
+			}
+		}
+	}
+
+	return msg;
+}
+
+/**
+ * Marks the entries held by the index, which include received
+ * ones no longer in the mailbox. The keys are not marked - a queue
+ * for a key that has gone is empty and is dropped eventually.
+ */
+void muse_mark_mailbox_index( muse_env *env, muse_process_frame_t *p )
+{
+	muse_mailbox_index_t *ix = p->mailbox_index;
+	int i, j;
+
+	if ( !ix )
+		return;
+
+	for ( i = 0; i < ix->capacity; ++i )
+	{
+		const muse_mailbox_queue_t *q = ix->queues + i;
+
+		for ( j = 0; j < q->count; ++j )
+			muse_mark( env, q->entries[(q->head + j) & (q->capacity - 1)] );
+	}
+}
+
+void muse_destroy_mailbox_index( muse_process_frame_t *p )
+{
+	muse_mailbox_index_t *ix = p->mailbox_index;
+	int i;
+
+	if ( !ix )
+		return;
+
+	for ( i = 0; i < ix->capacity; ++i )
+		free( ix->queues[i].entries );
+
+	free( ix->queues );
+	free( ix );
+	p->mailbox_index = NULL;
+}
@@ -32,14 +32,16 @@
  */
 MUSEAPI muse_int muse_hash_data( const unsigned char *start, const unsigned char *end, muse_int initial )
 {
-	muse_int hash = initial;
+	/* Unsigned, since the hash is meant to wrap around and signed
+	overflow would let the compiler assume it doesn't. */
+	unsigned long long hash = (unsigned long long)initial;
 	
 	for ( ; start < end; ++start )
 	{
 		hash = hash * 65599 + (*start);
 	}
 	
-	return hash;
+	return (muse_int)hash;
 }
 
 /**
@@ -47,14 +49,16 @@ MUSEAPI muse_int muse_hash_data( const unsigned char *start, const unsigned char
  */
 MUSEAPI muse_int muse_hash_text( const muse_char *start, const muse_char *end, muse_int initial )
 {
-	muse_int hash = initial;
+	/* Unsigned, since the hash is meant to wrap around and signed
+	overflow would let the compiler assume it doesn't. */
+	unsigned long long hash = (unsigned long long)initial;
 	
 	for ( ; start < end; ++start )
 	{
 		hash = hash * 65599 + (*start);
 	}
 	
-	return hash;
+	return (muse_int)hash;
 }
 
 /**
@@ -819,32 +823,22 @@ MUSEAPI muse_cell muse_similar_symbol( muse_env *env, muse_cell symbol, int *out
 
 	muse_stack symbols = env->symbol_stack;
 
-	int i;
-	for ( i = 0; i < symbols.size; ++i )
+	muse_cell *s;
+	for ( s = symbols.bottom; s < symbols.top; ++s )
 	{
-		muse_cell symlist = symbols.bottom[i];
+		muse_cell s2 = *s;
+		const muse_char *s2name = muse_symbol_name(env,s2);
 
-		/* Each entry in the symbols hash table is a list of symbols.
-		So traverse the list and examine each symbol. */
-
-		while ( symlist )
+		/* Don't consider comparing the symbol with itself.
+		Ignore operators, special and anonymous symbols. */
+		if ( s2 != symbol && s2name && isalpha(s2name[0]) && (predicate ? predicate(env,context,s2) : MUSE_TRUE) )
 		{
-			muse_cell s2 = _head(symlist);
-			const muse_char *s2name = muse_symbol_name(env,s2);
-
-			/* Don't consider comparing the symbol with itself.
-			Ignore operators and special symbols. */
-			if ( s2 != symbol && isalpha(s2name[0]) && (predicate ? predicate(env,context,s2) : MUSE_TRUE) )
+			int d = (int)levenshtein_distance( s1, s2name );
+			if ( d < distance )
 			{
-				int d = (int)levenshtein_distance( s1, s2name );
-				if ( d < distance )
-				{
-					result = s2;
-					distance = d;
-				}
+				result = s2;
+				distance = d;
 			}
-
-			symlist = _tail(symlist);
 		}
 	}
 
@@ -871,18 +865,11 @@ MUSEAPI muse_cell muse_symbol_with_value( muse_env *env, muse_cell value )
 	has the given cell as its value. */
 
 	muse_stack symbols = env->symbol_stack;
-	int i;
-	for ( i = 0; i < symbols.size; ++i )
+	muse_cell *s;
+	for ( s = symbols.bottom; s < symbols.top; ++s )
 	{
-		muse_cell symlist = symbols.bottom[i];
-		
-		while ( symlist )
-		{
-			muse_cell sym = _next(&symlist);
-
-			if ( _symval(sym) == value ) /* Value found. */
-				return sym;
-		}
+		if ( _symval(*s) == value ) /* Value found. */
+			return *s;
 	}
 
 	return MUSE_NIL;
@@ -96,6 +96,48 @@ typedef struct
 							the next cell pushed on top of the stack. */
 } muse_stack;
 
+/**
+ * An entry of the symbol table. The hash and the length of the
+ * name are kept alongside the symbol so that lookups only
+ * compare the characters of likely matches.
+ */
+typedef struct
+{
+	muse_int		hash;
+	int				length;
+	const muse_char	*name;		/**< The symbol's name text, which never moves. */
+	muse_cell		symbol;		/**< MUSE_NIL for an empty slot. */
+} muse_symbol_slot_t;
+
+/**
+ * The table of named symbols - an open addressing hash table whose
+ * capacity is a power of two. When it gets half full it is replaced by
+ * one of twice the capacity, to which the old slots are moved a few at a
+ * time by subsequent insertions. Lookups look at both until the move
+ * is complete.
+ */
+typedef struct
+{
+	muse_symbol_slot_t	*slots;
+	int					capacity;
+	int					count;			/**< The number of symbols in the table, including those yet to be moved. */
+	muse_symbol_slot_t	*old_slots;		/**< The table being moved out of, or NULL. */
+	int					old_capacity;
+	int					old_pos;		/**< The next old slot to move. */
+} muse_symbol_table_t;
+
+/**
+ * The phases of an incremental garbage collection cycle.
+ * @see MUSE_GC_SLICE_US
+ */
+typedef enum
+{
+	MUSE_GC_IDLE,		/**< No collection cycle is in progress. */
+	MUSE_GC_MARKING,	/**< Reachable cells are being marked a slice at a time. */
+	MUSE_GC_SWEEPING	/**< Marking is complete and unmarked cells are being swept
+							 into the free list a page at a time. */
+} muse_gc_phase_t;
+
 /**
  * The muse heap is an array of cells where the cells available
  * for allocation are collected into a free list.
@@ -114,9 +156,31 @@ typedef struct
 											only for diagnostic purposes. May be removed in the
 											future for efficiency reasons. */
 	unsigned char		*keep;		/**< The keep vector is a set of marks for cells that
-										 must always survive garbage collection. You set a 
+										 must always survive garbage collection. You set a
 										 mark in the keep vector by calling muse_mark() on
 										 the cell *outside* a call to muse_gc(). */
+	unsigned char		*old;		/**< When generational collection is enabled (see
+										 \ref MUSE_GENERATIONAL_GC), this holds a bit for every cell
+										 that survived the last collection. Such "old" cells are
+										 taken to be alive by a minor collection and are not traced.
+										 NULL if generational collection is disabled. */
+	muse_stack			remembered;	/**< The remembered set - old cells that have been modified since
+										 the last collection and may therefore refer to new cells.
+										 A minor collection treats these as roots. */
+	muse_gc_phase_t		gc_phase;	/**< Where the incremental collector (see \ref MUSE_GC_SLICE_US)
+										 is in its cycle. Always MUSE_GC_IDLE if it is disabled. */
+	int					gc_countdown; /**< Number of allocations until the next incremental
+										 collection slice. 0 if incremental collection is disabled. */
+	muse_stack			grey;		/**< Cells that have been marked but whose references haven't been
+										 traced yet, during incremental marking. The write barrier
+										 puts marked cells back here when they are modified. */
+	int					sweep_pos, sweep_end; /**< The range of cells that remains to be swept
+										 during the MUSE_GC_SWEEPING phase. */
+	int					shrink_limit; /**< When > 0, cells at and beyond this index are not put into the
+										 free list, so that the end of the heap can empty out and be released.
+										 @see MUSE_HEAP_SHRINK_COLLECTIONS */
+	muse_boolean		deferred_marking; /**< When MUSE_TRUE, muse_mark() only shades cells for the
+										 parallel marker (see \ref MUSE_GC_MARK_THREADS) to trace. */
 } muse_heap;
 
 /**
@@ -142,6 +206,36 @@ typedef struct
 	muse_trace_t *data;
 } muse_traceinfo_t;
 
+/**
+ * The values a process has given to symbols when it shares the
+ * locals of the main process - an open addressing map from local
+ * indices to values.
+ */
+typedef struct
+{
+	int			capacity;	/**< A power of two, or 0. */
+	int			count;
+	int			*keys;		/**< The local index + 1, or 0 for an empty slot. */
+	muse_cell	*values;
+} muse_local_overrides_t;
+
+/**
+ * A closure call being timed by an exact profile.
+ * @see fn_profile()
+ */
+typedef struct
+{
+	int			entry;
+	muse_boolean outermost;	/**< MUSE_FALSE for recursive calls, which don't add to the time. */
+	muse_int	start_us;
+} muse_profile_frame_t;
+
+typedef struct
+{
+	int depth, capacity;
+	muse_profile_frame_t *frames;
+} muse_profile_frames_t;
+
 typedef enum
 {
 	MUSE_PROCESS_DEAD			= 0x0,
@@ -189,6 +283,9 @@ typedef struct {
 	int top;			/**< The absolute top of the entries available within this context. */
 	int depth;		/**< The total number of history items collected in this context. 
 						 base + depth % MUSE_MAX_RECENT_ITEMS gives the next entry slot. */
+	int quiet;		/**< The number of closure calls sharing this context that
+						 don't use recent values, and so didn't get a context of their own.
+						 While this is non-zero, nothing is added to or found in the context. */
 } recent_context_t;
 
 typedef struct {
@@ -201,12 +298,106 @@ typedef struct {
 	recent_contexts_t contexts;
 } recent_t;
 
+struct _muse_process_frame_t;
+struct _muse_timer_t;
+
+typedef void (*muse_timer_fn_t)( muse_env *env, struct _muse_timer_t *timer );
+
+/**
+ * A deadline kept by the environment's timers. Timers are embedded in
+ * whatever they time and are scheduled and cancelled with 
+ * muse_schedule_timer() and muse_cancel_timer().
+ */
+typedef struct _muse_timer_t
+{
+	muse_int		deadline_us;	/**< When the timer expires, as per the environment's timer. */
+	int				index;			/**< 1 + the timer's position in the heap, or 0 if it isn't scheduled. */
+	muse_timer_fn_t	expire;			/**< Called when the deadline passes. The timer is no longer scheduled by then. */
+	void			*context;
+} muse_timer_t;
+
+/**
+ * All the scheduled timers of an environment, as a min-heap by deadline.
+ */
+typedef struct
+{
+	muse_timer_t	**heap;
+	int				count;
+	int				capacity;
+} muse_timers_t;
+
+/**
+ * Decides which process runs next. Processes that can run wait their
+ * turn in a queue. Processes waiting for a message are not tracked,
+ * except through the timers of those that have a timeout.
+ *
+ * @see switch_to_process()
+ */
+typedef struct
+{
+	struct _muse_process_frame_t *ready_head;	/**< Runnable processes other than the current one, in the order they will run. */
+	struct _muse_process_frame_t *ready_tail;
+} muse_scheduler_t;
+
+enum
+{
+	MUSE_CSTACK_CLASSES		= 12,	/**< Pooled C stacks are 1, 2, 4 ... 2048 pages in size. */
+	MUSE_CSTACK_POOL_LIMIT	= 32	/**< The most unused stacks of a class that are kept for reuse. */
+};
+
+/**
+ * The C stacks of one size for spawned processes.
+ */
+typedef struct
+{
+	int			count;			/**< The number of stacks of this size that exist. */
+	int			num_free;		/**< The number of them in the pool, waiting to be reused. */
+	void		*free[MUSE_CSTACK_POOL_LIMIT];
+	muse_int	spawned;		/**< The number of processes that have used a stack of this size. */
+	int			high_water;		/**< The most cells any finished process used. */
+} muse_cstack_class_t;
+
+typedef struct
+{
+	muse_cstack_class_t classes[MUSE_CSTACK_CLASSES];
+	muse_cstack_class_t	oversized;	/**< Stacks larger than the largest class, which aren't pooled. */
+	muse_stack			retired;	/**< The stack of a process that has just exited, released once off it. */
+} muse_cstack_pool_t;
+
+/**
+ * The messages in a mailbox from one sender or with one tag, oldest
+ * first - a ring of the mailbox entries that hold them. Entries whose
+ * message has already been received are skipped and dropped lazily.
+ */
+typedef struct
+{
+	muse_cell	key;		/**< The pid of the sender or the tag symbol, or MUSE_NIL for an unused slot. */
+	int			head, count, capacity;
+	muse_cell	*entries;
+} muse_mailbox_queue_t;
+
+/**
+ * An open addressing map from senders and tags to the messages in a
+ * mailbox, so that a receive that waits for a particular sender or tag 
+ * doesn't have to look through all the messages ahead of the one it wants.
+ * A process gets one when it first does such a receive.
+ * @see fn_receive()
+ */
+typedef struct
+{
+	int			capacity;	/**< A power of two. */
+	int			count;		/**< The number of used slots. */
+	muse_mailbox_queue_t *queues;
+} muse_mailbox_index_t;
+
 /**
  * A frame is the local environment of a process.
  */
 typedef struct _muse_process_frame_t
 {
 	struct _muse_process_frame_t *next, *prev;
+	struct _muse_process_frame_t *ready_next; ///< The next process in the scheduler's ready queue.
+	muse_boolean ready_queued;	///< MUSE_TRUE while the process is in the ready queue.
 
 	muse_env	*env;
 	int			state_bits;
@@ -214,7 +405,8 @@ typedef struct _muse_process_frame_t
 	int			remaining_attention;
 	int			atomicity;
 	jmp_buf		jmp;
-	muse_int	timeout_us;
+	muse_timer_t wait_timer;	///< Wakes the process up when it waits with a timeout.
+	muse_boolean eval_timeout_due;	///< Set when a with-timeout-us timer of the process has expired.
 	muse_stack	stack;
 	muse_stack	bindings_stack;
 	/**<
@@ -232,14 +424,24 @@ typedef struct _muse_process_frame_t
 	 * A symbol's value is different for each process.
 	 */
 
+	muse_stack	*shared_locals;
+	/**<
+	 * When not NULL, the process has no locals of its own. It uses
+	 * these locals of the main process instead, except for the values
+	 * in its overrides. @see MUSE_SHARED_LOCALS
+	 */
+	muse_local_overrides_t overrides;
+
 	muse_stack	cstack; ///< Holds the C stack pointer. If the pointer is NULL, its the main process.
 
 	muse_cell	thunk;
 	muse_cell	mailbox;
 	muse_cell	mailbox_end;
-	muse_cell	waiting_for_pid;
+	muse_mailbox_index_t *mailbox_index;	///< NULL until the process waits for a particular sender or tag.
+	muse_cell	waiting_for;	///< The pid or tag of the message the process is waiting for, or MUSE_NIL for any message.
 
 	muse_traceinfo_t traceinfo; ///< Holds a finite depth of stack trace information.
+	muse_profile_frames_t profile_frames; ///< The calls in progress when profiling exactly.
 
 	muse_port_t current_port[4]; ///< Per-process current input/output/error ports.
 
@@ -251,6 +453,10 @@ typedef struct _muse_process_frame_t
 	recent_t recent;
 
 	int			num_eval_timeouts;
+	struct _timeout_info_t *live_timeouts;	///< with-timeout-us timeouts not yet collected.
+	struct _muse_image_source_t *image_source;	///< The ports being loaded from images or recorded as images. @see muse_read_source()
+
+	muse_int	cells_allocated;	///< The number of cells allocated by this process.
 } muse_process_frame_t;
 
 typedef struct
@@ -262,6 +468,97 @@ typedef struct
 
 enum { MUSE_MAX_SLOTS = 16 };
 
+/**
+ * Finalization cost accumulated for one kind of special cell.
+ * @see fn_finalizer_stats()
+ */
+typedef struct
+{
+	const muse_functional_object_type_t *type_info; /**< NULL for text cells and destructors. */
+	int					kind;		/**< The cell type - MUSE_TEXT_CELL or MUSE_NATIVEFN_CELL. */
+	int					count;		/**< The number of cells finalized so far. */
+	muse_int			time_us;	/**< Total time spent finalizing them. */
+} muse_finalizer_stats_t;
+
+/**
+ * Cells that need to be finalized when they're garbage collected are
+ * kept in dense arrays segregated by kind, so that the collector can
+ * process them with linear scans.
+ */
+typedef struct
+{
+	muse_stack			texts;		/**< Text cells, whose character buffers must be freed. */
+	muse_stack			objects;	/**< Functional objects. */
+	muse_stack			destructors;/**< Native functions created using muse_mk_destructor(). */
+	int					num_stats, stats_capacity;
+	muse_finalizer_stats_t *stats;	/**< Finalization cost by kind and object type. */
+} muse_finalizers_t;
+
+/**
+ * Text cell contents are allocated in chunks of this size - 
+ * see muse_text.c.
+ */
+enum { MUSE_TEXT_CHUNK_SIZE = 32768, MUSE_NUM_TEXT_SIZE_CLASSES = 4 };
+
+typedef struct _muse_text_chunk_t muse_text_chunk_t;
+
+/**
+ * Storage for the character buffers of text cells.
+ *
+ * Short strings come from per size-class free lists.
+ * Strings created within a text arena (see muse_begin_text_arena())
+ * are bump allocated from a chunk that is released in one go 
+ * once all of its strings have been garbage collected.
+ */
+typedef struct
+{
+	void				*free_blocks[MUSE_NUM_TEXT_SIZE_CLASSES];	/**< Free lists of released blocks, by size class. */
+	muse_text_chunk_t	*class_chunks[MUSE_NUM_TEXT_SIZE_CLASSES];	/**< Chunks from which blocks of each size class are carved. */
+	muse_text_chunk_t	*arena_chunk;	/**< The chunk that the current text arena is allocating from. */
+	int					arena_depth;	/**< Nesting depth of text arenas. 0 when no arena is in effect. */
+} muse_text_storage_t;
+
+enum { MUSE_GC_HISTORY_SIZE = 64 };
+
+/**
+ * Statistics of recent garbage collections.
+ * @see muse_set_gc_callback(), fn_gc_stats()
+ */
+typedef struct
+{
+	muse_gc_stats_t		history[MUSE_GC_HISTORY_SIZE];	/**< A ring buffer of the most recent events. */
+	int					num_events;			/**< The total number of events so far. The latest is at
+											 *   history[(num_events-1) % MUSE_GC_HISTORY_SIZE]. */
+	muse_gc_stats_t		current;			/**< The collection in progress. */
+	muse_int			cells_allocated;	/**< Total number of cells allocated. */
+	muse_int			cells_allocated_at_last_gc;
+	int					low_occupancy_count; /**< Consecutive collections that left the heap below
+											 *   MUSE_HEAP_SHRINK_THRESHOLD% occupancy, or while
+											 *   shrinking, collections that waited for the end
+											 *   of the heap to empty out. */
+	muse_gc_callback_t	callback;
+	void				*callback_context;
+} muse_gc_telemetry_t;
+
+/**
+ * Counts how often closure calls and lazy forcing set up
+ * a scope for recent values and how often they could skip it.
+ * @see fn_recent_stats()
+ */
+typedef struct
+{
+	muse_int	scoped_calls;
+	muse_int	unscoped_calls;
+	muse_int	scoped_forces;
+	muse_int	unscoped_forces;
+} muse_recent_stats_t;
+
+muse_char *muse_text_alloc( muse_env *env, int length );
+void muse_text_free( muse_env *env, muse_char *text );
+int muse_begin_text_arena( muse_env *env );
+void muse_end_text_arena( muse_env *env, int depth );
+void muse_destroy_text_storage( muse_env *env );
+
 /**
  * The muse environment contains all info relevant to
  * evaluation of expressions in muSE.
@@ -271,10 +568,22 @@ enum { MUSE_MAX_SLOTS = 16 };
 struct _muse_env
 {
 	muse_heap			heap;
-	muse_stack			symbol_stack;
+	muse_stack			symbol_stack;	/**< All interned symbols, in the order of interning. Keeps them alive. */
+	muse_symbol_table_t	symbol_table;	/**< Finds named symbols in the symbol_stack by name. */
 	int					num_symbols;
-
-	muse_cell			specials;
+	muse_stack			snapshot_base;	/**< The value and plist each symbol had when muse_snapshot_base() was last called,
+										 *   two entries per symbol in symbol_stack order. */
+
+	muse_finalizers_t	finalizers;
+	muse_text_storage_t	text_storage;
+	muse_gc_telemetry_t	gc_telemetry;
+	muse_recent_stats_t	recent_stats;
+	struct _muse_profile_t *profile;	/**< The profile being collected, if any. @see fn_profile() */
+	volatile int		profile_sample_due;	/**< Set by the sampling timer when the next muse_apply() should take a sample. */
+	muse_boolean		profile_calls;		/**< MUSE_TRUE while closure calls are being counted and timed. */
+	muse_scheduler_t	scheduler;
+	muse_timers_t		timers;
+	muse_cstack_pool_t	cstacks;
 	muse_cell			*builtin_symbols;
 	int					*parameters;
 	void				*stack_base;
@@ -282,6 +591,10 @@ struct _muse_env
 	muse_process_frame_t	*current_process;
 	muse_boolean		collecting_garbage;
 	struct _muse_net_t	*net;
+	struct _muse_workers_t *workers;	/**< Inbox and handles for talking to other environments. @see fn_spawn_worker() */
+	struct _muse_prop_cache_t *prop_cache;	/**< Object property lookups cached by (shape, key). @see fn_new() */
+	struct _muse_regexp_cache_t *regexp_cache;	/**< Compiled regexps by pattern text, used in muse_regexp.cpp. */
+	struct _muse_plist_cache_t *plist_cache;	/**< Hashed indices of long symbol plists. @see muse_get_prop() */
 	muse_port_t			stdports[3];
 	void				*objc_pool;
 
@@ -368,6 +681,18 @@ void muse_push_copy_recent_scope( muse_env *env );
  */
 muse_cell muse_pop_recent_scope( muse_env *env, muse_int key, muse_cell value );
 
+/**
+ * Enter a computation that neither adds to nor uses the recent values,
+ * without setting up a new scope for it.
+ */
+void muse_push_quiet_recent_scope( muse_env *env );
+
+/**
+ * Exit from a computation entered using muse_push_quiet_recent_scope(),
+ * adding the result to the recent values of the current scope.
+ */
+muse_cell muse_pop_quiet_recent_scope( muse_env *env, muse_int key, muse_cell value );
+
 /**
  * Saves the current value of it and reset it to "it".
  * Returns the bindings stack pos before saving it.
@@ -407,6 +732,28 @@ static inline muse_cell _localcell(int ix)
 	return 7 + (ix << 3);
 }
 
+muse_cell muse_shared_local( muse_process_frame_t *p, int ix );
+void muse_set_shared_local( muse_process_frame_t *p, int ix, muse_cell value );
+
+/**
+ * Returns the current process' value of the local with index \p ix.
+ */
+#define _local(ix) op_local(env,ix)
+static inline muse_cell op_local( muse_env *env, int ix )
+{
+	muse_process_frame_t *p = env->current_process;
+	return p->shared_locals ? muse_shared_local( p, ix ) : p->locals.bottom[ix];
+}
+#define _setlocal(ix,value) op_setlocal(env,ix,value)
+static inline void op_setlocal( muse_env *env, int ix, muse_cell value )
+{
+	muse_process_frame_t *p = env->current_process;
+	if ( p->shared_locals )
+		muse_set_shared_local( p, ix, value );
+	else
+		p->locals.bottom[ix] = value;
+}
+
 /**
  * Returns the type of the cell referred to by
  * the given cell reference. The type is encoded in 
@@ -452,10 +799,12 @@ static inline muse_cell_data *op_ptr( muse_env *env, muse_cell cell )
 	muse_assert( _celli(cell) < env->heap.size_cells );
 	return env->heap.cells + _celli(cell);
 }
+muse_cell muse_argv_nativefn_adapter( muse_env *env, void *context, muse_cell args );
+
 #define _fnobjdata(c) op_fnobjdata(env,c)
 static inline muse_functional_object_t *op_fnobjdata( muse_env *env, muse_cell c )
 {
-	if ( _cellt(c) == MUSE_NATIVEFN_CELL )
+	if ( _cellt(c) == MUSE_NATIVEFN_CELL && _ptr(c)->fn.fn != muse_argv_nativefn_adapter )
 	{
 		muse_functional_object_t *d = (muse_functional_object_t*)_ptr(c)->fn.context;
 		if ( d && d->magic_word == 'muSE' )
@@ -464,6 +813,18 @@ static inline muse_functional_object_t *op_fnobjdata( muse_env *env, muse_cell c
 
 	return NULL;
 }
+#define _argvfninfo(c) op_argvfninfo(env,c)
+/**
+ * Returns the description of a native function made by muse_mk_argv_nativefn(),
+ * or NULL if the cell isn't one.
+ */
+static inline const muse_argv_nativefn_info_t *op_argvfninfo( muse_env *env, muse_cell c )
+{
+	if ( _cellt(c) == MUSE_NATIVEFN_CELL && _ptr(c)->fn.fn == muse_argv_nativefn_adapter )
+		return (const muse_argv_nativefn_info_t*)_ptr(c)->fn.context;
+
+	return NULL;
+}
 #define _fnobjview(c,id,fobj) op_fnobjview(env,c,id,&fobj)
 static inline void *op_fnobjview( muse_env *env, muse_cell c, int id, muse_functional_object_t **fobj )
 {
@@ -546,7 +907,7 @@ static inline muse_cell op_head( muse_env *env, muse_cell c )
 {
 	muse_assert( _cellt(c) == MUSE_CONS_CELL || _cellt(c) == MUSE_SYMBOL_CELL || _cellt(c) == MUSE_LAMBDA_CELL || _cellt(c) == MUSE_LAZY_CELL );
 	if ( _cellt(c) == MUSE_SYMBOL_CELL )
-		return 	env->current_process->locals.bottom[_ptr(c)->cons.head >> 3];
+		return _local( _ptr(c)->cons.head >> 3 );
 	else
 		return _ptr(c)->cons.head;
 }
@@ -573,9 +934,40 @@ static inline muse_cell op_next( muse_env *env, muse_cell *c )
 {
 	return muse_head(env,_step(c));
 }
+void muse_remember_cell( muse_env *env, muse_cell c );
+void muse_grey_cell( muse_env *env, muse_cell c );
+void muse_shade( muse_env *env, muse_cell c );
+void muse_gc_step( muse_env *env );
+void muse_reserve_cells( muse_env *env, int n );
+void muse_parallel_mark( muse_env *env, int num_threads );
+/**
+ * The write barrier used for generational and incremental collection.
+ * Every modification of the head or tail of a cell must go through
+ * this so that old cells that come to refer to new cells will
+ * be traced by the next minor collection, and so that cells already
+ * marked by an incremental collection get their references traced again.
+ */
+#define _remember(c) op_remember(env,c)
+static inline void op_remember( muse_env *env, muse_cell c )
+{
+	const unsigned char *old = env->heap.old;
+	if ( old )
+	{
+		int ci = _celli(c);
+		if ( old[ci >> 3] & (1 << (ci & 7)) )
+			muse_remember_cell( env, c );
+	}
+	else if ( env->heap.gc_phase == MUSE_GC_MARKING )
+	{
+		int ci = _celli(c);
+		if ( env->heap.marks[ci >> 3] & (1 << (ci & 7)) )
+			muse_grey_cell( env, c );
+	}
+}
 #define _lpush(h,l) op_lpush(env,h,l)
 static inline void op_lpush( muse_env *env, muse_cell h, muse_cell *l )
 {
+	_remember(h);
 	_ptr(h)->cons.tail = *l;
 	(*l) = h;
 }
@@ -584,6 +976,7 @@ static inline void op_seth( muse_env *env, muse_cell c, muse_cell h )
 {
 	muse_assert( _cellt(c) == MUSE_CONS_CELL || _cellt(c) == MUSE_SYMBOL_CELL || _cellt(c) == MUSE_LAMBDA_CELL );
 	muse_assert( h < 0 || _celli(h) < env->heap.size_cells );
+	_remember(c);
 	_ptr(c)->cons.head = h;
 }
 #define _sett(c,t) op_sett(env,c,t)
@@ -591,6 +984,7 @@ static inline void op_sett( muse_env *env, muse_cell c, muse_cell t )
 {
 	muse_assert( _cellt(c) == MUSE_CONS_CELL || _cellt(c) == MUSE_SYMBOL_CELL || _cellt(c) == MUSE_LAMBDA_CELL );
 	muse_assert( t < 0 || _celli(t) < env->heap.size_cells );
+	_remember(c);
 	_ptr(c)->cons.tail = t;
 }
 #define _setht(c,h,t) op_setht(env,c,h,t)
@@ -600,19 +994,35 @@ static inline void op_setht( muse_env *env, muse_cell c, muse_cell h, muse_cell
 	muse_assert( _cellt(c) == MUSE_CONS_CELL || _cellt(c) == MUSE_SYMBOL_CELL || _cellt(c) == MUSE_LAMBDA_CELL );
 	muse_assert( h < 0 || _celli(h) < env->heap.size_cells );
 	muse_assert( t < 0 || _celli(t) < env->heap.size_cells );
+	_remember(c);
 	p->cons.head = h;
 	p->cons.tail = t;
 }
+/**
+ * Some code walks lists by holding a pointer to the head or
+ * tail slot of a cell (see muse_assoc_iter()). Stores through
+ * such pointers must use _setslot() so that the write barrier
+ * sees them. The slot may also be outside the heap, such as
+ * the bucket array of a hashtable.
+ */
+#define _setslot(slot,v) op_setslot(env,slot,v)
+static inline void op_setslot( muse_env *env, muse_cell *slot, muse_cell v )
+{
+	const char *cells = (const char*)env->heap.cells;
+	if ( (const char*)slot >= cells && (const char*)slot < cells + env->heap.size_cells * sizeof(muse_cell_data) )
+		_remember( _cellati( (int)(((const char*)slot - cells) / sizeof(muse_cell_data)) ) );
+	(*slot) = v;
+}
 #define _define(symbol,value) op_define(env,symbol,value)
 static inline muse_cell op_define( muse_env *env, muse_cell symbol, muse_cell value )
 {
-	env->current_process->locals.bottom[_ptr(symbol)->cons.head >> 3] = value;
+	_setlocal( _ptr(symbol)->cons.head >> 3, value );
 	return value;
 }
 #define _symval(symbol) op_symval(env,symbol)
 static inline muse_cell op_symval( muse_env *env, muse_cell symbol )
 {
-	return env->current_process->locals.bottom[_ptr(symbol)->cons.head >> 3];
+	return _local( _ptr(symbol)->cons.head >> 3 );
 }
 #define _bspos() op_bspos(env)
 static inline int op_bspos(muse_env *env)
@@ -674,9 +1084,12 @@ static inline int _iscompound( muse_cell c )
 #define _takefreecell() op_takefreecell(env)
 static inline muse_cell op_takefreecell(muse_env *env)
 {
-	muse_cell c;
-	c = _step( &(env->heap.free_cells) );
-	_sett(c,MUSE_NIL);
+	/* Free cells are linked through their tails and are never lazy.
+	The write barrier is left to the _setht() that always follows. */
+	muse_cell c = env->heap.free_cells;
+	muse_cell_data *p = _ptr(c);
+	env->heap.free_cells = p->cons.tail;
+	p->cons.tail = MUSE_NIL;
 	env->heap.free_cell_count--;
 	return c;
 }
@@ -684,6 +1097,13 @@ static inline muse_cell op_takefreecell(muse_env *env)
 static inline void op_returncell( muse_env *env, muse_cell c )
 {
 	muse_cell *f = &env->heap.free_cells;
+
+	/* The cell may be old or on the remembered set, so with
+	generational collection we leave it for the collector. It may
+	also be waiting on the grey stack of an incremental collection. */
+	if ( env->heap.old || env->heap.gc_phase == MUSE_GC_MARKING )
+		return;
+
 	_setht(c, MUSE_NIL, *f);
 	(*f) = c;
 	env->heap.free_cell_count++;
@@ -702,11 +1122,13 @@ static inline muse_cell _quq( muse_cell c )
 #define _mk_int(i) muse_mk_int(env,i)
 #define _mk_float(f) muse_mk_float(env,f)
 #define _mk_nativefn(fn,ctxt) muse_mk_nativefn(env,fn,ctxt)
+#define _mk_argv_nativefn(info) muse_mk_argv_nativefn(env,info)
 #define _mk_destructor(fn,ctxt) muse_mk_destructor(env,fn,ctxt)
 #define _mk_functional_object(type,args) muse_mk_functional_object(env,type,args)
 #define _mk_anon_symbol() muse_mk_anon_symbol(env)
 #define _builtin_symbol(s) muse_builtin_symbol(env,s)
 #define _evalnext(argsptr) muse_evalnext(env,argsptr)
+#define _argv(i) ((i) < argc ? argv[i] : MUSE_NIL) /**< The i-th argument of a muse_argv_nativefn_t, or () if there aren't that many. */
 #define _eval(expr) muse_eval(env,expr,MUSE_FALSE)
 #define _compare(a,b) muse_compare(env,a,b)
 #define _list_length(l) muse_list_length(env,l)
@@ -725,11 +1147,38 @@ static inline muse_cell _quq( muse_cell c )
 #define _stdport(d) muse_stdport(env,d)
 #define _assign_port(f,mode) muse_assign_port(env,f,mode)
 
+/* C stacks of spawned processes. */
+muse_boolean muse_alloc_cstack( muse_env *env, muse_stack *s, int size );
+void muse_release_cstack( muse_env *env, muse_stack *s );
+int muse_cstack_used( muse_env *env, const muse_stack *s );
+int muse_cstack_class_cells( int k );
+void muse_retire_cstack( muse_env *env, muse_stack *s );
+void muse_release_retired_cstack( muse_env *env );
+void muse_destroy_cstacks( muse_env *env );
+
+/* Mailboxes. */
+void muse_mailbox_posted( muse_process_frame_t *p, muse_cell entry );
+muse_boolean muse_message_matches( muse_env *env, muse_cell msg, muse_cell key );
+muse_cell muse_take_message( muse_env *env, muse_process_frame_t *p, muse_cell key );
+void muse_mark_mailbox_index( muse_env *env, muse_process_frame_t *p );
+void muse_destroy_mailbox_index( muse_process_frame_t *p );
+
+/* Timers. */
+void muse_schedule_timer( muse_env *env, muse_timer_t *timer, muse_int deadline_us );
+void muse_cancel_timer( muse_env *env, muse_timer_t *timer );
+muse_boolean muse_expire_timers( muse_env *env );
+muse_int muse_next_deadline_us( muse_env *env );
+void muse_destroy_timers( muse_env *env );
+
 /* Process functions. */
-muse_process_frame_t *create_process( muse_env *env, int attention, muse_cell thunk, void *sp );
+muse_process_frame_t *create_process( muse_env *env, int attention, muse_cell thunk, void *sp, int stack_size );
 muse_process_frame_t *init_process_mailbox( muse_process_frame_t *p );
 muse_boolean prime_process( muse_process_frame_t *process );
 muse_boolean switch_to_process( muse_env *env, muse_process_frame_t *process );
+muse_boolean run_next_process( muse_env *env );
+void park_process( muse_env *env, muse_int deadline_us );
+void suspend_process( muse_env *env, muse_int deadline_us );
+void wake_process( muse_env *env, muse_process_frame_t *p );
 void yield_process( muse_env *env, int spent_attention );
 muse_boolean procrastinate( muse_env *env );
 muse_boolean remove_process( muse_process_frame_t *process );
@@ -739,9 +1188,11 @@ void mark_process( muse_process_frame_t *p );
 void free_process( muse_process_frame_t *p );
 muse_cell fn_pid( muse_env *env, muse_process_frame_t *process, muse_cell args );
 void post_message( muse_process_frame_t *process, muse_cell msg );
+void post_message_from( muse_process_frame_t *process, muse_cell msg, muse_cell from );
 void enter_atomic(muse_env *env);
 void leave_atomic(muse_env *env);
 void push_timeout( muse_env *env, muse_cell id, muse_int timeout_us );
+void pop_timeout( muse_env *env );
 void check_timeout( muse_env *env );
 
 /* Converts the given 16-bit unicode char to utf8 and stores
@@ -755,6 +1206,57 @@ void destroy_objc_bridge( muse_env *env );
 
 muse_cell meta_getname( muse_env *env, muse_cell fn );
 muse_cell meta_putname( muse_env *env, muse_cell fn, muse_cell name );
+muse_cell object_plist( muse_env *env, muse_cell obj );
+muse_cell object_supers( muse_env *env, muse_cell obj );
+void object_assign( muse_env *env, muse_cell obj, muse_cell supers, muse_cell plist );
+void muse_destroy_prop_cache( muse_env *env );
+void muse_destroy_regexp_cache( muse_env *env );
+void muse_plist_mark( muse_env *env );
+void muse_destroy_plist_cache( muse_env *env );
+muse_cell module_contents( muse_env *env, muse_cell mod );
+muse_cell mk_module( muse_env *env );
+void module_assign( muse_env *env, muse_cell mod, muse_cell contents );
+
+/* Compiled closure bodies. */
+muse_cell muse_apply_nativefn( muse_env *env, muse_cell fn, muse_cell args );
+void muse_compile_lambda( muse_env *env, muse_cell fn );
+muse_cell muse_compiled_code( muse_env *env, muse_cell fn );
+muse_boolean muse_is_compiled_code( muse_env *env, muse_cell c );
+muse_boolean muse_bind_compiled_formals( muse_env *env, muse_cell code, muse_cell formals, muse_cell args );
+muse_cell muse_run_compiled_code( muse_env *env, muse_cell code );
+muse_boolean muse_compiled_code_uses_recent( muse_env *env, muse_cell code );
+
+/* Pre-parsed code images. */
+muse_boolean muse_is_image_port( muse_port_t p );
+muse_cell muse_load_image( muse_port_t p );
+muse_cell muse_read_source( muse_port_t p );
+muse_boolean muse_is_snapshot_port( muse_port_t p );
+muse_cell muse_load_snapshot( muse_port_t p );
+muse_cell muse_load_cached( muse_env *env, muse_cell filename, FILE *f );
+void muse_sha1_digest( const void *bytes, size_t size, unsigned char digest[20] );
+
+/* Profiling. */
+void muse_profile_sample( muse_env *env, muse_cell fn );
+int muse_profile_enter( muse_env *env, muse_cell fn );
+void muse_profile_leave( muse_env *env, int depth );
+void muse_profile_mark( muse_env *env );
+void muse_destroy_profiler( muse_env *env );
+
+/* Network. */
+muse_boolean muse_wait_for_network( muse_env *env, muse_int wait_us );
+void muse_poll_network( muse_env *env );
+
+/* Workers. */
+muse_boolean muse_is_worker( muse_env *env, muse_cell worker );
+muse_cell muse_post_to_worker( muse_env *env, muse_cell worker, muse_cell msg );
+void muse_receive_worker_messages( muse_env *env );
+muse_boolean muse_wait_for_worker_messages( muse_env *env, muse_int wait_us );
+#ifndef MUSE_PLATFORM_WINDOWS
+muse_boolean muse_begin_worker_wait( muse_env *env, int *fd );
+void muse_end_worker_wait( muse_env *env );
+#endif
+void muse_mark_workers( muse_env *env );
+void muse_destroy_workers( muse_env *env );
 
 END_MUSE_C_FUNCTIONS
 
@@ -0,0 +1,375 @@
+/**
+ * @file muse_parallel_mark.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * The parallel marker used by stop-the-world collections when
+ * \ref MUSE_GC_MARK_THREADS is > 1. The mutator is stopped while this
+ * runs, so the threads only ever write to the marks bitmap, which they
+ * do using an atomic test-and-set.
+ *
+ * Each thread traces cells from its own mark stack. A thread with plenty
+ * of work moves a batch of cells into its "steal" area when some other
+ * thread has run dry, from where the idle threads take it.
+ *
+ * The threads only trace cons structure. The mark functions of functional
+ * objects are arbitrary code and are therefore called by the collecting
+ * thread between rounds, with muse_mark() redirected to the grey stack.
+ */
+
+#include "muse_opcodes.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef MUSE_PLATFORM_WINDOWS
+#	include <intrin.h>
+	typedef HANDLE mark_thread_t;
+	typedef volatile LONG mark_atomic_t;
+#	define atomic_test_and_set_bit(b,m)	((_InterlockedOr8( (volatile char*)(b), (char)(m) ) & (m)) != 0)
+#	define atomic_add(a,n)				InterlockedExchangeAdd( (a), (n) )
+#	define spin_try_lock(l)				(InterlockedExchange( (l), 1 ) == 0)
+#	define spin_unlock(l)				InterlockedExchange( (l), 0 )
+#	define yield_cpu()					SwitchToThread()
+#else
+#	include <pthread.h>
+#	include <sched.h>
+	typedef pthread_t mark_thread_t;
+	typedef volatile int mark_atomic_t;
+#	define atomic_test_and_set_bit(b,m)	((__sync_fetch_and_or( (b), (unsigned char)(m) ) & (m)) != 0)
+#	define atomic_add(a,n)				__sync_fetch_and_add( (a), (n) )
+#	define spin_try_lock(l)				(__sync_lock_test_and_set( (l), 1 ) == 0)
+#	define spin_unlock(l)				__sync_lock_release(l)
+#	define yield_cpu()					sched_yield()
+#endif
+
+enum
+{
+	MUSE_MARK_STEAL_CELLS = 256	/**< The number of cells handed over to an idle thread at a time. */
+};
+
+struct _mark_shared_t;
+
+/**
+ * State of one marking thread.
+ */
+typedef struct
+{
+	muse_env				*env;
+	struct _mark_shared_t	*shared;
+	int						index;
+	mark_thread_t			thread;
+
+	muse_stack				stack;		/**< Marked cells whose references are yet to be traced. */
+	muse_stack				objects;	/**< Marked functional objects with a mark function. */
+
+	mark_atomic_t			steal_lock;
+	volatile int			steal_count;
+	muse_cell				steal[MUSE_MARK_STEAL_CELLS];
+} mark_worker_t;
+
+typedef struct _mark_shared_t
+{
+	int					num_workers;
+	mark_worker_t		*workers;
+	mark_atomic_t		active;		/**< The number of threads that have, or may be about to get, work. */
+} mark_shared_t;
+
+static void init_mark_stack( muse_stack *s, int size )
+{
+	s->size = size;
+	s->bottom = s->top = (muse_cell*)malloc( sizeof(muse_cell) * size );
+}
+
+static void push_cell( muse_stack *s, muse_cell c )
+{
+	if ( s->top - s->bottom >= s->size )
+	{
+		int n = (int)(s->top - s->bottom);
+		s->size *= 2;
+		s->bottom = (muse_cell*)realloc( s->bottom, sizeof(muse_cell) * s->size );
+		s->top = s->bottom + n;
+	}
+
+	*(s->top++) = c;
+}
+
+/**
+ * Marks the cell and returns MUSE_TRUE if this thread is
+ * the one that marked it.
+ */
+static muse_boolean claim_cell( muse_env *env, muse_cell c )
+{
+	int ci = _celli(c);
+	unsigned char *m = env->heap.marks + (ci >> 3);
+	int bit = 1 << (ci & 7);
+
+	if ( (*m) & bit )
+		return MUSE_FALSE;
+
+	return atomic_test_and_set_bit( m, bit ) ? MUSE_FALSE : MUSE_TRUE;
+}
+
+static void trace_ref( mark_worker_t *w, muse_cell c )
+{
+	if ( c > 0 && claim_cell( w->env, c ) )
+		push_cell( &w->stack, c );
+}
+
+/**
+ * Moves all of the cells in the victim's steal area
+ * to the worker's own mark stack.
+ */
+static muse_boolean steal_from( mark_worker_t *w, mark_worker_t *victim )
+{
+	muse_boolean stolen = MUSE_FALSE;
+
+	/* The steal count is peeked at without the lock, but
+	cells are only moved while holding it. */
+	if ( victim->steal_count == 0 || !spin_try_lock( &victim->steal_lock ) )
+		return MUSE_FALSE;
+
+	while ( victim->steal_count > 0 )
+	{
+		push_cell( &w->stack, victim->steal[--victim->steal_count] );
+		stolen = MUSE_TRUE;
+	}
+
+	spin_unlock( &victim->steal_lock );
+	return stolen;
+}
+
+/**
+ * Hands a batch of cells from the top of the worker's mark
+ * stack over to its steal area if it is empty.
+ */
+static void share_work( mark_worker_t *w )
+{
+	if ( w->steal_count == 0 && spin_try_lock( &w->steal_lock ) )
+	{
+		if ( w->steal_count == 0 )
+		{
+			w->stack.top -= MUSE_MARK_STEAL_CELLS;
+			memcpy( w->steal, w->stack.top, sizeof(w->steal) );
+			w->steal_count = MUSE_MARK_STEAL_CELLS;
+		}
+
+		spin_unlock( &w->steal_lock );
+	}
+}
+
+static muse_boolean find_work( mark_worker_t *w )
+{
+	mark_shared_t *shared = w->shared;
+	int i;
+
+	/* Take back our own cells first. */
+	if ( w->steal_count > 0 )
+	{
+		while ( !spin_try_lock( &w->steal_lock ) )
+			yield_cpu();
+
+		while ( w->steal_count > 0 )
+			push_cell( &w->stack, w->steal[--w->steal_count] );
+
+		spin_unlock( &w->steal_lock );
+	}
+
+	if ( w->stack.top > w->stack.bottom )
+		return MUSE_TRUE;
+
+	for ( i = 1; i < shared->num_workers; ++i )
+	{
+		if ( steal_from( w, shared->workers + (w->index + i) % shared->num_workers ) )
+			return MUSE_TRUE;
+	}
+
+	/* We're out of work. A steal area can only have cells in it
+	while its owner is active, so once there are no active threads,
+	marking is complete. */
+	atomic_add( &shared->active, -1 );
+
+	while ( shared->active > 0 )
+	{
+		for ( i = 1; i < shared->num_workers; ++i )
+		{
+			mark_worker_t *victim = shared->workers + (w->index + i) % shared->num_workers;
+
+			if ( victim->steal_count > 0 )
+			{
+				atomic_add( &shared->active, 1 );
+
+				if ( steal_from( w, victim ) )
+					return MUSE_TRUE;
+
+				atomic_add( &shared->active, -1 );
+			}
+		}
+
+		yield_cpu();
+	}
+
+	return MUSE_FALSE;
+}
+
+static void mark_worker( mark_worker_t *w )
+{
+	muse_env *env = w->env;
+	mark_shared_t *shared = w->shared;
+
+	do
+	{
+		while ( w->stack.top > w->stack.bottom )
+		{
+			muse_cell c = *(--w->stack.top);
+
+			if ( _iscompound(c) )
+			{
+				trace_ref( w, _quq(_head(c)) );
+				trace_ref( w, _quq(_tail(c)) );
+			}
+			else
+			{
+				muse_functional_object_t *obj = _fnobjdata(c);
+				if ( obj && obj->type_info->mark )
+					push_cell( &w->objects, c );
+			}
+
+			if ( shared->active < shared->num_workers && w->stack.top - w->stack.bottom > 2 * MUSE_MARK_STEAL_CELLS )
+				share_work( w );
+		}
+	}
+	while ( find_work( w ) );
+}
+
+#ifdef MUSE_PLATFORM_WINDOWS
+static DWORD WINAPI mark_thread_proc( LPVOID w )
+{
+	mark_worker( (mark_worker_t*)w );
+	return 0;
+}
+#else
+static void *mark_thread_proc( void *w )
+{
+	mark_worker( (mark_worker_t*)w );
+	return NULL;
+}
+#endif
+
+/**
+ * Traces all the cells on the grey stack using the
+ * workers, one of them being the calling thread.
+ */
+static void mark_round( mark_shared_t *shared, muse_stack *grey )
+{
+	int i, n = shared->num_workers;
+	int started = 1;
+
+	/* Deal the grey cells out to the workers. */
+	for ( i = 0; grey->top > grey->bottom; i = (i + 1) % n )
+		push_cell( &shared->workers[i].stack, *(--grey->top) );
+
+	shared->active = n;
+
+	for ( i = 1; i < n; ++i, ++started )
+	{
+		mark_worker_t *w = shared->workers + i;
+#ifdef MUSE_PLATFORM_WINDOWS
+		w->thread = CreateThread( NULL, 0, mark_thread_proc, w, 0, NULL );
+		if ( w->thread == NULL )
+			break;
+#else
+		if ( pthread_create( &w->thread, NULL, mark_thread_proc, w ) != 0 )
+			break;
+#endif
+	}
+
+	/* If we couldn't start all the threads, this thread takes over
+	the cells dealt to the ones that didn't start and the active
+	count must not include them. */
+	if ( started < n )
+	{
+		for ( i = started; i < n; ++i )
+		{
+			mark_worker_t *w = shared->workers + i;
+			while ( w->stack.top > w->stack.bottom )
+				push_cell( &shared->workers[0].stack, *(--w->stack.top) );
+		}
+
+		atomic_add( &shared->active, started - n );
+	}
+
+	mark_worker( shared->workers );
+
+	for ( i = 1; i < started; ++i )
+	{
+#ifdef MUSE_PLATFORM_WINDOWS
+		WaitForSingleObject( shared->workers[i].thread, INFINITE );
+		CloseHandle( shared->workers[i].thread );
+#else
+		pthread_join( shared->workers[i].thread, NULL );
+#endif
+	}
+}
+
+/**
+ * Marks everything reachable from the cells on the grey stack
+ * using \p num_threads threads. The grey cells must already be marked.
+ * Returns with the grey stack empty.
+ *
+ * The references held by functional objects are marked by calling their
+ * mark functions from this thread with heap.deferred_marking set, so
+ * that muse_mark() only shades the cells and the next round traces them.
+ */
+void muse_parallel_mark( muse_env *env, int num_threads )
+{
+	muse_heap *heap = _heap();
+	mark_shared_t shared;
+	int i;
+
+	shared.num_workers	= num_threads;
+	shared.workers		= (mark_worker_t*)calloc( num_threads, sizeof(mark_worker_t) );
+	shared.active		= 0;
+
+	for ( i = 0; i < num_threads; ++i )
+	{
+		mark_worker_t *w = shared.workers + i;
+		w->env		= env;
+		w->shared	= &shared;
+		w->index	= i;
+		init_mark_stack( &w->stack, 4 * MUSE_MARK_STEAL_CELLS );
+		init_mark_stack( &w->objects, 64 );
+	}
+
+	heap->deferred_marking = MUSE_TRUE;
+
+	while ( heap->grey.top > heap->grey.bottom )
+	{
+		mark_round( &shared, &heap->grey );
+
+		for ( i = 0; i < num_threads; ++i )
+		{
+			muse_stack *objects = &shared.workers[i].objects;
+
+			while ( objects->top > objects->bottom )
+			{
+				muse_functional_object_t *obj = _fnobjdata( *(--objects->top) );
+				obj->type_info->mark( env, obj );
+			}
+		}
+	}
+
+	heap->deferred_marking = MUSE_FALSE;
+
+	for ( i = 0; i < num_threads; ++i )
+	{
+		free( shared.workers[i].stack.bottom );
+		free( shared.workers[i].objects.bottom );
+	}
+
+	free( shared.workers );
+}
@@ -95,6 +95,14 @@ typedef long long longlong_t;
 #define MUSEAPI
 #endif
 
+#ifdef _MSC_VER
+#	define MUSE_THREAD_LOCAL __declspec(thread)
+#	define MUSE_NOINLINE __declspec(noinline)
+#else
+#	define MUSE_THREAD_LOCAL __thread
+#	define MUSE_NOINLINE __attribute__((noinline))
+#endif
+
 #ifdef MUSE_DEBUG_BUILD
 BEGIN_MUSE_C_FUNCTIONS
 	MUSEAPI void muse_assert_failed( void *env, const char *file, int line, const char *condtext );
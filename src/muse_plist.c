@@ -10,6 +10,8 @@
  */
 
 #include "muse_opcodes.h"
+#include <stdlib.h>
+#include <memory.h>
 
 /**
  * Returns the property list of the given symbol.
@@ -39,12 +41,13 @@ MUSEAPI muse_cell muse_symbol_plist( muse_env *env, muse_cell sym )
  */
 MUSEAPI muse_cell muse_assoc( muse_env *env, muse_cell alist, muse_cell prop )
 {
-	if ( !alist )
-		return MUSE_NIL;
-	else if ( muse_equal( env, _head(_head(alist)), prop ) )
-		return _head(alist);
-	else
-		return muse_assoc( env, _tail(alist), prop );
+	for ( ; alist; alist = _tail(alist) )
+	{
+		if ( muse_equal( env, _head(_head(alist)), prop ) )
+			return _head(alist);
+	}
+
+	return MUSE_NIL;
 }
 
 /**
@@ -77,23 +80,210 @@ MUSEAPI muse_cell muse_assoc( muse_env *env, muse_cell alist, muse_cell prop )
  */
 muse_cell *muse_assoc_iter( muse_env *env, muse_cell *alist, muse_cell prop )
 {
-	if ( !*alist )
-		return alist;
-	else if ( muse_equal( env, _head(_head(*alist)), prop ) )
-		return alist;
-	else
-		return muse_assoc_iter( env, &_ptr(*alist)->cons.tail, prop );
+	while ( *alist && !muse_equal( env, _head(_head(*alist)), prop ) )
+		alist = &_ptr(*alist)->cons.tail;
+
+	return alist;
+}
+
+/**
+ * @name Hashed plists
+ *
+ * Symbols that carry many properties, such as documented library
+ * functions, get a hash index over their plist so that looking up
+ * a symbol-keyed property doesn't have to walk the list. The plist
+ * itself stays the ordinary assoc list that everybody else sees -
+ * the index maps property keys to its key-value pairs.
+ *
+ * Indices are kept in a small direct mapped table per environment,
+ * chosen by symbol. Each is valid for the list it was built from,
+ * which is known by its first cell. Properties added by muse_put_prop()
+ * go to the front of the list and into the index together. When a
+ * symbol's plist is replaced wholesale, its first cell changes and the
+ * index is built afresh the next time it is needed. The first cells of
+ * indexed lists are marked during gc so that they can't be reused for
+ * another list while the index refers to them. Plists are not expected
+ * to be spliced in the middle.
+ */
+/*@{*/
+
+enum
+{
+	PLIST_HASH_MIN_LENGTH	= 8,	/**< Shorter plists are only ever searched in order. */
+	PLIST_CACHE_BITS		= 8,
+	PLIST_CACHE_SIZE		= 1 << PLIST_CACHE_BITS
+};
+
+typedef struct
+{
+	muse_cell	head;		/**< The plist indexed, or MUSE_NIL if this slot is unused. */
+	int			count;		/**< Number of keys in the index. */
+	int			mask;		/**< Size of the table - 1, always a power of 2 - 1. */
+	muse_cell	*pairs;		/**< Open addressed by key, MUSE_NIL for empty. */
+} plist_index_t;
+
+typedef struct _muse_plist_cache_t
+{
+	plist_index_t indices[PLIST_CACHE_SIZE];
+} muse_plist_cache_t;
+
+static plist_index_t *plist_index( muse_env *env, muse_cell sym )
+{
+	if ( !env->plist_cache )
+		env->plist_cache = (muse_plist_cache_t*)calloc( 1, sizeof(muse_plist_cache_t) );
+
+	return env->plist_cache->indices + ((((unsigned int)sym) * 2654435761u) >> (32 - PLIST_CACHE_BITS));
+}
+
+static int plist_slot( plist_index_t *ix, muse_cell key )
+{
+	return (int)((((unsigned int)key) * 2654435761u) >> 7) & ix->mask;
+}
+
+static muse_cell plist_index_find( muse_env *env, plist_index_t *ix, muse_cell key )
+{
+	int i = plist_slot( ix, key );
+
+	while ( ix->pairs[i] && _head(ix->pairs[i]) != key )
+		i = (i + 1) & ix->mask;
+
+	return ix->pairs[i];
+}
+
+/**
+ * Adds the pair to the index unless its key is already there,
+ * in which case the pair that's already there comes first
+ * in the plist and is the one that lookups must find.
+ */
+static void plist_index_add( muse_env *env, plist_index_t *ix, muse_cell pair )
+{
+	muse_cell key = _head(pair);
+	int i = plist_slot( ix, key );
+
+	while ( ix->pairs[i] )
+	{
+		if ( _head(ix->pairs[i]) == key )
+			return;
+		i = (i + 1) & ix->mask;
+	}
+
+	ix->pairs[i] = pair;
+	++ix->count;
 }
 
+/**
+ * Rebuilds the index for the given list, with room for
+ * it to grow to twice its length before the next rebuild.
+ */
+static void plist_index_build( muse_env *env, plist_index_t *ix, muse_cell plist, int length )
+{
+	int size = 16;
+	muse_cell l;
+
+	while ( size < 4 * length )
+		size *= 2;
+
+	if ( size - 1 != ix->mask )
+	{
+		free( ix->pairs );
+		ix->pairs = (muse_cell*)malloc( size * sizeof(muse_cell) );
+		ix->mask = size - 1;
+	}
+
+	memset( ix->pairs, 0, size * sizeof(muse_cell) );
+	ix->head = plist;
+	ix->count = 0;
+
+	/* Only symbol keys are indexed. A symbol is muse_equal()
+	only to itself, so other keys can't match a symbol property. */
+	for ( l = plist; l; l = _tail(l) )
+	{
+		muse_cell key = _head(_head(l));
+		if ( key && _cellt(key) == MUSE_SYMBOL_CELL )
+			plist_index_add( env, ix, _head(l) );
+	}
+}
+
+/**
+ * Marks the lists that the plist indices refer to.
+ * Called by the gc with the other roots.
+ */
+void muse_plist_mark( muse_env *env )
+{
+	int i;
+
+	if ( !env->plist_cache )
+		return;
+
+	for ( i = 0; i < PLIST_CACHE_SIZE; ++i )
+	{
+		if ( env->plist_cache->indices[i].head )
+			muse_mark( env, env->plist_cache->indices[i].head );
+	}
+}
+
+/**
+ * Frees the plist indices. Called as the environment is destroyed.
+ */
+void muse_destroy_plist_cache( muse_env *env )
+{
+	int i;
+
+	if ( !env->plist_cache )
+		return;
+
+	for ( i = 0; i < PLIST_CACHE_SIZE; ++i )
+		free( env->plist_cache->indices[i].pairs );
+
+	free( env->plist_cache );
+	env->plist_cache = NULL;
+}
+
+/**
+ * Finds a symbol-keyed property, using and if necessary building
+ * the index of the symbol's plist when the plist is long enough.
+ */
+static muse_cell plist_get( muse_env *env, muse_cell sym, muse_cell plist, muse_cell prop )
+{
+	plist_index_t *ix = plist_index( env, sym );
+	muse_cell l = plist;
+	int length = 0;
+
+	if ( ix->head == plist )
+		return plist_index_find( env, ix, prop );
+
+	for ( ; l && length < PLIST_HASH_MIN_LENGTH; l = _tail(l), ++length )
+	{
+		if ( _head(_head(l)) == prop )
+			return _head(l);
+	}
+
+	if ( !l )
+		return MUSE_NIL;
+
+	for ( ; l; l = _tail(l) )
+		++length;
+
+	plist_index_build( env, ix, plist, length );
+	return plist_index_find( env, ix, prop );
+}
+/*@}*/
+
 /**
  * Looks up the given property in the given symbol's
  * property list. The return value is the pair whose
  * head is the property key and the tail is the property
- * value.
+ * value. Symbol properties of long plists are looked up
+ * through a hash index of the plist.
  */
 MUSEAPI muse_cell muse_get_prop( muse_env *env, muse_cell sym, muse_cell prop )
 {
-	return muse_assoc( env, muse_symbol_plist(env, sym), prop );
+	muse_cell plist = muse_symbol_plist(env, sym);
+
+	if ( plist && prop && _cellt(prop) == MUSE_SYMBOL_CELL )
+		return plist_get( env, sym, plist, prop );
+
+	return muse_assoc( env, plist, prop );
 }
 
 /**
@@ -114,8 +304,25 @@ MUSEAPI muse_cell muse_put_prop( muse_env *env, muse_cell sym, muse_cell prop, m
 		_sett( p, value );
 	else
 	{
+		muse_cell plist = _tail(_tail(sym));
 		p = _cons(prop,value);
-		_sett( _tail(sym), _cons( p, _tail(_tail(sym)) ) );
+		_sett( _tail(sym), _cons( p, plist ) );
+
+		/* Keep the plist's index, if it has one, in step. */
+		if ( plist && env->plist_cache && prop && _cellt(prop) == MUSE_SYMBOL_CELL )
+		{
+			plist_index_t *ix = plist_index( env, sym );
+			if ( ix->head == plist )
+			{
+				if ( 2 * (ix->count + 1) > ix->mask + 1 )
+					plist_index_build( env, ix, _tail(_tail(sym)), ix->count + 1 );
+				else
+				{
+					plist_index_add( env, ix, p );
+					ix->head = _tail(_tail(sym));
+				}
+			}
+		}
 	}
 	return p;
 }
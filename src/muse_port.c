@@ -15,6 +15,11 @@
 #include <string.h>
 #include <stdlib.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define MUSE_PORT_SSE2 1
+#	include <emmintrin.h>
+#endif
+
 /** @addtogroup Ports */
 /*@{*/
 
@@ -39,7 +44,7 @@ static void port_init_buffer( muse_port_buffer_t *buffer )
 
 static void port_destroy_buffer( muse_port_buffer_t *buffer )
 {
-	if ( buffer->bytes )
+	if ( buffer->bytes && !buffer->mapped )
 		free(buffer->bytes);
 	
 	memset( buffer, 0, sizeof(muse_port_buffer_t) );
@@ -47,6 +52,43 @@ static void port_destroy_buffer( muse_port_buffer_t *buffer )
 
 #define portfn(p,fn) ((muse_port_type_t*)((muse_functional_object_t*)p)->type_info)->fn
 
+/**
+ * Moves a position in the buffer on by \p n bytes. Only a ring buffer
+ * wraps around - a window onto mapped data doesn't.
+ */
+static int buffer_step( const muse_port_buffer_t *b, int pos, int n )
+{
+	return b->mapped ? pos + n : ((pos + n) & PORT_BUFFER_MASK);
+}
+
+/**
+ * Points the input buffer of a port that maps its data at the data
+ * from the current position on, giving up the ring buffer the first
+ * time round. Returns the number of bytes now buffered, which is 0
+ * at the end of the stream.
+ */
+static int port_map_input( muse_port_base_t *p )
+{
+	muse_port_buffer_t *in = &p->in;
+	int n = 0;
+	const unsigned char *window = portfn(p,map)( p, in->fpos, &n );
+
+	if ( window == NULL || n <= 0 )
+		return 0;
+
+	if ( !in->mapped )
+	{
+		free( in->bytes );
+		in->mapped = 1;
+	}
+
+	in->bytes	= (unsigned char*)window;
+	in->size	= n;
+	in->pos		= 0;
+	in->avail	= n;
+	return n;
+}
+
 /**
  * Intended to be called inside a particular port's init function
  * at port creation time. Sets up the port's buffers.
@@ -116,7 +158,7 @@ int	port_getc( muse_port_base_t *p )
 	if ( b->avail > 0 )
 	{
 		int result = b->bytes[b->pos];
-		b->pos = (b->pos + 1) & PORT_BUFFER_MASK;
+		b->pos = buffer_step( b, b->pos, 1 );
 		--(b->avail);
 		++(b->fpos);
 
@@ -130,6 +172,17 @@ int	port_getc( muse_port_base_t *p )
 		return result;
 	}
 	
+	if ( portfn(p,map) )
+	{
+		if ( port_map_input(p) == 0 )
+		{
+			p->eof = EOF;
+			return EOF;
+		}
+
+		return port_getc( p );
+	}
+
 	/* Nothing in the buffer fill it in a single system call. */
 	{
 		b->pos = PORT_BUFFER_UNGET_SIZE;
@@ -162,14 +215,29 @@ int port_ungetc( int c, muse_port_base_t *p )
 		muse_port_buffer_t *b = &p->in;
 	
 		muse_assert( b->bytes );
-		muse_assert( b->avail + 1 <= PORT_BUFFER_SIZE );
-		
-		if ( p->error || b->avail + 1 > PORT_BUFFER_SIZE )
-			return EOF; /* Exceeded the unget limit. */
-		
-		b->pos = ((b->pos - 1) + PORT_BUFFER_SIZE) & PORT_BUFFER_MASK;
-		++(b->avail);
-		b->bytes[b->pos] = (unsigned char)c;
+
+		if ( b->mapped )
+		{
+			/* Mapped data is only stepped back over, never written to, so
+			only the byte that was read can be put back. */
+			if ( p->error || b->pos == 0 || b->bytes[b->pos - 1] != (unsigned char)c )
+				return EOF;
+
+			--(b->pos);
+			++(b->avail);
+		}
+		else
+		{
+			muse_assert( b->avail + 1 <= PORT_BUFFER_SIZE );
+			
+			if ( p->error || b->avail + 1 > PORT_BUFFER_SIZE )
+				return EOF; /* Exceeded the unget limit. */
+			
+			b->pos = ((b->pos - 1) + PORT_BUFFER_SIZE) & PORT_BUFFER_MASK;
+			++(b->avail);
+			b->bytes[b->pos] = (unsigned char)c;
+		}
+
 		--(b->fpos);
 		p->eof = 0;
 
@@ -266,6 +334,28 @@ size_t port_read( void *buffer, size_t nbytes, muse_port_base_t *port )
 
 	if ( port->error || port->eof )
 		return 0;
+
+	if ( portfn(port,map) )
+	{
+		/* Copy straight out of the mapped data, a window at a time. */
+		while ( bytes_to_copy > 0 && (in->avail > 0 || port_map_input(port) > 0) )
+		{
+			int n = (int)(bytes_to_copy > (size_t)in->avail ? (size_t)in->avail : bytes_to_copy);
+
+			memcpy( b, in->bytes + in->pos, n );
+			in->pos			+= n;
+			in->avail		-= n;
+			in->fpos		+= n;
+			b				+= n;
+			bytes_read		+= n;
+			bytes_to_copy	-= n;
+		}
+
+		if ( bytes_to_copy > 0 )
+			port->eof = EOF;
+
+		return bytes_read;
+	}
 	
 	/* First copy whatever is in our buffer to the given buffer. */
 	if ( in->avail > 0 )
@@ -313,6 +403,194 @@ size_t port_read( void *buffer, size_t nbytes, muse_port_base_t *port )
 	return bytes_read;
 }
 
+/**
+ * Moves the pending input to just after the room kept for ungetting,
+ * so that it is contiguous and as much of the buffer as possible 
+ * is left after it.
+ */
+static void port_compact_input( muse_port_buffer_t *in )
+{
+	if ( in->pos + in->avail > PORT_BUFFER_SIZE )
+	{
+		/* Ungot bytes have wrapped around to the end of the buffer. */
+		unsigned char *pending = (unsigned char*)malloc( in->avail );
+		int tail = PORT_BUFFER_SIZE - in->pos;
+
+		memcpy( pending, in->bytes + in->pos, tail );
+		memcpy( pending + tail, in->bytes, in->avail - tail );
+		memcpy( in->bytes + PORT_BUFFER_UNGET_SIZE, pending, in->avail );
+		free( pending );
+	}
+	else if ( in->pos != PORT_BUFFER_UNGET_SIZE && in->avail > 0 )
+		memmove( in->bytes + PORT_BUFFER_UNGET_SIZE, in->bytes + in->pos, in->avail );
+
+	in->pos = PORT_BUFFER_UNGET_SIZE;
+}
+
+/**
+ * Returns the input that the port has buffered, so that it can be
+ * scanned in place, and sets \p avail to the number of bytes in it. The
+ * bytes stay valid until the port is next read from. Use port_consume()
+ * to take bytes out of the buffer once they've been looked at.
+ */
+const unsigned char *port_buffered( muse_port_base_t *p, int *avail )
+{
+	muse_port_buffer_t *in = &p->in;
+
+	if ( !in->mapped && in->pos + in->avail > PORT_BUFFER_SIZE )
+		port_compact_input( in );
+
+	*avail = in->avail;
+	return in->bytes + in->pos;
+}
+
+/**
+ * Reads more input into the port's buffer after what has already been
+ * buffered, with a single call to the port's read function. Pending output
+ * is flushed first, as with port_getc(). Returns the number of bytes added,
+ * which is 0 at the end of the stream or if the buffer is full. A port that
+ * maps its data gets its buffer pointed at the next window of it instead.
+ */
+int port_buffer_more( muse_port_base_t *p )
+{
+	muse_port_buffer_t *in = &p->in;
+	int room, n;
+
+	if ( p->error )
+		return 0;
+
+	if ( p->out.avail > 0 )
+		port_flush(p);
+
+	if ( p->eof )
+		return 0;
+
+	if ( portfn(p,map) )
+	{
+		/* The next window starts with the bytes still buffered. */
+		int buffered = in->avail;
+
+		if ( port_map_input(p) == 0 && buffered == 0 )
+			p->eof = EOF;
+
+		return in->avail > buffered ? in->avail - buffered : 0;
+	}
+
+	port_compact_input( in );
+
+	room = PORT_BUFFER_SIZE - (in->pos + in->avail);
+	if ( room <= 0 )
+		return 0;
+
+	n = (int)portfn(p,read)( in->bytes + in->pos + in->avail, room, p );
+	if ( n <= 0 )
+	{
+		/* The buffered bytes can still be read. */
+		if ( in->avail == 0 )
+			p->eof = EOF;
+		return 0;
+	}
+
+	in->avail += n;
+	return n;
+}
+
+/**
+ * Takes \p nbytes bytes of buffered input out of the port's
+ * buffer, as though they'd been read using port_getc().
+ */
+void port_consume( int nbytes, muse_port_base_t *p )
+{
+	muse_env *env = p->env;
+	muse_port_buffer_t *in = &p->in;
+	int i;
+
+	muse_assert( nbytes >= 0 && nbytes <= in->avail );
+
+	for ( i = 0; i < nbytes; ++i )
+	{
+		switch ( in->bytes[buffer_step( in, in->pos, i )] ) {
+			case '\n' : ++(in->line); // No break! \n resets column as well.
+			case '\r' : in->column = 0; break;
+			case '\t' : in->column += env->parameters[MUSE_TAB_SIZE]; break;
+			default : ++(in->column);
+		}
+	}
+
+	in->pos		= buffer_step( in, in->pos, nbytes );
+	in->avail	-= nbytes;
+	in->fpos	+= nbytes;
+}
+
+/**
+ * Same as port_consume(), but for binary data such as a code image,
+ * whose bytes aren't looked at to keep count of lines and columns.
+ */
+void port_consume_binary( int nbytes, muse_port_base_t *p )
+{
+	muse_debug_only(muse_env *env = p->env;)
+	muse_port_buffer_t *in = &p->in;
+
+	muse_assert( nbytes >= 0 && nbytes <= in->avail );
+
+	in->pos		= buffer_step( in, in->pos, nbytes );
+	in->avail	-= nbytes;
+	in->fpos	+= nbytes;
+}
+
+/**
+ * Skips over \p nbytes bytes of input, as though they'd been read using
+ * port_read(). A port that maps its data just moves on without the bytes
+ * being copied anywhere. Returns the number of bytes skipped, which is
+ * less than \p nbytes if the stream ended.
+ */
+size_t port_skip( size_t nbytes, muse_port_base_t *p )
+{
+	muse_port_buffer_t *in = &p->in;
+	size_t skipped = 0;
+
+	if ( p->error == 0 && p->out.avail > 0 )
+		port_flush(p);
+
+	if ( p->error || p->eof )
+		return 0;
+
+	if ( portfn(p,map) )
+	{
+		while ( skipped < nbytes )
+		{
+			if ( in->avail > 0 || port_map_input(p) > 0 )
+			{
+				int n = (int)(nbytes - skipped > (size_t)in->avail ? (size_t)in->avail : nbytes - skipped);
+
+				in->pos		+= n;
+				in->avail	-= n;
+				in->fpos	+= n;
+				skipped		+= n;
+			}
+			else
+				break;
+		}
+
+		if ( skipped < nbytes )
+			p->eof = EOF;
+	}
+	else
+	{
+		unsigned char scratch[256];
+
+		while ( skipped < nbytes )
+		{
+			size_t n = port_read( scratch, nbytes - skipped > sizeof(scratch) ? sizeof(scratch) : nbytes - skipped, p );
+			if ( n == 0 )
+				break;
+			skipped += n;
+		}
+	}
+
+	return skipped;
+}
+
 /**
  * Wraps the port specific write function. Writes any data in
  * the output buffer before calling the port-specific write function.
@@ -382,6 +660,107 @@ int port_flush( muse_port_base_t *port )
 		return 0;
 }
 
+/**
+ * Copies the run of ASCII characters at the start of the bytes,
+ * if \p chars isn't NULL, and returns its length. Sixteen bytes
+ * are looked at and widened at a time where SSE2 is available.
+ */
+static int ascii_to_uc16( muse_char *chars, const unsigned char *bytes, int nbytes )
+{
+	int i = 0;
+
+#ifdef MUSE_PORT_SSE2
+	const __m128i zero = _mm_setzero_si128();
+
+	for ( ; i + 16 <= nbytes; i += 16 )
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i*)(bytes + i) );
+
+		if ( _mm_movemask_epi8(v) != 0 )
+			break;
+
+		if ( chars )
+		{
+			__m128i lo = _mm_unpacklo_epi8( v, zero ), hi = _mm_unpackhi_epi8( v, zero );
+
+			if ( sizeof(muse_char) == 2 )
+			{
+				_mm_storeu_si128( (__m128i*)(chars + i), lo );
+				_mm_storeu_si128( (__m128i*)(chars + i + 8), hi );
+			}
+			else
+			{
+				_mm_storeu_si128( (__m128i*)(chars + i), _mm_unpacklo_epi16( lo, zero ) );
+				_mm_storeu_si128( (__m128i*)(chars + i + 4), _mm_unpackhi_epi16( lo, zero ) );
+				_mm_storeu_si128( (__m128i*)(chars + i + 8), _mm_unpacklo_epi16( hi, zero ) );
+				_mm_storeu_si128( (__m128i*)(chars + i + 12), _mm_unpackhi_epi16( hi, zero ) );
+			}
+		}
+	}
+#endif
+
+	if ( chars )
+	{
+		for ( ; i < nbytes && bytes[i] < 0x80; ++i )
+			chars[i] = bytes[i];
+	}
+	else
+	{
+		while ( i < nbytes && bytes[i] < 0x80 )
+			++i;
+	}
+
+	return i;
+}
+
+/**
+ * Decodes a block of UTF8 bytes in one go, as port_getchar() would decode
+ * them one by one, into \p chars. Passing NULL for \p chars only counts
+ * the characters. Returns the number of characters and sets \p nused to
+ * the number of bytes decoded. A character cut short by the end of the
+ * block is left for the next block, unless \p final is set, in which case
+ * its bytes are taken as they are.
+ */
+int utf8_to_uc16_block( muse_char *chars, const unsigned char *bytes, int nbytes, int *nused, int final )
+{
+	int i = 0, n = 0;
+
+	while ( i < nbytes )
+	{
+		int run = ascii_to_uc16( chars ? chars + n : NULL, bytes + i, nbytes - i );
+		i += run;
+		n += run;
+
+		/* Now a character of two or more bytes. */
+		while ( i < nbytes && bytes[i] >= 0x80 )
+		{
+			int c = bytes[i];
+			int len = (c & 0xF8) == 0xF0 ? 4 : ((c & 0xF0) == 0xE0 ? 3 : ((c & 0xE0) == 0xC0 ? 2 : 1));
+
+			if ( i + len > nbytes )
+			{
+				if ( !final )
+				{
+					*nused = i;
+					return n;
+				}
+
+				len = 1;
+				if ( chars )
+					chars[n] = (muse_char)(c & 0x7F);
+			}
+			else if ( chars )
+				utf8_to_uc16( bytes + i, chars + n );
+
+			i += len;
+			++n;
+		}
+	}
+
+	*nused = i;
+	return n;
+}
+
 /**
  * Reads a unicode character from the port.
  */
@@ -391,6 +770,7 @@ muse_char port_getchar( muse_port_t p )
 	muse_char c16 = 0;
 	int c = port_getc(p);
 	if ( c == EOF ) return (muse_char)EOF;
+	if ( c < 0x80 ) return (muse_char)c;
 	buffer[0] = (unsigned char)c;
 
 	/* It is a property of utf8 that the number of
@@ -436,7 +816,7 @@ muse_char port_ungetchar( muse_char c, muse_port_t p )
 {
 	unsigned char buffer[4];
 	int numchars = uc16_to_utf8( c, buffer, 4 );
-	while ( numchars )
+	while ( numchars > 0 )
 		port_ungetc( buffer[--numchars], p );
 	return c;
 }
@@ -1701,8 +2081,14 @@ static void muse_print_lambda( muse_port_t f, muse_cell l, muse_boolean quote )
 	pretty_printer_move(f,count);
 	while ( l )
 	{
+		muse_cell x = _next(&l);
+
+		/* The compiled form of the body isn't part of its source. */
+		if ( x < 0 && muse_is_compiled_code( env, _quq(x) ) )
+			continue;
+
 		pretty_printer_indent(f);
-		muse_print_q( f, _next(&l), quote );
+		muse_print_q( f, x, quote );
 		pretty_printer_unindent(f);
 		if ( l ) pretty_printer_line_break(f);
 	}
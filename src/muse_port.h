@@ -66,6 +66,18 @@ typedef struct
 		 * If a port is buffered at the system level, this should call
 		 * the system flush function appropriate for the task.
 		 */
+
+	const unsigned char *(*map)( void *port, size_t offset, int *nbytes );
+		/**<
+		 * Optional, for ports whose data is already in memory such as
+		 * mapped files. Should return the port's data from \p offset on,
+		 * or as much of it as fits in an int, and set \p nbytes to its
+		 * size. The input buffer then points straight into it instead of
+		 * the data being read into the buffer. The memory must stay valid
+		 * until the port is closed.
+		 *
+		 * @return NULL at the end of the stream.
+		 */
 } muse_port_type_t;
 
 /**
@@ -78,6 +90,7 @@ typedef struct
 	int size, avail, pos;
 	size_t fpos;
 	muse_int line, column;
+	int mapped; /**< The bytes are a window onto the port's mapped data rather than a ring buffer. */
 } muse_port_buffer_t;
 
 enum { MAX_INDENT_COLS = 128 };
@@ -108,6 +121,32 @@ typedef struct _muse_port_base_t
  */
 void muse_define_builtin_fileport(muse_env *env);
 
+/**
+ * If the port reads a mapped file, returns the bytes object of the
+ * mapping and sets \p offset to where the port's next byte is in it.
+ * Returns MUSE_NIL otherwise.
+ */
+muse_cell fileport_mapping( muse_port_base_t *p, muse_int *offset );
+
+/**
+ * A run of the bytes held by a memport.
+ */
+typedef struct
+{
+	const unsigned char *bytes;
+	size_t size;
+} muse_memport_chunk_t;
+
+/** @name Memport data
+ * Lets a memport's data be sent or taken without copying it out first.
+ */
+/*@{*/
+muse_boolean is_memport( muse_port_base_t *p );
+int		memport_chunks( muse_port_base_t *p, muse_memport_chunk_t *chunks, int max );
+size_t	memport_size( muse_port_base_t *p );
+void	memport_drop( muse_port_base_t *p, size_t nbytes );
+/*@}*/
+
 /** @name Ports implementation API */
 /**
  * A common API provided to all ports. A specific port
@@ -131,6 +170,12 @@ int		port_flush( muse_port_base_t *port );
 muse_char port_getchar( muse_port_base_t *p );
 muse_char port_putchar( muse_char c, muse_port_base_t *p );
 muse_char port_ungetchar( muse_char c, muse_port_base_t *p );
+const unsigned char *port_buffered( muse_port_base_t *p, int *avail );
+int		port_buffer_more( muse_port_base_t *p );
+void	port_consume( int nbytes, muse_port_base_t *p );
+void	port_consume_binary( int nbytes, muse_port_base_t *p );
+size_t	port_skip( size_t nbytes, muse_port_base_t *p );
+int		utf8_to_uc16_block( muse_char *chars, const unsigned char *bytes, int nbytes, int *nused, int final );
 /*@}*/
 
 /** @name Pretty printing */
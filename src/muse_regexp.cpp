@@ -8,14 +8,18 @@
  * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
  * for terms and conditions under which this software is provided to you.
  *
- * Implements functional vectors for constant time random access
- * to a collection of objects.
+ * Implements regular expressions matched over texts, or line by line
+ * over ports and byte arrays.
  */
 
 #include "muse_builtins.h"
 #include "muse_port.h"
 #include <stdlib.h>
 #include <memory.h>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <string>
 #include <boost/xpressive/xpressive.hpp>
 
 using namespace boost::xpressive;
@@ -27,13 +31,91 @@ typedef struct
     wcregex *re;
 } regexp_t;
 
+/**
+ * Compiled patterns keyed by their text, most recently used first.
+ * Copies of a wcregex share the compiled form, so handing one out
+ * of the cache doesn't compile or copy the pattern.
+ */
+enum { REGEXP_CACHE_SIZE = 64 };
+
+typedef std::list< std::pair<std::wstring, wcregex> > regexp_lru_t;
+
+struct _muse_regexp_cache_t
+{
+    regexp_lru_t lru;
+    std::map<std::wstring, regexp_lru_t::iterator> index;
+};
+
+extern "C" void muse_destroy_regexp_cache( muse_env *env )
+{
+    delete env->regexp_cache;
+    env->regexp_cache = NULL;
+}
+
+/**
+ * Gives the compiled form of the pattern, compiling it only if it
+ * isn't among the REGEXP_CACHE_SIZE most recently used ones. Gives
+ * NULL if the pattern doesn't compile.
+ */
+static const wcregex *compile_cached( muse_env *env, muse_cell pattern )
+{
+    if (!env->regexp_cache) {
+        env->regexp_cache = new _muse_regexp_cache_t;
+    }
+
+    _muse_regexp_cache_t *cache = env->regexp_cache;
+    int length = 0;
+    const muse_char *text = muse_text_contents(env, pattern, &length);
+    std::wstring key(text, text + length);
+    std::map<std::wstring, regexp_lru_t::iterator>::iterator found = cache->index.find(key);
+
+    if (found != cache->index.end()) {
+        cache->lru.splice(cache->lru.begin(), cache->lru, found->second);
+        return &(found->second->second);
+    }
+
+    wcregex compiled;
+    try {
+        compiled = wcregex::compile(key.c_str());
+    } catch (regex_error &) {
+        return NULL;
+    }
+
+    if (cache->lru.size() >= REGEXP_CACHE_SIZE) {
+        cache->index.erase(cache->lru.back().first);
+        cache->lru.pop_back();
+    }
+
+    cache->lru.push_front(std::make_pair(key, compiled));
+    cache->index[key] = cache->lru.begin();
+    return &(cache->lru.front().second);
+}
+
+/**
+ * Raises error:bad-regexp if the pattern doesn't compile. This is kept
+ * apart from compile_cached() so that no C++ locals are skipped over
+ * when the error unwinds the stack.
+ */
+static const wcregex &compile_or_raise( muse_env *env, muse_cell pattern )
+{
+    static const wcregex k_no_regexp;
+    const wcregex *re = compile_cached(env, pattern);
+
+    if (!re) {
+        muse_raise_error(env, _csymbol(L"error:bad-regexp"), _cons(pattern, MUSE_NIL));
+        return k_no_regexp;
+    }
+
+    return *re;
+}
+
 static void regexp_init( muse_env *env, void *ptr, muse_cell args )
 {
 	regexp_t *re = (regexp_t*)ptr;
     re->expr = _evalnext(&args);
-    muse_assert(_cellt(v->expr) == MUSE_TEXT_CELL);
-    re->re = new wcregex;
-    (*(re->re)) = wcregex::compile(_text_contents(re->expr, NULL));
+    muse_assert(_cellt(re->expr) == MUSE_TEXT_CELL);
+    const wcregex &compiled = compile_or_raise(env, re->expr);
+    re->re = new wcregex(compiled);
 }
 
 static void regexp_mark( muse_env *env, void *ptr )
@@ -58,7 +140,7 @@ static void regexp_write( muse_env *env, void *ptr, void *port )
 {
 	regexp_t *re = (regexp_t*)ptr;
 	muse_port_t p = (muse_port_t)port;
-	
+
     static const muse_char constructor[] = L"{regexp ";
     for (int i = 0; constructor[i]; ++i) {
         port_putchar(constructor[i], p);
@@ -101,6 +183,214 @@ static muse_functional_object_type_t g_regexp_type =
 	regexp_write
 };
 
+/**
+ * The regexp argument of the regexp- functions can be a regexp object
+ * or the pattern text itself, which is compiled through the cache.
+ */
+static const wcregex &regexp_arg( muse_env *env, muse_cell regexp ) {
+    regexp_t *re = (regexp_t*)_functional_object_data(regexp, 'regx');
+    if (re) {
+        return *(re->re);
+    }
+
+    if (_cellt(regexp) != MUSE_TEXT_CELL) {
+        muse_raise_error(env, _csymbol(L"error:regexp-expected"), _cons(regexp, MUSE_NIL));
+    }
+
+    return compile_or_raise(env, regexp);
+}
+
+/**
+ * Reads the lines of a port or a byte array one at a time, decoding
+ * each from utf8 into the same buffer. Line feeds and carriage returns
+ * are dropped. A port is left just past the last line read, so the
+ * next regexp operation on it continues from there.
+ */
+class line_reader {
+public:
+    line_reader( muse_port_t port, const unsigned char *bytes, size_t size )
+        : port(port), bytes(bytes), size(size), pos(0) {
+        if (bytes && size >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) {
+            pos = 3;
+        }
+    }
+
+    std::wstring line;
+
+    bool next() {
+        line.clear();
+        return port ? next_from_port() : next_from_bytes();
+    }
+
+private:
+    muse_port_t port;
+    const unsigned char *bytes;
+    size_t size, pos;
+
+    void append( const unsigned char *b, int nbytes, int final, int *nused ) {
+        size_t start = line.size();
+        line.resize(start + nbytes);
+        int n = utf8_to_uc16_block(&line[start], b, nbytes, nused, final);
+        line.resize(start + n);
+    }
+
+    void drop_cr() {
+        if (line.find(L'\r') != std::wstring::npos) {
+            line.erase(std::remove(line.begin(), line.end(), L'\r'), line.end());
+        }
+    }
+
+    bool next_from_bytes() {
+        if (pos >= size) {
+            return false;
+        }
+
+        const unsigned char *start = bytes + pos;
+        const unsigned char *nl = (const unsigned char*)memchr(start, '\n', size - pos);
+        int nbytes = (int)(nl ? nl - start : (bytes + size) - start);
+        int nused = 0;
+
+        append(start, nbytes, 1, &nused);
+        pos += nbytes + (nl ? 1 : 0);
+        drop_cr();
+        return true;
+    }
+
+    bool next_from_port() {
+        int scanned = 0;
+        bool got = false;
+
+        while (!port_eof(port)) {
+            int avail = 0;
+            const unsigned char *b = port_buffered(port, &avail);
+            const unsigned char *nl = avail > scanned ? (const unsigned char*)memchr(b + scanned, '\n', avail - scanned) : NULL;
+            int nused = 0;
+
+            if (nl) {
+                append(b, (int)(nl - b), 1, &nused);
+                port_consume((int)(nl - b) + 1, port);
+                got = true;
+                break;
+            }
+
+            scanned = avail;
+
+            if (port_buffer_more(port) > 0 || avail == 0) {
+                continue;
+            }
+
+            /* The buffer is full. Decode what's in it and read on. */
+            append(b, avail, 0, &nused);
+            if (nused == 0) {
+                append(b, avail, 1, &nused);
+            }
+            port_consume(nused, port);
+            scanned = 0;
+            got = true;
+        }
+
+        drop_cr();
+        return got || !line.empty();
+    }
+};
+
+/**
+ * Owns an object made with new. A muse error longjmps past C++
+ * destructors, so the object is also held by a destructor cell and is
+ * deleted when the cell is collected if the owner's destructor didn't
+ * get to run. Otherwise it is deleted as soon as the owner goes out of
+ * scope.
+ */
+template <class T>
+class collected {
+public:
+    collected( muse_env *env, T *obj )
+        : env(env), obj(obj), cell(obj ? muse_mk_destructor(env, destroy, obj) : MUSE_NIL) {
+    }
+
+    ~collected() {
+        if (cell) {
+            _ptr(cell)->fn.context = NULL;
+        }
+        delete obj;
+    }
+
+    T *get() const { return obj; }
+    T *operator->() const { return obj; }
+    T &operator*() const { return *obj; }
+
+private:
+    muse_env *env;
+    T *obj;
+    muse_cell cell;
+
+    static muse_cell destroy( muse_env *env, void *context, muse_cell args ) {
+        delete (T*)context;
+        return MUSE_NIL;
+    }
+
+    collected( const collected & );
+    collected &operator=( const collected & );
+};
+
+/**
+ * Gives a reader if the input is a port or byte array, or NULL if it is
+ * a text, in which case the regexp operations work on the whole text.
+ */
+static line_reader *input_reader( muse_env *env, muse_cell input ) {
+    muse_port_t port = _port(input);
+    if (port) {
+        return new line_reader(port, NULL, 0);
+    }
+
+    if (_functional_object_data(input, 'barr')) {
+        return new line_reader(NULL, (const unsigned char*)muse_bytes_data(env, input, 0), muse_bytes_size(env, input));
+    }
+
+    return NULL;
+}
+
+static muse_cell match_vector( muse_env *env, const wcmatch &what ) {
+    muse_cell vec = muse_mk_vector(env, what.size());
+    int sp = _spos();
+    {
+        int i, N;
+        for (i = 0, N = what.size(); i < N; ++i) {
+            const wcsub_match str = what[i];
+            muse_vector_put(env, vec, i, muse_mk_text(env, str.first, str.second));
+            _unwind(sp);
+        }
+    }
+    return vec;
+}
+
+/**
+ * Common to regexp-match and regexp-search. A port or byte array is
+ * read line by line until a line matches.
+ */
+static muse_cell regexp_find( muse_env *env, muse_cell args, bool whole ) {
+    const wcregex &re = regexp_arg(env, _evalnext(&args));
+    muse_cell input = _evalnext(&args);
+    collected<line_reader> lines(env, input_reader(env, input));
+    wcmatch what;
+
+    if (!lines.get()) {
+        const muse_char *txt = _text_contents(input, NULL);
+        return (whole ? regex_match(txt, what, re) : regex_search(txt, what, re)) ? match_vector(env, what) : MUSE_NIL;
+    }
+
+    muse_cell result = MUSE_NIL;
+    while (lines->next()) {
+        const muse_char *txt = lines->line.c_str();
+        if (whole ? regex_match(txt, what, re) : regex_search(txt, what, re)) {
+            result = match_vector(env, what);
+            break;
+        }
+    }
+
+    return result;
+}
+
 // {regexp "pattern"}
 static muse_cell fn_regexp_compile(muse_env *env, void *context, muse_cell args) {
     muse_cell regexp = _mk_functional_object(&g_regexp_type, args);
@@ -108,75 +398,75 @@ static muse_cell fn_regexp_compile(muse_env *env, void *context, muse_cell args)
 }
 
 // (regexp-match re input) -> vector
-// Entire input must match.
+// Entire input must match. If input is a port or bytes,
+// gives the first line that matches entirely.
 static muse_cell fn_regexp_match(muse_env *env, void *context, muse_cell args) {
-    muse_cell regexp = _evalnext(&args);
-    regexp_t *re = (regexp_t*)_functional_object_data(regexp, 'regx');
-    muse_cell txt = _evalnext(&args);
-    wcmatch what;
-    if (regex_match(_text_contents(txt, NULL), what, (*(re->re)))) {
-        muse_cell vec = muse_mk_vector(env, what.size());
-        int sp = _spos();
-        {
-            int i, N;
-            for (i = 0, N = what.size(); i < N; ++i) {
-                const wcsub_match str = what[i];
-                muse_vector_put(env, vec, i, muse_mk_text(env, str.first, str.second));
-                _unwind(sp);
-            }
-        }
-        return muse_add_recent_item(env, (muse_int)fn_regexp_match, vec);
-    } else {
-        return muse_add_recent_item(env, (muse_int)fn_regexp_match, MUSE_NIL);
-    }
+    return muse_add_recent_item(env, (muse_int)fn_regexp_match, regexp_find(env, args, true));
 }
 
 // (regexp-search re input) -> vector
-// Sub-string match.
+// Sub-string match. If input is a port or bytes,
+// gives the match in the first line that has one.
 static muse_cell fn_regexp_search(muse_env *env, void *context, muse_cell args) {
-    muse_cell regexp = _evalnext(&args);
-    regexp_t *re = (regexp_t*)_functional_object_data(regexp, 'regx');
-    muse_cell txt = _evalnext(&args);
-    wcmatch what;
-    if (regex_search(_text_contents(txt, NULL), what, (*(re->re)))) {
-        muse_cell vec = muse_mk_vector(env, what.size());
-        int sp = _spos();
-        {
-            int i, N;
-            for (i = 0, N = what.size(); i < N; ++i) {
-                const wcsub_match str = what[i];
-                muse_vector_put(env, vec, i, muse_mk_text(env, str.first, str.second));
-                _unwind(sp);
-            }
-        }
-        return muse_add_recent_item(env, (muse_int)fn_regexp_search, vec);
-    } else {
-        return muse_add_recent_item(env, (muse_int)fn_regexp_search, MUSE_NIL);
+    return muse_add_recent_item(env, (muse_int)fn_regexp_search, regexp_find(env, args, false));
+}
+
+static void write_line( const std::wstring &line, std::string &buffer, muse_port_t out ) {
+    buffer.clear();
+    for (size_t i = 0; i < line.size(); ++i) {
+        unsigned char utf8[4];
+        int n = uc16_to_utf8(line[i], utf8, 4);
+        buffer.append((const char*)utf8, n);
     }
+    buffer.push_back('\n');
+    port_write((void*)buffer.data(), buffer.size(), out);
 }
 
-// (regexp-replace-one re format input) -> text
-// Replaces first occurrence of re in input with format.
-static muse_cell fn_regexp_replace_one(muse_env *env, void *context, muse_cell args) {
-    muse_cell regexp = _evalnext(&args);
-    regexp_t *re = (regexp_t*)_functional_object_data(regexp, 'regx');
+/**
+ * Common to regexp-replace-one and regexp-replace. A port or byte array
+ * is replaced in line by line and written out to the output port, or
+ * the standard output if none is given. Each line is a separate input
+ * as far as regexp-replace-one goes. Gives the number of lines written.
+ */
+static muse_cell regexp_replace( muse_env *env, muse_cell args, regex_constants::match_flag_type flags ) {
+    const wcregex &re = regexp_arg(env, _evalnext(&args));
     muse_cell format = _evalnext(&args);
     muse_cell input = _evalnext(&args);
-    
-    std::wstring result = regex_replace(_text_contents(input, NULL), (*(re->re)), _text_contents(format, NULL), regex_constants::format_first_only);
-    return muse_add_recent_item(env, (muse_int)fn_regexp_replace_one, muse_mk_text(env, result.c_str(), result.c_str() + result.length()));
+    const muse_char *fmt = _text_contents(format, NULL);
+    collected<line_reader> lines(env, input_reader(env, input));
+
+    if (!lines.get()) {
+        std::wstring result = regex_replace(_text_contents(input, NULL), re, fmt, flags);
+        return muse_mk_text(env, result.c_str(), result.c_str() + result.length());
+    }
+
+    muse_port_t out = args ? _port(_evalnext(&args)) : _stdport(MUSE_STDOUT_PORT);
+    muse_assert(out != NULL && "regexp-replace's output must be a port.");
+
+    collected<std::wstring> result(env, new std::wstring);
+    collected<std::string> buffer(env, new std::string);
+    muse_int count = 0;
+    while (lines->next()) {
+        result->clear();
+        const muse_char *line = lines->line.c_str();
+        regex_replace(std::back_inserter(*result), line, line + lines->line.size(), re, fmt, flags);
+        write_line(*result, *buffer, out);
+        ++count;
+    }
+
+    return _mk_int(count);
+}
+
+// (regexp-replace-one re format input [output-port]) -> text
+// Replaces first occurrence of re in input with format.
+static muse_cell fn_regexp_replace_one(muse_env *env, void *context, muse_cell args) {
+    return muse_add_recent_item(env, (muse_int)fn_regexp_replace_one, regexp_replace(env, args, regex_constants::format_first_only));
 }
 
-// (regexp-replace re format input) -> text
+// (regexp-replace re format input [output-port]) -> text
 // Replaces all occurrence of re in input with format.
 static muse_cell fn_regexp_replace(muse_env *env, void *context, muse_cell args) {
-    muse_cell regexp = _evalnext(&args);
-    regexp_t *re = (regexp_t*)_functional_object_data(regexp, 'regx');
-    muse_cell format = _evalnext(&args);
-    muse_cell input = _evalnext(&args);
-    
-    std::wstring result = regex_replace(_text_contents(input, NULL), (*(re->re)), _text_contents(format, NULL), regex_constants::format_all);
-    return muse_add_recent_item(env, (muse_int)fn_regexp_replace, muse_mk_text(env, result.c_str(), result.c_str() + result.length()));
+    return muse_add_recent_item(env, (muse_int)fn_regexp_replace, regexp_replace(env, args, regex_constants::format_all));
 }
 
 static const struct regexp_fns_t { const muse_char *name; muse_nativefn_t fn; } g_regexp_fns[] =
@@ -0,0 +1,229 @@
+/**
+ * @file muse_text.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Storage for the contents of text cells. Parsers create huge numbers
+ * of tiny strings, so we avoid a malloc() and free() per string -
+ *	- Short strings are taken from free lists of fixed size blocks,
+ *	  one free list per size class.
+ *	- Strings created within a text arena are bump allocated from a
+ *	  chunk which is released when all of its strings are collected.
+ *	- Everything else is malloc-ed.
+ */
+
+#include "muse_opcodes.h"
+#include <stdlib.h>
+
+/**
+ * The block sizes of the size classes, in characters including
+ * the terminating null character.
+ */
+static const int k_text_size_classes[MUSE_NUM_TEXT_SIZE_CLASSES] = { 8, 16, 32, 64 };
+
+/**
+ * Strings up to this many characters are bump allocated when
+ * a text arena is in effect.
+ */
+enum { MUSE_MAX_ARENA_TEXT = 1024 };
+
+struct _muse_text_chunk_t
+{
+	muse_text_chunk_t	*next;		/**< The next chunk of the same size class. */
+	int					size_class;	/**< Index into k_text_size_classes, or -1 for an arena chunk. */
+	int					live;		/**< The number of live strings in an arena chunk. */
+	char				*top;		/**< Where the next block will be allocated. */
+	char				*end;		/**< The end of the chunk's memory. */
+};
+
+/**
+ * Every string is preceded by a pointer to the chunk it was
+ * allocated from, or NULL if it was malloc-ed by itself. The
+ * union keeps the characters suitably aligned.
+ */
+typedef union
+{
+	muse_text_chunk_t	*chunk;
+	double				align;
+} text_header_t;
+
+static size_t block_size( int chars )
+{
+	size_t size = sizeof(text_header_t) + chars * sizeof(muse_char);
+	return (size + sizeof(text_header_t) - 1) & ~(sizeof(text_header_t) - 1);
+}
+
+static char *chunk_base( muse_text_chunk_t *c )
+{
+	return (char*)c + ((sizeof(muse_text_chunk_t) + sizeof(text_header_t) - 1) & ~(sizeof(text_header_t) - 1));
+}
+
+static muse_text_chunk_t *new_chunk( int size_class )
+{
+	muse_text_chunk_t *c = (muse_text_chunk_t*)malloc( MUSE_TEXT_CHUNK_SIZE );
+	c->next			= NULL;
+	c->size_class	= size_class;
+	c->live			= 0;
+	c->top			= chunk_base(c);
+	c->end			= (char*)c + MUSE_TEXT_CHUNK_SIZE;
+	return c;
+}
+
+/**
+ * Allocates space for a text of the given number of characters, plus
+ * the terminating null character. The returned buffer must be released
+ * using muse_text_free().
+ */
+muse_char *muse_text_alloc( muse_env *env, int length )
+{
+	muse_text_storage_t *ts = &env->text_storage;
+	int chars = length + 1;
+	text_header_t *h;
+
+	if ( ts->arena_depth > 0 && chars <= MUSE_MAX_ARENA_TEXT )
+	{
+		size_t size = block_size(chars);
+		muse_text_chunk_t *c = ts->arena_chunk;
+
+		if ( !c || c->top + size > c->end )
+		{
+			/* The old chunk goes away once its last string does. */
+			if ( c && c->live == 0 )
+				free(c);
+
+			c = ts->arena_chunk = new_chunk(-1);
+		}
+
+		h = (text_header_t*)c->top;
+		h->chunk = c;
+		c->top += size;
+		c->live++;
+	}
+	else if ( chars <= k_text_size_classes[MUSE_NUM_TEXT_SIZE_CLASSES-1] )
+	{
+		int k = 0;
+
+		while ( chars > k_text_size_classes[k] )
+			++k;
+
+		if ( ts->free_blocks[k] )
+		{
+			/* Free blocks keep the link to the next one in their text area.
+			Their chunk pointer is still valid. */
+			h = (text_header_t*)ts->free_blocks[k];
+			ts->free_blocks[k] = *(void**)(h+1);
+		}
+		else
+		{
+			size_t size = block_size( k_text_size_classes[k] );
+			muse_text_chunk_t *c = ts->class_chunks[k];
+
+			if ( !c || c->top + size > c->end )
+			{
+				c = new_chunk(k);
+				c->next = ts->class_chunks[k];
+				ts->class_chunks[k] = c;
+			}
+
+			h = (text_header_t*)c->top;
+			h->chunk = c;
+			c->top += size;
+		}
+	}
+	else
+	{
+		h = (text_header_t*)malloc( sizeof(text_header_t) + chars * sizeof(muse_char) );
+		h->chunk = NULL;
+	}
+
+	return (muse_char*)(h+1);
+}
+
+/**
+ * Releases a text buffer allocated using muse_text_alloc().
+ */
+void muse_text_free( muse_env *env, muse_char *text )
+{
+	muse_text_storage_t *ts = &env->text_storage;
+	text_header_t *h = ((text_header_t*)text) - 1;
+	muse_text_chunk_t *c = h->chunk;
+
+	if ( !c )
+		free(h);
+	else if ( c->size_class >= 0 )
+	{
+		*(void**)text = ts->free_blocks[c->size_class];
+		ts->free_blocks[c->size_class] = h;
+	}
+	else if ( --c->live == 0 )
+	{
+		/* The whole arena chunk is dead. If new strings are still
+		being allocated from it, just start over from its base. */
+		if ( c == ts->arena_chunk )
+			c->top = chunk_base(c);
+		else
+			free(c);
+	}
+}
+
+/**
+ * Until the matching muse_end_text_arena(), text cells are allocated
+ * from arena chunks. Use this around code that creates lots of strings
+ * that tend to die together, such as parsers. Arenas nest and the
+ * returned value must be passed to muse_end_text_arena(), so that an
+ * outer arena ends properly even if an error skipped an inner end.
+ * Try blocks and continuations also return to the depth they were
+ * entered at, so an error raised by a parser doesn't leave its arena
+ * in effect.
+ * @code
+ *	int arena = muse_begin_text_arena(env);
+ *	...
+ *	muse_end_text_arena(env, arena);
+ * @endcode
+ */
+int muse_begin_text_arena( muse_env *env )
+{
+	return env->text_storage.arena_depth++;
+}
+
+/**
+ * @see muse_begin_text_arena()
+ */
+void muse_end_text_arena( muse_env *env, int depth )
+{
+	env->text_storage.arena_depth = depth;
+}
+
+/**
+ * Releases all text storage. All text cells must have been
+ * finalized by the time this is called.
+ */
+void muse_destroy_text_storage( muse_env *env )
+{
+	muse_text_storage_t *ts = &env->text_storage;
+	int k;
+
+	for ( k = 0; k < MUSE_NUM_TEXT_SIZE_CLASSES; ++k )
+	{
+		muse_text_chunk_t *c = ts->class_chunks[k];
+
+		while ( c )
+		{
+			muse_text_chunk_t *next = c->next;
+			free(c);
+			c = next;
+		}
+
+		ts->class_chunks[k] = NULL;
+		ts->free_blocks[k] = NULL;
+	}
+
+	free( ts->arena_chunk );
+	ts->arena_chunk = NULL;
+	ts->arena_depth = 0;
+}
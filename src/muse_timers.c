@@ -0,0 +1,157 @@
+/**
+ * @file muse_timers.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * The deadlines of an environment - timeouts of waiting processes,
+ * of \ref fn_with_timeout_us "with-timeout-us" blocks and of network waits.
+ * They are kept in a binary min-heap so that scheduling and cancelling
+ * a timer take logarithmic time and finding that nothing has expired
+ * takes constant time, however many processes there are.
+ */
+
+#include "muse_opcodes.h"
+#include <stdlib.h>
+
+static void set_timer( muse_timers_t *t, int i, muse_timer_t *timer )
+{
+	t->heap[i] = timer;
+	timer->index = i + 1;
+}
+
+static void sift_up( muse_timers_t *t, int i )
+{
+	muse_timer_t *timer = t->heap[i];
+
+	while ( i > 0 )
+	{
+		int parent = (i - 1) / 2;
+		if ( t->heap[parent]->deadline_us <= timer->deadline_us )
+			break;
+		set_timer( t, i, t->heap[parent] );
+		i = parent;
+	}
+
+	set_timer( t, i, timer );
+}
+
+static void sift_down( muse_timers_t *t, int i )
+{
+	muse_timer_t *timer = t->heap[i];
+
+	for ( ;; )
+	{
+		int child = 2 * i + 1;
+
+		if ( child >= t->count )
+			break;
+		if ( child + 1 < t->count && t->heap[child + 1]->deadline_us < t->heap[child]->deadline_us )
+			++child;
+		if ( timer->deadline_us <= t->heap[child]->deadline_us )
+			break;
+
+		set_timer( t, i, t->heap[child] );
+		i = child;
+	}
+
+	set_timer( t, i, timer );
+}
+
+/**
+ * Schedules the timer to expire at \p deadline_us on the environment's
+ * timer, i.e. when muse_elapsed_us(env->timer) reaches it. A timer that is
+ * already scheduled is moved to the new deadline.
+ */
+void muse_schedule_timer( muse_env *env, muse_timer_t *timer, muse_int deadline_us )
+{
+	muse_timers_t *t = &env->timers;
+
+	timer->deadline_us = deadline_us;
+
+	if ( timer->index )
+	{
+		sift_up( t, timer->index - 1 );
+		sift_down( t, timer->index - 1 );
+		return;
+	}
+
+	if ( t->count >= t->capacity )
+	{
+		t->capacity = t->capacity ? 2 * t->capacity : 16;
+		t->heap = (muse_timer_t**)realloc( t->heap, t->capacity * sizeof(muse_timer_t*) );
+	}
+
+	t->heap[t->count++] = timer;
+	sift_up( t, t->count - 1 );
+}
+
+/**
+ * Unschedules the timer if it is scheduled.
+ */
+void muse_cancel_timer( muse_env *env, muse_timer_t *timer )
+{
+	muse_timers_t *t = &env->timers;
+	int i = timer->index - 1;
+	muse_timer_t *last;
+
+	if ( i < 0 )
+		return;
+
+	muse_assert( t->heap[i] == timer );
+
+	timer->index = 0;
+	last = t->heap[--t->count];
+
+	if ( last != timer )
+	{
+		set_timer( t, i, last );
+		sift_up( t, i );
+		sift_down( t, last->index - 1 );
+	}
+}
+
+/**
+ * Calls the expire function of every timer whose deadline has passed,
+ * earliest first. Returns MUSE_TRUE if any timer expired.
+ */
+muse_boolean muse_expire_timers( muse_env *env )
+{
+	muse_timers_t *t = &env->timers;
+	muse_boolean expired = MUSE_FALSE;
+
+	if ( t->count > 0 )
+	{
+		muse_int now_us = muse_elapsed_us(env->timer);
+
+		while ( t->count > 0 && t->heap[0]->deadline_us <= now_us )
+		{
+			muse_timer_t *timer = t->heap[0];
+			muse_cancel_timer( env, timer );
+			timer->expire( env, timer );
+			expired = MUSE_TRUE;
+		}
+	}
+
+	return expired;
+}
+
+/**
+ * Returns the earliest deadline of all scheduled timers,
+ * or -1 if there are none.
+ */
+muse_int muse_next_deadline_us( muse_env *env )
+{
+	return env->timers.count > 0 ? env->timers.heap[0]->deadline_us : -1;
+}
+
+void muse_destroy_timers( muse_env *env )
+{
+	free( env->timers.heap );
+	env->timers.heap = NULL;
+	env->timers.count = env->timers.capacity = 0;
+}
@@ -237,8 +237,9 @@ static void com_unprepare_args( muse_env *env, com_object_t *obj, int n )
 			// and allocating a muSE one for the cell.
 			BSTR *pbstrVal = (obj->argv[i].pbstrVal);
 			size_t len = wcslen( *pbstrVal );
-			muse_char *copy = (muse_char*)calloc( len+1, sizeof(muse_char) );
+			muse_char *copy = muse_text_alloc( env, (int)len );
 			memcpy( copy, *pbstrVal, len * sizeof(muse_char) );
+			copy[len] = 0;
 			SysFreeString(*pbstrVal);
 			pbstrVal[0] = copy;
 			pbstrVal[1] = copy + len;
@@ -501,7 +502,7 @@ static void cell2variant( muse_env *env, muse_cell cell, VARIANT *var )
 					break;
 				case MUSE_TEXT_CELL:
 					var->vt = VT_BYREF | VT_BSTR;
-					free( _ptr(outcell)->text.start );
+					muse_text_free( env, _ptr(outcell)->text.start );
 					_ptr(outcell)->text.start = NULL;
 					_ptr(outcell)->text.end = NULL;
 					var->pbstrVal = &(_ptr(outcell)->text.start);
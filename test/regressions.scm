@@ -0,0 +1,490 @@
+; Regression checks for the muSE interpreter.
+;
+; Each check evaluates an expression and compares the result against
+; the expected value with =. Failed checks are printed as FAIL
+; lines and the run ends with a "failures: N" line. Run it with
+;
+;   muse regressions.scm --run
+;
+; build/posix/test runs it under each garbage collector setup, which it
+; picks with the MUSE_PARAMETERS environment variable.
+
+(define test-failures (vector 0))
+
+(define (check name expected actual)
+  (if (= expected actual)
+      ()
+      (do (print "FAIL" name "expected" expected "got" actual)
+          (test-failures 0 (+ (test-failures 0) 1)))))
+
+; Gives the symbol of the error that calling thunk raises, or () if it
+; doesn't raise one.
+(define (raised thunk)
+  (try (do (thunk) ()) (fn (resume err . info) err)))
+
+; A define inside a function that takes no arguments is local to the
+; function, even when the function's body is compiled and never
+; refers to "it".
+(define x 1)
+(define (define-local) (define x 2) x)
+(check 'define-in-thunk-result 2 (define-local))
+(check 'define-in-thunk-global 1 x)
+
+; A lazy mapped list maps each item once, however many times it is
+; walked and however many lists are built on it.
+(define map-calls (vector 0))
+(define (counted-square x) (map-calls 0 (+ 1 (map-calls 0))) (* x x))
+(define squares (map counted-square '(1 2 3 4 5)))
+(define squares+1 (map (fn (x) (+ x 1)) squares))
+(check 'lazy-map-sum 55 (reduce + 0 squares))
+(check 'lazy-map-sum-again 55 (reduce + 0 squares))
+(check 'lazy-map-chained 60 (reduce + 0 squares+1))
+(check 'lazy-map-calls 5 (map-calls 0))
+
+; get works on persistent maps, including deep lookups.
+(define pm (pmap-assoc (pmap '((a . 1))) 'inner (pmap '((b . 2)))))
+(check 'pmap-get 1 (get pm 'a))
+(check 'pmap-get-deep 2 (get pm 'inner 'b))
+(check 'pmap-get-missing () (get pm 'c))
+
+; memoize checks its arguments.
+(check 'memoize-non-function 'error:function-expected (raised (fn () (memoize 1))))
+(check 'memoize-zero-capacity 'error:positive-integer-expected (raised (fn () (memoize first 0))))
+(check 'memoize-negative-capacity 'error:positive-integer-expected (raised (fn () (memoize first -5))))
+(define memo-square (memoize (fn (x) (* x x)) 2))
+(check 'memoize-result 9 (memo-square 3))
+(check 'memoize-hit 9 (memo-square 3))
+(check 'memoize-hits 1 (get (memoize-stats memo-square) 'hits))
+
+; i64vector arithmetic wraps around at 64 bits, and floats out of the
+; range of 64-bit integers are limited to it when stored.
+(define i64-max 9223372036854775807)
+(define i64-min (- 0 i64-max 1))
+(check 'i64-add-wraps i64-min ((numvector+ (i64vector i64-max) 1) 0))
+(check 'i64-sub-wraps i64-max ((numvector- (i64vector i64-min) 1) 0))
+(check 'i64-mul-wraps -2 ((numvector* (i64vector i64-max) 2) 0))
+(check 'i64-sum-wraps -2 (numvector-sum (i64vector i64-max i64-max)))
+(check 'i64-dot-wraps 1 (numvector-dot (i64vector i64-max) (i64vector i64-max)))
+(check 'i64-store-big-float i64-max ((i64vector 1e30) 0))
+(check 'i64-store-small-float i64-min ((i64vector -1e30) 0))
+(check 'i64-store-nan 0 ((i64vector (/ 0.0 0.0)) 0))
+
+; Files the checks below make go in the temp folder.
+(define (temp-path name) (format (temp-folder) "muse-regressions-" name))
+(define (write-file path . texts)
+  (let ((port (open-file path 'for-writing)))
+    (apply print (cons port texts))
+    (close port)))
+(define (read-from path reader)
+  (let ((port (open-file path 'for-reading)))
+    (let ((result (reader port)))
+      (close port)
+      result)))
+
+; A module whose body is the rest of its file is cached with its body,
+; and loads from the cache the second time around. It is first loaded
+; with another stamp, so that the cache holds something else to start
+; with and the module gets recorded afresh on every run.
+(define module-loads (vector 0))
+(define (note-module-load) (module-loads 0 (+ 1 (module-loads 0))))
+(define module-source (temp-path "module.scm"))
+(define (write-module stamp)
+  (write-file module-source
+              "(module ImageMod (stamp twice))"
+              "(define stamp" stamp ")"
+              "(define (twice x) (* 2 x))"
+              "(note-module-load)"))
+(define *module-cache* (temp-path "cache"))
+(write-module 1)
+(check 'module-cache-load () (raised (fn () (load module-source))))
+(write-module 2)
+(check 'module-cache-first-load () (raised (fn () (load module-source))))
+(load module-source)
+(set! *module-cache* ())
+(check 'module-cache-body-runs 3 (module-loads 0))
+(check 'module-cache-stamp 2 ImageMod.stamp)
+(check 'module-cache-function 42 (ImageMod.twice 21))
+
+; compile-file saves the body of such a module along with it, whether
+; or not it evaluates what it reads.
+(define module-image (temp-path "module.img"))
+(check 'compile-module-eval 4 (compile-file module-source module-image T))
+(load module-image)
+(check 'compile-module-eval-body-runs 5 (module-loads 0))
+(check 'compile-module-eval-function 42 (ImageMod.twice 21))
+(check 'compile-module 4 (compile-file module-source module-image))
+(load module-image)
+(check 'compile-module-body-runs 6 (module-loads 0))
+(check 'compile-module-stamp 2 ImageMod.stamp)
+
+; Vectors and hashtables that braces read into are saved by their contents.
+(define loaded (mk-hashtable))
+(define (note key value) (loaded key value))
+(define literals-source (temp-path "literals.scm"))
+(define literals-image (temp-path "literals.img"))
+(write-file literals-source
+            "(note 'vector {vector 1 'two \"three\" 4.5})"
+            "(note 'table {hashtable '((a . 1) (b . (2 3)))})")
+(check 'compile-literals 2 (compile-file literals-source literals-image))
+(load literals-image)
+(check 'compile-literals-vector "three" ((loaded 'vector) 2))
+(check 'compile-literals-vector-length 4 (length (loaded 'vector)))
+(check 'compile-literals-table '(2 3) ((loaded 'table) 'b))
+
+; A file that makes its own macros compiles only when evaluated, and
+; then saves the builtin functions that the macros expand into.
+(define macro-source (temp-path "macro.scm"))
+(define macro-image (temp-path "macro.img"))
+(write-file macro-source
+            "(module MacroMod (result))"
+            "(define twice-of (fn '(x) (list * 2 x)))"
+            "(define result (twice-of 21))")
+(check 'compile-macro 'error:not-compilable (raised (fn () (compile-file macro-source (temp-path "unmade.img")))))
+(check 'compile-macro-no-image () (list-files (temp-path "unmade.img*")))
+(check 'compile-macro-eval 3 (compile-file macro-source macro-image T))
+(load macro-image)
+(check 'compile-macro-result 42 MacroMod.result)
+
+; A failed compile leaves the image file as it was, and no partly
+; written file behind.
+(write-file literals-source "(note 'vector {fn (x) x})")
+(check 'compile-closure 'error:not-compilable (raised (fn () (compile-file literals-source literals-image))))
+(note 'vector ())
+(load literals-image)
+(check 'compile-failed-keeps-image 4.5 ((loaded 'vector) 3))
+(check 'compile-failed-no-part () (list-files (format literals-image ".*")))
+
+; A snapshot of some definitions loads into a fresh environment with
+; their shared structure still shared, and loading it again here puts
+; back values changed since it was saved.
+(define snap-path (temp-path "snapshot.img"))
+(define snap-vector (vector 1 "two" 'three))
+(define snap-pair (list snap-vector snap-vector))
+(define snap-triple (fn (x) (* x 3)))
+(define snap-table (hashtable '((a . 1) (b . "bee"))))
+(module SnapMod (twice) (define (twice x) (* 2 x)))
+(check 'snapshot-save 5 (save-snapshot snap-path '(snap-vector snap-pair snap-triple snap-table SnapMod)))
+(define snap-worker
+  (spawn-worker (list 'do (list 'load snap-path)
+                      '((first snap-pair) 0 'shared)
+                      '((worker-parent) (snap-triple 14) (snap-vector 1) (snap-table 'b)
+                                        ((get SnapMod 'twice) 4) ((first (rest snap-pair)) 0)))))
+(define snap-reply (receive snap-worker 10000000))
+(check 'snapshot-worker '(42 "two" "bee" 8 shared) (rest snap-reply))
+(snap-vector 1 "changed")
+(load snap-path)
+(check 'snapshot-reload "two" (snap-vector 1))
+((first snap-pair) 2 'reloaded)
+(check 'snapshot-reload-shared 'reloaded (snap-vector 2))
+(check 'snapshot-reload-closure 15 (snap-triple 5))
+
+; Compiled regexps come from a cache of recently used patterns. A
+; regexp made before the cache has moved on to other patterns still
+; works, and bad patterns and inputs raise errors.
+(define rx-kept (regexp "a+(b)"))
+(define (rx-churn i)
+  (if (< i 100)
+      (do (regexp-search (format "x" i "y") "x5y")
+          (rx-churn (+ i 1)))
+      ()))
+(rx-churn 0)
+(check 'regexp-kept "b" ((regexp-search rx-kept "caaab") 1))
+(check 'regexp-text-pattern "aab" ((regexp-search "a+b" "caab") 0))
+(check 'regexp-bad-pattern 'error:bad-regexp (raised (fn () (regexp "a("))))
+(check 'regexp-not-pattern 'error:regexp-expected (raised (fn () (regexp-search 42 "a"))))
+
+; Ports and bytes are matched a line at a time. A search continues
+; from the line after the previous match, and replacing writes every
+; line to the output port.
+(define rx-source (temp-path "lines.txt"))
+(let ((port (open-file rx-source 'for-writing)))
+  (for-each '("INFO start" "ERROR disk 1" "INFO step" "ERROR net 2" "INFO end")
+            (fn (line) (print port line)))
+  (close port))
+(define rx-in (open-file rx-source 'for-reading))
+(check 'regexp-port-first "1" ((regexp-search "ERROR [a-z]+ ([0-9])" rx-in) 1))
+(check 'regexp-port-next "2" ((regexp-search "ERROR [a-z]+ ([0-9])" rx-in) 1))
+(check 'regexp-port-end () (regexp-search "ERROR [a-z]+ ([0-9])" rx-in))
+(close rx-in)
+(check 'regexp-bytes "ERROR x 7" ((regexp-match "ERROR.*" (string->bytes "INFO a
+ERROR x 7
+INFO b")) 0))
+(define rx-output (temp-path "lines-out.txt"))
+(set! rx-in (open-file rx-source 'for-reading))
+(define rx-out (open-file rx-output 'for-writing))
+(check 'regexp-port-replace 5 (regexp-replace "ERROR" "FAIL" rx-in rx-out))
+(close rx-out)
+(close rx-in)
+(check 'regexp-port-replaced "FAIL disk 1" (read-from rx-output (fn (port) (read-line port) (read-line port))))
+
+; Each process has its own values for symbols, whether or not it
+; shares the main process' locals. Processes set the same symbols to
+; values of their own and yield before reading them back, while the
+; main process interns more symbols under their feet.
+(define (local-symbol j) (symbol (format "process-local-" j)))
+(define (local-set n j)
+  (if (< j 50)
+      (do (eval (list set! (local-symbol j) (+ n j)))
+          (local-set n (+ j 1)))
+      ()))
+(define (local-intact? n j)
+  (if (< j 50)
+      (if (= (+ n j) (eval (local-symbol j)))
+          (local-intact? n (+ j 1))
+          j)
+      T))
+(define (local-definitions name j)
+  (if (< j 50)
+      (cons (format "(define " name j " " j ")") (local-definitions name (+ j 1)))
+      ()))
+(define local-source (temp-path "locals.scm"))
+(apply write-file (cons local-source (local-definitions "process-local-" 0)))
+(load local-source)
+(define (spawn-setters parent n)
+  (if (> n 0)
+      (cons (spawn (fn ()
+                     (receive 'go)
+                     (local-set n 0)
+                     (receive 1000)
+                     (parent 'setter (local-intact? n 0))))
+            (spawn-setters parent (- n 1)))
+      ()))
+(define local-setters (spawn-setters (this-process) 20))
+(apply write-file (cons local-source (local-definitions "process-late-" 0)))
+(load local-source)
+(for-each local-setters (fn (pid) (pid 'go)))
+(define (count-setters k ok)
+  (if (< k 20)
+      (let ((m (receive 'setter 10000000)))
+        (count-setters (+ k 1) (if (and m (= T (first (rest (rest m))))) (+ ok 1) ok)))
+      ok))
+(check 'process-locals 20 (count-setters 0 0))
+(check 'process-locals-main T (local-intact? 0 0))
+(check 'process-locals-late 49 process-late-49)
+
+; Processes blocked on sockets let the others run. An echo server
+; serves each connection in a process of its own, and the clients
+; pause between the two halves of their requests, so that all the
+; connections are open at once.
+(define net-port 47823)
+(define (net-serve port)
+  (let ((first-half (read port)))
+    (let ((second-half (read port)))
+      (write port (list 'echo first-half second-half))
+      (flush port)
+      (close port))))
+(define (net-accept port client)
+  (let ((request (read port)))
+    (if (= request 'quit)
+        (do (close port) ())
+        (do (spawn (fn () (write port request) (net-serve port))) T))))
+(define (net-server parent)
+  (fn ()
+    (with-incoming-connections-to-port (format "127.0.0.1:" net-port)
+      net-accept
+      (fn () (parent 'listening)))
+    (parent 'server-done)))
+(define (net-request message)
+  (let ((port (open-connection "127.0.0.1" net-port)))
+    (write port message)
+    (flush port)
+    port))
+(define (net-client parent k)
+  (fn ()
+    (let ((port (net-request 'hello)))
+      (write port k)
+      (flush port)
+      (run 20000)
+      (write port (* k k))
+      (flush port)
+      (let ((greeting (read port)))
+        (let (((tag first-half second-half) (read port)))
+          (close port)
+          (parent 'net-client (and (= greeting 'hello) (= tag 'echo)
+                                   (= first-half k) (= second-half (* k k)))))))))
+(define (net-spawn-clients k)
+  (if (< k 5)
+      (do (spawn (net-client (this-process) k))
+          (net-spawn-clients (+ k 1)))
+      ()))
+(define (net-await-clients k ok)
+  (if (< k 5)
+      (let ((m (receive 'net-client 10000000)))
+        (net-await-clients (+ k 1) (if (and m (= T (first (rest (rest m))))) (+ ok 1) ok)))
+      ok))
+(spawn (net-server (this-process)))
+(check 'net-listening T (if (receive 'listening 10000000) T ()))
+(net-spawn-clients 0)
+(check 'net-echo 5 (net-await-clients 0 0))
+(close (net-request 'quit))
+(check 'net-server-done T (if (receive 'server-done 10000000) T ()))
+
+; Finalizers run for each kind of garbage, once there has been a
+; collection however big the heap is, and never for what is still in
+; use.
+(define (finalized kind)
+  (let ((entry (assoc (finalizer-stats) kind)))
+    (if entry (first (rest entry)) 0)))
+(define fin-kinds '(text vect hash destructor))
+(define fin-before (list (finalized 'text) (finalized 'vect) (finalized 'hash) (finalized 'destructor)))
+(define fin-kept (mk-vector 100))
+(define (fin-keep i)
+  (if (< i 100)
+      (do (fin-kept i (let ((h (mk-hashtable))) (h 'n (format i)) h))
+          (fin-keep (+ i 1)))
+      ()))
+(define (fin-churn n)
+  (if (> n 0)
+      (do (format "text-" n)
+          (vector n n)
+          (let ((h (mk-hashtable))) (h 'n n))
+          (raised (fn () (raise 'error:churn)))
+          (fin-churn (- n 1)))
+      ()))
+(define (fin-grown kinds before)
+  (if kinds
+      (if (> (finalized (first kinds)) (first before))
+          (fin-grown (rest kinds) (rest before))
+          (first kinds))
+      T))
+(define (fin-kept-intact? i)
+  (if (< i 100)
+      (if (= (format i) ((fin-kept i) 'n))
+          (fin-kept-intact? (+ i 1))
+          i)
+      T))
+(define (fin-churn-until-finalized tries)
+  (fin-churn 5000)
+  (if (or (= T (fin-grown fin-kinds fin-before)) (= tries 1))
+      (fin-grown fin-kinds fin-before)
+      (fin-churn-until-finalized (- tries 1))))
+(fin-keep 0)
+(check 'finalizers-run T (fin-churn-until-finalized 40))
+(check 'finalizers-spare-live T (fin-kept-intact? 0))
+
+; Texts of every size keep their contents through collections, whether
+; made directly or by a parser in a text arena. Only some of the parsed
+; texts are kept, so that their arena chunks hold both live and dead
+; texts, and a parse error mustn't leave an arena in effect.
+(define (text-rep i k acc) (if (> k 0) (text-rep i (- k 1) (format acc i "-")) acc))
+(define (text-of i) (text-rep i (% i 40) ""))
+(define text-source (temp-path "texts.json"))
+(define (text-fill v i)
+  (if (< i (length v))
+      (do (v i (text-of i))
+          (text-fill v (+ i 1)))
+      v))
+(define text-kept (mk-vector 11))
+(define (text-keep v j)
+  (if (< j 10)
+      (do (text-kept j (v (* j 50)))
+          (text-keep v (+ j 1)))
+      ()))
+(define (text-kept-intact? j)
+  (if (< j 10)
+      (if (= (text-of (* j 50)) (text-kept j))
+          (text-kept-intact? (+ j 1))
+          j)
+      T))
+(let ((port (open-file text-source 'for-writing)))
+  (write-json port (text-fill (mk-vector 500) 0))
+  (close port))
+(text-keep (read-from text-source read-json) 0)
+(write-file text-source "[\"a\", \"b\", ")
+(check 'text-parse-error 'json:unexpected-end-of-stream (raised (fn () (read-from text-source read-json))))
+(text-kept 10 (text-of 39))
+(write-file text-source "<doc><item name=\"a1\">first</item><item name=\"b2\">second</item></doc>")
+(define text-xml ((read-from text-source read-xml) ()))
+(define (last-collection) (get (first (gc-stats 1)) 'time-us))
+(define (churn-through-collection since tries)
+  (fin-churn 5000)
+  (if (and (= since (last-collection)) (> tries 1))
+      (churn-through-collection since (- tries 1))
+      ()))
+(churn-through-collection (last-collection) 40)
+(check 'text-parsed-intact T (text-kept-intact? 0))
+(check 'text-after-parse-error (text-of 39) (text-kept 10))
+(check 'text-xml-intact "a1 first b2 second"
+       (let (((doc attrs (item1 ((name1 . a1)) c1) (item2 ((name2 . a2)) c2)) text-xml))
+         (format a1 " " c1 " " a2 " " c2)))
+
+; Garbage collection keeps everything reachable, whichever collector
+; the run is set up with. Cells stored into old structures during
+; churn must survive minor and incremental collections, and a heap
+; that grew for a big structure may shrink back once it is dropped.
+; The big structure is only ever a recent value inside gc-big-length,
+; so it is garbage once that returns.
+(define gc-old (mk-vector 1000))
+(define (gc-store i) (gc-old i (list i (format "item-" i) (vector i (* i i)))))
+(define (gc-fill i)
+  (if (< i 1000)
+      (do (gc-store i)
+          (gc-fill (+ i 1)))
+      ()))
+(define (gc-churn n)
+  (if (> n 0)
+      (do (gc-store (% n 1000))
+          (list n n n)
+          (gc-churn (- n 1)))
+      ()))
+(define (gc-intact? i)
+  (if (< i 1000)
+      (let (((n text squares) (gc-old i)))
+        (if (and (= i n)
+                 (= (format "item-" i) text)
+                 (= (* i i) (squares 1)))
+            (gc-intact? (+ i 1))
+            i))
+      T))
+(define (gc-build n acc) (if (> n 0) (gc-build (- n 1) (cons (list n) acc)) acc))
+(define (gc-big-length n)
+  (gc-build n ())
+  (length (the gc-build)))
+(define (gc-run)
+  (gc-fill 0)
+  (gc-churn 100000)
+  (check 'gc-old-to-young T (gc-intact? 0))
+  (check 'gc-big-structure 300000 (gc-big-length 300000))
+  (gc-churn 300000)
+  (check 'gc-after-big-structure T (gc-intact? 0)))
+(gc-run)
+
+; Collections keep up with processes that switch in the middle of
+; them. Each process churns through its own share of the slots, and
+; tells the main process when it is done.
+(define (gc-worker-churn k n)
+  (if (> n 0)
+      (do (gc-store (+ k (* 4 (% n 250))))
+          (gc-worker-churn k (- n 1)))
+      ()))
+(define (gc-worker parent k)
+  (fn ()
+    (gc-worker-churn k 50000)
+    (parent 'gc-done k)))
+(define (gc-spawn-workers k)
+  (if (< k 4)
+      (do (spawn (gc-worker (this-process) k))
+          (gc-spawn-workers (+ k 1)))
+      ()))
+(define (gc-await-workers k)
+  (if (and (< k 4) (receive 'gc-done 10000000))
+      (gc-await-workers (+ k 1))
+      k))
+(gc-spawn-workers 0)
+(check 'gc-processes-done 4 (gc-await-workers 0))
+(check 'gc-processes-intact T (gc-intact? 0))
+
+; The kinds of collection and heap resizing that happened so far, for
+; build/posix/test to check.
+(define (gc-add-kinds events kinds)
+  (if events
+      (gc-add-kinds (rest events)
+                    (let ((k (get (first events) 'kind)))
+                      (if (find k kinds) kinds (cons k kinds))))
+      kinds))
+(define gc-kinds (gc-add-kinds (gc-stats) ()))
+
+(define (main)
+  (print "collections:" gc-kinds)
+  (print "failures:" (test-failures 0))
+  (exit))